@@ -113,6 +113,7 @@ struct output {
 #define TS_PAYLOAD_SIZE                 1316
 #define MAX_GAP                         (UCLOCK_FREQ)
 #define DEFAULT_TIME_LIMIT              (UCLOCK_FREQ * 10)
+#define PREFETCH_SIZE                   (64 * 1024 * 1024)
 
 /** 2^33 (max resolution of PCR, PTS and DTS) */
 #define POW2_33 UINT64_C(8589934592)
@@ -126,6 +127,7 @@ static const char *url = NULL;
 static const char *addr = "127.0.0.1";
 static const char *dump = NULL;
 static const char *user_agent = "hls2rtp/1.0";
+static unsigned int prefetch = 0;
 static struct output video_output = {
     .port = 5004,
     .rtp_type = 96,
@@ -679,6 +681,12 @@ static int catch_playlist(struct uprobe *uprobe,
     case UPROBE_HLS_PLAYLIST_RELOADED: {
         UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_PLAYLIST_SIGNATURE);
         uprobe_notice(uprobe, NULL, "playlist reloaded");
+        if (prefetch) {
+            ret = upipe_hls_playlist_set_prefetch(upipe, prefetch,
+                                                  PREFETCH_SIZE);
+            if (!ubase_check(ret))
+                uprobe_warn(uprobe, NULL, "unable to set prefetch");
+        }
         uint64_t at = probe_playlist->at;
         if (at) {
             uint64_t remain = 0;
@@ -1287,6 +1295,7 @@ enum opt {
     OPT_DELAY,
     OPT_QUIT_TIMEOUT,
     OPT_USER_AGENT,
+    OPT_PREFETCH,
 #ifdef UPIPE_HAVE_BEARSSL_H
     OPT_USE_BEARSSL,
 #endif
@@ -1323,6 +1332,7 @@ static struct option options[] = {
     { "delay", required_argument, NULL, OPT_DELAY },
     { "quit-timeout", required_argument, NULL, OPT_QUIT_TIMEOUT },
     { "user-agent", required_argument, NULL, OPT_USER_AGENT },
+    { "prefetch", required_argument, NULL, OPT_PREFETCH },
 #ifdef UPIPE_HAVE_BEARSSL_H
     { "use-bearssl", no_argument, NULL, OPT_USE_BEARSSL },
 #endif
@@ -1472,6 +1482,9 @@ int main(int argc, char **argv)
         case OPT_USER_AGENT:
             user_agent = optarg;
             break;
+        case OPT_PREFETCH:
+            prefetch = strtoul(optarg, NULL, 10);
+            break;
 
         case OPT_HELP:
             return usage(argv[0], NULL);
@@ -65,6 +65,7 @@
 #include "upipe-dvbcsa/upipe_dvbcsa_decrypt.h"
 #include "upipe-dvbcsa/upipe_dvbcsa_common.h"
 #include "upipe-dvbcsa/upipe_dvbcsa_split.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_pool.h"
 
 #include "upipe-pthread/uprobe_pthread_upump_mgr.h"
 #include "upipe-pthread/upipe_pthread_transfer.h"
@@ -100,6 +101,7 @@ enum {
     OPT_RSAFILE = 'c',
     OPT_RT_PRIORITY = 'i',
     OPT_SYSLOG_TAG = 'l',
+    OPT_THREADS = 'T',
 };
 
 struct uprobe_dvbcsa_split {
@@ -168,6 +170,7 @@ static void usage(const char *name)
             "\t-k   : set BISS key (use twice for odd key)\n"
             "\t-c   : set RSA private key file\n"
             "\t-L   : set the maximum latency in milliseconds\n"
+            "\t-T   : number of worker threads (requires -L)\n"
             "\t-i   : RT priority for source and sink\n"
             "\t-D   : decrypt instead of encrypt\n"
             "\t-U   : UDP rather than RTP\n",
@@ -203,10 +206,11 @@ int main(int argc, char *argv[])
     bool udp = false;
     const char *key[2] = { NULL, NULL };
     int latency = -1;
+    unsigned int nb_threads = 0;
     const char *private_key = NULL;
     int c;
 
-    while ((c = getopt(argc, argv, "c:vbk:L:i:DUl:")) != -1) {
+    while ((c = getopt(argc, argv, "c:vbk:L:i:DUl:T:")) != -1) {
         switch (c) {
             case OPT_DEBUG:
                 if (log_level == UPROBE_LOG_DEBUG)
@@ -249,6 +253,9 @@ int main(int argc, char *argv[])
             case OPT_RT_PRIORITY:
                 rt_priority = atoi(optarg);
                 break;
+            case OPT_THREADS:
+                nb_threads = atoi(optarg);
+                break;
             case OPT_DECRYPT:
                 decryption = true;
                 break;
@@ -269,6 +276,12 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    if (nb_threads && latency < 0) {
+        fprintf(stderr, "worker threads require a maximum latency\n");
+        usage(argv[0]);
+        exit(-1);
+    }
+
 #ifdef UPIPE_HAVE_GCRYPT_H
     gcry_check_version(NULL);
     gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
@@ -474,6 +487,12 @@ int main(int argc, char *argv[])
     upipe_mgr_release(upipe_dvbcsa_mgr);
     if (key[0])
         ubase_assert(upipe_dvbcsa_set_key(output, key[0], key[1]));
+    if (nb_threads) {
+        struct upipe_dvbcsa_pool *pool = upipe_dvbcsa_pool_alloc(nb_threads);
+        assert(pool);
+        ubase_assert(upipe_dvbcsa_set_pool(output, pool));
+        upipe_dvbcsa_pool_release(pool);
+    }
     uprobe_dvbcsa_split.dvbcsa = output;
 
     struct upipe_mgr *upipe_agg_mgr = upipe_agg_mgr_alloc();
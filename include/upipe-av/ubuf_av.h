@@ -48,6 +48,16 @@ enum ubuf_av_command {
     UBUF_AV_GET_AVFRAME
 };
 
+/** @This extends ubuf_mgr_command with specific commands for AVFrame
+ * buffer managers. */
+enum ubuf_av_mgr_command {
+    UBUF_AV_MGR_SENTINEL = UBUF_MGR_CONTROL_LOCAL,
+
+    /** returns the number of plane copies done by the manager
+     * (uint64_t *) */
+    UBUF_AV_MGR_GET_COPIES,
+};
+
 /** @This allocates an ubuf for a picture AVFrame.
  *
  * @param ubuf_mgr pointer to AVFrame ubuf manager
@@ -84,6 +94,22 @@ static inline int ubuf_av_get_avframe(struct ubuf *ubuf, AVFrame *frame)
     return ubuf_control(ubuf, UBUF_AV_GET_AVFRAME, UBUF_AV_SIGNATURE, frame);
 }
 
+/** @This returns the number of plane copies done by the buffers of an
+ * AVFrame buffer manager since its allocation. Buffers are normally mapped
+ * without any copy, but planes with a negative linesize and hardware frames
+ * that cannot be mapped must be copied to system memory.
+ *
+ * @param mgr pointer to AVFrame ubuf manager
+ * @param copies_p filled with the number of plane copies
+ * @return an error code
+ */
+static inline int ubuf_av_mgr_get_copies(struct ubuf_mgr *mgr,
+                                         uint64_t *copies_p)
+{
+    return ubuf_mgr_control(mgr, UBUF_AV_MGR_GET_COPIES,
+                            UBUF_AV_SIGNATURE, copies_p);
+}
+
 /** @This allocates and initializes an AVFrame buffer manager.
  *
  * @return a pointer to an ubuf manager
@@ -45,6 +45,17 @@ enum upipe_avcdec_command {
 
     /** set hardware config (const char *, const char *) */
     UPIPE_AVCDEC_SET_HW_CONFIG,
+    /** set decoding threads (unsigned int, unsigned int) */
+    UPIPE_AVCDEC_SET_THREADS,
+};
+
+/** @This defines the threading methods of the decoder. */
+enum upipe_avcdec_thread_type {
+    /** decode more than one frame at once (adds one frame of latency per
+     * extra thread) */
+    UPIPE_AVCDEC_THREAD_FRAME = 0x1,
+    /** decode more than one part of a single frame at once */
+    UPIPE_AVCDEC_THREAD_SLICE = 0x2,
 };
 
 /** @This sets the hardware accel configuration.
@@ -62,6 +73,30 @@ static inline int upipe_avcdec_set_hw_config(struct upipe *upipe,
                          UPIPE_AVCDEC_SIGNATURE, type, device);
 }
 
+/** @This sets the number of decoding threads and the allowed threading
+ * methods. It must be called before the codec is opened, ie. before the
+ * first packet is input.
+ *
+ * With frame threading, libavcodec already keeps several frames in flight
+ * on its own threads and returns them in order, so the pipe has no output
+ * queue of its own: decoded pictures are output from the pipe thread as
+ * soon as libavcodec releases them. To decouple a slow downstream from the
+ * decoder, run it behind a @ref upipe_xfer or worker pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @param count number of threads, 0 for automatic detection
+ * @param type mask of allowed threading methods
+ * (@ref upipe_avcdec_thread_type)
+ * @return an error code
+ */
+static inline int upipe_avcdec_set_threads(struct upipe *upipe,
+                                           unsigned int count,
+                                           unsigned int type)
+{
+    return upipe_control(upipe, UPIPE_AVCDEC_SET_THREADS,
+                         UPIPE_AVCDEC_SIGNATURE, count, type);
+}
+
 /** @This returns the management structure for all avcodec decode pipes.
  *
  * @return pointer to manager
@@ -98,6 +98,13 @@ enum upipe_avfsink_input_command {
 };
 
 /** @This returns the management structure for all avformat sinks.
+ *
+ * If an output is set on the pipe, the multiplexed stream is output in block
+ * urefs instead of being written to the URI, which is then only used to guess
+ * the format, so that libavformat never blocks the event loop on I/O. The
+ * last block of each file has the end flag set. As the output may not be
+ * rewritten, formats must be configured for non-seekable outputs, for
+ * instance with the "movflags" option for MP4.
  *
  * @return pointer to manager
  */
@@ -47,7 +47,13 @@ enum upipe_avfsrc_command {
      * (uint64_t *) */
     UPIPE_AVFSRC_GET_TIME,
     /** asks to read at the given time (uint64_t) */
-    UPIPE_AVFSRC_SET_TIME
+    UPIPE_AVFSRC_SET_TIME,
+    /** returns the minimum buffered input before demultiplexing, in octets
+     * (uint64_t *) */
+    UPIPE_AVFSRC_GET_READ_AHEAD,
+    /** sets the minimum buffered input before demultiplexing, in octets
+     * (uint64_t) */
+    UPIPE_AVFSRC_SET_READ_AHEAD
 };
 
 /** @deprecated @This returns the content of an avformat option.
@@ -103,7 +109,44 @@ static inline int upipe_avfsrc_set_time(struct upipe *upipe, uint64_t time)
                          time);
 }
 
+/** @This returns the minimum size of the buffered input before the demuxer
+ * is run, when the pipe is fed by an upstream pipe instead of opening an URL.
+ *
+ * @param upipe description structure of the pipe
+ * @param read_ahead_p filled in with the read-ahead size, in octets
+ * @return an error code
+ */
+static inline int upipe_avfsrc_get_read_ahead(struct upipe *upipe,
+                                              uint64_t *read_ahead_p)
+{
+    return upipe_control(upipe, UPIPE_AVFSRC_GET_READ_AHEAD,
+                         UPIPE_AVFSRC_SIGNATURE, read_ahead_p);
+}
+
+/** @This sets the minimum size of the buffered input before the demuxer is
+ * run, when the pipe is fed by an upstream pipe instead of opening an URL.
+ * The input is probed when twice this size is buffered, and the probe does
+ * not read more than this size. The demuxer then runs in a separate thread,
+ * which waits for the input it needs, and the input is held while twice
+ * this size is buffered and not demuxed yet.
+ *
+ * @param upipe description structure of the pipe
+ * @param read_ahead read-ahead size, in octets
+ * @return an error code
+ */
+static inline int upipe_avfsrc_set_read_ahead(struct upipe *upipe,
+                                              uint64_t read_ahead)
+{
+    return upipe_control(upipe, UPIPE_AVFSRC_SET_READ_AHEAD,
+                         UPIPE_AVFSRC_SIGNATURE, read_ahead);
+}
+
 /** @This returns the management structure for all avformat sources.
+ *
+ * Instead of opening an URL with @ref upipe_set_uri, the pipe may also be fed
+ * with block urefs by an upstream pipe (file or HTTP source for instance),
+ * in which case libavformat only performs I/O from the buffered input, in a
+ * separate thread, and never blocks the event loop.
  *
  * @return pointer to manager
  */
@@ -34,6 +34,9 @@ extern "C" {
 #include "upipe/upipe.h"
 #include <dvbcsa/dvbcsa.h>
 
+/** @hidden */
+struct upipe_dvbcsa_pool;
+
 /** @This is the signature for common dvbcsa pipe operations. */
 #define UPIPE_DVBCSA_COMMON_SIGNATURE   UBASE_FOURCC('d','v','b',' ')
 
@@ -51,6 +54,8 @@ enum upipe_dvbcsa_command {
     UPIPE_DVBCSA_ADD_PID,
     /** delete a pid from the encryption/decryption list (uint64_t) */
     UPIPE_DVBCSA_DEL_PID,
+    /** set the worker pool (struct upipe_dvbcsa_pool *) */
+    UPIPE_DVBCSA_SET_POOL,
 
     /** custom dvbcsa commands start here */
     UPIPE_DVBCSA_CONTROL_LOCAL,
@@ -94,6 +99,22 @@ static inline int upipe_dvbcsa_del_pid(struct upipe *upipe,
                          UPIPE_DVBCSA_COMMON_SIGNATURE, pid);
 }
 
+/** @This sets the worker pool running the batches of a bitslice pipe. The
+ * batches are then scrambled or descrambled by the pool threads, and output
+ * in order from the upump manager of the pipe. A NULL pool processes them
+ * again on the pipe thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param pool worker pool, or NULL
+ * @return an error code
+ */
+static inline int upipe_dvbcsa_set_pool(struct upipe *upipe,
+                                        struct upipe_dvbcsa_pool *pool)
+{
+    return upipe_control(upipe, UPIPE_DVBCSA_SET_POOL,
+                         UPIPE_DVBCSA_COMMON_SIGNATURE, pool);
+}
+
 /** @This stores a parsed dvbcsa control word. */
 struct ustring_dvbcsa_cw {
     /** matching part of the string */
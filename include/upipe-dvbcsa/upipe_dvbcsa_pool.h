@@ -0,0 +1,65 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short shared pool of dvbcsa worker threads
+ *
+ * A pool runs the bitslice batches of any number of dvbcsa encryption and
+ * decryption pipes on its own threads. Each pipe gets its batches back in
+ * submission order through an event watcher on its upump manager, see
+ * @ref upipe_dvbcsa_set_pool.
+ */
+
+#ifndef _UPIPE_DVBCSA_UPIPE_DVBCSA_POOL_H_
+/** @hidden */
+#define _UPIPE_DVBCSA_UPIPE_DVBCSA_POOL_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @hidden */
+struct upipe_dvbcsa_pool;
+
+/** @This allocates a pool of dvbcsa worker threads.
+ *
+ * @param nb_threads number of worker threads to start
+ * @return pointer to the pool, or NULL in case of error
+ */
+struct upipe_dvbcsa_pool *upipe_dvbcsa_pool_alloc(unsigned int nb_threads);
+
+/** @This increments the reference count of a pool.
+ *
+ * @param pool pointer to the pool
+ * @return the same pointer to the pool
+ */
+struct upipe_dvbcsa_pool *upipe_dvbcsa_pool_use(struct upipe_dvbcsa_pool *pool);
+
+/** @This decrements the reference count of a pool, and stops its threads
+ * when it reaches 0.
+ *
+ * @param pool pointer to the pool
+ */
+void upipe_dvbcsa_pool_release(struct upipe_dvbcsa_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
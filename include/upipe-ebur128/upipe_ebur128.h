@@ -39,17 +39,57 @@ extern "C" {
 #include <stdint.h>
 
 UREF_ATTR_FLOAT(ebur128, momentary, "ebur128.momentary", momentary loudness)
+UREF_ATTR_FLOAT(ebur128, shortterm, "ebur128.shortterm", short-term loudness)
 UREF_ATTR_FLOAT(ebur128, lra, "ebur128.lra", loudness range)
 UREF_ATTR_FLOAT(ebur128, global, "ebur128.global", global integrated loudness)
 
 #define UPIPE_EBUR128_SIGNATURE UBASE_FOURCC('r', '1', '2', '8')
 
+/** @This extends upipe_command with specific commands for ebur128 pipes. */
+enum upipe_ebur128_command {
+    UPIPE_EBUR128_SENTINEL = UPIPE_CONTROL_LOCAL,
+
+    /** sets the period of loudness range and global loudness (uint64_t) */
+    UPIPE_EBUR128_SET_PERIOD,
+    /** gets the period of loudness range and global loudness (uint64_t *) */
+    UPIPE_EBUR128_GET_PERIOD
+};
+
 /** @This returns the management structure for all avformat sources.
  *
  * @return pointer to manager
  */
 struct upipe_mgr *upipe_ebur128_mgr_alloc(void);
 
+/** @This sets the period at which the loudness range and the global
+ * integrated loudness are computed and attached to the output buffers.
+ * Momentary and short-term loudness are attached to every buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param period period in units of the 27 MHz clock, or 0 for every buffer
+ * @return an error code
+ */
+static inline int upipe_ebur128_set_period(struct upipe *upipe,
+                                           uint64_t period)
+{
+    return upipe_control(upipe, UPIPE_EBUR128_SET_PERIOD,
+                         UPIPE_EBUR128_SIGNATURE, period);
+}
+
+/** @This gets the period at which the loudness range and the global
+ * integrated loudness are computed.
+ *
+ * @param upipe description structure of the pipe
+ * @param period_p filled in with the period in units of the 27 MHz clock
+ * @return an error code
+ */
+static inline int upipe_ebur128_get_period(struct upipe *upipe,
+                                           uint64_t *period_p)
+{
+    return upipe_control(upipe, UPIPE_EBUR128_GET_PERIOD,
+                         UPIPE_EBUR128_SIGNATURE, period_p);
+}
+
 #ifdef __cplusplus
 }
 #endif
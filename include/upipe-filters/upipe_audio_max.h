@@ -37,15 +37,60 @@ extern "C" {
 
 UREF_ATTR_FLOAT_VA(amax, amplitude, "amax.amp[%" PRIu8"]", max amplitude,
         uint8_t plane, plane)
+UREF_ATTR_FLOAT_VA(amax, rms, "amax.rms[%" PRIu8"]", RMS level,
+        uint8_t plane, plane)
+UREF_ATTR_FLOAT_VA(amax, true_peak, "amax.tp[%" PRIu8"]", true peak,
+        uint8_t plane, plane)
 
 #define UPIPE_AUDIO_MAX_SIGNATURE UBASE_FOURCC('a', 'm', 'a', 'x')
 
+/** @This extends upipe_command with specific commands for amax pipes. */
+enum upipe_amax_command {
+    UPIPE_AMAX_SENTINEL = UPIPE_CONTROL_LOCAL,
+
+    /** enables or disables true-peak measurement (int) */
+    UPIPE_AMAX_SET_TRUE_PEAK,
+    /** returns whether true peak is measured (int *) */
+    UPIPE_AMAX_GET_TRUE_PEAK
+};
+
 /** @This returns the management structure for all amax sources.
  *
  * @return pointer to manager
  */
 struct upipe_mgr *upipe_amax_mgr_alloc(void);
 
+/** @This enables or disables the measurement of the true peak, with a 4
+ * times oversampling, which is exported in the true_peak attribute. It is
+ * disabled by default. The u8 format does not support it.
+ *
+ * @param upipe description structure of the pipe
+ * @param enable true to measure the true peak
+ * @return an error code
+ */
+static inline int upipe_amax_set_true_peak(struct upipe *upipe, bool enable)
+{
+    return upipe_control(upipe, UPIPE_AMAX_SET_TRUE_PEAK,
+                         UPIPE_AUDIO_MAX_SIGNATURE, enable ? 1 : 0);
+}
+
+/** @This returns whether the true peak is measured.
+ *
+ * @param upipe description structure of the pipe
+ * @param enable_p filled in with true if the true peak is measured
+ * @return an error code
+ */
+static inline int upipe_amax_get_true_peak(struct upipe *upipe,
+                                           bool *enable_p)
+{
+    int enable;
+    UBASE_RETURN(upipe_control(upipe, UPIPE_AMAX_GET_TRUE_PEAK,
+                               UPIPE_AUDIO_MAX_SIGNATURE, &enable))
+    if (enable_p != NULL)
+        *enable_p = !!enable;
+    return UBASE_ERR_NONE;
+}
+
 #ifdef __cplusplus
 }
 #endif
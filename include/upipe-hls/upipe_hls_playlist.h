@@ -50,6 +50,10 @@ enum upipe_hls_playlist_command {
     UPIPE_HLS_PLAYLIST_NEXT,
     /** seek to this offset (uint64_t) */
     UPIPE_HLS_PLAYLIST_SEEK,
+    /** get the prefetch limits (unsigned int *, uint64_t *) */
+    UPIPE_HLS_PLAYLIST_GET_PREFETCH,
+    /** set the prefetch limits (unsigned int, uint64_t) */
+    UPIPE_HLS_PLAYLIST_SET_PREFETCH,
 };
 
 /** @This converts m3u playlist specific command to a string.
@@ -66,6 +70,8 @@ static inline const char *upipe_hls_playlist_command_str(int cmd)
     UBASE_CASE_TO_STR(UPIPE_HLS_PLAYLIST_PLAY);
     UBASE_CASE_TO_STR(UPIPE_HLS_PLAYLIST_NEXT);
     UBASE_CASE_TO_STR(UPIPE_HLS_PLAYLIST_SEEK);
+    UBASE_CASE_TO_STR(UPIPE_HLS_PLAYLIST_GET_PREFETCH);
+    UBASE_CASE_TO_STR(UPIPE_HLS_PLAYLIST_SET_PREFETCH);
     case UPIPE_HLS_PLAYLIST_SENTINEL: break;
     }
     return NULL;
@@ -135,6 +141,43 @@ static inline int upipe_hls_playlist_seek(struct upipe *upipe, uint64_t at,
                          UPIPE_HLS_PLAYLIST_SIGNATURE, at, offset_p);
 }
 
+/** @This gets the prefetch limits.
+ *
+ * @param upipe description structure of the pipe
+ * @param count_p filled with the maximum number of prefetched segments
+ * @param size_p filled with the maximum size of the prefetched segments
+ * @return an error code
+ */
+static inline int upipe_hls_playlist_get_prefetch(struct upipe *upipe,
+                                                  unsigned int *count_p,
+                                                  uint64_t *size_p)
+{
+    return upipe_control(upipe, UPIPE_HLS_PLAYLIST_GET_PREFETCH,
+                         UPIPE_HLS_PLAYLIST_SIGNATURE, count_p, size_p);
+}
+
+/** @This sets the prefetch limits. When count is not 0, up to count items
+ * following the one being played are downloaded concurrently in a memory
+ * cache, and new downloads are started as long as the cached size is below
+ * size. The size of the segments being downloaded is estimated from their
+ * byte range, or from their duration and the octet rate of the previous
+ * segments; until it is known, only one segment is downloaded ahead. The
+ * items are then played from the cache. Prefetching is disabled by default.
+ *
+ * @param upipe description structure of the pipe
+ * @param count maximum number of prefetched segments, 0 to disable
+ * @param size maximum size of the prefetched segments in octets, UINT64_MAX
+ * for no limit
+ * @return an error code
+ */
+static inline int upipe_hls_playlist_set_prefetch(struct upipe *upipe,
+                                                  unsigned int count,
+                                                  uint64_t size)
+{
+    return upipe_control(upipe, UPIPE_HLS_PLAYLIST_SET_PREFETCH,
+                         UPIPE_HLS_PLAYLIST_SIGNATURE, count, size);
+}
+
 /** @This extends @ref uprobe_event with specific m3u playlist events. */
 enum uprobe_hls_playlist_event {
     UPROBE_HLS_PLAYLIST_SENTINEL = UPROBE_LOCAL,
@@ -0,0 +1,206 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe sink module packaging a live stream into HLS segments
+ *
+ * The sink cuts its input at random access points into segments kept in a
+ * memory ring, and maintains a media playlist describing the last segments.
+ * Transport stream segments start with the last PAT and PMT. Segments and
+ * playlist may be fetched from the ring by an in-process origin with
+ * @ref upipe_hls_sink_get_segment and @ref upipe_hls_sink_get_playlist, and
+ * are also written next to the playlist path given with @ref upipe_set_uri,
+ * if any. The files are written in chunks from an idler, but with blocking
+ * system calls in the thread of the event loop.
+ */
+
+#ifndef _UPIPE_HLS_UPIPE_HLS_SINK_H_
+/** @hidden */
+# define _UPIPE_HLS_UPIPE_HLS_SINK_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "upipe/upipe.h"
+
+#define UPIPE_HLS_SINK_SIGNATURE UBASE_FOURCC('h','l','s','s')
+
+/** @This extends @ref upipe_command with specific HLS sink commands. */
+enum upipe_hls_sink_command {
+    UPIPE_HLS_SINK_SENTINEL = UPIPE_CONTROL_LOCAL,
+
+    /** returns the target duration (uint64_t *) */
+    UPIPE_HLS_SINK_GET_TARGET_DURATION,
+    /** sets the target duration (uint64_t) */
+    UPIPE_HLS_SINK_SET_TARGET_DURATION,
+    /** returns the playlist window and ring depth
+     * (unsigned int *, unsigned int *) */
+    UPIPE_HLS_SINK_GET_WINDOW,
+    /** sets the playlist window and ring depth (unsigned int, unsigned int) */
+    UPIPE_HLS_SINK_SET_WINDOW,
+    /** returns a segment of the ring (uint64_t, struct uref **) */
+    UPIPE_HLS_SINK_GET_SEGMENT,
+    /** returns the current playlist (const char **) */
+    UPIPE_HLS_SINK_GET_PLAYLIST,
+};
+
+/** @This converts @ref upipe_hls_sink_command to a string.
+ *
+ * @param command command to convert
+ * @return a string or NULL if invalid
+ */
+static inline const char *upipe_hls_sink_command_str(int command)
+{
+    switch ((enum upipe_hls_sink_command)command) {
+    UBASE_CASE_TO_STR(UPIPE_HLS_SINK_GET_TARGET_DURATION);
+    UBASE_CASE_TO_STR(UPIPE_HLS_SINK_SET_TARGET_DURATION);
+    UBASE_CASE_TO_STR(UPIPE_HLS_SINK_GET_WINDOW);
+    UBASE_CASE_TO_STR(UPIPE_HLS_SINK_SET_WINDOW);
+    UBASE_CASE_TO_STR(UPIPE_HLS_SINK_GET_SEGMENT);
+    UBASE_CASE_TO_STR(UPIPE_HLS_SINK_GET_PLAYLIST);
+    case UPIPE_HLS_SINK_SENTINEL: break;
+    }
+    return NULL;
+}
+
+/** @This returns the target duration of the segments.
+ *
+ * @param upipe description structure of the pipe
+ * @param duration_p filled in with the target duration in 27 MHz units
+ * @return an error code
+ */
+static inline int upipe_hls_sink_get_target_duration(struct upipe *upipe,
+                                                     uint64_t *duration_p)
+{
+    return upipe_control(upipe, UPIPE_HLS_SINK_GET_TARGET_DURATION,
+                         UPIPE_HLS_SINK_SIGNATURE, duration_p);
+}
+
+/** @This sets the target duration of the segments. Segments are cut at the
+ * first random access point after this duration.
+ *
+ * @param upipe description structure of the pipe
+ * @param duration target duration in 27 MHz units
+ * @return an error code
+ */
+static inline int upipe_hls_sink_set_target_duration(struct upipe *upipe,
+                                                     uint64_t duration)
+{
+    return upipe_control(upipe, UPIPE_HLS_SINK_SET_TARGET_DURATION,
+                         UPIPE_HLS_SINK_SIGNATURE, duration);
+}
+
+/** @This returns the number of segments in the playlist and in the ring.
+ *
+ * @param upipe description structure of the pipe
+ * @param window_p filled in with the number of segments in the playlist
+ * @param depth_p filled in with the number of segments kept in memory
+ * @return an error code
+ */
+static inline int upipe_hls_sink_get_window(struct upipe *upipe,
+                                            unsigned int *window_p,
+                                            unsigned int *depth_p)
+{
+    return upipe_control(upipe, UPIPE_HLS_SINK_GET_WINDOW,
+                         UPIPE_HLS_SINK_SIGNATURE, window_p, depth_p);
+}
+
+/** @This sets the number of segments in the playlist and in the ring. The
+ * depth is raised to the window if it is smaller; segments leaving the ring
+ * are also deleted from the disk.
+ *
+ * @param upipe description structure of the pipe
+ * @param window number of segments in the playlist
+ * @param depth number of segments kept in memory
+ * @return an error code
+ */
+static inline int upipe_hls_sink_set_window(struct upipe *upipe,
+                                            unsigned int window,
+                                            unsigned int depth)
+{
+    return upipe_control(upipe, UPIPE_HLS_SINK_SET_WINDOW,
+                         UPIPE_HLS_SINK_SIGNATURE, window, depth);
+}
+
+/** @This returns a reference to a segment of the ring, without copying its
+ * content. The segment carries the m3u playlist attributes (uri, duration,
+ * discontinuity) and must be freed by the caller.
+ *
+ * @param upipe description structure of the pipe
+ * @param sequence media sequence number of the segment
+ * @param uref_p filled in with a new reference to the segment
+ * @return an error code
+ */
+static inline int upipe_hls_sink_get_segment(struct upipe *upipe,
+                                             uint64_t sequence,
+                                             struct uref **uref_p)
+{
+    return upipe_control(upipe, UPIPE_HLS_SINK_GET_SEGMENT,
+                         UPIPE_HLS_SINK_SIGNATURE, sequence, uref_p);
+}
+
+/** @This returns the current media playlist. The string belongs to the pipe
+ * and is valid until the next segment is cut.
+ *
+ * @param upipe description structure of the pipe
+ * @param playlist_p filled in with the playlist, or NULL if no segment is
+ * available yet
+ * @return an error code
+ */
+static inline int upipe_hls_sink_get_playlist(struct upipe *upipe,
+                                              const char **playlist_p)
+{
+    return upipe_control(upipe, UPIPE_HLS_SINK_GET_PLAYLIST,
+                         UPIPE_HLS_SINK_SIGNATURE, playlist_p);
+}
+
+/** @This extends @ref uprobe_event with specific HLS sink events. */
+enum uprobe_hls_sink_event {
+    UPROBE_HLS_SINK_SENTINEL = UPROBE_LOCAL,
+
+    /** a new segment was added to the ring (uint64_t) */
+    UPROBE_HLS_SINK_SEGMENT,
+};
+
+/** @This converts @ref uprobe_hls_sink_event to a string.
+ *
+ * @param event event to convert
+ * @return a string or NULL if invalid
+ */
+static inline const char *upipe_hls_sink_event_str(int event)
+{
+    switch ((enum uprobe_hls_sink_event)event) {
+    UBASE_CASE_TO_STR(UPROBE_HLS_SINK_SEGMENT);
+    case UPROBE_HLS_SINK_SENTINEL: break;
+    }
+    return NULL;
+}
+
+/** @This returns the management structure for HLS sink pipes.
+ *
+ * @return pointer to manager
+ */
+struct upipe_mgr *upipe_hls_sink_mgr_alloc(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !_UPIPE_HLS_UPIPE_HLS_SINK_H_ */
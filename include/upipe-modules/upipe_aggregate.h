@@ -38,12 +38,54 @@ extern "C" {
 
 #define UPIPE_AGG_SIGNATURE UBASE_FOURCC('a','g','g','g')
 
+/** @This extends upipe_command with specific commands for agg pipes. */
+enum upipe_agg_command {
+    UPIPE_AGG_SENTINEL = UPIPE_CONTROL_LOCAL,
+
+    /** enables or disables copying packets into contiguous buffers (int) */
+    UPIPE_AGG_SET_CONTIGUOUS,
+    /** sets the maximum time a packet is kept before being output
+     * (uint64_t) */
+    UPIPE_AGG_SET_DEADLINE
+};
+
 /** @This returns the management structure for all agg pipes.
  *
  * @return pointer to manager
  */
 struct upipe_mgr *upipe_agg_mgr_alloc(void);
 
+/** @This enables or disables copying packets into contiguous buffers.
+ * Instead of appending the incoming blocks as segments, packets are then
+ * copied into a single buffer of the output size, allocated from a ubuf
+ * manager requested for the output flow, and the output flow definition is
+ * flagged with @ref uref_block_flow_set_contiguous.
+ *
+ * @param upipe description structure of the pipe
+ * @param contiguous true to copy packets into contiguous buffers
+ * @return an error code
+ */
+static inline int upipe_agg_set_contiguous(struct upipe *upipe,
+                                           bool contiguous)
+{
+    return upipe_control(upipe, UPIPE_AGG_SET_CONTIGUOUS,
+                         UPIPE_AGG_SIGNATURE, contiguous ? 1 : 0);
+}
+
+/** @This sets the maximum time a packet is kept before the aggregated
+ * buffer is output, even if it is not full. This requires a upump manager.
+ *
+ * @param upipe description structure of the pipe
+ * @param deadline maximum time in 27 MHz ticks, or 0 to disable
+ * @return an error code
+ */
+static inline int upipe_agg_set_deadline(struct upipe *upipe,
+                                         uint64_t deadline)
+{
+    return upipe_control(upipe, UPIPE_AGG_SET_DEADLINE,
+                         UPIPE_AGG_SIGNATURE, deadline);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,10 +36,18 @@
 extern "C" {
 #endif
 
+#include "upipe/uclock.h"
 #include "upipe/upipe.h"
 
 #define UPIPE_FSINK_SIGNATURE UBASE_FOURCC('f','s','n','k')
 #define UPIPE_FSINK_EXPECTED_FLOW_DEF "block."
+/** alignment of the write-behind buffer and of its writes */
+#define UPIPE_FSINK_WRITE_BEHIND_ALIGN 4096
+/** maximum size of the write-behind buffer */
+#define UPIPE_FSINK_WRITE_BEHIND_MAX (64 * 1024 * 1024)
+/** maximum time data stays in the write-behind buffer without a sync period
+ * (1 s) */
+#define UPIPE_FSINK_WRITE_BEHIND_PERIOD UCLOCK_FREQ
 
 /** @This defines file opening modes. */
 enum upipe_fsink_mode {
@@ -69,6 +77,12 @@ enum upipe_fsink_command {
     UPIPE_FSINK_SET_SYNC_PERIOD,
     /** gets fdatasync period (uint64_t *) */
     UPIPE_FSINK_GET_SYNC_PERIOD,
+    /** replaces the file with an opened one and returns the previous file
+     * descriptor without closing it (int fildes, const char *, int *) */
+    UPIPE_FSINK_SWAP_FD,
+    /** sets the size of the write-behind buffer and O_DIRECT
+     * (unsigned int, int) */
+    UPIPE_FSINK_SET_WRITE_BEHIND,
 
     /** outer pipes commands begin here */
     UPIPE_FSINK_CONTROL_LOCAL = UPIPE_CONTROL_LOCAL + 0x1000
@@ -162,6 +176,44 @@ static inline int upipe_fsink_set_sync_period(struct upipe *upipe,
                          UPIPE_FSINK_SIGNATURE, sync_period);
 }
 
+/** @This replaces the currently opened file with an already opened file
+ * descriptor, and returns the previous file descriptor without closing it, so
+ * that it may be closed outside of the real-time thread. Buffers are written
+ * at the current offset of the new file descriptor.
+ *
+ * @param upipe description structure of the pipe
+ * @param fildes new file descriptor, or -1 to only detach the current one
+ * @param path path of the new file, for logging purposes (may be NULL)
+ * @param old_fildes_p filled in with the previous file descriptor, or -1
+ * @return an error code
+ */
+static inline int upipe_fsink_swap_fd(struct upipe *upipe, int fildes,
+                                      const char *path, int *old_fildes_p)
+{
+    return upipe_control(upipe, UPIPE_FSINK_SWAP_FD, UPIPE_FSINK_SIGNATURE,
+                         fildes, path, old_fildes_p);
+}
+
+/** @This enables write-behind: incoming buffers are copied to an aligned
+ * buffer of the given size, which is written to the file with a single
+ * system call when it is full, before each sync and when the file is closed.
+ * Without a sync period, data doesn't stay in the buffer longer than
+ * @ref UPIPE_FSINK_WRITE_BEHIND_PERIOD, if a upump manager is available. The
+ * size is rounded up to @ref UPIPE_FSINK_WRITE_BEHIND_ALIGN and may not
+ * exceed @ref UPIPE_FSINK_WRITE_BEHIND_MAX.
+ *
+ * @param upipe description structure of the pipe
+ * @param size size of the buffer in octets, or 0 to disable write-behind
+ * @param direct true to bypass the page cache with O_DIRECT, if supported
+ * @return an error code
+ */
+static inline int upipe_fsink_set_write_behind(struct upipe *upipe,
+                                               unsigned int size, bool direct)
+{
+    return upipe_control(upipe, UPIPE_FSINK_SET_WRITE_BEHIND,
+                         UPIPE_FSINK_SIGNATURE, size, direct ? 1 : 0);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +44,10 @@ UREF_ATTR_STRING(msrc_flow, data, "msrc.data", data suffix)
 UREF_ATTR_STRING(msrc_flow, aux, "msrc.aux", aux suffix)
 UREF_ATTR_UNSIGNED(msrc_flow, rotate, "msrc.rotate", rotate interval)
 UREF_ATTR_UNSIGNED(msrc_flow, offset, "msrc.offset", rotate offset)
+/* mapping is only safe on files which are never truncated, see
+ * upipe_multicat_source.c */
+UREF_ATTR_VOID(msrc_flow, mmap, "msrc.mmap",
+               map the files instead of reading them)
 
 #define UPIPE_MSRC_SIGNATURE UBASE_FOURCC('m','s','r','c')
 #define UPIPE_MSRC_DEF_ROTATE UINT64_C(97200000000)
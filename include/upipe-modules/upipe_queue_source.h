@@ -28,7 +28,8 @@
  *
  * Note that the allocator requires an additional parameter:
  * @table 2
- * @item queue_length @item maximum length of the queue (<= 255)
+ * @item queue_length @item maximum length of the queue
+ * (<= @ref UPIPE_QSRC_MAX_LENGTH)
  * @end table
  *
  * Also note that this module is exceptional in that upipe_release() may be
@@ -49,6 +50,8 @@ extern "C" {
 #include <assert.h>
 
 #define UPIPE_QSRC_SIGNATURE UBASE_FOURCC('q','s','r','c')
+/** maximum length of a queue */
+#define UPIPE_QSRC_MAX_LENGTH (1 << 20)
 
 /** @This extends upipe_command with specific commands for queue source. */
 enum upipe_qsrc_command {
@@ -57,7 +60,15 @@ enum upipe_qsrc_command {
     /** returns the maximum length of the queue (unsigned int *) */
     UPIPE_QSRC_GET_MAX_LENGTH,
     /** returns the current length of the queue (unsigned int *) */
-    UPIPE_QSRC_GET_LENGTH
+    UPIPE_QSRC_GET_LENGTH,
+    /** sets the maximum number of octets in the queue (unsigned int) */
+    UPIPE_QSRC_SET_MAX_OCTETS,
+    /** sets the maximum number of urefs output per wake-up (unsigned int) */
+    UPIPE_QSRC_SET_BUDGET,
+    /** returns the high water marks (unsigned int *, unsigned int *) */
+    UPIPE_QSRC_GET_HIGH_WATER,
+    /** resets the high water marks (void) */
+    UPIPE_QSRC_RESET_HIGH_WATER
 };
 
 /** @This returns the management structure for all queue sources.
@@ -95,6 +106,63 @@ static inline int upipe_qsrc_get_length(struct upipe *upipe,
                          UPIPE_QSRC_SIGNATURE, length_p);
 }
 
+/** @This sets the maximum number of octets of block buffers in the queue.
+ * When the limit is reached, the sinks block until enough urefs are popped.
+ * This must be called before any sink is allocated.
+ *
+ * @param upipe description structure of the pipe
+ * @param max_octets maximum number of octets, or 0 to disable the limit
+ * @return an error code
+ */
+static inline int upipe_qsrc_set_max_octets(struct upipe *upipe,
+                                            unsigned int max_octets)
+{
+    return upipe_control(upipe, UPIPE_QSRC_SET_MAX_OCTETS,
+                         UPIPE_QSRC_SIGNATURE, max_octets);
+}
+
+/** @This sets the maximum number of urefs output each time the queue source
+ * is woken up.
+ *
+ * @param upipe description structure of the pipe
+ * @param budget maximum number of urefs (> 0)
+ * @return an error code
+ */
+static inline int upipe_qsrc_set_budget(struct upipe *upipe,
+                                        unsigned int budget)
+{
+    return upipe_control(upipe, UPIPE_QSRC_SET_BUDGET,
+                         UPIPE_QSRC_SIGNATURE, budget);
+}
+
+/** @This returns the highest length and number of octets observed in the
+ * queue since the allocation or the last reset. They are sampled each time
+ * the queue source is woken up.
+ *
+ * @param upipe description structure of the pipe
+ * @param length_p filled in with the highest length of the queue
+ * @param octets_p filled in with the highest number of octets in the queue
+ * @return an error code
+ */
+static inline int upipe_qsrc_get_high_water(struct upipe *upipe,
+                                            unsigned int *length_p,
+                                            unsigned int *octets_p)
+{
+    return upipe_control(upipe, UPIPE_QSRC_GET_HIGH_WATER,
+                         UPIPE_QSRC_SIGNATURE, length_p, octets_p);
+}
+
+/** @This resets the high water marks of the queue.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static inline int upipe_qsrc_reset_high_water(struct upipe *upipe)
+{
+    return upipe_control(upipe, UPIPE_QSRC_RESET_HIGH_WATER,
+                         UPIPE_QSRC_SIGNATURE);
+}
+
 /** @hidden */
 #define ARGS_DECL , unsigned int queue_length
 /** @hidden */
@@ -53,9 +53,22 @@ enum upipe_xfer_command {
     UPIPE_XFER_SENTINEL = UPIPE_CONTROL_LOCAL,
 
     /** returns the remote pipe (struct upipe **) */
-    UPIPE_XFER_GET_REMOTE
+    UPIPE_XFER_GET_REMOTE,
+    /** calls a function on the remote pipe and waits for its return code
+     * (upipe_xfer_call_func, void *) */
+    UPIPE_XFER_CALL
 };
 
+/** @This is the type of the functions called on the remote pipe by
+ * @ref upipe_xfer_call.
+ *
+ * @param upipe_remote remote pipe
+ * @param opaque opaque given to @ref upipe_xfer_call
+ * @return an error code
+ */
+typedef int (*upipe_xfer_call_func)(struct upipe *upipe_remote,
+                                    void *opaque);
+
 /** @This returns the remote pipe. Please note that this should only be
  * called in the thread running upipe_xfer, and that nothing should be done
  * on the remote pipe, unless you have stopped the remote thread and
@@ -72,6 +85,27 @@ static inline int upipe_xfer_get_remote(struct upipe *upipe,
                          UPIPE_XFER_SIGNATURE, remote_p);
 }
 
+/** @This calls a function on the remote pipe, in the thread running the
+ * remote event loop, and waits for it to return. This avoids a round trip
+ * of events when the result of a control command is needed. Messages
+ * previously sent by xfer pipes of the same manager, including a pending
+ * batch, are processed before the function.
+ *
+ * This blocks the calling thread, so it must not be called from the remote
+ * thread, nor while the remote event loop is frozen.
+ *
+ * @param upipe description structure of the pipe
+ * @param func function to call
+ * @param opaque opaque passed to the function
+ * @return the return code of the function, or an error code
+ */
+static inline int upipe_xfer_call(struct upipe *upipe,
+                                  upipe_xfer_call_func func, void *opaque)
+{
+    return upipe_control(upipe, UPIPE_XFER_CALL, UPIPE_XFER_SIGNATURE,
+                         func, opaque);
+}
+
 /** @This extends upipe_mgr_command with specific commands for xfer. */
 enum upipe_xfer_mgr_command {
     UPIPE_XFER_MGR_SENTINEL = UPIPE_MGR_CONTROL_LOCAL,
@@ -81,7 +115,11 @@ enum upipe_xfer_mgr_command {
     /** freeze the remote event loop (void) */
     UPIPE_XFER_MGR_FREEZE,
     /** thaw the remote event loop (void) */
-    UPIPE_XFER_MGR_THAW
+    UPIPE_XFER_MGR_THAW,
+    /** start a batch of messages (void) */
+    UPIPE_XFER_MGR_BATCH_BEGIN,
+    /** end a batch of messages and send them (void) */
+    UPIPE_XFER_MGR_BATCH_END
 };
 
 /** @This returns a management structure for xfer pipes. You would need one
@@ -145,6 +183,37 @@ static inline int upipe_xfer_mgr_thaw(struct upipe_mgr *mgr)
     return upipe_mgr_control(mgr, UPIPE_XFER_MGR_THAW, UPIPE_XFER_SIGNATURE);
 }
 
+/** @This starts a batch of messages. Until the matching call to
+ * @ref upipe_xfer_mgr_batch_end, control commands and releases of the xfer
+ * pipes of this manager are kept, and then pushed to the remote event loop
+ * all at once, with a single wake-up. Batches may be nested.
+ *
+ * Batches are not thread-safe, and must only be used from the thread
+ * sending commands to the xfer pipes.
+ *
+ * @param mgr xfer_mgr structure
+ * @return an error code
+ */
+static inline int upipe_xfer_mgr_batch_begin(struct upipe_mgr *mgr)
+{
+    return upipe_mgr_control(mgr, UPIPE_XFER_MGR_BATCH_BEGIN,
+                             UPIPE_XFER_SIGNATURE);
+}
+
+/** @This ends a batch of messages previously started by
+ * @ref upipe_xfer_mgr_batch_begin. If it is the outermost batch, the
+ * messages are pushed to the remote event loop. If the queue is full, they
+ * are kept and pushed with the next message.
+ *
+ * @param mgr xfer_mgr structure
+ * @return an error code
+ */
+static inline int upipe_xfer_mgr_batch_end(struct upipe_mgr *mgr)
+{
+    return upipe_mgr_control(mgr, UPIPE_XFER_MGR_BATCH_END,
+                             UPIPE_XFER_SIGNATURE);
+}
+
 /** @hidden */
 #define ARGS_DECL , struct upipe *upipe_remote
 /** @hidden */
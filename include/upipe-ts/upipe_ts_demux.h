@@ -62,6 +62,9 @@ enum upipe_ts_demux_command {
     UPIPE_TS_DEMUX_SET_MAX_PCR_INTERVAL,
     /** gets the configured maximum interval between PCRs (uint64_t *) */
     UPIPE_TS_DEMUX_GET_MAX_PCR_INTERVAL,
+    /** sets the worker thread running the framers (struct upipe_mgr *,
+     * struct uprobe *, unsigned int) */
+    UPIPE_TS_DEMUX_SET_FRAMER_WORKER,
 };
 
 /** @This returns the currently detected conformance mode. It cannot return
@@ -159,6 +162,37 @@ static inline int upipe_ts_demux_get_max_pcr_interval(struct upipe *upipe,
                          UPIPE_TS_DEMUX_SIGNATURE, max);
 }
 
+/** @This sets the worker thread running the framers, so that elementary
+ * streams are framed away from the thread receiving the transport stream.
+ * Only the framers move: ts_split, the PSI tables, the PCRs and the PES
+ * decapsulation of all programs stay on the demux thread, which therefore
+ * still handles every TS packet of the multiplex. The reassembled PES are
+ * sent to the worker through a queue, and the framed output comes back on
+ * the demux thread. Whole programs are not moved to other threads.
+ *
+ * It may be called on the demux pipe, in which case it applies to the
+ * programs allocated afterwards and to the existing ones, on a program pipe,
+ * or on an output pipe, to spread a group of PIDs over several threads. It
+ * only applies to the framers allocated afterwards.
+ *
+ * @param upipe description structure of the pipe
+ * @param wlin_mgr management structure for wlin pipes, or NULL to run the
+ * framers on the demux thread
+ * @param uprobe_remote probe hierarchy to use on the worker thread, which must
+ * provide the ubuf managers to the framers
+ * @param queue_length number of packets in the queues from and to the worker
+ * thread
+ * @return an error code
+ */
+static inline int upipe_ts_demux_set_framer_worker(struct upipe *upipe,
+        struct upipe_mgr *wlin_mgr, struct uprobe *uprobe_remote,
+        unsigned int queue_length)
+{
+    return upipe_control(upipe, UPIPE_TS_DEMUX_SET_FRAMER_WORKER,
+                         UPIPE_TS_DEMUX_SIGNATURE, wlin_mgr, uprobe_remote,
+                         queue_length);
+}
+
 /** @This returns the management structure for all ts_demux pipes.
  *
  * @return pointer to manager
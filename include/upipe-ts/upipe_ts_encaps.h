@@ -52,7 +52,10 @@ enum upipe_ts_encaps_command {
      * uint64_t, struct ubuf **, uint64_t *) */
     UPIPE_TS_ENCAPS_SPLICE,
     /** signals an end of stream (void) */
-    UPIPE_TS_ENCAPS_EOS
+    UPIPE_TS_ENCAPS_EOS,
+    /** sets the maximum number of PSI sections kept as TS packets
+     * (unsigned int) */
+    UPIPE_TS_ENCAPS_SET_CAROUSEL
 };
 
 /** @This sets the size of the TB buffer.
@@ -96,6 +99,21 @@ static inline int upipe_ts_encaps_eos(struct upipe *upipe)
     return upipe_control(upipe, UPIPE_TS_ENCAPS_EOS, UPIPE_TS_ENCAPS_SIGNATURE);
 }
 
+/** @This sets the maximum number of PSI sections kept in the carousel. The
+ * TS packets of a section are built once, and later repetitions of the same
+ * section only get a new continuity counter.
+ *
+ * @param upipe description structure of the pipe
+ * @param max maximum number of sections, or 0 to disable the carousel
+ * @return an error code
+ */
+static inline int upipe_ts_encaps_set_carousel(struct upipe *upipe,
+                                               unsigned int max)
+{
+    return upipe_control(upipe, UPIPE_TS_ENCAPS_SET_CAROUSEL,
+                         UPIPE_TS_ENCAPS_SIGNATURE, max);
+}
+
 /** @This returns the management structure for all ts_encaps pipes.
  *
  * @return pointer to manager
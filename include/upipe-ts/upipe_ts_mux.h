@@ -175,6 +175,9 @@ enum upipe_ts_mux_command {
     UPIPE_TS_MUX_GET_PES_MIN_DURATION,
     /** forces PES alignment (int) */
     UPIPE_TS_MUX_FORCE_PES_ALIGNMENT,
+    /** sets the number of PSI sections kept as TS packets per PID
+     * (unsigned int) */
+    UPIPE_TS_MUX_SET_PSI_CAROUSEL,
 
     /** ts_encaps commands begin here */
     UPIPE_TS_MUX_ENCAPS = UPIPE_CONTROL_LOCAL + 0x1000,
@@ -796,6 +799,21 @@ static inline int upipe_ts_mux_force_pes_alignment(struct upipe *upipe,
                          UPIPE_TS_MUX_SIGNATURE, force ? 1 : 0);
 }
 
+/** @This sets the number of PSI sections kept as ready-to-send TS packets
+ * on each PSI PID, so that repetitions of an unchanged section only patch
+ * the continuity counter.
+ *
+ * @param upipe description structure of the pipe
+ * @param max maximum number of sections per PID, or 0 to disable
+ * @return an error code
+ */
+static inline int upipe_ts_mux_set_psi_carousel(struct upipe *upipe,
+                                                unsigned int max)
+{
+    return upipe_control(upipe, UPIPE_TS_MUX_SET_PSI_CAROUSEL,
+                         UPIPE_TS_MUX_SIGNATURE, max);
+}
+
 /** @This stops updating a PSI table upon sub removal.
  *
  * @param upipe description structure of the pipe
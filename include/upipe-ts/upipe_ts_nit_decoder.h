@@ -34,6 +34,31 @@ extern "C" {
 
 #define UPIPE_TS_NITD_SIGNATURE UBASE_FOURCC('t','s',0x40,'d')
 
+/** @This extends upipe_command with specific commands for ts nitd. */
+enum upipe_ts_nitd_command {
+    UPIPE_TS_NITD_SENTINEL = UPIPE_CONTROL_LOCAL,
+
+    /** returns the section cache counters (uint64_t *, uint64_t *) */
+    UPIPE_TS_NITD_GET_CACHE_STATS
+};
+
+/** @This returns the number of NIT sections that were dropped as
+ * repetitions of the current table without being parsed (hits), and the
+ * number of sections that went through the full decoder (misses).
+ *
+ * @param upipe description structure of the pipe
+ * @param hits_p filled in with the number of hits (may be NULL)
+ * @param misses_p filled in with the number of misses (may be NULL)
+ * @return an error code
+ */
+static inline int upipe_ts_nitd_get_cache_stats(struct upipe *upipe,
+                                                uint64_t *hits_p,
+                                                uint64_t *misses_p)
+{
+    return upipe_control(upipe, UPIPE_TS_NITD_GET_CACHE_STATS,
+                         UPIPE_TS_NITD_SIGNATURE, hits_p, misses_p);
+}
+
 /** @This returns the management structure for all ts_nitd pipes.
  *
  * @return pointer to manager
@@ -39,7 +39,9 @@ enum upipe_ts_patd_command {
     UPIPE_TS_PATD_SENTINEL = UPIPE_CONTROL_LOCAL,
 
     /** returns the flow definition of the NIT (struct uref **) */
-    UPIPE_TS_PATD_GET_NIT
+    UPIPE_TS_PATD_GET_NIT,
+    /** returns the section cache counters (uint64_t *, uint64_t *) */
+    UPIPE_TS_PATD_GET_CACHE_STATS
 };
 
 /** @This returns the flow definition of the NIT.
@@ -55,6 +57,23 @@ static inline bool upipe_ts_patd_get_nit(struct upipe *upipe,
                          UPIPE_TS_PATD_SIGNATURE, flow_def_p);
 }
 
+/** @This returns the number of PAT sections that were dropped as
+ * repetitions of the current table without being parsed (hits), and the
+ * number of sections that went through the full decoder (misses).
+ *
+ * @param upipe description structure of the pipe
+ * @param hits_p filled in with the number of hits (may be NULL)
+ * @param misses_p filled in with the number of misses (may be NULL)
+ * @return an error code
+ */
+static inline int upipe_ts_patd_get_cache_stats(struct upipe *upipe,
+                                                uint64_t *hits_p,
+                                                uint64_t *misses_p)
+{
+    return upipe_control(upipe, UPIPE_TS_PATD_GET_CACHE_STATS,
+                         UPIPE_TS_PATD_SIGNATURE, hits_p, misses_p);
+}
+
 /** @This returns the management structure for all ts_patd pipes.
  *
  * @return pointer to manager
@@ -33,12 +33,58 @@ extern "C" {
 
 #define UPIPE_TS_PESD_SIGNATURE UBASE_FOURCC('t','s','p','d')
 
+/** @This extends upipe_command with specific commands for ts pesd. */
+enum upipe_ts_pesd_command {
+    UPIPE_TS_PESD_SENTINEL = UPIPE_CONTROL_LOCAL,
+
+    /** returns true if PES are coalesced in a contiguous buffer (int *) */
+    UPIPE_TS_PESD_GET_COALESCE,
+    /** sets whether PES are coalesced in a contiguous buffer (int) */
+    UPIPE_TS_PESD_SET_COALESCE
+};
+
 /** @This returns the management structure for all ts_pesd pipes.
  *
  * @return pointer to manager
  */
 struct upipe_mgr *upipe_ts_pesd_mgr_alloc(void);
 
+/** @This returns whether PES are coalesced in a contiguous buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param coalesce_p filled in with true if PES are coalesced
+ * @return an error code
+ */
+static inline int upipe_ts_pesd_get_coalesce(struct upipe *upipe,
+                                             bool *coalesce_p)
+{
+    int coalesce;
+    UBASE_RETURN(upipe_control(upipe, UPIPE_TS_PESD_GET_COALESCE,
+                               UPIPE_TS_PESD_SIGNATURE, &coalesce))
+    if (coalesce_p != NULL)
+        *coalesce_p = !!coalesce;
+    return UBASE_ERR_NONE;
+}
+
+/** @This sets whether PES are coalesced in a contiguous buffer. By default,
+ * the payload of each TS packet is output as soon as it is received. In
+ * coalescing mode, the payloads of a PES are copied into a single buffer,
+ * whose size is predicted from the PES length field, or from the average
+ * size of the previous PES for unbounded video PES, and which grows
+ * geometrically if the prediction was too short. The PES is output in one
+ * piece when it is complete, or for unbounded PES when the next one starts.
+ *
+ * @param upipe description structure of the pipe
+ * @param coalesce true to coalesce PES
+ * @return an error code
+ */
+static inline int upipe_ts_pesd_set_coalesce(struct upipe *upipe,
+                                             bool coalesce)
+{
+    return upipe_control(upipe, UPIPE_TS_PESD_SET_COALESCE,
+                         UPIPE_TS_PESD_SIGNATURE, coalesce ? 1 : 0);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -60,7 +60,11 @@ enum upipe_x265_command {
     UPIPE_X265_SET_SC_LATENCY,
 
     /** set slice type enforcement mode (int) */
-    UPIPE_X265_SET_SLICE_TYPE_ENFORCE
+    UPIPE_X265_SET_SLICE_TYPE_ENFORCE,
+
+    /** set the number of frames queued to the encoder thread
+     * (unsigned int) */
+    UPIPE_X265_SET_ASYNC
 };
 
 /** @This reconfigures encoder with updated parameters.
@@ -141,6 +145,21 @@ static inline int upipe_x265_set_slice_type_enforce(struct upipe *upipe,
                          UPIPE_X265_SIGNATURE, enforce ? 1 : 0);
 }
 
+/** @This sets the number of frames which may be queued to a dedicated
+ * encoder thread, so that encoding does not block the event loop of the pipe.
+ * The pipe then needs a upump manager. 0 (the default) encodes synchronously.
+ *
+ * @param upipe description structure of the pipe
+ * @param depth maximum number of frames queued to the encoder thread
+ * @return an error code
+ */
+static inline int upipe_x265_set_async(struct upipe *upipe,
+                                       unsigned int depth)
+{
+    return upipe_control(upipe, UPIPE_X265_SET_ASYNC, UPIPE_X265_SIGNATURE,
+                         depth);
+}
+
 /** @This returns the management structure for x265 pipes.
  *
  * @return pointer to manager
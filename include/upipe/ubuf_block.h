@@ -41,6 +41,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/uio.h>
@@ -50,6 +51,33 @@ extern "C" {
  * is used properly. */
 #define UBUF_ALLOC_BLOCK UBASE_FOURCC('b','l','c','k')
 
+/** @internal @This is the number of segments which may be walked to find an
+ * offset before an index of the segments is built. */
+#define UBUF_BLOCK_INDEX_THRESHOLD 16
+
+/** @internal @This is an entry of the index of segments. */
+struct ubuf_block_index_entry {
+    /** end of the segment, in the coordinates of the index */
+    size_t end;
+    /** segment */
+    struct ubuf *ubuf;
+};
+
+/** @internal @This is an index of the segments of a block ubuf, allowing to
+ * find the segment containing an offset with a binary search. The
+ * coordinates of the index are the offsets plus a bias, so that deleting
+ * data from the beginning doesn't require to update the entries. */
+struct ubuf_block_index {
+    /** bias added to offsets */
+    size_t bias;
+    /** number of entries */
+    size_t count;
+    /** number of allocated entries */
+    size_t allocated;
+    /** array of entries */
+    struct ubuf_block_index_entry entries[];
+};
+
 /** @internal @This is a common section of block ubuf, allowing to segment
  * data. In an opaque area you would typically store a pointer to shared
  * buffer space. It is mandatory for block managers to include this
@@ -76,6 +104,8 @@ struct ubuf_block {
 
     /** cached end ubuf */
     struct ubuf *cached_end_ubuf;
+    /** index of segments, built when the chain is long, or NULL */
+    struct ubuf_block_index *index;
 
     /** common structure */
     struct ubuf ubuf;
@@ -112,7 +142,104 @@ static inline int ubuf_block_size(struct ubuf *ubuf, size_t *size_p)
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This frees the index of segments of a block ubuf.
+ *
+ * @param block pointer to the head block
+ */
+static inline void ubuf_block_index_free(struct ubuf_block *block)
+{
+    free(block->index);
+    block->index = NULL;
+}
+
+/** @internal @This adds a segment at the end of the index of segments. The
+ * index is freed in case of allocation error.
+ *
+ * @param head_block pointer to the head block
+ * @param ubuf pointer to the segment
+ * @return false in case of allocation error
+ */
+static inline bool ubuf_block_index_add(struct ubuf_block *head_block,
+                                        struct ubuf *ubuf)
+{
+    struct ubuf_block_index *index = head_block->index;
+    if (unlikely(index->count >= index->allocated)) {
+        size_t allocated = index->allocated * 2;
+        index = (struct ubuf_block_index *)
+            realloc(index, sizeof(struct ubuf_block_index) +
+                           allocated * sizeof(struct ubuf_block_index_entry));
+        if (unlikely(index == NULL)) {
+            ubuf_block_index_free(head_block);
+            return false;
+        }
+        index->allocated = allocated;
+        head_block->index = index;
+    }
+
+    size_t end = index->count ? index->entries[index->count - 1].end :
+                 index->bias;
+    index->entries[index->count].end = end + ubuf_block_from_ubuf(ubuf)->size;
+    index->entries[index->count].ubuf = ubuf;
+    index->count++;
+    return true;
+}
+
+/** @internal @This builds the index of segments of a block ubuf. Nothing is
+ * done in case of allocation error.
+ *
+ * @param head_block pointer to the head block
+ */
+static inline void ubuf_block_index_build(struct ubuf_block *head_block)
+{
+    size_t count = 0;
+    struct ubuf *ubuf = &head_block->ubuf;
+    while (ubuf != NULL) {
+        count++;
+        ubuf = ubuf_block_from_ubuf(ubuf)->next_ubuf;
+    }
+
+    struct ubuf_block_index *index = (struct ubuf_block_index *)
+        malloc(sizeof(struct ubuf_block_index) +
+               2 * count * sizeof(struct ubuf_block_index_entry));
+    if (unlikely(index == NULL))
+        return;
+    index->bias = 0;
+    index->count = 0;
+    index->allocated = 2 * count;
+    head_block->index = index;
+
+    for (ubuf = &head_block->ubuf; ubuf != NULL;
+         ubuf = ubuf_block_from_ubuf(ubuf)->next_ubuf)
+        ubuf_block_index_add(head_block, ubuf);
+}
+
+/** @internal @This returns the position in the index of the segment
+ * containing the given offset.
+ *
+ * @param index pointer to the index of segments
+ * @param offset offset in the whole chain, in octets
+ * @return position of the segment, or the number of entries if the offset
+ * is beyond the end
+ */
+static inline size_t ubuf_block_index_find(const struct ubuf_block_index *index,
+                                           size_t offset)
+{
+    size_t coord = offset + index->bias;
+    size_t low = 0, high = index->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->entries[mid].end <= coord)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
 /** @internal @This returns the ubuf corresponding to the given offset.
+ *
+ * Long chains of segments get an index, so that the segment is found with a
+ * binary search instead of walking the chain.
  *
  * @param ubuf pointer to head ubuf
  * @param offset_p reference to the offset of the buffer space wanted in the
@@ -134,18 +261,35 @@ static inline struct ubuf *ubuf_block_get(struct ubuf *ubuf, int *offset_p,
     if (size_p != NULL && *size_p == -1)
         *size_p = block->total_size - *offset_p;
 
-    if (block->cached_offset <= *offset_p) {
-        *offset_p -= block->cached_offset;
-        ubuf = block->cached_ubuf;
-        block = ubuf_block_from_ubuf(ubuf);
-    }
-
-    while (*offset_p >= block->size) {
-        *offset_p -= block->size;
-        ubuf = block->next_ubuf;
-        if (unlikely(ubuf == NULL))
+    if (head_block->index != NULL) {
+        const struct ubuf_block_index *index = head_block->index;
+        if (unlikely(*offset_p < 0))
             return NULL;
+        size_t i = ubuf_block_index_find(index, *offset_p);
+        if (unlikely(i >= index->count))
+            return NULL;
+        ubuf = index->entries[i].ubuf;
         block = ubuf_block_from_ubuf(ubuf);
+        *offset_p += index->bias - (index->entries[i].end - block->size);
+    } else {
+        if (block->cached_offset <= *offset_p) {
+            *offset_p -= block->cached_offset;
+            ubuf = block->cached_ubuf;
+            block = ubuf_block_from_ubuf(ubuf);
+        }
+
+        unsigned int walked = 0;
+        while (*offset_p >= block->size) {
+            *offset_p -= block->size;
+            ubuf = block->next_ubuf;
+            if (unlikely(ubuf == NULL))
+                return NULL;
+            block = ubuf_block_from_ubuf(ubuf);
+            walked++;
+        }
+
+        if (unlikely(walked > UBUF_BLOCK_INDEX_THRESHOLD))
+            ubuf_block_index_build(head_block);
     }
 
     head_block->cached_ubuf = ubuf;
@@ -284,6 +428,7 @@ static inline int ubuf_block_append(struct ubuf *ubuf, struct ubuf *append)
     struct ubuf_block *head_block = block;
     struct ubuf_block *append_block = ubuf_block_from_ubuf(append);
     block->total_size += append_block->total_size;
+    ubuf_block_index_free(append_block);
 
     if (block->cached_end_ubuf != NULL) {
         ubuf = block->cached_end_ubuf;
@@ -295,6 +440,12 @@ static inline int ubuf_block_append(struct ubuf *ubuf, struct ubuf *append)
     }
     block->next_ubuf = append;
     head_block->cached_end_ubuf = append;
+
+    if (head_block->index != NULL) {
+        while (append != NULL &&
+               ubuf_block_index_add(head_block, append))
+            append = ubuf_block_from_ubuf(append)->next_ubuf;
+    }
     return UBASE_ERR_NONE;
 }
 
@@ -354,6 +505,8 @@ static inline int ubuf_block_insert(struct ubuf *ubuf, int offset,
 
     struct ubuf_block *insert_block = ubuf_block_from_ubuf(insert);
     head_block->total_size += insert_block->total_size;
+    ubuf_block_index_free(head_block);
+    ubuf_block_index_free(insert_block);
 
     if (block->next_ubuf != NULL)
         ubuf_block_append(insert, block->next_ubuf);
@@ -374,9 +527,13 @@ static inline int ubuf_block_delete(struct ubuf *ubuf, int offset, int size)
         return UBASE_ERR_INVALID;
 
     struct ubuf_block *head_block = ubuf_block_from_ubuf(ubuf);
+    bool front = !offset || offset == -(int)head_block->total_size;
     if (unlikely((ubuf = ubuf_block_get(ubuf, &offset, &size)) == NULL))
         return UBASE_ERR_INVALID;
     int delete_size = size;
+    /* deleting from the beginning only shifts the coordinates of the index */
+    if (!front)
+        ubuf_block_index_free(head_block);
 
     do {
         struct ubuf_block *block = ubuf_block_from_ubuf(ubuf);
@@ -410,6 +567,8 @@ static inline int ubuf_block_delete(struct ubuf *ubuf, int offset, int size)
 
 ubuf_block_delete_done:
     head_block->total_size -= delete_size;
+    if (head_block->index != NULL)
+        head_block->index->bias += delete_size;
     return UBASE_ERR_NONE;
 }
 
@@ -434,6 +593,7 @@ static inline int ubuf_block_truncate(struct ubuf *ubuf, int offset)
         head_block->total_size = 0;
         head_block->cached_ubuf = head_block->cached_end_ubuf = ubuf;
         head_block->cached_offset = 0;
+        ubuf_block_index_free(head_block);
         return UBASE_ERR_NONE;
     }
 
@@ -442,6 +602,15 @@ static inline int ubuf_block_truncate(struct ubuf *ubuf, int offset)
     if (unlikely((ubuf = ubuf_block_get(ubuf, &offset, NULL)) == NULL))
         return UBASE_ERR_INVALID;
 
+    struct ubuf_block_index *index = head_block->index;
+    if (index != NULL) {
+        /* the segment found by ubuf_block_get becomes the last one */
+        size_t i = ubuf_block_index_find(index, saved_size - 1);
+        assert(i < index->count && index->entries[i].ubuf == ubuf);
+        index->count = i + 1;
+        index->entries[i].end = saved_size + index->bias;
+    }
+
     struct ubuf_block *block = ubuf_block_from_ubuf(ubuf);
     if (block->next_ubuf != NULL) {
         ubuf_free(block->next_ubuf);
@@ -509,6 +678,17 @@ static inline int ubuf_block_prepend(struct ubuf *ubuf, int prepend)
     if (prepend > block->offset)
         return UBASE_ERR_INVALID;
 
+    struct ubuf_block_index *index = block->index;
+    if (index != NULL) {
+        /* the index remains valid if the head segment still starts where
+         * the index believes the block starts */
+        if (index->count && index->bias >= prepend &&
+            index->entries[0].end - block->size == index->bias)
+            index->bias -= prepend;
+        else
+            ubuf_block_index_free(block);
+    }
+
     block->offset -= prepend;
     block->size += prepend;
     block->total_size += prepend;
@@ -565,6 +745,7 @@ static inline struct ubuf *ubuf_block_split(struct ubuf *ubuf, int offset)
 
     struct ubuf *new_ubuf = block->next_ubuf;
     block->next_ubuf = NULL;
+    ubuf_block_index_free(head_block);
 
     if (new_ubuf != NULL) {
         struct ubuf_block *new_block = ubuf_block_from_ubuf(new_ubuf);
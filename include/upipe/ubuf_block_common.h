@@ -60,6 +60,7 @@ static inline void ubuf_block_common_init(struct ubuf *ubuf, bool map)
 
     block->cached_ubuf = block->cached_end_ubuf = ubuf;
     block->cached_offset = 0;
+    block->index = NULL;
     uchain_init(&ubuf->uchain);
 }
 
@@ -172,13 +173,14 @@ static inline int ubuf_block_common_splice(struct ubuf *ubuf,
 }
 
 /** @internal @This frees the ubuf containing the next segments of the current
- * ubuf.
+ * ubuf, and the index of segments.
  *
  * @param ubuf pointer to ubuf
  */
 static inline void ubuf_block_common_clean(struct ubuf *ubuf)
 {
     struct ubuf_block *block = ubuf_block_from_ubuf(ubuf);
+    ubuf_block_index_free(block);
     struct ubuf *next_ubuf = block->next_ubuf;
     while (next_ubuf != NULL) {
         struct ubuf_block *next_block = ubuf_block_from_ubuf(next_ubuf);
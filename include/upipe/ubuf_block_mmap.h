@@ -0,0 +1,113 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe ubuf manager for block formats with mapped file storage
+ *
+ * A ubuf allocated by this manager maps a window of a file in memory, of
+ * at most @ref UBUF_BLOCK_MMAP_WINDOW octets. It is typically spliced into
+ * smaller ubufs which reference the mapped pages directly, and the window is
+ * unmapped when the last of them is freed. The mapping is private, so
+ * writing to a block never modifies the file. If the file cannot be mapped,
+ * the window is read into memory instead.
+ *
+ * The file must not be truncated while blocks of it are alive: accessing a
+ * page past the new end of file raises SIGBUS. Files which may be rewritten,
+ * such as the ring of a multicat sink in overwrite mode, must be read
+ * instead.
+ */
+
+#ifndef _UPIPE_UBUF_BLOCK_MMAP_H_
+/** @hidden */
+#define _UPIPE_UBUF_BLOCK_MMAP_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "upipe/ubase.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+
+#include <stdint.h>
+
+/** @This is the signature to use to allocate from a file descriptor. */
+#define UBUF_BLOCK_MMAP_ALLOC_FROM_FD UBASE_FOURCC('m','m','a','p')
+
+/** @This is the maximum size of a mapped window (1 GiB). */
+#define UBUF_BLOCK_MMAP_WINDOW (UINT64_C(1) << 30)
+
+/** @This returns a new ubuf from the block mmap allocator, mapping a window
+ * of a regular file. The window is truncated to the end of the file and to
+ * @ref UBUF_BLOCK_MMAP_WINDOW; the actual size is given by
+ * @ref ubuf_block_size. The file descriptor may be closed afterwards.
+ *
+ * @param mgr management structure for this ubuf type
+ * @param fd file descriptor to map
+ * @param offset offset of the window in the file
+ * @param size requested size of the window
+ * @return pointer to ubuf or NULL in case of failure (including an offset
+ * beyond the end of the file)
+ */
+static inline struct ubuf *ubuf_block_mmap_alloc_range(struct ubuf_mgr *mgr,
+                                                       int fd,
+                                                       uint64_t offset,
+                                                       uint64_t size)
+{
+    return ubuf_alloc(mgr, UBUF_BLOCK_MMAP_ALLOC_FROM_FD, fd, offset, size);
+}
+
+/** @This returns a new ubuf from the block mmap allocator, mapping the
+ * content of a regular file from its start, up to
+ * @ref UBUF_BLOCK_MMAP_WINDOW octets. The file descriptor may be closed
+ * afterwards.
+ *
+ * @param mgr management structure for this ubuf type
+ * @param fd file descriptor to map
+ * @return pointer to ubuf or NULL in case of failure (including empty files)
+ */
+static inline struct ubuf *ubuf_block_mmap_alloc(struct ubuf_mgr *mgr, int fd)
+{
+    return ubuf_block_mmap_alloc_range(mgr, fd, 0, UINT64_MAX);
+}
+
+/** @This advises the kernel that a part of a mapped block will be accessed
+ * soon, so that it is read ahead.
+ *
+ * @param ubuf pointer to ubuf allocated by the block mmap allocator
+ * @param offset offset of the part in the block, in octets
+ * @param size size of the part, in octets
+ * @return an error code
+ */
+int ubuf_block_mmap_prefetch(struct ubuf *ubuf, uint64_t offset,
+                             uint64_t size);
+
+/** @This allocates a new instance of the ubuf manager for block formats
+ * using mapped files.
+ *
+ * @param ubuf_pool_depth maximum number of ubuf structures in the pool
+ * @return pointer to manager, or NULL in case of error
+ */
+struct ubuf_mgr *ubuf_block_mmap_mgr_alloc(uint16_t ubuf_pool_depth);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
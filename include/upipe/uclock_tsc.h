@@ -0,0 +1,54 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe implementation of uclock using the CPU time-stamp counter
+ *
+ * The clock reads the invariant time-stamp counter of x86 CPUs, calibrated
+ * against the system clock at allocation. It is re-anchored to the system
+ * clock about every second, by slewing its rate so that it stays monotonic.
+ * Errors above 1 ms step the clock forward, or hold it until the system
+ * clock catches up when the system clock went backwards.
+ * Without an invariant time-stamp counter, the standard uclock is returned
+ * instead.
+ */
+
+#ifndef _UPIPE_UCLOCK_TSC_H_
+/** @hidden */
+#define _UPIPE_UCLOCK_TSC_H_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "upipe/uclock.h"
+#include "upipe/uclock_std.h"
+
+/** @This allocates a new uclock structure.
+ *
+ * @param flags flags for the creation of a uclock structure
+ * @return pointer to uclock, or NULL in case of error
+ */
+struct uclock *uclock_tsc_alloc(enum uclock_std_flags flags);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
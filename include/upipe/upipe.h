@@ -41,6 +41,7 @@ extern "C" {
 #include "upipe/udict_dump.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
 
@@ -166,6 +167,26 @@ enum upipe_command {
     UPIPE_CONTROL_LOCAL = 0x8000
 };
 
+/** @This holds the instrumentation counters of a pipe. Counters are only
+ * updated by the thread running the pipe, and are therefore not locked. */
+struct upipe_stats {
+    /** number of urefs received */
+    uint64_t urefs;
+    /** number of octets received in block urefs */
+    uint64_t octets;
+    /** cumulated ticks spent in the input function (CPU cycles where a cycle
+     * counter is available, nanoseconds otherwise), excluding the time spent
+     * in the instrumented pipes it called */
+    uint64_t cycles;
+    /** maximum ticks spent in a single call to the input function, excluding
+     * instrumented pipes called */
+    uint64_t max_cycles;
+    /** last reported queue depth, for queue pipes */
+    uint64_t queue_depth;
+    /** maximum reported queue depth, for queue pipes */
+    uint64_t max_queue_depth;
+};
+
 /** @This stores common parameters for upipe structures. */
 struct upipe {
     /** pointer to refcount management structure */
@@ -179,6 +200,8 @@ struct upipe {
     struct uprobe *uprobe;
     /** pointer to the manager for this pipe type */
     struct upipe_mgr *mgr;
+    /** instrumentation counters, or NULL if the pipe is not instrumented */
+    struct upipe_stats *stats;
 };
 
 UBASE_FROM_TO(upipe, uchain, uchain, uchain)
@@ -222,6 +245,9 @@ struct upipe_mgr {
     /** control function for standard or local manager commands - all parameters
      * belong to the caller */
     int (*upipe_mgr_control)(struct upipe_mgr *, int, va_list);
+
+    /** true if pipes allocated by this manager are instrumented */
+    bool stats;
 };
 
 /** @This initializes a upipe manager structure with default values.
@@ -240,6 +266,7 @@ static inline void upipe_mgr_init(struct upipe_mgr *mgr)
         mgr->upipe_input = NULL;
         mgr->upipe_control = NULL;
         mgr->upipe_mgr_control = NULL;
+        mgr->stats = false;
     }
 }
 
@@ -327,6 +354,76 @@ static inline int upipe_mgr_check_flow_def(struct upipe_mgr *mgr,
     return upipe_mgr_control(mgr, UPIPE_MGR_CHECK_FLOW_DEF, flow_def);
 }
 
+/** @This enables or disables the instrumentation of the pipes allocated
+ * afterwards by a manager.
+ *
+ * @param mgr pointer to upipe manager
+ * @param enable true to instrument the pipes
+ */
+static inline void upipe_mgr_set_stats(struct upipe_mgr *mgr, bool enable)
+{
+    mgr->stats = enable;
+}
+
+/** @This enables or disables the instrumentation of all the pipes allocated
+ * afterwards, whatever their manager.
+ *
+ * @param enable true to instrument the pipes
+ */
+void upipe_stats_set_global(bool enable);
+
+/** @internal @This allocates the instrumentation counters of a new pipe,
+ * if instrumentation is enabled for its manager or globally.
+ *
+ * @param mgr management structure for this pipe type
+ * @return pointer to the counters, or NULL if the pipe is not instrumented
+ */
+struct upipe_stats *upipe_stats_alloc(struct upipe_mgr *mgr);
+
+/** @internal @This sends a uref to an instrumented pipe, updating its
+ * counters. The ticks spent in instrumented pipes called from the input
+ * function are subtracted, so that each instrumented pipe only accounts for
+ * its own processing. Non-instrumented pipes are accounted to the
+ * instrumented pipe calling them.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure to send
+ * @param upump_p reference to the pump that generated the buffer
+ */
+void upipe_stats_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p);
+
+/** @This returns a snapshot of the instrumentation counters of a pipe. It
+ * must be called from the thread running the pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @param stats filled in with the counters
+ * @return an error code, UBASE_ERR_INVALID if the pipe is not instrumented
+ */
+int upipe_stats_get(struct upipe *upipe, struct upipe_stats *stats);
+
+/** @This resets the instrumentation counters of a pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code, UBASE_ERR_INVALID if the pipe is not instrumented
+ */
+int upipe_stats_reset(struct upipe *upipe);
+
+/** @This records the depth of the queue of a queue pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @param depth current number of elements in the queue
+ */
+static inline void upipe_stats_queue(struct upipe *upipe, unsigned int depth)
+{
+    struct upipe_stats *stats = upipe->stats;
+    if (likely(stats == NULL))
+        return;
+    stats->queue_depth = depth;
+    if (depth > stats->max_queue_depth)
+        stats->max_queue_depth = depth;
+}
+
 /** @This return the corresponding error string.
  *
  * @param upipe description structure of the pipe
@@ -473,6 +570,7 @@ static inline void upipe_init(struct upipe *upipe, struct upipe_mgr *mgr,
     upipe->uprobe = uprobe;
     upipe->refcount = NULL;
     upipe->mgr = mgr;
+    upipe->stats = upipe_stats_alloc(mgr);
     upipe_mgr_use(mgr);
 }
 
@@ -581,6 +679,7 @@ static inline void upipe_clean(struct upipe *upipe)
     assert(upipe != NULL);
     uprobe_release(upipe->uprobe);
     upipe_mgr_release(upipe->mgr);
+    free(upipe->stats);
 }
 
 /** @internal @This throws generic events with optional arguments.
@@ -1061,7 +1160,10 @@ static inline void upipe_input(struct upipe *upipe, struct uref *uref,
         return;
     }
     upipe_use(upipe);
-    upipe->mgr->upipe_input(upipe, uref, upump_p);
+    if (unlikely(upipe->stats != NULL))
+        upipe_stats_input(upipe, uref, upump_p);
+    else
+        upipe->mgr->upipe_input(upipe, uref, upump_p);
     upipe_release(upipe);
 }
 
@@ -37,17 +37,32 @@ extern "C" {
 #include "upipe/config.h"
 #include "upipe/ubase.h"
 #include "upipe/uatomic.h"
-#include "upipe/ufifo.h"
 #include "upipe/ueventfd.h"
 #include "upipe/upump.h"
 
 #include <stdint.h>
 #include <assert.h>
 
+/** @This is a slot of the array of a queue. */
+struct uqueue_cell {
+    /** position of the element in the sequence of pushes and pops */
+    uatomic_uint32_t seq;
+    /** pointer to the element */
+    void *element;
+};
+
 /** @This is the implementation of a queue. */
 struct uqueue {
-    /** FIFO */
-    struct ufifo fifo;
+    /** array of cells */
+    struct uqueue_cell *cells;
+    /** number of cells minus one (the number of cells is a power of 2) */
+    uint32_t mask;
+    /** position of the next push */
+    uatomic_uint32_t push_pos;
+    /** position of the next pop */
+    uatomic_uint32_t pop_pos;
+    /** number of elements in the queue, including pushes in progress */
+    uatomic_uint32_t reserved;
     /** number of elements in the queue */
     uatomic_uint32_t counter;
     /** maximum number of elements in the queue */
@@ -63,19 +78,22 @@ struct uqueue {
  * @param length maximum number of elements in the queue
  * @return size in octets to allocate
  */
-#define uqueue_sizeof(length) ufifo_sizeof(length)
+#define uqueue_sizeof(length)                                               \
+    ((2 * (length) + 1) * sizeof(struct uqueue_cell))
 
 /** @This initializes a uqueue.
  *
  * @param uqueue pointer to a uqueue structure
- * @param length maximum number of elements in the queue
+ * @param length maximum number of elements in the queue (max 2^30)
  * @param extra mandatory extra space allocated by the caller, with the size
- * returned by @ref #ufifo_sizeof
+ * returned by @ref #uqueue_sizeof
  * @return false in case of failure
  */
-static inline bool uqueue_init(struct uqueue *uqueue, uint8_t length,
+static inline bool uqueue_init(struct uqueue *uqueue, uint32_t length,
                                void *extra)
 {
+    if (unlikely(!length || length > (UINT32_C(1) << 30)))
+        return false;
     if (unlikely(!ueventfd_init(&uqueue->event_push, true)))
         return false;
     if (unlikely(!ueventfd_init(&uqueue->event_pop, false))) {
@@ -83,7 +101,20 @@ static inline bool uqueue_init(struct uqueue *uqueue, uint8_t length,
         return false;
     }
 
-    ufifo_init(&uqueue->fifo, length, extra);
+    uint32_t cells = 1;
+    while (cells < length)
+        cells <<= 1;
+    /* the extra space may not be aligned */
+    uintptr_t align = sizeof(struct uqueue_cell) - 1;
+    uqueue->cells = (struct uqueue_cell *)(((uintptr_t)extra + align) & ~align);
+    uqueue->mask = cells - 1;
+    for (uint32_t i = 0; i < cells; i++) {
+        uatomic_init(&uqueue->cells[i].seq, i);
+        uqueue->cells[i].element = NULL;
+    }
+    uatomic_init(&uqueue->push_pos, 0);
+    uatomic_init(&uqueue->pop_pos, 0);
+    uatomic_init(&uqueue->reserved, 0);
     uatomic_init(&uqueue->counter, 0);
     uqueue->length = length;
     return true;
@@ -127,6 +158,77 @@ static inline struct upump *uqueue_upump_alloc_pop(struct uqueue *uqueue,
                                 refcount);
 }
 
+/** @internal @This reserves a slot for an element in the queue.
+ *
+ * @param uqueue pointer to a uqueue structure
+ * @return false if the queue is full
+ */
+static inline bool uqueue_reserve(struct uqueue *uqueue)
+{
+    uint32_t reserved = uatomic_load(&uqueue->reserved);
+    do {
+        if (reserved >= uqueue->length)
+            return false;
+    } while (unlikely(!uatomic_compare_exchange(&uqueue->reserved, &reserved,
+                                                reserved + 1)));
+    return true;
+}
+
+/** @internal @This stores an element in the array, in a slot that was
+ * previously reserved.
+ *
+ * @param uqueue pointer to a uqueue structure
+ * @param element pointer to element to push
+ */
+static inline void uqueue_store(struct uqueue *uqueue, void *element)
+{
+    uint32_t pos = uatomic_load(&uqueue->push_pos);
+    struct uqueue_cell *cell;
+    for ( ; ; ) {
+        cell = &uqueue->cells[pos & uqueue->mask];
+        int32_t diff = (int32_t)(uatomic_load(&cell->seq) - pos);
+        if (likely(diff == 0)) {
+            if (likely(uatomic_compare_exchange(&uqueue->push_pos, &pos,
+                                                pos + 1)))
+                break;
+        } else {
+            /* the cell is still being popped, or another thread pushed */
+            pos = uatomic_load(&uqueue->push_pos);
+        }
+    }
+    cell->element = element;
+    uatomic_store(&cell->seq, pos + 1);
+}
+
+/** @internal @This removes the first element from the array.
+ *
+ * @param uqueue pointer to a uqueue structure
+ * @return pointer to element, or NULL if the array is empty
+ */
+static inline void *uqueue_load(struct uqueue *uqueue)
+{
+    uint32_t pos = uatomic_load(&uqueue->pop_pos);
+    struct uqueue_cell *cell;
+    for ( ; ; ) {
+        cell = &uqueue->cells[pos & uqueue->mask];
+        int32_t diff = (int32_t)(uatomic_load(&cell->seq) - (pos + 1));
+        if (likely(diff == 0)) {
+            if (likely(uatomic_compare_exchange(&uqueue->pop_pos, &pos,
+                                                pos + 1)))
+                break;
+        } else if (diff < 0) {
+            /* empty, or the push is still in progress */
+            return NULL;
+        } else {
+            pos = uatomic_load(&uqueue->pop_pos);
+        }
+    }
+    void *element = cell->element;
+    cell->element = NULL;
+    uatomic_store(&cell->seq, pos + uqueue->mask + 1);
+    return element;
+}
+
 /** @This pushes an element into the queue.
  *
  * @param uqueue pointer to a uqueue structure
@@ -135,18 +237,20 @@ static inline struct upump *uqueue_upump_alloc_pop(struct uqueue *uqueue,
  */
 static inline bool uqueue_push(struct uqueue *uqueue, void *element)
 {
-    if (unlikely(!ufifo_push(&uqueue->fifo, element))) {
+    assert(element != NULL);
+    if (unlikely(!uqueue_reserve(uqueue))) {
         /* signal that we are full */
         ueventfd_read(&uqueue->event_push);
 
         /* double-check */
-        if (likely(!ufifo_push(&uqueue->fifo, element)))
+        if (likely(!uqueue_reserve(uqueue)))
             return false;
 
         /* signal that we're alright again */
         ueventfd_write(&uqueue->event_push);
     }
 
+    uqueue_store(uqueue, element);
     if (unlikely(uatomic_fetch_add(&uqueue->counter, 1) == 0))
         ueventfd_write(&uqueue->event_pop);
     return true;
@@ -159,21 +263,29 @@ static inline bool uqueue_push(struct uqueue *uqueue, void *element)
  */
 static inline void *uqueue_pop_internal(struct uqueue *uqueue)
 {
-    void *element = ufifo_pop(&uqueue->fifo, void *);
+    void *element = uqueue_load(uqueue);
     if (unlikely(element == NULL)) {
         /* signal that we starve */
         ueventfd_read(&uqueue->event_pop);
 
         /* double-check */
-        element = ufifo_pop(&uqueue->fifo, void *);
-        if (likely(element == NULL))
+        element = uqueue_load(uqueue);
+        if (likely(element == NULL)) {
+            /* a later push may have completed while the push of the first
+             * element is still in progress; its producer will not signal
+             * again since the counter is non-zero, so keep the event
+             * triggered until the first element is stored */
+            if (unlikely(uatomic_load(&uqueue->counter)))
+                ueventfd_write(&uqueue->event_pop);
             return NULL;
+        }
 
         /* signal that we're alright again */
         ueventfd_write(&uqueue->event_pop);
     }
 
-    if (unlikely(uatomic_fetch_sub(&uqueue->counter, 1) == uqueue->length))
+    uatomic_fetch_sub(&uqueue->counter, 1);
+    if (unlikely(uatomic_fetch_sub(&uqueue->reserved, 1) == uqueue->length))
         ueventfd_write(&uqueue->event_push);
     return element;
 }
@@ -202,8 +314,12 @@ static inline unsigned int uqueue_length(struct uqueue *uqueue)
  */
 static inline void uqueue_clean(struct uqueue *uqueue)
 {
+    for (uint32_t i = 0; i <= uqueue->mask; i++)
+        uatomic_clean(&uqueue->cells[i].seq);
+    uatomic_clean(&uqueue->push_pos);
+    uatomic_clean(&uqueue->pop_pos);
+    uatomic_clean(&uqueue->reserved);
     uatomic_clean(&uqueue->counter);
-    ufifo_clean(&uqueue->fifo);
     ueventfd_clean(&uqueue->event_push);
     ueventfd_clean(&uqueue->event_pop);
 }
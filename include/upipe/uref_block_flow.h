@@ -60,6 +60,8 @@ UREF_ATTR_UNSIGNED(block_flow, append, "b.append",
 UREF_ATTR_INT(block_flow, align_offset, "b.align_offset",
         offset of the aligned octet)
 UREF_ATTR_UNSIGNED(block_flow, size, "b.size", block size)
+UREF_ATTR_VOID(block_flow, contiguous, "b.contiguous",
+        blocks are made of a single segment)
 
 /** @This allocates a control packet to define a new block flow.
  *
@@ -40,9 +40,129 @@ extern "C" {
 #include <ev.h>
 
 #include "upipe/upump.h"
+#include "upipe/uprobe.h"
 
 #define UPUMP_EV_SIGNATURE UBASE_FOURCC('e','v',' ',' ')
 
+/** number of buckets of the statistics histograms */
+#define UPUMP_EV_STATS_BUCKETS 24
+
+/** @This holds the statistics of a pump or of a whole event loop. Bucket 0
+ * of a histogram counts durations below 1 microsecond, and bucket n > 0
+ * counts durations between 2^(n-1) and 2^n microseconds (the last bucket
+ * also holds longer durations). */
+struct upump_ev_stats {
+    /** number of callbacks run */
+    uint64_t dispatched;
+    /** histogram of callback run times */
+    uint64_t run[UPUMP_EV_STATS_BUCKETS];
+    /** longest callback run time, in microseconds */
+    uint64_t run_max;
+    /** histogram of timer lateness (actual versus scheduled date) */
+    uint64_t late[UPUMP_EV_STATS_BUCKETS];
+    /** highest timer lateness, in microseconds */
+    uint64_t late_max;
+};
+
+/** @This extends upump_command with specific commands for upump_ev. */
+enum upump_ev_command {
+    UPUMP_EV_SENTINEL = UPUMP_CONTROL_LOCAL,
+
+    /** returns the statistics of the pump (struct upump_ev_stats *) */
+    UPUMP_EV_GET_STATS
+};
+
+/** @This extends upump_mgr_command with specific commands for upump_ev. */
+enum upump_ev_mgr_command {
+    UPUMP_EV_MGR_SENTINEL = UPUMP_MGR_CONTROL_LOCAL,
+
+    /** enables or disables the statistics (int) */
+    UPUMP_EV_MGR_SET_STATS,
+    /** returns the statistics of the loop (struct upump_ev_stats *) */
+    UPUMP_EV_MGR_GET_STATS,
+    /** resets the statistics of the loop (void) */
+    UPUMP_EV_MGR_RESET_STATS,
+    /** throws the loop statistics periodically to a probe
+     * (struct uprobe *, uint64_t) */
+    UPUMP_EV_MGR_SET_STATS_PROBE
+};
+
+/** @This extends uprobe_event with specific events for upump_ev. */
+enum uprobe_upump_ev_event {
+    UPROBE_UPUMP_EV_SENTINEL = UPROBE_LOCAL,
+
+    /** periodic statistics of an event loop, thrown without pipe
+     * (struct upump_mgr *, const struct upump_ev_stats *) */
+    UPROBE_UPUMP_EV_STATS
+};
+
+/** @This returns the statistics of a pump. They are only recorded while
+ * the statistics are enabled on the manager.
+ *
+ * @param upump description structure of the pump
+ * @param stats filled in with the statistics
+ * @return an error code
+ */
+static inline int upump_ev_get_stats(struct upump *upump,
+                                     struct upump_ev_stats *stats)
+{
+    return upump_control(upump, UPUMP_EV_GET_STATS, UPUMP_EV_SIGNATURE,
+                         stats);
+}
+
+/** @This enables or disables the recording of statistics on an event loop.
+ *
+ * @param mgr pointer to a upump_mgr structure
+ * @param enable true to record statistics
+ * @return an error code
+ */
+static inline int upump_ev_mgr_set_stats(struct upump_mgr *mgr, bool enable)
+{
+    return upump_mgr_control(mgr, UPUMP_EV_MGR_SET_STATS, UPUMP_EV_SIGNATURE,
+                             enable ? 1 : 0);
+}
+
+/** @This returns the statistics of an event loop.
+ *
+ * @param mgr pointer to a upump_mgr structure
+ * @param stats filled in with the statistics
+ * @return an error code
+ */
+static inline int upump_ev_mgr_get_stats(struct upump_mgr *mgr,
+                                         struct upump_ev_stats *stats)
+{
+    return upump_mgr_control(mgr, UPUMP_EV_MGR_GET_STATS, UPUMP_EV_SIGNATURE,
+                             stats);
+}
+
+/** @This resets the statistics of an event loop.
+ *
+ * @param mgr pointer to a upump_mgr structure
+ * @return an error code
+ */
+static inline int upump_ev_mgr_reset_stats(struct upump_mgr *mgr)
+{
+    return upump_mgr_control(mgr, UPUMP_EV_MGR_RESET_STATS,
+                             UPUMP_EV_SIGNATURE);
+}
+
+/** @This throws the statistics of an event loop periodically as
+ * @ref UPROBE_UPUMP_EV_STATS events. The statistics are reset after each
+ * event. The timer does not keep the loop alive.
+ *
+ * @param mgr pointer to a upump_mgr structure
+ * @param uprobe probe to throw to (belongs to the callee), or NULL to stop
+ * @param period period of the events, in units of a 27 MHz clock
+ * @return an error code
+ */
+static inline int upump_ev_mgr_set_stats_probe(struct upump_mgr *mgr,
+                                               struct uprobe *uprobe,
+                                               uint64_t period)
+{
+    return upump_mgr_control(mgr, UPUMP_EV_MGR_SET_STATS_PROBE,
+                             UPUMP_EV_SIGNATURE, uprobe, period);
+}
+
 /** @This allocates and initializes a upump_mgr structure bound to a given
  * ev loop.
  *
@@ -28,6 +28,7 @@
  */
 
 #include "upipe/ubase.h"
+#include "upipe/uatomic.h"
 #include "upipe/ulist_helper.h"
 #include "upipe/ubuf.h"
 #include "upipe/urefcount_helper.h"
@@ -108,6 +109,8 @@ ubuf_av_to_ubuf_sound_av(struct ubuf_av *ubuf_av)
 struct ubuf_av_mgr {
     /** refcount management structure */
     struct urefcount urefcount;
+    /** number of plane copies */
+    uatomic_uint32_t copies;
     /** common picture management structure */
     struct ubuf_mgr mgr;
 };
@@ -115,6 +118,16 @@ struct ubuf_av_mgr {
 UBASE_FROM_TO(ubuf_av_mgr, ubuf_mgr, ubuf_mgr, mgr);
 UREFCOUNT_HELPER(ubuf_av_mgr, urefcount, ubuf_av_mgr_free);
 
+/** @internal @This accounts for a plane copy.
+ *
+ * @param ubuf pointer to buffer
+ */
+static inline void ubuf_av_count_copy(struct ubuf *ubuf)
+{
+    struct ubuf_av_mgr *ubuf_av_mgr = ubuf_av_mgr_from_ubuf_mgr(ubuf->mgr);
+    uatomic_fetch_add(&ubuf_av_mgr->copies, 1);
+}
+
 /** @internal @This frees a libav ubuf.
  *
  * @param ubuf pointer to buffer
@@ -270,10 +283,14 @@ static int ubuf_pic_av_get_mapped_avframe(struct ubuf *ubuf,
             ubuf_pic_av->mapped_frame = av_frame_alloc();
             UBASE_ALLOC_RETURN(ubuf_pic_av->mapped_frame);
             if (av_hwframe_map(ubuf_pic_av->mapped_frame, frame, writable ?
-                               AV_HWFRAME_MAP_WRITE : AV_HWFRAME_MAP_READ) &&
-                av_hwframe_transfer_data(ubuf_pic_av->mapped_frame, frame, 0)) {
-                av_frame_free(&ubuf_pic_av->mapped_frame);
-                return UBASE_ERR_EXTERNAL;
+                               AV_HWFRAME_MAP_WRITE : AV_HWFRAME_MAP_READ)) {
+                /* direct mapping is not supported, download the frame */
+                if (av_hwframe_transfer_data(ubuf_pic_av->mapped_frame,
+                                             frame, 0)) {
+                    av_frame_free(&ubuf_pic_av->mapped_frame);
+                    return UBASE_ERR_EXTERNAL;
+                }
+                ubuf_av_count_copy(ubuf);
             }
         }
         frame = ubuf_pic_av->mapped_frame;
@@ -594,12 +611,13 @@ static int ubuf_pic_av_plane_map(struct ubuf *ubuf,
             ubuf_pic_av->buf[plane_id] =
                 malloc(stride * frame->height);
             UBASE_ALLOC_RETURN(ubuf_pic_av->buf[plane_id]);
+            /* the plane is only reordered once per buffer */
+            for (int i = 0; i < frame->height; i++)
+                memcpy(ubuf_pic_av->buf[plane_id] + i * stride,
+                       frame->data[plane_id] + i * frame->linesize[plane_id],
+                       stride);
+            ubuf_av_count_copy(ubuf);
         }
-        for (int i = 0; i < frame->height; i++)
-            /* TODO: maybe we don't need to copy the whole plane buffer */
-            memcpy(ubuf_pic_av->buf[plane_id] + i * stride,
-                   frame->data[plane_id] + i * frame->linesize[plane_id],
-                   stride);
         buffer = ubuf_pic_av->buf[plane_id];
     }
     else {
@@ -978,6 +996,17 @@ static int ubuf_av_control(struct ubuf *ubuf, int command, va_list args)
 static int ubuf_av_mgr_control(struct ubuf_mgr *mgr,
                                int command, va_list args)
 {
+    struct ubuf_av_mgr *ubuf_av_mgr = ubuf_av_mgr_from_ubuf_mgr(mgr);
+
+    switch (command) {
+        case UBUF_AV_MGR_GET_COPIES: {
+            UBASE_SIGNATURE_CHECK(args, UBUF_AV_SIGNATURE)
+            uint64_t *copies_p = va_arg(args, uint64_t *);
+            if (copies_p)
+                *copies_p = uatomic_load(&ubuf_av_mgr->copies);
+            return UBASE_ERR_NONE;
+        }
+    }
     return UBASE_ERR_UNHANDLED;
 }
 
@@ -992,6 +1021,7 @@ struct ubuf_mgr *ubuf_av_mgr_alloc(void)
         return NULL;
 
     ubuf_av_mgr_init_urefcount(ubuf_av_mgr);
+    uatomic_init(&ubuf_av_mgr->copies, 0);
     ubuf_av_mgr->mgr.refcount = ubuf_av_mgr_to_urefcount(ubuf_av_mgr);
     ubuf_av_mgr->mgr.signature = UBUF_AV_SIGNATURE;
     ubuf_av_mgr->mgr.ubuf_mgr_control = ubuf_av_mgr_control;
@@ -1009,6 +1039,7 @@ struct ubuf_mgr *ubuf_av_mgr_alloc(void)
  */
 static void ubuf_av_mgr_free(struct ubuf_av_mgr *ubuf_av_mgr)
 {
+    uatomic_clean(&ubuf_av_mgr->copies);
     ubuf_av_mgr_clean_urefcount(ubuf_av_mgr);
     free(ubuf_av_mgr);
 }
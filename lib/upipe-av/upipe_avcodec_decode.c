@@ -63,6 +63,7 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
@@ -173,6 +174,10 @@ struct upipe_avcdec {
     char *hw_device;
     /** hw pixel format */
     enum AVPixelFormat hw_pix_fmt;
+    /** number of decoding threads (0 for auto) */
+    unsigned int thread_count;
+    /** allowed threading methods */
+    unsigned int thread_type;
     /** avcodec context */
     AVCodecContext *context;
     /** avcodec frame */
@@ -246,6 +251,12 @@ static void upipe_av_uref_pic_free(void *opaque, uint8_t *data);
  * Does not need to be reentrant.
  */
 
+/* When AV_CODEC_FLAG_COPY_OPAQUE is available, frames are allocated by the
+ * default thread-safe libavcodec allocator and the get_buffer functions below
+ * are only called from the pipe thread to wrap the decoded AVFrame into a
+ * ubuf_av. Otherwise they are installed as get_buffer2 callbacks, which are
+ * not safe for concurrent calls, so frame threading is disabled. */
+
 static void buffer_uref_free(void *opaque, uint8_t *data)
 {
     struct uref *uref = opaque;
@@ -371,8 +382,12 @@ static int upipe_avcdec_get_buffer_pic(struct AVCodecContext *context,
         urational_simplify(&fps);
         UBASE_FATAL(upipe, uref_pic_flow_set_fps(flow_def_attr, fps))
 
-        latency = (context->delay + context->has_b_frames) *
-            UCLOCK_FREQ * fps.den / fps.num;
+        unsigned int delay = context->delay + context->has_b_frames;
+        /* frame threading delays the output by one frame per extra thread */
+        if ((context->active_thread_type & FF_THREAD_FRAME) &&
+            context->thread_count > 1)
+            delay += context->thread_count - 1;
+        latency = delay * UCLOCK_FREQ * fps.den / fps.num;
     }
     UBASE_FATAL(upipe, uref_clock_set_latency(
             flow_def_attr, upipe_avcdec->input_latency + latency))
@@ -814,6 +829,27 @@ static bool upipe_avcdec_do_av_deal(struct upipe *upipe)
     context->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
 #endif
 
+    /* configure threading; frame threads form libavcodec's own asynchronous
+     * queue, avcodec_send_packet() only waits when they are all busy */
+    if (upipe_avcdec->thread_type != UINT_MAX) {
+        int thread_type = 0;
+        if (upipe_avcdec->thread_type & UPIPE_AVCDEC_THREAD_FRAME) {
+#ifdef USE_COPY_OPAQUE
+            thread_type |= FF_THREAD_FRAME;
+#else
+            if (context->get_buffer2 != NULL)
+                upipe_warn(upipe, "frame threading needs thread-safe "
+                           "buffer allocation, disabling");
+            else
+                thread_type |= FF_THREAD_FRAME;
+#endif
+        }
+        if (upipe_avcdec->thread_type & UPIPE_AVCDEC_THREAD_SLICE)
+            thread_type |= FF_THREAD_SLICE;
+        context->thread_type = thread_type;
+        context->thread_count = thread_type ? upipe_avcdec->thread_count : 1;
+    }
+
     /* open new context */
     if (unlikely((err = avcodec_open2(context, context->codec, NULL)) < 0)) {
         upipe_warn_va(upipe, "could not open codec (%s)", av_err2str(err));
@@ -822,6 +858,10 @@ static bool upipe_avcdec_do_av_deal(struct upipe *upipe)
     }
     upipe_notice_va(upipe, "codec %s (%s) %d opened", context->codec->name,
                     context->codec->long_name, context->codec->id);
+    if (context->active_thread_type)
+        upipe_notice_va(upipe, "using %d %s threads", context->thread_count,
+                        context->active_thread_type & FF_THREAD_FRAME ?
+                        "frame" : "slice");
 
     return true;
 }
@@ -1887,6 +1927,29 @@ static int upipe_avcdec_set_option(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets the number of decoding threads and the allowed
+ * threading methods.
+ *
+ * @param upipe description structure of the pipe
+ * @param count number of threads, 0 for automatic detection
+ * @param type mask of allowed threading methods
+ * @return an error code
+ */
+static int upipe_avcdec_set_threads_real(struct upipe *upipe,
+                                         unsigned int count,
+                                         unsigned int type)
+{
+    struct upipe_avcdec *upipe_avcdec = upipe_avcdec_from_upipe(upipe);
+    if (upipe_avcdec->context != NULL &&
+        avcodec_is_open(upipe_avcdec->context))
+        return UBASE_ERR_BUSY;
+    if (type & ~(UPIPE_AVCDEC_THREAD_FRAME | UPIPE_AVCDEC_THREAD_SLICE))
+        return UBASE_ERR_INVALID;
+    upipe_avcdec->thread_count = count;
+    upipe_avcdec->thread_type = type;
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on a file source pipe, and
  * checks the status of the pipe afterwards.
  *
@@ -1947,6 +2010,12 @@ static int upipe_avcdec_control(struct upipe *upipe, int command, va_list args)
             upipe_avcdec->hw_device = device ? strdup(device) : NULL;
             return UBASE_ERR_NONE;
         }
+        case UPIPE_AVCDEC_SET_THREADS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AVCDEC_SIGNATURE)
+            unsigned int count = va_arg(args, unsigned int);
+            unsigned int type = va_arg(args, unsigned int);
+            return upipe_avcdec_set_threads_real(upipe, count, type);
+        }
 
         default:
             return UBASE_ERR_UNHANDLED;
@@ -2026,6 +2095,8 @@ static struct upipe *upipe_avcdec_alloc(struct upipe_mgr *mgr,
     upipe_avcdec->hw_device_type = AV_HWDEVICE_TYPE_NONE;
     upipe_avcdec->hw_device = NULL;
     upipe_avcdec->hw_pix_fmt = AV_PIX_FMT_NONE;
+    upipe_avcdec->thread_count = 0;
+    upipe_avcdec->thread_type = UINT_MAX;
     upipe_avcdec->context = NULL;
     upipe_avcdec->frame = frame;
     upipe_avcdec->avpkt = avpkt;
@@ -848,6 +848,17 @@ static void upipe_avcenc_encode_subtitle(struct upipe *upipe,
     av_packet_unref(upipe_avcenc->avpkt);
 }
 
+/** @internal @This is the avbuffer free callback for input pictures.
+ *
+ * @param opaque pointer to the duplicated ubuf
+ * @param data avbuffer data
+ */
+static void upipe_avcenc_free_ubuf_cb(void *opaque, uint8_t *data)
+{
+    struct ubuf *ubuf = opaque;
+    ubuf_free(ubuf);
+}
+
 /** @internal @This encodes video frames.
  *
  * @param upipe description structure of the pipe
@@ -875,19 +886,41 @@ static void upipe_avcenc_encode_video(struct upipe *upipe,
              upipe_avcenc->chroma_map[i] != NULL; i++) {
             const uint8_t *data;
             size_t stride;
+            uint8_t vsub;
             if (unlikely(!ubase_check(uref_pic_plane_read(
                             uref, upipe_avcenc->chroma_map[i],
                             0, 0, -1, -1, &data)) ||
                     !ubase_check(uref_pic_plane_size(
                             uref, upipe_avcenc->chroma_map[i],
-                            &stride, NULL, NULL, NULL)))) {
+                            &stride, NULL, &vsub, NULL)))) {
                 upipe_warn(upipe, "invalid buffer received");
+                av_frame_unref(frame);
                 uref_free(uref);
                 return;
             }
             frame->data[i] = (uint8_t *)data;
             frame->linesize[i] = stride;
+
+            /* make the frame refcounted so that avcodec keeps a reference
+             * to the ubuf instead of copying the plane */
+            struct ubuf *ubuf = ubuf_dup(uref->ubuf);
+            if (ubuf != NULL)
+                frame->buf[i] = av_buffer_create(frame->data[i],
+                                                 stride * vsize / vsub,
+                                                 upipe_avcenc_free_ubuf_cb,
+                                                 ubuf,
+                                                 AV_BUFFER_FLAG_READONLY);
+            if (unlikely(frame->buf[i] == NULL)) {
+                if (ubuf != NULL)
+                    ubuf_free(ubuf);
+                upipe_warn(upipe, "cannot reference buffer");
+                av_frame_unref(frame);
+                uref_free(uref);
+                upipe_throw_error(upipe, UBASE_ERR_ALLOC);
+                return;
+            }
         }
+        frame->extended_data = frame->data;
 
         /* set frame properties */
         frame->format = context->pix_fmt;
@@ -896,6 +929,7 @@ static void upipe_avcenc_encode_video(struct upipe *upipe,
 
         if (!ubase_check(upipe_av_set_frame_properties(
                     upipe, frame, upipe_avcenc->flow_def_attr, uref))) {
+            av_frame_unref(frame);
             uref_free(uref);
             return;
         }
@@ -40,6 +40,9 @@
 #include "upipe/upipe_helper_upipe.h"
 #include "upipe/upipe_helper_urefcount.h"
 #include "upipe/upipe_helper_void.h"
+#include "upipe/upipe_helper_output.h"
+#include "upipe/upipe_helper_uref_mgr.h"
+#include "upipe/upipe_helper_ubuf_mgr.h"
 #include "upipe/upipe_helper_flow_def_check.h"
 #include "upipe/upipe_helper_subpipe.h"
 #include "upipe/upipe_helper_sync.h"
@@ -53,16 +56,41 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <libavutil/dict.h>
 #include <libavformat/avformat.h>
 
+/** size of the buffer of the I/O context writing to the output */
+#define AVIO_BUFFER_SIZE 32768
+
 /** @internal @This is the private context of an avformat source pipe. */
 struct upipe_avfsink {
     /** refcount management structure */
     struct urefcount urefcount;
 
+    /** pipe acting as output */
+    struct upipe *output;
+    /** output flow definition */
+    struct uref *flow_def;
+    /** output state */
+    enum upipe_helper_output_state output_state;
+    /** list of output requests */
+    struct uchain request_list;
+
+    /** uref manager */
+    struct uref_mgr *uref_mgr;
+    /** uref manager request */
+    struct urequest uref_mgr_request;
+
+    /** ubuf manager */
+    struct ubuf_mgr *ubuf_mgr;
+    /** flow format packet */
+    struct uref *flow_format;
+    /** ubuf manager request */
+    struct urequest ubuf_mgr_request;
+
     /** list of subs */
     struct uchain subs;
 
@@ -81,6 +109,10 @@ struct upipe_avfsink {
     AVFormatContext *context;
     /** true if the header has already been written */
     bool opened;
+    /** true if the I/O context writes to the output instead of the URI */
+    bool avio_output;
+    /** blocks written by the muxer and not output yet */
+    struct uchain blocks;
     /** offset between Upipe timestamp and avformat timestamp */
     uint64_t ts_offset;
     /** first DTS */
@@ -100,6 +132,13 @@ struct upipe_avfsink {
 UPIPE_HELPER_UPIPE(upipe_avfsink, upipe, UPIPE_AVFSINK_SIGNATURE)
 UPIPE_HELPER_UREFCOUNT(upipe_avfsink, urefcount, upipe_avfsink_free)
 UPIPE_HELPER_VOID(upipe_avfsink)
+UPIPE_HELPER_OUTPUT(upipe_avfsink, output, flow_def, output_state, request_list)
+UPIPE_HELPER_UREF_MGR(upipe_avfsink, uref_mgr, uref_mgr_request, NULL,
+                      upipe_throw_provide_request, NULL)
+UPIPE_HELPER_UBUF_MGR(upipe_avfsink, ubuf_mgr, flow_format, ubuf_mgr_request,
+                      NULL,
+                      upipe_avfsink_register_output_request,
+                      upipe_avfsink_unregister_output_request)
 UPIPE_HELPER_SYNC(upipe_avfsink, acquired)
 
 /** @internal @This is the private context of an output of an avformat source
@@ -725,6 +764,9 @@ static struct upipe *upipe_avfsink_alloc(struct upipe_mgr *mgr,
 
     struct upipe_avfsink *upipe_avfsink = upipe_avfsink_from_upipe(upipe);
     upipe_avfsink_init_urefcount(upipe);
+    upipe_avfsink_init_output(upipe);
+    upipe_avfsink_init_uref_mgr(upipe);
+    upipe_avfsink_init_ubuf_mgr(upipe);
     upipe_avfsink_init_sub_subs(upipe);
     upipe_avfsink_init_sub_mgr(upipe);
     upipe_avfsink_init_sync(upipe);
@@ -737,6 +779,8 @@ static struct upipe *upipe_avfsink_alloc(struct upipe_mgr *mgr,
     upipe_avfsink->options = NULL;
     upipe_avfsink->context = NULL;
     upipe_avfsink->opened = false;
+    upipe_avfsink->avio_output = false;
+    ulist_init(&upipe_avfsink->blocks);
     upipe_avfsink->ts_offset = UINT64_MAX;
     upipe_avfsink->first_dts = 0;
     upipe_avfsink->highest_next_dts = 0;
@@ -772,6 +816,133 @@ static struct upipe_avfsink_sub *upipe_avfsink_find_input(struct upipe *upipe)
     return earliest_input;
 }
 
+/** @internal @This is called by libavformat to write multiplexed data. The
+ * data is copied to a block which is output after the muxer returns.
+ *
+ * @param opaque description structure of the pipe
+ * @param buf octets to write
+ * @param size size of buf
+ * @return number of octets written, or an avformat error code
+ */
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+static int upipe_avfsink_avio_write(void *opaque, uint8_t *buf, int size)
+#else
+static int upipe_avfsink_avio_write(void *opaque, const uint8_t *buf, int size)
+#endif
+{
+    struct upipe *upipe = opaque;
+    struct upipe_avfsink *upipe_avfsink = upipe_avfsink_from_upipe(upipe);
+    struct uref *uref = uref_block_alloc(upipe_avfsink->uref_mgr,
+                                         upipe_avfsink->ubuf_mgr, size);
+    if (unlikely(uref == NULL))
+        return AVERROR(ENOMEM);
+
+    uint8_t *buffer;
+    int write_size = -1;
+    if (unlikely(!ubase_check(uref_block_write(uref, 0, &write_size,
+                                               &buffer)))) {
+        uref_free(uref);
+        return AVERROR(ENOMEM);
+    }
+    assert(write_size == size);
+    memcpy(buffer, buf, size);
+    uref_block_unmap(uref, 0);
+    ulist_add(&upipe_avfsink->blocks, uref_to_uchain(uref));
+    return size;
+}
+
+/** @internal @This allocates an I/O context writing to the output.
+ *
+ * @param upipe description structure of the pipe
+ * @return 0 or an avformat error code
+ */
+static int upipe_avfsink_avio_alloc(struct upipe *upipe)
+{
+    struct upipe_avfsink *upipe_avfsink = upipe_avfsink_from_upipe(upipe);
+    AVFormatContext *context = upipe_avfsink->context;
+
+    if (unlikely(!upipe_avfsink_demand_uref_mgr(upipe)))
+        return AVERROR(ENOMEM);
+    if (upipe_avfsink->ubuf_mgr == NULL) {
+        struct uref *flow_def =
+            uref_block_flow_alloc_def_va(upipe_avfsink->uref_mgr, "%s.",
+                                         context->oformat->name);
+        if (unlikely(flow_def == NULL))
+            return AVERROR(ENOMEM);
+        if (unlikely(!upipe_avfsink_demand_ubuf_mgr(upipe,
+                                                    uref_dup(flow_def)))) {
+            uref_free(flow_def);
+            return AVERROR(ENOMEM);
+        }
+        upipe_avfsink_store_flow_def(upipe, flow_def);
+    }
+
+    unsigned char *buffer = av_malloc(AVIO_BUFFER_SIZE);
+    if (unlikely(buffer == NULL))
+        return AVERROR(ENOMEM);
+    context->pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, upipe,
+                                     NULL, upipe_avfsink_avio_write, NULL);
+    if (unlikely(context->pb == NULL)) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    /* what has been output can't be rewritten */
+    context->pb->seekable = 0;
+    return 0;
+}
+
+/** @internal @This outputs the blocks written by the muxer.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the last buffer
+ */
+static void upipe_avfsink_output_blocks(struct upipe *upipe,
+                                        struct upump **upump_p)
+{
+    struct upipe_avfsink *upipe_avfsink = upipe_avfsink_from_upipe(upipe);
+    if (upipe_avfsink->avio_output)
+        avio_flush(upipe_avfsink->context->pb);
+
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&upipe_avfsink->blocks)) != NULL)
+        upipe_avfsink_output(upipe, uref_from_uchain(uchain), upump_p);
+}
+
+/** @internal @This closes the I/O context of the muxer. When writing to the
+ * output, the last block of the file is marked as the end of a logical
+ * block.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the last buffer
+ */
+static void upipe_avfsink_avio_close(struct upipe *upipe,
+                                     struct upump **upump_p)
+{
+    struct upipe_avfsink *upipe_avfsink = upipe_avfsink_from_upipe(upipe);
+    AVFormatContext *context = upipe_avfsink->context;
+
+    if (context->oformat->flags & AVFMT_NOFILE)
+        return;
+    if (!upipe_avfsink->avio_output) {
+        avio_close(context->pb);
+        return;
+    }
+
+    avio_flush(context->pb);
+    av_freep(&context->pb->buffer);
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 80, 100)
+    av_freep(&context->pb);
+#else
+    avio_context_free(&context->pb);
+#endif
+    upipe_avfsink->avio_output = false;
+
+    struct uchain *uchain = ulist_peek_last(&upipe_avfsink->blocks);
+    if (uchain != NULL)
+        uref_block_set_end(uref_from_uchain(uchain));
+    upipe_avfsink_output_blocks(upipe, upump_p);
+}
+
 static int upipe_avfsink_avio_open(struct upipe *upipe, struct upipe_avfsink_sub *input)
 {
     struct upipe_avfsink *upipe_avfsink = upipe_avfsink_from_upipe(upipe);
@@ -785,11 +956,17 @@ static int upipe_avfsink_avio_open(struct upipe *upipe, struct upipe_avfsink_sub
     char *url = upipe_avfsink->context->url;
 #endif
 
-    AVDictionary *options = NULL;
-    av_dict_copy(&options, upipe_avfsink->options, 0);
-    int error = avio_open2(&upipe_avfsink->context->pb, url,
+    int error;
+    if (upipe_avfsink->output != NULL) {
+        error = upipe_avfsink_avio_alloc(upipe);
+        upipe_avfsink->avio_output = error >= 0;
+    } else {
+        AVDictionary *options = NULL;
+        av_dict_copy(&options, upipe_avfsink->options, 0);
+        error = avio_open2(&upipe_avfsink->context->pb, url,
                            AVIO_FLAG_WRITE, NULL, &options);
-    av_dict_free(&options);
+        av_dict_free(&options);
+    }
     if (error < 0) {
         upipe_err_va(upipe, "couldn't open file %s (%s)", url,
                      av_err2str(error));
@@ -918,6 +1095,7 @@ static void upipe_avfsink_mux(struct upipe *upipe, struct upump **upump_p)
             while ((e = av_dict_get(options, "", e, AV_DICT_IGNORE_SUFFIX)))
                 upipe_warn_va(upipe, "unknown option \"%s\"", e->key);
             av_dict_free(&options);
+            upipe_avfsink_output_blocks(upipe, upump_p);
 
             /* write init section */
             if (upipe_avfsink->init_uri != NULL) {
@@ -930,8 +1108,7 @@ static void upipe_avfsink_mux(struct upipe *upipe, struct upump **upump_p)
                 }
                 upipe_notice_va(upipe, "closing init URI %s",
                                 upipe_avfsink->init_uri);
-                if (!(upipe_avfsink->context->oformat->flags & AVFMT_NOFILE))
-                    avio_close(upipe_avfsink->context->pb);
+                upipe_avfsink_avio_close(upipe, upump_p);
 #if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 7, 100)
                 snprintf(upipe_avfsink->context->filename,
                          sizeof (upipe_avfsink->context->filename),
@@ -1042,6 +1219,7 @@ static void upipe_avfsink_mux(struct upipe *upipe, struct upump **upump_p)
 
         int error = av_write_frame(upipe_avfsink->context, &avpkt);
         av_packet_unref(&avpkt);
+        upipe_avfsink_output_blocks(upipe, upump_p);
 
         if (unlikely(error < 0)) {
             upipe_warn_va(upipe, "write error to %s (%s)", upipe_avfsink->uri,
@@ -1233,8 +1411,7 @@ static int upipe_avfsink_set_uri(struct upipe *upipe, const char *uri)
         if (upipe_avfsink->opened) {
             upipe_dbg(upipe, "writing trailer");
             av_write_trailer(upipe_avfsink->context);
-            if (!(upipe_avfsink->context->oformat->flags & AVFMT_NOFILE))
-                avio_close(upipe_avfsink->context->pb);
+            upipe_avfsink_avio_close(upipe, NULL);
         }
         avformat_free_context(upipe_avfsink->context);
     }
@@ -1391,6 +1568,10 @@ static int upipe_avfsink_control(struct upipe *upipe, int command, va_list args)
             struct uref *flow_def = va_arg(args, struct uref *);
             return upipe_avfsink_set_flow_def(upipe, flow_def);
         }
+        case UPIPE_GET_FLOW_DEF:
+        case UPIPE_GET_OUTPUT:
+        case UPIPE_SET_OUTPUT:
+            return upipe_avfsink_control_output(upipe, command, args);
         case UPIPE_GET_OPTION: {
             const char *option = va_arg(args, const char *);
             const char **content_p = va_arg(args, const char **);
@@ -1489,7 +1670,16 @@ static void upipe_avfsink_free(struct upipe *upipe)
 
     av_dict_free(&upipe_avfsink->options);
 
+    struct uchain *uchain, *uchain_tmp;
+    ulist_delete_foreach (&upipe_avfsink->blocks, uchain, uchain_tmp) {
+        ulist_delete(uchain);
+        uref_free(uref_from_uchain(uchain));
+    }
+
     upipe_avfsink_clean_sync(upipe);
+    upipe_avfsink_clean_ubuf_mgr(upipe);
+    upipe_avfsink_clean_uref_mgr(upipe);
+    upipe_avfsink_clean_output(upipe);
     upipe_avfsink_clean_urefcount(upipe);
     upipe_avfsink_free_void(upipe);
 }
@@ -31,6 +31,7 @@
 #include "upipe/uprobe.h"
 #include "upipe/uprobe_prefix.h"
 #include "upipe/uclock.h"
+#include "upipe/ueventfd.h"
 #include "upipe/uref.h"
 #include "upipe/uref_block.h"
 #include "upipe/uref_block_flow.h"
@@ -48,6 +49,7 @@
 #include "upipe/upipe_helper_uref_mgr.h"
 #include "upipe/upipe_helper_upump_mgr.h"
 #include "upipe/upipe_helper_upump.h"
+#include "upipe/upipe_helper_input.h"
 #include "upipe/upipe_helper_uclock.h"
 #include "upipe/upipe_helper_output.h"
 #include "upipe/upipe_helper_ubuf_mgr.h"
@@ -64,7 +66,10 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <libavutil/dict.h>
 #include <libavformat/avformat.h>
@@ -75,6 +80,14 @@
 #define PCR_OFFSET (UCLOCK_FREQ * 3)
 /** 1/UCLOCK_FREQ time base */
 #define UCLOCK_TIME_BASE (AVRational){ 1, UCLOCK_FREQ }
+/** default minimum buffered input before running the demuxer */
+#define READ_AHEAD_DEFAULT (1024 * 1024)
+/** minimum read-ahead (lowest probe size accepted by libavformat) */
+#define READ_AHEAD_MIN 2048
+/** size of the buffer of the I/O context reading the buffered input */
+#define AVIO_BUFFER_SIZE 32768
+/** maximum number of demuxed packets waiting to be output */
+#define DEMUX_PACKETS_MAX 64
 
 /** @internal @This is the private context of an avfsrc manager. */
 struct upipe_avfsrc_mgr {
@@ -119,7 +132,7 @@ struct upipe_avfsrc {
 
     /** upump manager */
     struct upump_mgr *upump_mgr;
-    /** read watcher */
+    /** read watcher, or demuxer thread watcher in input mode */
     struct upump *upump;
     /** offset between libavformat timestamps and Upipe timestamps */
     int64_t timestamp_offset;
@@ -148,11 +161,63 @@ struct upipe_avfsrc {
     /** true if the URL has already been probed by avformat */
     bool probed;
 
+    /** true if the pipe is fed by an upstream pipe instead of an URL */
+    bool input_mode;
+    /** minimum buffered input before running the demuxer, in octets */
+    uint64_t read_ahead;
+    /** I/O context reading from the buffered input */
+    AVIOContext *avio;
+    /** buffered input not consumed by the demuxer yet */
+    struct ubuf *input;
+    /** size of the buffered input */
+    size_t input_size;
+    /** position in the stream of the first buffered octet */
+    uint64_t input_offset;
+    /** position in the stream of the next octet given to the I/O context */
+    uint64_t avio_offset;
+    /** true if the end of the input was received */
+    bool input_end;
+    /** true if the I/O context asked for input not received yet, during
+     * the probe */
+    bool underrun;
+
     /** manager to create subs */
     struct upipe_mgr sub_mgr;
 
     /** per-AVStream flow def */
     struct uref **streams;
+    /** number of streams found by the probe */
+    unsigned int nb_streams;
+
+    /** true if the demuxer thread is running */
+    bool demux_started;
+    /** demuxer thread */
+    pthread_t demux_thread;
+    /** mutex protecting the buffered input and the demuxed packets */
+    pthread_mutex_t demux_mutex;
+    /** condition signaled to wake up the demuxer thread */
+    pthread_cond_t demux_cond;
+    /** true if the demuxer thread must exit */
+    bool demux_quit;
+    /** true if the demuxer thread waits for input */
+    bool demux_waiting;
+    /** error that stopped the demuxer thread, or 0 */
+    int demux_error;
+    /** list of packets demuxed by the thread */
+    struct uchain demux_packets;
+    /** number of packets in the list */
+    unsigned int nb_demux_packets;
+    /** event signaled by the demuxer thread */
+    struct ueventfd demux_event;
+
+    /** temporary uref storage (used during urequest) */
+    struct uchain urefs;
+    /** nb urefs in storage */
+    unsigned int nb_urefs;
+    /** max urefs in storage */
+    unsigned int max_urefs;
+    /** list of blockers (used during urequest) */
+    struct uchain blockers;
 
     /** public upipe structure */
     struct upipe upipe;
@@ -171,6 +236,23 @@ UPIPE_HELPER_UCLOCK(upipe_avfsrc, uclock, uclock_request, NULL,
 UPIPE_HELPER_UPUMP_MGR(upipe_avfsrc, upump_mgr)
 UPIPE_HELPER_UPUMP(upipe_avfsrc, upump, upump_mgr)
 
+/** @hidden */
+static bool upipe_avfsrc_handle(struct upipe *upipe, struct uref *uref,
+                                struct upump **upump_p);
+
+UPIPE_HELPER_INPUT(upipe_avfsrc, urefs, nb_urefs, max_urefs, blockers,
+                   upipe_avfsrc_handle)
+
+/** @internal @This is a packet demuxed by the demuxer thread. */
+struct upipe_avfsrc_packet {
+    /** structure for double-linked lists */
+    struct uchain uchain;
+    /** packet, with timestamps in clock units */
+    AVPacket pkt;
+};
+
+UBASE_FROM_TO(upipe_avfsrc_packet, uchain, uchain, uchain)
+
 UBASE_FROM_TO(upipe_avfsrc, urefcount, urefcount_real, urefcount_real)
 
 /** @hidden */
@@ -292,8 +374,7 @@ static struct upipe *upipe_avfsrc_sub_alloc(struct upipe_mgr *mgr,
     }
 
     /* select the stream */
-    if (upipe_avfsrc->context == NULL ||
-        id >= upipe_avfsrc->context->nb_streams) {
+    if (upipe_avfsrc->context == NULL || id >= upipe_avfsrc->nb_streams) {
         upipe_warn_va(upipe, "ID %"PRIu64" doesn't exist", id);
         upipe_release(upipe);
         return NULL;
@@ -486,6 +567,7 @@ static struct upipe *upipe_avfsrc_alloc(struct upipe_mgr *mgr,
     upipe_avfsrc_init_upump_mgr(upipe);
     upipe_avfsrc_init_upump(upipe);
     upipe_avfsrc_init_uclock(upipe);
+    upipe_avfsrc_init_input(upipe);
     upipe_avfsrc->timestamp_offset = 0;
     upipe_avfsrc->timestamp_highest = AV_CLOCK_MIN;
     upipe_avfsrc->systime_rap = UINT64_MAX;
@@ -498,6 +580,27 @@ static struct upipe *upipe_avfsrc_alloc(struct upipe_mgr *mgr,
     upipe_avfsrc->options = NULL;
     upipe_avfsrc->context = NULL;
     upipe_avfsrc->probed = false;
+
+    upipe_avfsrc->input_mode = false;
+    upipe_avfsrc->read_ahead = READ_AHEAD_DEFAULT;
+    upipe_avfsrc->avio = NULL;
+    upipe_avfsrc->input = NULL;
+    upipe_avfsrc->input_size = 0;
+    upipe_avfsrc->input_offset = 0;
+    upipe_avfsrc->avio_offset = 0;
+    upipe_avfsrc->input_end = false;
+    upipe_avfsrc->underrun = false;
+    upipe_avfsrc->streams = NULL;
+    upipe_avfsrc->nb_streams = 0;
+
+    upipe_avfsrc->demux_started = false;
+    pthread_mutex_init(&upipe_avfsrc->demux_mutex, NULL);
+    pthread_cond_init(&upipe_avfsrc->demux_cond, NULL);
+    upipe_avfsrc->demux_quit = false;
+    upipe_avfsrc->demux_waiting = false;
+    upipe_avfsrc->demux_error = 0;
+    ulist_init(&upipe_avfsrc->demux_packets);
+    upipe_avfsrc->nb_demux_packets = 0;
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -517,6 +620,174 @@ static void upipe_avfsrc_abort_av_deal(struct upipe *upipe)
     }
 }
 
+/** @internal @This copies the buffered input at the position of the I/O
+ * context. In the demuxer thread, it is called with the mutex locked.
+ *
+ * @param upipe description structure of the pipe
+ * @param buf filled in with the read octets
+ * @param size size of buf
+ * @return number of octets read, or an avformat error code
+ */
+static int upipe_avfsrc_avio_extract(struct upipe *upipe, uint8_t *buf,
+                                     int size)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    uint64_t offset = upipe_avfsrc->avio_offset - upipe_avfsrc->input_offset;
+    if (offset >= upipe_avfsrc->input_size) {
+        if (upipe_avfsrc->input_end)
+            return AVERROR_EOF;
+        upipe_avfsrc->underrun = true;
+        return AVERROR(EAGAIN);
+    }
+
+    if (size > upipe_avfsrc->input_size - offset)
+        size = upipe_avfsrc->input_size - offset;
+    if (unlikely(!ubase_check(ubuf_block_extract(upipe_avfsrc->input, offset,
+                                                 size, buf))))
+        return AVERROR(EIO);
+    upipe_avfsrc->avio_offset += size;
+    return size;
+}
+
+/** @internal @This is called by libavformat to read from the buffered input.
+ * In the demuxer thread, it waits until the input is received. During the
+ * probe, which runs in the pipe thread, it reports an underrun instead of
+ * blocking.
+ *
+ * @param opaque description structure of the pipe
+ * @param buf filled in with the read octets
+ * @param size size of buf
+ * @return number of octets read, or an avformat error code
+ */
+static int upipe_avfsrc_avio_read(void *opaque, uint8_t *buf, int size)
+{
+    struct upipe *upipe = opaque;
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (!upipe_avfsrc->demux_started)
+        return upipe_avfsrc_avio_extract(upipe, buf, size);
+
+    pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+    while (!upipe_avfsrc->demux_quit && !upipe_avfsrc->input_end &&
+           upipe_avfsrc->avio_offset >=
+           upipe_avfsrc->input_offset + upipe_avfsrc->input_size) {
+        if (!upipe_avfsrc->demux_waiting) {
+            /* let the pipe release the held input */
+            upipe_avfsrc->demux_waiting = true;
+            ueventfd_write(&upipe_avfsrc->demux_event);
+        }
+        pthread_cond_wait(&upipe_avfsrc->demux_cond,
+                          &upipe_avfsrc->demux_mutex);
+    }
+    upipe_avfsrc->demux_waiting = false;
+    int ret = upipe_avfsrc->demux_quit ? AVERROR_EXIT :
+              upipe_avfsrc_avio_extract(upipe, buf, size);
+    pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+    return ret;
+}
+
+/** @internal @This is called by libavformat to seek in the buffered input.
+ * Seeking before the octets consumed by the demuxer is not possible, and the
+ * size of the stream is only known at the end of the input.
+ *
+ * @param opaque description structure of the pipe
+ * @param offset offset to seek to
+ * @param whence origin of the offset
+ * @return new position in the stream, or an avformat error code
+ */
+static int64_t upipe_avfsrc_avio_seek(void *opaque, int64_t offset,
+                                      int whence)
+{
+    struct upipe *upipe = opaque;
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (upipe_avfsrc->demux_started)
+        pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+    uint64_t end = upipe_avfsrc->input_offset + upipe_avfsrc->input_size;
+
+    if (whence & AVSEEK_SIZE) {
+        offset = upipe_avfsrc->input_end ? end : AVERROR(ENOSYS);
+        goto unlock;
+    }
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET:
+            break;
+        case SEEK_CUR:
+            offset += upipe_avfsrc->avio_offset;
+            break;
+        case SEEK_END:
+            if (!upipe_avfsrc->input_end) {
+                offset = AVERROR(ENOSYS);
+                goto unlock;
+            }
+            offset += end;
+            break;
+        default:
+            offset = AVERROR(EINVAL);
+            goto unlock;
+    }
+
+    if (offset < 0 || offset < upipe_avfsrc->input_offset)
+        offset = AVERROR(EINVAL);
+    else
+        upipe_avfsrc->avio_offset = offset;
+
+unlock:
+    if (upipe_avfsrc->demux_started)
+        pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+    return offset;
+}
+
+/** @internal @This releases the buffered input and the I/O context reading
+ * it.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_avfsrc_clean_buffered(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (upipe_avfsrc->avio != NULL) {
+        av_freep(&upipe_avfsrc->avio->buffer);
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(57, 80, 100)
+        av_freep(&upipe_avfsrc->avio);
+#else
+        avio_context_free(&upipe_avfsrc->avio);
+#endif
+    }
+    if (upipe_avfsrc->input != NULL) {
+        ubuf_free(upipe_avfsrc->input);
+        upipe_avfsrc->input = NULL;
+    }
+    upipe_avfsrc->input_size = 0;
+    upipe_avfsrc->input_offset = 0;
+    upipe_avfsrc->avio_offset = 0;
+    upipe_avfsrc->input_end = false;
+    upipe_avfsrc->underrun = false;
+    upipe_avfsrc->demux_error = 0;
+}
+
+/** @internal @This releases the buffered input consumed by the demuxer. It
+ * is called by the demuxer thread with the mutex locked.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_avfsrc_consume_input(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    int64_t position = avio_tell(upipe_avfsrc->avio);
+    if (position <= (int64_t)upipe_avfsrc->input_offset)
+        return;
+
+    size_t consumed = position - upipe_avfsrc->input_offset;
+    if (consumed >= upipe_avfsrc->input_size) {
+        consumed = upipe_avfsrc->input_size;
+        ubuf_free(upipe_avfsrc->input);
+        upipe_avfsrc->input = NULL;
+    } else
+        ubuf_block_resize(upipe_avfsrc->input, consumed, -1);
+    upipe_avfsrc->input_offset += consumed;
+    upipe_avfsrc->input_size -= consumed;
+}
+
 /** @internal @This finds the given id in the list of output subpipes.
  *
  * @param upipe description structure of the pipe
@@ -552,8 +823,17 @@ static void upipe_avfsrc_update_cr(struct upipe *upipe)
         struct upipe_avfsrc_sub *output =
             upipe_avfsrc_sub_from_uchain(uchain);
 
-        AVStream *stream = upipe_avfsrc->context->streams[output->id];
-        enum AVMediaType current_type = stream->codecpar->codec_type;
+        /* the context belongs to the demuxer thread in input mode, so the
+         * type is retrieved from the flow definition of the probe */
+        struct uref *flow_def = upipe_avfsrc->streams[output->id];
+        const char *def = "";
+        if (flow_def != NULL)
+            uref_flow_get_def(flow_def, &def);
+        enum AVMediaType current_type = AVMEDIA_TYPE_UNKNOWN;
+        if (strstr(def, "sound.") != NULL)
+            current_type = AVMEDIA_TYPE_AUDIO;
+        else if (strstr(def, "pic.") != NULL && strstr(def, "pic.sub.") == NULL)
+            current_type = AVMEDIA_TYPE_VIDEO;
 
         switch (current_type) {
             case AVMEDIA_TYPE_VIDEO:
@@ -581,46 +861,34 @@ static void upipe_avfsrc_update_cr(struct upipe *upipe)
     upipe_avfsrc->cr_id = cr_id;
 }
 
-/** @internal @This reads data from the source and outputs it.
- * It is called either when the idler triggers (permanent storage mode) or
- * when data is available on the file descriptor (live stream mode).
+/** @internal @This outputs a packet read from the demuxer.
  *
- * @param upump description structure of the read watcher
+ * @param upipe description structure of the pipe
+ * @param pkt packet with timestamps in clock units, unreferenced by this
+ * function
+ * @param upump_p reference to pump that generated the buffer
  */
-static void upipe_avfsrc_worker(struct upump *upump)
+static void upipe_avfsrc_output_packet(struct upipe *upipe, AVPacket *pkt,
+                                       struct upump **upump_p)
 {
-    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
     struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
-    AVPacket pkt;
-
-    int error = av_read_frame(upipe_avfsrc->context, &pkt);
-    if (unlikely(error < 0)) {
-        if (error != AVERROR_EOF) {
-            upipe_err_va(upipe, "read error from %s (%s)",
-                         upipe_avfsrc->url, av_err2str(error));
-        }
-        upipe_avfsrc_set_upump(upipe, NULL);
-        upipe_throw_source_end(upipe);
-        return;
-    }
-
     struct upipe_avfsrc_sub *output =
-        upipe_avfsrc_find_output(upipe, pkt.stream_index);
+        upipe_avfsrc_find_output(upipe, pkt->stream_index);
     if (output == NULL) {
-        av_packet_unref(&pkt);
+        av_packet_unref(pkt);
         return;
     }
     if (unlikely(output->ubuf_mgr == NULL)) {
         if (unlikely(!upipe_avfsrc_sub_demand_ubuf_mgr(upipe_avfsrc_sub_to_upipe(output), uref_dup(output->flow_def)))) {
-            av_packet_unref(&pkt);
+            av_packet_unref(pkt);
             return;
         }
     }
 
     struct uref *uref = uref_block_alloc(upipe_avfsrc->uref_mgr,
-                                         output->ubuf_mgr, pkt.size);
+                                         output->ubuf_mgr, pkt->size);
     if (unlikely(uref == NULL)) {
-        av_packet_unref(&pkt);
+        av_packet_unref(pkt);
         upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
         return;
     }
@@ -628,44 +896,41 @@ static void upipe_avfsrc_worker(struct upump *upump)
     if (upipe_avfsrc->cr_id == UINT64_MAX)
         upipe_avfsrc_update_cr(upipe);
 
-    AVStream *stream = upipe_avfsrc->context->streams[pkt.stream_index];
     uint64_t systime = upipe_avfsrc->uclock != NULL ?
                        uclock_now(upipe_avfsrc->uclock) : UINT64_MAX;
     uint8_t *buffer;
     int read_size = -1;
     if (unlikely(!ubase_check(uref_block_write(uref, 0, &read_size, &buffer)))) {
         uref_free(uref);
-        av_packet_unref(&pkt);
+        av_packet_unref(pkt);
         upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
         return;
     }
-    assert(read_size == pkt.size);
-    memcpy(buffer, pkt.data, pkt.size);
+    assert(read_size == pkt->size);
+    memcpy(buffer, pkt->data, pkt->size);
     uref_block_unmap(uref, 0);
 
     bool ts = false;
     if (upipe_avfsrc->uclock != NULL)
         uref_clock_set_cr_sys(uref, systime);
-    if (pkt.flags & AV_PKT_FLAG_KEY) {
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
         UBASE_FATAL(upipe, uref_pic_set_key(uref))
         upipe_avfsrc->systime_rap = systime;
     }
 
-    av_packet_rescale_ts(&pkt, stream->time_base, UCLOCK_TIME_BASE);
-
     uint64_t dts_orig = UINT64_MAX, dts_pts_delay = 0;
-    if (pkt.dts != AV_NOPTS_VALUE) {
-        dts_orig = (uint64_t)pkt.dts - INT64_MIN;
-        if (pkt.pts != AV_NOPTS_VALUE) {
-            if (pkt.pts < pkt.dts) {
+    if (pkt->dts != AV_NOPTS_VALUE) {
+        dts_orig = (uint64_t)pkt->dts - INT64_MIN;
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            if (pkt->pts < pkt->dts) {
                 upipe_warn_va(upipe, "pts in the past (pts=%"PRIi64", "
-                              "dts=%"PRIi64")", pkt.pts, pkt.dts);
+                              "dts=%"PRIi64")", pkt->pts, pkt->dts);
             } else {
-                dts_pts_delay = pkt.pts - pkt.dts;
+                dts_pts_delay = pkt->pts - pkt->dts;
             }
         }
-    } else if (pkt.pts != AV_NOPTS_VALUE) {
-        dts_orig = (uint64_t)pkt.pts - INT64_MIN;
+    } else if (pkt->pts != AV_NOPTS_VALUE) {
+        dts_orig = (uint64_t)pkt->pts - INT64_MIN;
     }
 
     if (dts_orig != UINT64_MAX) {
@@ -700,25 +965,272 @@ static void upipe_avfsrc_worker(struct upump *upump)
             upipe_avfsrc->last_cr_id = upipe_avfsrc->cr_id;
         }
     }
-    if (pkt.duration > 0)
-        UBASE_FATAL(upipe, uref_clock_set_duration(uref, pkt.duration))
+    if (pkt->duration > 0)
+        UBASE_FATAL(upipe, uref_clock_set_duration(uref, pkt->duration))
     if (upipe_avfsrc->systime_rap != UINT64_MAX)
         uref_clock_set_rap_sys(uref, upipe_avfsrc->systime_rap);
 
     if (ts)
         upipe_throw_clock_ts(upipe, uref);
-    av_packet_unref(&pkt);
+    av_packet_unref(pkt);
+
+    upipe_input(output->last_inner, uref, upump_p);
+}
+
+/** @internal @This reads a packet from the demuxer and outputs it.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_avfsrc_read(struct upipe *upipe, struct upump **upump_p)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    AVPacket pkt;
+
+    int error = av_read_frame(upipe_avfsrc->context, &pkt);
+    if (unlikely(error < 0)) {
+        if (error != AVERROR_EOF) {
+            upipe_err_va(upipe, "read error from %s (%s)",
+                         upipe_avfsrc->url, av_err2str(error));
+        }
+        upipe_avfsrc_set_upump(upipe, NULL);
+        upipe_throw_source_end(upipe);
+        return;
+    }
+
+    AVStream *stream = upipe_avfsrc->context->streams[pkt.stream_index];
+    av_packet_rescale_ts(&pkt, stream->time_base, UCLOCK_TIME_BASE);
+    upipe_avfsrc_output_packet(upipe, &pkt, upump_p);
+}
+
+/** @internal @This reads data from the source and outputs it.
+ * It is called either when the idler triggers (permanent storage mode) or
+ * when data is available on the file descriptor (live stream mode).
+ *
+ * @param upump description structure of the read watcher
+ */
+static void upipe_avfsrc_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    upipe_avfsrc_read(upipe, &upipe_avfsrc->upump);
+}
+
+/** @internal @This frees the packets demuxed by the thread and not output.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_avfsrc_flush_packets(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&upipe_avfsrc->demux_packets)) != NULL) {
+        struct upipe_avfsrc_packet *packet =
+            upipe_avfsrc_packet_from_uchain(uchain);
+        av_packet_unref(&packet->pkt);
+        free(packet);
+    }
+    upipe_avfsrc->nb_demux_packets = 0;
+}
+
+/** @internal @This is the main function of the demuxer thread, in input
+ * mode. libavformat reads from the buffered input and waits in
+ * @ref upipe_avfsrc_avio_read until the input is received, so that a packet
+ * is never demuxed from a truncated input. The demuxed packets are queued
+ * and output by the pipe thread.
+ *
+ * @param _upipe description structure of the pipe
+ * @return NULL
+ */
+static void *upipe_avfsrc_demux_run(void *_upipe)
+{
+    struct upipe *upipe = _upipe;
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+
+    pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+    for ( ; ; ) {
+        while (!upipe_avfsrc->demux_quit &&
+               upipe_avfsrc->nb_demux_packets >= DEMUX_PACKETS_MAX)
+            pthread_cond_wait(&upipe_avfsrc->demux_cond,
+                              &upipe_avfsrc->demux_mutex);
+        if (upipe_avfsrc->demux_quit)
+            break;
+        pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+
+        struct upipe_avfsrc_packet *packet =
+            malloc(sizeof(struct upipe_avfsrc_packet));
+        int error = packet == NULL ? AVERROR(ENOMEM) :
+                    av_read_frame(upipe_avfsrc->context, &packet->pkt);
+        if (likely(error >= 0)) {
+            AVStream *stream =
+                upipe_avfsrc->context->streams[packet->pkt.stream_index];
+            av_packet_rescale_ts(&packet->pkt, stream->time_base,
+                                 UCLOCK_TIME_BASE);
+        }
+
+        pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+        if (unlikely(error < 0)) {
+            free(packet);
+            if (!upipe_avfsrc->demux_quit) {
+                upipe_avfsrc->demux_error = error;
+                ueventfd_write(&upipe_avfsrc->demux_event);
+            }
+            break;
+        }
+        upipe_avfsrc_consume_input(upipe);
+        ulist_add(&upipe_avfsrc->demux_packets,
+                  upipe_avfsrc_packet_to_uchain(packet));
+        upipe_avfsrc->nb_demux_packets++;
+        ueventfd_write(&upipe_avfsrc->demux_event);
+    }
+    pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+    return NULL;
+}
+
+/** @internal @This stops the demuxer thread, and frees the packets not
+ * output yet.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_avfsrc_demux_stop(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (!upipe_avfsrc->demux_started)
+        return;
+
+    pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+    upipe_avfsrc->demux_quit = true;
+    pthread_cond_signal(&upipe_avfsrc->demux_cond);
+    pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+    pthread_join(upipe_avfsrc->demux_thread, NULL);
+
+    upipe_avfsrc_set_upump(upipe, NULL);
+    upipe_avfsrc_flush_packets(upipe);
+    ueventfd_clean(&upipe_avfsrc->demux_event);
+    upipe_avfsrc->demux_started = false;
+}
+
+/** @internal @This outputs the buffered input once the demuxer thread has
+ * consumed enough of the input, or waits for more.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_avfsrc_resume_input(struct upipe *upipe)
+{
+    bool was_buffered = !upipe_avfsrc_check_input(upipe);
+    upipe_avfsrc_output_input(upipe);
+    upipe_avfsrc_unblock_input(upipe);
+    if (was_buffered && upipe_avfsrc_check_input(upipe)) {
+        /* All packets have been output, release again the pipe that has been
+         * used in @ref upipe_avfsrc_input. */
+        upipe_release(upipe);
+    }
+}
+
+/** @internal @This outputs the packets demuxed by the thread, and resumes
+ * the input held while the thread was busy.
+ *
+ * @param upump description structure of the demuxer thread watcher
+ */
+static void upipe_avfsrc_demux_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    ueventfd_read(&upipe_avfsrc->demux_event);
+    /* the watcher may be freed while outputting packets */
+    upipe_use(upipe);
+
+    for ( ; ; ) {
+        pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+        struct uchain *uchain = ulist_pop(&upipe_avfsrc->demux_packets);
+        if (uchain != NULL) {
+            upipe_avfsrc->nb_demux_packets--;
+            pthread_cond_signal(&upipe_avfsrc->demux_cond);
+        }
+        int error = upipe_avfsrc->demux_error;
+        if (uchain == NULL && error) {
+            /* drop the rest of the input */
+            upipe_avfsrc->input_end = true;
+        }
+        pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+
+        if (uchain == NULL) {
+            if (error) {
+                /* the thread has exited */
+                upipe_avfsrc_demux_stop(upipe);
+                if (error != AVERROR_EOF)
+                    upipe_err_va(upipe, "read error from input (%s)",
+                                 av_err2str(error));
+                upipe_throw_source_end(upipe);
+            }
+            break;
+        }
+
+        struct upipe_avfsrc_packet *packet =
+            upipe_avfsrc_packet_from_uchain(uchain);
+        upipe_avfsrc_output_packet(upipe, &packet->pkt, &upipe_avfsrc->upump);
+        free(packet);
+    }
+
+    upipe_avfsrc_resume_input(upipe);
+    upipe_release(upipe);
+}
 
-    upipe_input(output->last_inner, uref, &upipe_avfsrc->upump);
+/** @internal @This starts the demuxer thread, and the watcher outputting
+ * the demuxed packets.
+ *
+ * @param upipe description structure of the pipe
+ * @return false in case of error
+ */
+static bool upipe_avfsrc_demux_start(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (unlikely(upipe_avfsrc->demux_error))
+        /* the end of the input was already demuxed */
+        return true;
+
+    if (!upipe_avfsrc->demux_started) {
+        if (unlikely(!ueventfd_init(&upipe_avfsrc->demux_event, false))) {
+            upipe_throw_fatal(upipe, UBASE_ERR_EXTERNAL);
+            return false;
+        }
+        upipe_avfsrc->demux_quit = false;
+        upipe_avfsrc->demux_waiting = false;
+        upipe_avfsrc->demux_started = true;
+        if (unlikely(pthread_create(&upipe_avfsrc->demux_thread, NULL,
+                                    upipe_avfsrc_demux_run, upipe) != 0)) {
+            upipe_err(upipe, "can't create demuxer thread");
+            upipe_avfsrc->demux_started = false;
+            ueventfd_clean(&upipe_avfsrc->demux_event);
+            upipe_throw_fatal(upipe, UBASE_ERR_EXTERNAL);
+            return false;
+        }
+    }
+
+    struct upump *upump = ueventfd_upump_alloc(&upipe_avfsrc->demux_event,
+                                               upipe_avfsrc->upump_mgr,
+                                               upipe_avfsrc_demux_worker,
+                                               upipe, upipe->refcount);
+    if (unlikely(upump == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_UPUMP);
+        return false;
+    }
+    upipe_avfsrc_set_upump(upipe, upump);
+    upump_start(upump);
+    return true;
 }
 
 /** @internal @This starts the worker.
  *
  * @param upipe description structure of the pipe
+ * @return false in case of error
  */
 static bool upipe_avfsrc_start(struct upipe *upipe)
 {
     struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (upipe_avfsrc->input_mode)
+        return upipe_avfsrc_demux_start(upipe);
+
     struct upump *upump = upump_alloc_idler(upipe_avfsrc->upump_mgr,
                                             upipe_avfsrc_worker, upipe,
                                             upipe->refcount);
@@ -929,16 +1441,25 @@ static void upipe_avfsrc_probe(struct upump *upump)
     upipe_avfsrc->probed = true;
 
     if (unlikely(error < 0)) {
-        upipe_err_va(upipe, "can't probe URL %s (%s)", upipe_avfsrc->url,
-                     av_err2str(error));
+        upipe_err_va(upipe, "can't probe URL %s (%s)",
+                     upipe_avfsrc->url ?: "input", av_err2str(error));
         if (likely(upipe_avfsrc->url != NULL))
             upipe_notice_va(upipe, "closing URL %s", upipe_avfsrc->url);
         avformat_close_input(&upipe_avfsrc->context);
         upipe_avfsrc->context = NULL;
+        upipe_avfsrc_clean_buffered(upipe);
         ubase_clean_str(&upipe_avfsrc->url);
         return;
     }
 
+    if (upipe_avfsrc->input_mode && upipe_avfsrc->underrun) {
+        /* the probe stopped at the end of the buffered input */
+        upipe_avfsrc->underrun = false;
+        context->pb->eof_reached = 0;
+        context->pb->error = 0;
+    }
+
+    upipe_avfsrc->nb_streams = context->nb_streams;
     upipe_avfsrc->streams = calloc(context->nb_streams, sizeof(struct uref *));
 
     for (int i = 0; i < context->nb_streams; i++) {
@@ -1025,7 +1546,7 @@ static int upipe_avfsrc_iterate(struct upipe *upipe, struct uref **p)
         id++;
     }
 
-    while (id < context->nb_streams) {
+    while (id < upipe_avfsrc->nb_streams) {
         struct uref *flow_def = upipe_avfsrc->streams[id];
         if (flow_def) {
             *p = flow_def;
@@ -1081,6 +1602,28 @@ static int _upipe_avfsrc_set_option(struct upipe *upipe, const char *option,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This outputs an empty void flow, before the flow definitions
+ * of the streams are known.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int upipe_avfsrc_output_void(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (unlikely(!upipe_avfsrc_demand_uref_mgr(upipe)))
+        return UBASE_ERR_ALLOC;
+    upipe_avfsrc_check_upump_mgr(upipe);
+
+    struct uref *flow_def = uref_alloc_control(upipe_avfsrc->uref_mgr);
+    uref_flow_set_def(flow_def, "void.");
+    upipe_avfsrc_store_flow_def(upipe, flow_def);
+    /* Force sending flow def */
+    struct uref *uref = uref_alloc(upipe_avfsrc->uref_mgr);
+    upipe_avfsrc_output(upipe, uref, NULL);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This returns the currently opened URL.
  *
  * @param upipe description structure of the pipe
@@ -1108,28 +1651,29 @@ static int upipe_avfsrc_set_uri(struct upipe *upipe, const char *url)
     if (unlikely(upipe_avfsrc->context != NULL)) {
         if (likely(upipe_avfsrc->url != NULL))
             upipe_notice_va(upipe, "closing URL %s", upipe_avfsrc->url);
+        upipe_avfsrc_demux_stop(upipe);
         avformat_close_input(&upipe_avfsrc->context);
         upipe_avfsrc->context = NULL;
         upipe_avfsrc_set_upump(upipe, NULL);
         upipe_avfsrc_abort_av_deal(upipe);
         upipe_avfsrc_throw_sub_subs(upipe, UPROBE_SOURCE_END);
+        for (unsigned i = 0; i < upipe_avfsrc->nb_streams; i++)
+            uref_free(upipe_avfsrc->streams[i]);
         free(upipe_avfsrc->streams);
+        upipe_avfsrc->streams = NULL;
+        upipe_avfsrc->nb_streams = 0;
     }
+    upipe_avfsrc_clean_buffered(upipe);
+    upipe_avfsrc->input_mode = false;
     ubase_clean_str(&upipe_avfsrc->url);
+    /* drop the input held for the previous stream */
+    if (upipe_avfsrc_flush_input(upipe))
+        upipe_release(upipe);
 
     if (unlikely(url == NULL))
         return UBASE_ERR_NONE;
 
-    if (unlikely(!upipe_avfsrc_demand_uref_mgr(upipe)))
-        return UBASE_ERR_ALLOC;
-    upipe_avfsrc_check_upump_mgr(upipe);
-
-    struct uref *flow_def = uref_alloc_control(upipe_avfsrc->uref_mgr);
-    uref_flow_set_def(flow_def, "void.");
-    upipe_avfsrc_store_flow_def(upipe, flow_def);
-    /* Force sending flow def */
-    struct uref *uref = uref_alloc(upipe_avfsrc->uref_mgr);
-    upipe_avfsrc_output(upipe, uref, NULL);
+    UBASE_RETURN(upipe_avfsrc_output_void(upipe))
 
     AVDictionary *options = NULL;
     av_dict_copy(&options, upipe_avfsrc->options, 0);
@@ -1182,6 +1726,265 @@ static int _upipe_avfsrc_set_time(struct upipe *upipe, uint64_t time)
     return UBASE_ERR_UNHANDLED;
 }
 
+/** @internal @This checks if the source may be probed or started.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int upipe_avfsrc_check(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (upipe_avfsrc->upump_mgr == NULL || upipe_avfsrc->context == NULL ||
+        upipe_avfsrc->upump != NULL)
+        return UBASE_ERR_NONE;
+
+    if (unlikely(upipe_avfsrc->probed))
+        return upipe_avfsrc_start(upipe) ? UBASE_ERR_NONE : UBASE_ERR_EXTERNAL;
+
+    if (unlikely(upipe_avfsrc->upump_av_deal != NULL))
+        return UBASE_ERR_NONE;
+
+    struct upump *upump_av_deal =
+        upipe_av_deal_upump_alloc(upipe_avfsrc->upump_mgr,
+                upipe_avfsrc_probe, upipe, upipe->refcount);
+    if (unlikely(upump_av_deal == NULL)) {
+        upipe_err(upipe, "can't create dealer");
+        upipe_throw_fatal(upipe, UBASE_ERR_UPUMP);
+        return UBASE_ERR_UPUMP;
+    }
+    upipe_avfsrc->upump_av_deal = upump_av_deal;
+    upipe_av_deal_start(upump_av_deal);
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This opens the buffered input with libavformat, once twice the
+ * read-ahead has been received (or the whole input, if shorter).
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int upipe_avfsrc_open_input(struct upipe *upipe)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (!upipe_avfsrc->input_end &&
+        upipe_avfsrc->input_size < 2 * upipe_avfsrc->read_ahead)
+        return UBASE_ERR_NONE;
+
+    unsigned char *buffer = av_malloc(AVIO_BUFFER_SIZE);
+    if (unlikely(buffer == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return UBASE_ERR_ALLOC;
+    }
+    upipe_avfsrc->avio = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, upipe,
+                                            upipe_avfsrc_avio_read, NULL,
+                                            upipe_avfsrc_avio_seek);
+    if (unlikely(upipe_avfsrc->avio == NULL)) {
+        av_free(buffer);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return UBASE_ERR_ALLOC;
+    }
+    /* only short seeks inside the buffered input are possible */
+    upipe_avfsrc->avio->seekable = 0;
+
+    AVFormatContext *context = avformat_alloc_context();
+    if (unlikely(context == NULL)) {
+        upipe_err(upipe, "can't allocate context");
+        upipe_avfsrc_clean_buffered(upipe);
+        upipe_throw_fatal(upipe, UBASE_ERR_EXTERNAL);
+        return UBASE_ERR_EXTERNAL;
+    }
+    context->pb = upipe_avfsrc->avio;
+    context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    AVDictionary *options = NULL;
+    av_dict_copy(&options, upipe_avfsrc->options, 0);
+    /* do not probe more than what is buffered */
+    av_dict_set_int(&options, "formatprobesize", upipe_avfsrc->read_ahead,
+                    AV_DICT_DONT_OVERWRITE);
+    av_dict_set_int(&options, "probesize", upipe_avfsrc->read_ahead,
+                    AV_DICT_DONT_OVERWRITE);
+    int error = avformat_open_input(&context, "", NULL, &options);
+    av_dict_free(&options);
+    if (unlikely(error < 0 || upipe_avfsrc->underrun)) {
+        upipe_err_va(upipe, "can't open input (%s)",
+                     error < 0 ? av_err2str(error) : "underrun");
+        if (error >= 0)
+            avformat_close_input(&context);
+        upipe_avfsrc_clean_buffered(upipe);
+        /* drop the rest of the input */
+        upipe_avfsrc->input_end = true;
+        upipe_throw_fatal(upipe, UBASE_ERR_EXTERNAL);
+        return UBASE_ERR_EXTERNAL;
+    }
+
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(59, 16, 100)
+    /* Don't merge side data into avpacket data */
+    context->flags |= AVFMT_FLAG_KEEP_SIDE_DATA;
+#endif
+    upipe_avfsrc->context = context;
+    upipe_avfsrc->timestamp_offset = 0;
+    upipe_avfsrc->probed = false;
+    upipe_notice(upipe, "opening input");
+    return upipe_avfsrc_check(upipe);
+}
+
+/** @internal @This appends the data of a uref to the buffered input.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @return false in case of allocation error
+ */
+static bool upipe_avfsrc_append_input(struct upipe *upipe, struct uref *uref)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (ubase_check(uref_block_get_end(uref)))
+        upipe_avfsrc->input_end = true;
+    struct ubuf *ubuf = uref_detach_ubuf(uref);
+    uref_free(uref);
+    size_t size = 0;
+    if (ubuf != NULL && ubase_check(ubuf_block_size(ubuf, &size)) && size) {
+        if (upipe_avfsrc->input == NULL)
+            upipe_avfsrc->input = ubuf;
+        else if (unlikely(!ubase_check(ubuf_block_append(upipe_avfsrc->input,
+                                                         ubuf)))) {
+            ubuf_free(ubuf);
+            return false;
+        }
+        upipe_avfsrc->input_size += size;
+    } else if (ubuf != NULL)
+        ubuf_free(ubuf);
+    return true;
+}
+
+/** @internal @This buffers data from the upstream pipe for the demuxer. Once
+ * the demuxer thread runs, the input is held while more than twice the
+ * read-ahead is buffered and the thread does not wait for it.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @param upump_p reference to pump that generated the buffer
+ * @return false if the input must be held
+ */
+static bool upipe_avfsrc_handle(struct upipe *upipe, struct uref *uref,
+                                struct upump **upump_p)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (unlikely(!upipe_avfsrc->input_mode)) {
+        upipe_warn(upipe, "received a buffer without a flow definition");
+        uref_free(uref);
+        return true;
+    }
+
+    if (!upipe_avfsrc->demux_started) {
+        if (unlikely(upipe_avfsrc->input_end)) {
+            uref_free(uref);
+            return true;
+        }
+        if (unlikely(!upipe_avfsrc_append_input(upipe, uref)))
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        else if (upipe_avfsrc->context == NULL)
+            upipe_avfsrc_open_input(upipe);
+        return true;
+    }
+
+    pthread_mutex_lock(&upipe_avfsrc->demux_mutex);
+    if (!upipe_avfsrc->input_end && !upipe_avfsrc->demux_waiting &&
+        upipe_avfsrc->input_size >= 2 * upipe_avfsrc->read_ahead) {
+        pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+        return false;
+    }
+    bool ret = true;
+    if (unlikely(upipe_avfsrc->input_end))
+        uref_free(uref);
+    else {
+        ret = upipe_avfsrc_append_input(upipe, uref);
+        pthread_cond_signal(&upipe_avfsrc->demux_cond);
+    }
+    pthread_mutex_unlock(&upipe_avfsrc->demux_mutex);
+    if (unlikely(!ret))
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+    return true;
+}
+
+/** @internal @This receives data from the upstream pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_avfsrc_input(struct upipe *upipe, struct uref *uref,
+                               struct upump **upump_p)
+{
+    if (!upipe_avfsrc_check_input(upipe)) {
+        upipe_avfsrc_hold_input(upipe, uref);
+        upipe_avfsrc_block_input(upipe, upump_p);
+    } else if (!upipe_avfsrc_handle(upipe, uref, upump_p)) {
+        upipe_avfsrc_hold_input(upipe, uref);
+        upipe_avfsrc_block_input(upipe, upump_p);
+        /* Increment upipe refcount to avoid disappearing before all packets
+         * have been sent. */
+        upipe_use(upipe);
+    }
+}
+
+/** @internal @This sets the input flow definition, when the pipe is fed by
+ * an upstream pipe instead of opening an URL. A new flow definition after the
+ * end of the input starts a new stream.
+ *
+ * @param upipe description structure of the pipe
+ * @param flow_def flow definition packet
+ * @return an error code
+ */
+static int upipe_avfsrc_set_flow_def(struct upipe *upipe,
+                                     struct uref *flow_def)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (flow_def == NULL)
+        return UBASE_ERR_INVALID;
+    UBASE_RETURN(uref_flow_match_def(flow_def, "block."))
+
+    if (upipe_avfsrc->input_mode && !upipe_avfsrc->input_end)
+        return UBASE_ERR_NONE;
+
+    upipe_avfsrc_set_uri(upipe, NULL);
+    UBASE_RETURN(upipe_avfsrc_output_void(upipe))
+    upipe_avfsrc->input_mode = true;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This returns the minimum buffered input before running the
+ * demuxer.
+ *
+ * @param upipe description structure of the pipe
+ * @param read_ahead_p filled in with the read-ahead size, in octets
+ * @return an error code
+ */
+static int _upipe_avfsrc_get_read_ahead(struct upipe *upipe,
+                                        uint64_t *read_ahead_p)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    assert(read_ahead_p != NULL);
+    *read_ahead_p = upipe_avfsrc->read_ahead;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This sets the minimum buffered input before running the
+ * demuxer.
+ *
+ * @param upipe description structure of the pipe
+ * @param read_ahead read-ahead size, in octets
+ * @return an error code
+ */
+static int _upipe_avfsrc_set_read_ahead(struct upipe *upipe,
+                                        uint64_t read_ahead)
+{
+    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
+    if (read_ahead < READ_AHEAD_MIN || read_ahead > INT_MAX)
+        return UBASE_ERR_INVALID;
+    upipe_avfsrc->read_ahead = read_ahead;
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on an avformat source pipe.
  *
  * @param upipe description structure of the pipe
@@ -1232,6 +2035,10 @@ static int _upipe_avfsrc_control(struct upipe *upipe,
             const char *uri = va_arg(args, const char *);
             return upipe_avfsrc_set_uri(upipe, uri);
         }
+        case UPIPE_SET_FLOW_DEF: {
+            struct uref *flow_def = va_arg(args, struct uref *);
+            return upipe_avfsrc_set_flow_def(upipe, flow_def);
+        }
         case UPIPE_AVFSRC_GET_TIME: {
             UBASE_SIGNATURE_CHECK(args, UPIPE_AVFSRC_SIGNATURE)
             uint64_t *time_p = va_arg(args, uint64_t *);
@@ -1242,6 +2049,16 @@ static int _upipe_avfsrc_control(struct upipe *upipe,
             uint64_t time = va_arg(args, uint64_t);
             return _upipe_avfsrc_set_time(upipe, time);
         }
+        case UPIPE_AVFSRC_GET_READ_AHEAD: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AVFSRC_SIGNATURE)
+            uint64_t *read_ahead_p = va_arg(args, uint64_t *);
+            return _upipe_avfsrc_get_read_ahead(upipe, read_ahead_p);
+        }
+        case UPIPE_AVFSRC_SET_READ_AHEAD: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AVFSRC_SIGNATURE)
+            uint64_t read_ahead = va_arg(args, uint64_t);
+            return _upipe_avfsrc_set_read_ahead(upipe, read_ahead);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -1259,29 +2076,7 @@ static int upipe_avfsrc_control(struct upipe *upipe, int command, va_list args)
 {
     UBASE_RETURN(_upipe_avfsrc_control(upipe, command, args));
 
-    struct upipe_avfsrc *upipe_avfsrc = upipe_avfsrc_from_upipe(upipe);
-    if (upipe_avfsrc->upump_mgr != NULL && upipe_avfsrc->url != NULL &&
-        upipe_avfsrc->upump == NULL) {
-        if (unlikely(upipe_avfsrc->probed))
-            return upipe_avfsrc_start(upipe) ?
-                   UBASE_ERR_NONE : UBASE_ERR_EXTERNAL;
-
-        if (unlikely(upipe_avfsrc->upump_av_deal != NULL))
-            return UBASE_ERR_NONE;
-
-        struct upump *upump_av_deal =
-            upipe_av_deal_upump_alloc(upipe_avfsrc->upump_mgr,
-                    upipe_avfsrc_probe, upipe, upipe->refcount);
-        if (unlikely(upump_av_deal == NULL)) {
-            upipe_err(upipe, "can't create dealer");
-            upipe_throw_fatal(upipe, UBASE_ERR_UPUMP);
-            return UBASE_ERR_UPUMP;
-        }
-        upipe_avfsrc->upump_av_deal = upump_av_deal;
-        upipe_av_deal_start(upump_av_deal);
-    }
-
-    return UBASE_ERR_NONE;
+    return upipe_avfsrc_check(upipe);
 }
 
 /** @This frees a upipe.
@@ -1300,17 +2095,22 @@ static void upipe_avfsrc_free(struct urefcount *urefcount_real)
         if (likely(upipe_avfsrc->url != NULL))
             upipe_notice_va(upipe, "closing URL %s", upipe_avfsrc->url);
 
-        for (int i = 0; i < upipe_avfsrc->context->nb_streams; i++)
+        upipe_avfsrc_demux_stop(upipe);
+        for (unsigned i = 0; i < upipe_avfsrc->nb_streams; i++)
             uref_free(upipe_avfsrc->streams[i]);
 
         free(upipe_avfsrc->streams);
         avformat_close_input(&upipe_avfsrc->context);
     }
+    upipe_avfsrc_clean_buffered(upipe);
     upipe_throw_dead(upipe);
 
     av_dict_free(&upipe_avfsrc->options);
     free(upipe_avfsrc->url);
 
+    pthread_cond_destroy(&upipe_avfsrc->demux_cond);
+    pthread_mutex_destroy(&upipe_avfsrc->demux_mutex);
+    upipe_avfsrc_clean_input(upipe);
     upipe_avfsrc_clean_uclock(upipe);
     upipe_avfsrc_clean_upump(upipe);
     upipe_avfsrc_clean_upump_mgr(upipe);
@@ -1406,7 +2206,7 @@ struct upipe_mgr *upipe_avfsrc_mgr_alloc(void)
     avfsrc_mgr->mgr.refcount = upipe_avfsrc_mgr_to_urefcount(avfsrc_mgr);
     avfsrc_mgr->mgr.signature = UPIPE_AVFSRC_SIGNATURE;
     avfsrc_mgr->mgr.upipe_alloc = upipe_avfsrc_alloc;
-    avfsrc_mgr->mgr.upipe_input = NULL;
+    avfsrc_mgr->mgr.upipe_input = upipe_avfsrc_input;
     avfsrc_mgr->mgr.upipe_control = upipe_avfsrc_control;
     avfsrc_mgr->mgr.upipe_mgr_control = upipe_avfsrc_mgr_control;
     return upipe_avfsrc_mgr_to_upipe_mgr(avfsrc_mgr);
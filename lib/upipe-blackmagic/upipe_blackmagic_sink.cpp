@@ -2153,7 +2153,9 @@ static struct upipe_mgr upipe_bmd_sink_mgr = {
     /* .upipe_input = */ NULL,
     /* .upipe_control = */ upipe_bmd_sink_control,
 
-    /* .upipe_mgr_control = */ NULL
+    /* .upipe_mgr_control = */ NULL,
+
+    /* .stats = */ false
 };
 
 /** @This returns the management structure for bmd_sink pipes
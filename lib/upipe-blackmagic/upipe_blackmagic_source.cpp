@@ -1430,7 +1430,9 @@ static struct upipe_mgr upipe_bmd_src_mgr = {
     /* .upipe_input = */ NULL,
     /* .upipe_control = */ upipe_bmd_src_control,
 
-    /* .upipe_mgr_control = */ NULL
+    /* .upipe_mgr_control = */ NULL,
+
+    /* .stats = */ false
 };
 }
 
@@ -0,0 +1,161 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _UPIPE_DVBCSA_POOL_H_
+#define _UPIPE_DVBCSA_POOL_H_
+
+#include "upipe/ubase.h"
+#include "upipe/ulist.h"
+#include "upipe/ueventfd.h"
+#include "upipe/uref.h"
+
+#include <dvbcsa/dvbcsa.h>
+
+struct upipe_dvbcsa_pool;
+struct upipe_dvbcsa_pool_client;
+
+/** @This is a batch submitted to a pool. */
+struct upipe_dvbcsa_pool_job {
+    /** link into the list of jobs of the client */
+    struct uchain uchain;
+    /** link into the queue of the pool */
+    struct uchain uchain_queue;
+    /** client that submitted the job */
+    struct upipe_dvbcsa_pool_client *client;
+    /** bitslice key to use */
+    dvbcsa_bs_key_t *key;
+    /** true to encrypt, false to decrypt */
+    bool encrypt;
+    /** set by the worker thread once the batch is processed */
+    bool done;
+    /** urefs to output once the batch is processed, in order */
+    struct uchain urefs;
+    /** number of packets in the batch */
+    unsigned int count;
+    /** urefs mapped by the batch */
+    struct uref **mapped;
+    /** batch items, terminated by a NULL item */
+    struct dvbcsa_bs_batch_s batch[];
+};
+
+/** @hidden */
+UBASE_FROM_TO(upipe_dvbcsa_pool_job, uchain, uchain, uchain);
+/** @hidden */
+UBASE_FROM_TO(upipe_dvbcsa_pool_job, uchain, uchain_queue, uchain_queue);
+
+/** @This is the per-pipe state of a pool user. */
+struct upipe_dvbcsa_pool_client {
+    /** pool, or NULL */
+    struct upipe_dvbcsa_pool *pool;
+    /** event triggered when a job is processed */
+    struct ueventfd event;
+    /** submitted jobs, in order */
+    struct uchain jobs;
+    /** number of jobs not processed yet, protected by the pool mutex */
+    unsigned int pending;
+};
+
+/** @This initializes a pool client.
+ *
+ * @param client pointer to the client structure
+ */
+static inline void
+upipe_dvbcsa_pool_client_init(struct upipe_dvbcsa_pool_client *client)
+{
+    client->pool = NULL;
+    ulist_init(&client->jobs);
+    client->pending = 0;
+}
+
+/** @This checks whether a client has jobs to wait for.
+ *
+ * @param client pointer to the client structure
+ * @return true if jobs were submitted and not popped yet
+ */
+static inline bool
+upipe_dvbcsa_pool_client_busy(struct upipe_dvbcsa_pool_client *client)
+{
+    return !ulist_empty(&client->jobs);
+}
+
+/** @This allocates a job from a batch.
+ *
+ * @param batch batch items
+ * @param mapped urefs mapped by the batch items
+ * @param count number of batch items
+ * @return pointer to the job, or NULL in case of allocation failure
+ */
+struct upipe_dvbcsa_pool_job *
+upipe_dvbcsa_pool_job_alloc(const struct dvbcsa_bs_batch_s *batch,
+                            struct uref **mapped, unsigned int count);
+
+/** @This unmaps the packets of a processed job.
+ *
+ * @param job pointer to the job
+ */
+void upipe_dvbcsa_pool_job_unmap(struct upipe_dvbcsa_pool_job *job);
+
+/** @This frees a job, along with the packets it still maps and the urefs it
+ * still holds.
+ *
+ * @param job pointer to the job
+ */
+void upipe_dvbcsa_pool_job_free(struct upipe_dvbcsa_pool_job *job);
+
+/** @This attaches a client to a pool, or detaches it with a NULL pool. The
+ * client must not be busy.
+ *
+ * @param client pointer to the client structure
+ * @param pool pointer to the pool, or NULL
+ * @return an error code
+ */
+int upipe_dvbcsa_pool_client_set(struct upipe_dvbcsa_pool_client *client,
+                                 struct upipe_dvbcsa_pool *pool);
+
+/** @This waits for the pending jobs, frees them and detaches the client.
+ *
+ * @param client pointer to the client structure
+ */
+void upipe_dvbcsa_pool_client_clean(struct upipe_dvbcsa_pool_client *client);
+
+/** @This submits a job to the pool of a client.
+ *
+ * @param client pointer to the client structure
+ * @param job job to submit
+ */
+void upipe_dvbcsa_pool_submit(struct upipe_dvbcsa_pool_client *client,
+                              struct upipe_dvbcsa_pool_job *job);
+
+/** @This pops the oldest job of a client if it is processed.
+ *
+ * @param client pointer to the client structure
+ * @return the oldest processed job, or NULL
+ */
+struct upipe_dvbcsa_pool_job *
+upipe_dvbcsa_pool_pop(struct upipe_dvbcsa_pool_client *client);
+
+/** @This waits until all the jobs of a client are processed.
+ *
+ * @param client pointer to the client structure
+ */
+void upipe_dvbcsa_pool_wait(struct upipe_dvbcsa_pool_client *client);
+
+#endif
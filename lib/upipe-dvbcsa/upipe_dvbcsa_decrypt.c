@@ -42,6 +42,7 @@
 
 #include "upipe-dvbcsa/upipe_dvbcsa_decrypt.h"
 #include "upipe-dvbcsa/upipe_dvbcsa_common.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_pool.h"
 
 #include <bitstream/mpeg/ts.h>
 #include <dvbcsa/dvbcsa.h>
@@ -51,6 +52,7 @@
 #endif
 
 #include "common.h"
+#include "pool.h"
 
 /** expected input flow format */
 #define EXPECTED_FLOW_DEF "block.mpegts."
@@ -92,6 +94,8 @@ struct upipe_dvbcsa_dec {
     struct upump_mgr *upump_mgr;
     /** upump */
     struct upump *upump;
+    /** pool completion watcher */
+    struct upump *upump_pool;
     /** list of retained urefs */
     struct uchain urefs;
     /** number of retained urefs */
@@ -126,6 +130,8 @@ struct upipe_dvbcsa_dec {
 
     /** common dvbcsa structure */
     struct upipe_dvbcsa_common common;
+    /** worker pool client */
+    struct upipe_dvbcsa_pool_client pool;
 };
 
 /** @hidden */
@@ -145,6 +151,7 @@ UPIPE_HELPER_UCLOCK(upipe_dvbcsa_dec, uclock, uclock_request,
                     upipe_dvbcsa_dec_unregister_output_request);
 UPIPE_HELPER_UPUMP_MGR(upipe_dvbcsa_dec, upump_mgr);
 UPIPE_HELPER_UPUMP(upipe_dvbcsa_dec, upump, upump_mgr);
+UPIPE_HELPER_UPUMP(upipe_dvbcsa_dec, upump_pool, upump_mgr);
 UPIPE_HELPER_INPUT(upipe_dvbcsa_dec, urefs, nb_urefs, max_urefs, blockers,
                    NULL);
 
@@ -195,6 +202,8 @@ static void upipe_dvbcsa_dec_free(struct upipe *upipe)
     for (unsigned i = 0; i < upipe_dvbcsa_dec->current; i++)
         uref_block_unmap(upipe_dvbcsa_dec->mapped[i], 0);
 
+    upipe_dvbcsa_dec_clean_upump_pool(upipe);
+    upipe_dvbcsa_pool_client_clean(&upipe_dvbcsa_dec->pool);
     upipe_dvbcsa_dec_free_key(upipe);
     free(upipe_dvbcsa_dec->mapped);
     free(upipe_dvbcsa_dec->batch);
@@ -247,7 +256,9 @@ static struct upipe *upipe_dvbcsa_dec_alloc(struct upipe_mgr *mgr,
     upipe_dvbcsa_dec_init_uclock(upipe);
     upipe_dvbcsa_dec_init_upump_mgr(upipe);
     upipe_dvbcsa_dec_init_upump(upipe);
+    upipe_dvbcsa_dec_init_upump_pool(upipe);
     upipe_dvbcsa_common_init(common);
+    upipe_dvbcsa_pool_client_init(&upipe_dvbcsa_dec->pool);
     for (int i = 0; i < 2; i++)
         upipe_dvbcsa_dec->key[i] = NULL;
     unsigned bs_size = dvbcsa_bs_batch_size();
@@ -303,6 +314,116 @@ static int upipe_dvbcsa_dec_set_flow_def_real(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This outputs a retained uref.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref retained uref
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_dvbcsa_dec_output_held(struct upipe *upipe,
+                                         struct uref *uref,
+                                         struct upump **upump_p)
+{
+    if (unlikely(ubase_check(uref_flow_get_def(uref, NULL))))
+        /* handle flow format */
+        upipe_dvbcsa_dec_set_flow_def_real(upipe, uref);
+    else
+        upipe_dvbcsa_dec_output(upipe, uref, upump_p);
+}
+
+/** @internal @This outputs the batches processed by the worker pool, in
+ * submission order.
+ *
+ * @param upipe description structure of the pipe
+ * @param wait true to wait for all the submitted batches
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_dvbcsa_dec_drain(struct upipe *upipe, bool wait,
+                                   struct upump **upump_p)
+{
+    struct upipe_dvbcsa_dec *upipe_dvbcsa_dec =
+        upipe_dvbcsa_dec_from_upipe(upipe);
+    struct upipe_dvbcsa_pool_client *pool = &upipe_dvbcsa_dec->pool;
+    if (!upipe_dvbcsa_pool_client_busy(pool))
+        return;
+
+    if (wait)
+        upipe_dvbcsa_pool_wait(pool);
+
+    unsigned int done = 0;
+    struct upipe_dvbcsa_pool_job *job;
+    while ((job = upipe_dvbcsa_pool_pop(pool))) {
+        upipe_dvbcsa_pool_job_unmap(job);
+        struct uchain *uchain;
+        while ((uchain = ulist_pop(&job->urefs)))
+            upipe_dvbcsa_dec_output_held(upipe, uref_from_uchain(uchain),
+                                         upump_p);
+        upipe_dvbcsa_pool_job_free(job);
+        done++;
+    }
+
+    if (!upipe_dvbcsa_pool_client_busy(pool)) {
+        if (upipe_dvbcsa_dec->upump_pool)
+            upump_stop(upipe_dvbcsa_dec->upump_pool);
+        /* output the urefs held behind the last batch */
+        struct uref *uref;
+        if (!upipe_dvbcsa_dec->current)
+            while ((uref = upipe_dvbcsa_dec_pop_input(upipe)))
+                upipe_dvbcsa_dec_output_held(upipe, uref, upump_p);
+    }
+
+    /* release the pipe for each batch, see @ref upipe_dvbcsa_dec_input */
+    while (done--)
+        upipe_release(upipe);
+}
+
+/** @internal @This is called when the worker pool has processed batches.
+ *
+ * @param upump description structure of the watcher
+ */
+static void upipe_dvbcsa_dec_pool_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_dvbcsa_dec *upipe_dvbcsa_dec =
+        upipe_dvbcsa_dec_from_upipe(upipe);
+
+    ueventfd_read(&upipe_dvbcsa_dec->pool.event);
+    upipe_dvbcsa_dec_drain(upipe, false, &upump);
+}
+
+/** @internal @This submits the current batch to the worker pool, along with
+ * the retained urefs.
+ *
+ * @param upipe description structure of the pipe
+ * @return false if the batch could not be submitted
+ */
+static bool upipe_dvbcsa_dec_submit(struct upipe *upipe)
+{
+    struct upipe_dvbcsa_dec *upipe_dvbcsa_dec =
+        upipe_dvbcsa_dec_from_upipe(upipe);
+    struct upipe_dvbcsa_pool_client *pool = &upipe_dvbcsa_dec->pool;
+
+    struct upipe_dvbcsa_pool_job *job =
+        upipe_dvbcsa_pool_job_alloc(upipe_dvbcsa_dec->batch,
+                                    upipe_dvbcsa_dec->mapped,
+                                    upipe_dvbcsa_dec->current);
+    if (unlikely(!job))
+        return false;
+
+    upipe_dvbcsa_dec->current = 0;
+    /* a batch never mixes parities, see @ref upipe_dvbcsa_dec_input */
+    job->key = upipe_dvbcsa_dec->key_bs[upipe_dvbcsa_dec->odd];
+    job->encrypt = false;
+    struct uref *uref;
+    while ((uref = upipe_dvbcsa_dec_pop_input(upipe)))
+        ulist_add(&job->urefs, uref_to_uchain(uref));
+
+    if (!upipe_dvbcsa_pool_client_busy(pool))
+        upump_start(upipe_dvbcsa_dec->upump_pool);
+    upipe_dvbcsa_pool_submit(pool, job);
+    return true;
+}
+
 /** @internal @This flushes the retained urefs.
  *
  * @param upipe description structure of the pipe
@@ -315,6 +436,18 @@ static void upipe_dvbcsa_dec_flush(struct upipe *upipe,
 
     upipe_dvbcsa_dec_set_upump(upipe, NULL);
 
+    /* hand the batch over to the worker pool */
+    if (upipe_dvbcsa_dec->upump_pool) {
+        if (!upipe_dvbcsa_dec->current)
+            /* retained urefs are waiting for the submitted batches */
+            return;
+        if (likely(upipe_dvbcsa_dec_submit(upipe)))
+            return;
+        upipe_warn(upipe, "unable to allocate job, "
+                   "descrambling synchronously");
+        upipe_dvbcsa_dec_drain(upipe, true, upump_p);
+    }
+
     /* descramble remaining packets */
     unsigned current = upipe_dvbcsa_dec->current;
     if (current) {
@@ -335,11 +468,7 @@ static void upipe_dvbcsa_dec_flush(struct upipe *upipe,
     /* output */
     struct uref *uref;
     while ((uref = upipe_dvbcsa_dec_pop_input(upipe)))
-        if (unlikely(ubase_check(uref_flow_get_def(uref, NULL))))
-            /* handle flow format */
-            upipe_dvbcsa_dec_set_flow_def_real(upipe, uref);
-        else
-            upipe_dvbcsa_dec_output(upipe, uref, upump_p);
+        upipe_dvbcsa_dec_output_held(upipe, uref, upump_p);
 
     /* no more buffered urefs */
     upipe_release(upipe);
@@ -369,7 +498,8 @@ static void upipe_dvbcsa_dec_input(struct upipe *upipe,
         upipe_dvbcsa_dec_from_upipe(upipe);
     struct upipe_dvbcsa_common *common =
         upipe_dvbcsa_dec_to_common(upipe_dvbcsa_dec);
-    bool first = upipe_dvbcsa_dec_check_input(upipe);
+    bool first = upipe_dvbcsa_dec_check_input(upipe) &&
+        !upipe_dvbcsa_pool_client_busy(&upipe_dvbcsa_dec->pool);
 
     /* handle new flow definition */
     if (unlikely(ubase_check(uref_flow_get_def(uref, NULL)))) {
@@ -384,7 +514,11 @@ static void upipe_dvbcsa_dec_input(struct upipe *upipe,
     if (unlikely(!upipe_dvbcsa_dec->key[0])) {
         if (unlikely(!first))
             upipe_dvbcsa_dec_flush(upipe, upump_p);
-        upipe_dvbcsa_dec_output(upipe, uref, upump_p);
+        if (unlikely(upipe_dvbcsa_pool_client_busy(&upipe_dvbcsa_dec->pool)))
+            /* wait for the submitted batches */
+            upipe_dvbcsa_dec_hold_input(upipe, uref);
+        else
+            upipe_dvbcsa_dec_output(upipe, uref, upump_p);
         return;
     }
 
@@ -497,11 +631,17 @@ static void upipe_dvbcsa_dec_input(struct upipe *upipe,
 
     /* biss mode */
 
-    if (!first && upipe_dvbcsa_dec->odd != odd)
+    if (upipe_dvbcsa_dec->current && upipe_dvbcsa_dec->odd != odd)
         upipe_dvbcsa_dec_flush(upipe, upump_p);
     upipe_dvbcsa_dec->odd = odd;
 
     unsigned current = upipe_dvbcsa_dec->current;
+    if (unlikely(!current)) {
+        /* make sure to send all buffered urefs */
+        upipe_use(upipe);
+        upipe_dvbcsa_dec_wait_upump(upipe, common->latency,
+                                    upipe_dvbcsa_dec_worker);
+    }
     upipe_dvbcsa_dec->batch[current].data = ts + ts_header_size;
     upipe_dvbcsa_dec->batch[current].len = size - ts_header_size;
     upipe_dvbcsa_dec->mapped[current] = uref;
@@ -509,12 +649,6 @@ static void upipe_dvbcsa_dec_input(struct upipe *upipe,
 
     /* hold uref */
     upipe_dvbcsa_dec_hold_input(upipe, uref);
-    if (unlikely(first)) {
-        /* make sure to send all buffered urefs */
-        upipe_use(upipe);
-        upipe_dvbcsa_dec_wait_upump(upipe, common->latency,
-                                    upipe_dvbcsa_dec_worker);
-    }
 
     /* descramble if we have enough buffered scrambled TS packets */
     if (upipe_dvbcsa_dec->current >= upipe_dvbcsa_dec->batch_size)
@@ -538,6 +672,21 @@ static int upipe_dvbcsa_dec_check(struct upipe *upipe, struct uref *flow_def)
     if (unlikely(!upipe_dvbcsa_dec->upump_mgr))
         return UBASE_ERR_NONE;
 
+    if (upipe_dvbcsa_dec->pool.pool && !upipe_dvbcsa_dec->upump_pool) {
+        struct upump *upump =
+            ueventfd_upump_alloc(&upipe_dvbcsa_dec->pool.event,
+                                 upipe_dvbcsa_dec->upump_mgr,
+                                 upipe_dvbcsa_dec_pool_worker,
+                                 upipe, upipe->refcount);
+        if (unlikely(!upump)) {
+            upipe_warn(upipe, "unable to allocate pool watcher, "
+                       "descrambling synchronously");
+            upipe_dvbcsa_pool_client_set(&upipe_dvbcsa_dec->pool, NULL);
+            return UBASE_ERR_UPUMP;
+        }
+        upipe_dvbcsa_dec_set_upump_pool(upipe, upump);
+    }
+
     return UBASE_ERR_NONE;
 }
 
@@ -568,6 +717,10 @@ static int upipe_dvbcsa_dec_set_key(struct upipe *upipe, const char *even_key, c
     struct upipe_dvbcsa_dec *upipe_dvbcsa_dec =
         upipe_dvbcsa_dec_from_upipe(upipe);
 
+    /* descramble the retained packets with the previous keys */
+    if (upipe_dvbcsa_dec->current)
+        upipe_dvbcsa_dec_flush(upipe, NULL);
+    upipe_dvbcsa_dec_drain(upipe, true, NULL);
     upipe_dvbcsa_dec_free_key(upipe);
 
     struct ustring_dvbcsa_cw even_cw = ustring_to_dvbcsa_cw(ustring_from_str(even_key));
@@ -642,6 +795,36 @@ error:
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets the worker pool.
+ *
+ * @param upipe description structure of the pipe
+ * @param pool worker pool, or NULL
+ * @return an error code
+ */
+static int upipe_dvbcsa_dec_set_pool(struct upipe *upipe,
+                                     struct upipe_dvbcsa_pool *pool)
+{
+    struct upipe_dvbcsa_dec *upipe_dvbcsa_dec =
+        upipe_dvbcsa_dec_from_upipe(upipe);
+
+    if (unlikely(pool && upipe_dvbcsa_dec->mode != CSA_BS))
+        return UBASE_ERR_INVALID;
+    if (pool == upipe_dvbcsa_dec->pool.pool)
+        return UBASE_ERR_NONE;
+    if (unlikely(upipe_dvbcsa_dec->current ||
+                 upipe_dvbcsa_pool_client_busy(&upipe_dvbcsa_dec->pool)))
+        return UBASE_ERR_BUSY;
+
+    upipe_dvbcsa_dec_set_upump_pool(upipe, NULL);
+    UBASE_RETURN(upipe_dvbcsa_pool_client_set(&upipe_dvbcsa_dec->pool, pool));
+    if (pool) {
+        upipe_dvbcsa_dec_check_upump_mgr(upipe);
+        if (unlikely(!upipe_dvbcsa_dec->upump_mgr))
+            upipe_warn(upipe, "no upump manager, descrambling synchronously");
+    }
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This handles the pipe control commands.
  *
  * @param upipe description structure of the pipe
@@ -661,6 +844,8 @@ static int upipe_dvbcsa_dec_control_real(struct upipe *upipe,
 
     switch (command) {
         case UPIPE_ATTACH_UPUMP_MGR:
+            upipe_dvbcsa_dec_drain(upipe, true, NULL);
+            upipe_dvbcsa_dec_set_upump_pool(upipe, NULL);
             return upipe_dvbcsa_dec_attach_upump_mgr(upipe);
 
         case UPIPE_SET_FLOW_DEF: {
@@ -674,6 +859,12 @@ static int upipe_dvbcsa_dec_control_real(struct upipe *upipe,
             const char *odd_key = va_arg(args, const char *);
             return upipe_dvbcsa_dec_set_key(upipe, even_key, odd_key);
         }
+        case UPIPE_DVBCSA_SET_POOL: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_DVBCSA_COMMON_SIGNATURE);
+            struct upipe_dvbcsa_pool *pool =
+                va_arg(args, struct upipe_dvbcsa_pool *);
+            return upipe_dvbcsa_dec_set_pool(upipe, pool);
+        }
         case UPIPE_DVBCSA_ADD_PID:
         case UPIPE_DVBCSA_DEL_PID:
             return upipe_dvbcsa_common_control(common, command, args);
@@ -25,6 +25,7 @@
 
 #include "upipe-dvbcsa/upipe_dvbcsa_encrypt.h"
 #include "upipe-dvbcsa/upipe_dvbcsa_common.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_pool.h"
 
 #include "upipe/upipe_helper_upipe.h"
 #include "upipe/upipe_helper_urefcount.h"
@@ -43,6 +44,7 @@
 #include <bitstream/mpeg/ts.h>
 
 #include "common.h"
+#include "pool.h"
 
 /** expected input flow format */
 #define EXPECTED_FLOW_DEF "block.mpegts."
@@ -86,6 +88,8 @@ struct upipe_dvbcsa_enc {
     struct upump_mgr *upump_mgr;
     /** timer */
     struct upump *upump;
+    /** pool completion watcher */
+    struct upump *upump_pool;
     /** encryption batch size */
     unsigned batch_size;
     /** encryption key */
@@ -103,6 +107,8 @@ struct upipe_dvbcsa_enc {
     enum mode mode;
     /** common dvbcsa structure */
     struct upipe_dvbcsa_common common;
+    /** worker pool client */
+    struct upipe_dvbcsa_pool_client pool;
 };
 
 /** @hidden */
@@ -124,6 +130,7 @@ UPIPE_HELPER_UCLOCK(upipe_dvbcsa_enc, uclock, uclock_request,
                     upipe_dvbcsa_enc_unregister_output_request);
 UPIPE_HELPER_UPUMP_MGR(upipe_dvbcsa_enc, upump_mgr);
 UPIPE_HELPER_UPUMP(upipe_dvbcsa_enc, upump, upump_mgr);
+UPIPE_HELPER_UPUMP(upipe_dvbcsa_enc, upump_pool, upump_mgr);
 
 /** @internal @This frees a decryption key structure
  *
@@ -160,6 +167,8 @@ static void upipe_dvbcsa_enc_free(struct upipe *upipe)
     for (unsigned i = 0; i < upipe_dvbcsa_enc->current; i++)
         uref_block_unmap(upipe_dvbcsa_enc->mapped[i], 0);
 
+    upipe_dvbcsa_enc_clean_upump_pool(upipe);
+    upipe_dvbcsa_pool_client_clean(&upipe_dvbcsa_enc->pool);
     upipe_dvbcsa_enc_free_key(upipe);
     free(upipe_dvbcsa_enc->mapped);
     free(upipe_dvbcsa_enc->batch);
@@ -202,7 +211,9 @@ static struct upipe *upipe_dvbcsa_enc_alloc(struct upipe_mgr *mgr,
     upipe_dvbcsa_enc_init_output(upipe);
     upipe_dvbcsa_enc_init_upump_mgr(upipe);
     upipe_dvbcsa_enc_init_upump(upipe);
+    upipe_dvbcsa_enc_init_upump_pool(upipe);
     upipe_dvbcsa_common_init(common);
+    upipe_dvbcsa_pool_client_init(&upipe_dvbcsa_enc->pool);
     upipe_dvbcsa_enc->key = NULL;
     unsigned bs_size = dvbcsa_bs_batch_size();
     upipe_dvbcsa_enc->batch_size = bs_size;
@@ -256,6 +267,115 @@ static int upipe_dvbcsa_enc_set_flow_def_real(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This outputs a retained uref.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref retained uref
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_dvbcsa_enc_output_held(struct upipe *upipe,
+                                         struct uref *uref,
+                                         struct upump **upump_p)
+{
+    if (unlikely(ubase_check(uref_flow_get_def(uref, NULL))))
+        /* handle flow format */
+        upipe_dvbcsa_enc_set_flow_def_real(upipe, uref);
+    else
+        upipe_dvbcsa_enc_output(upipe, uref, upump_p);
+}
+
+/** @internal @This outputs the batches processed by the worker pool, in
+ * submission order.
+ *
+ * @param upipe description structure of the pipe
+ * @param wait true to wait for all the submitted batches
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_dvbcsa_enc_drain(struct upipe *upipe, bool wait,
+                                   struct upump **upump_p)
+{
+    struct upipe_dvbcsa_enc *upipe_dvbcsa_enc =
+        upipe_dvbcsa_enc_from_upipe(upipe);
+    struct upipe_dvbcsa_pool_client *pool = &upipe_dvbcsa_enc->pool;
+    if (!upipe_dvbcsa_pool_client_busy(pool))
+        return;
+
+    if (wait)
+        upipe_dvbcsa_pool_wait(pool);
+
+    unsigned int done = 0;
+    struct upipe_dvbcsa_pool_job *job;
+    while ((job = upipe_dvbcsa_pool_pop(pool))) {
+        upipe_dvbcsa_pool_job_unmap(job);
+        struct uchain *uchain;
+        while ((uchain = ulist_pop(&job->urefs)))
+            upipe_dvbcsa_enc_output_held(upipe, uref_from_uchain(uchain),
+                                         upump_p);
+        upipe_dvbcsa_pool_job_free(job);
+        done++;
+    }
+
+    if (!upipe_dvbcsa_pool_client_busy(pool)) {
+        if (upipe_dvbcsa_enc->upump_pool)
+            upump_stop(upipe_dvbcsa_enc->upump_pool);
+        /* output the urefs held behind the last batch */
+        struct uref *uref;
+        if (!upipe_dvbcsa_enc->current)
+            while ((uref = upipe_dvbcsa_enc_pop_input(upipe)))
+                upipe_dvbcsa_enc_output_held(upipe, uref, upump_p);
+    }
+
+    /* release the pipe for each batch, see @ref upipe_dvbcsa_enc_input */
+    while (done--)
+        upipe_release(upipe);
+}
+
+/** @internal @This is called when the worker pool has processed batches.
+ *
+ * @param upump description structure of the watcher
+ */
+static void upipe_dvbcsa_enc_pool_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_dvbcsa_enc *upipe_dvbcsa_enc =
+        upipe_dvbcsa_enc_from_upipe(upipe);
+
+    ueventfd_read(&upipe_dvbcsa_enc->pool.event);
+    upipe_dvbcsa_enc_drain(upipe, false, &upump);
+}
+
+/** @internal @This submits the current batch to the worker pool, along with
+ * the retained urefs.
+ *
+ * @param upipe description structure of the pipe
+ * @return false if the batch could not be submitted
+ */
+static bool upipe_dvbcsa_enc_submit(struct upipe *upipe)
+{
+    struct upipe_dvbcsa_enc *upipe_dvbcsa_enc =
+        upipe_dvbcsa_enc_from_upipe(upipe);
+    struct upipe_dvbcsa_pool_client *pool = &upipe_dvbcsa_enc->pool;
+
+    struct upipe_dvbcsa_pool_job *job =
+        upipe_dvbcsa_pool_job_alloc(upipe_dvbcsa_enc->batch,
+                                    upipe_dvbcsa_enc->mapped,
+                                    upipe_dvbcsa_enc->current);
+    if (unlikely(!job))
+        return false;
+
+    upipe_dvbcsa_enc->current = 0;
+    job->key = upipe_dvbcsa_enc->key_bs;
+    job->encrypt = true;
+    struct uref *uref;
+    while ((uref = upipe_dvbcsa_enc_pop_input(upipe)))
+        ulist_add(&job->urefs, uref_to_uchain(uref));
+
+    if (!upipe_dvbcsa_pool_client_busy(pool))
+        upump_start(upipe_dvbcsa_enc->upump_pool);
+    upipe_dvbcsa_pool_submit(pool, job);
+    return true;
+}
+
 /** @internal @This flushes the retained urefs.
  *
  * @param upipe description structure of the pipe
@@ -268,6 +388,17 @@ static void upipe_dvbcsa_enc_flush(struct upipe *upipe,
 
     upipe_dvbcsa_enc_set_upump(upipe, NULL);
 
+    /* hand the batch over to the worker pool */
+    if (upipe_dvbcsa_enc->upump_pool) {
+        if (!upipe_dvbcsa_enc->current)
+            /* retained urefs are waiting for the submitted batches */
+            return;
+        if (likely(upipe_dvbcsa_enc_submit(upipe)))
+            return;
+        upipe_warn(upipe, "unable to allocate job, scrambling synchronously");
+        upipe_dvbcsa_enc_drain(upipe, true, upump_p);
+    }
+
     /* scramble remaining packets */
     unsigned current = upipe_dvbcsa_enc->current;
     if (upipe_dvbcsa_enc->current) {
@@ -288,13 +419,8 @@ static void upipe_dvbcsa_enc_flush(struct upipe *upipe,
 
     /* output */
     struct uref *uref;
-    while ((uref = upipe_dvbcsa_enc_pop_input(upipe))) {
-        if (unlikely(ubase_check(uref_flow_get_def(uref, NULL))))
-            /* handle flow format */
-            upipe_dvbcsa_enc_set_flow_def_real(upipe, uref);
-        else
-            upipe_dvbcsa_enc_output(upipe, uref, upump_p);
-    }
+    while ((uref = upipe_dvbcsa_enc_pop_input(upipe)))
+        upipe_dvbcsa_enc_output_held(upipe, uref, upump_p);
 
     /* all buffered urefs has been sent */
     upipe_release(upipe);
@@ -325,7 +451,8 @@ static void upipe_dvbcsa_enc_input(struct upipe *upipe,
         upipe_dvbcsa_enc_from_upipe(upipe);
     struct upipe_dvbcsa_common *common =
         upipe_dvbcsa_enc_to_common(upipe_dvbcsa_enc);
-    bool first = upipe_dvbcsa_enc_check_input(upipe);
+    bool first = upipe_dvbcsa_enc_check_input(upipe) &&
+        !upipe_dvbcsa_pool_client_busy(&upipe_dvbcsa_enc->pool);
     int ret;
 
     /* handle flow format */
@@ -416,6 +543,12 @@ static void upipe_dvbcsa_enc_input(struct upipe *upipe,
     }
 
     uint8_t current = upipe_dvbcsa_enc->current;
+    if (unlikely(!current)) {
+        /* make sure to send all buffered urefs */
+        upipe_use(upipe);
+        upipe_dvbcsa_enc_wait_upump(upipe, common->latency,
+                                    upipe_dvbcsa_enc_worker);
+    }
     upipe_dvbcsa_enc->batch[current].data = ts + ts_header_size;
     upipe_dvbcsa_enc->batch[current].len = size - ts_header_size;
     upipe_dvbcsa_enc->mapped[current] = uref;
@@ -423,12 +556,6 @@ static void upipe_dvbcsa_enc_input(struct upipe *upipe,
 
     /* hold uref */
     upipe_dvbcsa_enc_hold_input(upipe, uref);
-    if (unlikely(first)) {
-        /* make sure to send all buffered urefs */
-        upipe_use(upipe);
-        upipe_dvbcsa_enc_wait_upump(upipe, common->latency,
-                                    upipe_dvbcsa_enc_worker);
-    }
 
     /* scramble if we have enough packets */
     if (upipe_dvbcsa_enc->current >= upipe_dvbcsa_enc->batch_size)
@@ -452,6 +579,21 @@ static int upipe_dvbcsa_enc_check(struct upipe *upipe, struct uref *flow_def)
     if (unlikely(!upipe_dvbcsa_enc->upump_mgr))
         return UBASE_ERR_NONE;
 
+    if (upipe_dvbcsa_enc->pool.pool && !upipe_dvbcsa_enc->upump_pool) {
+        struct upump *upump =
+            ueventfd_upump_alloc(&upipe_dvbcsa_enc->pool.event,
+                                 upipe_dvbcsa_enc->upump_mgr,
+                                 upipe_dvbcsa_enc_pool_worker,
+                                 upipe, upipe->refcount);
+        if (unlikely(!upump)) {
+            upipe_warn(upipe, "unable to allocate pool watcher, "
+                       "scrambling synchronously");
+            upipe_dvbcsa_pool_client_set(&upipe_dvbcsa_enc->pool, NULL);
+            return UBASE_ERR_UPUMP;
+        }
+        upipe_dvbcsa_enc_set_upump_pool(upipe, upump);
+    }
+
     return UBASE_ERR_NONE;
 }
 
@@ -482,6 +624,10 @@ static int upipe_dvbcsa_enc_set_key(struct upipe *upipe, const char *key)
     struct upipe_dvbcsa_enc *upipe_dvbcsa_enc =
         upipe_dvbcsa_enc_from_upipe(upipe);
 
+    /* scramble the retained packets with the previous key */
+    if (upipe_dvbcsa_enc->current)
+        upipe_dvbcsa_enc_flush(upipe, NULL);
+    upipe_dvbcsa_enc_drain(upipe, true, NULL);
     upipe_dvbcsa_enc_free_key(upipe);
     upipe_dvbcsa_enc->key = NULL;
     if (!key)
@@ -509,6 +655,36 @@ static int upipe_dvbcsa_enc_set_key(struct upipe *upipe, const char *key)
 
 }
 
+/** @internal @This sets the worker pool.
+ *
+ * @param upipe description structure of the pipe
+ * @param pool worker pool, or NULL
+ * @return an error code
+ */
+static int upipe_dvbcsa_enc_set_pool(struct upipe *upipe,
+                                     struct upipe_dvbcsa_pool *pool)
+{
+    struct upipe_dvbcsa_enc *upipe_dvbcsa_enc =
+        upipe_dvbcsa_enc_from_upipe(upipe);
+
+    if (unlikely(pool && upipe_dvbcsa_enc->mode != CSA_BS))
+        return UBASE_ERR_INVALID;
+    if (pool == upipe_dvbcsa_enc->pool.pool)
+        return UBASE_ERR_NONE;
+    if (unlikely(upipe_dvbcsa_enc->current ||
+                 upipe_dvbcsa_pool_client_busy(&upipe_dvbcsa_enc->pool)))
+        return UBASE_ERR_BUSY;
+
+    upipe_dvbcsa_enc_set_upump_pool(upipe, NULL);
+    UBASE_RETURN(upipe_dvbcsa_pool_client_set(&upipe_dvbcsa_enc->pool, pool));
+    if (pool) {
+        upipe_dvbcsa_enc_check_upump_mgr(upipe);
+        if (unlikely(!upipe_dvbcsa_enc->upump_mgr))
+            upipe_warn(upipe, "no upump manager, scrambling synchronously");
+    }
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This handles the dvbcsa encryption pipe control commands.
  *
  * @param upipe description structure of the pipe
@@ -528,6 +704,8 @@ static int upipe_dvbcsa_enc_control_real(struct upipe *upipe,
 
     switch (cmd) {
         case UPIPE_ATTACH_UPUMP_MGR:
+            upipe_dvbcsa_enc_drain(upipe, true, NULL);
+            upipe_dvbcsa_enc_set_upump_pool(upipe, NULL);
             return upipe_dvbcsa_enc_attach_upump_mgr(upipe);
 
         case UPIPE_SET_FLOW_DEF: {
@@ -541,6 +719,13 @@ static int upipe_dvbcsa_enc_control_real(struct upipe *upipe,
             return upipe_dvbcsa_enc_set_key(upipe, key);
         }
 
+        case UPIPE_DVBCSA_SET_POOL: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_DVBCSA_COMMON_SIGNATURE);
+            struct upipe_dvbcsa_pool *pool =
+                va_arg(args, struct upipe_dvbcsa_pool *);
+            return upipe_dvbcsa_enc_set_pool(upipe, pool);
+        }
+
         case UPIPE_DVBCSA_ADD_PID:
         case UPIPE_DVBCSA_DEL_PID:
             return upipe_dvbcsa_common_control(common, cmd, args);
@@ -0,0 +1,344 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short shared pool of dvbcsa worker threads
+ */
+
+#include "upipe/ubase.h"
+#include "upipe/ulist.h"
+#include "upipe/urefcount.h"
+#include "upipe/ueventfd.h"
+#include "upipe/uref.h"
+#include "upipe/uref_block.h"
+
+#include "upipe-dvbcsa/upipe_dvbcsa_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+/** @This is the private structure of a pool. */
+struct upipe_dvbcsa_pool {
+    /** refcount management structure */
+    struct urefcount urefcount;
+    /** mutex protecting the queue and the job states */
+    pthread_mutex_t mutex;
+    /** signaled when a job is queued or the threads must quit */
+    pthread_cond_t cond;
+    /** signaled when a job is processed */
+    pthread_cond_t done_cond;
+    /** queued jobs */
+    struct uchain queue;
+    /** true if the threads must quit */
+    bool quit;
+    /** number of started threads */
+    unsigned int nb_threads;
+    /** worker threads */
+    pthread_t threads[];
+};
+
+/** @hidden */
+UBASE_FROM_TO(upipe_dvbcsa_pool, urefcount, urefcount, urefcount);
+
+/** @internal @This is the main loop of a worker thread.
+ *
+ * @param arg pointer to the pool
+ * @return NULL
+ */
+static void *upipe_dvbcsa_pool_run(void *arg)
+{
+    struct upipe_dvbcsa_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    for ( ; ; ) {
+        struct uchain *uchain;
+        while (!pool->quit && (uchain = ulist_pop(&pool->queue)) == NULL)
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        if (pool->quit)
+            break;
+        pthread_mutex_unlock(&pool->mutex);
+
+        struct upipe_dvbcsa_pool_job *job =
+            upipe_dvbcsa_pool_job_from_uchain_queue(uchain);
+        if (job->encrypt)
+            dvbcsa_bs_encrypt(job->key, job->batch, 184);
+        else
+            dvbcsa_bs_decrypt(job->key, job->batch, 184);
+
+        pthread_mutex_lock(&pool->mutex);
+        /* the client may free the job as soon as the mutex is released */
+        struct upipe_dvbcsa_pool_client *client = job->client;
+        job->done = true;
+        client->pending--;
+        ueventfd_write(&client->event);
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/** @internal @This stops the threads and frees a pool.
+ *
+ * @param urefcount pointer to the urefcount structure of the pool
+ */
+static void upipe_dvbcsa_pool_free(struct urefcount *urefcount)
+{
+    struct upipe_dvbcsa_pool *pool =
+        upipe_dvbcsa_pool_from_urefcount(urefcount);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (unsigned int i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    urefcount_clean(&pool->urefcount);
+    free(pool);
+}
+
+/** @This allocates a pool of dvbcsa worker threads.
+ *
+ * @param nb_threads number of worker threads to start
+ * @return pointer to the pool, or NULL in case of error
+ */
+struct upipe_dvbcsa_pool *upipe_dvbcsa_pool_alloc(unsigned int nb_threads)
+{
+    if (unlikely(!nb_threads))
+        return NULL;
+
+    struct upipe_dvbcsa_pool *pool =
+        malloc(sizeof (*pool) + nb_threads * sizeof (pthread_t));
+    if (unlikely(!pool))
+        return NULL;
+
+    urefcount_init(&pool->urefcount, upipe_dvbcsa_pool_free);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ulist_init(&pool->queue);
+    pool->quit = false;
+    pool->nb_threads = 0;
+
+    for (unsigned int i = 0; i < nb_threads; i++) {
+        if (unlikely(pthread_create(&pool->threads[i], NULL,
+                                    upipe_dvbcsa_pool_run, pool) != 0)) {
+            upipe_dvbcsa_pool_release(pool);
+            return NULL;
+        }
+        pool->nb_threads++;
+    }
+    return pool;
+}
+
+/** @This increments the reference count of a pool.
+ *
+ * @param pool pointer to the pool
+ * @return the same pointer to the pool
+ */
+struct upipe_dvbcsa_pool *upipe_dvbcsa_pool_use(struct upipe_dvbcsa_pool *pool)
+{
+    if (pool != NULL)
+        urefcount_use(&pool->urefcount);
+    return pool;
+}
+
+/** @This decrements the reference count of a pool, and stops its threads
+ * when it reaches 0.
+ *
+ * @param pool pointer to the pool
+ */
+void upipe_dvbcsa_pool_release(struct upipe_dvbcsa_pool *pool)
+{
+    if (pool != NULL)
+        urefcount_release(&pool->urefcount);
+}
+
+/** @This allocates a job from a batch.
+ *
+ * @param batch batch items
+ * @param mapped urefs mapped by the batch items
+ * @param count number of batch items
+ * @return pointer to the job, or NULL in case of allocation failure
+ */
+struct upipe_dvbcsa_pool_job *
+upipe_dvbcsa_pool_job_alloc(const struct dvbcsa_bs_batch_s *batch,
+                            struct uref **mapped, unsigned int count)
+{
+    struct upipe_dvbcsa_pool_job *job =
+        malloc(sizeof (*job) +
+               (count + 1) * sizeof (struct dvbcsa_bs_batch_s) +
+               count * sizeof (struct uref *));
+    if (unlikely(!job))
+        return NULL;
+
+    uchain_init(&job->uchain);
+    uchain_init(&job->uchain_queue);
+    job->client = NULL;
+    job->key = NULL;
+    job->encrypt = false;
+    job->done = false;
+    ulist_init(&job->urefs);
+    job->count = count;
+    memcpy(job->batch, batch, count * sizeof (struct dvbcsa_bs_batch_s));
+    job->batch[count].data = NULL;
+    job->batch[count].len = 0;
+    job->mapped = (struct uref **)(job->batch + count + 1);
+    memcpy(job->mapped, mapped, count * sizeof (struct uref *));
+    return job;
+}
+
+/** @This unmaps the packets of a processed job.
+ *
+ * @param job pointer to the job
+ */
+void upipe_dvbcsa_pool_job_unmap(struct upipe_dvbcsa_pool_job *job)
+{
+    for (unsigned int i = 0; i < job->count; i++)
+        uref_block_unmap(job->mapped[i], 0);
+    job->count = 0;
+}
+
+/** @This frees a job, along with the packets it still maps and the urefs it
+ * still holds.
+ *
+ * @param job pointer to the job
+ */
+void upipe_dvbcsa_pool_job_free(struct upipe_dvbcsa_pool_job *job)
+{
+    upipe_dvbcsa_pool_job_unmap(job);
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&job->urefs)) != NULL)
+        uref_free(uref_from_uchain(uchain));
+    free(job);
+}
+
+/** @This attaches a client to a pool, or detaches it with a NULL pool. The
+ * client must not be busy.
+ *
+ * @param client pointer to the client structure
+ * @param pool pointer to the pool, or NULL
+ * @return an error code
+ */
+int upipe_dvbcsa_pool_client_set(struct upipe_dvbcsa_pool_client *client,
+                                 struct upipe_dvbcsa_pool *pool)
+{
+    if (client->pool == pool)
+        return UBASE_ERR_NONE;
+    if (unlikely(upipe_dvbcsa_pool_client_busy(client)))
+        return UBASE_ERR_BUSY;
+
+    if (client->pool != NULL) {
+        ueventfd_clean(&client->event);
+        upipe_dvbcsa_pool_release(client->pool);
+        client->pool = NULL;
+    }
+
+    if (pool != NULL) {
+        if (unlikely(!ueventfd_init(&client->event, false)))
+            return UBASE_ERR_EXTERNAL;
+        client->pool = upipe_dvbcsa_pool_use(pool);
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** @This waits for the pending jobs, frees them and detaches the client.
+ *
+ * @param client pointer to the client structure
+ */
+void upipe_dvbcsa_pool_client_clean(struct upipe_dvbcsa_pool_client *client)
+{
+    if (client->pool == NULL)
+        return;
+
+    upipe_dvbcsa_pool_wait(client);
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&client->jobs)) != NULL)
+        upipe_dvbcsa_pool_job_free(upipe_dvbcsa_pool_job_from_uchain(uchain));
+    upipe_dvbcsa_pool_client_set(client, NULL);
+}
+
+/** @This submits a job to the pool of a client.
+ *
+ * @param client pointer to the client structure
+ * @param job job to submit
+ */
+void upipe_dvbcsa_pool_submit(struct upipe_dvbcsa_pool_client *client,
+                              struct upipe_dvbcsa_pool_job *job)
+{
+    struct upipe_dvbcsa_pool *pool = client->pool;
+
+    job->client = client;
+    job->done = false;
+    ulist_add(&client->jobs, &job->uchain);
+
+    pthread_mutex_lock(&pool->mutex);
+    client->pending++;
+    ulist_add(&pool->queue, &job->uchain_queue);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/** @This pops the oldest job of a client if it is processed.
+ *
+ * @param client pointer to the client structure
+ * @return the oldest processed job, or NULL
+ */
+struct upipe_dvbcsa_pool_job *
+upipe_dvbcsa_pool_pop(struct upipe_dvbcsa_pool_client *client)
+{
+    struct uchain *uchain = ulist_peek(&client->jobs);
+    if (uchain == NULL)
+        return NULL;
+
+    struct upipe_dvbcsa_pool_job *job =
+        upipe_dvbcsa_pool_job_from_uchain(uchain);
+    pthread_mutex_lock(&client->pool->mutex);
+    bool done = job->done;
+    pthread_mutex_unlock(&client->pool->mutex);
+    if (!done)
+        return NULL;
+
+    ulist_pop(&client->jobs);
+    return job;
+}
+
+/** @This waits until all the jobs of a client are processed.
+ *
+ * @param client pointer to the client structure
+ */
+void upipe_dvbcsa_pool_wait(struct upipe_dvbcsa_pool_client *client)
+{
+    struct upipe_dvbcsa_pool *pool = client->pool;
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (client->pending)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -27,6 +27,7 @@
  * @short Upipe ebur128
  */
 
+#include "upipe/uclock.h"
 #include "upipe/uref.h"
 #include "upipe/uref_flow.h"
 #include "upipe/uref_sound_flow.h"
@@ -74,6 +75,13 @@ struct upipe_ebur128 {
     uint8_t planes;
     /** sample format */
     enum upipe_ebur128_fmt fmt;
+    /** sample rate */
+    uint64_t rate;
+
+    /** period of loudness range and global loudness computation */
+    uint64_t period;
+    /** number of samples before the next computation */
+    uint64_t countdown;
 
     /** public structure */
     struct upipe upipe;
@@ -104,6 +112,9 @@ static struct upipe *upipe_ebur128_alloc(struct upipe_mgr *mgr,
         return NULL;
     struct upipe_ebur128 *upipe_ebur128 = upipe_ebur128_from_upipe(upipe);
     upipe_ebur128->st = NULL;
+    upipe_ebur128->rate = 0;
+    upipe_ebur128->period = 0;
+    upipe_ebur128->countdown = 0;
 
     upipe_ebur128_init_urefcount(upipe);
     upipe_ebur128_init_output(upipe);
@@ -121,7 +132,7 @@ static void upipe_ebur128_input(struct upipe *upipe, struct uref *uref,
                                 struct upump **upump_p)
 {
     struct upipe_ebur128 *upipe_ebur128 = upipe_ebur128_from_upipe(upipe);
-    double loud = 0, lra = 0, global = 0;
+    double loud = 0, shortterm = 0, lra = 0, global = 0;
 
     if (unlikely(upipe_ebur128->output_flow == NULL)) {
         upipe_err_va(upipe, "invalid input");
@@ -201,14 +212,27 @@ static void upipe_ebur128_input(struct upipe *upipe, struct uref *uref,
         free(buf);
 
     ebur128_loudness_momentary(upipe_ebur128->st, &loud);
+    ebur128_loudness_shortterm(upipe_ebur128->st, &shortterm);
+    uref_ebur128_set_momentary(uref, loud);
+    uref_ebur128_set_shortterm(uref, shortterm);
+
+    /* loudness range and global loudness go through the whole histogram */
+    if (upipe_ebur128->countdown > samples) {
+        upipe_ebur128->countdown -= samples;
+        upipe_verbose_va(upipe, "loud %f short %f", loud, shortterm);
+        upipe_ebur128_output(upipe, uref, upump_p);
+        return;
+    }
+    upipe_ebur128->countdown = upipe_ebur128->period *
+                               upipe_ebur128->rate / UCLOCK_FREQ;
+
     ebur128_loudness_range(upipe_ebur128->st, &lra);
     ebur128_loudness_global(upipe_ebur128->st, &global);
-
-    uref_ebur128_set_momentary(uref, loud);
     uref_ebur128_set_lra(uref, lra);
     uref_ebur128_set_global(uref, global);
 
-    upipe_verbose_va(upipe, "loud %f lra %f global %f", loud, lra, global);
+    upipe_verbose_va(upipe, "loud %f short %f lra %f global %f",
+                     loud, shortterm, lra, global);
 
     upipe_ebur128_output(upipe, uref, upump_p);
 }
@@ -255,6 +279,8 @@ static int upipe_ebur128_set_flow_def(struct upipe *upipe,
         return UBASE_ERR_ALLOC;
     }
     upipe_ebur128->fmt = fmt;
+    upipe_ebur128->rate = rate;
+    upipe_ebur128->countdown = 0;
 
     if (unlikely(upipe_ebur128->st)) {
         //ebur128_destroy(&upipe_ebur128->st);
@@ -263,7 +289,8 @@ static int upipe_ebur128_set_flow_def(struct upipe *upipe,
     } else {
         upipe_ebur128->st =
             ebur128_init(upipe_ebur128->channels, rate,
-            EBUR128_MODE_LRA | EBUR128_MODE_I | EBUR128_MODE_HISTOGRAM);
+            EBUR128_MODE_S | EBUR128_MODE_LRA | EBUR128_MODE_I |
+            EBUR128_MODE_HISTOGRAM);
     }
 
     upipe_ebur128_store_flow_def(upipe, flow_dup);
@@ -290,6 +317,21 @@ static int upipe_ebur128_provide_flow_format(struct upipe *upipe,
     return urequest_provide_flow_format(request, flow);
 }
 
+/** @internal @This sets the period of loudness range and global loudness
+ * computation.
+ *
+ * @param upipe description structure of the pipe
+ * @param period period in units of the 27 MHz clock, or 0 for every buffer
+ * @return an error code
+ */
+static int _upipe_ebur128_set_period(struct upipe *upipe, uint64_t period)
+{
+    struct upipe_ebur128 *upipe_ebur128 = upipe_ebur128_from_upipe(upipe);
+    upipe_ebur128->period = period;
+    upipe_ebur128->countdown = 0;
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on the pipe.
  *
  * @param upipe description structure of the pipe
@@ -319,6 +361,18 @@ static int upipe_ebur128_control(struct upipe *upipe,
         case UPIPE_GET_OUTPUT:
         case UPIPE_SET_OUTPUT:
             return upipe_ebur128_control_output(upipe, command, args);
+
+        case UPIPE_EBUR128_SET_PERIOD: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_EBUR128_SIGNATURE)
+            uint64_t period = va_arg(args, uint64_t);
+            return _upipe_ebur128_set_period(upipe, period);
+        }
+        case UPIPE_EBUR128_GET_PERIOD: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_EBUR128_SIGNATURE)
+            uint64_t *period_p = va_arg(args, uint64_t *);
+            *period_p = upipe_ebur128_from_upipe(upipe)->period;
+            return UBASE_ERR_NONE;
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
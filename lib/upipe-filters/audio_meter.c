@@ -0,0 +1,464 @@
+/*
+ * Audio metering kernels
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ */
+
+/*
+ * Each kernel returns the peak absolute value and the sum of squares of a
+ * plane in a single pass. The SIMD versions keep running minimums and
+ * maximums instead of absolute values, so that the most negative integer is
+ * handled like the portable version. Squares of 16-bit samples are summed
+ * exactly in 64-bit integers, other formats are summed in double precision.
+ *
+ * The true peak is measured by oversampling 4 times with a 48-tap
+ * Blackman-windowed sinc interpolator, split in 4 phases of 12 taps, as
+ * suggested by ITU-R BS.1770.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__i686__) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "audio_meter.h"
+
+/** number of samples converted at once for the true-peak interpolator */
+#define TP_CHUNK 256
+
+void upipe_audio_meter_u8_c(const uint8_t *p, uintptr_t n,
+                            double *peak_p, double *sum2_p)
+{
+    unsigned max = 0;
+    uint64_t sum2 = 0;
+    for (uintptr_t i = 0; i < n; i++) {
+        unsigned c = p[i];
+        if (c > max)
+            max = c;
+        /* unlike the legacy peak, the energy is relative to silence */
+        int s = (int)c - 128;
+        sum2 += s * s;
+    }
+    *peak_p = max * 1. / UINT8_MAX;
+    *sum2_p = sum2 * 1. / (128 * 128);
+}
+
+void upipe_audio_meter_s16_c(const int16_t *p, uintptr_t n,
+                             double *peak_p, double *sum2_p)
+{
+    int32_t max = 0;
+    int64_t sum2 = 0;
+    for (uintptr_t i = 0; i < n; i++) {
+        int32_t c = p[i];
+        if (c < 0)
+            c = -c;
+        if (c > max)
+            max = c;
+        sum2 += c * c;
+    }
+    *peak_p = max * 1. / INT16_MAX;
+    *sum2_p = sum2 * 1. / (INT16_MAX * INT16_MAX);
+}
+
+void upipe_audio_meter_s32_c(const int32_t *p, uintptr_t n,
+                             double *peak_p, double *sum2_p)
+{
+    int64_t max = 0;
+    double sum2 = 0.;
+    for (uintptr_t i = 0; i < n; i++) {
+        int64_t c = p[i];
+        if (c < 0)
+            c = -c;
+        if (c > max)
+            max = c;
+        sum2 += (double)c * c;
+    }
+    *peak_p = max * 1. / INT32_MAX;
+    *sum2_p = sum2 / ((double)INT32_MAX * INT32_MAX);
+}
+
+void upipe_audio_meter_flt_c(const float *p, uintptr_t n,
+                             double *peak_p, double *sum2_p)
+{
+    float max = 0.;
+    double sum2 = 0.;
+    for (uintptr_t i = 0; i < n; i++) {
+        float c = fabsf(p[i]);
+        if (c > max)
+            max = c;
+        sum2 += (double)c * c;
+    }
+    *peak_p = max;
+    *sum2_p = sum2;
+}
+
+void upipe_audio_meter_dbl_c(const double *p, uintptr_t n,
+                             double *peak_p, double *sum2_p)
+{
+    double max = 0.;
+    double sum2 = 0.;
+    for (uintptr_t i = 0; i < n; i++) {
+        double c = fabs(p[i]);
+        if (c > max)
+            max = c;
+        sum2 += c * c;
+    }
+    *peak_p = max;
+    *sum2_p = sum2;
+}
+
+float upipe_audio_meter_tp_c(const float coef[UPIPE_AUDIO_METER_TP_PHASES]
+                                             [UPIPE_AUDIO_METER_TP_TAPS],
+                             const float *x, uintptr_t n)
+{
+    float peak = 0.;
+    for (uintptr_t i = 0; i < n; i++) {
+        for (int k = 0; k < UPIPE_AUDIO_METER_TP_PHASES; k++) {
+            float y = 0.;
+            for (int j = 0; j < UPIPE_AUDIO_METER_TP_TAPS; j++)
+                y += coef[k][j] * x[i - j];
+            y = fabsf(y);
+            if (y > peak)
+                peak = y;
+        }
+    }
+    return peak;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void upipe_audio_meter_s16_sse2(const int16_t *p, uintptr_t n,
+                                double *peak_p, double *sum2_p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmax = zero, vmin = zero, acc = zero;
+    uintptr_t i = 0;
+    for ( ; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        vmax = _mm_max_epi16(vmax, x);
+        vmin = _mm_min_epi16(vmin, x);
+        /* at most 2^31, so the pairs fit in unsigned 32 bits */
+        __m128i sq = _mm_madd_epi16(x, x);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+
+    int16_t maxs[8], mins[8];
+    uint64_t accs[2];
+    _mm_storeu_si128((__m128i *)maxs, vmax);
+    _mm_storeu_si128((__m128i *)mins, vmin);
+    _mm_storeu_si128((__m128i *)accs, acc);
+    int32_t max = 0;
+    for (int j = 0; j < 8; j++) {
+        if (maxs[j] > max)
+            max = maxs[j];
+        if (-mins[j] > max)
+            max = -mins[j];
+    }
+
+    double peak, sum2;
+    upipe_audio_meter_s16_c(p + i, n - i, &peak, &sum2);
+    if (peak < max * 1. / INT16_MAX)
+        peak = max * 1. / INT16_MAX;
+    *peak_p = peak;
+    *sum2_p = sum2 + (accs[0] + accs[1]) * 1. / (INT16_MAX * INT16_MAX);
+}
+
+__attribute__((target("sse2")))
+void upipe_audio_meter_flt_sse2(const float *p, uintptr_t n,
+                                double *peak_p, double *sum2_p)
+{
+    const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(INT32_MAX));
+    __m128 vmax = _mm_setzero_ps();
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    uintptr_t i = 0;
+    for ( ; i + 4 <= n; i += 4) {
+        __m128 x = _mm_and_ps(_mm_loadu_ps(p + i), abs);
+        vmax = _mm_max_ps(vmax, x);
+        __m128d lo = _mm_cvtps_pd(x);
+        __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(x, x));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(lo, lo));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(hi, hi));
+    }
+
+    float maxs[4];
+    double accs[2];
+    _mm_storeu_ps(maxs, vmax);
+    _mm_storeu_pd(accs, _mm_add_pd(acc0, acc1));
+
+    double peak, sum2;
+    upipe_audio_meter_flt_c(p + i, n - i, &peak, &sum2);
+    for (int j = 0; j < 4; j++)
+        if (maxs[j] > peak)
+            peak = maxs[j];
+    *peak_p = peak;
+    *sum2_p = sum2 + accs[0] + accs[1];
+}
+
+__attribute__((target("avx2")))
+void upipe_audio_meter_s16_avx2(const int16_t *p, uintptr_t n,
+                                double *peak_p, double *sum2_p)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vmax = zero, vmin = zero, acc = zero;
+    uintptr_t i = 0;
+    for ( ; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        vmax = _mm256_max_epi16(vmax, x);
+        vmin = _mm256_min_epi16(vmin, x);
+        /* at most 2^31, so the pairs fit in unsigned 32 bits */
+        __m256i sq = _mm256_madd_epi16(x, x);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+    }
+
+    int16_t maxs[16], mins[16];
+    uint64_t accs[4];
+    _mm256_storeu_si256((__m256i *)maxs, vmax);
+    _mm256_storeu_si256((__m256i *)mins, vmin);
+    _mm256_storeu_si256((__m256i *)accs, acc);
+    int32_t max = 0;
+    for (int j = 0; j < 16; j++) {
+        if (maxs[j] > max)
+            max = maxs[j];
+        if (-mins[j] > max)
+            max = -mins[j];
+    }
+
+    double peak, sum2;
+    upipe_audio_meter_s16_c(p + i, n - i, &peak, &sum2);
+    if (peak < max * 1. / INT16_MAX)
+        peak = max * 1. / INT16_MAX;
+    *peak_p = peak;
+    *sum2_p = sum2 + (accs[0] + accs[1] + accs[2] + accs[3]) * 1. /
+                     (INT16_MAX * INT16_MAX);
+}
+
+__attribute__((target("avx2")))
+void upipe_audio_meter_s32_avx2(const int32_t *p, uintptr_t n,
+                                double *peak_p, double *sum2_p)
+{
+    __m256i vmax = _mm256_setzero_si256(), vmin = _mm256_setzero_si256();
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    uintptr_t i = 0;
+    for ( ; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        vmax = _mm256_max_epi32(vmax, x);
+        vmin = _mm256_min_epi32(vmin, x);
+        __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(x));
+        __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1));
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(lo, lo));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(hi, hi));
+    }
+
+    int32_t maxs[8], mins[8];
+    double accs[4];
+    _mm256_storeu_si256((__m256i *)maxs, vmax);
+    _mm256_storeu_si256((__m256i *)mins, vmin);
+    _mm256_storeu_pd(accs, _mm256_add_pd(acc0, acc1));
+    int64_t max = 0;
+    for (int j = 0; j < 8; j++) {
+        if (maxs[j] > max)
+            max = maxs[j];
+        if (-(int64_t)mins[j] > max)
+            max = -(int64_t)mins[j];
+    }
+
+    double peak, sum2;
+    upipe_audio_meter_s32_c(p + i, n - i, &peak, &sum2);
+    if (peak < max * 1. / INT32_MAX)
+        peak = max * 1. / INT32_MAX;
+    *peak_p = peak;
+    *sum2_p = sum2 + (accs[0] + accs[1] + accs[2] + accs[3]) /
+                     ((double)INT32_MAX * INT32_MAX);
+}
+
+__attribute__((target("avx2")))
+void upipe_audio_meter_flt_avx2(const float *p, uintptr_t n,
+                                double *peak_p, double *sum2_p)
+{
+    const __m256 abs = _mm256_castsi256_ps(_mm256_set1_epi32(INT32_MAX));
+    __m256 vmax = _mm256_setzero_ps();
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    uintptr_t i = 0;
+    for ( ; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_and_ps(_mm256_loadu_ps(p + i), abs);
+        vmax = _mm256_max_ps(vmax, x);
+        __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(x));
+        __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1));
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(lo, lo));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(hi, hi));
+    }
+
+    float maxs[8];
+    double accs[4];
+    _mm256_storeu_ps(maxs, vmax);
+    _mm256_storeu_pd(accs, _mm256_add_pd(acc0, acc1));
+
+    double peak, sum2;
+    upipe_audio_meter_flt_c(p + i, n - i, &peak, &sum2);
+    for (int j = 0; j < 8; j++)
+        if (maxs[j] > peak)
+            peak = maxs[j];
+    *peak_p = peak;
+    *sum2_p = sum2 + accs[0] + accs[1] + accs[2] + accs[3];
+}
+
+__attribute__((target("avx2,fma")))
+float upipe_audio_meter_tp_avx2(const float coef[UPIPE_AUDIO_METER_TP_PHASES]
+                                                [UPIPE_AUDIO_METER_TP_TAPS],
+                                const float *x, uintptr_t n)
+{
+    const __m256 abs = _mm256_castsi256_ps(_mm256_set1_epi32(INT32_MAX));
+    __m256 vpeak = _mm256_setzero_ps();
+    uintptr_t i = 0;
+    for ( ; i + 8 <= n; i += 8) {
+        for (int k = 0; k < UPIPE_AUDIO_METER_TP_PHASES; k++) {
+            __m256 y = _mm256_setzero_ps();
+            for (int j = 0; j < UPIPE_AUDIO_METER_TP_TAPS; j++)
+                y = _mm256_fmadd_ps(_mm256_set1_ps(coef[k][j]),
+                                    _mm256_loadu_ps(x + i - j), y);
+            vpeak = _mm256_max_ps(vpeak, _mm256_and_ps(y, abs));
+        }
+    }
+
+    float peaks[8];
+    _mm256_storeu_ps(peaks, vpeak);
+    float peak = upipe_audio_meter_tp_c(coef, x + i, n - i);
+    for (int j = 0; j < 8; j++)
+        if (peaks[j] > peak)
+            peak = peaks[j];
+    return peak;
+}
+#endif
+
+void upipe_audio_meter_u8(const uint8_t *p, uintptr_t n,
+                          double *peak_p, double *sum2_p)
+{
+    upipe_audio_meter_u8_c(p, n, peak_p, sum2_p);
+}
+
+void upipe_audio_meter_s16(const int16_t *p, uintptr_t n,
+                           double *peak_p, double *sum2_p)
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return upipe_audio_meter_s16_avx2(p, n, peak_p, sum2_p);
+    if (__builtin_cpu_supports("sse2"))
+        return upipe_audio_meter_s16_sse2(p, n, peak_p, sum2_p);
+#endif
+    upipe_audio_meter_s16_c(p, n, peak_p, sum2_p);
+}
+
+void upipe_audio_meter_s32(const int32_t *p, uintptr_t n,
+                           double *peak_p, double *sum2_p)
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return upipe_audio_meter_s32_avx2(p, n, peak_p, sum2_p);
+#endif
+    upipe_audio_meter_s32_c(p, n, peak_p, sum2_p);
+}
+
+void upipe_audio_meter_flt(const float *p, uintptr_t n,
+                           double *peak_p, double *sum2_p)
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return upipe_audio_meter_flt_avx2(p, n, peak_p, sum2_p);
+    if (__builtin_cpu_supports("sse2"))
+        return upipe_audio_meter_flt_sse2(p, n, peak_p, sum2_p);
+#endif
+    upipe_audio_meter_flt_c(p, n, peak_p, sum2_p);
+}
+
+void upipe_audio_meter_dbl(const double *p, uintptr_t n,
+                           double *peak_p, double *sum2_p)
+{
+    upipe_audio_meter_dbl_c(p, n, peak_p, sum2_p);
+}
+
+/** @internal @This returns the true peak of a block, with the runtime
+ * dispatched interpolator.
+ *
+ * @param coef interpolator coefficients
+ * @param x pointer to the first sample, preceded by the history
+ * @param n number of samples
+ * @return true peak
+ */
+static float upipe_audio_meter_tp(const float
+                coef[UPIPE_AUDIO_METER_TP_PHASES][UPIPE_AUDIO_METER_TP_TAPS],
+                const float *x, uintptr_t n)
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return upipe_audio_meter_tp_avx2(coef, x, n);
+#endif
+    return upipe_audio_meter_tp_c(coef, x, n);
+}
+
+void upipe_audio_meter_tp_init(struct upipe_audio_meter_tp *tp)
+{
+    const int size = UPIPE_AUDIO_METER_TP_PHASES * UPIPE_AUDIO_METER_TP_TAPS;
+    for (int k = 0; k < UPIPE_AUDIO_METER_TP_PHASES; k++) {
+        double sum = 0.;
+        for (int j = 0; j < UPIPE_AUDIO_METER_TP_TAPS; j++) {
+            int m = j * UPIPE_AUDIO_METER_TP_PHASES + k;
+            double t = (m - (size - 1) / 2.) / UPIPE_AUDIO_METER_TP_PHASES;
+            double sinc = sin(M_PI * t) / (M_PI * t);
+            double window = 0.42 - 0.5 * cos(2. * M_PI * m / (size - 1)) +
+                            0.08 * cos(4. * M_PI * m / (size - 1));
+            tp->coef[k][j] = sinc * window;
+            sum += tp->coef[k][j];
+        }
+        /* unity gain at DC for each phase */
+        for (int j = 0; j < UPIPE_AUDIO_METER_TP_TAPS; j++)
+            tp->coef[k][j] /= sum;
+    }
+    memset(tp->history, 0, sizeof(tp->history));
+}
+
+#define UPIPE_AUDIO_METER_TP_TEMPLATE(type, name, offset, scale)            \
+double upipe_audio_meter_tp_##name(struct upipe_audio_meter_tp *tp,         \
+                                   const type *p, uintptr_t n)              \
+{                                                                           \
+    float buffer[UPIPE_AUDIO_METER_TP_TAPS - 1 + TP_CHUNK];                 \
+    float *x = buffer + UPIPE_AUDIO_METER_TP_TAPS - 1;                      \
+    float peak = 0.;                                                        \
+    while (n) {                                                             \
+        uintptr_t chunk = n < TP_CHUNK ? n : TP_CHUNK;                      \
+        memcpy(buffer, tp->history, sizeof(tp->history));                   \
+        for (uintptr_t i = 0; i < chunk; i++)                               \
+            x[i] = (p[i] - (offset)) * (scale);                             \
+        float ret = upipe_audio_meter_tp(tp->coef, x, chunk);               \
+        if (ret > peak)                                                     \
+            peak = ret;                                                     \
+        memcpy(tp->history, buffer + chunk, sizeof(tp->history));           \
+        p += chunk;                                                         \
+        n -= chunk;                                                         \
+    }                                                                       \
+    return peak;                                                            \
+}
+/* unsigned 8-bit samples are offset binary */
+UPIPE_AUDIO_METER_TP_TEMPLATE(uint8_t, u8, 128, 1.f / 128)
+UPIPE_AUDIO_METER_TP_TEMPLATE(int16_t, s16, 0, 1.f / INT16_MAX)
+UPIPE_AUDIO_METER_TP_TEMPLATE(int32_t, s32, 0, 1.f / INT32_MAX)
+UPIPE_AUDIO_METER_TP_TEMPLATE(float, flt, 0, 1.f)
+UPIPE_AUDIO_METER_TP_TEMPLATE(double, dbl, 0, 1.f)
+#undef UPIPE_AUDIO_METER_TP_TEMPLATE
@@ -0,0 +1,88 @@
+/*
+ * Audio metering kernels
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ */
+
+#include <stdint.h>
+
+/* number of taps of each phase of the true-peak interpolator */
+#define UPIPE_AUDIO_METER_TP_TAPS 12
+/* oversampling factor of the true-peak interpolator */
+#define UPIPE_AUDIO_METER_TP_PHASES 4
+
+/* peak and sum of squares of a plane, relative to full scale (the u8
+ * sum of squares is centered on 128, the u8 peak is not) */
+void upipe_audio_meter_u8_c  (const uint8_t *p, uintptr_t n,
+                              double *peak_p, double *sum2_p);
+void upipe_audio_meter_s16_c (const int16_t *p, uintptr_t n,
+                              double *peak_p, double *sum2_p);
+void upipe_audio_meter_s32_c (const int32_t *p, uintptr_t n,
+                              double *peak_p, double *sum2_p);
+void upipe_audio_meter_flt_c (const float *p, uintptr_t n,
+                              double *peak_p, double *sum2_p);
+void upipe_audio_meter_dbl_c (const double *p, uintptr_t n,
+                              double *peak_p, double *sum2_p);
+
+void upipe_audio_meter_s16_sse2(const int16_t *p, uintptr_t n,
+                                double *peak_p, double *sum2_p);
+void upipe_audio_meter_flt_sse2(const float *p, uintptr_t n,
+                                double *peak_p, double *sum2_p);
+void upipe_audio_meter_s16_avx2(const int16_t *p, uintptr_t n,
+                                double *peak_p, double *sum2_p);
+void upipe_audio_meter_s32_avx2(const int32_t *p, uintptr_t n,
+                                double *peak_p, double *sum2_p);
+void upipe_audio_meter_flt_avx2(const float *p, uintptr_t n,
+                                double *peak_p, double *sum2_p);
+
+/* runtime dispatched versions */
+void upipe_audio_meter_u8 (const uint8_t *p, uintptr_t n,
+                           double *peak_p, double *sum2_p);
+void upipe_audio_meter_s16(const int16_t *p, uintptr_t n,
+                           double *peak_p, double *sum2_p);
+void upipe_audio_meter_s32(const int32_t *p, uintptr_t n,
+                           double *peak_p, double *sum2_p);
+void upipe_audio_meter_flt(const float *p, uintptr_t n,
+                           double *peak_p, double *sum2_p);
+void upipe_audio_meter_dbl(const double *p, uintptr_t n,
+                           double *peak_p, double *sum2_p);
+
+/* peak of the signal oversampled 4 times, x[-TAPS+1] to x[n-1] are read */
+float upipe_audio_meter_tp_c   (const float coef[UPIPE_AUDIO_METER_TP_PHASES]
+                                                [UPIPE_AUDIO_METER_TP_TAPS],
+                                const float *x, uintptr_t n);
+float upipe_audio_meter_tp_avx2(const float coef[UPIPE_AUDIO_METER_TP_PHASES]
+                                                [UPIPE_AUDIO_METER_TP_TAPS],
+                                const float *x, uintptr_t n);
+
+/* true-peak state of a channel, kept between buffers */
+struct upipe_audio_meter_tp {
+    float coef[UPIPE_AUDIO_METER_TP_PHASES][UPIPE_AUDIO_METER_TP_TAPS];
+    float history[UPIPE_AUDIO_METER_TP_TAPS - 1];
+};
+
+void upipe_audio_meter_tp_init(struct upipe_audio_meter_tp *tp);
+
+/* runtime dispatched true-peak of a plane, relative to full scale */
+double upipe_audio_meter_tp_u8 (struct upipe_audio_meter_tp *tp,
+                                const uint8_t *p, uintptr_t n);
+double upipe_audio_meter_tp_s16(struct upipe_audio_meter_tp *tp,
+                                const int16_t *p, uintptr_t n);
+double upipe_audio_meter_tp_s32(struct upipe_audio_meter_tp *tp,
+                                const int32_t *p, uintptr_t n);
+double upipe_audio_meter_tp_flt(struct upipe_audio_meter_tp *tp,
+                                const float *p, uintptr_t n);
+double upipe_audio_meter_tp_dbl(struct upipe_audio_meter_tp *tp,
+                                const double *p, uintptr_t n);
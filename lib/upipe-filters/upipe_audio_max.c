@@ -35,11 +35,15 @@
 #include "upipe/upipe_helper_output.h"
 #include "upipe-filters/upipe_audio_max.h"
 
+#include "audio_meter.h"
+
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <math.h>
 
-typedef double (*upipe_amax_process)(struct upipe *, struct uref *,
-                                     const char *, size_t);
+typedef void (*upipe_amax_process)(struct upipe *, struct uref *,
+                                   const char *, size_t, uint8_t);
 
 /** @internal upipe_amax private structure */
 struct upipe_amax {
@@ -47,6 +51,12 @@ struct upipe_amax {
     struct urefcount urefcount;
 
     upipe_amax_process process;
+    /** number of planes */
+    uint8_t planes;
+    /** true if the true peak is measured */
+    bool true_peak;
+    /** true-peak states, one per plane */
+    struct upipe_audio_meter_tp *tp;
 
     /** output */
     struct upipe *output;
@@ -86,46 +96,72 @@ static struct upipe *upipe_amax_alloc(struct upipe_mgr *mgr,
     upipe_amax_init_urefcount(upipe);
     upipe_amax_init_output(upipe);
     upipe_amax->process = NULL;
+    upipe_amax->planes = 0;
+    upipe_amax->true_peak = false;
+    upipe_amax->tp = NULL;
 
     upipe_throw_ready(upipe);
     return upipe;
 }
 
-#define UPIPE_AMAX_TEMPLATE(type, type_max)                                 \
+#define UPIPE_AMAX_TEMPLATE(type, name)                                     \
 /** @internal @This processes input of format type.                         \
  *                                                                          \
  * @param upipe description structure of the pipe                           \
  * @param uref uref structure                                               \
  * @param channel channel name                                              \
  * @param samples number of samples                                         \
+ * @param plane plane number                                                \
  */                                                                         \
-static double upipe_amax_process_##type(struct upipe *upipe,                \
-        struct uref *uref, const char *channel, size_t samples)             \
+static void upipe_amax_process_##type(struct upipe *upipe,                  \
+        struct uref *uref, const char *channel, size_t samples,             \
+        uint8_t plane)                                                      \
 {                                                                           \
+    struct upipe_amax *upipe_amax = upipe_amax_from_upipe(upipe);           \
     const type *buf = NULL;                                                 \
     if (unlikely(!ubase_check(uref_sound_plane_read_##type(uref,            \
             channel, 0, -1, &buf)))) {                                      \
         upipe_warn(upipe, "error mapping sound buffer");                    \
-        return 0.;                                                          \
-    }                                                                       \
-    type max = 0;                                                           \
-    for (size_t i = 0; i < samples; i++) {                                  \
-        type c = buf[i];                                                    \
-        if (c > max)                                                        \
-            max = c;                                                        \
-        else if (-c > max)                                                  \
-            max = -c;                                                       \
+        uref_amax_set_amplitude(uref, 0., plane);                           \
+        return;                                                             \
     }                                                                       \
+    double peak, sum2;                                                      \
+    upipe_audio_meter_##name(buf, samples, &peak, &sum2);                   \
+    if (upipe_amax->tp != NULL)                                             \
+        uref_amax_set_true_peak(uref,                                       \
+                upipe_audio_meter_tp_##name(&upipe_amax->tp[plane],         \
+                                            buf, samples), plane);          \
     uref_sound_plane_unmap(uref, channel, 0, -1);                           \
-    return max * 1. / type_max;                                             \
+    uref_amax_set_amplitude(uref, peak, plane);                             \
+    uref_amax_set_rms(uref, samples ? sqrt(sum2 / samples) : 0., plane);    \
 }
-UPIPE_AMAX_TEMPLATE(uint8_t, UINT8_MAX)
-UPIPE_AMAX_TEMPLATE(int16_t, INT16_MAX)
-UPIPE_AMAX_TEMPLATE(int32_t, INT32_MAX)
-UPIPE_AMAX_TEMPLATE(float, 1.)
-UPIPE_AMAX_TEMPLATE(double, 1.)
+UPIPE_AMAX_TEMPLATE(uint8_t, u8)
+UPIPE_AMAX_TEMPLATE(int16_t, s16)
+UPIPE_AMAX_TEMPLATE(int32_t, s32)
+UPIPE_AMAX_TEMPLATE(float, flt)
+UPIPE_AMAX_TEMPLATE(double, dbl)
 #undef UPIPE_AMAX_TEMPLATE
 
+/** @internal @This allocates or frees the true-peak states.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int upipe_amax_alloc_tp(struct upipe *upipe)
+{
+    struct upipe_amax *upipe_amax = upipe_amax_from_upipe(upipe);
+    free(upipe_amax->tp);
+    upipe_amax->tp = NULL;
+    if (!upipe_amax->true_peak || !upipe_amax->planes)
+        return UBASE_ERR_NONE;
+
+    upipe_amax->tp = malloc(upipe_amax->planes * sizeof(*upipe_amax->tp));
+    UBASE_ALLOC_RETURN(upipe_amax->tp)
+    for (uint8_t i = 0; i < upipe_amax->planes; i++)
+        upipe_audio_meter_tp_init(&upipe_amax->tp[i]);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This handles input.
  *
  * @param upipe description structure of the pipe
@@ -151,8 +187,9 @@ static void upipe_amax_input(struct upipe *upipe, struct uref *uref,
     const char *channel = NULL;
     uint8_t j = 0;
     uref_sound_foreach_plane(uref, channel) {
-        double maxf = upipe_amax->process(upipe, uref, channel, samples);
-        uref_amax_set_amplitude(uref, maxf, j++);
+        if (unlikely(j >= upipe_amax->planes))
+            break;
+        upipe_amax->process(upipe, uref, channel, samples, j++);
     }
 
     upipe_amax_output(upipe, uref, upump_p);
@@ -192,6 +229,8 @@ static int upipe_amax_set_flow_def(struct upipe *upipe, struct uref *flow)
         return UBASE_ERR_INVALID;
 
     upipe_amax->process = process;
+    upipe_amax->planes = planes;
+    UBASE_RETURN(upipe_amax_alloc_tp(upipe))
 
     struct uref *flow_dup;
     if (unlikely((flow_dup = uref_dup(flow)) == NULL)) {
@@ -241,6 +280,21 @@ static int upipe_amax_provide_flow_format(struct upipe *upipe,
     return urequest_provide_flow_format(request, flow);
 }
 
+/** @internal @This enables or disables true-peak measurement.
+ *
+ * @param upipe description structure of the pipe
+ * @param enable true to measure the true peak
+ * @return an error code
+ */
+static int _upipe_amax_set_true_peak(struct upipe *upipe, bool enable)
+{
+    struct upipe_amax *upipe_amax = upipe_amax_from_upipe(upipe);
+    if (upipe_amax->true_peak == enable)
+        return UBASE_ERR_NONE;
+    upipe_amax->true_peak = enable;
+    return upipe_amax_alloc_tp(upipe);
+}
+
 /** @internal @This processes control commands on the pipe.
  *
  * @param upipe description structure of the pipe
@@ -271,6 +325,18 @@ static int upipe_amax_control(struct upipe *upipe, int command, va_list args)
         case UPIPE_GET_OUTPUT:
         case UPIPE_SET_OUTPUT:
             return upipe_amax_control_output(upipe, command, args);
+
+        case UPIPE_AMAX_SET_TRUE_PEAK: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AUDIO_MAX_SIGNATURE)
+            int enable = va_arg(args, int);
+            return _upipe_amax_set_true_peak(upipe, !!enable);
+        }
+        case UPIPE_AMAX_GET_TRUE_PEAK: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AUDIO_MAX_SIGNATURE)
+            int *enable_p = va_arg(args, int *);
+            *enable_p = upipe_amax_from_upipe(upipe)->true_peak;
+            return UBASE_ERR_NONE;
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -282,8 +348,10 @@ static int upipe_amax_control(struct upipe *upipe, int command, va_list args)
  */
 static void upipe_amax_free(struct upipe *upipe)
 {
+    struct upipe_amax *upipe_amax = upipe_amax_from_upipe(upipe);
     upipe_throw_dead(upipe);
 
+    free(upipe_amax->tp);
     upipe_amax_clean_output(upipe);
     upipe_amax_clean_urefcount(upipe);
     upipe_amax_free_void(upipe);
@@ -64,6 +64,12 @@
 #include <bitstream/ietf/rtcp3611.h>
 
 #define EXPECTED_FLOW_DEF "block."
+/** number of RTP sequence numbers */
+#define SEQNUM_COUNT 65536
+/** number of 64-bit words in a bitmap of sequence numbers */
+#define SEQNUM_WORDS (SEQNUM_COUNT / 64)
+/** maximum number of FCIs in a NACK packet */
+#define NACK_MAX_FCI 64
 
 /** upipe_rtpfb structure */
 struct upipe_rtpfb {
@@ -114,7 +120,15 @@ struct upipe_rtpfb {
     struct upipe *rtpfb_output;
 
     /** last time a NACK was sent */
-    uint64_t last_nack[65536];
+    uint64_t last_nack[SEQNUM_COUNT];
+    /** queued urefs indexed by sequence number */
+    struct uref **seqnums;
+    /** bitmap of the sequence numbers present in the queue */
+    uint64_t present[SEQNUM_WORDS];
+    /** bitmap of the sequence numbers lost and not repaired yet */
+    uint64_t lost[SEQNUM_WORDS];
+    /** true to send RIST range NACKs instead of generic NACKs */
+    bool nack_range;
 
     uint64_t rtt;
 
@@ -291,20 +305,111 @@ static void upipe_rtpfb_output_free(struct upipe *upipe)
     upipe_rtpfb_output_free_void(upipe);
 }
 
-/** @internal @This sends a retransmission request for a number of seqnums.
+/** @internal @This returns true if a sequence number is set in a bitmap.
  *
- * @param upipe description structure of the pipe
- * @param lost_seqnum First sequence number missing
- * @param seqnum First sequence number NOT missing
- * @param ssrc TODO
+ * @param bitmap bitmap of sequence numbers
+ * @param seqnum sequence number
+ * @return true if the sequence number is set
+ */
+static inline bool upipe_rtpfb_seqnum_test(const uint64_t *bitmap,
+                                           uint16_t seqnum)
+{
+    return bitmap[seqnum / 64] & (UINT64_C(1) << (seqnum % 64));
+}
+
+/** @internal @This sets a sequence number in a bitmap.
+ *
+ * @param bitmap bitmap of sequence numbers
+ * @param seqnum sequence number
+ */
+static inline void upipe_rtpfb_seqnum_set(uint64_t *bitmap, uint16_t seqnum)
+{
+    bitmap[seqnum / 64] |= UINT64_C(1) << (seqnum % 64);
+}
+
+/** @internal @This clears a sequence number in a bitmap.
+ *
+ * @param bitmap bitmap of sequence numbers
+ * @param seqnum sequence number
+ */
+static inline void upipe_rtpfb_seqnum_clear(uint64_t *bitmap, uint16_t seqnum)
+{
+    bitmap[seqnum / 64] &= ~(UINT64_C(1) << (seqnum % 64));
+}
+
+/** @internal @This clears a range of sequence numbers in a bitmap.
+ *
+ * @param bitmap bitmap of sequence numbers
+ * @param seqnum first sequence number
+ * @param count number of sequence numbers
+ */
+static void upipe_rtpfb_seqnum_clear_range(uint64_t *bitmap, uint16_t seqnum,
+                                           unsigned count)
+{
+    while (count) {
+        unsigned bit = seqnum % 64;
+        unsigned bits = 64 - bit < count ? 64 - bit : count;
+        uint64_t mask = bits == 64 ? UINT64_MAX :
+                        ((UINT64_C(1) << bits) - 1) << bit;
+        bitmap[seqnum / 64] &= ~mask;
+        seqnum += bits;
+        count -= bits;
+    }
+}
+
+/** @internal @This finds the first sequence number set in a range of a
+ * bitmap, testing 64 sequence numbers at a time.
+ *
+ * @param bitmap bitmap of sequence numbers
+ * @param seqnum first sequence number of the range
+ * @param count number of sequence numbers in the range
+ * @return offset of the first sequence number set from the start of the
+ * range, or count if none is set
  */
-static void upipe_rtpfb_output_lost(struct upipe *upipe, uint16_t lost_seqnum, uint16_t seqnum, uint8_t *ssrc)
+static unsigned upipe_rtpfb_seqnum_find(const uint64_t *bitmap,
+                                        uint16_t seqnum, unsigned count)
+{
+    unsigned offset = 0;
+    while (offset < count) {
+        uint16_t seq = seqnum + offset;
+        uint64_t word = bitmap[seq / 64] >> (seq % 64);
+        if (word) {
+            offset += __builtin_ctzll(word);
+            return offset < count ? offset : count;
+        }
+        offset += 64 - seq % 64;
+    }
+    return count;
+}
+
+/** @internal @This is a retransmission request being built. */
+struct upipe_rtpfb_nack {
+    /** number of FCIs */
+    unsigned fcis;
+    /** first lost sequence number of each FCI */
+    uint16_t seqnum[NACK_MAX_FCI];
+    /** bitmask of the following lost packets (generic NACK), or number of
+     * additional lost packets after the first one (range NACK) of each FCI */
+    uint16_t extra[NACK_MAX_FCI];
+};
+
+/** @internal @This sends a retransmission request.
+ *
+ * @param upipe description structure of the output subpipe
+ * @param nack retransmission request
+ * @param ssrc SSRC of the media source
+ */
+static void upipe_rtpfb_output_lost(struct upipe *upipe,
+                                    const struct upipe_rtpfb_nack *nack,
+                                    const uint8_t *ssrc)
 {
     struct upipe_rtpfb_output *upipe_rtpfb_output = upipe_rtpfb_output_from_upipe(upipe);
     struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_sub_mgr(upipe->mgr);
 
-    /* Send a single NACK packet, with a single FCI */
-    int s = RTCP_FB_HEADER_SIZE + 1 * RTCP_FB_FCI_GENERIC_NACK_SIZE;
+    /* generic NACK (RFC 4585) or RIST range NACK (APP packet), both with
+     * 4-octet FCIs */
+    int header_size = upipe_rtpfb->nack_range ? 12 : RTCP_FB_HEADER_SIZE;
+    int s = header_size + nack->fcis * RTCP_FB_FCI_GENERIC_NACK_SIZE;
 
     /* Allocate NACK packet */
     struct uref *pkt = uref_block_alloc(upipe_rtpfb_output->uref_mgr,
@@ -318,35 +423,38 @@ static void upipe_rtpfb_output_lost(struct upipe *upipe, uint16_t lost_seqnum, u
     uref_block_write(pkt, 0, &s, &buf);
     memset(buf, 0, s);
 
-    /* Header */
-    rtcp_set_rtp_version(buf);
-    rtcp_fb_set_fmt(buf, RTCP_PT_RTPFB_GENERIC_NACK);
-    rtcp_set_pt(buf, RTCP_PT_RTPFB);
-
     // TODO : make receiver SSRC configurable
     uint8_t ssrc_sender[4] = { 0x1, 0x2, 0x3, 0x4 };
-    rtcp_fb_set_ssrc_pkt_sender(buf, ssrc_sender);
-    rtcp_fb_set_ssrc_media_src(buf, ssrc);
-
-    uint8_t *fci = &buf[RTCP_FB_HEADER_SIZE];
-    rtcp_fb_nack_set_packet_id(fci, lost_seqnum);
-
-    uint16_t pkts = seqnum - 1 - lost_seqnum;
-    // TODO : add several FCI if more than 17 packets are missing
-    if (pkts > 16)
-        pkts = 16;
 
-    uint16_t bits = 0;
-    for (size_t i = 0; i < pkts; i++)
-        bits |= 1 << i;
+    /* Header */
+    rtcp_set_rtp_version(buf);
+    if (upipe_rtpfb->nack_range) {
+        rtcp_set_pt(buf, RTCP_PT_APP);
+        rtcp_fb_set_ssrc_pkt_sender(buf, ssrc);
+        memcpy(&buf[8], "RIST", 4);
+    } else {
+        rtcp_fb_set_fmt(buf, RTCP_PT_RTPFB_GENERIC_NACK);
+        rtcp_set_pt(buf, RTCP_PT_RTPFB);
+        rtcp_fb_set_ssrc_pkt_sender(buf, ssrc_sender);
+        rtcp_fb_set_ssrc_media_src(buf, ssrc);
+    }
 
-    rtcp_fb_nack_set_bitmask_lost(fci, bits);
-    upipe_rtpfb->nacks += pkts + 1;
+    uint8_t *fci = &buf[header_size];
+    for (unsigned i = 0; i < nack->fcis; i++) {
+        /* the range form uses the same layout as the generic form */
+        rtcp_fb_nack_set_packet_id(fci, nack->seqnum[i]);
+        rtcp_fb_nack_set_bitmask_lost(fci, nack->extra[i]);
+        if (upipe_rtpfb->nack_range)
+            upipe_verbose_va(upipe, "NACKing %hu (+%hu)", nack->seqnum[i],
+                             nack->extra[i]);
+        else
+            upipe_verbose_va(upipe, "NACKing %hu (+0x%hx)", nack->seqnum[i],
+                             nack->extra[i]);
+        fci += RTCP_FB_FCI_GENERIC_NACK_SIZE;
+    }
 
     rtcp_set_length(buf, s / 4 - 1);
 
-    upipe_verbose_va(upipe, "NACKing %hu (+0x%hx)", lost_seqnum, bits);
-
     uref_block_unmap(pkt, 0);
 
     // XXX : date NACK packet?
@@ -355,6 +463,47 @@ static void upipe_rtpfb_output_lost(struct upipe *upipe, uint16_t lost_seqnum, u
     upipe_rtpfb_output_output(upipe, pkt, NULL);
 }
 
+/** @internal @This adds a lost sequence number to a retransmission request,
+ * sending it first if it is full.
+ *
+ * @param upipe description structure of the pipe
+ * @param nack retransmission request
+ * @param seqnum lost sequence number, greater than the previous ones
+ */
+static void upipe_rtpfb_nack_add(struct upipe *upipe,
+                                 struct upipe_rtpfb_nack *nack,
+                                 uint16_t seqnum)
+{
+    struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_upipe(upipe);
+    upipe_rtpfb->nacks++;
+
+    if (nack->fcis) {
+        unsigned last = nack->fcis - 1;
+        uint16_t diff = seqnum - nack->seqnum[last];
+        if (upipe_rtpfb->nack_range) {
+            /* extend the range if this is the next packet */
+            if (nack->extra[last] < UINT16_MAX &&
+                diff == nack->extra[last] + 1) {
+                nack->extra[last]++;
+                return;
+            }
+        } else if (diff >= 1 && diff <= 16) {
+            nack->extra[last] |= 1 << (diff - 1);
+            return;
+        }
+    }
+
+    if (nack->fcis == NACK_MAX_FCI) {
+        if (upipe_rtpfb->rtpfb_output)
+            upipe_rtpfb_output_lost(upipe_rtpfb->rtpfb_output, nack,
+                                    upipe_rtpfb->last_ssrc);
+        nack->fcis = 0;
+    }
+    nack->seqnum[nack->fcis] = seqnum;
+    nack->extra[nack->fcis] = 0;
+    nack->fcis++;
+}
+
 static uint64_t _upipe_rtpfb_get_rtt(struct upipe *upipe)
 {
     struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_upipe(upipe);
@@ -376,7 +525,9 @@ static void upipe_rtpfb_timer_lost(struct upump *upump)
     struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
     struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_upipe(upipe);
 
-    uint64_t expected_seq = UINT64_MAX;
+    if (ulist_empty(&upipe_rtpfb->queue) ||
+        upipe_rtpfb->expected_seqnum == UINT_MAX)
+        return;
 
     uint64_t rtt = _upipe_rtpfb_get_rtt(upipe);
 
@@ -390,61 +541,41 @@ static void upipe_rtpfb_timer_lost(struct upump *upump)
      * XXX: use cr_sys, because pkts/s also accounts for
      * the retransmitted packets */
 
-    struct uchain *uchain;
-    int holes = 0;
-    ulist_foreach(&upipe_rtpfb->queue, uchain) {
-        struct uref *uref = uref_from_uchain(uchain);
-        uint64_t seqnum = 0;
-        uref_attr_get_priv(uref, &seqnum);
-
-        if (likely(expected_seq != UINT64_MAX) && seqnum != expected_seq) {
-            /* hole found */
-            upipe_dbg_va(upipe, "Found hole from %"PRIu64" (incl) to %"PRIu64" (excl)",
-                expected_seq, seqnum);
-
-            for (uint16_t seq = expected_seq; seq != seqnum; seq++) {
-                /* if packet was lost, we should have detected it already */
-                if (upipe_rtpfb->last_nack[seq] == 0) {
-                    upipe_err_va(upipe, "packet %hu missing but was not marked as lost!", seq);
-                    continue;
-                }
-
-                /* if we sent a NACK not too long ago, do not repeat it */
-                /* since NACKs are sent in a batch, break loop if the first packet is too early */
-                if (upipe_rtpfb->last_nack[seq] > next_nack) {
-                    if (0) upipe_err_va(upipe, "Cancelling NACK due to RTT (seq %hu diff %"PRId64"",
-                        seq, next_nack - upipe_rtpfb->last_nack[seq]
-                    );
-                    goto next;
-                }
-            }
-
-            /* update NACK request time */
-            for (uint16_t seq = expected_seq; seq != seqnum; seq++) {
-                upipe_rtpfb->last_nack[seq] = now;
-            }
-
-            /* TODO:
-                - check the following packets to fill in bitmask
-                - send request in a single batch (multiple FCI)
-             */
-            if (upipe_rtpfb->rtpfb_output)
-                upipe_rtpfb_output_lost(upipe_rtpfb->rtpfb_output, expected_seq, seqnum, upipe_rtpfb->last_ssrc);
-            holes++;
+    /* only visit the lost packets between the first queued packet and the
+     * next expected one */
+    uint64_t first_seqnum = 0;
+    uref_attr_get_priv(uref_from_uchain(ulist_peek(&upipe_rtpfb->queue)),
+                       &first_seqnum);
+    uint16_t seq = first_seqnum;
+    unsigned count = (uint16_t)(upipe_rtpfb->expected_seqnum - seq);
+
+    struct upipe_rtpfb_nack nack;
+    nack.fcis = 0;
+    unsigned lost = 0;
+    for ( ; ; ) {
+        unsigned offset = upipe_rtpfb_seqnum_find(upipe_rtpfb->lost,
+                                                  seq, count);
+        if (offset == count)
+            break;
+        seq += offset;
+        count -= offset;
+        lost++;
+
+        /* if we sent a NACK not too long ago, do not repeat it */
+        if (upipe_rtpfb->last_nack[seq] <= next_nack) {
+            upipe_rtpfb->last_nack[seq] = now;
+            upipe_rtpfb_nack_add(upipe, &nack, seq);
         }
-
-next:
-        expected_seq = (seqnum + 1) & UINT16_MAX;
+        seq++;
+        count--;
     }
 
-    if (holes) { /* debug stats */
-        uint64_t now = uclock_now(upipe_rtpfb->uclock);
-        static uint64_t old;
-        if (likely(old != 0))
-            upipe_dbg_va(upipe, "%d holes after %"PRIu64" ms",
-                    holes, 1000 * (now - old) / UCLOCK_FREQ);
-        old = now;
-    }
+    if (nack.fcis && upipe_rtpfb->rtpfb_output)
+        upipe_rtpfb_output_lost(upipe_rtpfb->rtpfb_output, &nack,
+                                upipe_rtpfb->last_ssrc);
+
+    if (lost)
+        upipe_verbose_va(upipe, "%u packets missing", lost);
 }
 
 /** @internal @This periodic timer remove seqnums from the buffer.
@@ -474,6 +605,9 @@ static void upipe_rtpfb_timer(struct upump *upump)
         upipe_verbose_va(upipe, "Output seq %"PRIu64" after %"PRIu64" clocks", seqnum, now - cr_sys);
         if (likely(upipe_rtpfb->last_output_seqnum != UINT_MAX)) {
             uint16_t diff = seqnum - upipe_rtpfb->last_output_seqnum - 1;
+            /* packets skipped over can no longer be repaired */
+            upipe_rtpfb_seqnum_clear_range(upipe_rtpfb->lost,
+                    upipe_rtpfb->last_output_seqnum + 1, diff);
             if (diff) {
                 upipe_rtpfb->loss += diff;
                 upipe_dbg_va(upipe, "PKT LOSS: %u -> %"PRIu64" DIFF %hu",
@@ -482,6 +616,8 @@ static void upipe_rtpfb_timer(struct upump *upump)
         }
 
         upipe_rtpfb->last_output_seqnum = seqnum;
+        upipe_rtpfb_seqnum_clear(upipe_rtpfb->present, seqnum);
+        upipe_rtpfb->seqnums[(uint16_t)seqnum] = NULL;
 
         ulist_delete(uchain);
         upipe_rtpfb_output(upipe, uref, NULL); // XXX: use timer upump ?
@@ -738,6 +874,12 @@ static struct upipe *upipe_rtpfb_alloc(struct upipe_mgr *mgr,
         return NULL;
 
     struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_upipe(upipe);
+    upipe_rtpfb->seqnums = calloc(SEQNUM_COUNT, sizeof(struct uref *));
+    if (unlikely(upipe_rtpfb->seqnums == NULL)) {
+        upipe_rtpfb_free_void(upipe);
+        return NULL;
+    }
+
     upipe_rtpfb_init_urefcount(upipe);
     upipe_rtpfb_init_urefcount_real(upipe);
     upipe_rtpfb_init_output(upipe);
@@ -751,6 +893,9 @@ static struct upipe *upipe_rtpfb_alloc(struct upipe_mgr *mgr,
     upipe_rtpfb_init_uclock(upipe);
     ulist_init(&upipe_rtpfb->queue);
     memset(upipe_rtpfb->last_nack, 0, sizeof(upipe_rtpfb->last_nack));
+    memset(upipe_rtpfb->present, 0, sizeof(upipe_rtpfb->present));
+    memset(upipe_rtpfb->lost, 0, sizeof(upipe_rtpfb->lost));
+    upipe_rtpfb->nack_range = false;
     upipe_rtpfb->rtt = 0;
     upipe_rtpfb_require_uclock(upipe);
     upipe_rtpfb->rtpfb_output = NULL;
@@ -770,30 +915,35 @@ static struct upipe *upipe_rtpfb_alloc(struct upipe_mgr *mgr,
 }
 
 /* returns true if uref was inserted in the queue */
-static bool upipe_rtpfb_insert_inner(struct upipe *upipe, struct uref *uref,
-        const uint16_t seqnum, struct uref *next)
+static bool upipe_rtpfb_insert(struct upipe *upipe, struct uref *uref, const uint16_t seqnum)
 {
     struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_upipe(upipe);
-    uint64_t next_seqnum = 0;
-    uref_attr_get_priv(next, &next_seqnum);
 
-    uint16_t diff = seqnum - next_seqnum;
-    if (!diff) {
+    if (upipe_rtpfb_seqnum_test(upipe_rtpfb->present, seqnum)) {
         upipe_verbose_va(upipe, "dropping duplicate %hu", seqnum);
         upipe_rtpfb->dups++;
         uref_free(uref);
         return true;
     }
 
-    /* browse the list until we find a seqnum bigger than ours */
-    if (diff < 0x8000) // seqnum > next_seqnum
+    /* packets which are neither queued nor lost were already output */
+    if (!upipe_rtpfb_seqnum_test(upipe_rtpfb->lost, seqnum))
+        return false;
+
+    /* find the packet following ours in the queue */
+    unsigned count = (uint16_t)(upipe_rtpfb->expected_seqnum - seqnum - 1);
+    unsigned offset = upipe_rtpfb_seqnum_find(upipe_rtpfb->present,
+                                              seqnum + 1, count);
+    if (unlikely(offset == count))
         return false;
+    uint16_t next_seqnum = seqnum + 1 + offset;
+    struct uref *next = upipe_rtpfb->seqnums[next_seqnum];
 
     /* if there's no previous packet we're too late */
     struct uchain *uchain = uref_to_uchain(next);
     if (unlikely(ulist_is_first(&upipe_rtpfb->queue, uchain))) {
         upipe_dbg_va(upipe,
-                "LATE packet drop: Expected %u, got %hu, didn't insert after %"PRIu64,
+                "LATE packet drop: Expected %u, got %hu, didn't insert after %hu",
                 upipe_rtpfb->expected_seqnum, seqnum, next_seqnum);
         uref_free(uref);
         return true;
@@ -816,29 +966,17 @@ static bool upipe_rtpfb_insert_inner(struct upipe *upipe, struct uref *uref,
     upipe_rtpfb->buffered++;
     ulist_insert(uchain->prev, uchain, uref_to_uchain(uref));
     upipe_rtpfb->repaired++;
+    upipe_rtpfb->seqnums[seqnum] = uref;
+    upipe_rtpfb_seqnum_set(upipe_rtpfb->present, seqnum);
+    upipe_rtpfb_seqnum_clear(upipe_rtpfb->lost, seqnum);
     upipe_rtpfb->last_nack[seqnum] = 0;
 
-    upipe_dbg_va(upipe, "Repaired %"PRIu64" > %hu > %"PRIu64" -diff %d",
-            prev_seqnum, seqnum, next_seqnum, -diff);
+    upipe_dbg_va(upipe, "Repaired %"PRIu64" > %hu > %hu",
+            prev_seqnum, seqnum, next_seqnum);
 
     return true;
 }
 
-static bool upipe_rtpfb_insert(struct upipe *upipe, struct uref *uref, const uint16_t seqnum)
-{
-    struct upipe_rtpfb *upipe_rtpfb = upipe_rtpfb_from_upipe(upipe);
-
-    struct uchain *uchain, *uchain_tmp;
-    ulist_delete_foreach(&upipe_rtpfb->queue, uchain, uchain_tmp) {
-        struct uref *next = uref_from_uchain(uchain);
-        if (upipe_rtpfb_insert_inner(upipe, uref, seqnum, next))
-            return true;
-    }
-
-    /* Could not insert packet */
-    return false;
-}
-
 /** @internal @This handles RTCP data.
  *
  * @param upipe description structure of the pipe
@@ -989,8 +1127,10 @@ static void upipe_rtpfb_input(struct upipe *upipe, struct uref *uref,
     uref_attr_set_priv(uref, seqnum);
 
     /* first packet */
-    if (unlikely(upipe_rtpfb->expected_seqnum == UINT_MAX))
+    if (unlikely(upipe_rtpfb->expected_seqnum == UINT_MAX)) {
         upipe_rtpfb->expected_seqnum = seqnum;
+        memset(upipe_rtpfb->lost, 0, sizeof(upipe_rtpfb->lost));
+    }
 
     uint16_t diff = seqnum - upipe_rtpfb->expected_seqnum;
 
@@ -998,6 +1138,9 @@ static void upipe_rtpfb_input(struct upipe *upipe, struct uref *uref,
         /* packet is from the future */
         upipe_rtpfb->buffered++;
         ulist_add(&upipe_rtpfb->queue, uref_to_uchain(uref));
+        upipe_rtpfb->seqnums[seqnum] = uref;
+        upipe_rtpfb_seqnum_set(upipe_rtpfb->present, seqnum);
+        upipe_rtpfb_seqnum_clear(upipe_rtpfb->lost, seqnum);
         upipe_rtpfb->last_nack[seqnum] = 0;
 
         if (diff != 0) {
@@ -1005,8 +1148,10 @@ static void upipe_rtpfb_input(struct upipe *upipe, struct uref *uref,
             /* wait a bit to send a NACK, in case of reordering */
             uint64_t fake_last_nack = uclock_now(upipe_rtpfb->uclock) - rtt;
             for (uint16_t seq = upipe_rtpfb->expected_seqnum; seq != seqnum; seq++)
-                if (upipe_rtpfb->last_nack[seq] == 0)
+                if (!upipe_rtpfb_seqnum_test(upipe_rtpfb->lost, seq)) {
+                    upipe_rtpfb_seqnum_set(upipe_rtpfb->lost, seq);
                     upipe_rtpfb->last_nack[seq] = fake_last_nack;
+                }
         }
 
         upipe_rtpfb->expected_seqnum = seqnum + 1;
@@ -1072,6 +1217,14 @@ static int upipe_rtpfb_set_option(struct upipe *upipe, const char *k, const char
     } else if (!strcmp(k, "latency")) {
         upipe_dbg_va(upipe, "Setting latency to %s msecs", v);
         upipe_rtpfb->latency = atoi(v) * UCLOCK_FREQ / 1000;
+    } else if (!strcmp(k, "nack")) {
+        /* "bitmask" for generic NACKs, "range" for RIST range NACKs */
+        if (!strcmp(v, "range"))
+            upipe_rtpfb->nack_range = true;
+        else if (!strcmp(v, "bitmask"))
+            upipe_rtpfb->nack_range = false;
+        else
+            return UBASE_ERR_INVALID;
     } else
         return UBASE_ERR_INVALID;
 
@@ -1175,6 +1328,7 @@ static void upipe_rtpfb_free(struct upipe *upipe)
         ulist_delete(uchain);
         uref_free(uref);
     }
+    free(upipe_rtpfb->seqnums);
 
     upipe_rtpfb_free_void(upipe);
 }
@@ -132,6 +132,20 @@ struct upipe_hls_playlist {
     struct upump_mgr *upump_mgr;
     /** timer */
     struct upump *upump;
+    /** item end timer for segments played from the cache */
+    struct upump *upump_end;
+
+    /** list of prefetched segments */
+    struct uchain segments;
+    /** segment being played */
+    struct upipe_hls_playlist_segment *segment;
+    /** maximum number of prefetched segments */
+    unsigned int prefetch_count;
+    /** maximum size of the prefetched segments */
+    uint64_t prefetch_size;
+    /** octet rate of the downloaded segments, to estimate the size of the
+     * segments to prefetch, or 0 if unknown */
+    uint64_t prefetch_octetrate;
 
     /** current index in the playlist */
     uint64_t index;
@@ -188,6 +202,55 @@ UPIPE_HELPER_UPROBE(upipe_hls_playlist, urefcount_real, probe_setflowdef, NULL);
 UPIPE_HELPER_BIN_OUTPUT(upipe_hls_playlist, setflowdef, output, requests);
 UPIPE_HELPER_UPUMP_MGR(upipe_hls_playlist, upump_mgr);
 UPIPE_HELPER_UPUMP(upipe_hls_playlist, upump, upump_mgr);
+UPIPE_HELPER_UPUMP(upipe_hls_playlist, upump_end, upump_mgr);
+
+/** @internal @This is a segment downloaded in the cache, keyed by its URI and
+ * byte range. It is owned by the cache list and by the playlist while it is
+ * played, and its probes keep it alive until the inner pipes are dead. */
+struct upipe_hls_playlist_segment {
+    /** for the list of prefetched segments */
+    struct uchain uchain;
+    /** refcount of the owners */
+    struct urefcount urefcount;
+    /** refcount of the inner probes */
+    struct urefcount urefcount_real;
+    /** playlist pipe */
+    struct upipe *upipe;
+
+    /** URI of the segment */
+    char *uri;
+    /** byte range offset */
+    uint64_t range_off;
+    /** byte range length */
+    uint64_t range_len;
+    /** duration of the segment, or 0 if unknown */
+    uint64_t duration;
+
+    /** source pipe */
+    struct upipe *src;
+    /** source probe */
+    struct uprobe probe_src;
+    /** probe for the probe uref pipe receiving the data */
+    struct uprobe probe_sink;
+
+    /** flow definition of the segment */
+    struct uref *flow_def;
+    /** list of buffered urefs */
+    struct uchain urefs;
+    /** size of the buffered urefs */
+    uint64_t size;
+    /** size of the received urefs, buffered or played */
+    uint64_t received;
+    /** the source has ended */
+    bool complete;
+};
+
+UBASE_FROM_TO(upipe_hls_playlist_segment, uchain, uchain, uchain);
+UBASE_FROM_TO(upipe_hls_playlist_segment, urefcount, urefcount, urefcount);
+UBASE_FROM_TO(upipe_hls_playlist_segment, urefcount, urefcount_real,
+              urefcount_real);
+UBASE_FROM_TO(upipe_hls_playlist_segment, uprobe, probe_src, probe_src);
+UBASE_FROM_TO(upipe_hls_playlist_segment, uprobe, probe_sink, probe_sink);
 
 /** @internal @This catches the inner key source pipe event.
  *
@@ -345,6 +408,306 @@ static int probe_src(struct uprobe *uprobe, struct upipe *inner,
     return upipe_throw_proxy(upipe, inner, event, args);
 }
 
+/** @internal @This checks if the source manager is set and asks for it if not.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int upipe_hls_playlist_check_source_mgr(struct upipe *upipe)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    if (unlikely(upipe_hls_playlist->source_mgr == NULL))
+        return upipe_throw_need_source_mgr(
+            upipe, &upipe_hls_playlist->source_mgr);
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This frees a segment when its inner pipes are dead.
+ *
+ * @param urefcount pointer to the urefcount of the inner probes
+ */
+static void upipe_hls_playlist_segment_free(struct urefcount *urefcount)
+{
+    struct upipe_hls_playlist_segment *segment =
+        upipe_hls_playlist_segment_from_urefcount_real(urefcount);
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(segment->upipe);
+
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&segment->urefs)) != NULL)
+        uref_free(uref_from_uchain(uchain));
+    uref_free(segment->flow_def);
+    free(segment->uri);
+    uprobe_clean(&segment->probe_sink);
+    uprobe_clean(&segment->probe_src);
+    urefcount_clean(&segment->urefcount_real);
+    urefcount_clean(&segment->urefcount);
+    free(segment);
+    urefcount_release(&upipe_hls_playlist->urefcount_real);
+}
+
+/** @internal @This is called when a segment is neither cached nor played,
+ * and releases its source pipe.
+ *
+ * @param urefcount pointer to the urefcount of the owners
+ */
+static void upipe_hls_playlist_segment_no_ref(struct urefcount *urefcount)
+{
+    struct upipe_hls_playlist_segment *segment =
+        upipe_hls_playlist_segment_from_urefcount(urefcount);
+
+    if (segment->src != NULL && !segment->complete)
+        upipe_dbg_va(segment->upipe, "abort download of %s", segment->uri);
+    upipe_release(segment->src);
+    segment->src = NULL;
+    urefcount_release(&segment->urefcount_real);
+}
+
+/** @internal @This releases a segment.
+ *
+ * @param segment segment to release
+ */
+static void upipe_hls_playlist_segment_release(
+    struct upipe_hls_playlist_segment *segment)
+{
+    if (segment != NULL)
+        urefcount_release(&segment->urefcount);
+}
+
+/** @hidden */
+static void upipe_hls_playlist_prefetch(struct upipe *upipe);
+
+/** @internal @This catches the events of the source pipe of a segment.
+ *
+ * @param uprobe structure used to raise events
+ * @param inner the inner pipe
+ * @param event event thrown
+ * @param args optional arguments
+ * @return an error code
+ */
+static int upipe_hls_playlist_segment_probe_src(struct uprobe *uprobe,
+                                                struct upipe *inner,
+                                                int event, va_list args)
+{
+    struct upipe_hls_playlist_segment *segment =
+        upipe_hls_playlist_segment_from_probe_src(uprobe);
+    struct upipe *upipe = segment->upipe;
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+
+    switch (event) {
+    case UPROBE_SOURCE_END:
+        upipe_dbg_va(upipe, "segment %s complete", segment->uri);
+        segment->complete = true;
+        if (segment->duration && segment->received) {
+            uint64_t octetrate =
+                segment->received * UCLOCK_FREQ / segment->duration;
+            if (upipe_hls_playlist->prefetch_octetrate)
+                octetrate = (upipe_hls_playlist->prefetch_octetrate * 3 +
+                             octetrate) / 4;
+            upipe_hls_playlist->prefetch_octetrate = octetrate;
+        }
+        /* a download slot is available */
+        upipe_hls_playlist_prefetch(upipe);
+        if (upipe_hls_playlist->segment != segment)
+            return UBASE_ERR_NONE;
+        upipe_dbg(upipe, "stopped");
+        upipe_hls_playlist->playing = false;
+        return upipe_hls_playlist_throw_item_end(upipe);
+    }
+    return upipe_throw_proxy(upipe, inner, event, args);
+}
+
+/** @internal @This catches the events of the probe uref pipe receiving the
+ * data of a segment. The data is forwarded if the segment is played, and
+ * buffered otherwise.
+ *
+ * @param uprobe structure used to raise events
+ * @param inner the inner pipe
+ * @param event event thrown
+ * @param args optional arguments
+ * @return an error code
+ */
+static int upipe_hls_playlist_segment_probe_sink(struct uprobe *uprobe,
+                                                 struct upipe *inner,
+                                                 int event, va_list args)
+{
+    struct upipe_hls_playlist_segment *segment =
+        upipe_hls_playlist_segment_from_probe_sink(uprobe);
+    struct upipe *upipe = segment->upipe;
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    bool playing = upipe_hls_playlist->segment == segment;
+
+    switch (event) {
+    case UPROBE_PROBE_UREF: {
+        UBASE_SIGNATURE_CHECK(args, UPIPE_PROBE_UREF_SIGNATURE);
+        struct uref *uref = va_arg(args, struct uref *);
+        struct upump **upump_p = va_arg(args, struct upump **);
+        bool *drop = va_arg(args, bool *);
+        *drop = true;
+
+        uref = uref_dup(uref);
+        UBASE_ALLOC_RETURN(uref);
+        size_t size = 0;
+        uref_block_size(uref, &size);
+        segment->received += size;
+        if (playing) {
+            upipe_input(upipe_hls_playlist->setflowdef, uref, upump_p);
+            return UBASE_ERR_NONE;
+        }
+
+        segment->size += size;
+        ulist_add(&segment->urefs, uref_to_uchain(uref));
+        return UBASE_ERR_NONE;
+    }
+    case UPROBE_NEW_FLOW_DEF: {
+        struct uref *flow_def = va_arg(args, struct uref *);
+        uref_free(segment->flow_def);
+        segment->flow_def = uref_dup(flow_def);
+        UBASE_ALLOC_RETURN(segment->flow_def);
+        if (playing)
+            return upipe_set_flow_def(upipe_hls_playlist->setflowdef,
+                                      segment->flow_def);
+        return UBASE_ERR_NONE;
+    }
+    case UPROBE_NEED_OUTPUT:
+        return UBASE_ERR_INVALID;
+    }
+    return upipe_throw_proxy(upipe, inner, event, args);
+}
+
+/** @internal @This allocates a segment and starts its download.
+ *
+ * @param upipe description structure of the pipe
+ * @param uri URI of the segment
+ * @param range_off byte range offset
+ * @param range_len byte range length
+ * @param duration duration of the segment, or 0 if unknown
+ * @return pointer to the allocated segment or NULL in case of error
+ */
+static struct upipe_hls_playlist_segment *
+upipe_hls_playlist_segment_alloc(struct upipe *upipe,
+                                 const char *uri,
+                                 uint64_t range_off,
+                                 uint64_t range_len,
+                                 uint64_t duration)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+
+    if (unlikely(!ubase_check(upipe_hls_playlist_check_source_mgr(upipe))))
+        return NULL;
+
+    struct upipe_hls_playlist_segment *segment = malloc(sizeof (*segment));
+    if (unlikely(segment == NULL))
+        return NULL;
+    uchain_init(&segment->uchain);
+    urefcount_init(&segment->urefcount, upipe_hls_playlist_segment_no_ref);
+    urefcount_init(&segment->urefcount_real,
+                   upipe_hls_playlist_segment_free);
+    urefcount_use(&upipe_hls_playlist->urefcount_real);
+    segment->upipe = upipe;
+    segment->uri = strdup(uri);
+    segment->range_off = range_off;
+    segment->range_len = range_len;
+    segment->duration = duration;
+    segment->src = NULL;
+    uprobe_init(&segment->probe_src,
+                upipe_hls_playlist_segment_probe_src, NULL);
+    segment->probe_src.refcount = &segment->urefcount_real;
+    uprobe_init(&segment->probe_sink,
+                upipe_hls_playlist_segment_probe_sink, NULL);
+    segment->probe_sink.refcount = &segment->urefcount_real;
+    segment->flow_def = NULL;
+    ulist_init(&segment->urefs);
+    segment->size = 0;
+    segment->received = 0;
+    segment->complete = false;
+    if (unlikely(segment->uri == NULL)) {
+        upipe_hls_playlist_segment_release(segment);
+        return NULL;
+    }
+
+    segment->src = upipe_void_alloc(
+        upipe_hls_playlist->source_mgr,
+        uprobe_pfx_alloc(uprobe_use(&segment->probe_src),
+                         UPROBE_LOG_VERBOSE, "segment src"));
+    if (unlikely(segment->src == NULL)) {
+        upipe_hls_playlist_segment_release(segment);
+        return NULL;
+    }
+
+    struct upipe_mgr *upipe_probe_uref_mgr = upipe_probe_uref_mgr_alloc();
+    struct upipe *output = upipe_void_alloc_output(
+        segment->src, upipe_probe_uref_mgr,
+        uprobe_pfx_alloc(uprobe_use(&segment->probe_sink),
+                         UPROBE_LOG_VERBOSE, "segment"));
+    upipe_mgr_release(upipe_probe_uref_mgr);
+    if (unlikely(output == NULL)) {
+        upipe_hls_playlist_segment_release(segment);
+        return NULL;
+    }
+    upipe_release(output);
+
+    int ret = UBASE_ERR_NONE;
+    if (upipe_hls_playlist->attach_uclock)
+        ret = upipe_attach_uclock(segment->src);
+    if (ubase_check(ret) && upipe_hls_playlist->output_size)
+        ret = upipe_set_output_size(segment->src,
+                                    upipe_hls_playlist->output_size);
+    if (ubase_check(ret))
+        ret = upipe_set_uri(segment->src, uri);
+    if (ubase_check(ret))
+        ret = upipe_src_set_range(segment->src, range_off, range_len);
+    if (unlikely(!ubase_check(ret))) {
+        upipe_hls_playlist_segment_release(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+/** @internal @This releases all the prefetched segments.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_playlist_flush_segments(struct upipe *upipe)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&upipe_hls_playlist->segments)) != NULL)
+        upipe_hls_playlist_segment_release(
+            upipe_hls_playlist_segment_from_uchain(uchain));
+}
+
+/** @internal @This looks for a segment in a list.
+ *
+ * @param list list of segments
+ * @param uri URI of the segment
+ * @param range_off byte range offset
+ * @param range_len byte range length
+ * @return a pointer to the segment or NULL
+ */
+static struct upipe_hls_playlist_segment *
+upipe_hls_playlist_find_segment(struct uchain *list,
+                                const char *uri,
+                                uint64_t range_off,
+                                uint64_t range_len)
+{
+    struct uchain *uchain;
+    ulist_foreach(list, uchain) {
+        struct upipe_hls_playlist_segment *segment =
+            upipe_hls_playlist_segment_from_uchain(uchain);
+        if (segment->range_off == range_off &&
+            segment->range_len == range_len &&
+            !strcmp(segment->uri, uri))
+            return segment;
+    }
+    return NULL;
+}
+
 /** @internal @This allocates a m3u playlist pipe.
  *
  * @param mgr pointer to upipe manager
@@ -377,10 +740,16 @@ static struct upipe *upipe_hls_playlist_alloc(struct upipe_mgr *mgr,
     upipe_hls_playlist_init_bin_output(upipe);
     upipe_hls_playlist_init_upump_mgr(upipe);
     upipe_hls_playlist_init_upump(upipe);
+    upipe_hls_playlist_init_upump_end(upipe);
 
     struct upipe_hls_playlist *upipe_hls_playlist =
         upipe_hls_playlist_from_upipe(upipe);
     ulist_init(&upipe_hls_playlist->items);
+    ulist_init(&upipe_hls_playlist->segments);
+    upipe_hls_playlist->segment = NULL;
+    upipe_hls_playlist->prefetch_count = 0;
+    upipe_hls_playlist->prefetch_size = 0;
+    upipe_hls_playlist->prefetch_octetrate = 0;
     upipe_hls_playlist->input_flow_def = NULL;
     upipe_hls_playlist->flow_def = NULL;
     upipe_hls_playlist->source_mgr = NULL;
@@ -465,6 +834,7 @@ static void upipe_hls_playlist_free(struct upipe *upipe)
         uref_free(upipe_hls_playlist->map.flow_def);
     uref_free(upipe_hls_playlist->flow_def);
     uref_free(upipe_hls_playlist->input_flow_def);
+    upipe_hls_playlist_clean_upump_end(upipe);
     upipe_hls_playlist_clean_upump(upipe);
     upipe_hls_playlist_clean_upump_mgr(upipe);
     upipe_hls_playlist_clean_bin_output(upipe);
@@ -491,6 +861,10 @@ static void upipe_hls_playlist_no_ref(struct upipe *upipe)
 
     upipe_hls_playlist_clean_upipe_map(upipe);
     upipe_hls_playlist_clean_upipe_key(upipe);
+    upipe_hls_playlist_set_upump_end(upipe, NULL);
+    upipe_hls_playlist_segment_release(upipe_hls_playlist->segment);
+    upipe_hls_playlist->segment = NULL;
+    upipe_hls_playlist_flush_segments(upipe);
     upipe_hls_playlist_clean_setflowdef(upipe);
     upipe_hls_playlist_clean_src(upipe);
     upipe_mgr_release(upipe_hls_playlist->source_mgr);
@@ -530,21 +904,6 @@ static int upipe_hls_playlist_set_src(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
-/** @internal @This checks if the source manager is set and asks for it if not.
- *
- * @param upipe description structure of the pipe
- * @return an error code
- */
-static int upipe_hls_playlist_check_source_mgr(struct upipe *upipe)
-{
-    struct upipe_hls_playlist *upipe_hls_playlist =
-        upipe_hls_playlist_from_upipe(upipe);
-    if (unlikely(upipe_hls_playlist->source_mgr == NULL))
-        return upipe_throw_need_source_mgr(
-            upipe, &upipe_hls_playlist->source_mgr);
-    return UBASE_ERR_NONE;
-}
-
 /** @internal @This creates the inner pipeline to get a key.
  *
  * @param upipe description structure of the pipe
@@ -778,26 +1137,265 @@ static void upipe_hls_playlist_need_reload(struct upipe *upipe)
     UBASE_FATAL(upipe, upipe_hls_playlist_throw_need_reload(upipe));
 }
 
+/** @internal @This builds the URI of an item, relative to the playlist URI.
+ *
+ * @param upipe description structure of the pipe
+ * @param item playlist item
+ * @param uri_p filled with an allocated string to free after use
+ * @return an error code
+ */
+static int upipe_hls_playlist_item_uri(struct upipe *upipe,
+                                       struct uref *item,
+                                       char **uri_p)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    struct uref *input_flow_def = upipe_hls_playlist->input_flow_def;
+    int ret;
+
+    const char *m3u_uri;
+    UBASE_RETURN(uref_m3u_get_uri(item, &m3u_uri));
+
+    struct uuri uuri;
+    if (ubase_check(uuri_from_str(&uuri, m3u_uri)))
+        /* this is a valid URI, we can directly play it */
+        return uuri_to_str(&uuri, uri_p);
+
+    UBASE_RETURN(uref_uri_get(input_flow_def, &uuri));
+    uuri.query = ustring_null();
+    uuri.fragment = ustring_null();
+    if (strlen(m3u_uri) >= 2 && !strncmp(m3u_uri, "//", 2)) {
+        /* use the item absolute path with the input protocol */
+        char uri[uuri.scheme.len + 1 + strlen(m3u_uri) + 1];
+        snprintf(uri, sizeof (uri),
+                 "%.*s:%s", (int)uuri.scheme.len, uuri.scheme.at, m3u_uri);
+        if (ubase_check(uuri_from_str(&uuri, uri)))
+            return uuri_to_str(&uuri, uri_p);
+        else {
+            upipe_err(upipe, "invalid uri");
+            return UBASE_ERR_INVALID;
+        }
+    }
+    if (strlen(m3u_uri) && *m3u_uri == '/') {
+        /* use the item absolute path with the input scheme */
+        uuri.path = ustring_from_str(m3u_uri);
+        return uuri_to_str(&uuri, uri_p);
+    }
+
+    /* use the item relative path with the input path as root path */
+    char tmp[uuri.path.len + 1];
+    ustring_cpy(uuri.path, tmp, sizeof (tmp));
+    const char *root = dirname(tmp);
+    char new_path[strlen(root) + 1 + strlen(m3u_uri) + 1];
+    ret = snprintf(new_path, sizeof (new_path), "%s/%s", root, m3u_uri);
+    if (ret < 0 || (unsigned)ret >= sizeof (new_path))
+        return UBASE_ERR_NOSPC;
+    uuri.path = ustring_from_str(new_path);
+    return uuri_to_str(&uuri, uri_p);
+}
+
+/** @internal @This throws the end of a segment played from the cache.
+ *
+ * @param upump description structure of the timer
+ */
+static void upipe_hls_playlist_item_end_cb(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+
+    upipe_hls_playlist_set_upump_end(upipe, NULL);
+    upipe_dbg(upipe, "stopped");
+    upipe_hls_playlist->playing = false;
+    upipe_hls_playlist_throw_item_end(upipe);
+}
+
+/** @internal @This plays a segment from the cache, downloading it if it was
+ * not prefetched.
+ *
+ * @param upipe description structure of the pipe
+ * @param uri URI of the segment
+ * @param range_off byte range offset
+ * @param range_len byte range length
+ * @param duration duration of the segment, or 0 if unknown
+ * @return an error code
+ */
+static int upipe_hls_playlist_play_segment(struct upipe *upipe,
+                                           const char *uri,
+                                           uint64_t range_off,
+                                           uint64_t range_len,
+                                           uint64_t duration)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    struct upipe *output = upipe_hls_playlist->setflowdef;
+
+    struct upipe_hls_playlist_segment *segment =
+        upipe_hls_playlist_find_segment(&upipe_hls_playlist->segments,
+                                        uri, range_off, range_len);
+    if (segment != NULL) {
+        upipe_dbg_va(upipe, "play segment from the cache "
+                     "(%"PRIu64" octets%s)", segment->size,
+                     segment->complete ? ", complete" : "");
+        ulist_delete(&segment->uchain);
+    }
+    else {
+        segment = upipe_hls_playlist_segment_alloc(upipe, uri,
+                                                   range_off, range_len,
+                                                   duration);
+        UBASE_ALLOC_RETURN(segment);
+    }
+
+    upipe_hls_playlist_store_src(upipe, NULL);
+    upipe_hls_playlist_set_upump_end(upipe, NULL);
+    upipe_hls_playlist_segment_release(upipe_hls_playlist->segment);
+    upipe_hls_playlist->segment = segment;
+    upipe_hls_playlist->playing = true;
+
+    if (segment->flow_def != NULL) {
+        int ret = upipe_set_flow_def(output, segment->flow_def);
+        if (unlikely(!ubase_check(ret)))
+            upipe_warn(upipe, "segment flow def rejected");
+    }
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&segment->urefs)) != NULL)
+        upipe_input(output, uref_from_uchain(uchain), NULL);
+    segment->size = 0;
+
+    if (segment->complete) {
+        upipe_hls_playlist_check_upump_mgr(upipe);
+        if (likely(upipe_hls_playlist->upump_mgr != NULL))
+            upipe_hls_playlist_wait_upump_end(
+                upipe, 0, upipe_hls_playlist_item_end_cb);
+        else {
+            upipe_dbg(upipe, "stopped");
+            upipe_hls_playlist->playing = false;
+            return upipe_hls_playlist_throw_item_end(upipe);
+        }
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This estimates the size a segment will have in the cache,
+ * from its byte range or from the octet rate of the segments downloaded so
+ * far.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment being downloaded
+ * @return the estimated size, or UINT64_MAX if it is unknown
+ */
+static uint64_t
+upipe_hls_playlist_estimate_size(struct upipe *upipe,
+                                 struct upipe_hls_playlist_segment *segment)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    uint64_t estimate = UINT64_MAX;
+    if (segment->range_len != (uint64_t)-1)
+        estimate = segment->range_len;
+    else if (segment->duration && upipe_hls_playlist->prefetch_octetrate)
+        estimate = segment->duration *
+            upipe_hls_playlist->prefetch_octetrate / UCLOCK_FREQ;
+    if (estimate != UINT64_MAX && estimate < segment->size)
+        estimate = segment->size;
+    return estimate;
+}
+
+/** @internal @This starts the download of the segments following the
+ * current index, and releases the cached segments that are not part of
+ * them anymore. The size of a segment being downloaded is estimated, and no
+ * download is started once the estimated size of the cache reaches the
+ * limit. If the size of a segment cannot be estimated yet, it is supposed
+ * to reach the limit, so that only one download is started.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_playlist_prefetch(struct upipe *upipe)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    struct uref *input_flow_def = upipe_hls_playlist->input_flow_def;
+
+    if (!upipe_hls_playlist->prefetch_count || input_flow_def == NULL ||
+        upipe_hls_playlist->index == (uint64_t)-1 ||
+        upipe_hls_playlist->reloading)
+        return;
+
+    uint64_t media_sequence = 0;
+    uref_m3u_playlist_flow_get_media_sequence(input_flow_def, &media_sequence);
+    uint64_t sequence = media_sequence;
+    struct uchain segments;
+    ulist_init(&segments);
+    unsigned int count = 0;
+    uint64_t size = 0;
+
+    struct uchain *uchain;
+    ulist_foreach(&upipe_hls_playlist->items, uchain) {
+        if (count >= upipe_hls_playlist->prefetch_count ||
+            size >= upipe_hls_playlist->prefetch_size)
+            break;
+        if (sequence++ <= upipe_hls_playlist->index)
+            continue;
+        count++;
+
+        struct uref *item = uref_from_uchain(uchain);
+        char *uri;
+        if (unlikely(!ubase_check(upipe_hls_playlist_item_uri(upipe, item,
+                                                              &uri))))
+            continue;
+        uint64_t range_off = 0;
+        uref_m3u_playlist_get_byte_range_off(item, &range_off);
+        uint64_t range_len = (uint64_t)-1;
+        uref_m3u_playlist_get_byte_range_len(item, &range_len);
+        uint64_t duration = 0;
+        uref_m3u_playlist_get_seq_duration(item, &duration);
+
+        struct upipe_hls_playlist_segment *segment =
+            upipe_hls_playlist_find_segment(&upipe_hls_playlist->segments,
+                                            uri, range_off, range_len);
+        if (segment != NULL)
+            ulist_delete(&segment->uchain);
+        else {
+            upipe_dbg_va(upipe, "prefetch sequence %"PRIu64" %s",
+                         sequence - 1, uri);
+            segment = upipe_hls_playlist_segment_alloc(upipe, uri,
+                                                       range_off, range_len,
+                                                       duration);
+            if (unlikely(segment == NULL))
+                upipe_warn_va(upipe, "unable to prefetch %s", uri);
+        }
+        free(uri);
+
+        if (segment != NULL) {
+            uint64_t estimate = segment->size;
+            if (!segment->complete &&
+                upipe_hls_playlist->prefetch_size != UINT64_MAX)
+                estimate = upipe_hls_playlist_estimate_size(upipe, segment);
+            size = estimate > UINT64_MAX - size ? UINT64_MAX : size + estimate;
+            ulist_add(&segments, &segment->uchain);
+        }
+    }
+
+    upipe_hls_playlist_flush_segments(upipe);
+    while ((uchain = ulist_pop(&segments)) != NULL)
+        ulist_add(&upipe_hls_playlist->segments, uchain);
+}
+
 /** @internal @This plays an URI.
  *
  * @param upipe description structure of the pipe
  * @param item item to play
- * @param uuri the URI of the item to play
+ * @param uri the URI of the item to play
  * @return an error code
  */
 static int upipe_hls_playlist_play_uri(struct upipe *upipe,
                                        struct uref *item,
-                                       struct uuri *uuri)
+                                       const char *uri)
 {
     struct upipe_hls_playlist *upipe_hls_playlist =
         upipe_hls_playlist_from_upipe(upipe);
     struct uref *input_flow_def = upipe_hls_playlist->input_flow_def;
 
-    size_t len;
-    UBASE_RETURN(uuri_len(uuri, &len));
-    char uri[len + 1];
-    UBASE_RETURN(uuri_to_buffer(uuri, uri, sizeof (uri)));
-
     uint64_t media_sequence = 0;
     uref_m3u_playlist_flow_get_media_sequence(input_flow_def, &media_sequence);
     uint64_t last_sequence = media_sequence;
@@ -888,6 +1486,29 @@ static int upipe_hls_playlist_play_uri(struct upipe *upipe,
     }
     UBASE_RETURN(upipe_hls_playlist_update_flow_def(upipe));
 
+    uint64_t range_off = 0;
+    uref_m3u_playlist_get_byte_range_off(item, &range_off);
+    uint64_t range_len = (uint64_t)-1;
+    uref_m3u_playlist_get_byte_range_len(item, &range_len);
+
+    if (upipe_hls_playlist->prefetch_count) {
+        uint64_t duration = 0;
+        uref_m3u_playlist_get_seq_duration(item, &duration);
+        UBASE_RETURN(upipe_hls_playlist_play_segment(upipe, uri,
+                                                     range_off, range_len,
+                                                     duration));
+        upipe_hls_playlist_prefetch(upipe);
+        if (upipe_hls_playlist->index >= last_sequence - 1) {
+            upipe_warn(upipe, "reach the end of the playlist");
+            upipe_hls_playlist_need_reload(upipe);
+        }
+        return UBASE_ERR_NONE;
+    }
+
+    upipe_hls_playlist_set_upump_end(upipe, NULL);
+    upipe_hls_playlist_segment_release(upipe_hls_playlist->segment);
+    upipe_hls_playlist->segment = NULL;
+
     UBASE_RETURN(upipe_hls_playlist_check_source_mgr(upipe));
     struct upipe *inner = upipe_void_alloc(
         upipe_hls_playlist->source_mgr,
@@ -903,11 +1524,6 @@ static int upipe_hls_playlist_play_uri(struct upipe *upipe,
         return ret;
     }
     UBASE_RETURN(upipe_hls_playlist_set_src(upipe, inner));
-
-    uint64_t range_off = 0;
-    uref_m3u_playlist_get_byte_range_off(item, &range_off);
-    uint64_t range_len = (uint64_t)-1;
-    uref_m3u_playlist_get_byte_range_len(item, &range_len);
     UBASE_RETURN(upipe_src_set_range(inner, range_off, range_len));
     upipe_dbg(upipe, "playing");
     upipe_hls_playlist->playing = true;
@@ -930,7 +1546,6 @@ static int upipe_hls_playlist_play_item(struct upipe *upipe,
     struct upipe_hls_playlist *upipe_hls_playlist =
         upipe_hls_playlist_from_upipe(upipe);
     struct uref *input_flow_def = upipe_hls_playlist->input_flow_def;
-    int ret;
 
     if (unlikely(input_flow_def == NULL) || unlikely(item == NULL))
         return UBASE_ERR_INVALID;
@@ -939,45 +1554,11 @@ static int upipe_hls_playlist_play_item(struct upipe *upipe,
                      upipe_hls_playlist->index);
     uref_dump(item, upipe->uprobe);
 
-    const char *m3u_uri;
-    UBASE_RETURN(uref_m3u_get_uri(item, &m3u_uri));
-
-    struct uuri uuri;
-    if (ubase_check(uuri_from_str(&uuri, m3u_uri)))
-        /* this is a valid URI, we can directly play it */
-        return upipe_hls_playlist_play_uri(upipe, item, &uuri);
-
-    UBASE_RETURN(uref_uri_get(input_flow_def, &uuri));
-    uuri.query = ustring_null();
-    uuri.fragment = ustring_null();
-    if (strlen(m3u_uri) >= 2 && !strncmp(m3u_uri, "//", 2)) {
-        /* use the item absolute path with the input protocol */
-        char uri[uuri.scheme.len + 1 + strlen(m3u_uri) + 1];
-        snprintf(uri, sizeof (uri),
-                 "%.*s:%s", (int)uuri.scheme.len, uuri.scheme.at, m3u_uri);
-        if (ubase_check(uuri_from_str(&uuri, uri)))
-            return upipe_hls_playlist_play_uri(upipe, item, &uuri);
-        else {
-            upipe_err(upipe, "invalid uri");
-            return UBASE_ERR_INVALID;
-        }
-    }
-    if (strlen(m3u_uri) && *m3u_uri == '/') {
-        /* use the item absolute path with the input scheme */
-        uuri.path = ustring_from_str(m3u_uri);
-        return upipe_hls_playlist_play_uri(upipe, item, &uuri);
-    }
-
-    /* use the item relative path with the input path as root path */
-    char tmp[uuri.path.len + 1];
-    ustring_cpy(uuri.path, tmp, sizeof (tmp));
-    const char *root = dirname(tmp);
-    char new_path[strlen(root) + 1 + strlen(m3u_uri) + 1];
-    ret = snprintf(new_path, sizeof (new_path), "%s/%s", root, m3u_uri);
-    if (ret < 0 || (unsigned)ret >= sizeof (new_path))
-        return UBASE_ERR_NOSPC;
-    uuri.path = ustring_from_str(new_path);
-    return upipe_hls_playlist_play_uri(upipe, item, &uuri);
+    char *uri;
+    UBASE_RETURN(upipe_hls_playlist_item_uri(upipe, item, &uri));
+    int ret = upipe_hls_playlist_play_uri(upipe, item, uri);
+    free(uri);
+    return ret;
 }
 
 /** @internal @This gets a media sequence by its sequence number.
@@ -1180,6 +1761,8 @@ static void upipe_hls_playlist_input(struct upipe *upipe,
         upipe_dbg(upipe, "playlist end");
         upipe_hls_playlist->reloading = false;
         upipe_hls_playlist_throw_reloaded(upipe);
+        if (upipe_hls_playlist->playing)
+            upipe_hls_playlist_prefetch(upipe);
     }
 }
 
@@ -1362,6 +1945,48 @@ static int _upipe_hls_playlist_seek(struct upipe *upipe,
     return UBASE_ERR_INVALID;
 }
 
+/** @internal @This gets the prefetch limits.
+ *
+ * @param upipe description structure of the pipe
+ * @param count_p filled with the maximum number of prefetched segments
+ * @param size_p filled with the maximum size of the prefetched segments
+ * @return an error code
+ */
+static int _upipe_hls_playlist_get_prefetch(struct upipe *upipe,
+                                            unsigned int *count_p,
+                                            uint64_t *size_p)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    if (likely(count_p != NULL))
+        *count_p = upipe_hls_playlist->prefetch_count;
+    if (likely(size_p != NULL))
+        *size_p = upipe_hls_playlist->prefetch_size;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This sets the prefetch limits.
+ *
+ * @param upipe description structure of the pipe
+ * @param count maximum number of prefetched segments, 0 to disable
+ * @param size maximum size of the prefetched segments
+ * @return an error code
+ */
+static int _upipe_hls_playlist_set_prefetch(struct upipe *upipe,
+                                            unsigned int count,
+                                            uint64_t size)
+{
+    struct upipe_hls_playlist *upipe_hls_playlist =
+        upipe_hls_playlist_from_upipe(upipe);
+    upipe_hls_playlist->prefetch_count = count;
+    upipe_hls_playlist->prefetch_size = size;
+    if (!count)
+        upipe_hls_playlist_flush_segments(upipe);
+    else if (upipe_hls_playlist->playing)
+        upipe_hls_playlist_prefetch(upipe);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This sets the inner pipe output size.
  *
  * @param upipe description structure of the pipe
@@ -1376,6 +2001,10 @@ static int upipe_hls_playlist_set_output_size(struct upipe *upipe,
     upipe_hls_playlist->output_size = output_size;
     if (likely(upipe_hls_playlist->src != NULL))
         return upipe_set_output_size(upipe_hls_playlist->src, output_size);
+    if (upipe_hls_playlist->segment != NULL &&
+        upipe_hls_playlist->segment->src != NULL)
+        return upipe_set_output_size(upipe_hls_playlist->segment->src,
+                                     output_size);
     return UBASE_ERR_NONE;
 }
 
@@ -1430,6 +2059,8 @@ static int upipe_hls_playlist_control_internal(struct upipe *upipe,
             upipe_hls_playlist_from_upipe(upipe);
         struct upipe **p = va_arg(args, struct upipe **);
         *p = upipe_hls_playlist->src;
+        if (*p == NULL && upipe_hls_playlist->segment != NULL)
+            *p = upipe_hls_playlist->segment->src;
         return (*p != NULL) ? UBASE_ERR_NONE : UBASE_ERR_UNHANDLED;
     }
 
@@ -1461,6 +2092,19 @@ static int upipe_hls_playlist_control_internal(struct upipe *upipe,
         return _upipe_hls_playlist_seek(upipe, at, offset_p);
     }
 
+    case UPIPE_HLS_PLAYLIST_GET_PREFETCH: {
+        UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_PLAYLIST_SIGNATURE);
+        unsigned int *count_p = va_arg(args, unsigned int *);
+        uint64_t *size_p = va_arg(args, uint64_t *);
+        return _upipe_hls_playlist_get_prefetch(upipe, count_p, size_p);
+    }
+    case UPIPE_HLS_PLAYLIST_SET_PREFETCH: {
+        UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_PLAYLIST_SIGNATURE);
+        unsigned int count = va_arg(args, unsigned int);
+        uint64_t size = va_arg(args, uint64_t);
+        return _upipe_hls_playlist_set_prefetch(upipe, count, size);
+    }
+
     default:
         return upipe_hls_playlist_control_bin_output(upipe, command, args);
     }
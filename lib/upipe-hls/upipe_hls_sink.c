@@ -0,0 +1,1338 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe sink module packaging a live stream into HLS segments
+ *
+ * Incoming blocks are appended to the current segment without copy. For
+ * transport streams, the packets are scanned for the random access indicator
+ * set by the TS encapsulation on the random access points signalled by the
+ * framers, and nothing is kept before the first one; the last PAT and PMT
+ * packets are repeated at the beginning of each segment so that it can be
+ * decoded on its own. Other block flows are cut on the random flag of the
+ * urefs, and a stream without any random access point (audio only) is cut
+ * on uref boundaries.
+ *
+ * Disk writes are queued and performed in chunks from an idler, into
+ * temporary files which are renamed when complete, so that a web server
+ * never sees a partial segment or playlist. The writes themselves are
+ * blocking system calls run from the thread of the event loop: a slow disk
+ * stalls the pipeline for up to a chunk at a time, so the playlist should be
+ * written to a tmpfs, or the sink run in its own thread (upipe-pthread).
+ */
+
+#define _GNU_SOURCE
+
+#include "upipe/ubase.h"
+#include "upipe/uclock.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+#include "upipe/uref.h"
+#include "upipe/uref_attr.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_clock.h"
+#include "upipe/uref_flow.h"
+#include "upipe/uref_m3u.h"
+#include "upipe/uref_m3u_flow.h"
+#include "upipe/uref_m3u_playlist.h"
+#include "upipe/uref_m3u_playlist_flow.h"
+#include "upipe/upump.h"
+#include "upipe/upipe.h"
+#include "upipe/upipe_helper_upipe.h"
+#include "upipe/upipe_helper_urefcount.h"
+#include "upipe/upipe_helper_void.h"
+#include "upipe/upipe_helper_upump_mgr.h"
+#include "upipe/upipe_helper_upump.h"
+#include "upipe-hls/upipe_hls_sink.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <assert.h>
+
+#include <bitstream/mpeg/ts.h>
+#include <bitstream/mpeg/psi.h>
+
+#ifndef O_CLOEXEC
+#   define O_CLOEXEC 0
+#endif
+
+/** we only accept blocks */
+#define EXPECTED_FLOW_DEF "block."
+/** flow definition of transport streams */
+#define MPEGTS_FLOW_DEF "block.mpegts."
+/** flow definition of the playlist attributes */
+#define PLAYLIST_FLOW_DEF "block.m3u.playlist."
+/** default target duration */
+#define DEFAULT_TARGET_DURATION (UCLOCK_FREQ * 6)
+/** default number of segments in the playlist */
+#define DEFAULT_WINDOW 5
+/** default number of segments in the ring */
+#define DEFAULT_DEPTH 8
+/** tolerance on the target duration when looking for a cut */
+#define CUT_TOLERANCE (UCLOCK_FREQ / 10)
+/** maximum number of octets written to disk per idler run */
+#define WRITE_CHUNK (64 * 1024)
+/** value of rap_pid before the first random access point */
+#define NO_PID 8192
+/** maximum number of programs whose PMT is repeated in the segments */
+#define MAX_PROGRAMS 16
+/** prefix of the segment names without playlist path */
+#define DEFAULT_PREFIX "segment"
+/** m3u version of the playlist */
+#define M3U_VERSION 3
+
+/** @internal @This is the type of a disk job. */
+enum upipe_hls_sink_job_type {
+    /** write a segment */
+    UPIPE_HLS_SINK_JOB_SEGMENT,
+    /** write the playlist */
+    UPIPE_HLS_SINK_JOB_PLAYLIST,
+    /** delete a segment */
+    UPIPE_HLS_SINK_JOB_DELETE,
+};
+
+/** @internal @This is a pending disk job. */
+struct upipe_hls_sink_job {
+    /** attach to the list of jobs */
+    struct uchain uchain;
+    /** job type */
+    enum upipe_hls_sink_job_type type;
+    /** destination path */
+    char *path;
+    /** segment to write */
+    struct uref *uref;
+    /** playlist to write */
+    char *text;
+    /** number of octets to write */
+    size_t size;
+    /** number of octets already written */
+    size_t offset;
+    /** temporary file descriptor, or -1 */
+    int fd;
+};
+
+UBASE_FROM_TO(upipe_hls_sink_job, uchain, uchain, uchain)
+
+/** @internal @This is the private context of a HLS sink pipe. */
+struct upipe_hls_sink {
+    /** refcount management structure */
+    struct urefcount urefcount;
+
+    /** upump manager */
+    struct upump_mgr *upump_mgr;
+    /** disk writer */
+    struct upump *upump;
+
+    /** playlist uri */
+    char *uri;
+    /** directory of the segments, or NULL */
+    char *dir;
+    /** prefix of the segment names, or NULL */
+    char *prefix;
+    /** extension of the segment names */
+    const char *ext;
+
+    /** target duration */
+    uint64_t target_duration;
+    /** number of segments in the playlist */
+    unsigned int window;
+    /** number of segments in the ring */
+    unsigned int depth;
+
+    /** true if the input is a transport stream */
+    bool mpegts;
+    /** PID carrying the random access points, or NO_PID */
+    uint16_t rap_pid;
+    /** true if a random access point was ever seen */
+    bool random;
+    /** true if the next segment starts after a discontinuity */
+    bool discontinuity;
+    /** last system clock reference before the discontinuity */
+    uint64_t discontinuity_cr;
+    /** last system clock reference */
+    uint64_t last_cr;
+    /** last PAT packet, or NULL */
+    struct ubuf *pat;
+    /** PIDs of the PMTs of the last PAT */
+    uint16_t pmt_pids[MAX_PROGRAMS];
+    /** last PMT packets, or NULL */
+    struct ubuf *pmts[MAX_PROGRAMS];
+    /** number of PMTs of the last PAT */
+    unsigned int nb_pmts;
+
+    /** segment being received, or NULL */
+    struct uref *segment;
+    /** system clock reference of the beginning of the segment */
+    uint64_t segment_cr;
+    /** true if the segment starts after a discontinuity */
+    bool segment_discontinuity;
+
+    /** ring of complete segments */
+    struct uchain segments;
+    /** number of segments in the ring */
+    unsigned int nb_segments;
+    /** media sequence of the next segment */
+    uint64_t next_sequence;
+    /** number of discontinuities that left the ring */
+    uint64_t discontinuity_sequence;
+
+    /** playlist attributes */
+    struct uref *playlist_flow;
+    /** rendered playlist, or NULL */
+    char *playlist;
+
+    /** list of disk jobs */
+    struct uchain jobs;
+    /** queued playlist job that was not started yet, or NULL */
+    struct upipe_hls_sink_job *playlist_job;
+
+    /** public upipe structure */
+    struct upipe upipe;
+};
+
+UPIPE_HELPER_UPIPE(upipe_hls_sink, upipe, UPIPE_HLS_SINK_SIGNATURE)
+UPIPE_HELPER_UREFCOUNT(upipe_hls_sink, urefcount, upipe_hls_sink_free)
+UPIPE_HELPER_VOID(upipe_hls_sink)
+UPIPE_HELPER_UPUMP_MGR(upipe_hls_sink, upump_mgr)
+UPIPE_HELPER_UPUMP(upipe_hls_sink, upump, upump_mgr)
+
+/** @internal @This allocates a HLS sink pipe.
+ *
+ * @param mgr common management structure
+ * @param uprobe structure used to raise events
+ * @param signature signature of the pipe allocator
+ * @param args optional arguments
+ * @return pointer to upipe or NULL in case of allocation error
+ */
+static struct upipe *upipe_hls_sink_alloc(struct upipe_mgr *mgr,
+                                          struct uprobe *uprobe,
+                                          uint32_t signature, va_list args)
+{
+    struct upipe *upipe =
+        upipe_hls_sink_alloc_void(mgr, uprobe, signature, args);
+    if (unlikely(upipe == NULL))
+        return NULL;
+
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    upipe_hls_sink_init_urefcount(upipe);
+    upipe_hls_sink_init_upump_mgr(upipe);
+    upipe_hls_sink_init_upump(upipe);
+    upipe_hls_sink->uri = NULL;
+    upipe_hls_sink->dir = NULL;
+    upipe_hls_sink->prefix = NULL;
+    upipe_hls_sink->ext = "ts";
+    upipe_hls_sink->target_duration = DEFAULT_TARGET_DURATION;
+    upipe_hls_sink->window = DEFAULT_WINDOW;
+    upipe_hls_sink->depth = DEFAULT_DEPTH;
+    upipe_hls_sink->mpegts = false;
+    upipe_hls_sink->rap_pid = NO_PID;
+    upipe_hls_sink->random = false;
+    upipe_hls_sink->discontinuity = false;
+    upipe_hls_sink->discontinuity_cr = UINT64_MAX;
+    upipe_hls_sink->last_cr = UINT64_MAX;
+    upipe_hls_sink->pat = NULL;
+    upipe_hls_sink->nb_pmts = 0;
+    upipe_hls_sink->segment = NULL;
+    upipe_hls_sink->segment_cr = UINT64_MAX;
+    upipe_hls_sink->segment_discontinuity = false;
+    ulist_init(&upipe_hls_sink->segments);
+    upipe_hls_sink->nb_segments = 0;
+    upipe_hls_sink->next_sequence = 0;
+    upipe_hls_sink->discontinuity_sequence = 0;
+    upipe_hls_sink->playlist_flow = NULL;
+    upipe_hls_sink->playlist = NULL;
+    ulist_init(&upipe_hls_sink->jobs);
+    upipe_hls_sink->playlist_job = NULL;
+    upipe_throw_ready(upipe);
+    return upipe;
+}
+
+/** @internal @This frees a disk job.
+ *
+ * @param job job to free
+ */
+static void upipe_hls_sink_job_free(struct upipe_hls_sink_job *job)
+{
+    if (job->fd != -1) {
+        char tmp[strlen(job->path) + sizeof(".tmp")];
+        sprintf(tmp, "%s.tmp", job->path);
+        close(job->fd);
+        unlink(tmp);
+    }
+    uref_free(job->uref);
+    free(job->text);
+    free(job->path);
+    free(job);
+}
+
+/** @internal @This runs a step of the job at the head of the queue.
+ *
+ * @param upipe description structure of the pipe
+ * @param job job to run
+ * @param budget maximum number of octets to write
+ * @return the number of octets written, or -1 when the job is over
+ */
+static ssize_t upipe_hls_sink_job_run(struct upipe *upipe,
+                                      struct upipe_hls_sink_job *job,
+                                      size_t budget)
+{
+    if (job->type == UPIPE_HLS_SINK_JOB_DELETE) {
+        if (unlink(job->path) == -1 && errno != ENOENT)
+            upipe_warn_va(upipe, "can't delete %s (%m)", job->path);
+        return -1;
+    }
+
+    char tmp[strlen(job->path) + sizeof(".tmp")];
+    sprintf(tmp, "%s.tmp", job->path);
+    if (job->fd == -1) {
+        job->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (unlikely(job->fd == -1)) {
+            upipe_warn_va(upipe, "can't open %s (%m)", tmp);
+            return -1;
+        }
+    }
+
+    size_t size = job->size - job->offset;
+    if (size > budget)
+        size = budget;
+    ssize_t ret;
+    if (job->type == UPIPE_HLS_SINK_JOB_SEGMENT) {
+        int iovec_count = uref_block_iovec_count(job->uref, job->offset, size);
+        if (unlikely(iovec_count <= 0)) {
+            upipe_warn(upipe, "cannot read ubuf buffer");
+            return -1;
+        }
+        struct iovec iovecs[iovec_count];
+        if (unlikely(!ubase_check(uref_block_iovec_read(job->uref,
+                            job->offset, size, iovecs)))) {
+            upipe_warn(upipe, "cannot read ubuf buffer");
+            return -1;
+        }
+        ret = writev(job->fd, iovecs, iovec_count);
+        uref_block_iovec_unmap(job->uref, job->offset, size, iovecs);
+    } else
+        ret = write(job->fd, job->text + job->offset, size);
+
+    if (unlikely(ret == -1)) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        upipe_warn_va(upipe, "write error to %s (%m)", tmp);
+        return -1;
+    }
+
+    job->offset += ret;
+    if (job->offset < job->size)
+        return ret;
+
+    close(job->fd);
+    job->fd = -1;
+    if (unlikely(rename(tmp, job->path) == -1)) {
+        upipe_warn_va(upipe, "can't rename %s (%m)", tmp);
+        unlink(tmp);
+    }
+    return -1;
+}
+
+/** @internal @This runs the queued disk jobs.
+ *
+ * @param upipe description structure of the pipe
+ * @param budget maximum number of octets to write
+ * @return true if the queue is empty
+ */
+static bool upipe_hls_sink_work(struct upipe *upipe, size_t budget)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    struct uchain *uchain;
+    while ((uchain = ulist_peek(&upipe_hls_sink->jobs)) != NULL) {
+        struct upipe_hls_sink_job *job =
+            upipe_hls_sink_job_from_uchain(uchain);
+        if (job == upipe_hls_sink->playlist_job)
+            upipe_hls_sink->playlist_job = NULL;
+
+        ssize_t ret = upipe_hls_sink_job_run(upipe, job, budget);
+        if (ret == -1) {
+            ulist_pop(&upipe_hls_sink->jobs);
+            upipe_hls_sink_job_free(job);
+            continue;
+        }
+        if ((size_t)ret >= budget)
+            return false;
+        budget -= ret;
+        if (!ret)
+            /* interrupted, try again later */
+            return false;
+    }
+    return true;
+}
+
+/** @internal @This is called by the idler to write to disk.
+ *
+ * @param upump description structure of the idler
+ */
+static void upipe_hls_sink_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    if (upipe_hls_sink_work(upipe, WRITE_CHUNK))
+        upipe_hls_sink_set_upump(upipe, NULL);
+}
+
+/** @internal @This starts the idler running the disk jobs, or runs them
+ * synchronously if there is no upump manager.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_sink_schedule(struct upipe *upipe)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (upipe_hls_sink->upump != NULL)
+        return;
+    if (upipe_hls_sink->upump_mgr == NULL) {
+        upipe_hls_sink_work(upipe, SIZE_MAX);
+        return;
+    }
+
+    struct upump *upump = upump_alloc_idler(upipe_hls_sink->upump_mgr,
+                                            upipe_hls_sink_worker, upipe,
+                                            upipe->refcount);
+    if (unlikely(upump == NULL)) {
+        upipe_warn(upipe, "can't create idler, writing synchronously");
+        upipe_hls_sink_work(upipe, SIZE_MAX);
+        return;
+    }
+    upipe_hls_sink_set_upump(upipe, upump);
+    upump_start(upump);
+}
+
+/** @internal @This queues a disk job.
+ *
+ * @param upipe description structure of the pipe
+ * @param job job to queue
+ */
+static void upipe_hls_sink_queue(struct upipe *upipe,
+                                 struct upipe_hls_sink_job *job)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    ulist_add(&upipe_hls_sink->jobs, upipe_hls_sink_job_to_uchain(job));
+    upipe_hls_sink_schedule(upipe);
+}
+
+/** @internal @This allocates a disk job for a file of the playlist
+ * directory.
+ *
+ * @param upipe description structure of the pipe
+ * @param type type of job
+ * @param name name of the file in the directory
+ * @return pointer to the job, or NULL in case of error
+ */
+static struct upipe_hls_sink_job *
+    upipe_hls_sink_job_alloc(struct upipe *upipe,
+                             enum upipe_hls_sink_job_type type,
+                             const char *name)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    struct upipe_hls_sink_job *job = malloc(sizeof(*job));
+    if (unlikely(job == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return NULL;
+    }
+    uchain_init(&job->uchain);
+    job->type = type;
+    job->uref = NULL;
+    job->text = NULL;
+    job->size = job->offset = 0;
+    job->fd = -1;
+    if (unlikely(asprintf(&job->path, "%s/%s",
+                          upipe_hls_sink->dir, name) == -1)) {
+        free(job);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return NULL;
+    }
+    return job;
+}
+
+/** @internal @This queues the writing of a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment to write
+ */
+static void upipe_hls_sink_write_segment(struct upipe *upipe,
+                                         struct uref *segment)
+{
+    const char *uri;
+    size_t size;
+    if (unlikely(!ubase_check(uref_m3u_get_uri(segment, &uri)) ||
+                 !ubase_check(uref_block_size(segment, &size))))
+        return;
+
+    struct upipe_hls_sink_job *job =
+        upipe_hls_sink_job_alloc(upipe, UPIPE_HLS_SINK_JOB_SEGMENT, uri);
+    if (unlikely(job == NULL))
+        return;
+    job->uref = uref_dup(segment);
+    if (unlikely(job->uref == NULL)) {
+        upipe_hls_sink_job_free(job);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    job->size = size;
+    upipe_hls_sink_queue(upipe, job);
+}
+
+/** @internal @This queues the deletion of a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment to delete
+ */
+static void upipe_hls_sink_delete_segment(struct upipe *upipe,
+                                          struct uref *segment)
+{
+    const char *uri;
+    if (unlikely(!ubase_check(uref_m3u_get_uri(segment, &uri))))
+        return;
+
+    struct upipe_hls_sink_job *job =
+        upipe_hls_sink_job_alloc(upipe, UPIPE_HLS_SINK_JOB_DELETE, uri);
+    if (likely(job != NULL))
+        upipe_hls_sink_queue(upipe, job);
+}
+
+/** @internal @This queues the writing of the playlist. A playlist which is
+ * still waiting in the queue is replaced.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_sink_write_playlist(struct upipe *upipe)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    char *text = strdup(upipe_hls_sink->playlist);
+    if (unlikely(text == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+
+    struct upipe_hls_sink_job *job = upipe_hls_sink->playlist_job;
+    if (job != NULL) {
+        /* move it to the end of the queue, after the new segments */
+        ulist_delete(upipe_hls_sink_job_to_uchain(job));
+        free(job->text);
+    } else {
+        const char *name = strrchr(upipe_hls_sink->uri, '/');
+        name = name != NULL ? name + 1 : upipe_hls_sink->uri;
+        job = upipe_hls_sink_job_alloc(upipe, UPIPE_HLS_SINK_JOB_PLAYLIST,
+                                       name);
+        if (unlikely(job == NULL)) {
+            free(text);
+            return;
+        }
+    }
+    job->text = text;
+    job->size = strlen(text);
+    upipe_hls_sink->playlist_job = job;
+    upipe_hls_sink_queue(upipe, job);
+}
+
+/** @internal @This checks whether a segment starts after a discontinuity.
+ *
+ * @param segment segment of the ring
+ * @return true if the segment starts after a discontinuity
+ */
+static inline bool upipe_hls_sink_has_discontinuity(struct uref *segment)
+{
+    bool discontinuity = false;
+    uref_m3u_playlist_get_discontinuity(segment, &discontinuity);
+    return discontinuity;
+}
+
+/** @internal @This renders the playlist from the attributes of the
+ * playlist flow and of the last segments of the ring.
+ *
+ * @param upipe description structure of the pipe
+ * @param endlist true if the stream is over
+ * @return an error code
+ */
+static int upipe_hls_sink_render(struct upipe *upipe, bool endlist)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    struct uref *flow = upipe_hls_sink->playlist_flow;
+    if (unlikely(flow == NULL || !upipe_hls_sink->nb_segments))
+        return UBASE_ERR_INVALID;
+
+    unsigned int hidden = upipe_hls_sink->nb_segments > upipe_hls_sink->window ?
+        upipe_hls_sink->nb_segments - upipe_hls_sink->window : 0;
+    uint64_t discontinuity_sequence = upipe_hls_sink->discontinuity_sequence;
+    uint64_t max_duration = upipe_hls_sink->target_duration;
+    struct uchain *uchain;
+    unsigned int i = 0;
+    ulist_foreach (&upipe_hls_sink->segments, uchain) {
+        struct uref *segment = uref_from_uchain(uchain);
+        if (i++ < hidden) {
+            if (upipe_hls_sink_has_discontinuity(segment))
+                discontinuity_sequence++;
+            continue;
+        }
+        uint64_t duration;
+        if (ubase_check(uref_m3u_playlist_get_seq_duration(segment,
+                                                           &duration)) &&
+            duration > max_duration)
+            max_duration = duration;
+    }
+
+    UBASE_RETURN(uref_m3u_playlist_flow_set_target_duration(flow,
+                max_duration))
+    UBASE_RETURN(uref_m3u_playlist_flow_set_media_sequence(flow,
+                upipe_hls_sink->next_sequence - upipe_hls_sink->nb_segments +
+                hidden))
+    UBASE_RETURN(uref_m3u_playlist_flow_set_discontinuity_sequence(flow,
+                discontinuity_sequence))
+    if (endlist)
+        UBASE_RETURN(uref_m3u_playlist_flow_set_endlist(flow))
+
+    char *text;
+    size_t size;
+    FILE *stream = open_memstream(&text, &size);
+    UBASE_ALLOC_RETURN(stream)
+
+    uint8_t version = M3U_VERSION;
+    uint64_t media_sequence = 0;
+    uref_m3u_flow_get_version(flow, &version);
+    uref_m3u_playlist_flow_get_target_duration(flow, &max_duration);
+    uref_m3u_playlist_flow_get_media_sequence(flow, &media_sequence);
+    fprintf(stream, "#EXTM3U\n#EXT-X-VERSION:%"PRIu8"\n"
+            "#EXT-X-TARGETDURATION:%"PRIu64"\n"
+            "#EXT-X-MEDIA-SEQUENCE:%"PRIu64"\n", version,
+            (max_duration + UCLOCK_FREQ / 2) / UCLOCK_FREQ, media_sequence);
+    if (discontinuity_sequence)
+        fprintf(stream, "#EXT-X-DISCONTINUITY-SEQUENCE:%"PRIu64"\n",
+                discontinuity_sequence);
+
+    i = 0;
+    ulist_foreach (&upipe_hls_sink->segments, uchain) {
+        if (i++ < hidden)
+            continue;
+        struct uref *segment = uref_from_uchain(uchain);
+        const char *uri = "";
+        uint64_t duration = 0;
+        uref_m3u_get_uri(segment, &uri);
+        uref_m3u_playlist_get_seq_duration(segment, &duration);
+        if (upipe_hls_sink_has_discontinuity(segment))
+            fprintf(stream, "#EXT-X-DISCONTINUITY\n");
+        fprintf(stream, "#EXTINF:%.3f,\n%s\n",
+                (double)duration / UCLOCK_FREQ, uri);
+    }
+    if (ubase_check(uref_m3u_playlist_flow_get_endlist(flow)))
+        fprintf(stream, "#EXT-X-ENDLIST\n");
+
+    if (unlikely(fclose(stream))) {
+        free(text);
+        return UBASE_ERR_ALLOC;
+    }
+    free(upipe_hls_sink->playlist);
+    upipe_hls_sink->playlist = text;
+
+    if (upipe_hls_sink->dir != NULL)
+        upipe_hls_sink_write_playlist(upipe);
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This removes the segments exceeding the depth of the ring.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_sink_trim(struct upipe *upipe)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    while (upipe_hls_sink->nb_segments > upipe_hls_sink->depth) {
+        struct uref *segment =
+            uref_from_uchain(ulist_pop(&upipe_hls_sink->segments));
+        upipe_hls_sink->nb_segments--;
+        if (upipe_hls_sink_has_discontinuity(segment))
+            upipe_hls_sink->discontinuity_sequence++;
+        if (upipe_hls_sink->dir != NULL)
+            upipe_hls_sink_delete_segment(upipe, segment);
+        uref_free(segment);
+    }
+}
+
+/** @internal @This completes the current segment and adds it to the ring.
+ *
+ * @param upipe description structure of the pipe
+ * @param cr system clock reference of the end of the segment
+ */
+static void upipe_hls_sink_close(struct upipe *upipe, uint64_t cr)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    struct uref *segment = upipe_hls_sink->segment;
+    if (segment == NULL)
+        return;
+    upipe_hls_sink->segment = NULL;
+
+    uint64_t sequence = upipe_hls_sink->next_sequence++;
+    uint64_t duration = upipe_hls_sink->target_duration;
+    if (cr != UINT64_MAX && upipe_hls_sink->segment_cr != UINT64_MAX &&
+        cr >= upipe_hls_sink->segment_cr)
+        duration = cr - upipe_hls_sink->segment_cr;
+
+    const char *prefix = upipe_hls_sink->prefix ?: DEFAULT_PREFIX;
+    char uri[strlen(prefix) + strlen(upipe_hls_sink->ext) +
+             sizeof("-18446744073709551615.")];
+    sprintf(uri, "%s-%"PRIu64".%s", prefix, sequence, upipe_hls_sink->ext);
+    if (unlikely(!ubase_check(uref_m3u_set_uri(segment, uri)) ||
+                 !ubase_check(uref_m3u_playlist_set_seq_duration(segment,
+                                                                 duration)) ||
+                 !ubase_check(uref_m3u_playlist_set_discontinuity(segment,
+                         upipe_hls_sink->segment_discontinuity)))) {
+        uref_free(segment);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+
+    ulist_add(&upipe_hls_sink->segments, uref_to_uchain(segment));
+    upipe_hls_sink->nb_segments++;
+    upipe_verbose_va(upipe, "segment %"PRIu64" (%.3f s)", sequence,
+                     (double)duration / UCLOCK_FREQ);
+
+    if (upipe_hls_sink->dir != NULL)
+        upipe_hls_sink_write_segment(upipe, segment);
+    upipe_hls_sink_trim(upipe);
+    if (unlikely(!ubase_check(upipe_hls_sink_render(upipe, false))))
+        upipe_warn(upipe, "unable to render playlist");
+
+    upipe_throw(upipe, UPROBE_HLS_SINK_SEGMENT, UPIPE_HLS_SINK_SIGNATURE,
+                sequence);
+}
+
+/** @internal @This appends a block to the current segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ */
+static void upipe_hls_sink_append(struct upipe *upipe, struct uref *uref)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (upipe_hls_sink->segment == NULL) {
+        /* nothing can be decoded before the first random access point */
+        uref_free(uref);
+        return;
+    }
+
+    struct ubuf *ubuf = uref_detach_ubuf(uref);
+    uref_free(uref);
+    if (unlikely(ubuf == NULL))
+        return;
+    if (unlikely(!ubase_check(uref_block_append(upipe_hls_sink->segment,
+                                                ubuf)))) {
+        ubuf_free(ubuf);
+        upipe_warn(upipe, "unable to append to segment");
+    }
+}
+
+/** @internal @This forgets the PAT and PMT packets.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_sink_flush_psi(struct upipe *upipe)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (upipe_hls_sink->pat != NULL) {
+        ubuf_free(upipe_hls_sink->pat);
+        upipe_hls_sink->pat = NULL;
+    }
+    for (unsigned int i = 0; i < upipe_hls_sink->nb_pmts; i++)
+        if (upipe_hls_sink->pmts[i] != NULL)
+            ubuf_free(upipe_hls_sink->pmts[i]);
+    upipe_hls_sink->nb_pmts = 0;
+}
+
+/** @internal @This updates the list of PMT PIDs from a PAT section. The
+ * packets of the PMTs which are still announced are kept.
+ *
+ * @param upipe description structure of the pipe
+ * @param pat PAT section
+ */
+static void upipe_hls_sink_parse_pat(struct upipe *upipe, uint8_t *pat)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    uint16_t pmt_pids[MAX_PROGRAMS];
+    struct ubuf *pmts[MAX_PROGRAMS];
+    unsigned int nb_pmts = 0;
+    uint8_t *program;
+    uint8_t j = 0;
+    while ((program = pat_get_program(pat, j++)) != NULL) {
+        if (!patn_get_program(program))
+            /* network PID */
+            continue;
+        if (unlikely(nb_pmts >= MAX_PROGRAMS)) {
+            upipe_warn(upipe, "too many programs, not repeating all PMTs");
+            break;
+        }
+        uint16_t pid = patn_get_pid(program);
+        pmt_pids[nb_pmts] = pid;
+        pmts[nb_pmts] = NULL;
+        for (unsigned int i = 0; i < upipe_hls_sink->nb_pmts; i++)
+            if (upipe_hls_sink->pmt_pids[i] == pid) {
+                pmts[nb_pmts] = upipe_hls_sink->pmts[i];
+                upipe_hls_sink->pmts[i] = NULL;
+            }
+        nb_pmts++;
+    }
+
+    for (unsigned int i = 0; i < upipe_hls_sink->nb_pmts; i++)
+        if (upipe_hls_sink->pmts[i] != NULL)
+            ubuf_free(upipe_hls_sink->pmts[i]);
+    memcpy(upipe_hls_sink->pmt_pids, pmt_pids, sizeof(pmt_pids));
+    memcpy(upipe_hls_sink->pmts, pmts, sizeof(pmts));
+    upipe_hls_sink->nb_pmts = nb_pmts;
+}
+
+/** @internal @This keeps a reference to the last PAT or PMT packet. Only
+ * tables fitting in a single packet are repeated, so that the copy at the
+ * beginning of a segment is a legal duplicate of the last packet of its PID.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @param offset offset of the packet in the block
+ * @param pid PID of the packet
+ */
+static void upipe_hls_sink_store_psi(struct upipe *upipe, struct uref *uref,
+                                     size_t offset, uint16_t pid)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    struct ubuf **ubuf_p = NULL;
+    if (pid == PAT_PID)
+        ubuf_p = &upipe_hls_sink->pat;
+    else
+        for (unsigned int i = 0; i < upipe_hls_sink->nb_pmts; i++)
+            if (upipe_hls_sink->pmt_pids[i] == pid)
+                ubuf_p = &upipe_hls_sink->pmts[i];
+    if (ubuf_p == NULL)
+        return;
+
+    if (*ubuf_p != NULL) {
+        ubuf_free(*ubuf_p);
+        *ubuf_p = NULL;
+    }
+    uint8_t buffer[TS_SIZE];
+    if (unlikely(!ubase_check(uref_block_extract(uref, offset, TS_SIZE,
+                                                 buffer))))
+        return;
+    if (!ts_get_unitstart(buffer) || !ts_has_payload(buffer))
+        return;
+    uint8_t *payload = ts_payload(buffer);
+    uint8_t *section = payload + 1;
+    if (section + *payload + PSI_HEADER_SIZE > buffer + TS_SIZE)
+        return;
+    section += *payload;
+    if (section + PSI_HEADER_SIZE + psi_get_length(section) >
+        buffer + TS_SIZE)
+        return;
+
+    if (pid == PAT_PID) {
+        if (psi_get_tableid(section) != PAT_TID)
+            return;
+        upipe_hls_sink_parse_pat(upipe, section);
+    } else if (psi_get_tableid(section) != PMT_TID)
+        return;
+    *ubuf_p = ubuf_block_splice(uref->ubuf, offset, TS_SIZE);
+}
+
+/** @internal @This prepends the last PAT and PMT packets to a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment first block of the segment
+ */
+static void upipe_hls_sink_prepend_psi(struct upipe *upipe,
+                                       struct uref *segment)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (upipe_hls_sink->pat == NULL) {
+        upipe_warn(upipe, "no PAT before the segment");
+        return;
+    }
+
+    struct ubuf *psi = ubuf_dup(upipe_hls_sink->pat);
+    if (unlikely(psi == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    for (unsigned int i = 0; i < upipe_hls_sink->nb_pmts; i++) {
+        if (upipe_hls_sink->pmts[i] == NULL)
+            continue;
+        struct ubuf *pmt = ubuf_dup(upipe_hls_sink->pmts[i]);
+        if (unlikely(pmt == NULL ||
+                     !ubase_check(ubuf_block_append(psi, pmt)))) {
+            if (pmt != NULL)
+                ubuf_free(pmt);
+            ubuf_free(psi);
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+            return;
+        }
+    }
+
+    struct ubuf *ubuf = uref_detach_ubuf(segment);
+    if (unlikely(!ubase_check(ubuf_block_append(psi, ubuf)))) {
+        ubuf_free(psi);
+        uref_attach_ubuf(segment, ubuf);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    uref_attach_ubuf(segment, psi);
+}
+
+/** @internal @This checks whether a segment may start with the given system
+ * clock reference.
+ *
+ * @param upipe description structure of the pipe
+ * @param cr system clock reference
+ * @return true if the current segment must be cut
+ */
+static bool upipe_hls_sink_check_cut(struct upipe *upipe, uint64_t cr)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (upipe_hls_sink->segment == NULL || upipe_hls_sink->discontinuity)
+        return true;
+    if (cr == UINT64_MAX || upipe_hls_sink->segment_cr == UINT64_MAX)
+        return false;
+    return cr + CUT_TOLERANCE >=
+           upipe_hls_sink->segment_cr + upipe_hls_sink->target_duration;
+}
+
+/** @internal @This looks for a cut point in a transport stream block, and
+ * keeps the PAT and PMT packets.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @param cr system clock reference of the block
+ * @return the offset of the cut, or -1
+ */
+static int upipe_hls_sink_find_ts_cut(struct upipe *upipe, struct uref *uref,
+                                      uint64_t cr)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    size_t size;
+    if (unlikely(!ubase_check(uref_block_size(uref, &size))))
+        return -1;
+
+    int cut = -1;
+    for (size_t offset = 0; offset + TS_SIZE <= size; offset += TS_SIZE) {
+        uint8_t buffer[TS_HEADER_SIZE_AF + 1];
+        const uint8_t *p = uref_block_peek(uref, offset, sizeof(buffer),
+                                           buffer);
+        if (unlikely(p == NULL))
+            return -1;
+        bool rap = ts_validate(p) && ts_get_unitstart(p) &&
+                   ts_has_adaptation(p) && ts_get_adaptation(p) &&
+                   tsaf_has_randomaccess(p);
+        uint16_t pid = ts_get_pid(p);
+        uref_block_peek_unmap(uref, offset, buffer, p);
+
+        upipe_hls_sink_store_psi(upipe, uref, offset, pid);
+        if (cut != -1 || !rap || (upipe_hls_sink->rap_pid != NO_PID &&
+                     pid != upipe_hls_sink->rap_pid))
+            continue;
+        if (upipe_hls_sink->rap_pid == NO_PID) {
+            upipe_dbg_va(upipe, "cutting on random access points of PID %"
+                         PRIu16, pid);
+            upipe_hls_sink->rap_pid = pid;
+        }
+        upipe_hls_sink->random = true;
+        if (upipe_hls_sink_check_cut(upipe, cr))
+            cut = offset;
+    }
+    return cut;
+}
+
+/** @internal @This receives data.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_hls_sink_input(struct upipe *upipe, struct uref *uref,
+                                 struct upump **upump_p)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (unlikely(upipe_hls_sink->playlist_flow == NULL)) {
+        upipe_warn(upipe, "received a buffer before the flow definition");
+        uref_free(uref);
+        return;
+    }
+
+    uint64_t cr = UINT64_MAX;
+    if (!ubase_check(uref_clock_get_cr_sys(uref, &cr)))
+        cr = upipe_hls_sink->last_cr;
+    if ((ubase_check(uref_flow_get_discontinuity(uref)) ||
+         (cr != UINT64_MAX && upipe_hls_sink->last_cr != UINT64_MAX &&
+          cr < upipe_hls_sink->last_cr)) &&
+        upipe_hls_sink->segment != NULL && !upipe_hls_sink->discontinuity) {
+        /* the segment ends at the last date before the discontinuity */
+        upipe_hls_sink->discontinuity = true;
+        upipe_hls_sink->discontinuity_cr = upipe_hls_sink->last_cr;
+    }
+    upipe_hls_sink->last_cr = cr;
+
+    int cut = -1;
+    if (upipe_hls_sink->mpegts)
+        cut = upipe_hls_sink_find_ts_cut(upipe, uref, cr);
+    else if (ubase_check(uref_flow_get_random(uref))) {
+        upipe_hls_sink->random = true;
+        if (upipe_hls_sink_check_cut(upipe, cr))
+            cut = 0;
+    }
+    /* a transport stream always waits for a random access point */
+    if (cut == -1 && !upipe_hls_sink->mpegts && !upipe_hls_sink->random &&
+        upipe_hls_sink_check_cut(upipe, cr))
+        cut = 0;
+
+    if (cut == -1) {
+        upipe_hls_sink_append(upipe, uref);
+        return;
+    }
+
+    if (cut > 0) {
+        struct uref *tail = uref_block_split(uref, cut);
+        if (unlikely(tail == NULL)) {
+            uref_free(uref);
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+            return;
+        }
+        upipe_hls_sink_append(upipe, uref);
+        uref = tail;
+    }
+
+    upipe_hls_sink_close(upipe, upipe_hls_sink->discontinuity ?
+                                upipe_hls_sink->discontinuity_cr : cr);
+    uref_m3u_playlist_delete(uref);
+    if (upipe_hls_sink->mpegts)
+        upipe_hls_sink_prepend_psi(upipe, uref);
+    upipe_hls_sink->segment = uref;
+    upipe_hls_sink->segment_cr = cr;
+    upipe_hls_sink->segment_discontinuity = upipe_hls_sink->discontinuity;
+    upipe_hls_sink->discontinuity = false;
+}
+
+/** @internal @This sets the input flow definition.
+ *
+ * @param upipe description structure of the pipe
+ * @param flow_def flow definition packet
+ * @return an error code
+ */
+static int upipe_hls_sink_set_flow_def(struct upipe *upipe,
+                                       struct uref *flow_def)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    const char *def;
+    if (flow_def == NULL || !ubase_check(uref_flow_get_def(flow_def, &def)) ||
+        ubase_ncmp(def, EXPECTED_FLOW_DEF))
+        return UBASE_ERR_INVALID;
+
+    bool mpegts = !ubase_ncmp(def, MPEGTS_FLOW_DEF);
+    if (upipe_hls_sink->playlist_flow != NULL &&
+        mpegts == upipe_hls_sink->mpegts)
+        return UBASE_ERR_NONE;
+
+    struct uref *playlist_flow = uref_sibling_alloc_control(flow_def);
+    UBASE_ALLOC_RETURN(playlist_flow)
+    if (unlikely(!ubase_check(uref_flow_set_def(playlist_flow,
+                                                PLAYLIST_FLOW_DEF)) ||
+                 !ubase_check(uref_m3u_flow_set_version(playlist_flow,
+                                                        M3U_VERSION)))) {
+        uref_free(playlist_flow);
+        return UBASE_ERR_ALLOC;
+    }
+    uref_free(upipe_hls_sink->playlist_flow);
+    upipe_hls_sink->playlist_flow = playlist_flow;
+
+    /* packed audio segments are named after their codec */
+    upipe_hls_sink->mpegts = mpegts;
+    upipe_hls_sink->ext = "ts";
+    if (!mpegts && !ubase_ncmp(def, "block.aac."))
+        upipe_hls_sink->ext = "aac";
+    else if (!mpegts && !ubase_ncmp(def, "block.ac3."))
+        upipe_hls_sink->ext = "ac3";
+    else if (!mpegts && !ubase_ncmp(def, "block.eac3."))
+        upipe_hls_sink->ext = "ec3";
+    else if (!mpegts && !ubase_ncmp(def, "block.mp3."))
+        upipe_hls_sink->ext = "mp3";
+    upipe_hls_sink->rap_pid = NO_PID;
+    upipe_hls_sink->random = false;
+    upipe_hls_sink_flush_psi(upipe);
+    if (upipe_hls_sink->segment != NULL && !upipe_hls_sink->discontinuity) {
+        upipe_hls_sink->discontinuity = true;
+        upipe_hls_sink->discontinuity_cr = upipe_hls_sink->last_cr;
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This returns the uri of the playlist.
+ *
+ * @param upipe description structure of the pipe
+ * @param uri_p filled in with the uri
+ * @return an error code
+ */
+static int upipe_hls_sink_get_uri(struct upipe *upipe, const char **uri_p)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    assert(uri_p != NULL);
+    *uri_p = upipe_hls_sink->uri;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This sets the path of the playlist on disk. Segments are
+ * written in the same directory, and named after the playlist. NULL only
+ * keeps the segments in memory.
+ *
+ * @param upipe description structure of the pipe
+ * @param uri path of the playlist, or NULL
+ * @return an error code
+ */
+static int upipe_hls_sink_set_uri(struct upipe *upipe, const char *uri)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    ubase_clean_str(&upipe_hls_sink->uri);
+    ubase_clean_str(&upipe_hls_sink->dir);
+    ubase_clean_str(&upipe_hls_sink->prefix);
+    if (uri == NULL)
+        return UBASE_ERR_NONE;
+
+    const char *name = strrchr(uri, '/');
+    upipe_hls_sink->uri = strdup(uri);
+    upipe_hls_sink->dir = name != NULL ? strndup(uri, name - uri) :
+                                         strdup(".");
+    name = name != NULL ? name + 1 : uri;
+    const char *ext = strrchr(name, '.');
+    upipe_hls_sink->prefix = ext != NULL ? strndup(name, ext - name) :
+                                           strdup(name);
+    if (unlikely(upipe_hls_sink->uri == NULL ||
+                 upipe_hls_sink->dir == NULL ||
+                 upipe_hls_sink->prefix == NULL)) {
+        ubase_clean_str(&upipe_hls_sink->uri);
+        ubase_clean_str(&upipe_hls_sink->dir);
+        ubase_clean_str(&upipe_hls_sink->prefix);
+        return UBASE_ERR_ALLOC;
+    }
+    if (!*upipe_hls_sink->dir) {
+        free(upipe_hls_sink->dir);
+        upipe_hls_sink->dir = strdup("/");
+        UBASE_ALLOC_RETURN(upipe_hls_sink->dir)
+    }
+    upipe_hls_sink_check_upump_mgr(upipe);
+    upipe_notice_va(upipe, "writing playlist %s", upipe_hls_sink->uri);
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This sets the number of segments of the playlist and the
+ * ring.
+ *
+ * @param upipe description structure of the pipe
+ * @param window number of segments in the playlist
+ * @param depth number of segments in the ring
+ * @return an error code
+ */
+static int _upipe_hls_sink_set_window(struct upipe *upipe,
+                                      unsigned int window, unsigned int depth)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    if (unlikely(!window))
+        return UBASE_ERR_INVALID;
+    upipe_hls_sink->window = window;
+    upipe_hls_sink->depth = depth > window ? depth : window;
+    upipe_hls_sink_trim(upipe);
+    if (upipe_hls_sink->nb_segments)
+        UBASE_RETURN(upipe_hls_sink_render(upipe, false))
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This returns a new reference to a segment of the ring.
+ *
+ * @param upipe description structure of the pipe
+ * @param sequence media sequence of the segment
+ * @param uref_p filled in with the segment
+ * @return an error code
+ */
+static int _upipe_hls_sink_get_segment(struct upipe *upipe, uint64_t sequence,
+                                       struct uref **uref_p)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    assert(uref_p != NULL);
+    uint64_t first = upipe_hls_sink->next_sequence -
+                     upipe_hls_sink->nb_segments;
+    if (sequence < first || sequence >= upipe_hls_sink->next_sequence)
+        return UBASE_ERR_INVALID;
+
+    struct uchain *uchain;
+    ulist_foreach (&upipe_hls_sink->segments, uchain) {
+        if (sequence-- > first)
+            continue;
+        *uref_p = uref_dup(uref_from_uchain(uchain));
+        UBASE_ALLOC_RETURN(*uref_p)
+        return UBASE_ERR_NONE;
+    }
+    return UBASE_ERR_INVALID;
+}
+
+/** @internal @This processes control commands on a HLS sink pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @param command type of command to process
+ * @param args arguments of the command
+ * @return an error code
+ */
+static int upipe_hls_sink_control(struct upipe *upipe, int command,
+                                  va_list args)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+
+    switch (command) {
+        case UPIPE_ATTACH_UPUMP_MGR:
+            upipe_hls_sink_set_upump(upipe, NULL);
+            UBASE_RETURN(upipe_hls_sink_attach_upump_mgr(upipe))
+            if (!ulist_empty(&upipe_hls_sink->jobs))
+                upipe_hls_sink_schedule(upipe);
+            return UBASE_ERR_NONE;
+        case UPIPE_SET_FLOW_DEF: {
+            struct uref *flow_def = va_arg(args, struct uref *);
+            return upipe_hls_sink_set_flow_def(upipe, flow_def);
+        }
+        case UPIPE_GET_URI: {
+            const char **uri_p = va_arg(args, const char **);
+            return upipe_hls_sink_get_uri(upipe, uri_p);
+        }
+        case UPIPE_SET_URI: {
+            const char *uri = va_arg(args, const char *);
+            return upipe_hls_sink_set_uri(upipe, uri);
+        }
+
+        case UPIPE_HLS_SINK_GET_TARGET_DURATION: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            uint64_t *duration_p = va_arg(args, uint64_t *);
+            *duration_p = upipe_hls_sink->target_duration;
+            return UBASE_ERR_NONE;
+        }
+        case UPIPE_HLS_SINK_SET_TARGET_DURATION: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            uint64_t duration = va_arg(args, uint64_t);
+            if (unlikely(!duration))
+                return UBASE_ERR_INVALID;
+            upipe_hls_sink->target_duration = duration;
+            return UBASE_ERR_NONE;
+        }
+        case UPIPE_HLS_SINK_GET_WINDOW: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            unsigned int *window_p = va_arg(args, unsigned int *);
+            unsigned int *depth_p = va_arg(args, unsigned int *);
+            if (window_p != NULL)
+                *window_p = upipe_hls_sink->window;
+            if (depth_p != NULL)
+                *depth_p = upipe_hls_sink->depth;
+            return UBASE_ERR_NONE;
+        }
+        case UPIPE_HLS_SINK_SET_WINDOW: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            unsigned int window = va_arg(args, unsigned int);
+            unsigned int depth = va_arg(args, unsigned int);
+            return _upipe_hls_sink_set_window(upipe, window, depth);
+        }
+        case UPIPE_HLS_SINK_GET_SEGMENT: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            uint64_t sequence = va_arg(args, uint64_t);
+            struct uref **uref_p = va_arg(args, struct uref **);
+            return _upipe_hls_sink_get_segment(upipe, sequence, uref_p);
+        }
+        case UPIPE_HLS_SINK_GET_PLAYLIST: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            const char **playlist_p = va_arg(args, const char **);
+            *playlist_p = upipe_hls_sink->playlist;
+            return UBASE_ERR_NONE;
+        }
+        default:
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** @This frees a upipe. The last segment is completed, the playlist is
+ * ended, and the pending disk jobs are run synchronously.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_hls_sink_free(struct upipe *upipe)
+{
+    struct upipe_hls_sink *upipe_hls_sink = upipe_hls_sink_from_upipe(upipe);
+    /* the remaining jobs are run synchronously */
+    upipe_hls_sink_set_upump(upipe, NULL);
+    upipe_hls_sink_clean_upump_mgr(upipe);
+    upipe_hls_sink->upump_mgr = NULL;
+    upipe_hls_sink_close(upipe, upipe_hls_sink->discontinuity ?
+                                upipe_hls_sink->discontinuity_cr :
+                                upipe_hls_sink->last_cr);
+    if (upipe_hls_sink->nb_segments)
+        upipe_hls_sink_render(upipe, true);
+    upipe_hls_sink_work(upipe, SIZE_MAX);
+    upipe_throw_dead(upipe);
+
+    struct uchain *uchain, *uchain_tmp;
+    ulist_delete_foreach (&upipe_hls_sink->jobs, uchain, uchain_tmp) {
+        ulist_delete(uchain);
+        upipe_hls_sink_job_free(upipe_hls_sink_job_from_uchain(uchain));
+    }
+    ulist_delete_foreach (&upipe_hls_sink->segments, uchain, uchain_tmp) {
+        ulist_delete(uchain);
+        uref_free(uref_from_uchain(uchain));
+    }
+    upipe_hls_sink_flush_psi(upipe);
+    uref_free(upipe_hls_sink->playlist_flow);
+    free(upipe_hls_sink->playlist);
+    free(upipe_hls_sink->uri);
+    free(upipe_hls_sink->dir);
+    free(upipe_hls_sink->prefix);
+    upipe_hls_sink_clean_upump(upipe);
+    upipe_hls_sink_clean_urefcount(upipe);
+    upipe_hls_sink_free_void(upipe);
+}
+
+/** module manager static descriptor */
+static struct upipe_mgr upipe_hls_sink_mgr = {
+    .refcount = NULL,
+    .signature = UPIPE_HLS_SINK_SIGNATURE,
+
+    .upipe_alloc = upipe_hls_sink_alloc,
+    .upipe_input = upipe_hls_sink_input,
+    .upipe_control = upipe_hls_sink_control,
+
+    .upipe_mgr_control = NULL
+};
+
+/** @This returns the management structure for HLS sink pipes.
+ *
+ * @return pointer to manager
+ */
+struct upipe_mgr *upipe_hls_sink_mgr_alloc(void)
+{
+    return &upipe_hls_sink_mgr;
+}
@@ -35,12 +35,17 @@
 #include "upipe/uref_block_flow.h"
 #include "upipe/uref_clock.h"
 #include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+#include "upipe/upump.h"
 #include "upipe/upipe.h"
 #include "upipe/upipe_helper_upipe.h"
 #include "upipe/upipe_helper_urefcount.h"
 #include "upipe/upipe_helper_void.h"
 #include "upipe/upipe_helper_output.h"
 #include "upipe/upipe_helper_output_size.h"
+#include "upipe/upipe_helper_ubuf_mgr.h"
+#include "upipe/upipe_helper_upump_mgr.h"
+#include "upipe/upipe_helper_upump.h"
 #include "upipe-modules/upipe_aggregate.h"
 
 #include <stdlib.h>
@@ -51,6 +56,9 @@
 /** default output size, corresponding to 7 TS packets */
 #define DEFAULT_MTU 1316
 
+/** @hidden */
+static int upipe_agg_check(struct upipe *upipe, struct uref *flow_format);
+
 /** @internal @This is the private context of a agg pipe. */
 struct upipe_agg {
     /** refcount management structure */
@@ -65,6 +73,18 @@ struct upipe_agg {
     /** list of output requests */
     struct uchain request_list;
 
+    /** ubuf manager for contiguous buffers */
+    struct ubuf_mgr *ubuf_mgr;
+    /** flow format packet */
+    struct uref *flow_format;
+    /** ubuf manager request */
+    struct urequest ubuf_mgr_request;
+
+    /** upump manager */
+    struct upump_mgr *upump_mgr;
+    /** deadline timer */
+    struct upump *upump;
+
     /** MTU */
     size_t output_size;
     /** incoming buffer size */
@@ -74,6 +94,12 @@ struct upipe_agg {
     struct uref *aggregated;
     /** current stored size */
     size_t size;
+    /** true if the current aggregation is a contiguous buffer */
+    bool preallocated;
+    /** copy packets into contiguous buffers */
+    bool contiguous;
+    /** maximum time a packet is kept, or 0 */
+    uint64_t deadline;
 
     /** public upipe structure */
     struct upipe upipe;
@@ -84,6 +110,12 @@ UPIPE_HELPER_UREFCOUNT(upipe_agg, urefcount, upipe_agg_free)
 UPIPE_HELPER_VOID(upipe_agg)
 UPIPE_HELPER_OUTPUT(upipe_agg, output, flow_def, output_state, request_list)
 UPIPE_HELPER_OUTPUT_SIZE(upipe_agg, output_size)
+UPIPE_HELPER_UBUF_MGR(upipe_agg, ubuf_mgr, flow_format, ubuf_mgr_request,
+                      upipe_agg_check,
+                      upipe_agg_register_output_request,
+                      upipe_agg_unregister_output_request)
+UPIPE_HELPER_UPUMP_MGR(upipe_agg, upump_mgr)
+UPIPE_HELPER_UPUMP(upipe_agg, upump, upump_mgr)
 
 /** @internal @This allocates a agg pipe.
  *
@@ -105,13 +137,55 @@ static struct upipe *upipe_agg_alloc(struct upipe_mgr *mgr,
     upipe_agg_init_urefcount(upipe);
     upipe_agg_init_output(upipe);
     upipe_agg_init_output_size(upipe, DEFAULT_MTU);
+    upipe_agg_init_ubuf_mgr(upipe);
+    upipe_agg_init_upump_mgr(upipe);
+    upipe_agg_init_upump(upipe);
     upipe_agg->input_size = 0;
     upipe_agg->size = 0;
     upipe_agg->aggregated = NULL;
+    upipe_agg->preallocated = false;
+    upipe_agg->contiguous = false;
+    upipe_agg->deadline = 0;
     upipe_throw_ready(upipe);
     return upipe;
 }
 
+/** @internal @This merges the segments of a buffer if the output flow is
+ * flagged as contiguous, or removes the flag if it is not possible.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref aggregated buffer
+ * @param size size of the buffer
+ */
+static void upipe_agg_merge(struct upipe *upipe, struct uref *uref,
+                            size_t size)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    if (upipe_agg->flow_def == NULL ||
+        !ubase_check(uref_block_flow_get_contiguous(upipe_agg->flow_def)))
+        return;
+
+    const uint8_t *r;
+    int end = -1;
+    if (ubase_check(uref_block_read(uref, 0, &end, &r))) {
+        uref_block_unmap(uref, 0);
+        if (end == (int)size)
+            return;
+    }
+    if (upipe_agg->ubuf_mgr != NULL &&
+        ubase_check(uref_block_merge(uref, upipe_agg->ubuf_mgr, 0, size)))
+        return;
+
+    upipe_warn(upipe, "unable to merge buffer, output is no longer contiguous");
+    struct uref *flow_def = uref_dup(upipe_agg->flow_def);
+    if (unlikely(flow_def == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    uref_block_flow_delete_contiguous(flow_def);
+    upipe_agg_store_flow_def(upipe, flow_def);
+}
+
 /** @internal @This flushes the aggregated buffer.
  *
  * @param upipe description structure of the pipe
@@ -121,9 +195,94 @@ static void upipe_agg_flush(struct upipe *upipe, struct upump **upump_p)
 {
     struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
     struct uref *uref = upipe_agg->aggregated;
+    size_t size = upipe_agg->size;
+    bool preallocated = upipe_agg->preallocated;
+    upipe_agg_set_upump(upipe, NULL);
     upipe_agg->aggregated = NULL;
-    if (uref)
-        upipe_agg_output(upipe, uref, upump_p);
+    upipe_agg->preallocated = false;
+    upipe_agg->size = 0;
+    if (uref == NULL)
+        return;
+
+    if (preallocated) {
+        if (unlikely(!size)) {
+            uref_free(uref);
+            return;
+        }
+        uref_block_resize(uref, 0, size);
+    } else
+        upipe_agg_merge(upipe, uref, size);
+    upipe_agg_output(upipe, uref, upump_p);
+}
+
+/** @internal @This is called when the deadline of the aggregated buffer
+ * passes.
+ *
+ * @param upump description structure of the timer
+ */
+static void upipe_agg_timeout(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    upipe_agg_flush(upipe, NULL);
+}
+
+/** @internal @This starts the deadline timer of a new aggregated buffer.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_agg_wait(struct upipe *upipe)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    if (upipe_agg->deadline && upipe_agg->upump_mgr)
+        upipe_agg_wait_upump(upipe, upipe_agg->deadline, upipe_agg_timeout);
+}
+
+/** @internal @This starts a contiguous buffer with the attributes of the
+ * first packet.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref first packet
+ * @return false if the buffer couldn't be allocated
+ */
+static bool upipe_agg_prealloc(struct upipe *upipe, struct uref *uref)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    struct ubuf *ubuf = ubuf_block_alloc(upipe_agg->ubuf_mgr,
+                                         upipe_agg->output_size);
+    if (unlikely(ubuf == NULL))
+        return false;
+
+    struct uref *aggregated = uref_fork(uref, ubuf);
+    if (unlikely(aggregated == NULL)) {
+        ubuf_free(ubuf);
+        return false;
+    }
+    upipe_agg->aggregated = aggregated;
+    upipe_agg->preallocated = true;
+    upipe_agg->size = 0;
+    return true;
+}
+
+/** @internal @This copies a packet at the end of the contiguous buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref packet to copy
+ * @param size size of the packet
+ * @return an error code
+ */
+static int upipe_agg_copy(struct upipe *upipe, struct uref *uref, size_t size)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    int end = size;
+    uint8_t *w;
+    UBASE_RETURN(uref_block_write(upipe_agg->aggregated, upipe_agg->size,
+                                  &end, &w))
+    int err = end == (int)size ? uref_block_extract(uref, 0, size, w) :
+                            UBASE_ERR_INVALID;
+    uref_block_unmap(upipe_agg->aggregated, upipe_agg->size);
+    UBASE_RETURN(err)
+    upipe_agg->size += size;
+    return UBASE_ERR_NONE;
 }
 
 /** @internal @This sets the input flow definition for real.
@@ -146,6 +305,8 @@ static int upipe_agg_set_flow_def_real(struct upipe *upipe,
 
     upipe_agg->input_size = size;
 
+    /* the flow is only flagged contiguous once the ubuf manager is there */
+    uref_block_flow_delete_contiguous(flow_def);
     int err = uref_block_flow_set_size(flow_def, upipe_agg->output_size);
     if (unlikely(!ubase_check(err))) {
         uref_free(flow_def);
@@ -163,6 +324,40 @@ static int upipe_agg_set_flow_def_real(struct upipe *upipe,
         }
     }
     upipe_agg_store_flow_def(upipe, flow_def);
+    if (upipe_agg->contiguous) {
+        flow_def = uref_dup(flow_def);
+        if (unlikely(flow_def == NULL)) {
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+            return UBASE_ERR_ALLOC;
+        }
+        upipe_agg_require_ubuf_mgr(upipe, flow_def);
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This receives the ubuf manager for contiguous buffers, and
+ * flags the output flow as contiguous.
+ *
+ * @param upipe description structure of the pipe
+ * @param flow_format amended flow format
+ * @return an error code
+ */
+static int upipe_agg_check(struct upipe *upipe, struct uref *flow_format)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    if (flow_format == NULL)
+        return UBASE_ERR_NONE;
+    if (!upipe_agg->contiguous) {
+        uref_free(flow_format);
+        return UBASE_ERR_NONE;
+    }
+
+    int err = uref_block_flow_set_contiguous(flow_format);
+    if (unlikely(!ubase_check(err))) {
+        uref_free(flow_format);
+        return err;
+    }
+    upipe_agg_store_flow_def(upipe, flow_format);
     return UBASE_ERR_NONE;
 }
 
@@ -200,8 +395,23 @@ static void upipe_agg_input(struct upipe *upipe, struct uref *uref,
     if (upipe_agg->size + size > output_size)
         upipe_agg_flush(upipe, upump_p);
 
-    /* keep or attach incoming packet */
-    if (unlikely(!upipe_agg->aggregated)) {
+    /* start a contiguous buffer with the attributes of the first packet */
+    bool first = !upipe_agg->aggregated;
+    if (first && upipe_agg->contiguous && upipe_agg->ubuf_mgr != NULL &&
+        unlikely(!upipe_agg_prealloc(upipe, uref)))
+        upipe_warn(upipe, "unable to allocate contiguous buffer");
+
+    /* copy, keep or attach incoming packet */
+    if (upipe_agg->preallocated &&
+        unlikely(!ubase_check(upipe_agg_copy(upipe, uref, size)))) {
+        /* keep the packet in a new segmented buffer */
+        upipe_warn(upipe, "error copying packet");
+        upipe_agg_flush(upipe, upump_p);
+        first = true;
+    }
+    if (upipe_agg->preallocated)
+        uref_free(uref);
+    else if (unlikely(!upipe_agg->aggregated)) {
         upipe_agg->aggregated = uref;
         upipe_agg->size = size;
     } else {
@@ -215,6 +425,8 @@ static void upipe_agg_input(struct upipe *upipe, struct uref *uref,
         };
         upipe_agg->size += size;
     }
+    if (first)
+        upipe_agg_wait(upipe);
 
     /* anticipate next packet size and flush now if necessary */
     if (upipe_agg->input_size)
@@ -242,6 +454,59 @@ static int upipe_agg_set_flow_def(struct upipe *upipe, struct uref *flow_def)
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This enables or disables copying packets into contiguous
+ * buffers.
+ *
+ * @param upipe description structure of the pipe
+ * @param contiguous true to copy packets into contiguous buffers
+ * @return an error code
+ */
+static int upipe_agg_set_contiguous_real(struct upipe *upipe, bool contiguous)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    if (upipe_agg->contiguous == contiguous)
+        return UBASE_ERR_NONE;
+
+    upipe_agg_flush(upipe, NULL);
+    upipe_agg->contiguous = contiguous;
+    if (upipe_agg->flow_def == NULL)
+        return UBASE_ERR_NONE;
+
+    struct uref *flow_def = uref_dup(upipe_agg->flow_def);
+    UBASE_ALLOC_RETURN(flow_def)
+    if (contiguous)
+        /* the flow is flagged when the ubuf manager is received */
+        upipe_agg_require_ubuf_mgr(upipe, flow_def);
+    else {
+        uref_block_flow_delete_contiguous(flow_def);
+        upipe_agg_store_flow_def(upipe, flow_def);
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This sets the maximum time a packet is kept before being
+ * output.
+ *
+ * @param upipe description structure of the pipe
+ * @param deadline maximum time in 27 MHz ticks, or 0
+ * @return an error code
+ */
+static int upipe_agg_set_deadline_real(struct upipe *upipe, uint64_t deadline)
+{
+    struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+    upipe_agg->deadline = deadline;
+    upipe_agg_set_upump(upipe, NULL);
+    if (!deadline)
+        return UBASE_ERR_NONE;
+
+    upipe_agg_check_upump_mgr(upipe);
+    if (unlikely(upipe_agg->upump_mgr == NULL))
+        upipe_warn(upipe, "no upump manager, deadline ignored");
+    else if (upipe_agg->aggregated != NULL)
+        upipe_agg_wait(upipe);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on a ts check pipe.
  *
  * @param upipe description structure of the pipe
@@ -254,10 +519,28 @@ static int upipe_agg_control(struct upipe *upipe, int command, va_list args)
     UBASE_HANDLED_RETURN(upipe_agg_control_output(upipe, command, args));
     UBASE_HANDLED_RETURN(upipe_agg_control_output_size(upipe, command, args));
     switch (command) {
+        case UPIPE_ATTACH_UPUMP_MGR: {
+            struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
+            upipe_agg_set_upump(upipe, NULL);
+            UBASE_RETURN(upipe_agg_attach_upump_mgr(upipe))
+            if (upipe_agg->aggregated != NULL)
+                upipe_agg_wait(upipe);
+            return UBASE_ERR_NONE;
+        }
         case UPIPE_SET_FLOW_DEF: {
             struct uref *flow_def = va_arg(args, struct uref *);
             return upipe_agg_set_flow_def(upipe, flow_def);
         }
+        case UPIPE_AGG_SET_CONTIGUOUS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AGG_SIGNATURE)
+            int contiguous = va_arg(args, int);
+            return upipe_agg_set_contiguous_real(upipe, !!contiguous);
+        }
+        case UPIPE_AGG_SET_DEADLINE: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_AGG_SIGNATURE)
+            uint64_t deadline = va_arg(args, uint64_t);
+            return upipe_agg_set_deadline_real(upipe, deadline);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -272,9 +555,12 @@ static void upipe_agg_free(struct upipe *upipe)
     struct upipe_agg *upipe_agg = upipe_agg_from_upipe(upipe);
 
     if (unlikely(upipe_agg->aggregated)) {
-        upipe_agg_output(upipe, upipe_agg->aggregated, NULL);
+        upipe_agg_flush(upipe, NULL);
     }
     upipe_throw_dead(upipe);
+    upipe_agg_clean_upump(upipe);
+    upipe_agg_clean_upump_mgr(upipe);
+    upipe_agg_clean_ubuf_mgr(upipe);
     upipe_agg_clean_output(upipe);
     upipe_agg_clean_output_size(upipe);
     upipe_agg_clean_urefcount(upipe);
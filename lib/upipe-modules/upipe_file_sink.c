@@ -29,6 +29,8 @@
  * @short Upipe sink module for files
  */
 
+#define _GNU_SOURCE
+
 #include "upipe/ubase.h"
 #include "upipe/uclock.h"
 #include "upipe/uref.h"
@@ -58,6 +60,9 @@
 #ifndef O_CLOEXEC
 #   define O_CLOEXEC 0
 #endif
+#ifndef O_DIRECT
+#   define O_DIRECT 0
+#endif
 
 /** @hidden */
 static void upipe_fsink_watcher(struct upump *upump);
@@ -76,6 +81,8 @@ struct upipe_fsink {
     struct upump *upump;
     /** sync watcher */
     struct upump *upump_sync;
+    /** write-behind timer, used without a sync period */
+    struct upump *upump_wb;
 
     /** uclock structure, if not NULL we are in live mode */
     struct uclock *uclock;
@@ -91,6 +98,15 @@ struct upipe_fsink {
     /** sync period */
     uint64_t sync_period;
 
+    /** write-behind buffer, or NULL */
+    uint8_t *wb_buffer;
+    /** size of the write-behind buffer */
+    size_t wb_size;
+    /** number of octets in the write-behind buffer */
+    size_t wb_fill;
+    /** true if O_DIRECT is used with write-behind */
+    bool direct;
+
     /** temporary uref storage */
     struct uchain urefs;
     /** nb urefs in storage */
@@ -110,6 +126,7 @@ UPIPE_HELPER_VOID(upipe_fsink)
 UPIPE_HELPER_UPUMP_MGR(upipe_fsink, upump_mgr)
 UPIPE_HELPER_UPUMP(upipe_fsink, upump, upump_mgr)
 UPIPE_HELPER_UPUMP(upipe_fsink, upump_sync, upump_mgr)
+UPIPE_HELPER_UPUMP(upipe_fsink, upump_wb, upump_mgr)
 UPIPE_HELPER_INPUT(upipe_fsink, urefs, nb_urefs, max_urefs, blockers, upipe_fsink_output)
 UPIPE_HELPER_UCLOCK(upipe_fsink, uclock, uclock_request, NULL, upipe_throw_provide_request, NULL)
 
@@ -134,12 +151,17 @@ static struct upipe *upipe_fsink_alloc(struct upipe_mgr *mgr,
     upipe_fsink_init_upump_mgr(upipe);
     upipe_fsink_init_upump(upipe);
     upipe_fsink_init_upump_sync(upipe);
+    upipe_fsink_init_upump_wb(upipe);
     upipe_fsink_init_input(upipe);
     upipe_fsink_init_uclock(upipe);
     upipe_fsink->latency = 0;
     upipe_fsink->fd = -1;
     upipe_fsink->path = NULL;
     upipe_fsink->sync_period = 0;
+    upipe_fsink->wb_buffer = NULL;
+    upipe_fsink->wb_size = 0;
+    upipe_fsink->wb_fill = 0;
+    upipe_fsink->direct = false;
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -167,6 +189,233 @@ static void upipe_fsink_poll(struct upipe *upipe)
     }
 }
 
+/** @internal @This sets or clears O_DIRECT on the file descriptor.
+ *
+ * @param upipe description structure of the pipe
+ * @param direct true to set O_DIRECT
+ * @return false if the flag could not be changed
+ */
+static bool upipe_fsink_set_direct(struct upipe *upipe, bool direct)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    int flags = fcntl(upipe_fsink->fd, F_GETFL);
+    /* the unaligned tail can't be rewritten in append mode */
+    if (unlikely(flags == -1 || !O_DIRECT || (direct && (flags & O_APPEND))))
+        return false;
+    flags = direct ? flags | O_DIRECT : flags & ~O_DIRECT;
+    return fcntl(upipe_fsink->fd, F_SETFL, flags) != -1;
+}
+
+/** @internal @This applies the O_DIRECT setting to a newly opened file.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_fsink_open_direct(struct upipe *upipe)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    if (upipe_fsink->wb_buffer != NULL && upipe_fsink->direct &&
+        !upipe_fsink_set_direct(upipe, true)) {
+        upipe_warn_va(upipe, "O_DIRECT not supported for %s",
+                      upipe_fsink->path);
+        upipe_fsink->direct = false;
+    }
+}
+
+/** @internal @This writes a part of the write-behind buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param size number of octets to write from the start of the buffer
+ * @param written_p filled in with the number of octets written
+ * @return an error code, UBASE_ERR_BUSY if the write would block
+ */
+static int upipe_fsink_wb_write(struct upipe *upipe, size_t size,
+                                size_t *written_p)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    *written_p = 0;
+    while (*written_p < size) {
+        ssize_t ret = write(upipe_fsink->fd,
+                            upipe_fsink->wb_buffer + *written_p,
+                            size - *written_p);
+        if (likely(ret >= 0)) {
+            *written_p += ret;
+            continue;
+        }
+
+        switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                return UBASE_ERR_BUSY;
+            case EINVAL:
+                /* the file offset is probably not aligned */
+                if (upipe_fsink->direct) {
+                    upipe_warn_va(upipe, "disabling O_DIRECT for %s",
+                                  upipe_fsink->path);
+                    upipe_fsink->direct = false;
+                    upipe_fsink_set_direct(upipe, false);
+                    continue;
+                }
+                /* fallthrough */
+            default:
+                return UBASE_ERR_EXTERNAL;
+        }
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This writes the content of the write-behind buffer to the file.
+ * With O_DIRECT, only the aligned part is written, unless all is true. The
+ * unaligned tail is then written through the page cache and kept in the
+ * buffer, to be written again with the next aligned write.
+ *
+ * @param upipe description structure of the pipe
+ * @param all true to write the unaligned tail as well
+ * @return an error code, UBASE_ERR_BUSY if the write would block
+ */
+static int upipe_fsink_wb_flush(struct upipe *upipe, bool all)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    if (upipe_fsink->wb_buffer == NULL || upipe_fsink->fd == -1 ||
+        !upipe_fsink->wb_fill)
+        return UBASE_ERR_NONE;
+
+    size_t size = upipe_fsink->wb_fill;
+    if (upipe_fsink->direct)
+        size -= size % UPIPE_FSINK_WRITE_BEHIND_ALIGN;
+    size_t written;
+    int err = upipe_fsink_wb_write(upipe, size, &written);
+    upipe_fsink->wb_fill -= written;
+    memmove(upipe_fsink->wb_buffer, upipe_fsink->wb_buffer + written,
+            upipe_fsink->wb_fill);
+    UBASE_RETURN(err)
+
+    if (!all || !upipe_fsink->wb_fill)
+        return UBASE_ERR_NONE;
+
+    /* only happens with O_DIRECT */
+    upipe_fsink_set_direct(upipe, false);
+    err = upipe_fsink_wb_write(upipe, upipe_fsink->wb_fill, &written);
+    if (upipe_fsink->direct)
+        upipe_fsink_set_direct(upipe, true);
+    if (unlikely(lseek(upipe_fsink->fd, -(off_t)written, SEEK_CUR) == -1))
+        return UBASE_ERR_EXTERNAL;
+    return err;
+}
+
+/** @internal @This writes the content of the write-behind buffer before the
+ * file is closed or the buffer is released, and empties the buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int upipe_fsink_wb_close(struct upipe *upipe)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    int err = upipe_fsink_wb_flush(upipe, true);
+    if (ubase_check(err) && upipe_fsink->wb_fill &&
+        lseek(upipe_fsink->fd, upipe_fsink->wb_fill, SEEK_CUR) == -1)
+        err = UBASE_ERR_EXTERNAL;
+    if (unlikely(!ubase_check(err)))
+        upipe_warn_va(upipe, "write error to %s (%m)", upipe_fsink->path);
+    upipe_fsink->wb_fill = 0;
+    return err;
+}
+
+/** @internal @This is called when data was kept in the write-behind buffer
+ * for a whole period, without a sync period.
+ *
+ * @param upump description structure of the timer
+ */
+static void upipe_fsink_wb_timer(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    upipe_fsink_set_upump_wb(upipe, NULL);
+    if (unlikely(!ubase_check(upipe_fsink_wb_flush(upipe, true))))
+        upipe_warn_va(upipe, "write error to %s (%m)", upipe_fsink->path);
+}
+
+/** @internal @This arms the write-behind timer, so that data doesn't stay
+ * in the buffer at low rates when there is no sync period.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_fsink_wb_arm(struct upipe *upipe)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    if (upipe_fsink->sync_period || upipe_fsink->upump_wb != NULL ||
+        !ubase_check(upipe_fsink_check_upump_mgr(upipe)))
+        return;
+
+    struct upump *upump = upump_alloc_timer(upipe_fsink->upump_mgr,
+            upipe_fsink_wb_timer, upipe, upipe->refcount,
+            UPIPE_FSINK_WRITE_BEHIND_PERIOD, 0);
+    if (unlikely(upump == NULL)) {
+        upipe_warn(upipe, "can't create write-behind timer");
+        return;
+    }
+    upipe_fsink_set_upump_wb(upipe, upump);
+    upump_start(upump);
+}
+
+/** @internal @This copies data to the write-behind buffer, and writes the
+ * buffer when it is full.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ * @return true if the uref was processed
+ */
+static bool upipe_fsink_wb_output(struct upipe *upipe, struct uref *uref)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    size_t size, offset = 0;
+    if (unlikely(!ubase_check(uref_block_size(uref, &size)))) {
+        uref_free(uref);
+        upipe_warn(upipe, "cannot read ubuf buffer");
+        return true;
+    }
+
+    while (offset < size) {
+        if (upipe_fsink->wb_fill == upipe_fsink->wb_size) {
+            int err = upipe_fsink_wb_flush(upipe, false);
+            if (unlikely(err == UBASE_ERR_BUSY)) {
+                uref_block_resize(uref, offset, -1);
+                upipe_fsink_poll(upipe);
+                return false;
+            }
+            if (unlikely(!ubase_check(err))) {
+                uref_free(uref);
+                upipe_warn_va(upipe, "write error to %s (%m)",
+                              upipe_fsink->path);
+                upipe_fsink_set_upump(upipe, NULL);
+                upipe_fsink_set_upump_sync(upipe, NULL);
+                upipe_fsink_set_upump_wb(upipe, NULL);
+                upipe_throw_sink_end(upipe);
+                return true;
+            }
+        }
+
+        size_t chunk = upipe_fsink->wb_size - upipe_fsink->wb_fill;
+        if (chunk > size - offset)
+            chunk = size - offset;
+        if (unlikely(!ubase_check(uref_block_extract(uref, offset, chunk,
+                        upipe_fsink->wb_buffer + upipe_fsink->wb_fill)))) {
+            uref_free(uref);
+            upipe_warn(upipe, "cannot read ubuf buffer");
+            return true;
+        }
+        upipe_fsink->wb_fill += chunk;
+        offset += chunk;
+    }
+    uref_free(uref);
+    upipe_fsink_wb_arm(upipe);
+    return true;
+}
+
 /** @internal @This outputs data to the file sink.
  *
  * @param upipe description structure of the pipe
@@ -211,6 +460,9 @@ static bool upipe_fsink_output(struct upipe *upipe, struct uref *uref,
     }
 
 write_buffer:
+    if (upipe_fsink->wb_buffer != NULL)
+        return upipe_fsink_wb_output(upipe, uref);
+
     for ( ; ; ) {
         int iovec_count = uref_block_iovec_count(uref, 0, -1);
         if (unlikely(iovec_count == -1)) {
@@ -257,6 +509,7 @@ write_buffer:
             upipe_warn_va(upipe, "write error to %s (%m)", upipe_fsink->path);
             upipe_fsink_set_upump(upipe, NULL);
             upipe_fsink_set_upump_sync(upipe, NULL);
+            upipe_fsink_set_upump_wb(upipe, NULL);
             upipe_throw_sink_end(upipe);
             return true;
         }
@@ -298,6 +551,8 @@ static void upipe_fsink_sync(struct upump *upump)
 {
     struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
     struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    if (unlikely(!ubase_check(upipe_fsink_wb_flush(upipe, true))))
+        upipe_warn_va(upipe, "write error to %s (%m)", upipe_fsink->path);
     if (likely(upipe_fsink->fd != -1))
 #if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
         fdatasync(upipe_fsink->fd);
@@ -388,6 +643,7 @@ static int _upipe_fsink_set_path(struct upipe *upipe, const char *path,
     struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
 
     if (unlikely(upipe_fsink->fd != -1)) {
+        upipe_fsink_wb_close(upipe);
         if (likely(upipe_fsink->path != NULL))
             upipe_notice_va(upipe, "closing file %s", upipe_fsink->path);
         ubase_clean_fd(&upipe_fsink->fd);
@@ -395,6 +651,7 @@ static int _upipe_fsink_set_path(struct upipe *upipe, const char *path,
     ubase_clean_str(&upipe_fsink->path);
     upipe_fsink_set_upump(upipe, NULL);
     upipe_fsink_set_upump_sync(upipe, NULL);
+    upipe_fsink_set_upump_wb(upipe, NULL);
     if (!upipe_fsink_check_input(upipe))
         /* Release the pipe used in @ref upipe_fsink_input. */
         upipe_release(upipe);
@@ -451,6 +708,7 @@ static int _upipe_fsink_set_path(struct upipe *upipe, const char *path,
         upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
         return UBASE_ERR_ALLOC;
     }
+    upipe_fsink_open_direct(upipe);
     if (!upipe_fsink_check_input(upipe))
         /* Use again the pipe that we previously released. */
         upipe_use(upipe);
@@ -472,6 +730,7 @@ static int _upipe_fsink_set_fd(struct upipe *upipe, int fd,
     struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
 
     if (unlikely(upipe_fsink->fd != -1)) {
+        upipe_fsink_wb_close(upipe);
         if (likely(upipe_fsink->path != NULL))
             upipe_notice_va(upipe, "closing file %s", upipe_fsink->path);
         ubase_clean_fd(&upipe_fsink->fd);
@@ -479,6 +738,7 @@ static int _upipe_fsink_set_fd(struct upipe *upipe, int fd,
     ubase_clean_str(&upipe_fsink->path);
     upipe_fsink_set_upump(upipe, NULL);
     upipe_fsink_set_upump_sync(upipe, NULL);
+    upipe_fsink_set_upump_wb(upipe, NULL);
     if (!upipe_fsink_check_input(upipe))
         /* Release the pipe used in @ref upipe_fsink_input. */
         upipe_release(upipe);
@@ -519,6 +779,7 @@ static int _upipe_fsink_set_fd(struct upipe *upipe, int fd,
             break;
     }
 
+    upipe_fsink_open_direct(upipe);
     if (!upipe_fsink_check_input(upipe))
         /* Use again the pipe that we previously released. */
         upipe_use(upipe);
@@ -527,6 +788,54 @@ static int _upipe_fsink_set_fd(struct upipe *upipe, int fd,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This replaces the current file with an already opened file
+ * descriptor, and returns the previous one without closing it.
+ *
+ * @param upipe description structure of the pipe
+ * @param fd new file descriptor, or -1
+ * @param path path of the new file (may be NULL)
+ * @param old_fd_p filled in with the previous file descriptor
+ * @return an error code
+ */
+static int _upipe_fsink_swap_fd(struct upipe *upipe, int fd, const char *path,
+                                int *old_fd_p)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    assert(old_fd_p != NULL);
+
+    if (upipe_fsink->fd != -1)
+        upipe_fsink_wb_close(upipe);
+    *old_fd_p = upipe_fsink->fd;
+    upipe_fsink->fd = -1;
+    ubase_clean_str(&upipe_fsink->path);
+    upipe_fsink_set_upump(upipe, NULL);
+    upipe_fsink_set_upump_sync(upipe, NULL);
+    upipe_fsink_set_upump_wb(upipe, NULL);
+    if (!upipe_fsink_check_input(upipe))
+        /* Release the pipe used in @ref upipe_fsink_input. */
+        upipe_release(upipe);
+
+    if (unlikely(fd < 0))
+        return UBASE_ERR_NONE;
+
+    upipe_fsink_check_upump_mgr(upipe);
+    upipe_fsink->fd = fd;
+    if (path != NULL) {
+        upipe_fsink->path = strdup(path);
+        if (unlikely(upipe_fsink->path == NULL)) {
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+            return UBASE_ERR_ALLOC;
+        }
+    }
+
+    upipe_fsink_open_direct(upipe);
+    if (!upipe_fsink_check_input(upipe))
+        /* Use again the pipe that we previously released. */
+        upipe_use(upipe);
+    upipe_notice_va(upipe, "switching to file %s", upipe_fsink->path);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This returns the file descriptor of the currently opened file.
  *
  * @param upipe description structure of the pipe
@@ -552,6 +861,7 @@ static int _upipe_fsink_set_sync_period(struct upipe *upipe,
     struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
     upipe_fsink->sync_period = sync_period;
     upipe_fsink_set_upump_sync(upipe, NULL);
+    upipe_fsink_set_upump_wb(upipe, NULL);
     return UBASE_ERR_NONE;
 }
 
@@ -568,6 +878,49 @@ static int _upipe_fsink_get_sync_period(struct upipe *upipe, uint64_t *p)
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets the size of the write-behind buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param size size of the buffer, or 0 to disable write-behind
+ * @param direct true to use O_DIRECT
+ * @return an error code
+ */
+static int _upipe_fsink_set_write_behind(struct upipe *upipe,
+                                         unsigned int size, bool direct)
+{
+    struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
+    if (unlikely(size > UPIPE_FSINK_WRITE_BEHIND_MAX))
+        return UBASE_ERR_INVALID;
+    size += UPIPE_FSINK_WRITE_BEHIND_ALIGN - 1;
+    size -= size % UPIPE_FSINK_WRITE_BEHIND_ALIGN;
+
+    if (upipe_fsink->wb_buffer != NULL) {
+        if (upipe_fsink->fd != -1) {
+            UBASE_RETURN(upipe_fsink_wb_close(upipe))
+            if (upipe_fsink->direct)
+                upipe_fsink_set_direct(upipe, false);
+        }
+        free(upipe_fsink->wb_buffer);
+        upipe_fsink->wb_buffer = NULL;
+        upipe_fsink->wb_size = upipe_fsink->wb_fill = 0;
+        upipe_fsink->direct = false;
+        upipe_fsink_set_upump_wb(upipe, NULL);
+    }
+    if (!size)
+        return UBASE_ERR_NONE;
+
+    void *buffer;
+    if (unlikely(posix_memalign(&buffer, UPIPE_FSINK_WRITE_BEHIND_ALIGN,
+                                size)))
+        return UBASE_ERR_ALLOC;
+    upipe_fsink->wb_buffer = buffer;
+    upipe_fsink->wb_size = size;
+    upipe_fsink->direct = direct;
+    if (upipe_fsink->fd != -1)
+        upipe_fsink_open_direct(upipe);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on a file sink pipe.
  *
  * @param upipe description structure of the pipe
@@ -585,10 +938,12 @@ static int  _upipe_fsink_control(struct upipe *upipe, int command, va_list args)
         case UPIPE_ATTACH_UPUMP_MGR:
             upipe_fsink_set_upump(upipe, NULL);
             upipe_fsink_set_upump_sync(upipe, NULL);
+            upipe_fsink_set_upump_wb(upipe, NULL);
             return upipe_fsink_attach_upump_mgr(upipe);
         case UPIPE_ATTACH_UCLOCK:
             upipe_fsink_set_upump(upipe, NULL);
             upipe_fsink_set_upump_sync(upipe, NULL);
+            upipe_fsink_set_upump_wb(upipe, NULL);
             upipe_fsink_require_uclock(upipe);
             return UBASE_ERR_NONE;
         case UPIPE_SET_FLOW_DEF: {
@@ -629,6 +984,19 @@ static int  _upipe_fsink_control(struct upipe *upipe, int command, va_list args)
             int *fd_p = va_arg(args, int *);
             return _upipe_fsink_get_fd(upipe, fd_p);
         }
+        case UPIPE_FSINK_SET_WRITE_BEHIND: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_FSINK_SIGNATURE)
+            unsigned int size = va_arg(args, unsigned int);
+            bool direct = !!va_arg(args, int);
+            return _upipe_fsink_set_write_behind(upipe, size, direct);
+        }
+        case UPIPE_FSINK_SWAP_FD: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_FSINK_SIGNATURE)
+            int fd = va_arg(args, int);
+            const char *path = va_arg(args, const char *);
+            int *old_fd_p = va_arg(args, int *);
+            return _upipe_fsink_swap_fd(upipe, fd, path, old_fd_p);
+        }
         case UPIPE_FSINK_SET_SYNC_PERIOD: {
             UBASE_SIGNATURE_CHECK(args, UPIPE_FSINK_SIGNATURE)
             uint64_t sync_period = va_arg(args, uint64_t);
@@ -689,6 +1057,7 @@ static void upipe_fsink_free(struct upipe *upipe)
 {
     struct upipe_fsink *upipe_fsink = upipe_fsink_from_upipe(upipe);
     if (likely(upipe_fsink->fd != -1)) {
+        upipe_fsink_wb_close(upipe);
         if (likely(upipe_fsink->path != NULL)) {
             upipe_notice_va(upipe, "closing file %s", upipe_fsink->path);
             close(upipe_fsink->fd);
@@ -697,9 +1066,11 @@ static void upipe_fsink_free(struct upipe *upipe)
     upipe_throw_dead(upipe);
 
     free(upipe_fsink->path);
+    free(upipe_fsink->wb_buffer);
     upipe_fsink_clean_uclock(upipe);
     upipe_fsink_clean_upump(upipe);
     upipe_fsink_clean_upump_sync(upipe);
+    upipe_fsink_clean_upump_wb(upipe);
     upipe_fsink_clean_upump_mgr(upipe);
     upipe_fsink_clean_input(upipe);
     upipe_fsink_clean_urefcount(upipe);
@@ -27,7 +27,10 @@
  * @short Upipe module - multicat file sink
  */
 
+#define _GNU_SOURCE
+
 #include "upipe/ubase.h"
+#include "upipe/ulist.h"
 #include "upipe/uprobe.h"
 #include "upipe/uprobe_prefix.h"
 #include "upipe/uref_clock.h"
@@ -46,10 +49,60 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <assert.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+
+#ifndef O_CLOEXEC
+#   define O_CLOEXEC 0
+#endif
 
 #define EXPECTED_FLOW_DEF "block."
+/** maximum number of files waiting to be closed by the helper thread */
+#define MAX_CLOSING 8
+/** maximum number of urefs held while the helper thread opens a segment */
+#define MAX_HELD 1024
+
+/** @internal @This is the state of the helper thread, which opens the next
+ * segment ahead of time and closes the previous one, so that neither happens
+ * on the real-time thread. */
+struct upipe_multicat_sink_helper {
+    /** helper thread */
+    pthread_t thread;
+    /** true if the thread was started */
+    bool started;
+    /** true if the thread must exit */
+    bool quit;
+    /** mutex protecting the fields below */
+    pthread_mutex_t mutex;
+    /** condition signaled when there is a job or when a job is done */
+    pthread_cond_t cond;
+
+    /** index of the segment to open, or -1 */
+    int64_t next_idx;
+    /** path of the segment to open */
+    char next_path[MAXPATHLEN];
+    /** mode of opening */
+    enum upipe_fsink_mode next_mode;
+    /** number of octets to preallocate */
+    uint64_t next_prealloc;
+    /** true if the opening was attempted */
+    bool next_done;
+    /** true if the file was created by the helper */
+    bool next_created;
+    /** opened file descriptor, or -1 in case of error */
+    int next_fd;
+
+    /** file descriptors to close */
+    int closing[MAX_CLOSING];
+    /** number of file descriptors to close */
+    unsigned int nb_closing;
+    /** true if the file descriptors must be sync'ed before closing */
+    bool sync;
+};
 
 /** upipe_multicat_sink structure */
 struct upipe_multicat_sink {
@@ -82,6 +135,20 @@ struct upipe_multicat_sink {
     /** sync period */
     uint64_t sync_period;
 
+    /** index of the segment being opened by the helper thread, or -1 */
+    int64_t pending_idx;
+    /** urefs held until the pending segment is opened */
+    struct uchain held;
+    /** number of held urefs */
+    unsigned int nb_held;
+
+    /** octets written to the current segment */
+    uint64_t segment_size;
+    /** octets written to the previous segment */
+    uint64_t last_segment_size;
+    /** helper thread */
+    struct upipe_multicat_sink_helper helper;
+
     /** public upipe structure */
     struct upipe upipe;
 };
@@ -90,31 +157,405 @@ UPIPE_HELPER_UPIPE(upipe_multicat_sink, upipe, UPIPE_MULTICAT_SINK_SIGNATURE);
 UPIPE_HELPER_UREFCOUNT(upipe_multicat_sink, urefcount, upipe_multicat_sink_free)
 UPIPE_HELPER_VOID(upipe_multicat_sink)
 
+/** @internal @This opens a segment, in the helper thread. In overwrite mode,
+ * the file is not truncated, since it is opened a whole period before it is
+ * used; non-empty files are opened again at the boundary.
+ *
+ * @param path path of the segment
+ * @param mode mode of opening
+ * @param prealloc number of octets to preallocate
+ * @param created_p set to true if the file did not exist
+ * @return file descriptor, or -1 in case of error
+ */
+static int upipe_multicat_sink_helper_open(const char *path,
+                                           enum upipe_fsink_mode mode,
+                                           uint64_t prealloc, bool *created_p)
+{
+    int flags;
+    switch (mode) {
+        case UPIPE_FSINK_NONE:
+            flags = 0;
+            break;
+        case UPIPE_FSINK_APPEND:
+        case UPIPE_FSINK_OVERWRITE:
+            flags = O_CREAT;
+            break;
+        case UPIPE_FSINK_CREATE:
+            flags = O_CREAT | O_EXCL;
+            break;
+        default:
+            return -1;
+    }
+
+    struct stat st;
+    *created_p = stat(path, &st) == -1;
+    int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC | flags,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (unlikely(fd == -1))
+        return -1;
+
+    off_t offset = 0;
+    if (mode == UPIPE_FSINK_APPEND &&
+        unlikely((offset = lseek(fd, 0, SEEK_END)) == -1)) {
+        close(fd);
+        return -1;
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    /* reserve the blocks without changing the size of the file, errors are
+     * not fatal */
+    if (prealloc)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, prealloc);
+#endif
+    return fd;
+}
+
+/** @internal @This closes a segment, in the helper thread.
+ *
+ * @param fd file descriptor
+ * @param sync true if the file must be sync'ed before closing
+ */
+static void upipe_multicat_sink_helper_close(int fd, bool sync)
+{
+    if (sync)
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        fdatasync(fd);
+#else
+        fsync(fd);
+#endif
+    close(fd);
+}
+
+/** @internal @This is the main loop of the helper thread.
+ *
+ * @param _helper helper thread state
+ * @return NULL
+ */
+static void *upipe_multicat_sink_helper_run(void *_helper)
+{
+    struct upipe_multicat_sink_helper *helper =
+        (struct upipe_multicat_sink_helper *)_helper;
+
+    pthread_mutex_lock(&helper->mutex);
+    for ( ; ; ) {
+        if (helper->nb_closing) {
+            int fd = helper->closing[--helper->nb_closing];
+            bool sync = helper->sync;
+            pthread_mutex_unlock(&helper->mutex);
+            upipe_multicat_sink_helper_close(fd, sync);
+            pthread_mutex_lock(&helper->mutex);
+            continue;
+        }
+        if (helper->quit)
+            break;
+
+        if (helper->next_idx != -1 && !helper->next_done) {
+            int64_t idx = helper->next_idx;
+            char path[MAXPATHLEN];
+            strcpy(path, helper->next_path);
+            enum upipe_fsink_mode mode = helper->next_mode;
+            uint64_t prealloc = helper->next_prealloc;
+            pthread_mutex_unlock(&helper->mutex);
+
+            bool created = false;
+            int fd = upipe_multicat_sink_helper_open(path, mode, prealloc,
+                                                     &created);
+
+            pthread_mutex_lock(&helper->mutex);
+            if (helper->next_idx == idx) {
+                helper->next_fd = fd;
+                helper->next_created = created;
+                helper->next_done = true;
+                pthread_cond_broadcast(&helper->cond);
+            } else if (fd != -1) {
+                /* cancelled in the meantime */
+                if (created)
+                    unlink(path);
+                close(fd);
+            }
+            continue;
+        }
+        pthread_cond_wait(&helper->cond, &helper->mutex);
+    }
+    pthread_mutex_unlock(&helper->mutex);
+    return NULL;
+}
+
+/** @internal @This starts the helper thread if needed.
+ *
+ * @param upipe description structure of the pipe
+ * @return false if the thread could not be started
+ */
+static bool upipe_multicat_sink_helper_start(struct upipe *upipe)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    struct upipe_multicat_sink_helper *helper = &upipe_multicat_sink->helper;
+    if (likely(helper->started))
+        return true;
+
+    helper->quit = false;
+    helper->next_idx = -1;
+    helper->next_fd = -1;
+    helper->nb_closing = 0;
+    helper->sync = false;
+    if (unlikely(pthread_create(&helper->thread, NULL,
+                                upipe_multicat_sink_helper_run,
+                                helper) != 0)) {
+        upipe_warn(upipe, "couldn't start helper thread");
+        return false;
+    }
+    helper->started = true;
+    return true;
+}
+
+/** @internal @This discards the segment opened ahead of time, if any. It must
+ * be called with the mutex locked.
+ *
+ * @param helper helper thread state
+ */
+static void upipe_multicat_sink_helper_discard(
+        struct upipe_multicat_sink_helper *helper)
+{
+    if (helper->next_idx != -1 && helper->next_done &&
+        helper->next_fd != -1) {
+        if (helper->next_created)
+            unlink(helper->next_path);
+        close(helper->next_fd);
+    }
+    helper->next_idx = -1;
+    helper->next_fd = -1;
+}
+
+/** @internal @This stops the helper thread, after it has closed all pending
+ * files.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_multicat_sink_helper_stop(struct upipe *upipe)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    struct upipe_multicat_sink_helper *helper = &upipe_multicat_sink->helper;
+    if (!helper->started)
+        return;
+
+    pthread_mutex_lock(&helper->mutex);
+    helper->quit = true;
+    upipe_multicat_sink_helper_discard(helper);
+    pthread_cond_signal(&helper->cond);
+    pthread_mutex_unlock(&helper->mutex);
+    pthread_join(helper->thread, NULL);
+    helper->started = false;
+}
+
+/** @internal @This asks the helper thread to open a segment ahead of time.
+ *
+ * @param upipe description structure of the pipe
+ * @param idx index of the segment
+ */
+static void upipe_multicat_sink_prepare_file(struct upipe *upipe, int64_t idx)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    struct upipe_multicat_sink_helper *helper = &upipe_multicat_sink->helper;
+    if (!upipe_multicat_sink_helper_start(upipe))
+        return;
+
+    pthread_mutex_lock(&helper->mutex);
+    upipe_multicat_sink_helper_discard(helper);
+    snprintf(helper->next_path, MAXPATHLEN, "%s%"PRId64"%s",
+             upipe_multicat_sink->dirpath, idx, upipe_multicat_sink->suffix);
+    helper->next_idx = idx;
+    helper->next_mode = upipe_multicat_sink->mode;
+    helper->next_prealloc = upipe_multicat_sink->last_segment_size;
+    helper->next_done = false;
+    pthread_cond_signal(&helper->cond);
+    pthread_mutex_unlock(&helper->mutex);
+}
+
+/** @internal @This switches the fsink to a segment opened ahead of time, and
+ * hands the previous file to the helper thread for closing.
+ *
+ * @param upipe description structure of the pipe
+ * @param idx new file index
+ * @param wait true to wait for the helper thread if it is still opening the
+ * segment
+ * @return an error code, UBASE_ERR_BUSY if the segment is still being opened,
+ * or another error if it was not opened ahead of time
+ */
+static int upipe_multicat_sink_swap_file(struct upipe *upipe, int64_t idx,
+                                         bool wait)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    struct upipe_multicat_sink_helper *helper = &upipe_multicat_sink->helper;
+    if (!helper->started)
+        return UBASE_ERR_INVALID;
+
+    pthread_mutex_lock(&helper->mutex);
+    if (helper->next_idx != idx) {
+        /* not the expected segment, for instance after a discontinuity */
+        upipe_multicat_sink_helper_discard(helper);
+        pthread_mutex_unlock(&helper->mutex);
+        return UBASE_ERR_INVALID;
+    }
+    /* opening the file again would race with the helper thread, so the
+     * caller holds its urefs until it is done, unless asked to wait */
+    if (!helper->next_done && !wait) {
+        pthread_mutex_unlock(&helper->mutex);
+        return UBASE_ERR_BUSY;
+    }
+    while (!helper->next_done)
+        pthread_cond_wait(&helper->cond, &helper->mutex);
+    int fd = helper->next_fd;
+    bool created = helper->next_created;
+    helper->next_idx = -1;
+    helper->next_fd = -1;
+    pthread_mutex_unlock(&helper->mutex);
+    if (fd == -1)
+        return UBASE_ERR_EXTERNAL;
+
+    struct stat st;
+    if (upipe_multicat_sink->mode == UPIPE_FSINK_OVERWRITE &&
+        (fstat(fd, &st) == -1 || st.st_size)) {
+        /* the file must be truncated by the fsink */
+        close(fd);
+        return UBASE_ERR_INVALID;
+    }
+
+    int old_fd = -1;
+    if (unlikely(!ubase_check(upipe_fsink_swap_fd(upipe_multicat_sink->fsink,
+                        fd, helper->next_path, &old_fd)))) {
+        /* the file will be opened again by the fsink */
+        if (created)
+            unlink(helper->next_path);
+        close(fd);
+        return UBASE_ERR_UNHANDLED;
+    }
+
+    if (old_fd != -1) {
+        pthread_mutex_lock(&helper->mutex);
+        if (likely(helper->nb_closing < MAX_CLOSING)) {
+            helper->closing[helper->nb_closing++] = old_fd;
+            helper->sync = !!upipe_multicat_sink->sync_period;
+            old_fd = -1;
+            pthread_cond_signal(&helper->cond);
+        }
+        pthread_mutex_unlock(&helper->mutex);
+        if (unlikely(old_fd != -1)) {
+            upipe_warn(upipe, "helper thread late, closing synchronously");
+            close(old_fd);
+        }
+    }
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This generates a path from idx and send set_path to the internal
  * (fsink) output
  *
  * @param upipe description structure of the pipe
  * @param idx new file index
- * @return false in case of error
+ * @param wait true to wait for the helper thread if it is still opening the
+ * segment
+ * @return an error code, UBASE_ERR_BUSY if the segment is still being opened
  */
-static bool _upipe_multicat_sink_change_file(struct upipe *upipe, int64_t idx)
+static int _upipe_multicat_sink_change_file(struct upipe *upipe, int64_t idx,
+                                            bool wait)
 {
     struct upipe_multicat_sink *upipe_multicat_sink = upipe_multicat_sink_from_upipe(upipe);
     char filepath[MAXPATHLEN];
     if (unlikely(! (upipe_multicat_sink->dirpath
                       && upipe_multicat_sink->suffix && upipe_multicat_sink->fsink) )) {
         upipe_warn(upipe, "call set_path first !");
-        return false;
+        return UBASE_ERR_INVALID;
+    }
+
+    int err = upipe_multicat_sink_swap_file(upipe, idx, wait);
+    if (err == UBASE_ERR_BUSY)
+        return err;
+    if (!ubase_check(err)) {
+        snprintf(filepath, MAXPATHLEN, "%s%"PRId64"%s", upipe_multicat_sink->dirpath, idx, upipe_multicat_sink->suffix);
+        UBASE_RETURN(upipe_fsink_set_path(upipe_multicat_sink->fsink, filepath, upipe_multicat_sink->mode))
     }
-    snprintf(filepath, MAXPATHLEN, "%s%"PRId64"%s", upipe_multicat_sink->dirpath, idx, upipe_multicat_sink->suffix);
-    if (!ubase_check(upipe_fsink_set_path(upipe_multicat_sink->fsink, filepath, upipe_multicat_sink->mode)))
-        return false;
     if (upipe_multicat_sink->sync_period)
         upipe_fsink_set_sync_period(upipe_multicat_sink->fsink,
                                     upipe_multicat_sink->sync_period);
+
+    if (upipe_multicat_sink->segment_size)
+        upipe_multicat_sink->last_segment_size =
+            upipe_multicat_sink->segment_size;
+    upipe_multicat_sink->segment_size = 0;
+    upipe_multicat_sink_prepare_file(upipe, idx + 1);
+    return UBASE_ERR_NONE;
+}
+
+/** @hidden */
+static void upipe_multicat_sink_input(struct upipe *upipe, struct uref *uref,
+                                      struct upump **upump_p);
+
+/** @internal @This holds a uref until the pending segment is opened.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure
+ */
+static void upipe_multicat_sink_hold(struct upipe *upipe, struct uref *uref)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    ulist_add(&upipe_multicat_sink->held, uref_to_uchain(uref));
+    upipe_multicat_sink->nb_held++;
+}
+
+/** @internal @This completes the change to the segment being opened by the
+ * helper thread, and writes the held urefs.
+ *
+ * @param upipe description structure of the pipe
+ * @param wait true to wait for the helper thread
+ * @return false if the segment is still being opened
+ */
+static bool upipe_multicat_sink_complete_change(struct upipe *upipe,
+                                                bool wait)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    int64_t idx = upipe_multicat_sink->pending_idx;
+    int err = _upipe_multicat_sink_change_file(upipe, idx, wait);
+    if (err == UBASE_ERR_BUSY)
+        return false;
+
+    upipe_multicat_sink->pending_idx = -1;
+    if (ubase_check(err))
+        upipe_multicat_sink->fileidx = idx;
+    else
+        upipe_warn(upipe, "couldn't change file path");
+
+    /* held urefs may belong to later segments, or be dropped if the file
+     * could not be opened, so they go through the input again */
+    struct uchain held;
+    ulist_init(&held);
+    struct uchain *uchain;
+    while ((uchain = ulist_pop(&upipe_multicat_sink->held)) != NULL)
+        ulist_add(&held, uchain);
+    upipe_multicat_sink->nb_held = 0;
+    while ((uchain = ulist_pop(&held)) != NULL)
+        upipe_multicat_sink_input(upipe, uref_from_uchain(uchain), NULL);
     return true;
 }
 
+/** @internal @This waits for the segment being opened by the helper thread,
+ * if any, and writes the held urefs.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_multicat_sink_flush_held(struct upipe *upipe)
+{
+    struct upipe_multicat_sink *upipe_multicat_sink =
+        upipe_multicat_sink_from_upipe(upipe);
+    while (upipe_multicat_sink->pending_idx != -1)
+        upipe_multicat_sink_complete_change(upipe, true);
+}
+
 /** @internal @This handles data.
  *
  * @param upipe description structure of the pipe
@@ -133,10 +574,28 @@ static void upipe_multicat_sink_input(struct upipe *upipe, struct uref *uref,
         uref_free(uref);
         return;
     }
+
+    if (unlikely(upipe_multicat_sink->pending_idx != -1)) {
+        /* the helper thread is still opening the segment */
+        bool wait = upipe_multicat_sink->nb_held >= MAX_HELD;
+        if (unlikely(wait))
+            upipe_warn(upipe, "helper thread late, waiting");
+        if (!upipe_multicat_sink_complete_change(upipe, wait)) {
+            upipe_multicat_sink_hold(upipe, uref);
+            return;
+        }
+    }
+
     newidx = (systime - upipe_multicat_sink->rotate_offset) /
              upipe_multicat_sink->rotate;
     if (upipe_multicat_sink->fileidx != newidx) {
-        if (unlikely(! _upipe_multicat_sink_change_file(upipe, newidx))) {
+        int err = _upipe_multicat_sink_change_file(upipe, newidx, false);
+        if (err == UBASE_ERR_BUSY) {
+            upipe_multicat_sink->pending_idx = newidx;
+            upipe_multicat_sink_hold(upipe, uref);
+            return;
+        }
+        if (unlikely(!ubase_check(err))) {
             upipe_warn(upipe, "couldn't change file path");
             uref_free(uref);
             return;
@@ -144,6 +603,9 @@ static void upipe_multicat_sink_input(struct upipe *upipe, struct uref *uref,
         upipe_multicat_sink->fileidx = newidx;
     }
 
+    size_t size;
+    if (ubase_check(uref_block_size(uref, &size)))
+        upipe_multicat_sink->segment_size += size;
     upipe_input(upipe_multicat_sink->fsink, uref, upump_p);
 }
 
@@ -218,9 +680,11 @@ static int _upipe_multicat_sink_set_path(struct upipe *upipe, const char *path,
         UBASE_RETURN(_upipe_multicat_sink_output_alloc(upipe));
     }
 
+    upipe_multicat_sink_flush_held(upipe);
     free(upipe_multicat_sink->dirpath);
     free(upipe_multicat_sink->suffix);
     upipe_multicat_sink->fileidx = -1;
+    upipe_multicat_sink_helper_stop(upipe);
 
     if (unlikely(!path || !suffix)) {
         upipe_notice(upipe, "setting NULL fsink path");
@@ -430,6 +894,14 @@ static struct upipe *upipe_multicat_sink_alloc(struct upipe_mgr *mgr,
     upipe_multicat_sink->rotate_offset = UPIPE_MULTICAT_SINK_DEF_ROTATE_OFFSET;
     upipe_multicat_sink->mode = UPIPE_FSINK_APPEND;
     upipe_multicat_sink->sync_period = 0;
+    upipe_multicat_sink->pending_idx = -1;
+    ulist_init(&upipe_multicat_sink->held);
+    upipe_multicat_sink->nb_held = 0;
+    upipe_multicat_sink->segment_size = 0;
+    upipe_multicat_sink->last_segment_size = 0;
+    upipe_multicat_sink->helper.started = false;
+    pthread_mutex_init(&upipe_multicat_sink->helper.mutex, NULL);
+    pthread_cond_init(&upipe_multicat_sink->helper.cond, NULL);
     upipe_multicat_sink->flow_def = NULL;
     upipe_throw_ready(upipe);
     return upipe;
@@ -442,10 +914,14 @@ static struct upipe *upipe_multicat_sink_alloc(struct upipe_mgr *mgr,
 static void upipe_multicat_sink_free(struct upipe *upipe)
 {
     struct upipe_multicat_sink *upipe_multicat_sink = upipe_multicat_sink_from_upipe(upipe);
+    upipe_multicat_sink_flush_held(upipe);
     if (upipe_multicat_sink->flow_def != NULL)
         uref_free(upipe_multicat_sink->flow_def);
     if (upipe_multicat_sink->fsink != NULL)
         upipe_release(upipe_multicat_sink->fsink);
+    upipe_multicat_sink_helper_stop(upipe);
+    pthread_cond_destroy(&upipe_multicat_sink->helper.cond);
+    pthread_mutex_destroy(&upipe_multicat_sink->helper.mutex);
 
     upipe_dbg_va(upipe, "releasing pipe %p", upipe);
     upipe_throw_dead(upipe);
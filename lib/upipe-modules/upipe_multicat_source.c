@@ -26,12 +26,23 @@
 
 /** @file
  * @short Upipe module - multicat file source
+ *
+ * Segments are read in windows of @ref READAHEAD_SIZE octets into buffers
+ * of the ubuf manager. With the msrc.mmap flow definition attribute, they
+ * are mapped instead and the output blocks reference the mapped pages
+ * directly. This is only safe on archives which are never truncated: when a
+ * multicat sink wraps its ring in overwrite mode, it truncates the files,
+ * and accessing a page past the new end of file raises SIGBUS, in this pipe
+ * or in any pipe still holding a block. Cached segments are checked when
+ * they are reused, and dropped if the file was replaced or shrank.
  */
 
 #include "upipe/ubase.h"
 #include "upipe/uref_clock.h"
 #include "upipe/uref.h"
 #include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+#include "upipe/ubuf_block_mmap.h"
 #include "upipe/uref_block.h"
 #include "upipe/uref_block_flow.h"
 #include "upipe/uref_flow.h"
@@ -53,10 +64,9 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/mman.h>
-#include <errno.h>
 #include <assert.h>
 
 #ifndef O_CLOEXEC
@@ -67,6 +77,46 @@
 #define UBUF_DEFAULT_SIZE       1316
 /** mux number of missing segments */
 #define MISSING_SEGMENTS        5
+/** number of segments kept mapped for subsequent seeks */
+#define CACHED_SEGMENTS         4
+/** size of the data read ahead of the current position, and of the windows
+ * read at once when the files are not mapped */
+#define READAHEAD_SIZE          (1024 * 1024)
+/** number of timestamps read at once when the files are not mapped */
+#define AUX_WINDOW              8192
+/** depth of the pool of mapped ubufs */
+#define UBUF_POOL_DEPTH         64
+
+/** @internal @This is a mapped segment, with its timestamp index. */
+struct upipe_msrc_segment {
+    /** structure for double-linked lists */
+    struct uchain uchain;
+
+    /** file index */
+    uint64_t fileidx;
+    /** device of the data file */
+    dev_t dev;
+    /** inode of the data file */
+    ino_t ino;
+    /** window of the data file */
+    struct ubuf *data;
+    /** offset of the window in the data file */
+    uint64_t data_offset;
+    /** size of the window */
+    uint64_t data_size;
+    /** window of the aux file */
+    struct ubuf *aux;
+    /** timestamps from the aux file, in network endianness */
+    const uint8_t *aux_buf;
+    /** index of the first packet of the aux window */
+    uint64_t aux_first;
+    /** number of packets in the aux window */
+    uint64_t aux_count;
+    /** number of packets in the aux file */
+    uint64_t packets;
+};
+
+UBASE_FROM_TO(upipe_msrc_segment, uchain, uchain, uchain)
 
 /** @internal @This is the private context of a multicat source pipe. */
 struct upipe_msrc {
@@ -103,11 +153,21 @@ struct upipe_msrc {
 
     /** input flow def */
     struct uref *flow_def_input;
-
-    /** data file descriptor */
-    int fd;
-    /** aux file pointer */
-    FILE *aux_file;
+    /** true if the files are mapped instead of read */
+    bool mmap;
+
+    /** manager of mapped ubufs */
+    struct ubuf_mgr *mmap_mgr;
+    /** list of mapped segments, most recently used first */
+    struct uchain segments;
+    /** number of mapped segments */
+    unsigned int nb_segments;
+    /** current segment */
+    struct upipe_msrc_segment *segment;
+    /** index of the next packet in the current segment */
+    uint64_t packet;
+    /** offset in the data file up to which read ahead was requested */
+    uint64_t readahead;
     /** file index */
     uint64_t fileidx;
     /** current position */
@@ -175,6 +235,12 @@ static struct upipe *upipe_msrc_alloc(struct upipe_mgr *mgr,
         return NULL;
 
     struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    upipe_msrc->mmap_mgr = ubuf_block_mmap_mgr_alloc(UBUF_POOL_DEPTH);
+    if (unlikely(upipe_msrc->mmap_mgr == NULL)) {
+        upipe_msrc_free_void(upipe);
+        return NULL;
+    }
+
     upipe_msrc_init_urefcount(upipe);
     upipe_msrc_init_uref_mgr(upipe);
     upipe_msrc_init_ubuf_mgr(upipe);
@@ -183,8 +249,12 @@ static struct upipe *upipe_msrc_alloc(struct upipe_mgr *mgr,
     upipe_msrc_init_upump(upipe);
     upipe_msrc_init_output_size(upipe, UBUF_DEFAULT_SIZE);
     upipe_msrc->flow_def_input = NULL;
-    upipe_msrc->fd = -1;
-    upipe_msrc->aux_file = NULL;
+    upipe_msrc->mmap = false;
+    ulist_init(&upipe_msrc->segments);
+    upipe_msrc->nb_segments = 0;
+    upipe_msrc->segment = NULL;
+    upipe_msrc->packet = 0;
+    upipe_msrc->readahead = 0;
     upipe_msrc->fileidx = -1;
     upipe_msrc->pos = UINT64_MAX;
     upipe_msrc->missing = 0;
@@ -192,6 +262,352 @@ static struct upipe *upipe_msrc_alloc(struct upipe_mgr *mgr,
     return upipe;
 }
 
+/** @internal @This unmaps a segment.
+ *
+ * @param segment mapped segment
+ */
+static void upipe_msrc_segment_free(struct upipe_msrc_segment *segment)
+{
+    if (segment->aux != NULL)
+        ubuf_block_unmap(segment->aux, 0);
+    ubuf_free(segment->aux);
+    ubuf_free(segment->data);
+    free(segment);
+}
+
+/** @internal @This unmaps all cached segments.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_msrc_flush_segments(struct upipe *upipe)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    struct uchain *uchain, *uchain_tmp;
+    ulist_delete_foreach(&upipe_msrc->segments, uchain, uchain_tmp) {
+        ulist_delete(uchain);
+        upipe_msrc_segment_free(upipe_msrc_segment_from_uchain(uchain));
+    }
+    upipe_msrc->nb_segments = 0;
+    upipe_msrc->segment = NULL;
+}
+
+/** @internal @This builds the path of a file of a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param fileidx file index of the segment
+ * @param suffix suffix of the file
+ * @return allocated path, or NULL in case of error
+ */
+static char *upipe_msrc_path(struct upipe *upipe, uint64_t fileidx,
+                             const char *suffix)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    const char *path;
+    if (unlikely(!ubase_check(uref_msrc_flow_get_path(
+                        upipe_msrc->flow_def_input, &path))))
+        return NULL;
+
+    char *file = malloc(strlen(path) + strlen(suffix) +
+                        sizeof("18446744073709551615"));
+    if (unlikely(file == NULL))
+        return NULL;
+    sprintf(file, "%s%"PRIu64"%s", path, fileidx, suffix);
+    return file;
+}
+
+/** @internal @This reads a window of a file into a buffer of the ubuf
+ * manager.
+ *
+ * @param upipe description structure of the pipe
+ * @param fd file descriptor
+ * @param offset offset of the window in the file
+ * @param size size of the window, already truncated to the end of the file
+ * @return pointer to the ubuf, or NULL in case of error
+ */
+static struct ubuf *upipe_msrc_read(struct upipe *upipe, int fd,
+                                    uint64_t offset, uint64_t size)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    struct ubuf *ubuf = ubuf_block_alloc(upipe_msrc->ubuf_mgr, size);
+    if (unlikely(ubuf == NULL))
+        return NULL;
+
+    int write_size = -1;
+    uint8_t *buf;
+    if (unlikely(!ubase_check(ubuf_block_write(ubuf, 0, &write_size, &buf)))) {
+        ubuf_free(ubuf);
+        return NULL;
+    }
+
+    uint64_t done = 0;
+    while (done < (uint64_t)write_size) {
+        ssize_t ret = pread(fd, buf + done, write_size - done, offset + done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            /* the file may have been truncated in the meantime */
+            break;
+        done += ret;
+    }
+    ubuf_block_unmap(ubuf, 0);
+
+    if (unlikely(!done)) {
+        ubuf_free(ubuf);
+        return NULL;
+    }
+    if (done < size)
+        ubuf_block_resize(ubuf, 0, done);
+    return ubuf;
+}
+
+/** @internal @This maps or reads a window of a file of a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param fileidx file index of the segment
+ * @param suffix suffix of the file
+ * @param offset offset of the window in the file
+ * @param size maximum size of the window
+ * @param st filled in with the status of the file, or with a null size if
+ * it could not be opened
+ * @return pointer to the ubuf, or NULL in case of error
+ */
+static struct ubuf *upipe_msrc_map(struct upipe *upipe, uint64_t fileidx,
+                                   const char *suffix, uint64_t offset,
+                                   uint64_t size, struct stat *st)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    memset(st, 0, sizeof(*st));
+    char *file = upipe_msrc_path(upipe, fileidx, suffix);
+    if (unlikely(file == NULL))
+        return NULL;
+
+    upipe_dbg_va(upipe, "opening %s at %"PRIu64, file, offset);
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    free(file);
+    if (unlikely(fd == -1))
+        return NULL;
+    if (unlikely(fstat(fd, st) == -1)) {
+        memset(st, 0, sizeof(*st));
+        close(fd);
+        return NULL;
+    }
+
+    struct ubuf *ubuf = NULL;
+    if (upipe_msrc->mmap)
+        ubuf = ubuf_block_mmap_alloc_range(upipe_msrc->mmap_mgr, fd,
+                                           offset, size);
+    else if (offset < (uint64_t)st->st_size) {
+        if (size > (uint64_t)st->st_size - offset)
+            size = (uint64_t)st->st_size - offset;
+        ubuf = upipe_msrc_read(upipe, fd, offset, size);
+    }
+    close(fd);
+    return ubuf;
+}
+
+/** @internal @This maps or reads a window of the aux file of a segment,
+ * starting at the given packet. The number of packets of the segment is
+ * updated even if the window is empty.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment
+ * @param packet index of the first packet of the window
+ * @return false if the window could not be mapped
+ */
+static bool upipe_msrc_map_aux(struct upipe *upipe,
+                               struct upipe_msrc_segment *segment,
+                               uint64_t packet)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    const char *aux;
+    if (unlikely(!ubase_check(uref_msrc_flow_get_aux(
+                        upipe_msrc->flow_def_input, &aux))))
+        return false;
+
+    struct stat st;
+    struct ubuf *ubuf = upipe_msrc_map(upipe, segment->fileidx, aux,
+            packet * sizeof(uint64_t),
+            upipe_msrc->mmap ? UINT64_MAX : AUX_WINDOW * sizeof(uint64_t),
+            &st);
+    segment->packets = st.st_size / sizeof(uint64_t);
+    int size = -1;
+    const uint8_t *aux_buf;
+    if (unlikely(ubuf == NULL ||
+                 !ubase_check(ubuf_block_read(ubuf, 0, &size, &aux_buf)))) {
+        ubuf_free(ubuf);
+        return false;
+    }
+
+    if (segment->aux != NULL) {
+        ubuf_block_unmap(segment->aux, 0);
+        ubuf_free(segment->aux);
+    }
+    segment->aux = ubuf;
+    segment->aux_buf = aux_buf;
+    segment->aux_first = packet;
+    segment->aux_count = size / sizeof(uint64_t);
+    return true;
+}
+
+/** @internal @This returns the timestamp of a packet of a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment
+ * @param packet index of the packet
+ * @param cr_sys_p filled in with the timestamp
+ * @return false if the timestamp could not be read
+ */
+static bool upipe_msrc_get_aux(struct upipe *upipe,
+                               struct upipe_msrc_segment *segment,
+                               uint64_t packet, uint64_t *cr_sys_p)
+{
+    if ((segment->aux == NULL || packet < segment->aux_first ||
+         packet >= segment->aux_first + segment->aux_count) &&
+        !upipe_msrc_map_aux(upipe, segment, packet))
+        return false;
+    if (unlikely(packet >= segment->aux_first + segment->aux_count))
+        return false;
+    *cr_sys_p = upipe_msrc_ntoh64(segment->aux_buf +
+            (packet - segment->aux_first) * sizeof(uint64_t));
+    return true;
+}
+
+/** @internal @This maps or reads a window of the data file of a segment.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment
+ * @param offset offset of the window in the data file
+ * @return false if the data file could not be mapped
+ */
+static bool upipe_msrc_map_data(struct upipe *upipe,
+                                struct upipe_msrc_segment *segment,
+                                uint64_t offset)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    const char *data;
+    if (unlikely(!ubase_check(uref_msrc_flow_get_data(
+                        upipe_msrc->flow_def_input, &data))))
+        return false;
+
+    uint64_t window = UINT64_MAX;
+    if (!upipe_msrc->mmap)
+        window = upipe_msrc->output_size > READAHEAD_SIZE ?
+                 upipe_msrc->output_size : READAHEAD_SIZE;
+    struct stat st;
+    struct ubuf *ubuf = upipe_msrc_map(upipe, segment->fileidx, data, offset,
+                                       window, &st);
+    size_t size;
+    if (unlikely(ubuf == NULL || !ubase_check(ubuf_block_size(ubuf, &size)))) {
+        ubuf_free(ubuf);
+        return false;
+    }
+
+    ubuf_free(segment->data);
+    segment->data = ubuf;
+    segment->data_offset = offset;
+    segment->data_size = size;
+    segment->dev = st.st_dev;
+    segment->ino = st.st_ino;
+    return true;
+}
+
+/** @internal @This checks that the data file of a cached segment was
+ * neither replaced nor truncated since it was mapped.
+ *
+ * @param upipe description structure of the pipe
+ * @param segment segment
+ * @return false if the segment must be dropped
+ */
+static bool upipe_msrc_check_segment(struct upipe *upipe,
+                                     struct upipe_msrc_segment *segment)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    const char *data;
+    if (unlikely(!ubase_check(uref_msrc_flow_get_data(
+                        upipe_msrc->flow_def_input, &data))))
+        return false;
+    char *file = upipe_msrc_path(upipe, segment->fileidx, data);
+    if (unlikely(file == NULL))
+        return false;
+
+    struct stat st;
+    int ret = stat(file, &st);
+    free(file);
+    return ret != -1 && st.st_dev == segment->dev &&
+           st.st_ino == segment->ino &&
+           (uint64_t)st.st_size >= segment->data_offset + segment->data_size;
+}
+
+/** @internal @This returns the segment of the current file index, from the
+ * cache or by mapping its files.
+ *
+ * @param upipe description structure of the pipe
+ * @return pointer to the segment, or NULL if it could not be mapped
+ */
+static struct upipe_msrc_segment *upipe_msrc_get_segment(struct upipe *upipe)
+{
+    struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    struct uchain *uchain;
+    ulist_foreach(&upipe_msrc->segments, uchain) {
+        struct upipe_msrc_segment *segment =
+            upipe_msrc_segment_from_uchain(uchain);
+        if (segment->fileidx != upipe_msrc->fileidx)
+            continue;
+
+        ulist_delete(uchain);
+        if (likely(upipe_msrc_check_segment(upipe, segment))) {
+            ulist_unshift(&upipe_msrc->segments, uchain);
+            return segment;
+        }
+        upipe_dbg_va(upipe, "segment %"PRIu64" changed on disk",
+                     segment->fileidx);
+        if (segment == upipe_msrc->segment)
+            upipe_msrc->segment = NULL;
+        upipe_msrc_segment_free(segment);
+        upipe_msrc->nb_segments--;
+        break;
+    }
+
+    struct upipe_msrc_segment *segment =
+        malloc(sizeof(struct upipe_msrc_segment));
+    if (unlikely(segment == NULL))
+        return NULL;
+    segment->fileidx = upipe_msrc->fileidx;
+    segment->data = NULL;
+    segment->aux = NULL;
+    segment->aux_first = segment->aux_count = 0;
+
+    if (unlikely(!upipe_msrc_map_data(upipe, segment, 0))) {
+        upipe_warn_va(upipe, "segment %"PRIu64" not found (data)",
+                      upipe_msrc->fileidx);
+        free(segment);
+        return NULL;
+    }
+
+    if (unlikely(!upipe_msrc_map_aux(upipe, segment, 0))) {
+        upipe_warn_va(upipe, "segment %"PRIu64" not found (aux)",
+                      upipe_msrc->fileidx);
+        ubuf_free(segment->data);
+        free(segment);
+        return NULL;
+    }
+
+    uchain_init(&segment->uchain);
+    ulist_unshift(&upipe_msrc->segments, &segment->uchain);
+    if (++upipe_msrc->nb_segments > CACHED_SEGMENTS) {
+        struct uchain *last = ulist_peek_last(&upipe_msrc->segments);
+        ulist_delete(last);
+        struct upipe_msrc_segment *evicted =
+            upipe_msrc_segment_from_uchain(last);
+        if (evicted == upipe_msrc->segment)
+            upipe_msrc->segment = NULL;
+        upipe_msrc_segment_free(evicted);
+        upipe_msrc->nb_segments--;
+    }
+    return segment;
+}
+
 /** @internal @This skips the current segment in case of error.
  *
  * @param upipe description structure of the pipe
@@ -214,43 +630,13 @@ static int upipe_msrc_skip(struct upipe *upipe)
 static int upipe_msrc_setup(struct upipe *upipe)
 {
     struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
-    const char *path, *data, *aux;
-    UBASE_RETURN(uref_msrc_flow_get_path(upipe_msrc->flow_def_input, &path))
-    UBASE_RETURN(uref_msrc_flow_get_data(upipe_msrc->flow_def_input, &data))
-    UBASE_RETURN(uref_msrc_flow_get_aux(upipe_msrc->flow_def_input, &aux))
-
-    if (upipe_msrc->fd != -1)
-        ubase_clean_fd(&upipe_msrc->fd);
-    if (upipe_msrc->aux_file != NULL) {
-        fclose(upipe_msrc->aux_file);
-        upipe_msrc->aux_file = NULL;
-    }
-
-    char data_file[strlen(path) + strlen(data) +
-                   sizeof("18446744073709551615")];
-    sprintf(data_file, "%s%"PRIu64"%s", path, upipe_msrc->fileidx, data);
-
-    upipe_dbg_va(upipe, "opening %s", data_file);
-
-    upipe_msrc->fd = open(data_file, O_RDONLY);
-    if (unlikely(upipe_msrc->fd == -1)) {
-        upipe_warn_va(upipe, "segment %"PRIu64" not found (data)",
-                      upipe_msrc->fileidx);
+    upipe_msrc->segment = upipe_msrc_get_segment(upipe);
+    if (unlikely(upipe_msrc->segment == NULL))
         /* try next file anyway */
         return upipe_msrc_skip(upipe);
-    }
 
-    char aux_file[strlen(path) + strlen(aux) +
-                  sizeof("18446744073709551615")];
-    sprintf(aux_file, "%s%"PRIu64"%s", path, upipe_msrc->fileidx, aux);
-
-    upipe_msrc->aux_file = fopen(aux_file, "rb");
-    if (unlikely(upipe_msrc->aux_file == NULL)) {
-        upipe_warn_va(upipe, "segment %"PRIu64" not found (aux)",
-                      upipe_msrc->fileidx);
-        /* try next file anyway */
-        return upipe_msrc_skip(upipe);
-    }
+    upipe_msrc->packet = 0;
+    upipe_msrc->readahead = 0;
     return UBASE_ERR_NONE;
 }
 
@@ -262,73 +648,39 @@ static int upipe_msrc_setup(struct upipe *upipe)
 static int upipe_msrc_start(struct upipe *upipe)
 {
     struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
-    const char *path, *data, *aux;
     uint64_t rotate = UPIPE_MSRC_DEF_ROTATE;
     uint64_t offset = UPIPE_MSRC_DEF_OFFSET;
-    UBASE_RETURN(uref_msrc_flow_get_path(upipe_msrc->flow_def_input, &path))
-    UBASE_RETURN(uref_msrc_flow_get_data(upipe_msrc->flow_def_input, &data))
-    UBASE_RETURN(uref_msrc_flow_get_aux(upipe_msrc->flow_def_input, &aux))
     uref_msrc_flow_get_rotate(upipe_msrc->flow_def_input, &rotate);
     uref_msrc_flow_get_offset(upipe_msrc->flow_def_input, &offset);
     upipe_msrc->fileidx = (upipe_msrc->pos - offset) / rotate;
 
-    char aux_file[strlen(path) + strlen(aux) +
-                  sizeof(".18446744073709551615")];
-    sprintf(aux_file, "%s%"PRIu64"%s", path, upipe_msrc->fileidx, aux);
-
-    int fd = open(aux_file, O_RDONLY);
-    if (unlikely(fd == -1)) {
-        upipe_warn_va(upipe, "segment %"PRIu64" not found (start)",
-                      upipe_msrc->fileidx);
-        /* try next file anyway */
-        return upipe_msrc_skip(upipe);
-    }
-
-    struct stat aux_stat;
-    if (unlikely(fstat(fd, &aux_stat) == -1 ||
-                 aux_stat.st_size < sizeof(uint64_t))) {
-        upipe_warn_va(upipe, "invalid segment %"PRIu64, upipe_msrc->fileidx);
-        /* try next file anyway */
-        return upipe_msrc_skip(upipe);
-    }
-
-    uint8_t *aux_buf = mmap(NULL, aux_stat.st_size, PROT_READ, MAP_SHARED,
-                            fd, 0);
-    if (unlikely(aux_buf == MAP_FAILED)) {
-        upipe_err_va(upipe,
-                     "unable to mmap segment %"PRIu64, upipe_msrc->fileidx);
-        return UBASE_ERR_EXTERNAL;
-    }
+    UBASE_RETURN(upipe_msrc_setup(upipe))
+    struct upipe_msrc_segment *segment = upipe_msrc->segment;
+    if (segment->fileidx != (upipe_msrc->pos - offset) / rotate)
+        /* the segment was missing, start from the next one */
+        return UBASE_ERR_NONE;
 
     uint64_t offset1 = 0;
-    uint64_t offset2 = aux_stat.st_size / sizeof(uint64_t);
+    uint64_t offset2 = segment->packets;
 
     for ( ; ; ) {
         uint64_t mid_offset = (offset1 + offset2) / 2;
-        uint64_t mid_aux = upipe_msrc_ntoh64(aux_buf +
-                                             mid_offset * sizeof(uint64_t));
-
         if (offset1 == mid_offset)
             break;
 
+        uint64_t mid_aux;
+        if (unlikely(!upipe_msrc_get_aux(upipe, segment, mid_offset,
+                                         &mid_aux)))
+            return upipe_msrc_skip(upipe);
+
         if (mid_aux >= upipe_msrc->pos)
             offset2 = mid_offset;
         else
             offset1 = mid_offset;
     }
 
-    munmap(aux_buf, aux_stat.st_size);
-    close(fd);
-
-    UBASE_RETURN(upipe_msrc_setup(upipe))
-    if (unlikely(lseek(upipe_msrc->fd, (off_t)upipe_msrc->output_size * offset1,
-                       SEEK_SET) == -1 ||
-                 fseeko(upipe_msrc->aux_file, 8 * offset1, SEEK_SET) == -1)) {
-        upipe_warn_va(upipe, "invalid segment %"PRIu64, upipe_msrc->fileidx);
-        /* try next file anyway */
-        return upipe_msrc_skip(upipe);
-    }
-
+    upipe_msrc->packet = offset1;
+    upipe_msrc->readahead = (uint64_t)upipe_msrc->output_size * offset1;
     return UBASE_ERR_NONE;
 }
 
@@ -340,54 +692,62 @@ static int upipe_msrc_start(struct upipe *upipe)
 static int upipe_msrc_handle(struct upipe *upipe)
 {
     struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
-    uint8_t aux[8];
-    if (fread(aux, 8, 1, upipe_msrc->aux_file) != 1)
+    struct upipe_msrc_segment *segment = upipe_msrc->segment;
+    if (segment == NULL)
         return upipe_msrc_skip(upipe);
-    uint64_t cr_sys = upipe_msrc_ntoh64(aux);
-
-    struct uref *uref = uref_block_alloc(upipe_msrc->uref_mgr,
-                                         upipe_msrc->ubuf_mgr,
-                                         upipe_msrc->output_size);
-    if (unlikely(uref == NULL)) {
-        return UBASE_ERR_ALLOC;
-    }
 
-    uint8_t *buffer;
-    int output_size = -1;
-    if (unlikely(!ubase_check(uref_block_write(uref, 0, &output_size,
-                                               &buffer)))) {
-        uref_free(uref);
-        return UBASE_ERR_ALLOC;
+    /* the files may still be growing, so the sizes are refreshed when the
+     * end of the mapping is reached */
+    uint64_t offset = (uint64_t)upipe_msrc->output_size * upipe_msrc->packet;
+    if (upipe_msrc->packet >= segment->packets)
+        upipe_msrc_map_aux(upipe, segment, upipe_msrc->packet);
+    if (upipe_msrc->packet >= segment->packets)
+        return upipe_msrc_skip(upipe);
+    uint64_t cr_sys;
+    if (unlikely(!upipe_msrc_get_aux(upipe, segment, upipe_msrc->packet,
+                                     &cr_sys))) {
+        upipe_warn_va(upipe, "premature end of segment %"PRIu64" (aux)",
+                      upipe_msrc->fileidx);
+        return upipe_msrc_skip(upipe);
     }
-    assert(output_size == upipe_msrc->output_size);
-
-    ssize_t ret = read(upipe_msrc->fd, buffer, upipe_msrc->output_size);
-    uref_block_unmap(uref, 0);
-
-    if (unlikely(ret == -1)) {
-        uref_free(uref);
-        switch (errno) {
-            case EINTR:
-            case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-            case EWOULDBLOCK:
-#endif
-                /* not an issue, try again later */
-                return UBASE_ERR_NONE;
-            case EBADF:
-            case EINVAL:
-            case EIO:
-            default:
-                break;
-        }
-
+    if (offset < segment->data_offset ||
+        offset + upipe_msrc->output_size >
+            segment->data_offset + segment->data_size)
+        upipe_msrc_map_data(upipe, segment, offset);
+    if (unlikely(offset < segment->data_offset ||
+                 offset >= segment->data_offset + segment->data_size)) {
         upipe_warn_va(upipe, "premature end of segment %"PRIu64,
                       upipe_msrc->fileidx);
         return upipe_msrc_skip(upipe);
     }
-    if (unlikely(ret != upipe_msrc->output_size))
-        uref_block_resize(uref, 0, ret);
+
+    offset -= segment->data_offset;
+    uint64_t size = segment->data_size - offset;
+    if (size > upipe_msrc->output_size)
+        size = upipe_msrc->output_size;
+
+    if (upipe_msrc->readahead < segment->data_offset + offset)
+        upipe_msrc->readahead = segment->data_offset + offset;
+    if (upipe_msrc->mmap &&
+        segment->data_offset + offset + READAHEAD_SIZE / 2 >=
+            upipe_msrc->readahead) {
+        ubuf_block_mmap_prefetch(segment->data,
+                                 upipe_msrc->readahead - segment->data_offset,
+                                 READAHEAD_SIZE);
+        upipe_msrc->readahead += READAHEAD_SIZE;
+    }
+
+    struct ubuf *ubuf = ubuf_block_splice(segment->data, offset, size);
+    if (unlikely(ubuf == NULL))
+        return UBASE_ERR_ALLOC;
+    struct uref *uref = uref_alloc(upipe_msrc->uref_mgr);
+    if (unlikely(uref == NULL)) {
+        ubuf_free(ubuf);
+        return UBASE_ERR_ALLOC;
+    }
+    uref_attach_ubuf(uref, ubuf);
     uref_clock_set_cr_sys(uref, cr_sys);
+    upipe_msrc->packet++;
 
     upipe_msrc->missing = 0;
     upipe_msrc_output(upipe, uref, &upipe_msrc->upump);
@@ -447,14 +807,7 @@ static void upipe_msrc_open(struct upipe *upipe)
 static void upipe_msrc_close(struct upipe *upipe)
 {
     struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
-
-    if (upipe_msrc->fd != -1)
-        ubase_clean_fd(&upipe_msrc->fd);
-    if (upipe_msrc->aux_file != NULL) {
-        fclose(upipe_msrc->aux_file);
-        upipe_msrc->aux_file = NULL;
-    }
-
+    upipe_msrc->segment = NULL;
     upipe_msrc_set_upump(upipe, NULL);
 }
 
@@ -538,11 +891,13 @@ static int upipe_msrc_set_flow_def(struct upipe *upipe, struct uref *flow_def)
         return UBASE_ERR_INVALID;
 
     upipe_msrc_close(upipe);
+    upipe_msrc_flush_segments(upipe);
     ubuf_mgr_release(upipe_msrc->ubuf_mgr);
     upipe_msrc->ubuf_mgr = NULL;
     uref_free(upipe_msrc->flow_def_input);
     upipe_msrc->flow_def_input = uref_dup(flow_def);
     UBASE_ALLOC_RETURN(upipe_msrc->flow_def_input)
+    upipe_msrc->mmap = ubase_check(uref_msrc_flow_get_mmap(flow_def));
     return UBASE_ERR_NONE;
 }
 
@@ -659,6 +1014,8 @@ static void upipe_msrc_free(struct upipe *upipe)
     upipe_throw_dead(upipe);
 
     struct upipe_msrc *upipe_msrc = upipe_msrc_from_upipe(upipe);
+    upipe_msrc_flush_segments(upipe);
+    ubuf_mgr_release(upipe_msrc->mmap_mgr);
     uref_free(upipe_msrc->flow_def_input);
     upipe_msrc_clean_output_size(upipe);
     upipe_msrc_clean_upump(upipe);
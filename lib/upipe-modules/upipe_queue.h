@@ -32,7 +32,10 @@
 #define _UPIPE_QUEUE_H_
 
 #include "upipe/ubase.h"
+#include "upipe/uatomic.h"
 #include "upipe/uqueue.h"
+#include "upipe/uref.h"
+#include "upipe/uref_block.h"
 #include "upipe/upipe.h"
 #include "upipe-modules/upipe_queue_source.h"
 
@@ -42,6 +45,16 @@
 struct upipe_queue {
     /** max length of the queue */
     unsigned int max_length;
+    /** max number of octets in the queue, or 0 */
+    uint32_t max_octets;
+    /** number of octets in the queue */
+    uatomic_uint32_t octets;
+    /** set to 1 when a sink waits for octets to be popped */
+    uatomic_uint32_t octets_blocked;
+    /** highest length of the queue since the last reset */
+    unsigned int high_length;
+    /** highest number of octets in the queue since the last reset */
+    unsigned int high_octets;
     /** uref queue */
     struct uqueue uqueue;
     /** out of band downstream queue */
@@ -64,6 +77,83 @@ static inline struct upipe_queue *upipe_queue(struct upipe *upipe)
     return container_of(upipe, struct upipe_queue, upipe);
 }
 
+/** @internal @This returns the number of octets accounted for a uref.
+ *
+ * @param uref uref structure
+ * @return size of the block buffer, or 0
+ */
+static inline uint32_t upipe_queue_uref_octets(struct uref *uref)
+{
+    size_t size;
+    if (uref->ubuf == NULL || !ubase_check(uref_block_size(uref, &size)))
+        return 0;
+    return size > UINT32_MAX ? UINT32_MAX : size;
+}
+
+/** @internal @This pushes a uref into the queue, taking into account the
+ * maximum number of octets. A uref is always accepted by an empty queue, so
+ * that a buffer larger than the limit does not block the queue forever.
+ *
+ * @param upipe_queue pointer to upipe_queue structure
+ * @param uref uref structure
+ * @return false if the queue is full and the uref couldn't be queued
+ */
+static inline bool upipe_queue_push(struct upipe_queue *upipe_queue,
+                                    struct uref *uref)
+{
+    uint32_t size = 0;
+    if (upipe_queue->max_octets) {
+        size = upipe_queue_uref_octets(uref);
+        uint32_t octets = uatomic_load(&upipe_queue->octets);
+        if (unlikely(octets && octets + size > upipe_queue->max_octets)) {
+            /* signal that we are full */
+            ueventfd_read(&upipe_queue->uqueue.event_push);
+            uatomic_store(&upipe_queue->octets_blocked, 1);
+
+            /* double-check */
+            octets = uatomic_load(&upipe_queue->octets);
+            if (likely(octets && octets + size > upipe_queue->max_octets))
+                return false;
+
+            /* signal that we're alright again */
+            uatomic_store(&upipe_queue->octets_blocked, 0);
+            ueventfd_write(&upipe_queue->uqueue.event_push);
+        }
+        uatomic_fetch_add(&upipe_queue->octets, size);
+    }
+
+    if (unlikely(!uqueue_push(&upipe_queue->uqueue, uref_to_uchain(uref)))) {
+        if (size)
+            uatomic_fetch_sub(&upipe_queue->octets, size);
+        return false;
+    }
+    return true;
+}
+
+/** @internal @This pops a uref from the queue, and unblocks the sinks if they
+ * were waiting for octets to be released.
+ *
+ * @param upipe_queue pointer to upipe_queue structure
+ * @return pointer to uref, or NULL if the queue is empty
+ */
+static inline struct uref *upipe_queue_pop(struct upipe_queue *upipe_queue)
+{
+    struct uref *uref = uqueue_pop(&upipe_queue->uqueue, struct uref *);
+    if (uref == NULL || !upipe_queue->max_octets)
+        return uref;
+
+    uint32_t size = upipe_queue_uref_octets(uref);
+    if (!size)
+        return uref;
+
+    uatomic_fetch_sub(&upipe_queue->octets, size);
+    uint32_t blocked = 1;
+    if (unlikely(uatomic_compare_exchange(&upipe_queue->octets_blocked,
+                                          &blocked, 0)))
+        ueventfd_write(&upipe_queue->uqueue.event_push);
+    return uref;
+}
+
 /** @internal @This is a super-set of @ref urequest. */
 struct upipe_queue_request {
     /** refcount management structure */
@@ -154,8 +154,7 @@ static bool upipe_qsink_output(struct upipe *upipe, struct uref *uref,
                                struct upump **upump_p)
 {
     struct upipe_qsink *upipe_qsink = upipe_qsink_from_upipe(upipe);
-    return uqueue_push(&upipe_queue(upipe_qsink->qsrc)->uqueue,
-                       uref_to_uchain(uref));
+    return upipe_queue_push(upipe_queue(upipe_qsink->qsrc), uref);
 }
 
 /** @internal @This is called when the queue can be written again.
@@ -28,7 +28,8 @@
  *
  * Note that the allocator requires an additional parameter:
  * @table 2
- * @item queue_length @item maximum length of the queue (<= 255)
+ * @item queue_length @item maximum length of the queue
+ * (<= @ref UPIPE_QSRC_MAX_LENGTH)
  * @end table
  *
  * Also note that this module is exceptional in that upipe_release() may be
@@ -56,6 +57,8 @@
 
 /** maximum length of out of band queues */
 #define OOB_QUEUES 255
+/** default maximum number of urefs output per wake-up */
+#define DEFAULT_BUDGET 64
 
 /** @internal @This is the private context of a queue source pipe. */
 struct upipe_qsrc {
@@ -70,6 +73,8 @@ struct upipe_qsrc {
     struct upump *upump;
     /** oob watcher */
     struct upump *upump_oob;
+    /** maximum number of urefs output per wake-up */
+    unsigned int budget;
 
     /** pipe acting as output */
     struct upipe *output;
@@ -112,7 +117,7 @@ static struct upipe *_upipe_qsrc_alloc(struct upipe_mgr *mgr,
     if (signature != UPIPE_QSRC_SIGNATURE)
         goto upipe_qsrc_alloc_err;
     unsigned int length = va_arg(args, unsigned int);
-    if (!length || length > UINT8_MAX)
+    if (!length || length > UPIPE_QSRC_MAX_LENGTH)
         goto upipe_qsrc_alloc_err;
 
     struct upipe_qsrc *upipe_qsrc = malloc(sizeof(struct upipe_qsrc) +
@@ -142,6 +147,12 @@ static struct upipe *_upipe_qsrc_alloc(struct upipe_mgr *mgr,
     upipe_qsrc_init_upump(upipe);
     upipe_qsrc_init_upump_oob(upipe);
     upipe_qsrc->upipe_queue.max_length = length;
+    upipe_qsrc->upipe_queue.max_octets = 0;
+    uatomic_init(&upipe_qsrc->upipe_queue.octets, 0);
+    uatomic_init(&upipe_qsrc->upipe_queue.octets_blocked, 0);
+    upipe_qsrc->upipe_queue.high_length = 0;
+    upipe_qsrc->upipe_queue.high_octets = 0;
+    upipe_qsrc->budget = DEFAULT_BUDGET;
     upipe_throw_ready(upipe);
 
     return upipe;
@@ -169,7 +180,9 @@ static void upipe_qsrc_input(struct upipe *upipe, struct uref *uref,
     upipe_qsrc_output(upipe, uref, upump_p);
 }
 
-/** @internal @This reads data from the queue and outputs it.
+/** @internal @This reads data from the queue and outputs it. Up to
+ * budget urefs are output per wake-up, so that the cost of the event loop
+ * iteration is amortized over a batch of urefs.
  *
  * @param upump description structure of the read watcher
  */
@@ -177,9 +190,25 @@ static void upipe_qsrc_worker(struct upump *upump)
 {
     struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
     struct upipe_qsrc *upipe_qsrc = upipe_qsrc_from_upipe(upipe);
-    struct uref *uref = uqueue_pop(&upipe_queue(upipe)->uqueue, struct uref *);
-    if (likely(uref != NULL))
+    struct upipe_queue *queue = upipe_queue(upipe);
+    unsigned int length = uqueue_length(&queue->uqueue);
+    upipe_stats_queue(upipe, length);
+    if (unlikely(length > queue->high_length &&
+                 length <= queue->max_length))
+        queue->high_length = length;
+    unsigned int octets = uatomic_load(&queue->octets);
+    if (unlikely(octets > queue->high_octets))
+        queue->high_octets = octets;
+
+    for (unsigned int i = 0; i < upipe_qsrc->budget; i++) {
+        struct uref *uref = upipe_queue_pop(queue);
+        if (uref == NULL)
+            break;
         upipe_qsrc_input(upipe, uref, &upipe_qsrc->upump);
+        /* the pump may have been released by the output */
+        if (unlikely(upipe_qsrc->upump != upump))
+            break;
+    }
 }
 
 /** @internal @This handles the result of a request.
@@ -270,8 +299,7 @@ static int upipe_qsrc_unregister_request(struct upipe *upipe,
 static void upipe_qsrc_source_end(struct upipe *upipe)
 {
     struct uref *uref;
-    while ((uref = uqueue_pop(&upipe_queue(upipe)->uqueue,
-                              struct uref *)) != NULL)
+    while ((uref = upipe_queue_pop(upipe_queue(upipe))) != NULL)
         upipe_qsrc_input(upipe, uref, NULL);
 
     upipe_throw_source_end(upipe);
@@ -285,8 +313,7 @@ static void upipe_qsrc_source_end(struct upipe *upipe)
 static void upipe_qsrc_free(struct upipe *upipe)
 {
     struct uref *uref;
-    while ((uref = uqueue_pop(&upipe_queue(upipe)->uqueue,
-                              struct uref *)) != NULL)
+    while ((uref = upipe_queue_pop(upipe_queue(upipe))) != NULL)
         upipe_qsrc_input(upipe, uref, NULL);
 
     upipe_dbg_va(upipe, "freeing queue %p", upipe);
@@ -383,6 +410,71 @@ static int _upipe_qsrc_get_length(struct upipe *upipe, unsigned int *length_p)
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets the maximum number of octets in the queue. This must
+ * be called before any sink is allocated.
+ *
+ * @param upipe description structure of the pipe
+ * @param max_octets maximum number of octets, or 0 to disable the limit
+ * @return an error code
+ */
+static int _upipe_qsrc_set_max_octets(struct upipe *upipe,
+                                      unsigned int max_octets)
+{
+    struct upipe_queue *queue = upipe_queue(upipe);
+    if (unlikely(uqueue_length(&queue->uqueue)))
+        return UBASE_ERR_BUSY;
+    queue->max_octets = max_octets;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This sets the maximum number of urefs output per wake-up.
+ *
+ * @param upipe description structure of the pipe
+ * @param budget maximum number of urefs (> 0)
+ * @return an error code
+ */
+static int _upipe_qsrc_set_budget(struct upipe *upipe, unsigned int budget)
+{
+    struct upipe_qsrc *upipe_qsrc = upipe_qsrc_from_upipe(upipe);
+    if (unlikely(!budget))
+        return UBASE_ERR_INVALID;
+    upipe_qsrc->budget = budget;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This returns the highest length and number of octets observed
+ * in the queue since the allocation or the last reset.
+ *
+ * @param upipe description structure of the pipe
+ * @param length_p filled in with the highest length of the queue
+ * @param octets_p filled in with the highest number of octets
+ * @return an error code
+ */
+static int _upipe_qsrc_get_high_water(struct upipe *upipe,
+                                      unsigned int *length_p,
+                                      unsigned int *octets_p)
+{
+    struct upipe_queue *queue = upipe_queue(upipe);
+    if (length_p != NULL)
+        *length_p = queue->high_length;
+    if (octets_p != NULL)
+        *octets_p = queue->high_octets;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This resets the high water marks of the queue.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code
+ */
+static int _upipe_qsrc_reset_high_water(struct upipe *upipe)
+{
+    struct upipe_queue *queue = upipe_queue(upipe);
+    queue->high_length = 0;
+    queue->high_octets = 0;
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on a queue source pipe.
  *
  * @param upipe description structure of the pipe
@@ -411,6 +503,25 @@ static int _upipe_qsrc_control(struct upipe *upipe, int command, va_list args)
             unsigned int *length_p = va_arg(args, unsigned int *);
             return _upipe_qsrc_get_length(upipe, length_p);
         }
+        case UPIPE_QSRC_SET_MAX_OCTETS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_QSRC_SIGNATURE)
+            unsigned int max_octets = va_arg(args, unsigned int);
+            return _upipe_qsrc_set_max_octets(upipe, max_octets);
+        }
+        case UPIPE_QSRC_SET_BUDGET: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_QSRC_SIGNATURE)
+            unsigned int budget = va_arg(args, unsigned int);
+            return _upipe_qsrc_set_budget(upipe, budget);
+        }
+        case UPIPE_QSRC_GET_HIGH_WATER: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_QSRC_SIGNATURE)
+            unsigned int *length_p = va_arg(args, unsigned int *);
+            unsigned int *octets_p = va_arg(args, unsigned int *);
+            return _upipe_qsrc_get_high_water(upipe, length_p, octets_p);
+        }
+        case UPIPE_QSRC_RESET_HIGH_WATER:
+            UBASE_SIGNATURE_CHECK(args, UPIPE_QSRC_SIGNATURE)
+            return _upipe_qsrc_reset_high_water(upipe);
         default:
             return UBASE_ERR_UNHANDLED;
     }
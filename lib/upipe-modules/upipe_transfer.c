@@ -29,8 +29,10 @@
  */
 
 #include "upipe/ubase.h"
+#include "upipe/uatomic.h"
 #include "upipe/urefcount.h"
 #include "upipe/umutex.h"
+#include "upipe/ulist.h"
 #include "upipe/ulifo.h"
 #include "upipe/uqueue.h"
 #include "upipe/uprobe.h"
@@ -47,8 +49,12 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 #include <assert.h>
 
+/** maximum number of messages allocated at once */
+#define MSG_SLAB_SIZE 32
+
 /** @internal @This is the private context of a xfer pipe manager. */
 struct upipe_xfer_mgr {
     /** real refcount management structure */
@@ -69,6 +75,12 @@ struct upipe_xfer_mgr {
     struct uqueue uqueue;
     /** pool of @ref upipe_xfer_msg */
     struct ulifo msg_pool;
+    /** number of messages allocated at once when the pool is empty */
+    unsigned int slab_size;
+    /** number of nested batches */
+    unsigned int batch_depth;
+    /** message carrying the batch being built, or NULL */
+    struct upipe_xfer_msg *batch;
     /** extra data for the queue and pool structures */
     uint8_t extra[];
 };
@@ -88,7 +100,11 @@ enum upipe_xfer_msg_type {
     /** release pipe */
     UPIPE_XFER_RELEASE,
     /** detach from remote upump_mgr */
-    UPIPE_XFER_DETACH
+    UPIPE_XFER_DETACH,
+    /** list of messages */
+    UPIPE_XFER_BATCH,
+    /** call a function on a pipe and wait for the result */
+    UPIPE_XFER_SYNC_CALL
     /* values from @ref uprobe_xfer_event are also allowed (backwards) */
 };
 
@@ -100,6 +116,24 @@ union upipe_xfer_arg {
     struct upipe *pipe;
     /** event */
     int event;
+    /** synchronous call */
+    struct upipe_xfer_call *call;
+};
+
+/** @This describes a synchronous call, allocated by the caller. */
+struct upipe_xfer_call {
+    /** function to call in the remote event loop */
+    upipe_xfer_call_func func;
+    /** opaque passed to the function */
+    void *opaque;
+    /** return code of the function */
+    int err;
+    /** set to true when the function has returned */
+    bool done;
+    /** mutex protecting done */
+    pthread_mutex_t mutex;
+    /** condition signaled when done is set */
+    pthread_cond_t cond;
 };
 
 /** @This is the optional argument of an event. */
@@ -118,8 +152,11 @@ static int upipe_xfer_mgr_send(struct upipe_mgr *mgr, int type,
 /** @This stores a message to send.
  */
 struct upipe_xfer_msg {
-    /** structure for double-linked lists */
+    /** structure for double-linked lists, or list of messages for
+     * @ref UPIPE_XFER_BATCH */
     struct uchain uchain;
+    /** slab the message belongs to */
+    struct upipe_xfer_slab *slab;
 
     /** type of command */
     int type;
@@ -135,21 +172,25 @@ struct upipe_xfer_msg {
 
 UBASE_FROM_TO(upipe_xfer_msg, uchain, uchain, uchain)
 
-/** @This allocates and initializes a message structure.
+/** @This is a set of messages allocated at once. */
+struct upipe_xfer_slab {
+    /** number of messages of the slab which are not released */
+    uatomic_uint32_t refcount;
+    /** messages */
+    struct upipe_xfer_msg msgs[];
+};
+
+/** @This releases a message of a slab, and frees the slab if it was the
+ * last one.
  *
- * @param mgr xfer_mgr structure
- * @return pointer to upipe_xfer_msg or NULL in case of allocation error
+ * @param slab slab of the message
  */
-static struct upipe_xfer_msg *upipe_xfer_msg_alloc(struct upipe_mgr *mgr)
+static void upipe_xfer_slab_release(struct upipe_xfer_slab *slab)
 {
-    struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
-    struct upipe_xfer_msg *msg = ulifo_pop(&xfer_mgr->msg_pool,
-                                           struct upipe_xfer_msg *);
-    if (unlikely(msg == NULL))
-        msg = malloc(sizeof(struct upipe_xfer_msg));
-    if (unlikely(msg == NULL))
-        return NULL;
-    return msg;
+    if (uatomic_fetch_sub(&slab->refcount, 1) == 1) {
+        uatomic_clean(&slab->refcount);
+        free(slab);
+    }
 }
 
 /** @This frees a message structure.
@@ -162,7 +203,35 @@ static void upipe_xfer_msg_free(struct upipe_mgr *mgr,
 {
     struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
     if (unlikely(!ulifo_push(&xfer_mgr->msg_pool, msg)))
-        free(msg);
+        upipe_xfer_slab_release(msg->slab);
+}
+
+/** @This allocates and initializes a message structure. When the pool is
+ * empty, a slab of messages is allocated and the unused messages are put
+ * into the pool.
+ *
+ * @param mgr xfer_mgr structure
+ * @return pointer to upipe_xfer_msg or NULL in case of allocation error
+ */
+static struct upipe_xfer_msg *upipe_xfer_msg_alloc(struct upipe_mgr *mgr)
+{
+    struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
+    struct upipe_xfer_msg *msg = ulifo_pop(&xfer_mgr->msg_pool,
+                                           struct upipe_xfer_msg *);
+    if (likely(msg != NULL))
+        return msg;
+
+    unsigned int nb = xfer_mgr->slab_size;
+    struct upipe_xfer_slab *slab = malloc(sizeof(struct upipe_xfer_slab) +
+                                          nb * sizeof(struct upipe_xfer_msg));
+    if (unlikely(slab == NULL))
+        return NULL;
+    uatomic_init(&slab->refcount, nb);
+    for (unsigned int i = 0; i < nb; i++)
+        slab->msgs[i].slab = slab;
+    for (unsigned int i = 1; i < nb; i++)
+        upipe_xfer_msg_free(mgr, &slab->msgs[i]);
+    return &slab->msgs[0];
 }
 
 /** @internal @This is the private context of a xfer pipe. */
@@ -361,6 +430,7 @@ static void upipe_xfer_worker(struct upump *upump)
     struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
     struct upipe_xfer *upipe_xfer = upipe_xfer_from_upipe(upipe);
     struct upipe_xfer_msg *msg;
+    upipe_stats_queue(upipe, uqueue_length(&upipe_xfer->uqueue));
     while ((msg = uqueue_pop(&upipe_xfer->uqueue,
                              struct upipe_xfer_msg *)) != NULL) {
         switch (msg->type) {
@@ -390,6 +460,46 @@ static void upipe_xfer_worker(struct upump *upump)
     }
 }
 
+/** @This calls a function on the remote pipe in the remote event loop, and
+ * waits for its return code.
+ *
+ * @param upipe description structure of the pipe
+ * @param func function to call
+ * @param opaque opaque passed to the function
+ * @return the return code of the function, or an error code
+ */
+static int _upipe_xfer_call(struct upipe *upipe, upipe_xfer_call_func func,
+                            void *opaque)
+{
+    struct upipe_xfer *upipe_xfer = upipe_xfer_from_upipe(upipe);
+    struct upipe_xfer_call call;
+    call.func = func;
+    call.opaque = opaque;
+    call.err = UBASE_ERR_NONE;
+    call.done = false;
+    if (unlikely(pthread_mutex_init(&call.mutex, NULL)))
+        return UBASE_ERR_EXTERNAL;
+    if (unlikely(pthread_cond_init(&call.cond, NULL))) {
+        pthread_mutex_destroy(&call.mutex);
+        return UBASE_ERR_EXTERNAL;
+    }
+
+    union upipe_xfer_arg arg = { .call = &call };
+    int err = upipe_xfer_mgr_send(upipe->mgr, UPIPE_XFER_SYNC_CALL,
+                                  upipe_xfer->upipe_remote, arg);
+    if (ubase_check(err)) {
+        pthread_mutex_lock(&call.mutex);
+        while (!call.done)
+            pthread_cond_wait(&call.cond, &call.mutex);
+        pthread_mutex_unlock(&call.mutex);
+        err = call.err;
+    }
+
+    pthread_cond_destroy(&call.cond);
+    pthread_mutex_destroy(&call.mutex);
+    return err;
+}
+
 /** @This processes control commands.
  *
  * @param upipe description structure of the pipe
@@ -439,6 +549,12 @@ static int upipe_xfer_control(struct upipe *upipe, int command, va_list args)
                                        upipe_xfer->upipe_remote, arg);
         }
 
+        case UPIPE_XFER_CALL: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_XFER_SIGNATURE)
+            upipe_xfer_call_func func = va_arg(args, upipe_xfer_call_func);
+            void *opaque = va_arg(args, void *);
+            return _upipe_xfer_call(upipe, func, opaque);
+        }
         case UPIPE_XFER_GET_REMOTE: {
             UBASE_SIGNATURE_CHECK(args, UPIPE_XFER_SIGNATURE)
             struct upipe_xfer *upipe_xfer = upipe_xfer_from_upipe(upipe);
@@ -501,7 +617,7 @@ static void upipe_xfer_mgr_vacuum(struct upipe_mgr *mgr)
 
     while ((msg = ulifo_pop(&xfer_mgr->msg_pool,
                             struct upipe_xfer_msg *)) != NULL)
-        free(msg);
+        upipe_xfer_slab_release(msg->slab);
 }
 
 /** @internal @This frees a upipe manager.
@@ -520,6 +636,61 @@ static void upipe_xfer_mgr_free(struct upipe_mgr *mgr)
     free(xfer_mgr);
 }
 
+/** @This processes a message in the remote event loop, and frees it.
+ *
+ * @param mgr xfer_mgr structure
+ * @param msg message to process
+ * @return false if the manager was freed
+ */
+static bool upipe_xfer_mgr_process(struct upipe_mgr *mgr,
+                                   struct upipe_xfer_msg *msg)
+{
+    switch (msg->type) {
+        case UPIPE_XFER_ATTACH_UPUMP_MGR:
+            upipe_attach_upump_mgr(msg->upipe_remote);
+            break;
+        case UPIPE_XFER_SET_URI:
+            upipe_set_uri(msg->upipe_remote, msg->arg.string);
+            free(msg->arg.string);
+            break;
+        case UPIPE_XFER_SET_OUTPUT:
+            upipe_set_output(msg->upipe_remote, msg->arg.pipe);
+            upipe_release(msg->arg.pipe);
+            break;
+        case UPIPE_XFER_RELEASE:
+            upipe_release(msg->upipe_remote);
+            break;
+        case UPIPE_XFER_DETACH:
+            upipe_xfer_msg_free(mgr, msg);
+            upipe_xfer_mgr_free(mgr);
+            return false;
+        case UPIPE_XFER_BATCH: {
+            struct uchain *uchain, *uchain_tmp;
+            ulist_delete_foreach(&msg->uchain, uchain, uchain_tmp) {
+                ulist_delete(uchain);
+                upipe_xfer_mgr_process(mgr, upipe_xfer_msg_from_uchain(uchain));
+            }
+            break;
+        }
+        case UPIPE_XFER_SYNC_CALL: {
+            struct upipe_xfer_call *call = msg->arg.call;
+            int err = call->func(msg->upipe_remote, call->opaque);
+            pthread_mutex_lock(&call->mutex);
+            call->err = err;
+            call->done = true;
+            pthread_cond_signal(&call->cond);
+            pthread_mutex_unlock(&call->mutex);
+            break;
+        }
+        default:
+            /* this should not happen */
+            break;
+    }
+
+    upipe_xfer_msg_free(mgr, msg);
+    return true;
+}
+
 /** @This is called by the remote upump manager to receive messages.
  *
  * @param upump description structure of the read watcher
@@ -530,33 +701,26 @@ static void upipe_xfer_mgr_worker(struct upump *upump)
     struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
     struct upipe_xfer_msg *msg;
     while ((msg = uqueue_pop(&xfer_mgr->uqueue,
-                             struct upipe_xfer_msg *)) != NULL) {
-        switch (msg->type) {
-            case UPIPE_XFER_ATTACH_UPUMP_MGR:
-                upipe_attach_upump_mgr(msg->upipe_remote);
-                break;
-            case UPIPE_XFER_SET_URI:
-                upipe_set_uri(msg->upipe_remote, msg->arg.string);
-                free(msg->arg.string);
-                break;
-            case UPIPE_XFER_SET_OUTPUT:
-                upipe_set_output(msg->upipe_remote, msg->arg.pipe);
-                upipe_release(msg->arg.pipe);
-                break;
-            case UPIPE_XFER_RELEASE:
-                upipe_release(msg->upipe_remote);
-                break;
-            case UPIPE_XFER_DETACH:
-                upipe_xfer_msg_free(mgr, msg);
-                upipe_xfer_mgr_free(mgr);
-                return;
-            default:
-                /* this should not happen */
-                break;
-        }
+                             struct upipe_xfer_msg *)) != NULL)
+        if (!upipe_xfer_mgr_process(mgr, msg))
+            return;
+}
 
-        upipe_xfer_msg_free(mgr, msg);
-    }
+/** @This pushes the batch being built, if any, to the remote upump manager.
+ * If the queue is full, the batch is kept and pushed with the next message.
+ *
+ * @param mgr xfer_mgr structure
+ * @return an error code
+ */
+static int upipe_xfer_mgr_flush(struct upipe_mgr *mgr)
+{
+    struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
+    if (xfer_mgr->batch == NULL)
+        return UBASE_ERR_NONE;
+    if (unlikely(!uqueue_push(&xfer_mgr->uqueue, xfer_mgr->batch)))
+        return UBASE_ERR_EXTERNAL;
+    xfer_mgr->batch = NULL;
+    return UBASE_ERR_NONE;
 }
 
 /** @This sends a message to the remote upump manager.
@@ -580,7 +744,25 @@ static int upipe_xfer_mgr_send(struct upipe_mgr *mgr, int type,
     msg->upipe_remote = upipe_remote;
     msg->arg = arg;
 
-    if (unlikely(!uqueue_push(&xfer_mgr->uqueue, msg))) {
+    /* detach and synchronous calls must not wait for the end of the batch */
+    if (xfer_mgr->batch_depth && type != UPIPE_XFER_DETACH &&
+        type != UPIPE_XFER_SYNC_CALL) {
+        if (xfer_mgr->batch == NULL) {
+            xfer_mgr->batch = upipe_xfer_msg_alloc(mgr);
+            if (unlikely(xfer_mgr->batch == NULL)) {
+                upipe_xfer_msg_free(mgr, msg);
+                return UBASE_ERR_ALLOC;
+            }
+            xfer_mgr->batch->type = UPIPE_XFER_BATCH;
+            xfer_mgr->batch->upipe_remote = NULL;
+            ulist_init(&xfer_mgr->batch->uchain);
+        }
+        ulist_add(&xfer_mgr->batch->uchain, upipe_xfer_msg_to_uchain(msg));
+        return UBASE_ERR_NONE;
+    }
+
+    if (unlikely(!ubase_check(upipe_xfer_mgr_flush(mgr)) ||
+                 !uqueue_push(&xfer_mgr->uqueue, msg))) {
         upipe_xfer_msg_free(mgr, msg);
         return UBASE_ERR_EXTERNAL;
     }
@@ -667,6 +849,36 @@ static inline int _upipe_xfer_mgr_thaw(struct upipe_mgr *mgr)
     return err;
 }
 
+/** @This starts a batch of messages. Until the matching call to
+ * @ref upipe_xfer_mgr_batch_end, messages sent by the xfer pipes of this
+ * manager are kept and pushed to the remote event loop all at once.
+ *
+ * @param mgr xfer_mgr structure
+ * @return an error code
+ */
+static int _upipe_xfer_mgr_batch_begin(struct upipe_mgr *mgr)
+{
+    struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
+    xfer_mgr->batch_depth++;
+    return UBASE_ERR_NONE;
+}
+
+/** @This ends a batch of messages, and pushes them to the remote event loop
+ * if it was the outermost batch.
+ *
+ * @param mgr xfer_mgr structure
+ * @return an error code
+ */
+static int _upipe_xfer_mgr_batch_end(struct upipe_mgr *mgr)
+{
+    struct upipe_xfer_mgr *xfer_mgr = upipe_xfer_mgr_from_upipe_mgr(mgr);
+    if (unlikely(!xfer_mgr->batch_depth))
+        return UBASE_ERR_INVALID;
+    if (--xfer_mgr->batch_depth)
+        return UBASE_ERR_NONE;
+    return upipe_xfer_mgr_flush(mgr);
+}
+
 /** @This processes manager control commands.
  *
  * @param mgr xfer_mgr structure
@@ -691,6 +903,14 @@ static int upipe_xfer_mgr_control(struct upipe_mgr *mgr,
             UBASE_SIGNATURE_CHECK(args, UPIPE_XFER_SIGNATURE)
             return _upipe_xfer_mgr_thaw(mgr);
         }
+        case UPIPE_XFER_MGR_BATCH_BEGIN: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_XFER_SIGNATURE)
+            return _upipe_xfer_mgr_batch_begin(mgr);
+        }
+        case UPIPE_XFER_MGR_BATCH_END: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_XFER_SIGNATURE)
+            return _upipe_xfer_mgr_batch_end(mgr);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -727,6 +947,10 @@ struct upipe_mgr *upipe_xfer_mgr_alloc(uint8_t queue_length,
     xfer_mgr->upump = NULL;
     xfer_mgr->upump_mgr = NULL;
     xfer_mgr->queue_length = queue_length;
+    xfer_mgr->slab_size = msg_pool_depth < MSG_SLAB_SIZE ?
+                          msg_pool_depth + 1 : MSG_SLAB_SIZE;
+    xfer_mgr->batch_depth = 0;
+    xfer_mgr->batch = NULL;
     ulifo_init(&xfer_mgr->msg_pool, msg_pool_depth,
                xfer_mgr->extra + uqueue_sizeof(queue_length));
 
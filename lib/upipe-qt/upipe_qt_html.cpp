@@ -443,7 +443,9 @@ static struct upipe_mgr upipe_qt_html_mgr = {
     /* .upipe_input = */ NULL,
     /* .upipe_control = */ upipe_qt_html_control,
 
-    /* .upipe_mgr_control = */ NULL
+    /* .upipe_mgr_control = */ NULL,
+
+    /* .stats = */ false
 };
 
 /** @This returns the management structure for html pipes
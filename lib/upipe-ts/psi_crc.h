@@ -0,0 +1,12 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+uint32_t upipe_psi_crc_c     (uint32_t crc, const uint8_t *p, uintptr_t len);
+uint32_t upipe_psi_crc_pclmul(uint32_t crc, const uint8_t *p, uintptr_t len);
+
+/* runtime dispatched version */
+uint32_t upipe_psi_crc(uint32_t crc, const uint8_t *p, uintptr_t len);
+
+/* drop-in replacements for psi_set_crc and psi_check_crc from bitstream */
+void upipe_psi_set_crc(uint8_t *section);
+bool upipe_psi_check_crc(const uint8_t *section);
@@ -37,6 +37,7 @@
 #include "upipe-ts/upipe_ts_cat_decoder.h"
 #include "upipe-ts/uref_ts_flow.h"
 #include "upipe_ts_psi_decoder.h"
+#include "psi_crc.h"
 
 #include <bitstream/mpeg/psi/desc_09.h>
 
@@ -133,7 +134,7 @@ static bool upipe_ts_catd_table_validate(struct upipe *upipe)
                                                   &section))))
             return false;
 
-        if (!cat_validate(section) || !psi_check_crc(section)) {
+        if (!cat_validate(section) || !upipe_psi_check_crc(section)) {
             uref_block_unmap(section_uref, 0);
             return false;
         }
@@ -67,6 +67,7 @@
 #include "upipe-modules/upipe_idem.h"
 #include "upipe-modules/upipe_setflowdef.h"
 #include "upipe-modules/upipe_probe_uref.h"
+#include "upipe-modules/upipe_worker_linear.h"
 #include "upipe-ts/uref_ts_flow.h"
 #include "upipe-ts/uref_ts_event.h"
 #include "upipe-ts/upipe_ts_demux.h"
@@ -195,6 +196,65 @@ struct upipe_ts_demux_mgr {
 UBASE_FROM_TO(upipe_ts_demux_mgr, upipe_mgr, upipe_mgr, mgr)
 UBASE_FROM_TO(upipe_ts_demux_mgr, urefcount, urefcount, urefcount)
 
+/** @internal @This describes the worker thread running the framers. */
+struct upipe_ts_demux_worker {
+    /** wlin manager, or NULL to run the framers on the demux thread */
+    struct upipe_mgr *wlin_mgr;
+    /** probe hierarchy to use on the worker thread */
+    struct uprobe *uprobe_remote;
+    /** number of packets in the queues from and to the worker thread */
+    unsigned int queue_length;
+};
+
+/** @internal @This initializes a worker description.
+ *
+ * @param worker pointer to the worker description
+ */
+static void upipe_ts_demux_worker_init(struct upipe_ts_demux_worker *worker)
+{
+    worker->wlin_mgr = NULL;
+    worker->uprobe_remote = NULL;
+    worker->queue_length = 0;
+}
+
+/** @internal @This cleans up a worker description.
+ *
+ * @param worker pointer to the worker description
+ */
+static void upipe_ts_demux_worker_clean(struct upipe_ts_demux_worker *worker)
+{
+    upipe_mgr_release(worker->wlin_mgr);
+    uprobe_release(worker->uprobe_remote);
+}
+
+/** @internal @This sets a worker description.
+ *
+ * @param worker pointer to the worker description
+ * @param wlin_mgr management structure for wlin pipes, or NULL
+ * @param uprobe_remote probe hierarchy to use on the worker thread
+ * @param queue_length number of packets in the queues
+ * @return an error code
+ */
+static int upipe_ts_demux_worker_set(struct upipe_ts_demux_worker *worker,
+                                     struct upipe_mgr *wlin_mgr,
+                                     struct uprobe *uprobe_remote,
+                                     unsigned int queue_length)
+{
+    if (wlin_mgr == NULL) {
+        uprobe_remote = NULL;
+        queue_length = 0;
+    } else if (uprobe_remote == NULL || !queue_length)
+        return UBASE_ERR_INVALID;
+
+    wlin_mgr = upipe_mgr_use(wlin_mgr);
+    uprobe_remote = uprobe_use(uprobe_remote);
+    upipe_ts_demux_worker_clean(worker);
+    worker->wlin_mgr = wlin_mgr;
+    worker->uprobe_remote = uprobe_remote;
+    worker->queue_length = queue_length;
+    return UBASE_ERR_NONE;
+}
+
 /** @hidden */
 struct upipe_ts_demux_psi_pid;
 
@@ -301,6 +361,8 @@ struct upipe_ts_demux {
     bool eits_enabled;
     /** maximum allowed interval between PCRs */
     uint64_t max_pcr_interval;
+    /** worker thread running the framers of new programs */
+    struct upipe_ts_demux_worker worker;
 
     /** probe to get new flow events from inner pipes created by psi_pid
      * objects */
@@ -423,6 +485,8 @@ struct upipe_ts_demux_program {
     uint64_t last_pcr;
     /** highest Upipe timestamp given to a frame */
     uint64_t timestamp_highest;
+    /** worker thread running the framers of the outputs */
+    struct upipe_ts_demux_worker worker;
 
     /** probe to get events from ts_pmtd inner pipe */
     struct uprobe pmtd_probe;
@@ -488,6 +552,8 @@ struct upipe_ts_demux_output {
     uint64_t max_delay;
     /** last DTS orig (used for telx) */
     uint64_t last_dts_orig;
+    /** worker thread running the framer, overriding the program one */
+    struct upipe_ts_demux_worker worker;
 
     /** probe to get events from probe_uref telx inner pipe */
     struct uprobe telx_probe;
@@ -903,12 +969,37 @@ static int upipe_ts_demux_output_plumber(struct upipe *upipe,
     }
 
     if (ts_demux_mgr->autof_mgr != NULL) {
-        /* allocate autof inner */
-        struct upipe *output =
-            upipe_void_alloc_output(inner, ts_demux_mgr->autof_mgr,
+        struct upipe_ts_demux_worker *worker = &upipe_ts_demux_output->worker;
+        if (worker->wlin_mgr == NULL)
+            worker = &program->worker;
+
+        struct upipe *output;
+        if (worker->wlin_mgr != NULL) {
+            /* allocate autof on the worker thread, the rest of the program
+             * staying on the demux thread */
+            struct upipe *autof = upipe_void_alloc(ts_demux_mgr->autof_mgr,
+                uprobe_pfx_alloc_va(uprobe_use(worker->uprobe_remote),
+                                    UPROBE_LOG_VERBOSE, "autof %"PRIu64,
+                                    upipe_ts_demux_output->pid));
+            if (unlikely(autof == NULL))
+                return UBASE_ERR_ALLOC;
+
+            output = upipe_wlin_alloc_output(inner, worker->wlin_mgr,
+                uprobe_pfx_alloc(
+                    uprobe_use(&upipe_ts_demux_output->last_inner_probe),
+                    UPROBE_LOG_VERBOSE, "wlin"),
+                autof,
+                uprobe_pfx_alloc_va(uprobe_use(worker->uprobe_remote),
+                                    UPROBE_LOG_VERBOSE, "wlin_x %"PRIu64,
+                                    upipe_ts_demux_output->pid),
+                worker->queue_length, worker->queue_length);
+        } else {
+            /* allocate autof inner */
+            output = upipe_void_alloc_output(inner, ts_demux_mgr->autof_mgr,
                 uprobe_pfx_alloc(
                     uprobe_use(&upipe_ts_demux_output->last_inner_probe),
                     UPROBE_LOG_VERBOSE, "autof"));
+        }
         if (unlikely(output == NULL))
             return UBASE_ERR_ALLOC;
 
@@ -1111,6 +1202,7 @@ static struct upipe *upipe_ts_demux_output_alloc(struct upipe_mgr *mgr,
     upipe_ts_demux_output->setrap = NULL;
     upipe_ts_demux_output->max_delay = MAX_DELAY;
     upipe_ts_demux_output->last_dts_orig = UINT64_MAX;
+    upipe_ts_demux_worker_init(&upipe_ts_demux_output->worker);
     uref_ts_flow_get_max_delay(flow_def, &upipe_ts_demux_output->max_delay);
     upipe_ts_demux_output_init_telx_probe(upipe);
     upipe_ts_demux_output_init_timestamp_probe(upipe);
@@ -1233,6 +1325,19 @@ static int upipe_ts_demux_output_control(struct upipe *upipe,
                 upipe_ts_demux_output_from_upipe(upipe);
             return upipe_control_va(upipe_ts_demux_output->decaps, command, args);
         }
+        case UPIPE_TS_DEMUX_SET_FRAMER_WORKER: {
+            if (ubase_get_signature(args) != UPIPE_TS_DEMUX_SIGNATURE)
+                return upipe_ts_demux_output_control_bin_output(upipe, command,
+                                                                args);
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_DEMUX_SIGNATURE);
+            struct upipe_ts_demux_output *upipe_ts_demux_output =
+                upipe_ts_demux_output_from_upipe(upipe);
+            struct upipe_mgr *wlin_mgr = va_arg(args, struct upipe_mgr *);
+            struct uprobe *uprobe_remote = va_arg(args, struct uprobe *);
+            unsigned int queue_length = va_arg(args, unsigned int);
+            return upipe_ts_demux_worker_set(&upipe_ts_demux_output->worker,
+                    wlin_mgr, uprobe_remote, queue_length);
+        }
         default:
             return upipe_ts_demux_output_control_bin_output(upipe, command,
                                                             args);
@@ -1250,6 +1355,7 @@ static void upipe_ts_demux_output_free(struct upipe *upipe)
 
     upipe_throw_dead(upipe);
     uref_free(upipe_ts_demux_output->flow_def_input);
+    upipe_ts_demux_worker_clean(&upipe_ts_demux_output->worker);
     upipe_ts_demux_output_clean_last_inner_probe(upipe);
     upipe_ts_demux_output_clean_probe(upipe);
     upipe_ts_demux_output_clean_timestamp_probe(upipe);
@@ -2154,6 +2260,11 @@ static struct upipe *upipe_ts_demux_program_alloc(struct upipe_mgr *mgr,
     upipe_ts_demux_program->timestamp_offset = 0;
     upipe_ts_demux_program->timestamp_highest = TS_CLOCK_MAX;
     upipe_ts_demux_program->max_pcr_interval = demux->max_pcr_interval;
+    upipe_ts_demux_worker_init(&upipe_ts_demux_program->worker);
+    upipe_ts_demux_worker_set(&upipe_ts_demux_program->worker,
+                              demux->worker.wlin_mgr,
+                              demux->worker.uprobe_remote,
+                              demux->worker.queue_length);
     upipe_ts_demux_program->last_pcr = TS_CLOCK_MAX;
     uprobe_init(&upipe_ts_demux_program->pmtd_probe,
                 upipe_ts_demux_program_pmtd_probe, NULL);
@@ -2349,6 +2460,17 @@ static int upipe_ts_demux_program_control(struct upipe *upipe,
                 uint64_t *max = va_arg(args, uint64_t *);
                 return upipe_ts_demux_program_get_max_pcr_interval(upipe, max);
             }
+
+            case UPIPE_TS_DEMUX_SET_FRAMER_WORKER: {
+                UBASE_SIGNATURE_CHECK(args, UPIPE_TS_DEMUX_SIGNATURE);
+                struct upipe_ts_demux_program *program =
+                    upipe_ts_demux_program_from_upipe(upipe);
+                struct upipe_mgr *wlin_mgr = va_arg(args, struct upipe_mgr *);
+                struct uprobe *uprobe_remote = va_arg(args, struct uprobe *);
+                unsigned int queue_length = va_arg(args, unsigned int);
+                return upipe_ts_demux_worker_set(&program->worker, wlin_mgr,
+                                                 uprobe_remote, queue_length);
+            }
         }
     }
 
@@ -2373,6 +2495,7 @@ static void upipe_ts_demux_program_free(struct urefcount *urefcount_real)
     uprobe_clean(&upipe_ts_demux_program->pcr_probe);
     uprobe_clean(&upipe_ts_demux_program->proxy_probe);
     uprobe_clean(&upipe_ts_demux_program->ecmd_probe);
+    upipe_ts_demux_worker_clean(&upipe_ts_demux_program->worker);
 
     urefcount_clean(urefcount_real);
     upipe_ts_demux_program_clean_sub_outputs(upipe);
@@ -3451,6 +3574,7 @@ static struct upipe *upipe_ts_demux_alloc(struct upipe_mgr *mgr,
     upipe_ts_demux->eit_enabled = true;
     upipe_ts_demux->eits_enabled = true;
     upipe_ts_demux->max_pcr_interval = MAX_PCR_INTERVAL;
+    upipe_ts_demux_worker_init(&upipe_ts_demux->worker);
     upipe_ts_demux->nit_pid = 0;
     upipe_ts_demux->flow_def_input = NULL;
 
@@ -3784,6 +3908,34 @@ static int _upipe_ts_demux_get_max_pcr_interval(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets the worker thread running the framers of the
+ * programs.
+ *
+ * @param upipe description structure of the pipe
+ * @param wlin_mgr management structure for wlin pipes, or NULL
+ * @param uprobe_remote probe hierarchy to use on the worker thread
+ * @param queue_length number of packets in the queues
+ * @return an error code
+ */
+static int _upipe_ts_demux_set_framer_worker(struct upipe *upipe,
+                                             struct upipe_mgr *wlin_mgr,
+                                             struct uprobe *uprobe_remote,
+                                             unsigned int queue_length)
+{
+    struct upipe_ts_demux *demux = upipe_ts_demux_from_upipe(upipe);
+    UBASE_RETURN(upipe_ts_demux_worker_set(&demux->worker, wlin_mgr,
+                                           uprobe_remote, queue_length));
+
+    struct uchain *uchain;
+    ulist_foreach(&demux->programs, uchain) {
+        struct upipe_ts_demux_program *program =
+            upipe_ts_demux_program_from_uchain(uchain);
+        upipe_ts_demux_worker_set(&program->worker, wlin_mgr, uprobe_remote,
+                                  queue_length);
+    }
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on a ts_demux pipe.
  *
  * @param upipe description structure of the pipe
@@ -3866,6 +4018,15 @@ static int upipe_ts_demux_control(struct upipe *upipe,
             uint64_t *max = va_arg(args, uint64_t *);
             return _upipe_ts_demux_get_max_pcr_interval(upipe, max);
         }
+        case UPIPE_TS_DEMUX_SET_FRAMER_WORKER: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_DEMUX_SIGNATURE);
+            struct upipe_mgr *wlin_mgr = va_arg(args, struct upipe_mgr *);
+            struct uprobe *uprobe_remote = va_arg(args, struct uprobe *);
+            unsigned int queue_length = va_arg(args, unsigned int);
+            return _upipe_ts_demux_set_framer_worker(upipe, wlin_mgr,
+                                                     uprobe_remote,
+                                                     queue_length);
+        }
 
         default:
             break;
@@ -3895,6 +4056,7 @@ static void upipe_ts_demux_free(struct urefcount *urefcount_real)
     uprobe_clean(&upipe_ts_demux->input_probe);
     uprobe_clean(&upipe_ts_demux->split_probe);
     uref_free(upipe_ts_demux->flow_def_input);
+    upipe_ts_demux_worker_clean(&upipe_ts_demux->worker);
     upipe_ts_demux_clean_sub_programs(upipe);
     upipe_ts_demux_clean_sync(upipe);
     upipe_ts_demux_clean_uref_mgr(upipe);
@@ -90,6 +90,8 @@ struct upipe_ts_eitd {
     UPIPE_TS_PSID_TABLE_DECLARE(eit);
     /** EIT table being gathered */
     UPIPE_TS_PSID_TABLE_DECLARE(next_eit);
+    /** fingerprints of the sections of the current EIT */
+    struct upipe_ts_psid_cache cache;
 
     /** encoding of the following iconv handle */
     const char *current_encoding;
@@ -136,6 +138,7 @@ static struct upipe *upipe_ts_eitd_alloc(struct upipe_mgr *mgr,
     upipe_ts_eitd_init_iconv(upipe);
     upipe_ts_psid_table_init(upipe_ts_eitd->eit);
     upipe_ts_psid_table_init(upipe_ts_eitd->next_eit);
+    upipe_ts_psid_cache_init(&upipe_ts_eitd->cache);
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -327,13 +330,23 @@ static void upipe_ts_eitd_input(struct upipe *upipe, struct uref *uref,
     struct upipe_ts_eitd *upipe_ts_eitd = upipe_ts_eitd_from_upipe(upipe);
     assert(upipe_ts_eitd->flow_def_input != NULL);
 
+    if (upipe_ts_psid_cache_check(&upipe_ts_eitd->cache, uref) &&
+        !upipe_ts_psid_cache_pending(&upipe_ts_eitd->cache)) {
+        /* Repetition of a section of the current EIT. */
+        uref_free(uref);
+        return;
+    }
+
+    upipe_ts_psid_cache_gather(&upipe_ts_eitd->cache, upipe_ts_eitd->next_eit);
     if (!upipe_ts_eitd_table_section(upipe_ts_eitd->next_eit, uref))
         return;
+    upipe_ts_psid_cache_gathered(&upipe_ts_eitd->cache);
 
     if (upipe_ts_psid_table_validate(upipe_ts_eitd->eit) &&
         upipe_ts_psid_table_compare(upipe_ts_eitd->eit,
                                     upipe_ts_eitd->next_eit)) {
         /* Identical EIT. */
+        upipe_ts_psid_cache_update(&upipe_ts_eitd->cache, upipe_ts_eitd->eit);
         upipe_ts_psid_table_clean(upipe_ts_eitd->next_eit);
         upipe_ts_psid_table_init(upipe_ts_eitd->next_eit);
         return;
@@ -418,6 +431,7 @@ static void upipe_ts_eitd_input(struct upipe *upipe, struct uref *uref,
         upipe_ts_psid_table_clean(upipe_ts_eitd->eit);
     upipe_ts_psid_table_copy(upipe_ts_eitd->eit, upipe_ts_eitd->next_eit);
     upipe_ts_psid_table_init(upipe_ts_eitd->next_eit);
+    upipe_ts_psid_cache_update(&upipe_ts_eitd->cache, upipe_ts_eitd->eit);
 
     flow_def = upipe_ts_eitd_store_flow_def_attr(upipe, flow_def);
     if (unlikely(flow_def == NULL)) {
@@ -486,6 +500,15 @@ static int upipe_ts_eitd_control(struct upipe *upipe, int command, va_list args)
             struct uref *flow_def = va_arg(args, struct uref *);
             return upipe_ts_eitd_set_flow_def(upipe, flow_def);
         }
+        case UPIPE_TS_EITD_GET_CACHE_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_EITD_SIGNATURE)
+            struct upipe_ts_eitd *upipe_ts_eitd =
+                upipe_ts_eitd_from_upipe(upipe);
+            uint64_t *hits_p = va_arg(args, uint64_t *);
+            uint64_t *misses_p = va_arg(args, uint64_t *);
+            return upipe_ts_psid_cache_get_stats(&upipe_ts_eitd->cache,
+                                                 hits_p, misses_p);
+        }
 
         default:
             return UBASE_ERR_UNHANDLED;
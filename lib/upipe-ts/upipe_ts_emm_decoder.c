@@ -39,6 +39,7 @@
 #include "upipe-ts/upipe_ts_emm_decoder.h"
 #include "upipe-ts/uref_ts_flow.h"
 #include "upipe_ts_psi_decoder.h"
+#include "psi_crc.h"
 
 #include <bitstream/ebu/biss.h>
 
@@ -240,7 +241,7 @@ static bool upipe_ts_emmd_table_validate(struct upipe *upipe)
                                                   &section))))
             return false;
 
-        if (!bissca_emm_validate(section) || !psi_check_crc(section)) {
+        if (!bissca_emm_validate(section) || !upipe_psi_check_crc(section)) {
             uref_block_unmap(section_uref, 0);
             return false;
         }
@@ -1055,7 +1056,7 @@ static bool upipe_ts_emmd_ecm_table_validate(struct upipe *upipe)
                                                   &section))))
             return false;
 
-        if (/*!ecm_validate(section) || */!psi_check_crc(section)) {
+        if (/*!ecm_validate(section) || */!upipe_psi_check_crc(section)) {
             uref_block_unmap(section_uref, 0);
             return false;
         }
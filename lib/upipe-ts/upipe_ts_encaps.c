@@ -50,6 +50,7 @@
 
 #include <bitstream/mpeg/ts.h>
 #include <bitstream/mpeg/pes.h>
+#include <bitstream/mpeg/psi.h>
 
 /** we only accept blocks */
 #define EXPECTED_FLOW_DEF "block."
@@ -73,6 +74,25 @@
 /** @hidden */
 static int upipe_ts_encaps_check(struct upipe *upipe, struct uref *flow_format);
 
+/** @internal @This is a PSI section kept in the carousel, with the ready to
+ * send payloads of its TS packets. */
+struct upipe_ts_encaps_section {
+    /** structure for double-linked lists */
+    struct uchain uchain;
+    /** section as received */
+    struct ubuf *section;
+    /** size of the section */
+    size_t size;
+    /** CRC32 of the section */
+    uint32_t crc;
+    /** TS payloads, including pointer_field and stuffing */
+    struct ubuf *packets;
+    /** number of TS packets */
+    size_t nb_packets;
+};
+
+UBASE_FROM_TO(upipe_ts_encaps_section, uchain, uchain, uchain)
+
 /** @internal @This is the private context of a ts_encaps pipe. */
 struct upipe_ts_encaps {
     /** refcount management structure */
@@ -142,6 +162,18 @@ struct upipe_ts_encaps {
 
     /** a padding packet for PSI streams */
     struct ubuf *padding;
+    /** maximum number of sections in the carousel (0 = disabled) */
+    unsigned int carousel_max;
+    /** number of sections in the carousel */
+    unsigned int carousel_nb;
+    /** list of sections in the carousel, most recently used first */
+    struct uchain carousel;
+    /** TS payloads of the section being output from the carousel */
+    struct ubuf *carousel_packets;
+    /** index of the next TS packet to output from the carousel */
+    size_t carousel_next;
+    /** number of TS packets of the section being output */
+    size_t carousel_nb_packets;
     /** last continuity counter for this PID */
     uint8_t last_cc;
     /** last time prepare was called */
@@ -228,6 +260,12 @@ static struct upipe *upipe_ts_encaps_alloc(struct upipe_mgr *mgr,
     upipe_ts_encaps->pes_min_duration = 0;
     upipe_ts_encaps->pes_alignment = true;
     upipe_ts_encaps->padding = NULL;
+    upipe_ts_encaps->carousel_max = 0;
+    upipe_ts_encaps->carousel_nb = 0;
+    ulist_init(&upipe_ts_encaps->carousel);
+    upipe_ts_encaps->carousel_packets = NULL;
+    upipe_ts_encaps->carousel_next = 0;
+    upipe_ts_encaps->carousel_nb_packets = 0;
     upipe_ts_encaps->last_cc = 0;
     upipe_ts_encaps->last_splice = 0;
     upipe_ts_encaps->last_pcr = 0;
@@ -407,6 +445,28 @@ static void upipe_ts_encaps_check_status(struct upipe *upipe)
         upipe_ts_encaps_update_status(upipe);
 }
 
+/** @internal @This removes the least recently used sections from the PSI
+ * carousel.
+ *
+ * @param upipe description structure of the pipe
+ * @param max number of sections to keep
+ */
+static void upipe_ts_encaps_trim_carousel(struct upipe *upipe,
+                                          unsigned int max)
+{
+    struct upipe_ts_encaps *encaps = upipe_ts_encaps_from_upipe(upipe);
+    while (encaps->carousel_nb > max) {
+        struct uchain *uchain = ulist_peek_last(&encaps->carousel);
+        struct upipe_ts_encaps_section *section =
+            upipe_ts_encaps_section_from_uchain(uchain);
+        ulist_delete(uchain);
+        ubuf_free(section->section);
+        ubuf_free(section->packets);
+        free(section);
+        encaps->carousel_nb--;
+    }
+}
+
 /** @This promotes a uref to the temporary buffer, checking for flow def
  * changes.
  *
@@ -436,6 +496,8 @@ static void upipe_ts_encaps_promote_uref(struct upipe *upipe)
             uref_ts_flow_get_tb_rate(uref, &encaps->tb_rate);
             uint64_t pid = PADDING_PID;
             uref_ts_flow_get_pid(uref, &pid);
+            if (encaps->pid != pid)
+                upipe_ts_encaps_trim_carousel(upipe, 0);
             encaps->pid = pid;
             encaps->max_delay = T_STD_MAX_RETENTION;
             uref_ts_flow_get_max_delay(uref, &encaps->max_delay);
@@ -501,6 +563,8 @@ static void upipe_ts_encaps_consume_uref(struct upipe *upipe)
     struct upipe_ts_encaps *upipe_ts_encaps = upipe_ts_encaps_from_upipe(upipe);
     uref_free(upipe_ts_encaps->uref);
     upipe_ts_encaps->uref = NULL;
+    ubuf_free(upipe_ts_encaps->carousel_packets);
+    upipe_ts_encaps->carousel_packets = NULL;
     upipe_ts_encaps_promote_uref(upipe);
 }
 
@@ -741,6 +805,21 @@ static int _upipe_ts_encaps_set_tb_size(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @This sets the maximum number of PSI sections kept in the carousel.
+ *
+ * @param upipe description structure of the pipe
+ * @param max maximum number of sections, or 0 to disable the carousel
+ * @return an error code
+ */
+static int _upipe_ts_encaps_set_carousel(struct upipe *upipe,
+                                         unsigned int max)
+{
+    struct upipe_ts_encaps *encaps = upipe_ts_encaps_from_upipe(upipe);
+    encaps->carousel_max = max;
+    upipe_ts_encaps_trim_carousel(upipe, max);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This returns the size of the next PES header.
  *
  * @param upipe description structure of the pipe
@@ -1249,6 +1328,211 @@ static int upipe_ts_encaps_complete(struct upipe *upipe, struct ubuf **ubuf_p,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This builds the TS payloads of the current PSI section and
+ * adds them to the carousel.
+ *
+ * @param upipe description structure of the pipe
+ * @param crc CRC32 of the section
+ * @return pointer to the carousel entry, or NULL in case of error
+ */
+static struct upipe_ts_encaps_section *
+    upipe_ts_encaps_build_section(struct upipe *upipe, uint32_t crc)
+{
+    struct upipe_ts_encaps *encaps = upipe_ts_encaps_from_upipe(upipe);
+    size_t size = encaps->uref_size;
+    /* the first packet also carries the pointer_field */
+    size_t nb_packets = (size + TS_SIZE - TS_HEADER_SIZE) /
+                        (TS_SIZE - TS_HEADER_SIZE);
+
+    struct upipe_ts_encaps_section *section =
+        malloc(sizeof(struct upipe_ts_encaps_section));
+    if (unlikely(section == NULL))
+        return NULL;
+    section->size = size;
+    section->crc = crc;
+    section->nb_packets = nb_packets;
+    section->section = ubuf_dup(encaps->uref->ubuf);
+    section->packets = ubuf_block_alloc(encaps->ubuf_mgr,
+            nb_packets * (TS_SIZE - TS_HEADER_SIZE));
+    uint8_t *buffer;
+    int buffer_size = -1;
+    if (unlikely(section->section == NULL || section->packets == NULL ||
+                 !ubase_check(ubuf_block_write(section->packets, 0,
+                                               &buffer_size, &buffer)))) {
+        ubuf_free(section->section);
+        ubuf_free(section->packets);
+        free(section);
+        return NULL;
+    }
+    if (unlikely(buffer_size != nb_packets * (TS_SIZE - TS_HEADER_SIZE))) {
+        ubuf_block_unmap(section->packets, 0);
+        ubuf_free(section->section);
+        ubuf_free(section->packets);
+        free(section);
+        return NULL;
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < nb_packets; i++) {
+        uint8_t *payload = buffer + i * (TS_SIZE - TS_HEADER_SIZE);
+        size_t payload_size = TS_SIZE - TS_HEADER_SIZE;
+        if (!i) {
+            *payload++ = 0;
+            payload_size--;
+        }
+
+        size_t extract = size - offset;
+        if (extract > payload_size)
+            extract = payload_size;
+        ubuf_block_extract(encaps->uref->ubuf, offset, extract, payload);
+        memset(payload + extract, 0xff, payload_size - extract);
+        offset += extract;
+    }
+    ubuf_block_unmap(section->packets, 0);
+
+    upipe_ts_encaps_trim_carousel(upipe, encaps->carousel_max - 1);
+    ulist_unshift(&encaps->carousel,
+                  upipe_ts_encaps_section_to_uchain(section));
+    encaps->carousel_nb++;
+    return section;
+}
+
+/** @internal @This looks up the current PSI section in the carousel, and
+ * prepares to output its TS packets. Sections without section syntax (TDT,
+ * TOT) change at each repetition and are not kept.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_ts_encaps_promote_carousel(struct upipe *upipe)
+{
+    struct upipe_ts_encaps *encaps = upipe_ts_encaps_from_upipe(upipe);
+    size_t size = encaps->uref_size;
+    if (size < PSI_HEADER_SIZE_SYNTAX1 + PSI_CRC_SIZE)
+        return;
+
+    uint8_t header_buffer[PSI_HEADER_SIZE];
+    const uint8_t *header = uref_block_peek(encaps->uref, 0, PSI_HEADER_SIZE,
+                                            header_buffer);
+    if (unlikely(header == NULL))
+        return;
+    bool syntax = psi_get_syntax(header);
+    size_t section_size = psi_get_length(header) + PSI_HEADER_SIZE;
+    uref_block_peek_unmap(encaps->uref, 0, header_buffer, header);
+    if (!syntax || section_size != size)
+        return;
+
+    uint8_t crc_buffer[PSI_CRC_SIZE];
+    const uint8_t *crc_p = uref_block_peek(encaps->uref, size - PSI_CRC_SIZE,
+                                           PSI_CRC_SIZE, crc_buffer);
+    if (unlikely(crc_p == NULL))
+        return;
+    uint32_t crc = ((uint32_t)crc_p[0] << 24) | (crc_p[1] << 16) |
+                   (crc_p[2] << 8) | crc_p[3];
+    uref_block_peek_unmap(encaps->uref, size - PSI_CRC_SIZE, crc_buffer,
+                          crc_p);
+
+    struct upipe_ts_encaps_section *section = NULL;
+    struct uchain *uchain;
+    ulist_foreach (&encaps->carousel, uchain) {
+        struct upipe_ts_encaps_section *entry =
+            upipe_ts_encaps_section_from_uchain(uchain);
+        if (entry->size == size && entry->crc == crc &&
+            ubase_check(ubuf_block_equal(entry->section,
+                                         encaps->uref->ubuf))) {
+            section = entry;
+            /* most recently used first */
+            ulist_delete(uchain);
+            ulist_unshift(&encaps->carousel, uchain);
+            break;
+        }
+    }
+
+    if (section == NULL &&
+        unlikely((section = upipe_ts_encaps_build_section(upipe,
+                                                          crc)) == NULL))
+        return;
+
+    encaps->carousel_packets = ubuf_dup(section->packets);
+    if (unlikely(encaps->carousel_packets == NULL))
+        return;
+    encaps->carousel_next = 0;
+    encaps->carousel_nb_packets = section->nb_packets;
+    /* account for the pointer_field */
+    encaps->uref_size++;
+    encaps->au_size = encaps->uref_size;
+}
+
+/** @internal @This outputs the next TS packet of the current section from
+ * the carousel. Only the TS header is written, the payload is a reference
+ * to the carousel buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param ubuf_p filled in with a pointer to the ubuf
+ * @param dts_sys_p filled in with the dts_sys, or UINT64_MAX
+ * @return an error code
+ */
+static int upipe_ts_encaps_splice_carousel(struct upipe *upipe,
+                                           struct ubuf **ubuf_p,
+                                           uint64_t *dts_sys_p)
+{
+    struct upipe_ts_encaps *encaps = upipe_ts_encaps_from_upipe(upipe);
+    assert(encaps->carousel_next < encaps->carousel_nb_packets);
+    encaps->need_status = true;
+    *dts_sys_p = UINT64_MAX;
+
+    uint64_t dts_sys;
+    if (ubase_check(uref_clock_get_dts_sys(encaps->uref, &dts_sys))) {
+        size_t header_size = encaps->carousel_next ? 0 : 1;
+        *dts_sys_p = dts_sys -
+            (uint64_t)(encaps->uref_size - header_size) * UCLOCK_FREQ /
+            encaps->tb_rate;
+    }
+
+    struct ubuf *ubuf = ubuf_block_alloc(encaps->ubuf_mgr, TS_HEADER_SIZE);
+    uint8_t *buffer;
+    int size = -1;
+    if (unlikely(ubuf == NULL ||
+                 !ubase_check(ubuf_block_write(ubuf, 0, &size, &buffer)))) {
+        ubuf_free(ubuf);
+        return UBASE_ERR_ALLOC;
+    }
+    encaps->last_cc++;
+    encaps->last_cc &= 0xf;
+    ts_init(buffer);
+    ts_set_pid(buffer, encaps->pid);
+    ts_set_payload(buffer);
+    if (!encaps->carousel_next)
+        ts_set_unitstart(buffer);
+    ts_set_cc(buffer, encaps->last_cc);
+    ubuf_block_unmap(ubuf, 0);
+
+    struct ubuf *payload = ubuf_block_splice(encaps->carousel_packets,
+            encaps->carousel_next * (TS_SIZE - TS_HEADER_SIZE),
+            TS_SIZE - TS_HEADER_SIZE);
+    if (unlikely(payload == NULL ||
+                 !ubase_check(ubuf_block_append(ubuf, payload)))) {
+        ubuf_free(payload);
+        ubuf_free(ubuf);
+        return UBASE_ERR_ALLOC;
+    }
+    *ubuf_p = ubuf;
+
+    size_t payload_size = TS_SIZE - TS_HEADER_SIZE;
+    if (payload_size > encaps->uref_size)
+        payload_size = encaps->uref_size;
+    encaps->uref_size -= payload_size;
+    encaps->au_size -= payload_size;
+    encaps->tb_buffer -= payload_size;
+    encaps->carousel_next++;
+    uref_block_delete_start(encaps->uref);
+
+    if (!encaps->uref_size) {
+        assert(encaps->carousel_next == encaps->carousel_nb_packets);
+        upipe_ts_encaps_consume_uref(upipe);
+    }
+    return UBASE_ERR_NONE;
+}
+
 /** @This returns a ubuf containing a TS packet, and the dts_sys of the packet.
  *
  * @param upipe description structure of the pipe
@@ -1324,6 +1608,19 @@ static int _upipe_ts_encaps_splice(struct upipe *upipe, uint64_t cr_sys_min,
     }
 
     bool start = ubase_check(uref_block_get_start(encaps->uref));
+    if (start && encaps->psi && encaps->carousel_max &&
+        !encaps->pcr_interval &&
+        !ubase_check(uref_flow_get_random(encaps->uref)) &&
+        !ubase_check(uref_flow_get_discontinuity(encaps->uref)))
+        upipe_ts_encaps_promote_carousel(upipe);
+
+    if (encaps->carousel_packets != NULL) {
+        UBASE_RETURN(upipe_ts_encaps_splice_carousel(upipe, ubuf_p,
+                                                     dts_sys_p));
+        upipe_ts_encaps_check_status(upipe);
+        return UBASE_ERR_NONE;
+    }
+
     if (start) {
         UBASE_RETURN(upipe_ts_encaps_promote_au(upipe));
     }
@@ -1422,6 +1719,11 @@ static int upipe_ts_encaps_control(struct upipe *upipe,
             unsigned int tb_size = va_arg(args, unsigned int);
             return _upipe_ts_encaps_set_tb_size(upipe, tb_size);
         }
+        case UPIPE_TS_ENCAPS_SET_CAROUSEL: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_ENCAPS_SIGNATURE)
+            unsigned int max = va_arg(args, unsigned int);
+            return _upipe_ts_encaps_set_carousel(upipe, max);
+        }
         case UPIPE_TS_ENCAPS_SPLICE: {
             UBASE_SIGNATURE_CHECK(args, UPIPE_TS_ENCAPS_SIGNATURE)
             uint64_t cr_sys_min = va_arg(args, uint64_t);
@@ -1457,6 +1759,8 @@ static void upipe_ts_encaps_free(struct upipe *upipe)
 
     uref_free(upipe_ts_encaps->uref);
     ubuf_free(upipe_ts_encaps->padding);
+    ubuf_free(upipe_ts_encaps->carousel_packets);
+    upipe_ts_encaps_trim_carousel(upipe, 0);
     upipe_ts_encaps_clean_input(upipe);
     upipe_ts_encaps_clean_output(upipe);
     upipe_ts_encaps_clean_ubuf_mgr(upipe);
@@ -1478,6 +1782,7 @@ static const char *upipe_ts_encaps_command_str(int cmd)
         UBASE_CASE_TO_STR(UPIPE_TS_ENCAPS_SET_TB_SIZE);
         UBASE_CASE_TO_STR(UPIPE_TS_ENCAPS_SPLICE);
         UBASE_CASE_TO_STR(UPIPE_TS_ENCAPS_EOS);
+        UBASE_CASE_TO_STR(UPIPE_TS_ENCAPS_SET_CAROUSEL);
         default: break;
     }
     return NULL;
@@ -356,6 +356,8 @@ struct upipe_ts_mux {
     size_t tb_size;
     /** force PES alignment */
     bool force_pes_alignment;
+    /** number of PSI sections kept as TS packets per PID */
+    unsigned int psi_carousel;
 
     /** list of PIDs carrying PSI */
     struct uchain psi_pids;
@@ -854,6 +856,7 @@ static struct upipe_ts_mux_psi_pid *
 
     uref_free(flow_def);
     upipe_ts_encaps_set_tb_size(psi_pid->encaps, upipe_ts_mux->tb_size);
+    upipe_ts_encaps_set_carousel(psi_pid->encaps, upipe_ts_mux->psi_carousel);
     upipe_set_output(psi_pid->encaps,
                      upipe_ts_mux_to_inner_sink(upipe_ts_mux));
 
@@ -2928,6 +2931,7 @@ static struct upipe *upipe_ts_mux_alloc(struct upipe_mgr *mgr,
     upipe_ts_mux->octetrate_in_progress = false;
     upipe_ts_mux->interval = 0;
     upipe_ts_mux->force_pes_alignment = false;
+    upipe_ts_mux->psi_carousel = 0;
 
     ulist_init(&upipe_ts_mux->psi_pids);
     ulist_init(&upipe_ts_mux->psi_pids_splice);
@@ -4720,6 +4724,28 @@ static int _upipe_ts_mux_force_pes_alignment(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets the number of PSI sections kept as TS packets on
+ * each PSI PID.
+ *
+ * @param upipe description structure of the pipe
+ * @param max maximum number of sections per PID, or 0 to disable
+ * @return an error code
+ */
+static int _upipe_ts_mux_set_psi_carousel(struct upipe *upipe,
+                                          unsigned int max)
+{
+    struct upipe_ts_mux *mux = upipe_ts_mux_from_upipe(upipe);
+    mux->psi_carousel = max;
+
+    struct uchain *uchain;
+    ulist_foreach (&mux->psi_pids, uchain) {
+        struct upipe_ts_mux_psi_pid *psi_pid =
+            upipe_ts_mux_psi_pid_from_uchain(uchain);
+        upipe_ts_encaps_set_carousel(psi_pid->encaps, max);
+    }
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This sets the default minimum PES duration.
  *
  * @param upipe description structure of the pipe
@@ -4990,6 +5016,11 @@ static int _upipe_ts_mux_control(struct upipe *upipe, int command, va_list args)
             int force = va_arg(args, int);
             return _upipe_ts_mux_force_pes_alignment(upipe, !!force);
         }
+        case UPIPE_TS_MUX_SET_PSI_CAROUSEL: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_MUX_SIGNATURE)
+            unsigned int max = va_arg(args, unsigned int);
+            return _upipe_ts_mux_set_psi_carousel(upipe, max);
+        }
 
         case UPIPE_TS_MUX_GET_VERSION:
         case UPIPE_TS_MUX_SET_VERSION:
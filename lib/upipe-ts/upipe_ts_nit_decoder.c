@@ -39,6 +39,7 @@
 #include "upipe-ts/upipe_ts_nit_decoder.h"
 #include "upipe-ts/uref_ts_flow.h"
 #include "upipe_ts_psi_decoder.h"
+#include "psi_crc.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -87,6 +88,8 @@ struct upipe_ts_nitd {
     UPIPE_TS_PSID_TABLE_DECLARE(nit);
     /** NIT table being gathered */
     UPIPE_TS_PSID_TABLE_DECLARE(next_nit);
+    /** fingerprints of the sections of the current NIT */
+    struct upipe_ts_psid_cache cache;
 
     /** encoding of the following iconv handle */
     const char *current_encoding;
@@ -133,6 +136,7 @@ static struct upipe *upipe_ts_nitd_alloc(struct upipe_mgr *mgr,
     upipe_ts_nitd_init_iconv(upipe);
     upipe_ts_psid_table_init(upipe_ts_nitd->nit);
     upipe_ts_psid_table_init(upipe_ts_nitd->next_nit);
+    upipe_ts_psid_cache_init(&upipe_ts_nitd->cache);
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -190,7 +194,7 @@ static bool upipe_ts_nitd_table_validate(struct upipe *upipe)
                                                   &section))))
             return false;
 
-        if (!nit_validate(section) || !psi_check_crc(section)) {
+        if (!nit_validate(section) || !upipe_psi_check_crc(section)) {
             uref_block_unmap(section_uref, 0);
             return false;
         }
@@ -309,13 +313,23 @@ static void upipe_ts_nitd_input(struct upipe *upipe, struct uref *uref,
     struct upipe_ts_nitd *upipe_ts_nitd = upipe_ts_nitd_from_upipe(upipe);
     assert(upipe_ts_nitd->flow_def_input != NULL);
 
+    if (upipe_ts_psid_cache_check(&upipe_ts_nitd->cache, uref) &&
+        !upipe_ts_psid_cache_pending(&upipe_ts_nitd->cache)) {
+        /* Repetition of a section of the current NIT. */
+        uref_free(uref);
+        return;
+    }
+
+    upipe_ts_psid_cache_gather(&upipe_ts_nitd->cache, upipe_ts_nitd->next_nit);
     if (!upipe_ts_psid_table_section(upipe_ts_nitd->next_nit, uref))
         return;
+    upipe_ts_psid_cache_gathered(&upipe_ts_nitd->cache);
 
     if (upipe_ts_psid_table_validate(upipe_ts_nitd->nit) &&
         upipe_ts_psid_table_compare(upipe_ts_nitd->nit,
                                     upipe_ts_nitd->next_nit)) {
         /* Identical NIT. */
+        upipe_ts_psid_cache_update(&upipe_ts_nitd->cache, upipe_ts_nitd->nit);
         upipe_ts_psid_table_clean(upipe_ts_nitd->next_nit);
         upipe_ts_psid_table_init(upipe_ts_nitd->next_nit);
         return;
@@ -384,6 +398,7 @@ static void upipe_ts_nitd_input(struct upipe *upipe, struct uref *uref,
         upipe_ts_psid_table_clean(upipe_ts_nitd->nit);
     upipe_ts_psid_table_copy(upipe_ts_nitd->nit, upipe_ts_nitd->next_nit);
     upipe_ts_psid_table_init(upipe_ts_nitd->next_nit);
+    upipe_ts_psid_cache_update(&upipe_ts_nitd->cache, upipe_ts_nitd->nit);
 
     flow_def = upipe_ts_nitd_store_flow_def_attr(upipe, flow_def);
     if (unlikely(flow_def == NULL)) {
@@ -452,6 +467,15 @@ static int upipe_ts_nitd_control(struct upipe *upipe, int command, va_list args)
             struct uref *flow_def = va_arg(args, struct uref *);
             return upipe_ts_nitd_set_flow_def(upipe, flow_def);
         }
+        case UPIPE_TS_NITD_GET_CACHE_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_NITD_SIGNATURE)
+            struct upipe_ts_nitd *upipe_ts_nitd =
+                upipe_ts_nitd_from_upipe(upipe);
+            uint64_t *hits_p = va_arg(args, uint64_t *);
+            uint64_t *misses_p = va_arg(args, uint64_t *);
+            return upipe_ts_psid_cache_get_stats(&upipe_ts_nitd->cache,
+                                                 hits_p, misses_p);
+        }
 
         default:
             return UBASE_ERR_UNHANDLED;
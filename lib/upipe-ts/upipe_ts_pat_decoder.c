@@ -39,6 +39,7 @@
 #include "upipe-ts/upipe_ts_pat_decoder.h"
 #include "upipe-ts/uref_ts_flow.h"
 #include "upipe_ts_psi_decoder.h"
+#include "psi_crc.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -84,6 +85,8 @@ struct upipe_ts_patd {
     UPIPE_TS_PSID_TABLE_DECLARE(pat);
     /** PAT table being gathered */
     UPIPE_TS_PSID_TABLE_DECLARE(next_pat);
+    /** fingerprints of the sections of the current PAT */
+    struct upipe_ts_psid_cache cache;
     /** current TSID */
     int tsid;
     /** NIT flow definition */
@@ -128,6 +131,7 @@ static struct upipe *upipe_ts_patd_alloc(struct upipe_mgr *mgr,
     upipe_ts_patd_init_ubuf_mgr(upipe);
     upipe_ts_patd_init_flow_def(upipe);
     upipe_ts_psid_table_init(upipe_ts_patd->pat);
+    upipe_ts_psid_cache_init(&upipe_ts_patd->cache);
     upipe_ts_psid_table_init(upipe_ts_patd->next_pat);
     upipe_ts_patd->tsid = -1;
     upipe_ts_patd->nit = NULL;
@@ -201,7 +205,7 @@ static bool upipe_ts_patd_table_validate(struct upipe *upipe)
                                                   &section))))
             return false;
 
-        if (!pat_validate(section) || !psi_check_crc(section)) {
+        if (!pat_validate(section) || !upipe_psi_check_crc(section)) {
             uref_block_unmap(section_uref, 0);
             return false;
         }
@@ -342,14 +346,32 @@ static void upipe_ts_patd_input(struct upipe *upipe, struct uref *uref,
     assert(upipe_ts_patd->flow_def_input != NULL);
     assert(upipe_ts_patd->ubuf_mgr != NULL);
 
+    if (upipe_ts_psid_cache_check(&upipe_ts_patd->cache, uref) &&
+        upipe_ts_psid_table_validate(upipe_ts_patd->pat) &&
+        !upipe_ts_psid_cache_pending(&upipe_ts_patd->cache) &&
+        !upipe_ts_psid_table_get_lastsection(upipe_ts_patd->pat)) {
+        /* Repetition of the single section of the current PAT. */
+        uint64_t cr_sys;
+        if (ubase_check(uref_clock_get_cr_sys(uref, &cr_sys))) {
+            uref_clock_set_rap_sys(uref, cr_sys);
+            upipe_throw_new_rap(upipe, uref);
+        }
+        uref_free(uref);
+        return;
+    }
+
+    upipe_ts_psid_cache_gather(&upipe_ts_patd->cache, upipe_ts_patd->next_pat);
     if (!upipe_ts_psid_table_section(upipe_ts_patd->next_pat, uref))
         return;
+    upipe_ts_psid_cache_gathered(&upipe_ts_patd->cache);
 
     if (upipe_ts_psid_table_validate(upipe_ts_patd->pat) &&
         upipe_ts_psid_table_compare(upipe_ts_patd->pat,
                                     upipe_ts_patd->next_pat)) {
         /* Identical PAT. */
         upipe_ts_patd_table_rap(upipe, uref);
+        upipe_ts_psid_cache_update(&upipe_ts_patd->cache,
+                                   upipe_ts_patd->pat);
         upipe_ts_psid_table_clean(upipe_ts_patd->next_pat);
         upipe_ts_psid_table_init(upipe_ts_patd->next_pat);
         return;
@@ -412,6 +434,7 @@ static void upipe_ts_patd_input(struct upipe *upipe, struct uref *uref,
         upipe_ts_psid_table_clean(upipe_ts_patd->pat);
     upipe_ts_psid_table_copy(upipe_ts_patd->pat, upipe_ts_patd->next_pat);
     upipe_ts_psid_table_init(upipe_ts_patd->next_pat);
+    upipe_ts_psid_cache_update(&upipe_ts_patd->cache, upipe_ts_patd->pat);
 
     upipe_split_throw_update(upipe);
 }
@@ -521,6 +544,15 @@ static int upipe_ts_patd_control(struct upipe *upipe, int command, va_list args)
             struct uref **p = va_arg(args, struct uref **);
             return _upipe_ts_patd_get_nit(upipe, p);
         }
+        case UPIPE_TS_PATD_GET_CACHE_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_PATD_SIGNATURE)
+            struct upipe_ts_patd *upipe_ts_patd =
+                upipe_ts_patd_from_upipe(upipe);
+            uint64_t *hits_p = va_arg(args, uint64_t *);
+            uint64_t *misses_p = va_arg(args, uint64_t *);
+            return upipe_ts_psid_cache_get_stats(&upipe_ts_patd->cache,
+                                                 hits_p, misses_p);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -27,6 +27,7 @@
 #include "upipe/uref_block.h"
 #include "upipe/uref_clock.h"
 #include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
 #include "upipe/uclock.h"
 #include "upipe/upipe.h"
 #include "upipe/upipe_helper_upipe.h"
@@ -50,6 +51,8 @@
 #define POW2_33 UINT64_C(8589934592)
 /** max DTS/PTS delay */
 #define MAX_DELAY (UCLOCK_FREQ * 60)
+/** minimum size of a coalesced buffer for an unbounded PES */
+#define COALESCE_MIN_SIZE 4096
 
 /** @internal @This is the private context of a ts_pesd pipe. */
 struct upipe_ts_pesd {
@@ -76,6 +79,19 @@ struct upipe_ts_pesd {
     /** true if subsequent (non-start) packets have to be dropped */
     bool drop;
 
+    /** true if PES are coalesced in a contiguous buffer */
+    bool coalesce;
+    /** PES being coalesced */
+    struct uref *pes_uref;
+    /** number of octets written in the coalesced buffer */
+    size_t pes_fill;
+    /** allocated size of the coalesced buffer */
+    size_t pes_capacity;
+    /** true if the PES being coalesced has no length field */
+    bool pes_unbounded;
+    /** running average of the size of unbounded PES */
+    size_t pes_average;
+
     /** public upipe structure */
     struct upipe upipe;
 };
@@ -110,6 +126,11 @@ static struct upipe *upipe_ts_pesd_alloc(struct upipe_mgr *mgr,
     upipe_ts_pesd->drop = true;
     upipe_ts_pesd->next_uref = NULL;
     upipe_ts_pesd->next_uref_size = 0;
+    upipe_ts_pesd->coalesce = false;
+    upipe_ts_pesd->pes_uref = NULL;
+    upipe_ts_pesd->pes_fill = upipe_ts_pesd->pes_capacity = 0;
+    upipe_ts_pesd->pes_unbounded = false;
+    upipe_ts_pesd->pes_average = 0;
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -127,11 +148,184 @@ static void upipe_ts_pesd_flush(struct upipe *upipe, bool lost)
         upipe_ts_pesd->next_uref = NULL;
         upipe_ts_pesd->next_uref_size = 0;
     }
+    if (upipe_ts_pesd->pes_uref != NULL) {
+        uref_free(upipe_ts_pesd->pes_uref);
+        upipe_ts_pesd->pes_uref = NULL;
+    }
     if (lost)
         upipe_ts_pesd_sync_lost(upipe);
     upipe_ts_pesd->drop = true;
 }
 
+/** @internal @This outputs the coalesced PES.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_ts_pesd_output_pes(struct upipe *upipe,
+                                     struct upump **upump_p)
+{
+    struct upipe_ts_pesd *upipe_ts_pesd = upipe_ts_pesd_from_upipe(upipe);
+    struct uref *uref = upipe_ts_pesd->pes_uref;
+    upipe_ts_pesd->pes_uref = NULL;
+
+    if (upipe_ts_pesd->pes_unbounded) {
+        size_t average = upipe_ts_pesd->pes_average;
+        upipe_ts_pesd->pes_average = average ?
+            (average * 7 + upipe_ts_pesd->pes_fill) / 8 :
+            upipe_ts_pesd->pes_fill;
+    }
+
+    if (unlikely(!ubase_check(uref_block_resize(uref, 0,
+                                                upipe_ts_pesd->pes_fill)))) {
+        uref_free(uref);
+        upipe_throw_fatal(upipe, UBASE_ERR_INVALID);
+        return;
+    }
+    upipe_ts_pesd_output(upipe, uref, upump_p);
+}
+
+/** @internal @This copies a PES chunk into the coalesced buffer, growing it
+ * if needed.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref PES chunk
+ * @param size size of the PES chunk
+ * @return an error code
+ */
+static int upipe_ts_pesd_copy(struct upipe *upipe, struct uref *uref,
+                              size_t size)
+{
+    struct upipe_ts_pesd *upipe_ts_pesd = upipe_ts_pesd_from_upipe(upipe);
+    struct uref *pes_uref = upipe_ts_pesd->pes_uref;
+    if (unlikely(!size))
+        return UBASE_ERR_NONE;
+
+    if (unlikely(upipe_ts_pesd->pes_fill + size >
+                 upipe_ts_pesd->pes_capacity)) {
+        size_t capacity = upipe_ts_pesd->pes_capacity * 2;
+        if (capacity < upipe_ts_pesd->pes_fill + size)
+            capacity = upipe_ts_pesd->pes_fill + size;
+        UBASE_RETURN(uref_block_resize(pes_uref, 0, upipe_ts_pesd->pes_fill))
+        struct ubuf *ubuf = ubuf_block_copy(pes_uref->ubuf->mgr,
+                                            pes_uref->ubuf, 0, capacity);
+        UBASE_ALLOC_RETURN(ubuf)
+        uref_attach_ubuf(pes_uref, ubuf);
+        upipe_ts_pesd->pes_capacity = capacity;
+    }
+
+    int write_size = size;
+    uint8_t *buffer;
+    UBASE_RETURN(uref_block_write(pes_uref, upipe_ts_pesd->pes_fill,
+                                  &write_size, &buffer))
+    int err = uref_block_extract(uref, 0, size, buffer);
+    uref_block_unmap(pes_uref, upipe_ts_pesd->pes_fill);
+    UBASE_RETURN(err)
+    upipe_ts_pesd->pes_fill += size;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This starts coalescing a new PES.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref first PES chunk, without the PES header
+ * @param size size of the PES chunk
+ * @param pes_size expected size of the PES without its header, or 0 if the
+ * PES is unbounded
+ * @return an error code
+ */
+static int upipe_ts_pesd_start_pes(struct upipe *upipe, struct uref *uref,
+                                   size_t size, size_t pes_size)
+{
+    struct upipe_ts_pesd *upipe_ts_pesd = upipe_ts_pesd_from_upipe(upipe);
+    size_t capacity = pes_size;
+    if (!capacity) {
+        /* leave some room for a PES slightly larger than the average */
+        capacity = upipe_ts_pesd->pes_average +
+                   upipe_ts_pesd->pes_average / 8;
+        if (capacity < COALESCE_MIN_SIZE)
+            capacity = COALESCE_MIN_SIZE;
+    }
+    if (capacity < size)
+        capacity = size;
+
+    struct ubuf *ubuf = ubuf_block_alloc(uref->ubuf->mgr, capacity);
+    UBASE_ALLOC_RETURN(ubuf)
+    int write_size = size;
+    uint8_t *buffer;
+    int err = ubuf_block_write(ubuf, 0, &write_size, &buffer);
+    if (ubase_check(err)) {
+        err = uref_block_extract(uref, 0, size, buffer);
+        ubuf_block_unmap(ubuf, 0);
+    }
+    if (unlikely(!ubase_check(err))) {
+        ubuf_free(ubuf);
+        return err;
+    }
+
+    uref_attach_ubuf(uref, ubuf);
+    upipe_ts_pesd->pes_uref = uref;
+    upipe_ts_pesd->pes_fill = size;
+    upipe_ts_pesd->pes_capacity = capacity;
+    upipe_ts_pesd->pes_unbounded = !pes_size;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This coalesces a PES chunk, and outputs the PES when it is
+ * complete.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the buffer
+ * @param bounded true if the PES has a length field
+ * @param pes_left number of octets of the PES expected after this chunk
+ * @param end true if the chunk is the last one of the PES
+ */
+static void upipe_ts_pesd_coalesce(struct upipe *upipe, struct upump **upump_p,
+                                   bool bounded, size_t pes_left, bool end)
+{
+    struct upipe_ts_pesd *upipe_ts_pesd = upipe_ts_pesd_from_upipe(upipe);
+    struct uref *uref = upipe_ts_pesd->next_uref;
+    upipe_ts_pesd->next_uref = NULL;
+    size_t size;
+    int err = uref_block_size(uref, &size);
+
+    if (ubase_check(uref_block_get_start(uref))) {
+        if (upipe_ts_pesd->pes_uref != NULL)
+            upipe_ts_pesd_output_pes(upipe, upump_p);
+        if (ubase_check(err))
+            err = upipe_ts_pesd_start_pes(upipe, uref, size,
+                                          bounded ? size + pes_left : 0);
+        if (unlikely(!ubase_check(err))) {
+            /* output this PES without coalescing it */
+            upipe_warn(upipe, "unable to coalesce PES");
+            if (end)
+                uref_block_set_end(uref);
+            upipe_ts_pesd_output(upipe, uref, upump_p);
+            return;
+        }
+    } else if (upipe_ts_pesd->pes_uref != NULL) {
+        if (ubase_check(err))
+            err = upipe_ts_pesd_copy(upipe, uref, size);
+        uref_free(uref);
+        if (unlikely(!ubase_check(err))) {
+            upipe_ts_pesd_flush(upipe, false);
+            upipe_throw_fatal(upipe, err);
+            return;
+        }
+    } else {
+        /* the beginning of the PES was not coalesced */
+        if (end)
+            uref_block_set_end(uref);
+        upipe_ts_pesd_output(upipe, uref, upump_p);
+        return;
+    }
+
+    if (end) {
+        uref_block_set_end(upipe_ts_pesd->pes_uref);
+        upipe_ts_pesd_output_pes(upipe, upump_p);
+    }
+}
+
 /** @internal @This outputs a PES chunk, and checks if it is the end of the PES.
  *
  * @param upipe description structure of the pipe
@@ -143,10 +337,24 @@ static void upipe_ts_pesd_check_output(struct upipe *upipe,
     struct upipe_ts_pesd *upipe_ts_pesd = upipe_ts_pesd_from_upipe(upipe);
     upipe_ts_pesd_sync_acquired(upipe);
     upipe_ts_pesd->drop = false;
+    bool bounded = upipe_ts_pesd->next_pes_size != 0;
+    size_t pes_left = 0;
+    if (upipe_ts_pesd->next_uref_size < upipe_ts_pesd->next_pes_size)
+        pes_left = upipe_ts_pesd->next_pes_size -
+                   upipe_ts_pesd->next_uref_size;
+    bool end = false;
     if (upipe_ts_pesd->next_uref_size == upipe_ts_pesd->next_pes_size) {
-        uref_block_set_end(upipe_ts_pesd->next_uref);
+        end = true;
         upipe_ts_pesd->next_uref_size = upipe_ts_pesd->next_pes_size = 0;
     }
+
+    if (upipe_ts_pesd->coalesce) {
+        upipe_ts_pesd_coalesce(upipe, upump_p, bounded, pes_left, end);
+        return;
+    }
+
+    if (end)
+        uref_block_set_end(upipe_ts_pesd->next_uref);
     upipe_ts_pesd_output(upipe, upipe_ts_pesd->next_uref, upump_p);
     upipe_ts_pesd->next_uref = NULL;
 }
@@ -363,6 +571,21 @@ static int upipe_ts_pesd_set_flow_def(struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This sets whether PES are coalesced in a contiguous buffer.
+ *
+ * @param upipe description structure of the pipe
+ * @param coalesce true to coalesce PES
+ * @return an error code
+ */
+static int _upipe_ts_pesd_set_coalesce(struct upipe *upipe, bool coalesce)
+{
+    struct upipe_ts_pesd *upipe_ts_pesd = upipe_ts_pesd_from_upipe(upipe);
+    if (!coalesce && upipe_ts_pesd->pes_uref != NULL)
+        upipe_ts_pesd_output_pes(upipe, NULL);
+    upipe_ts_pesd->coalesce = coalesce;
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on a ts pesd pipe.
  *
  * @param upipe description structure of the pipe
@@ -378,6 +601,17 @@ static int upipe_ts_pesd_control(struct upipe *upipe, int command, va_list args)
             struct uref *flow_def = va_arg(args, struct uref *);
             return upipe_ts_pesd_set_flow_def(upipe, flow_def);
         }
+        case UPIPE_TS_PESD_GET_COALESCE: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_PESD_SIGNATURE)
+            int *coalesce_p = va_arg(args, int *);
+            *coalesce_p = upipe_ts_pesd_from_upipe(upipe)->coalesce ? 1 : 0;
+            return UBASE_ERR_NONE;
+        }
+        case UPIPE_TS_PESD_SET_COALESCE: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_PESD_SIGNATURE)
+            int coalesce = va_arg(args, int);
+            return _upipe_ts_pesd_set_coalesce(upipe, !!coalesce);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -397,6 +631,8 @@ static void upipe_ts_pesd_free(struct upipe *upipe)
 
     if (upipe_ts_pesd->next_uref != NULL)
         uref_free(upipe_ts_pesd->next_uref);
+    if (upipe_ts_pesd->pes_uref != NULL)
+        uref_free(upipe_ts_pesd->pes_uref);
     upipe_ts_pesd_clean_urefcount(upipe);
     upipe_ts_pesd_free_void(upipe);
 }
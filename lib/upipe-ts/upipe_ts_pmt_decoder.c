@@ -99,6 +99,8 @@ struct upipe_ts_pmtd {
 
     /** currently in effect PMT table */
     struct uref *pmt;
+    /** fingerprint of the current PMT section */
+    struct upipe_ts_psid_cache cache;
     /** list of flows */
     struct uchain flows;
 
@@ -139,6 +141,7 @@ static struct upipe *upipe_ts_pmtd_alloc(struct upipe_mgr *mgr,
     upipe_ts_pmtd_init_ubuf_mgr(upipe);
     upipe_ts_pmtd_init_flow_def(upipe);
     upipe_ts_pmtd->pmt = NULL;
+    upipe_ts_psid_cache_init(&upipe_ts_pmtd->cache);
     ulist_init(&upipe_ts_pmtd->flows);
     upipe_throw_ready(upipe);
     return upipe;
@@ -681,8 +684,9 @@ static void upipe_ts_pmtd_input(struct upipe *upipe, struct uref *uref,
 {
     struct upipe_ts_pmtd *upipe_ts_pmtd = upipe_ts_pmtd_from_upipe(upipe);
     assert(upipe_ts_pmtd->flow_def_input != NULL);
-    if (upipe_ts_pmtd->pmt != NULL &&
-        ubase_check(uref_block_equal(upipe_ts_pmtd->pmt, uref))) {
+    if (upipe_ts_psid_cache_check(&upipe_ts_pmtd->cache, uref) ||
+        (upipe_ts_pmtd->pmt != NULL &&
+         ubase_check(uref_block_equal(upipe_ts_pmtd->pmt, uref)))) {
         /* Identical PMT. */
         upipe_throw_new_rap(upipe, uref);
         uref_free(uref);
@@ -745,6 +749,8 @@ static void upipe_ts_pmtd_input(struct upipe *upipe, struct uref *uref,
     /* Switch tables. */
     uref_free(upipe_ts_pmtd->pmt);
     upipe_ts_pmtd->pmt = uref;
+    upipe_ts_psid_cache_reset(&upipe_ts_pmtd->cache);
+    upipe_ts_psid_cache_add(&upipe_ts_pmtd->cache, uref);
 
     upipe_split_throw_update(upipe);
 }
@@ -832,6 +838,15 @@ static int upipe_ts_pmtd_control(struct upipe *upipe, int command, va_list args)
             struct uref **p = va_arg(args, struct uref **);
             return upipe_ts_pmtd_iterate(upipe, p);
         }
+        case UPIPE_TS_PMTD_GET_CACHE_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_PMTD_SIGNATURE)
+            struct upipe_ts_pmtd *upipe_ts_pmtd =
+                upipe_ts_pmtd_from_upipe(upipe);
+            uint64_t *hits_p = va_arg(args, uint64_t *);
+            uint64_t *misses_p = va_arg(args, uint64_t *);
+            return upipe_ts_psid_cache_get_stats(&upipe_ts_pmtd->cache,
+                                                 hits_p, misses_p);
+        }
 
         default:
             return UBASE_ERR_UNHANDLED;
@@ -260,3 +260,219 @@ static inline int upipe_ts_psid_table_merge(struct uref **sections,
     }
     return UBASE_ERR_NONE;
 }
+
+/** @This is the fingerprint of a PSI section, as found in its header and
+ * CRC trailer. */
+struct upipe_ts_psid_fingerprint {
+    /** true if the fingerprint was filled in */
+    bool valid;
+    /** table id */
+    uint8_t table_id;
+    /** version number */
+    uint8_t version;
+    /** last section number */
+    uint8_t last_section;
+    /** table id extension */
+    uint16_t tableidext;
+    /** CRC32 of the section */
+    uint32_t crc;
+};
+
+/** @This is a cache of the fingerprints of the sections of the currently
+ * in effect table, allowing to drop repetitions without parsing them. */
+struct upipe_ts_psid_cache {
+    /** fingerprints indexed by section number */
+    struct upipe_ts_psid_fingerprint sections[PSI_TABLE_MAX_SECTIONS];
+    /** section number of the last checked section, or -1 */
+    int checked;
+    /** number of sections of the table being gathered */
+    unsigned int pending;
+    /** number of sections found in the cache */
+    uint64_t hits;
+    /** number of sections not found in the cache */
+    uint64_t misses;
+};
+
+/** @This reads the fingerprint of a PSI section.
+ *
+ * @param uref PSI section
+ * @param section_p filled in with the section number
+ * @param fingerprint filled in with the fingerprint
+ * @return false if the section is too short or has no long syntax
+ */
+static inline bool upipe_ts_psid_fingerprint_read(struct uref *uref,
+        uint8_t *section_p, struct upipe_ts_psid_fingerprint *fingerprint)
+{
+    size_t size;
+    if (unlikely(!ubase_check(uref_block_size(uref, &size)) ||
+                 size < PSI_HEADER_SIZE_SYNTAX1 + PSI_CRC_SIZE))
+        return false;
+
+    uint8_t buffer[PSI_HEADER_SIZE_SYNTAX1];
+    const uint8_t *section_header = uref_block_peek(uref, 0,
+                                                    PSI_HEADER_SIZE_SYNTAX1,
+                                                    buffer);
+    if (unlikely(section_header == NULL))
+        return false;
+    bool syntax = psi_get_syntax(section_header);
+    *section_p = psi_get_section(section_header);
+    fingerprint->table_id = psi_get_tableid(section_header);
+    fingerprint->version = psi_get_version(section_header);
+    fingerprint->last_section = psi_get_lastsection(section_header);
+    fingerprint->tableidext = psi_get_tableidext(section_header);
+    int err = uref_block_peek_unmap(uref, 0, buffer, section_header);
+    ubase_assert(err);
+    if (unlikely(!syntax))
+        return false;
+
+    uint8_t crc_buffer[PSI_CRC_SIZE];
+    const uint8_t *crc = uref_block_peek(uref, size - PSI_CRC_SIZE,
+                                         PSI_CRC_SIZE, crc_buffer);
+    if (unlikely(crc == NULL))
+        return false;
+    fingerprint->crc = ((uint32_t)crc[0] << 24) | (crc[1] << 16) |
+                       (crc[2] << 8) | crc[3];
+    err = uref_block_peek_unmap(uref, size - PSI_CRC_SIZE, crc_buffer, crc);
+    ubase_assert(err);
+    fingerprint->valid = true;
+    return true;
+}
+
+/** @This initializes a section cache.
+ *
+ * @param cache section cache
+ */
+static inline void upipe_ts_psid_cache_init(struct upipe_ts_psid_cache *cache)
+{
+    for (int i = 0; i < PSI_TABLE_MAX_SECTIONS; i++)
+        cache->sections[i].valid = false;
+    cache->checked = -1;
+    cache->pending = 0;
+    cache->hits = cache->misses = 0;
+}
+
+/** @This forgets all fingerprints of a section cache, keeping the counters.
+ *
+ * @param cache section cache
+ */
+static inline void upipe_ts_psid_cache_reset(struct upipe_ts_psid_cache *cache)
+{
+    for (int i = 0; i < PSI_TABLE_MAX_SECTIONS; i++)
+        cache->sections[i].valid = false;
+}
+
+/** @This records the fingerprint of a section that has just been accepted.
+ *
+ * @param cache section cache
+ * @param uref PSI section
+ */
+static inline void upipe_ts_psid_cache_add(struct upipe_ts_psid_cache *cache,
+                                           struct uref *uref)
+{
+    struct upipe_ts_psid_fingerprint fingerprint;
+    uint8_t n;
+    if (upipe_ts_psid_fingerprint_read(uref, &n, &fingerprint))
+        cache->sections[n] = fingerprint;
+}
+
+/** @This records the fingerprints of a table that has just been accepted or
+ * confirmed. This function may only be called if
+ * @ref upipe_ts_psid_table_validate is true.
+ *
+ * @param cache section cache
+ * @param sections PSI table
+ */
+static inline void upipe_ts_psid_cache_update(struct upipe_ts_psid_cache *cache,
+                                              struct uref **sections)
+{
+    upipe_ts_psid_cache_reset(cache);
+    upipe_ts_psid_table_foreach (sections, section) {
+        if (section != NULL)
+            upipe_ts_psid_cache_add(cache, section);
+    }
+}
+
+/** @This checks whether a section is a repetition of a section of the table
+ * in effect, by comparing table id, table id extension, version, section
+ * number and CRC32. Only the header and the trailer of the section are read.
+ *
+ * @param cache section cache
+ * @param uref PSI section
+ * @return true if the section is already known
+ */
+static inline bool upipe_ts_psid_cache_check(struct upipe_ts_psid_cache *cache,
+                                             struct uref *uref)
+{
+    struct upipe_ts_psid_fingerprint fingerprint;
+    uint8_t n;
+    cache->checked = -1;
+    if (upipe_ts_psid_fingerprint_read(uref, &n, &fingerprint)) {
+        struct upipe_ts_psid_fingerprint *cached = &cache->sections[n];
+        cache->checked = n;
+        if (cached->valid && cached->crc == fingerprint.crc &&
+            cached->table_id == fingerprint.table_id &&
+            cached->tableidext == fingerprint.tableidext &&
+            cached->version == fingerprint.version &&
+            cached->last_section == fingerprint.last_section) {
+            cache->hits++;
+            return true;
+        }
+    }
+    cache->misses++;
+    return false;
+}
+
+/** @This returns the counters of a section cache.
+ *
+ * @param cache section cache
+ * @param hits_p filled in with the number of sections found in the cache
+ * (may be NULL)
+ * @param misses_p filled in with the number of sections not found in the
+ * cache (may be NULL)
+ * @return an error code
+ */
+static inline int upipe_ts_psid_cache_get_stats(
+        struct upipe_ts_psid_cache *cache, uint64_t *hits_p, uint64_t *misses_p)
+{
+    if (hits_p != NULL)
+        *hits_p = cache->hits;
+    if (misses_p != NULL)
+        *misses_p = cache->misses;
+    return UBASE_ERR_NONE;
+}
+
+/** @This accounts for the last checked section, which is about to be
+ * inserted into the table being gathered. This function may only be called
+ * after @ref upipe_ts_psid_cache_check on the same section.
+ *
+ * @param cache section cache
+ * @param sections PSI table being gathered
+ */
+static inline void upipe_ts_psid_cache_gather(struct upipe_ts_psid_cache *cache,
+                                              struct uref **sections)
+{
+    if (cache->checked >= 0 && sections[cache->checked] == NULL)
+        cache->pending++;
+}
+
+/** @This signals that the table being gathered is complete, and will be
+ * emptied.
+ *
+ * @param cache section cache
+ */
+static inline void upipe_ts_psid_cache_gathered(
+        struct upipe_ts_psid_cache *cache)
+{
+    cache->pending = 0;
+}
+
+/** @This checks if the table being gathered already holds sections.
+ *
+ * @param cache section cache
+ * @return true if at least one section is pending
+ */
+static inline bool upipe_ts_psid_cache_pending(
+        struct upipe_ts_psid_cache *cache)
+{
+    return cache->pending != 0;
+}
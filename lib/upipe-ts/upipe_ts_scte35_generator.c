@@ -47,6 +47,7 @@
 #include "upipe-ts/upipe_ts_scte35_generator.h"
 #include "upipe-ts/upipe_ts_mux.h"
 #include "upipe-ts/uref_ts_scte35.h"
+#include "psi_crc.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -344,7 +345,7 @@ static struct ubuf *upipe_ts_scte35g_build_splice_insert(struct upipe *upipe,
 
     psi_set_length(scte35, scte35_get_descl(scte35) + PSI_CRC_SIZE - scte35 -
                                PSI_HEADER_SIZE + descl_length);
-    psi_set_crc(scte35);
+    upipe_psi_set_crc(scte35);
 
     uint16_t scte35_size = psi_get_length(scte35) + PSI_HEADER_SIZE;
     ubuf_block_unmap(ubuf, 0);
@@ -420,7 +421,7 @@ static struct ubuf *upipe_ts_scte35g_build_time_signal(struct upipe *upipe,
     psi_set_length(scte35,
                    scte35_get_descl(scte35) + PSI_CRC_SIZE -
                    scte35 - PSI_HEADER_SIZE + descl_length);
-    psi_set_crc(scte35);
+    upipe_psi_set_crc(scte35);
 
     uint16_t scte35_size = psi_get_length(scte35) + PSI_HEADER_SIZE;
     ubuf_block_unmap(ubuf, 0);
@@ -600,7 +601,7 @@ static void upipe_ts_scte35g_build_null(struct upipe *upipe)
     scte35_set_desclength(scte35, 0);
     psi_set_length(scte35,
             scte35_get_descl(scte35) + PSI_CRC_SIZE - scte35 - PSI_HEADER_SIZE);
-    psi_set_crc(scte35);
+    upipe_psi_set_crc(scte35);
 
     uint16_t scte35_size = psi_get_length(scte35) + PSI_HEADER_SIZE;
     ubuf_block_unmap(ubuf, 0);
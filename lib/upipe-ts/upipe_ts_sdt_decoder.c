@@ -40,6 +40,7 @@
 #include "upipe-ts/upipe_ts_sdt_decoder.h"
 #include "upipe-ts/uref_ts_flow.h"
 #include "upipe_ts_psi_decoder.h"
+#include "psi_crc.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
@@ -88,6 +89,8 @@ struct upipe_ts_sdtd {
     UPIPE_TS_PSID_TABLE_DECLARE(sdt);
     /** SDT table being gathered */
     UPIPE_TS_PSID_TABLE_DECLARE(next_sdt);
+    /** fingerprints of the sections of the current SDT */
+    struct upipe_ts_psid_cache cache;
     /** current TSID */
     int tsid;
     /** current original network ID */
@@ -140,6 +143,7 @@ static struct upipe *upipe_ts_sdtd_alloc(struct upipe_mgr *mgr,
     upipe_ts_sdtd_init_iconv(upipe);
     upipe_ts_psid_table_init(upipe_ts_sdtd->sdt);
     upipe_ts_psid_table_init(upipe_ts_sdtd->next_sdt);
+    upipe_ts_psid_cache_init(&upipe_ts_sdtd->cache);
     upipe_ts_sdtd->tsid = upipe_ts_sdtd->onid = -1;
     ulist_init(&upipe_ts_sdtd->services);
     upipe_throw_ready(upipe);
@@ -216,7 +220,7 @@ static bool upipe_ts_sdtd_table_validate(struct upipe *upipe)
                                                   &section))))
             return false;
 
-        if (!sdt_validate(section) || !psi_check_crc(section)) {
+        if (!sdt_validate(section) || !upipe_psi_check_crc(section)) {
             uref_block_unmap(section_uref, 0);
             return false;
         }
@@ -358,13 +362,23 @@ static void upipe_ts_sdtd_input(struct upipe *upipe, struct uref *uref,
     struct upipe_ts_sdtd *upipe_ts_sdtd = upipe_ts_sdtd_from_upipe(upipe);
     assert(upipe_ts_sdtd->flow_def_input != NULL);
 
+    if (upipe_ts_psid_cache_check(&upipe_ts_sdtd->cache, uref) &&
+        !upipe_ts_psid_cache_pending(&upipe_ts_sdtd->cache)) {
+        /* Repetition of a section of the current SDT. */
+        uref_free(uref);
+        return;
+    }
+
+    upipe_ts_psid_cache_gather(&upipe_ts_sdtd->cache, upipe_ts_sdtd->next_sdt);
     if (!upipe_ts_psid_table_section(upipe_ts_sdtd->next_sdt, uref))
         return;
+    upipe_ts_psid_cache_gathered(&upipe_ts_sdtd->cache);
 
     if (upipe_ts_psid_table_validate(upipe_ts_sdtd->sdt) &&
         upipe_ts_psid_table_compare(upipe_ts_sdtd->sdt,
                                     upipe_ts_sdtd->next_sdt)) {
         /* Identical SDT. */
+        upipe_ts_psid_cache_update(&upipe_ts_sdtd->cache, upipe_ts_sdtd->sdt);
         upipe_ts_psid_table_clean(upipe_ts_sdtd->next_sdt);
         upipe_ts_psid_table_init(upipe_ts_sdtd->next_sdt);
         return;
@@ -433,6 +447,7 @@ static void upipe_ts_sdtd_input(struct upipe *upipe, struct uref *uref,
         upipe_ts_psid_table_clean(upipe_ts_sdtd->sdt);
     upipe_ts_psid_table_copy(upipe_ts_sdtd->sdt, upipe_ts_sdtd->next_sdt);
     upipe_ts_psid_table_init(upipe_ts_sdtd->next_sdt);
+    upipe_ts_psid_cache_update(&upipe_ts_sdtd->cache, upipe_ts_sdtd->sdt);
 
     upipe_split_throw_update(upipe);
 }
@@ -520,6 +535,15 @@ static int upipe_ts_sdtd_control(struct upipe *upipe, int command, va_list args)
             struct uref **p = va_arg(args, struct uref **);
             return upipe_ts_sdtd_iterate(upipe, p);
         }
+        case UPIPE_TS_SDTD_GET_CACHE_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_TS_SDTD_SIGNATURE)
+            struct upipe_ts_sdtd *upipe_ts_sdtd =
+                upipe_ts_sdtd_from_upipe(upipe);
+            uint64_t *hits_p = va_arg(args, uint64_t *);
+            uint64_t *misses_p = va_arg(args, uint64_t *);
+            return upipe_ts_psid_cache_get_stats(&upipe_ts_sdtd->cache,
+                                                 hits_p, misses_p);
+        }
 
         default:
             return UBASE_ERR_UNHANDLED;
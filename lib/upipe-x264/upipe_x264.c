@@ -40,12 +40,16 @@
 #include "upipe/uref_block.h"
 #include "upipe/uref_block_flow.h"
 #include "upipe/ubuf_block.h"
+#include "upipe/upump.h"
+#include "upipe/ueventfd.h"
 #include "upipe/upipe.h"
 #include "upipe/upipe_helper_upipe.h"
 #include "upipe/upipe_helper_urefcount.h"
 #include "upipe/upipe_helper_void.h"
 #include "upipe/upipe_helper_ubuf_mgr.h"
 #include "upipe/upipe_helper_uclock.h"
+#include "upipe/upipe_helper_upump_mgr.h"
+#include "upipe/upipe_helper_upump.h"
 #include "upipe/upipe_helper_output.h"
 #include "upipe/upipe_helper_input.h"
 #include "upipe/upipe_helper_flow_format.h"
@@ -60,6 +64,9 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <x264.h>
 #include <bitstream/mpeg/h264.h>
@@ -69,6 +76,67 @@
 #define OUT_FLOW "block.h264.pic."
 #define OUT_FLOW_MPEG2 "block.mpeg2video.pic."
 
+/** @internal @This is a frame submitted to the encoder thread. */
+struct upipe_x264_job {
+    /** structure for double-linked lists */
+    struct uchain uchain;
+    /** input picture, with its planes mapped */
+    struct uref *uref;
+    /** mapped planes */
+    const char **chromas;
+    /** number of mapped planes */
+    int chromas_count;
+    /** x264 picture, in and then out */
+    x264_picture_t pic;
+    /** ubuf manager for the encoded frame */
+    struct ubuf_mgr *ubuf_mgr;
+
+    /** return value of the encoder */
+    int ret;
+    /** time base of the encoder */
+    uint32_t timebase_num, timebase_den;
+    /** NAL units of the encoded frame (payload pointers are not valid) */
+    x264_nal_t *nals;
+    /** number of NAL units */
+    int nals_num;
+    /** encoded frame, or NULL in case of allocation error */
+    struct ubuf *ubuf;
+};
+
+UBASE_FROM_TO(upipe_x264_job, uchain, uchain, uchain)
+
+/** @internal @This is the state of the encoder thread. The encoder is only
+ * touched by the pipe when no job is running. */
+struct upipe_x264_thread {
+    /** encoder thread */
+    pthread_t thread;
+    /** true if the thread was started */
+    bool started;
+    /** true if the thread must exit */
+    bool quit;
+    /** mutex protecting the fields below */
+    pthread_mutex_t mutex;
+    /** condition signaled when a job is submitted or done */
+    pthread_cond_t cond;
+    /** jobs waiting for the encoder */
+    struct uchain jobs;
+    /** encoded jobs waiting for the pipe */
+    struct uchain done;
+    /** number of jobs submitted and not encoded yet */
+    unsigned int running;
+#ifdef HAVE_X264_OBE
+    /** speedcontrol buffer fill to apply before the next frame */
+    float sc_fill;
+    /** true if sc_fill must be applied */
+    bool sc_pending;
+#endif
+
+    /** event signaled when a job is done */
+    struct ueventfd event;
+    /** number of jobs submitted and not output yet (pipe side) */
+    unsigned int nb_jobs;
+};
+
 /** @internal upipe_x264 private structure */
 struct upipe_x264 {
     /** refcount management structure */
@@ -123,6 +191,12 @@ struct upipe_x264 {
     struct uref *flow_def_requested;
     /** requested headers */
     bool headers_requested;
+    /** maximum number of delayed frames of the encoder */
+    int delayed_frames;
+    /** global headers of the encoder */
+    uint8_t *headers;
+    /** size of the global headers */
+    int headers_size;
     /** requested encaps */
     enum uref_h26x_encaps encaps_requested;
     /** output flow */
@@ -154,6 +228,15 @@ struct upipe_x264 {
     /** last input PTS (system time) */
     uint64_t input_pts_sys;
 
+    /** upump manager */
+    struct upump_mgr *upump_mgr;
+    /** watcher of the encoded frames, in asynchronous mode */
+    struct upump *upump;
+    /** maximum number of frames queued to the encoder thread, or 0 */
+    unsigned int async_depth;
+    /** encoder thread */
+    struct upipe_x264_thread thread;
+
     /** public structure */
     struct upipe upipe;
 };
@@ -184,6 +267,8 @@ UPIPE_HELPER_UBUF_MGR(upipe_x264, ubuf_mgr, flow_format, ubuf_mgr_request,
                       upipe_x264_register_output_request,
                       upipe_x264_unregister_output_request)
 UPIPE_HELPER_UCLOCK(upipe_x264, uclock, uclock_request, NULL, upipe_throw_provide_request, NULL)
+UPIPE_HELPER_UPUMP_MGR(upipe_x264, upump_mgr)
+UPIPE_HELPER_UPUMP(upipe_x264, upump, upump_mgr)
 
 /** @internal loglevel map from x264 to uprobe_log */
 static const enum uprobe_log_level loglevel_map[] = {
@@ -221,6 +306,61 @@ static inline bool upipe_x264_mpeg2_enabled(struct upipe *upipe)
 #endif
 }
 
+/** @internal @This waits until the encoder thread has encoded all the
+ * submitted frames, so that the encoder may be used by the pipe.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x264_wait(struct upipe *upipe)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+    if (!thread->started)
+        return;
+
+    pthread_mutex_lock(&thread->mutex);
+    while (thread->running)
+        pthread_cond_wait(&thread->cond, &thread->mutex);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
+/** @hidden */
+static void upipe_x264_drain(struct upipe *upipe);
+
+/** @internal @This reads the encoder properties used by the flow definition,
+ * so that it can be built without waiting for the encoder thread. The
+ * encoder must not be in use by the thread.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x264_read_encoder(struct upipe *upipe)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    upipe_x264->delayed_frames =
+        x264_encoder_maximum_delayed_frames(upipe_x264->encoder);
+
+    free(upipe_x264->headers);
+    upipe_x264->headers = NULL;
+    upipe_x264->headers_size = 0;
+
+    int i, ret, nal_num, size = 0;
+    x264_nal_t *nals;
+    ret = x264_encoder_headers(upipe_x264->encoder, &nals, &nal_num);
+    if (unlikely(ret < 0)) {
+        upipe_warn(upipe, "unable to get encoder headers");
+        return;
+    }
+    for (i = 0; i < nal_num; i++)
+        size += nals[i].i_payload;
+    upipe_x264->headers = malloc(size);
+    if (unlikely(upipe_x264->headers == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    memcpy(upipe_x264->headers, nals[0].p_payload, size);
+    upipe_x264->headers_size = size;
+}
+
 /** @internal @This reconfigures encoder with updated parameters
  * @param upipe description structure of the pipe
  * @return an error code
@@ -232,8 +372,12 @@ static int _upipe_x264_reconfigure(struct upipe *upipe)
     if (unlikely(!upipe_x264->encoder)) {
         return UBASE_ERR_UNHANDLED;
     }
+    upipe_x264_wait(upipe);
     ret = x264_encoder_reconfig(upipe_x264->encoder, &upipe_x264->params);
-    return ( (ret < 0) ? UBASE_ERR_EXTERNAL : UBASE_ERR_NONE );
+    if (ret < 0)
+        return UBASE_ERR_EXTERNAL;
+    upipe_x264_read_encoder(upipe);
+    return UBASE_ERR_NONE;
 }
 
 /** @internal @This reset parameters to default
@@ -384,6 +528,9 @@ static struct upipe *upipe_x264_alloc(struct upipe_mgr *mgr,
     upipe_x264_init_flow_def_check(upipe);
     upipe_x264->flow_def_requested = NULL;
     upipe_x264->headers_requested = false;
+    upipe_x264->delayed_frames = -1;
+    upipe_x264->headers = NULL;
+    upipe_x264->headers_size = 0;
     upipe_x264->encaps_requested = UREF_H26X_ENCAPS_ANNEXB;
     upipe_x264->sar.num = upipe_x264->sar.den = 1;
     upipe_x264->overscan = 0; /* undef */
@@ -395,6 +542,19 @@ static struct upipe *upipe_x264_alloc(struct upipe_mgr *mgr,
     upipe_x264->input_pts = UINT64_MAX;
     upipe_x264->input_pts_sys = UINT64_MAX;
 
+    upipe_x264_init_upump_mgr(upipe);
+    upipe_x264_init_upump(upipe);
+    upipe_x264->async_depth = 0;
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+    thread->started = false;
+    thread->quit = false;
+    pthread_mutex_init(&thread->mutex, NULL);
+    pthread_cond_init(&thread->cond, NULL);
+    ulist_init(&thread->jobs);
+    ulist_init(&thread->done);
+    thread->running = 0;
+    thread->nb_jobs = 0;
+
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -481,6 +641,7 @@ static bool upipe_x264_open(struct upipe *upipe, int width, int height)
 
     /* sync pipe parameters with internal copy */
     x264_encoder_parameters(upipe_x264->encoder, params);
+    upipe_x264_read_encoder(upipe);
 
     /* flow definition */
     struct uref *flow_def_attr = upipe_x264_alloc_flow_def_attr(upipe);
@@ -630,6 +791,7 @@ static void upipe_x264_close(struct upipe *upipe)
 {
     struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
     if (upipe_x264->encoder) {
+        upipe_x264_drain(upipe);
         while(x264_encoder_delayed_frames(upipe_x264->encoder)) {
             upipe_x264_handle(upipe, NULL, NULL);
         }
@@ -637,6 +799,9 @@ static void upipe_x264_close(struct upipe *upipe)
         upipe_notice(upipe, "closing encoder");
         x264_encoder_close(upipe_x264->encoder);
         upipe_x264->encoder = NULL;
+        free(upipe_x264->headers);
+        upipe_x264->headers = NULL;
+        upipe_x264->headers_size = 0;
     }
 }
 
@@ -657,7 +822,7 @@ static void upipe_x264_build_flow_def(struct upipe *upipe)
 
     /* find latency */
     uint64_t latency = upipe_x264->input_latency;
-    int delayed = x264_encoder_maximum_delayed_frames(upipe_x264->encoder);
+    int delayed = upipe_x264->delayed_frames;
     if (delayed >= 0)
         latency += (uint64_t)delayed * UCLOCK_FREQ
                      * upipe_x264->params.i_fps_den
@@ -671,26 +836,464 @@ static void upipe_x264_build_flow_def(struct upipe *upipe)
     uref_clock_set_latency(flow_def, latency);
 
     /* global headers (extradata) */
-    if (upipe_x264->headers_requested) {
-        int i, ret, nal_num, size = 0;
-        x264_nal_t *nals;
-        ret = x264_encoder_headers(upipe_x264->encoder, &nals, &nal_num);
-        if (unlikely(ret < 0)) {
-            upipe_warn(upipe, "unable to get encoder headers");
-        } else {
-            for (i=0; i < nal_num; i++) {
-                size += nals[i].i_payload;
-            }
-            UBASE_FATAL(upipe,
-                uref_flow_set_headers(flow_def, nals[0].p_payload, size))
-        }
-    }
+    if (upipe_x264->headers_requested && upipe_x264->headers != NULL)
+        UBASE_FATAL(upipe,
+            uref_flow_set_headers(flow_def, upipe_x264->headers,
+                                  upipe_x264->headers_size))
     UBASE_FATAL(upipe,
             uref_h26x_flow_set_encaps(flow_def, upipe_x264->encaps_requested))
 
     upipe_x264_store_flow_def(upipe, flow_def);
 }
 
+/** @internal @This allocates a block containing the NAL units of an encoded
+ * frame, which x264 returns contiguously.
+ *
+ * @param ubuf_mgr block ubuf manager
+ * @param nals NAL units
+ * @param nals_num number of NAL units
+ * @return pointer to ubuf, or NULL in case of allocation error
+ */
+static struct ubuf *upipe_x264_alloc_nals(struct ubuf_mgr *ubuf_mgr,
+                                          const x264_nal_t *nals,
+                                          int nals_num)
+{
+    int size = 0;
+    for (int i = 0; i < nals_num; i++)
+        size += nals[i].i_payload;
+
+    struct ubuf *ubuf = ubuf_block_alloc(ubuf_mgr, size);
+    if (unlikely(ubuf == NULL))
+        return NULL;
+    uint8_t *buf;
+    if (unlikely(!ubase_check(ubuf_block_write(ubuf, 0, &size, &buf)))) {
+        ubuf_free(ubuf);
+        return NULL;
+    }
+    memcpy(buf, nals[0].p_payload, size);
+    ubuf_block_unmap(ubuf, 0);
+    return ubuf;
+}
+
+/** @internal @This sets the attributes of an encoded frame and outputs it.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure, with the encoded frame attached
+ * @param pic output x264 picture
+ * @param nals NAL units of the frame
+ * @param nals_num number of NAL units
+ * @param timebase_num numerator of the time base of the encoder
+ * @param timebase_den denominator of the time base of the encoder
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_x264_output_frame(struct upipe *upipe, struct uref *uref,
+                                    const x264_picture_t *pic,
+                                    const x264_nal_t *nals, int nals_num,
+                                    uint32_t timebase_num,
+                                    uint32_t timebase_den,
+                                    struct upump **upump_p)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    int header_size = 0;
+    for (int i = 0; i < nals_num; i++) {
+        if (nals[i].i_type == NAL_SPS || nals[i].i_type == NAL_PPS ||
+            nals[i].i_type == NAL_AUD || nals[i].i_type == NAL_FILLER ||
+            nals[i].i_type == NAL_UNKNOWN)
+            header_size += nals[i].i_payload;
+    }
+
+    uref_block_set_header_size(uref, header_size);
+
+    if (!upipe_x264_mpeg2_enabled(upipe)) {
+        /* NAL offsets */
+        uint64_t offset = 0;
+        for (int i = 0; i < nals_num - 1; i++) {
+            offset += nals[i].i_payload;
+            uref_h26x_set_nal_offset(uref, offset, i);
+        }
+
+        /* optionally convert NAL encapsulation */
+        enum uref_h26x_encaps encaps = upipe_x264->params.b_annexb ?
+            UREF_H26X_ENCAPS_ANNEXB : UREF_H26X_ENCAPS_LENGTH4;
+        /* no need for annex B header because if annexb is requested, there
+         * will be no conversion */
+        int err = upipe_h26xf_convert_frame(uref,
+                encaps, upipe_x264->encaps_requested, upipe_x264->ubuf_mgr,
+                NULL);
+        if (!ubase_check(err)) {
+            upipe_warn(upipe, "invalid NAL encapsulation conversion");
+            upipe_throw_error(upipe, err);
+        }
+    }
+
+    /* set dts */
+    uint64_t dts_pts_delay = (uint64_t)(pic->i_pts - pic->i_dts) * UCLOCK_FREQ
+                              * timebase_num / timebase_den;
+    uref_clock_set_dts_pts_delay(uref, dts_pts_delay);
+    uref_clock_delete_cr_dts_delay(uref);
+
+    /* rebase to dts as we're in encoded domain now */
+    uint64_t dts = UINT64_MAX;
+    if ((!ubase_check(uref_clock_get_dts_prog(uref, &dts)) ||
+         dts < upipe_x264->last_dts) &&
+        upipe_x264->last_dts != UINT64_MAX) {
+        upipe_warn_va(upipe, "DTS prog in the past, resetting (%"PRIu64" ms)",
+                      (upipe_x264->last_dts - dts) * 1000 / UCLOCK_FREQ);
+        dts = upipe_x264->last_dts + 1;
+        uref_clock_set_dts_prog(uref, dts);
+    } else
+        uref_clock_rebase_dts_prog(uref);
+
+    uint64_t dts_sys = UINT64_MAX;
+    if (dts != UINT64_MAX &&
+        upipe_x264->input_pts != UINT64_MAX &&
+        upipe_x264->input_pts_sys != UINT64_MAX) {
+        dts_sys = (int64_t)upipe_x264->input_pts_sys +
+            ((int64_t)dts - (int64_t)upipe_x264->input_pts) *
+            (int64_t)upipe_x264->drift_rate.num /
+            (int64_t)upipe_x264->drift_rate.den;
+        uref_clock_set_dts_sys(uref, dts_sys);
+    } else if (!ubase_check(uref_clock_get_dts_sys(uref, &dts_sys)) ||
+        (upipe_x264->last_dts_sys != UINT64_MAX &&
+               dts_sys < upipe_x264->last_dts_sys)) {
+        upipe_warn_va(upipe,
+                      "DTS sys in the past, resetting (%"PRIu64" ms)",
+                      (upipe_x264->last_dts_sys - dts_sys) * 1000 /
+                      UCLOCK_FREQ);
+        dts_sys = upipe_x264->last_dts_sys + 1;
+        uref_clock_set_dts_sys(uref, dts_sys);
+    } else
+        uref_clock_rebase_dts_sys(uref);
+
+    uref_clock_rebase_dts_orig(uref);
+    uref_clock_set_rate(uref, upipe_x264->drift_rate);
+
+    upipe_x264->last_dts = dts;
+    upipe_x264->last_dts_sys = dts_sys;
+
+#ifdef HAVE_X264_OBE
+    /* speedcontrol */
+    if (dts_sys != UINT64_MAX && upipe_x264->uclock != NULL &&
+        upipe_x264->sc_latency) {
+        uint64_t systime = uclock_now(upipe_x264->uclock);
+        int64_t buffer_state = dts_sys + upipe_x264->initial_latency +
+                               upipe_x264->sc_latency - systime;
+        float buffer_fill = (float)buffer_state /
+                            (float)upipe_x264->sc_latency;
+        struct upipe_x264_thread *thread = &upipe_x264->thread;
+        if (thread->started) {
+            /* the encoder thread applies it before the next frame */
+            pthread_mutex_lock(&thread->mutex);
+            thread->sc_fill = buffer_fill;
+            thread->sc_pending = true;
+            pthread_mutex_unlock(&thread->mutex);
+        } else
+            x264_speedcontrol_sync(upipe_x264->encoder, buffer_fill, 0, 1);
+    }
+#endif
+
+    if (pic->b_keyframe) {
+        uref_flow_set_random(uref);
+    }
+
+    if (upipe_x264->flow_def == NULL)
+        upipe_x264_build_flow_def(upipe);
+
+    upipe_x264_output(upipe, uref, upump_p);
+}
+
+/** @internal @This encodes a frame in the encoder thread, and copies the
+ * NAL units before x264 recycles them at the next call.
+ *
+ * @param encoder x264 encoder
+ * @param job frame to encode
+ */
+static void upipe_x264_thread_encode(x264_t *encoder,
+                                     struct upipe_x264_job *job)
+{
+    x264_nal_t *nals;
+    int nals_num;
+    job->ret = x264_encoder_encode(encoder, &nals, &nals_num,
+                                   &job->pic, &job->pic);
+    if (job->ret <= 0)
+        return;
+
+    x264_param_t curparams;
+    x264_encoder_parameters(encoder, &curparams);
+    job->timebase_num = curparams.i_timebase_num;
+    job->timebase_den = curparams.i_timebase_den;
+
+    job->nals = malloc(sizeof(x264_nal_t) * nals_num);
+    if (likely(job->nals != NULL)) {
+        memcpy(job->nals, nals, sizeof(x264_nal_t) * nals_num);
+        job->nals_num = nals_num;
+        job->ubuf = upipe_x264_alloc_nals(job->ubuf_mgr, nals, nals_num);
+    }
+}
+
+/** @internal @This is the main loop of the encoder thread.
+ *
+ * @param _upipe_x264 private structure of the pipe
+ * @return NULL
+ */
+static void *upipe_x264_thread_run(void *_upipe_x264)
+{
+    struct upipe_x264 *upipe_x264 = _upipe_x264;
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+
+    pthread_mutex_lock(&thread->mutex);
+    for ( ; ; ) {
+        struct uchain *uchain = ulist_pop(&thread->jobs);
+        if (uchain == NULL) {
+            if (thread->quit)
+                break;
+            pthread_cond_wait(&thread->cond, &thread->mutex);
+            continue;
+        }
+        struct upipe_x264_job *job = upipe_x264_job_from_uchain(uchain);
+        x264_t *encoder = upipe_x264->encoder;
+#ifdef HAVE_X264_OBE
+        bool sc_pending = thread->sc_pending;
+        float sc_fill = thread->sc_fill;
+        thread->sc_pending = false;
+#endif
+        pthread_mutex_unlock(&thread->mutex);
+
+#ifdef HAVE_X264_OBE
+        if (sc_pending)
+            x264_speedcontrol_sync(encoder, sc_fill, 0, 1);
+#endif
+        upipe_x264_thread_encode(encoder, job);
+
+        pthread_mutex_lock(&thread->mutex);
+        ulist_add(&thread->done, upipe_x264_job_to_uchain(job));
+        thread->running--;
+        pthread_cond_broadcast(&thread->cond);
+        ueventfd_write(&thread->event);
+    }
+    pthread_mutex_unlock(&thread->mutex);
+    return NULL;
+}
+
+/** @internal @This outputs the frames encoded by the encoder thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_x264_process(struct upipe *upipe, struct upump **upump_p)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+
+    for ( ; ; ) {
+        pthread_mutex_lock(&thread->mutex);
+        struct uchain *uchain = ulist_pop(&thread->done);
+        pthread_mutex_unlock(&thread->mutex);
+        if (uchain == NULL)
+            break;
+
+        struct upipe_x264_job *job = upipe_x264_job_from_uchain(uchain);
+        thread->nb_jobs--;
+
+        /* unmap */
+        for (int i = 0; i < job->chromas_count; i++)
+            uref_pic_plane_unmap(job->uref, job->chromas[i], 0, 0, -1, -1);
+        ubuf_free(uref_detach_ubuf(job->uref));
+        ubuf_mgr_release(job->ubuf_mgr);
+
+        if (unlikely(job->ret < 0)) {
+            upipe_warn(upipe, "Error encoding frame");
+            uref_free(job->uref);
+        } else if (unlikely(job->ret == 0)) {
+            upipe_verbose(upipe, "No nal units returned");
+        } else if (unlikely(job->ubuf == NULL)) {
+            uref_free(job->pic.opaque);
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        } else {
+            /* get uref back */
+            struct uref *uref = job->pic.opaque;
+            assert(uref);
+            uref_attach_ubuf(uref, job->ubuf);
+            upipe_x264_output_frame(upipe, uref, &job->pic,
+                                    job->nals, job->nals_num,
+                                    job->timebase_num, job->timebase_den,
+                                    upump_p);
+        }
+        free(job->nals);
+        free(job);
+    }
+}
+
+/** @internal @This outputs the buffered input once the encoder thread has
+ * room for it.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x264_resume_input(struct upipe *upipe)
+{
+    bool was_buffered = !upipe_x264_check_input(upipe);
+    upipe_x264_output_input(upipe);
+    upipe_x264_unblock_input(upipe);
+    if (was_buffered && upipe_x264_check_input(upipe)) {
+        /* All packets have been output, release again the pipe that has been
+         * used in @ref upipe_x264_input. */
+        upipe_release(upipe);
+    }
+}
+
+/** @internal @This is called when the encoder thread has encoded frames.
+ *
+ * @param upump description structure of the watcher
+ */
+static void upipe_x264_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+
+    ueventfd_read(&upipe_x264->thread.event);
+    upipe_x264_process(upipe, &upump);
+    upipe_x264_resume_input(upipe);
+}
+
+/** @internal @This waits for the encoder thread and outputs all the frames
+ * it has encoded.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x264_drain(struct upipe *upipe)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    if (!upipe_x264->thread.started)
+        return;
+
+    upipe_x264_wait(upipe);
+    upipe_x264_process(upipe, NULL);
+}
+
+/** @internal @This starts the encoder thread if it is not running yet, or
+ * falls back to synchronous encoding if it cannot be started.
+ *
+ * @param upipe description structure of the pipe
+ * @return true if the encoder thread is running
+ */
+static bool upipe_x264_thread_start(struct upipe *upipe)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+    if (likely(thread->started))
+        return true;
+
+    upipe_x264_check_upump_mgr(upipe);
+    if (unlikely(upipe_x264->upump_mgr == NULL)) {
+        upipe_warn(upipe, "no upump manager, encoding synchronously");
+        upipe_x264->async_depth = 0;
+        return false;
+    }
+
+    if (unlikely(!ueventfd_init(&thread->event, false))) {
+        upipe_warn(upipe, "unable to create eventfd, encoding synchronously");
+        upipe_x264->async_depth = 0;
+        return false;
+    }
+
+    struct upump *upump = ueventfd_upump_alloc(&thread->event,
+            upipe_x264->upump_mgr, upipe_x264_worker, upipe, upipe->refcount);
+    if (unlikely(upump == NULL)) {
+        upipe_warn(upipe, "unable to allocate pump, encoding synchronously");
+        ueventfd_clean(&thread->event);
+        upipe_x264->async_depth = 0;
+        return false;
+    }
+
+    thread->quit = false;
+    thread->running = 0;
+    thread->nb_jobs = 0;
+#ifdef HAVE_X264_OBE
+    thread->sc_pending = false;
+#endif
+    if (unlikely(pthread_create(&thread->thread, NULL,
+                                upipe_x264_thread_run, upipe_x264) != 0)) {
+        upipe_warn(upipe, "unable to create thread, encoding synchronously");
+        upump_free(upump);
+        ueventfd_clean(&thread->event);
+        upipe_x264->async_depth = 0;
+        return false;
+    }
+
+    upump_start(upump);
+    upipe_x264_set_upump(upipe, upump);
+    thread->started = true;
+    upipe_dbg_va(upipe, "started encoder thread (depth %u)",
+                 upipe_x264->async_depth);
+    return true;
+}
+
+/** @internal @This outputs the pending frames and stops the encoder thread.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x264_thread_stop(struct upipe *upipe)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+    if (!thread->started)
+        return;
+
+    upipe_x264_drain(upipe);
+
+    pthread_mutex_lock(&thread->mutex);
+    thread->quit = true;
+    pthread_cond_broadcast(&thread->cond);
+    pthread_mutex_unlock(&thread->mutex);
+    pthread_join(thread->thread, NULL);
+
+    upipe_x264_set_upump(upipe, NULL);
+    ueventfd_clean(&thread->event);
+    thread->started = false;
+}
+
+/** @internal @This submits a mapped picture to the encoder thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref input picture, with its planes mapped
+ * @param pic x264 picture pointing to the planes
+ * @param chromas mapped planes
+ * @param chromas_count number of mapped planes
+ */
+static void upipe_x264_submit(struct upipe *upipe, struct uref *uref,
+                              const x264_picture_t *pic,
+                              const char **chromas, int chromas_count)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    struct upipe_x264_thread *thread = &upipe_x264->thread;
+
+    struct upipe_x264_job *job = malloc(sizeof(struct upipe_x264_job));
+    if (unlikely(job == NULL)) {
+        for (int i = 0; i < chromas_count; i++)
+            uref_pic_plane_unmap(uref, chromas[i], 0, 0, -1, -1);
+        uref_free(uref);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    uchain_init(&job->uchain);
+    job->uref = uref;
+    job->chromas = chromas;
+    job->chromas_count = chromas_count;
+    job->pic = *pic;
+    job->ubuf_mgr = ubuf_mgr_use(upipe_x264->ubuf_mgr);
+    job->ret = 0;
+    job->nals = NULL;
+    job->nals_num = 0;
+    job->ubuf = NULL;
+    thread->nb_jobs++;
+
+    pthread_mutex_lock(&thread->mutex);
+    ulist_add(&thread->jobs, upipe_x264_job_to_uchain(job));
+    thread->running++;
+    pthread_cond_broadcast(&thread->cond);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
 /** @internal @This checks incoming pic against cached parameters.
  *
  * @param upipe description structure of the pipe
@@ -731,6 +1334,8 @@ static bool upipe_x264_handle(struct upipe *upipe, struct uref *uref,
     struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
     const char *def;
     if (unlikely(uref != NULL && ubase_check(uref_flow_get_def(uref, &def)))) {
+        /* frames of the previous flow are output first */
+        upipe_x264_drain(upipe);
         upipe_x264->input_latency = 0;
         uref_clock_get_latency(uref, &upipe_x264->input_latency);
         upipe_x264_store_flow_def(upipe, NULL);
@@ -788,9 +1393,7 @@ static bool upipe_x264_handle(struct upipe *upipe, struct uref *uref,
     size_t width, height;
     x264_picture_t pic;
     x264_nal_t *nals;
-    int i, nals_num, size = 0, header_size = 0;
-    struct ubuf *ubuf_block;
-    uint8_t *buf = NULL;
+    int i, nals_num;
     x264_param_t curparams;
     bool needopen = false;
     int ret = 0;
@@ -816,6 +1419,7 @@ static bool upipe_x264_handle(struct upipe *upipe, struct uref *uref,
             needopen = true;
         }
         if (unlikely(needopen)) {
+            upipe_x264_drain(upipe);
             if (unlikely(!upipe_x264_open(upipe, width, height))) {
                 upipe_err(upipe, "Could not open encoder");
                 uref_free(uref);
@@ -825,7 +1429,10 @@ static bool upipe_x264_handle(struct upipe *upipe, struct uref *uref,
         if (upipe_x264->flow_def_requested == NULL)
             return false;
 
-        x264_encoder_parameters(upipe_x264->encoder, &curparams);
+        bool async = upipe_x264->async_depth &&
+                     upipe_x264_thread_start(upipe);
+        if (async && upipe_x264->thread.nb_jobs >= upipe_x264->async_depth)
+            return false;
 
         pic.img.i_csp = upipe_x264->chroma_subsampling;
 
@@ -906,9 +1513,15 @@ static bool upipe_x264_handle(struct upipe *upipe, struct uref *uref,
         }
         pic.img.i_plane = i;
 
+        if (async) {
+            upipe_x264_submit(upipe, uref, &pic, chromas, chromas_count);
+            return true;
+        }
+
         /* encode frame ! */
         ret = x264_encoder_encode(upipe_x264->encoder,
                                   &nals, &nals_num, &pic, &pic);
+        x264_encoder_parameters(upipe_x264->encoder, &curparams);
 
         /* unmap */
         for (i = 0; i < chromas_count; i++) {
@@ -936,115 +1549,18 @@ static bool upipe_x264_handle(struct upipe *upipe, struct uref *uref,
     uref = pic.opaque;
     assert(uref);
 
-    for (i = 0; i < nals_num; i++) {
-        size += nals[i].i_payload;
-        if (nals[i].i_type == NAL_SPS || nals[i].i_type == NAL_PPS ||
-            nals[i].i_type == NAL_AUD || nals[i].i_type == NAL_FILLER ||
-            nals[i].i_type == NAL_UNKNOWN)
-            header_size += nals[i].i_payload;
-    }
-
     /* alloc ubuf, map, copy, unmap */
-    ubuf_block = ubuf_block_alloc(upipe_x264->ubuf_mgr, size);
+    struct ubuf *ubuf_block = upipe_x264_alloc_nals(upipe_x264->ubuf_mgr,
+                                                    nals, nals_num);
     if (unlikely(ubuf_block == NULL)) {
+        uref_free(uref);
         upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
         return true;
     }
-    ubuf_block_write(ubuf_block, 0, &size, &buf);
-    memcpy(buf, nals[0].p_payload, size);
-    ubuf_block_unmap(ubuf_block, 0);
     uref_attach_ubuf(uref, ubuf_block);
-    uref_block_set_header_size(uref, header_size);
-
-    if (!upipe_x264_mpeg2_enabled(upipe)) {
-        /* NAL offsets */
-        uint64_t offset = 0;
-        for (i = 0; i < nals_num - 1; i++) {
-            offset += nals[i].i_payload;
-            uref_h26x_set_nal_offset(uref, offset, i);
-        }
-
-        /* optionally convert NAL encapsulation */
-        enum uref_h26x_encaps encaps = upipe_x264->params.b_annexb ?
-            UREF_H26X_ENCAPS_ANNEXB : UREF_H26X_ENCAPS_LENGTH4;
-        /* no need for annex B header because if annexb is requested, there
-         * will be no conversion */
-        int err = upipe_h26xf_convert_frame(uref,
-                encaps, upipe_x264->encaps_requested, upipe_x264->ubuf_mgr,
-                NULL);
-        if (!ubase_check(err)) {
-            upipe_warn(upipe, "invalid NAL encapsulation conversion");
-            upipe_throw_error(upipe, err);
-        }
-    }
-
-    /* set dts */
-    uint64_t dts_pts_delay = (uint64_t)(pic.i_pts - pic.i_dts) * UCLOCK_FREQ
-                              * curparams.i_timebase_num
-                              / curparams.i_timebase_den;
-    uref_clock_set_dts_pts_delay(uref, dts_pts_delay);
-    uref_clock_delete_cr_dts_delay(uref);
-
-    /* rebase to dts as we're in encoded domain now */
-    uint64_t dts = UINT64_MAX;
-    if ((!ubase_check(uref_clock_get_dts_prog(uref, &dts)) ||
-         dts < upipe_x264->last_dts) &&
-        upipe_x264->last_dts != UINT64_MAX) {
-        upipe_warn_va(upipe, "DTS prog in the past, resetting (%"PRIu64" ms)",
-                      (upipe_x264->last_dts - dts) * 1000 / UCLOCK_FREQ);
-        dts = upipe_x264->last_dts + 1;
-        uref_clock_set_dts_prog(uref, dts);
-    } else
-        uref_clock_rebase_dts_prog(uref);
-
-    uint64_t dts_sys = UINT64_MAX;
-    if (dts != UINT64_MAX &&
-        upipe_x264->input_pts != UINT64_MAX &&
-        upipe_x264->input_pts_sys != UINT64_MAX) {
-        dts_sys = (int64_t)upipe_x264->input_pts_sys +
-            ((int64_t)dts - (int64_t)upipe_x264->input_pts) *
-            (int64_t)upipe_x264->drift_rate.num /
-            (int64_t)upipe_x264->drift_rate.den;
-        uref_clock_set_dts_sys(uref, dts_sys);
-    } else if (!ubase_check(uref_clock_get_dts_sys(uref, &dts_sys)) ||
-        (upipe_x264->last_dts_sys != UINT64_MAX &&
-               dts_sys < upipe_x264->last_dts_sys)) {
-        upipe_warn_va(upipe,
-                      "DTS sys in the past, resetting (%"PRIu64" ms)",
-                      (upipe_x264->last_dts_sys - dts_sys) * 1000 /
-                      UCLOCK_FREQ);
-        dts_sys = upipe_x264->last_dts_sys + 1;
-        uref_clock_set_dts_sys(uref, dts_sys);
-    } else
-        uref_clock_rebase_dts_sys(uref);
-
-    uref_clock_rebase_dts_orig(uref);
-    uref_clock_set_rate(uref, upipe_x264->drift_rate);
-
-    upipe_x264->last_dts = dts;
-    upipe_x264->last_dts_sys = dts_sys;
-
-#ifdef HAVE_X264_OBE
-    /* speedcontrol */
-    if (dts_sys != UINT64_MAX && upipe_x264->uclock != NULL &&
-        upipe_x264->sc_latency) {
-        uint64_t systime = uclock_now(upipe_x264->uclock);
-        int64_t buffer_state = dts_sys + upipe_x264->initial_latency +
-                               upipe_x264->sc_latency - systime;
-        float buffer_fill = (float)buffer_state /
-                            (float)upipe_x264->sc_latency;
-        x264_speedcontrol_sync(upipe_x264->encoder, buffer_fill, 0, 1);
-    }
-#endif
-
-    if (pic.b_keyframe) {
-        uref_flow_set_random(uref);
-    }
-
-    if (upipe_x264->flow_def == NULL)
-        upipe_x264_build_flow_def(upipe);
-
-    upipe_x264_output(upipe, uref, upump_p);
+    upipe_x264_output_frame(upipe, uref, &pic, nals, nals_num,
+                            curparams.i_timebase_num,
+                            curparams.i_timebase_den, upump_p);
     return true;
 }
 
@@ -1113,16 +1629,7 @@ static int upipe_x264_check_ubuf_mgr(struct upipe *upipe,
     uref_free(upipe_x264->flow_def_requested);
     upipe_x264->flow_def_requested = flow_format;
     upipe_x264_build_flow_def(upipe);
-
-    bool was_buffered = !upipe_x264_check_input(upipe);
-    upipe_x264_output_input(upipe);
-    upipe_x264_unblock_input(upipe);
-    if (was_buffered && upipe_x264_check_input(upipe)) {
-        /* All packets have been output, release again the pipe that has been
-         * used in @ref upipe_x264_input. */
-        upipe_release(upipe);
-    }
-
+    upipe_x264_resume_input(upipe);
     return UBASE_ERR_NONE;
 }
 
@@ -1237,6 +1744,25 @@ static int _upipe_x264_provide_flow_format(struct upipe *upipe,
     return urequest_provide_flow_format(request, flow_format);
 }
 
+/** @internal @This sets the maximum number of frames queued to the encoder
+ * thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param depth maximum number of queued frames, or 0 to encode synchronously
+ * @return an error code
+ */
+static int _upipe_x264_set_async(struct upipe *upipe, unsigned int depth)
+{
+    struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
+    if (!depth) {
+        upipe_x264_thread_stop(upipe);
+        upipe_x264_resume_input(upipe);
+    }
+    upipe_x264->async_depth = depth;
+    upipe_dbg_va(upipe, "setting async depth to %u", depth);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on the pipe.
  *
  * @param upipe description structure of the pipe
@@ -1250,6 +1776,9 @@ static int upipe_x264_control(struct upipe *upipe, int command, va_list args)
         case UPIPE_ATTACH_UCLOCK:
             upipe_x264_require_uclock(upipe);
             return UBASE_ERR_NONE;
+        case UPIPE_ATTACH_UPUMP_MGR:
+            upipe_x264_thread_stop(upipe);
+            return upipe_x264_attach_upump_mgr(upipe);
         case UPIPE_REGISTER_REQUEST: {
             struct urequest *request = va_arg(args, struct urequest *);
             if (request->type == UREQUEST_UBUF_MGR)
@@ -1313,6 +1842,11 @@ static int upipe_x264_control(struct upipe *upipe, int command, va_list args)
             bool enforce = !(va_arg(args, int) == 0);
             return _upipe_x264_set_slice_type_enforce(upipe, enforce);
         }
+        case UPIPE_X264_SET_ASYNC: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_X264_SIGNATURE)
+            unsigned int depth = va_arg(args, unsigned int);
+            return _upipe_x264_set_async(upipe, depth);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -1326,6 +1860,7 @@ static void upipe_x264_free(struct upipe *upipe)
 {
     struct upipe_x264 *upipe_x264 = upipe_x264_from_upipe(upipe);
     upipe_x264_close(upipe);
+    upipe_x264_thread_stop(upipe);
 
     upipe_throw_dead(upipe);
     upipe_x264_clean_uclock(upipe);
@@ -1336,6 +1871,10 @@ static void upipe_x264_free(struct upipe *upipe)
     upipe_x264_clean_flow_format(upipe);
     upipe_x264_clean_flow_def(upipe);
     upipe_x264_clean_flow_def_check(upipe);
+    upipe_x264_clean_upump(upipe);
+    upipe_x264_clean_upump_mgr(upipe);
+    pthread_cond_destroy(&upipe_x264->thread.cond);
+    pthread_mutex_destroy(&upipe_x264->thread.mutex);
     upipe_x264_clean_urefcount(upipe);
     upipe_x264_free_void(upipe);
 }
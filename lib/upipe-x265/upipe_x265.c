@@ -41,12 +41,16 @@
 #include "upipe/uref_block.h"
 #include "upipe/uref_block_flow.h"
 #include "upipe/ubuf_block.h"
+#include "upipe/upump.h"
+#include "upipe/ueventfd.h"
 #include "upipe/upipe.h"
 #include "upipe/upipe_helper_upipe.h"
 #include "upipe/upipe_helper_urefcount.h"
 #include "upipe/upipe_helper_void.h"
 #include "upipe/upipe_helper_ubuf_mgr.h"
 #include "upipe/upipe_helper_uclock.h"
+#include "upipe/upipe_helper_upump_mgr.h"
+#include "upipe/upipe_helper_upump.h"
 #include "upipe/upipe_helper_output.h"
 #include "upipe/upipe_helper_input.h"
 #include "upipe/upipe_helper_flow_format.h"
@@ -61,6 +65,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <x265_config.h>
 
@@ -110,6 +116,57 @@ struct option {
 
 UBASE_FROM_TO(option, uchain, uchain, uchain);
 
+/** @internal @This is a frame submitted to the encoder thread. */
+struct upipe_x265_job {
+    /** structure for double-linked lists */
+    struct uchain uchain;
+    /** input picture, with its planes mapped */
+    struct uref *uref;
+    /** mapped planes */
+    const char * const *chromas;
+    /** x265 picture, in and then out */
+    x265_picture pic;
+    /** ubuf manager for the encoded frame */
+    struct ubuf_mgr *ubuf_mgr;
+
+    /** return value of the encoder */
+    int ret;
+    /** NAL units of the encoded frame (payload pointers are not valid) */
+    x265_nal *nals;
+    /** number of NAL units */
+    uint32_t nals_num;
+    /** encoded frame, or NULL in case of allocation error */
+    struct ubuf *ubuf;
+};
+
+UBASE_FROM_TO(upipe_x265_job, uchain, uchain, uchain)
+
+/** @internal @This is the state of the encoder thread. The encoder is only
+ * touched by the pipe when no job is running. */
+struct upipe_x265_thread {
+    /** encoder thread */
+    pthread_t thread;
+    /** true if the thread was started */
+    bool started;
+    /** true if the thread must exit */
+    bool quit;
+    /** mutex protecting the fields below */
+    pthread_mutex_t mutex;
+    /** condition signaled when a job is submitted or done */
+    pthread_cond_t cond;
+    /** jobs waiting for the encoder */
+    struct uchain jobs;
+    /** encoded jobs waiting for the pipe */
+    struct uchain done;
+    /** number of jobs submitted and not encoded yet */
+    unsigned int running;
+
+    /** event signaled when a job is done */
+    struct ueventfd event;
+    /** number of jobs submitted and not output yet (pipe side) */
+    unsigned int nb_jobs;
+};
+
 /** @internal upipe_x265 private structure */
 struct upipe_x265 {
     /** refcount management structure */
@@ -175,6 +232,10 @@ struct upipe_x265 {
     struct uref *flow_def_requested;
     /** requested headers */
     bool headers_requested;
+    /** global headers of the encoder */
+    uint8_t *headers;
+    /** size of the global headers */
+    int headers_size;
     /** requested encaps */
     enum uref_h26x_encaps encaps_requested;
     /** output flow */
@@ -240,6 +301,15 @@ struct upipe_x265 {
     /** speedcontrol buffer fullness */
     int64_t sc_buffer_fill;
 
+    /** upump manager */
+    struct upump_mgr *upump_mgr;
+    /** watcher of the encoded frames, in asynchronous mode */
+    struct upump *upump;
+    /** maximum number of frames queued to the encoder thread, or 0 */
+    unsigned int async_depth;
+    /** encoder thread */
+    struct upipe_x265_thread thread;
+
     /** public structure */
     struct upipe upipe;
 };
@@ -270,6 +340,8 @@ UPIPE_HELPER_UBUF_MGR(upipe_x265, ubuf_mgr, flow_format, ubuf_mgr_request,
                       upipe_x265_register_output_request,
                       upipe_x265_unregister_output_request)
 UPIPE_HELPER_UCLOCK(upipe_x265, uclock, uclock_request, NULL, upipe_throw_provide_request, NULL)
+UPIPE_HELPER_UPUMP_MGR(upipe_x265, upump_mgr)
+UPIPE_HELPER_UPUMP(upipe_x265, upump, upump_mgr)
 
 /** @internal @This describes the supported pixel formats. */
 static const struct uref_pic_flow_format *pixel_format_desc[] = {
@@ -475,6 +547,57 @@ static int setup_encoder_params(struct upipe *upipe)
     return UBASE_ERR_NONE;
 }
 
+/** @internal @This waits until the encoder thread has encoded all the
+ * submitted frames, so that the encoder may be used by the pipe.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x265_wait(struct upipe *upipe)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+    if (!thread->started)
+        return;
+
+    pthread_mutex_lock(&thread->mutex);
+    while (thread->running)
+        pthread_cond_wait(&thread->cond, &thread->mutex);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
+/** @hidden */
+static void upipe_x265_drain(struct upipe *upipe);
+
+/** @internal @This reads the global headers of the encoder, so that the flow
+ * definition can be built without waiting for the encoder thread. The
+ * encoder must not be in use by the thread.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x265_read_headers(struct upipe *upipe)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    free(upipe_x265->headers);
+    upipe_x265->headers = NULL;
+    upipe_x265->headers_size = 0;
+
+    uint32_t nal_num;
+    x265_nal *nals;
+    int ret = upipe_x265->api->encoder_headers(upipe_x265->encoder, &nals,
+                                               &nal_num);
+    if (unlikely(ret < 0)) {
+        upipe_warn(upipe, "unable to get encoder headers");
+        return;
+    }
+    upipe_x265->headers = malloc(ret);
+    if (unlikely(upipe_x265->headers == NULL)) {
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    memcpy(upipe_x265->headers, nals[0].payload, ret);
+    upipe_x265->headers_size = ret;
+}
+
 /** @internal @This reconfigures encoder with updated parameters
  *
  * @param upipe description structure of the pipe
@@ -488,9 +611,13 @@ static int _upipe_x265_reconfigure(struct upipe *upipe)
     if (unlikely(upipe_x265->encoder == NULL))
         return UBASE_ERR_NONE;
 
+    upipe_x265_wait(upipe);
     int ret = upipe_x265->api->encoder_reconfig(upipe_x265->encoder,
                                                 &upipe_x265->params);
-    return ret != 0 ? UBASE_ERR_EXTERNAL : UBASE_ERR_NONE;
+    if (ret != 0)
+        return UBASE_ERR_EXTERNAL;
+    upipe_x265_read_headers(upipe);
+    return UBASE_ERR_NONE;
 }
 
 /** @internal @This sets default parameters for specified preset.
@@ -587,6 +714,8 @@ static struct upipe *upipe_x265_alloc(struct upipe_mgr *mgr,
     upipe_x265_init_flow_def_check(upipe);
     upipe_x265->flow_def_requested = NULL;
     upipe_x265->headers_requested = false;
+    upipe_x265->headers = NULL;
+    upipe_x265->headers_size = 0;
     upipe_x265->encaps_requested = UREF_H26X_ENCAPS_ANNEXB;
     upipe_x265->aspect_ratio_idc = 0;
     upipe_x265->overscan = OVERSCAN_UNDEF;
@@ -597,6 +726,19 @@ static struct upipe *upipe_x265_alloc(struct upipe_mgr *mgr,
     upipe_x265->input_pts = UINT64_MAX;
     upipe_x265->input_pts_sys = UINT64_MAX;
 
+    upipe_x265_init_upump_mgr(upipe);
+    upipe_x265_init_upump(upipe);
+    upipe_x265->async_depth = 0;
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+    thread->started = false;
+    thread->quit = false;
+    pthread_mutex_init(&thread->mutex, NULL);
+    pthread_cond_init(&thread->cond, NULL);
+    ulist_init(&thread->jobs);
+    ulist_init(&thread->done);
+    thread->running = 0;
+    thread->nb_jobs = 0;
+
     upipe_throw_ready(upipe);
     return upipe;
 }
@@ -674,6 +816,7 @@ static bool upipe_x265_open(struct upipe *upipe, int width, int height)
 
     /* sync pipe parameters with internal copy */
     upipe_x265->api->encoder_parameters(upipe_x265->encoder, params);
+    upipe_x265_read_headers(upipe);
 
     /* flow definition */
     struct uref *flow_def_attr = upipe_x265_alloc_flow_def_attr(upipe);
@@ -775,11 +918,16 @@ static void upipe_x265_close(struct upipe *upipe)
 {
     struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
     if (upipe_x265->encoder) {
+        upipe_x265_drain(upipe);
         while (upipe_x265->delayed_frames)
             upipe_x265_handle(upipe, NULL, NULL);
 
         upipe_notice(upipe, "closing encoder");
         upipe_x265->api->encoder_close(upipe_x265->encoder);
+        upipe_x265->encoder = NULL;
+        free(upipe_x265->headers);
+        upipe_x265->headers = NULL;
+        upipe_x265->headers_size = 0;
     }
 }
 
@@ -809,23 +957,438 @@ static void upipe_x265_build_flow_def(struct upipe *upipe)
     uref_clock_set_latency(flow_def, latency);
 
     /* global headers (extradata) */
-    if (upipe_x265->headers_requested) {
-        uint32_t nal_num;
-        x265_nal *nals;
-        int ret = upipe_x265->api->encoder_headers(upipe_x265->encoder, &nals, &nal_num);
-        if (unlikely(ret < 0)) {
-            upipe_warn(upipe, "unable to get encoder headers");
-        } else {
-            UBASE_FATAL(upipe,
-                uref_flow_set_headers(flow_def, nals[0].payload, ret));
-        }
-    }
+    if (upipe_x265->headers_requested && upipe_x265->headers != NULL)
+        UBASE_FATAL(upipe,
+            uref_flow_set_headers(flow_def, upipe_x265->headers,
+                                  upipe_x265->headers_size));
     UBASE_FATAL(upipe,
             uref_h26x_flow_set_encaps(flow_def, upipe_x265->encaps_requested));
 
     upipe_x265_store_flow_def(upipe, flow_def);
 }
 
+/** @internal @This allocates a block containing the NAL units of an encoded
+ * frame, which x265 returns contiguously.
+ *
+ * @param ubuf_mgr block ubuf manager
+ * @param nals NAL units
+ * @param nals_num number of NAL units
+ * @return pointer to ubuf, or NULL in case of allocation error
+ */
+static struct ubuf *upipe_x265_alloc_nals(struct ubuf_mgr *ubuf_mgr,
+                                          const x265_nal *nals,
+                                          uint32_t nals_num)
+{
+    int size = 0;
+    for (uint32_t i = 0; i < nals_num; i++)
+        size += nals[i].sizeBytes;
+
+    struct ubuf *ubuf = ubuf_block_alloc(ubuf_mgr, size);
+    if (unlikely(ubuf == NULL))
+        return NULL;
+    uint8_t *buf;
+    if (unlikely(!ubase_check(ubuf_block_write(ubuf, 0, &size, &buf)))) {
+        ubuf_free(ubuf);
+        return NULL;
+    }
+    memcpy(buf, nals[0].payload, size);
+    ubuf_block_unmap(ubuf, 0);
+    return ubuf;
+}
+
+/** @internal @This sets the attributes of an encoded frame and outputs it.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure, with the encoded frame attached
+ * @param pic output x265 picture
+ * @param nals NAL units of the frame
+ * @param nals_num number of NAL units
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_x265_output_frame(struct upipe *upipe, struct uref *uref,
+                                    const x265_picture *pic,
+                                    const x265_nal *nals, uint32_t nals_num,
+                                    struct upump **upump_p)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    int header_size = 0;
+    for (uint32_t i = 0; i < nals_num; i++) {
+        if (nals[i].type == NAL_UNIT_VPS ||
+            nals[i].type == NAL_UNIT_SPS ||
+            nals[i].type == NAL_UNIT_PPS ||
+            nals[i].type == NAL_UNIT_ACCESS_UNIT_DELIMITER ||
+            nals[i].type == NAL_UNIT_FILLER_DATA)
+            header_size += nals[i].sizeBytes;
+    }
+
+    uref_block_set_header_size(uref, header_size);
+
+    /* NAL offsets */
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i + 1 < nals_num; i++) {
+        offset += nals[i].sizeBytes;
+        uref_h26x_set_nal_offset(uref, offset, i);
+    }
+
+    /* optionally convert NAL encapsulation */
+    enum uref_h26x_encaps encaps = upipe_x265->params.bAnnexB ?
+        UREF_H26X_ENCAPS_ANNEXB : UREF_H26X_ENCAPS_LENGTH4;
+    /* no need for annex B header because if annexb is requested, there
+     * will be no conversion */
+    int err = upipe_h26xf_convert_frame(uref,
+                                        encaps,
+                                        upipe_x265->encaps_requested,
+                                        upipe_x265->ubuf_mgr,
+                                        NULL);
+    if (!ubase_check(err)) {
+        upipe_warn(upipe, "invalid NAL encapsulation conversion");
+        upipe_throw_error(upipe, err);
+    }
+
+    /* set dts */
+    uint64_t dts_pts_delay = pic->pts - pic->dts;
+    uref_clock_set_dts_pts_delay(uref, dts_pts_delay);
+    uref_clock_delete_cr_dts_delay(uref);
+
+    /* rebase to dts as we're in encoded domain now */
+    uint64_t dts = UINT64_MAX;
+    if ((!ubase_check(uref_clock_get_dts_prog(uref, &dts)) ||
+         dts < upipe_x265->last_dts) &&
+        upipe_x265->last_dts != UINT64_MAX) {
+        upipe_warn_va(upipe, "DTS prog in the past, resetting (%"PRIu64" ms)",
+                      (upipe_x265->last_dts - dts) * 1000 / UCLOCK_FREQ);
+        dts = upipe_x265->last_dts + 1;
+        uref_clock_set_dts_prog(uref, dts);
+    } else
+        uref_clock_rebase_dts_prog(uref);
+
+    uint64_t dts_sys = UINT64_MAX;
+    if (dts != UINT64_MAX &&
+        upipe_x265->input_pts != UINT64_MAX &&
+        upipe_x265->input_pts_sys != UINT64_MAX) {
+        dts_sys = (int64_t)upipe_x265->input_pts_sys +
+            ((int64_t)dts - (int64_t)upipe_x265->input_pts) *
+            (int64_t)upipe_x265->drift_rate.num /
+            (int64_t)upipe_x265->drift_rate.den;
+        uref_clock_set_dts_sys(uref, dts_sys);
+    } else if (!ubase_check(uref_clock_get_dts_sys(uref, &dts_sys)) ||
+        (upipe_x265->last_dts_sys != UINT64_MAX &&
+               dts_sys < upipe_x265->last_dts_sys)) {
+        upipe_warn_va(upipe,
+                      "DTS sys in the past, resetting (%"PRIu64" ms)",
+                      (upipe_x265->last_dts_sys - dts_sys) * 1000 /
+                      UCLOCK_FREQ);
+        dts_sys = upipe_x265->last_dts_sys + 1;
+        uref_clock_set_dts_sys(uref, dts_sys);
+    } else
+        uref_clock_rebase_dts_sys(uref);
+
+    uref_clock_rebase_dts_orig(uref);
+    uref_clock_set_rate(uref, upipe_x265->drift_rate);
+
+    upipe_x265->last_dts = dts;
+    upipe_x265->last_dts_sys = dts_sys;
+
+    if (dts_sys != UINT64_MAX &&
+        upipe_x265->uclock != NULL &&
+        upipe_x265->sc_latency) {
+        /* speedcontrol sync */
+        upipe_x265->sc_buffer_fill = dts_sys +
+            upipe_x265->initial_latency +
+            upipe_x265->sc_latency -
+            uclock_now(upipe_x265->uclock);
+    }
+
+    if (IS_X265_TYPE_I(pic->sliceType))
+        uref_flow_set_random(uref);
+
+    if (upipe_x265->flow_def == NULL)
+        upipe_x265_build_flow_def(upipe);
+
+    upipe_x265_output(upipe, uref, upump_p);
+}
+
+/** @internal @This encodes a frame in the encoder thread, and copies the
+ * NAL units before x265 recycles them at the next call.
+ *
+ * @param api x265 API
+ * @param encoder x265 encoder
+ * @param job frame to encode
+ */
+static void upipe_x265_thread_encode(const x265_api *api,
+                                     x265_encoder *encoder,
+                                     struct upipe_x265_job *job)
+{
+#if X265_BUILD >= 210 && X265_BUILD < 213
+    x265_picture *pic_out[MAX_SCALABLE_LAYERS] = { &job->pic };
+#else
+    x265_picture *pic_out = &job->pic;
+#endif
+    x265_nal *nals = NULL;
+    uint32_t nals_num = 0;
+    job->ret = api->encoder_encode(encoder, &nals, &nals_num,
+                                   &job->pic, pic_out);
+    if (job->ret <= 0)
+        return;
+
+    job->nals = malloc(sizeof(x265_nal) * nals_num);
+    if (likely(job->nals != NULL)) {
+        memcpy(job->nals, nals, sizeof(x265_nal) * nals_num);
+        job->nals_num = nals_num;
+        job->ubuf = upipe_x265_alloc_nals(job->ubuf_mgr, nals, nals_num);
+    }
+}
+
+/** @internal @This is the main loop of the encoder thread.
+ *
+ * @param _upipe_x265 private structure of the pipe
+ * @return NULL
+ */
+static void *upipe_x265_thread_run(void *_upipe_x265)
+{
+    struct upipe_x265 *upipe_x265 = _upipe_x265;
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+
+    pthread_mutex_lock(&thread->mutex);
+    for ( ; ; ) {
+        struct uchain *uchain = ulist_pop(&thread->jobs);
+        if (uchain == NULL) {
+            if (thread->quit)
+                break;
+            pthread_cond_wait(&thread->cond, &thread->mutex);
+            continue;
+        }
+        struct upipe_x265_job *job = upipe_x265_job_from_uchain(uchain);
+        const x265_api *api = upipe_x265->api;
+        x265_encoder *encoder = upipe_x265->encoder;
+        pthread_mutex_unlock(&thread->mutex);
+
+        upipe_x265_thread_encode(api, encoder, job);
+
+        pthread_mutex_lock(&thread->mutex);
+        ulist_add(&thread->done, upipe_x265_job_to_uchain(job));
+        thread->running--;
+        pthread_cond_broadcast(&thread->cond);
+        ueventfd_write(&thread->event);
+    }
+    pthread_mutex_unlock(&thread->mutex);
+    return NULL;
+}
+
+/** @internal @This outputs the frames encoded by the encoder thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param upump_p reference to pump that generated the buffer
+ */
+static void upipe_x265_process(struct upipe *upipe, struct upump **upump_p)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+
+    for ( ; ; ) {
+        pthread_mutex_lock(&thread->mutex);
+        struct uchain *uchain = ulist_pop(&thread->done);
+        pthread_mutex_unlock(&thread->mutex);
+        if (uchain == NULL)
+            break;
+
+        struct upipe_x265_job *job = upipe_x265_job_from_uchain(uchain);
+        thread->nb_jobs--;
+
+        /* unmap */
+        for (int i = 0; i < 3; i++)
+            uref_pic_plane_unmap(job->uref, job->chromas[i], 0, 0, -1, -1);
+        ubuf_free(uref_detach_ubuf(job->uref));
+        ubuf_mgr_release(job->ubuf_mgr);
+
+        if (unlikely(job->ret < 0)) {
+            upipe_warn(upipe, "Error encoding frame");
+            uref_free(job->uref);
+        } else if (unlikely(job->ret == 0)) {
+            /* delayed frame, increase latency */
+            upipe_x265->latency_frames++;
+            upipe_verbose(upipe, "No nal units returned");
+        } else if (unlikely(job->ubuf == NULL)) {
+            uref_free(job->pic.userData);
+            upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        } else {
+            /* get uref back */
+            struct uref *uref = job->pic.userData;
+            assert(uref);
+            uref_attach_ubuf(uref, job->ubuf);
+            upipe_x265_output_frame(upipe, uref, &job->pic,
+                                    job->nals, job->nals_num, upump_p);
+        }
+        free(job->nals);
+        free(job);
+    }
+}
+
+/** @internal @This outputs the buffered input once the encoder thread has
+ * room for it.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x265_resume_input(struct upipe *upipe)
+{
+    bool was_buffered = !upipe_x265_check_input(upipe);
+    upipe_x265_output_input(upipe);
+    upipe_x265_unblock_input(upipe);
+    if (was_buffered && upipe_x265_check_input(upipe)) {
+        /* All packets have been output, release again the pipe that has been
+         * used in @ref upipe_x265_input. */
+        upipe_release(upipe);
+    }
+}
+
+/** @internal @This is called when the encoder thread has encoded frames.
+ *
+ * @param upump description structure of the watcher
+ */
+static void upipe_x265_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+
+    ueventfd_read(&upipe_x265->thread.event);
+    upipe_x265_process(upipe, &upump);
+    upipe_x265_resume_input(upipe);
+}
+
+/** @internal @This waits for the encoder thread and outputs all the frames
+ * it has encoded.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x265_drain(struct upipe *upipe)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    if (!upipe_x265->thread.started)
+        return;
+
+    upipe_x265_wait(upipe);
+    upipe_x265_process(upipe, NULL);
+}
+
+/** @internal @This starts the encoder thread if it is not running yet, or
+ * falls back to synchronous encoding if it cannot be started.
+ *
+ * @param upipe description structure of the pipe
+ * @return true if the encoder thread is running
+ */
+static bool upipe_x265_thread_start(struct upipe *upipe)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+    if (likely(thread->started))
+        return true;
+
+    upipe_x265_check_upump_mgr(upipe);
+    if (unlikely(upipe_x265->upump_mgr == NULL)) {
+        upipe_warn(upipe, "no upump manager, encoding synchronously");
+        upipe_x265->async_depth = 0;
+        return false;
+    }
+
+    if (unlikely(!ueventfd_init(&thread->event, false))) {
+        upipe_warn(upipe, "unable to create eventfd, encoding synchronously");
+        upipe_x265->async_depth = 0;
+        return false;
+    }
+
+    struct upump *upump = ueventfd_upump_alloc(&thread->event,
+            upipe_x265->upump_mgr, upipe_x265_worker, upipe, upipe->refcount);
+    if (unlikely(upump == NULL)) {
+        upipe_warn(upipe, "unable to allocate pump, encoding synchronously");
+        ueventfd_clean(&thread->event);
+        upipe_x265->async_depth = 0;
+        return false;
+    }
+
+    thread->quit = false;
+    thread->running = 0;
+    thread->nb_jobs = 0;
+    if (unlikely(pthread_create(&thread->thread, NULL,
+                                upipe_x265_thread_run, upipe_x265) != 0)) {
+        upipe_warn(upipe, "unable to create thread, encoding synchronously");
+        upump_free(upump);
+        ueventfd_clean(&thread->event);
+        upipe_x265->async_depth = 0;
+        return false;
+    }
+
+    upump_start(upump);
+    upipe_x265_set_upump(upipe, upump);
+    thread->started = true;
+    upipe_dbg_va(upipe, "started encoder thread (depth %u)",
+                 upipe_x265->async_depth);
+    return true;
+}
+
+/** @internal @This outputs the pending frames and stops the encoder thread.
+ *
+ * @param upipe description structure of the pipe
+ */
+static void upipe_x265_thread_stop(struct upipe *upipe)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+    if (!thread->started)
+        return;
+
+    upipe_x265_drain(upipe);
+
+    pthread_mutex_lock(&thread->mutex);
+    thread->quit = true;
+    pthread_cond_broadcast(&thread->cond);
+    pthread_mutex_unlock(&thread->mutex);
+    pthread_join(thread->thread, NULL);
+
+    upipe_x265_set_upump(upipe, NULL);
+    ueventfd_clean(&thread->event);
+    thread->started = false;
+}
+
+/** @internal @This submits a mapped picture to the encoder thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref input picture, with its planes mapped
+ * @param pic x265 picture pointing to the planes
+ * @param chromas mapped planes
+ */
+static void upipe_x265_submit(struct upipe *upipe, struct uref *uref,
+                              const x265_picture *pic,
+                              const char * const *chromas)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    struct upipe_x265_thread *thread = &upipe_x265->thread;
+
+    struct upipe_x265_job *job = malloc(sizeof(struct upipe_x265_job));
+    if (unlikely(job == NULL)) {
+        for (int i = 0; i < 3; i++)
+            uref_pic_plane_unmap(uref, chromas[i], 0, 0, -1, -1);
+        uref_free(uref);
+        upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
+        return;
+    }
+    uchain_init(&job->uchain);
+    job->uref = uref;
+    job->chromas = chromas;
+    job->pic = *pic;
+    job->ubuf_mgr = ubuf_mgr_use(upipe_x265->ubuf_mgr);
+    job->ret = 0;
+    job->nals = NULL;
+    job->nals_num = 0;
+    job->ubuf = NULL;
+    thread->nb_jobs++;
+
+    pthread_mutex_lock(&thread->mutex);
+    ulist_add(&thread->jobs, upipe_x265_job_to_uchain(job));
+    thread->running++;
+    pthread_cond_broadcast(&thread->cond);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
 static int params_overscan(x265_param *params)
 {
     if (!params->vui.bEnableOverscanInfoPresentFlag)
@@ -924,6 +1487,8 @@ static bool upipe_x265_handle(struct upipe *upipe,
     struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
 
     if (unlikely(uref != NULL && ubase_check(uref_flow_get_def(uref, NULL)))) {
+        /* frames of the previous flow are output first */
+        upipe_x265_drain(upipe);
         upipe_x265->input_latency = 0;
         uref_clock_get_latency(uref, &upipe_x265->input_latency);
         upipe_x265_store_flow_def(upipe, NULL);
@@ -993,10 +1558,8 @@ err_invalid:
     size_t width, height;
     x265_picture pic;
     x265_nal *nals = NULL;
-    int i, size = 0, header_size = 0;
+    int i;
     uint32_t nals_num = 0;
-    struct ubuf *ubuf_block;
-    uint8_t *buf = NULL;
     bool needopen = false;
     int ret = 0;
 
@@ -1040,6 +1603,7 @@ err_invalid:
             needopen = true;
         }
         if (unlikely(needopen)) {
+            upipe_x265_drain(upipe);
             if (unlikely(!upipe_x265_open(upipe, width, height))) {
                 upipe_err(upipe, "Could not open encoder");
                 uref_free(uref);
@@ -1049,6 +1613,11 @@ err_invalid:
         if (upipe_x265->flow_def_requested == NULL)
             return false;
 
+        bool async = upipe_x265->async_depth &&
+                     upipe_x265_thread_start(upipe);
+        if (async && upipe_x265->thread.nb_jobs >= upipe_x265->async_depth)
+            return false;
+
         uref_clock_get_rate(uref, &upipe_x265->drift_rate);
         uref_clock_get_pts_prog(uref, &upipe_x265->input_pts);
         uref_clock_get_pts_sys(uref, &upipe_x265->input_pts_sys);
@@ -1092,6 +1661,11 @@ err_invalid:
             pic.planes[i] = (void *)plane;
         }
 
+        if (async) {
+            upipe_x265_submit(upipe, uref, &pic, chromas);
+            return true;
+        }
+
         /* encode frame */
         ret = upipe_x265->api->encoder_encode(upipe_x265->encoder,
                                               &nals, &nals_num,
@@ -1129,111 +1703,15 @@ err_invalid:
     uref = pic.userData;
     assert(uref);
 
-    for (i = 0; i < nals_num; i++) {
-        size += nals[i].sizeBytes;
-        if (nals[i].type == NAL_UNIT_VPS ||
-            nals[i].type == NAL_UNIT_SPS ||
-            nals[i].type == NAL_UNIT_PPS ||
-            nals[i].type == NAL_UNIT_ACCESS_UNIT_DELIMITER ||
-            nals[i].type == NAL_UNIT_FILLER_DATA)
-            header_size += nals[i].sizeBytes;
-    }
-
-    /* alloc ubuf, map, copy, unmap */
-    ubuf_block = ubuf_block_alloc(upipe_x265->ubuf_mgr, size);
+    struct ubuf *ubuf_block = upipe_x265_alloc_nals(upipe_x265->ubuf_mgr,
+                                                    nals, nals_num);
     if (unlikely(ubuf_block == NULL)) {
+        uref_free(uref);
         upipe_throw_fatal(upipe, UBASE_ERR_ALLOC);
         return true;
     }
-    ubuf_block_write(ubuf_block, 0, &size, &buf);
-    memcpy(buf, nals[0].payload, size);
-    ubuf_block_unmap(ubuf_block, 0);
     uref_attach_ubuf(uref, ubuf_block);
-    uref_block_set_header_size(uref, header_size);
-
-    /* NAL offsets */
-    uint64_t offset = 0;
-    for (i = 0; i < nals_num - 1; i++) {
-        offset += nals[i].sizeBytes;
-        uref_h26x_set_nal_offset(uref, offset, i);
-    }
-
-    /* optionally convert NAL encapsulation */
-    enum uref_h26x_encaps encaps = upipe_x265->params.bAnnexB ?
-        UREF_H26X_ENCAPS_ANNEXB : UREF_H26X_ENCAPS_LENGTH4;
-    /* no need for annex B header because if annexb is requested, there
-     * will be no conversion */
-    int err = upipe_h26xf_convert_frame(uref,
-                                        encaps,
-                                        upipe_x265->encaps_requested,
-                                        upipe_x265->ubuf_mgr,
-                                        NULL);
-    if (!ubase_check(err)) {
-        upipe_warn(upipe, "invalid NAL encapsulation conversion");
-        upipe_throw_error(upipe, err);
-    }
-
-    /* set dts */
-    uint64_t dts_pts_delay = pic.pts - pic.dts;
-    uref_clock_set_dts_pts_delay(uref, dts_pts_delay);
-    uref_clock_delete_cr_dts_delay(uref);
-
-    /* rebase to dts as we're in encoded domain now */
-    uint64_t dts = UINT64_MAX;
-    if ((!ubase_check(uref_clock_get_dts_prog(uref, &dts)) ||
-         dts < upipe_x265->last_dts) &&
-        upipe_x265->last_dts != UINT64_MAX) {
-        upipe_warn_va(upipe, "DTS prog in the past, resetting (%"PRIu64" ms)",
-                      (upipe_x265->last_dts - dts) * 1000 / UCLOCK_FREQ);
-        dts = upipe_x265->last_dts + 1;
-        uref_clock_set_dts_prog(uref, dts);
-    } else
-        uref_clock_rebase_dts_prog(uref);
-
-    uint64_t dts_sys = UINT64_MAX;
-    if (dts != UINT64_MAX &&
-        upipe_x265->input_pts != UINT64_MAX &&
-        upipe_x265->input_pts_sys != UINT64_MAX) {
-        dts_sys = (int64_t)upipe_x265->input_pts_sys +
-            ((int64_t)dts - (int64_t)upipe_x265->input_pts) *
-            (int64_t)upipe_x265->drift_rate.num /
-            (int64_t)upipe_x265->drift_rate.den;
-        uref_clock_set_dts_sys(uref, dts_sys);
-    } else if (!ubase_check(uref_clock_get_dts_sys(uref, &dts_sys)) ||
-        (upipe_x265->last_dts_sys != UINT64_MAX &&
-               dts_sys < upipe_x265->last_dts_sys)) {
-        upipe_warn_va(upipe,
-                      "DTS sys in the past, resetting (%"PRIu64" ms)",
-                      (upipe_x265->last_dts_sys - dts_sys) * 1000 /
-                      UCLOCK_FREQ);
-        dts_sys = upipe_x265->last_dts_sys + 1;
-        uref_clock_set_dts_sys(uref, dts_sys);
-    } else
-        uref_clock_rebase_dts_sys(uref);
-
-    uref_clock_rebase_dts_orig(uref);
-    uref_clock_set_rate(uref, upipe_x265->drift_rate);
-
-    upipe_x265->last_dts = dts;
-    upipe_x265->last_dts_sys = dts_sys;
-
-    if (dts_sys != UINT64_MAX &&
-        upipe_x265->uclock != NULL &&
-        upipe_x265->sc_latency) {
-        /* speedcontrol sync */
-        upipe_x265->sc_buffer_fill = dts_sys +
-            upipe_x265->initial_latency +
-            upipe_x265->sc_latency -
-            uclock_now(upipe_x265->uclock);
-    }
-
-    if (IS_X265_TYPE_I(pic.sliceType))
-        uref_flow_set_random(uref);
-
-    if (upipe_x265->flow_def == NULL)
-        upipe_x265_build_flow_def(upipe);
-
-    upipe_x265_output(upipe, uref, upump_p);
+    upipe_x265_output_frame(upipe, uref, &pic, nals, nals_num, upump_p);
     return true;
 }
 
@@ -1302,16 +1780,7 @@ static int upipe_x265_check_ubuf_mgr(struct upipe *upipe,
 
     uref_free(upipe_x265->flow_def_requested);
     upipe_x265->flow_def_requested = flow_format;
-
-    bool was_buffered = !upipe_x265_check_input(upipe);
-    upipe_x265_output_input(upipe);
-    upipe_x265_unblock_input(upipe);
-    if (was_buffered && upipe_x265_check_input(upipe)) {
-        /* All packets have been output, release again the pipe that has been
-         * used in @ref upipe_x265_input. */
-        upipe_release(upipe);
-    }
-
+    upipe_x265_resume_input(upipe);
     return UBASE_ERR_NONE;
 }
 
@@ -1438,6 +1907,25 @@ static int _upipe_x265_provide_flow_format(struct upipe *upipe,
     return urequest_provide_flow_format(request, flow_format);
 }
 
+/** @internal @This sets the maximum number of frames queued to the encoder
+ * thread.
+ *
+ * @param upipe description structure of the pipe
+ * @param depth maximum number of queued frames, or 0 to encode synchronously
+ * @return an error code
+ */
+static int _upipe_x265_set_async(struct upipe *upipe, unsigned int depth)
+{
+    struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
+    if (!depth) {
+        upipe_x265_thread_stop(upipe);
+        upipe_x265_resume_input(upipe);
+    }
+    upipe_x265->async_depth = depth;
+    upipe_dbg_va(upipe, "setting async depth to %u", depth);
+    return UBASE_ERR_NONE;
+}
+
 /** @internal @This processes control commands on the pipe.
  *
  * @param upipe description structure of the pipe
@@ -1453,6 +1941,9 @@ static int upipe_x265_control(struct upipe *upipe, int command, va_list args)
         case UPIPE_ATTACH_UCLOCK:
             upipe_x265_require_uclock(upipe);
             return UBASE_ERR_NONE;
+        case UPIPE_ATTACH_UPUMP_MGR:
+            upipe_x265_thread_stop(upipe);
+            return upipe_x265_attach_upump_mgr(upipe);
         case UPIPE_REGISTER_REQUEST: {
             struct urequest *request = va_arg(args, struct urequest *);
             if (request->type == UREQUEST_UBUF_MGR)
@@ -1565,6 +2056,11 @@ static int upipe_x265_control(struct upipe *upipe, int command, va_list args)
             bool enforce = va_arg(args, int);
             return _upipe_x265_set_slice_type_enforce(upipe, enforce);
         }
+        case UPIPE_X265_SET_ASYNC: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_X265_SIGNATURE)
+            unsigned int depth = va_arg(args, unsigned int);
+            return _upipe_x265_set_async(upipe, depth);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -1597,6 +2093,7 @@ static void upipe_x265_free(struct upipe *upipe)
     struct upipe_x265 *upipe_x265 = upipe_x265_from_upipe(upipe);
 
     upipe_x265_close(upipe);
+    upipe_x265_thread_stop(upipe);
     upipe_x265_free_options(upipe);
     free(upipe_x265->preset);
     free(upipe_x265->tune);
@@ -1610,6 +2107,10 @@ static void upipe_x265_free(struct upipe *upipe)
     upipe_x265_clean_flow_format(upipe);
     upipe_x265_clean_flow_def(upipe);
     upipe_x265_clean_flow_def_check(upipe);
+    upipe_x265_clean_upump(upipe);
+    upipe_x265_clean_upump_mgr(upipe);
+    pthread_cond_destroy(&upipe_x265->thread.cond);
+    pthread_mutex_destroy(&upipe_x265->thread.mutex);
     upipe_x265_clean_urefcount(upipe);
     upipe_x265_free_void(upipe);
 }
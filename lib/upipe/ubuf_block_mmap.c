@@ -0,0 +1,476 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe ubuf manager for block formats with mapped file storage
+ */
+
+#include "upipe/ubase.h"
+#include "upipe/uatomic.h"
+#include "upipe/urefcount.h"
+#include "upipe/upool.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+#include "upipe/ubuf_block_common.h"
+#include "upipe/ubuf_block_mmap.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+/** @This is the shared structure describing a mapped file window. */
+struct ubuf_block_mmap_shared {
+    /** number of blocks pointing to the mapping */
+    uatomic_uint32_t refcount;
+    /** start of the mapping */
+    uint8_t *base;
+    /** size of the mapping */
+    size_t size;
+    /** true if the window was mapped, false if it was read into memory */
+    bool mapped;
+};
+
+/** @This is a super-set of the @ref ubuf (and @ref ubuf_block)
+ * structure with private fields pointing to shared data. */
+struct ubuf_block_mmap {
+    /** pointer to shared structure */
+    struct ubuf_block_mmap_shared *shared;
+
+    /** block structure */
+    struct ubuf_block ubuf_block;
+};
+
+UBASE_FROM_TO(ubuf_block_mmap, ubuf, ubuf, ubuf_block.ubuf)
+
+/** @This is a super-set of the ubuf_mgr structure with additional local
+ * members. */
+struct ubuf_block_mmap_mgr {
+    /** refcount management structure */
+    struct urefcount urefcount;
+
+    /** ubuf pool */
+    struct upool ubuf_pool;
+
+    /** common management structure */
+    struct ubuf_mgr mgr;
+
+    /** extra space for upool */
+    uint8_t upool_extra[];
+};
+
+UBASE_FROM_TO(ubuf_block_mmap_mgr, ubuf_mgr, ubuf_mgr, mgr)
+UBASE_FROM_TO(ubuf_block_mmap_mgr, urefcount, urefcount, urefcount)
+UBASE_FROM_TO(ubuf_block_mmap_mgr, upool, ubuf_pool, ubuf_pool)
+
+/** @internal @This allocates a ubuf structure from the pool, pointing to the
+ * given shared mapping.
+ *
+ * @param mgr common management structure
+ * @param shared shared mapping, whose reference is transferred to the ubuf
+ * @return pointer to ubuf or NULL in case of allocation error
+ */
+static struct ubuf *ubuf_block_mmap_alloc_pool(struct ubuf_mgr *mgr,
+        struct ubuf_block_mmap_shared *shared)
+{
+    struct ubuf_block_mmap_mgr *mmap_mgr =
+        ubuf_block_mmap_mgr_from_ubuf_mgr(mgr);
+    struct ubuf_block_mmap *block_mmap = upool_alloc(&mmap_mgr->ubuf_pool,
+                                                     struct ubuf_block_mmap *);
+    if (unlikely(block_mmap == NULL))
+        return NULL;
+
+    block_mmap->shared = shared;
+    struct ubuf *ubuf = ubuf_block_mmap_to_ubuf(block_mmap);
+    ubuf_block_common_init(ubuf, false);
+    ubuf_block_common_set_buffer(ubuf, shared->base);
+    return ubuf;
+}
+
+/** @internal @This releases a shared mapping, and unmaps the file if it was
+ * the last reference.
+ *
+ * @param shared shared mapping
+ */
+static void ubuf_block_mmap_shared_release(
+        struct ubuf_block_mmap_shared *shared)
+{
+    if (uatomic_fetch_sub(&shared->refcount, 1) != 1)
+        return;
+    if (shared->mapped)
+        munmap(shared->base, shared->size);
+    else
+        free(shared->base);
+    uatomic_clean(&shared->refcount);
+    free(shared);
+}
+
+/** @internal @This returns the size of a page.
+ *
+ * @return size of a page in octets
+ */
+static uint64_t ubuf_block_mmap_page_size(void)
+{
+    static long page_size = 0;
+    if (unlikely(!page_size))
+        page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+/** @internal @This reads a window of a file into memory, when it cannot be
+ * mapped.
+ *
+ * @param shared shared structure, whose size is already set
+ * @param fd file descriptor to read
+ * @param offset offset of the window in the file
+ * @return false in case of error
+ */
+static bool ubuf_block_mmap_read(struct ubuf_block_mmap_shared *shared,
+                                 int fd, uint64_t offset)
+{
+    shared->base = malloc(shared->size);
+    if (unlikely(shared->base == NULL))
+        return false;
+
+    size_t done = 0;
+    while (done < shared->size) {
+        ssize_t ret = pread(fd, shared->base + done, shared->size - done,
+                            offset + done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (unlikely(ret <= 0)) {
+            free(shared->base);
+            return false;
+        }
+        done += ret;
+    }
+    shared->mapped = false;
+    return true;
+}
+
+/** @This maps a window of a file and allocates a ubuf covering it.
+ *
+ * @param mgr common management structure
+ * @param signature type of allocation
+ * @param args optional arguments
+ * @return pointer to ubuf or NULL in case of error
+ */
+static struct ubuf *_ubuf_block_mmap_alloc(struct ubuf_mgr *mgr,
+                                           uint32_t signature, va_list args)
+{
+    if (unlikely(signature != UBUF_BLOCK_MMAP_ALLOC_FROM_FD))
+        return NULL;
+    int fd = va_arg(args, int);
+    uint64_t offset = va_arg(args, uint64_t);
+    uint64_t size = va_arg(args, uint64_t);
+
+    struct stat st;
+    if (unlikely(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+                 st.st_size <= 0 || offset >= (uint64_t)st.st_size))
+        return NULL;
+    if (size > (uint64_t)st.st_size - offset)
+        size = (uint64_t)st.st_size - offset;
+    if (size > UBUF_BLOCK_MMAP_WINDOW)
+        size = UBUF_BLOCK_MMAP_WINDOW;
+    if (unlikely(!size))
+        return NULL;
+
+    struct ubuf_block_mmap_shared *shared =
+        malloc(sizeof(struct ubuf_block_mmap_shared));
+    if (unlikely(shared == NULL))
+        return NULL;
+
+    /* mappings start on a page boundary; the pages stay backed by the file,
+     * so truncating it while they are mapped raises SIGBUS on access */
+    uint64_t start = offset - offset % ubuf_block_mmap_page_size();
+    shared->size = offset - start + size;
+    shared->base = mmap(NULL, shared->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, fd, start);
+    if (likely(shared->base != MAP_FAILED)) {
+        shared->mapped = true;
+        madvise(shared->base, shared->size, MADV_SEQUENTIAL);
+    } else if (unlikely(!ubuf_block_mmap_read(shared, fd, start))) {
+        free(shared);
+        return NULL;
+    }
+    uatomic_init(&shared->refcount, 1);
+
+    struct ubuf *ubuf = ubuf_block_mmap_alloc_pool(mgr, shared);
+    if (unlikely(ubuf == NULL)) {
+        ubuf_block_mmap_shared_release(shared);
+        return NULL;
+    }
+    ubuf_block_common_set(ubuf, offset - start, size);
+    return ubuf;
+}
+
+/** @This asks for the creation of a new reference to the same buffer space.
+ *
+ * @param ubuf pointer to ubuf
+ * @param new_ubuf_p reference written with a pointer to the newly allocated
+ * ubuf
+ * @return an error code
+ */
+static int ubuf_block_mmap_dup(struct ubuf *ubuf, struct ubuf **new_ubuf_p)
+{
+    assert(new_ubuf_p != NULL);
+    struct ubuf_block_mmap *block_mmap = ubuf_block_mmap_from_ubuf(ubuf);
+    uatomic_fetch_add(&block_mmap->shared->refcount, 1);
+    struct ubuf *new_ubuf = ubuf_block_mmap_alloc_pool(ubuf->mgr,
+                                                       block_mmap->shared);
+    if (unlikely(new_ubuf == NULL)) {
+        ubuf_block_mmap_shared_release(block_mmap->shared);
+        return UBASE_ERR_ALLOC;
+    }
+
+    if (unlikely(!ubase_check(ubuf_block_common_dup(ubuf, new_ubuf)))) {
+        ubuf_free(new_ubuf);
+        return UBASE_ERR_INVALID;
+    }
+    *new_ubuf_p = new_ubuf;
+    return UBASE_ERR_NONE;
+}
+
+/** @This asks for the creation of a new reference to part of the same buffer
+ * space.
+ *
+ * @param ubuf pointer to ubuf
+ * @param new_ubuf_p reference written with a pointer to the newly allocated
+ * ubuf
+ * @param offset offset in the buffer
+ * @param size final size of the buffer
+ * @return an error code
+ */
+static int ubuf_block_mmap_splice(struct ubuf *ubuf, struct ubuf **new_ubuf_p,
+                                  int offset, int size)
+{
+    assert(new_ubuf_p != NULL);
+    struct ubuf_block_mmap *block_mmap = ubuf_block_mmap_from_ubuf(ubuf);
+    uatomic_fetch_add(&block_mmap->shared->refcount, 1);
+    struct ubuf *new_ubuf = ubuf_block_mmap_alloc_pool(ubuf->mgr,
+                                                       block_mmap->shared);
+    if (unlikely(new_ubuf == NULL)) {
+        ubuf_block_mmap_shared_release(block_mmap->shared);
+        return UBASE_ERR_ALLOC;
+    }
+
+    if (unlikely(!ubase_check(ubuf_block_common_splice(ubuf, new_ubuf,
+                                                       offset, size)))) {
+        ubuf_free(new_ubuf);
+        return UBASE_ERR_INVALID;
+    }
+    *new_ubuf_p = new_ubuf;
+    return UBASE_ERR_NONE;
+}
+
+/** @This handles control commands.
+ *
+ * @param ubuf pointer to ubuf
+ * @param command type of command to process
+ * @param args arguments of the command
+ * @return an error code
+ */
+static int ubuf_block_mmap_control(struct ubuf *ubuf, int command,
+                                   va_list args)
+{
+    switch (command) {
+        case UBUF_DUP: {
+            struct ubuf **new_ubuf_p = va_arg(args, struct ubuf **);
+            return ubuf_block_mmap_dup(ubuf, new_ubuf_p);
+        }
+        case UBUF_SINGLE: {
+            struct ubuf_block_mmap *block_mmap =
+                ubuf_block_mmap_from_ubuf(ubuf);
+            return uatomic_load(&block_mmap->shared->refcount) == 1 ?
+                   UBASE_ERR_NONE : UBASE_ERR_BUSY;
+        }
+        case UBUF_SPLICE_BLOCK: {
+            struct ubuf **new_ubuf_p = va_arg(args, struct ubuf **);
+            int offset = va_arg(args, int);
+            int size = va_arg(args, int);
+            return ubuf_block_mmap_splice(ubuf, new_ubuf_p, offset, size);
+        }
+        default:
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** @This recycles or frees a ubuf.
+ *
+ * @param ubuf pointer to a ubuf structure
+ */
+static void ubuf_block_mmap_free(struct ubuf *ubuf)
+{
+    struct ubuf_block_mmap_mgr *mmap_mgr =
+        ubuf_block_mmap_mgr_from_ubuf_mgr(ubuf->mgr);
+    struct ubuf_block_mmap *block_mmap = ubuf_block_mmap_from_ubuf(ubuf);
+
+    ubuf_block_common_clean(ubuf);
+    ubuf_block_mmap_shared_release(block_mmap->shared);
+    upool_free(&mmap_mgr->ubuf_pool, block_mmap);
+}
+
+/** @This advises the kernel that a part of a mapped block will be accessed
+ * soon, so that it is read ahead.
+ *
+ * @param ubuf pointer to ubuf allocated by the block mmap allocator
+ * @param offset offset of the part in the block, in octets
+ * @param size size of the part, in octets
+ * @return an error code
+ */
+int ubuf_block_mmap_prefetch(struct ubuf *ubuf, uint64_t offset,
+                             uint64_t size)
+{
+    if (unlikely(ubuf->mgr->ubuf_alloc != _ubuf_block_mmap_alloc))
+        return UBASE_ERR_INVALID;
+
+    struct ubuf_block_mmap *block_mmap = ubuf_block_mmap_from_ubuf(ubuf);
+    struct ubuf_block_mmap_shared *shared = block_mmap->shared;
+    if (!shared->mapped)
+        return UBASE_ERR_NONE;
+    offset += block_mmap->ubuf_block.offset;
+    if (offset >= shared->size)
+        return UBASE_ERR_NONE;
+    if (size > shared->size - offset)
+        size = shared->size - offset;
+
+    uint64_t start = offset - offset % ubuf_block_mmap_page_size();
+    if (unlikely(madvise(shared->base + start, size + offset - start,
+                         MADV_WILLNEED) == -1))
+        return UBASE_ERR_EXTERNAL;
+    return UBASE_ERR_NONE;
+}
+
+/** @internal @This allocates the data structure.
+ *
+ * @param upool pointer to upool
+ * @return pointer to ubuf_block_mmap or NULL in case of allocation error
+ */
+static void *ubuf_block_mmap_alloc_inner(struct upool *upool)
+{
+    struct ubuf_block_mmap_mgr *mmap_mgr =
+        ubuf_block_mmap_mgr_from_ubuf_pool(upool);
+    struct ubuf_block_mmap *block_mmap =
+        malloc(sizeof(struct ubuf_block_mmap));
+    if (unlikely(block_mmap == NULL))
+        return NULL;
+    struct ubuf *ubuf = ubuf_block_mmap_to_ubuf(block_mmap);
+    ubuf->mgr = ubuf_block_mmap_mgr_to_ubuf_mgr(mmap_mgr);
+    return block_mmap;
+}
+
+/** @internal @This frees a ubuf_block_mmap.
+ *
+ * @param upool pointer to upool
+ * @param _block_mmap pointer to a ubuf_block_mmap structure to free
+ */
+static void ubuf_block_mmap_free_inner(struct upool *upool, void *_block_mmap)
+{
+    free(_block_mmap);
+}
+
+/** @This checks if the given flow format can be allocated with the manager.
+ * Blocks can only be allocated from files with @ref ubuf_block_mmap_alloc,
+ * not with @ref ubuf_block_alloc, so no flow format is accepted.
+ *
+ * @param mgr pointer to ubuf manager
+ * @param flow_format flow format to check
+ * @return an error code
+ */
+static int ubuf_block_mmap_mgr_check(struct ubuf_mgr *mgr,
+                                     struct uref *flow_format)
+{
+    return UBASE_ERR_INVALID;
+}
+
+/** @This handles manager control commands.
+ *
+ * @param mgr pointer to ubuf manager
+ * @param command type of command to process
+ * @param args arguments of the command
+ * @return an error code
+ */
+static int ubuf_block_mmap_mgr_control(struct ubuf_mgr *mgr,
+                                       int command, va_list args)
+{
+    switch (command) {
+        case UBUF_MGR_CHECK: {
+            struct uref *flow_format = va_arg(args, struct uref *);
+            return ubuf_block_mmap_mgr_check(mgr, flow_format);
+        }
+        case UBUF_MGR_VACUUM: {
+            struct ubuf_block_mmap_mgr *mmap_mgr =
+                ubuf_block_mmap_mgr_from_ubuf_mgr(mgr);
+            upool_vacuum(&mmap_mgr->ubuf_pool);
+            return UBASE_ERR_NONE;
+        }
+        default:
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** @This frees a ubuf manager.
+ *
+ * @param urefcount pointer to urefcount
+ */
+static void ubuf_block_mmap_mgr_free(struct urefcount *urefcount)
+{
+    struct ubuf_block_mmap_mgr *mmap_mgr =
+        ubuf_block_mmap_mgr_from_urefcount(urefcount);
+    upool_clean(&mmap_mgr->ubuf_pool);
+
+    urefcount_clean(urefcount);
+    free(mmap_mgr);
+}
+
+/** @This allocates a new instance of the ubuf manager for block formats
+ * using mapped files.
+ *
+ * @param ubuf_pool_depth maximum number of ubuf structures in the pool
+ * @return pointer to manager, or NULL in case of error
+ */
+struct ubuf_mgr *ubuf_block_mmap_mgr_alloc(uint16_t ubuf_pool_depth)
+{
+    struct ubuf_block_mmap_mgr *mmap_mgr =
+        malloc(sizeof(struct ubuf_block_mmap_mgr) +
+               upool_sizeof(ubuf_pool_depth));
+    if (unlikely(mmap_mgr == NULL))
+        return NULL;
+
+    urefcount_init(ubuf_block_mmap_mgr_to_urefcount(mmap_mgr),
+                   ubuf_block_mmap_mgr_free);
+    mmap_mgr->mgr.refcount = ubuf_block_mmap_mgr_to_urefcount(mmap_mgr);
+    mmap_mgr->mgr.signature = UBUF_ALLOC_BLOCK;
+    mmap_mgr->mgr.ubuf_alloc = _ubuf_block_mmap_alloc;
+    mmap_mgr->mgr.ubuf_control = ubuf_block_mmap_control;
+    mmap_mgr->mgr.ubuf_free = ubuf_block_mmap_free;
+    mmap_mgr->mgr.ubuf_mgr_control = ubuf_block_mmap_mgr_control;
+
+    upool_init(&mmap_mgr->ubuf_pool, mmap_mgr->mgr.refcount, ubuf_pool_depth,
+               mmap_mgr->upool_extra, ubuf_block_mmap_alloc_inner,
+               ubuf_block_mmap_free_inner);
+
+    return ubuf_block_mmap_mgr_to_ubuf_mgr(mmap_mgr);
+}
@@ -0,0 +1,353 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe implementation of uclock using the CPU time-stamp counter
+ */
+
+#include "upipe/ubase.h"
+#include "upipe/urefcount.h"
+#include "upipe/uatomic.h"
+#include "upipe/uclock.h"
+#include "upipe/uclock_std.h"
+#include "upipe/uclock_tsc.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) && !defined(__MACH__)
+#include <cpuid.h>
+#include <x86intrin.h>
+
+/** fractional bits of the fixed-point conversion */
+#define UCLOCK_TSC_SHIFT 40
+/** number of tries to get a tight pair of system time and counter */
+#define UCLOCK_TSC_TRIES 5
+/** duration of the calibration at allocation */
+#define UCLOCK_TSC_CALIBRATION (UCLOCK_FREQ / 50)
+/** period of the re-anchoring to the system clock */
+#define UCLOCK_TSC_PERIOD UCLOCK_FREQ
+/** above this error, the clock is stepped rather than slewed */
+#define UCLOCK_TSC_MAX_SLEW (UCLOCK_FREQ / 1000)
+
+/** @This is a conversion point from counter to system time. */
+struct uclock_tsc_anchor {
+    /** counter value of the anchor */
+    uint64_t tsc;
+    /** system time of the anchor, in 2^-UCLOCK_TSC_SHIFT 27 MHz ticks */
+    unsigned __int128 base;
+    /** 27 MHz ticks per counter tick, in 2^-UCLOCK_TSC_SHIFT units */
+    uint64_t mult;
+};
+
+/** super-set of the uclock structure with additional local members */
+struct uclock_tsc {
+    /** refcount management structure */
+    struct urefcount urefcount;
+
+    /** flags at the creation of this clock */
+    enum uclock_std_flags flags;
+    /** number of counter ticks between re-anchorings */
+    uint64_t period;
+
+    /** generation of the active anchor, whose slot is generation & 1 */
+    uatomic_uint32_t generation;
+    /** set while a thread re-anchors the clock */
+    uatomic_uint32_t lock;
+    /** double-buffered conversion points */
+    struct uclock_tsc_anchor anchors[2];
+
+    /** counter value of the last system time measurement */
+    uint64_t measure_tsc;
+    /** last system time measurement, in 27 MHz ticks */
+    uint64_t measure;
+
+    /** structure exported to modules */
+    struct uclock uclock;
+};
+
+UBASE_FROM_TO(uclock_tsc, uclock, uclock, uclock)
+UBASE_FROM_TO(uclock_tsc, urefcount, urefcount, urefcount)
+
+/** @internal @This returns the system time.
+ *
+ * @param flags type of clock
+ * @return system time in 27 MHz ticks
+ */
+static uint64_t uclock_tsc_system(enum uclock_std_flags flags)
+{
+    struct timespec ts;
+    if (unlikely(clock_gettime((flags & UCLOCK_FLAG_REALTIME) ?
+                               CLOCK_REALTIME : CLOCK_MONOTONIC, &ts) == -1))
+        return UINT64_MAX;
+    return ts.tv_sec * UCLOCK_FREQ +
+           ts.tv_nsec * UCLOCK_FREQ / UINT64_C(1000000000);
+}
+
+/** @internal @This measures the system time and the matching counter value,
+ * keeping the tightest of a few tries.
+ *
+ * @param flags type of clock
+ * @param tsc_p filled in with the counter value
+ * @return system time in 27 MHz ticks
+ */
+static uint64_t uclock_tsc_measure(enum uclock_std_flags flags,
+                                   uint64_t *tsc_p)
+{
+    uint64_t best = UINT64_MAX, system = UINT64_MAX;
+    for (int i = 0; i < UCLOCK_TSC_TRIES; i++) {
+        uint64_t before = __rdtsc();
+        uint64_t now = uclock_tsc_system(flags);
+        uint64_t after = __rdtsc();
+        if (after - before < best) {
+            best = after - before;
+            system = now;
+            *tsc_p = before + (after - before) / 2;
+        }
+    }
+    return system;
+}
+
+/** @internal @This returns the rate between two measurements.
+ *
+ * @param system_delta system time elapsed in 27 MHz ticks
+ * @param tsc_delta counter ticks elapsed
+ * @return 27 MHz ticks per counter tick, in 2^-UCLOCK_TSC_SHIFT units
+ */
+static uint64_t uclock_tsc_rate(uint64_t system_delta, uint64_t tsc_delta)
+{
+    return ((unsigned __int128)system_delta << UCLOCK_TSC_SHIFT) / tsc_delta;
+}
+
+/** @internal @This re-anchors the clock to the system time. The error
+ * accumulated since the last anchor is absorbed during the next period by
+ * adjusting the rate, unless it is too large. Large errors step the clock
+ * forward, or hold it until the system time catches up if the system clock
+ * went backwards, so that it never decreases.
+ *
+ * @param tsc private structure
+ */
+static void uclock_tsc_reanchor(struct uclock_tsc *tsc)
+{
+    uint32_t generation = uatomic_load(&tsc->generation);
+    const struct uclock_tsc_anchor *anchor = &tsc->anchors[generation & 1];
+    struct uclock_tsc_anchor *next = &tsc->anchors[(generation + 1) & 1];
+
+    uint64_t now_tsc;
+    uint64_t system = uclock_tsc_measure(tsc->flags, &now_tsc);
+    if (unlikely(system == UINT64_MAX || now_tsc <= tsc->measure_tsc))
+        return;
+
+    unsigned __int128 current = anchor->base;
+    if (likely((int64_t)(now_tsc - anchor->tsc) > 0))
+        current += (unsigned __int128)(now_tsc - anchor->tsc) * anchor->mult;
+    unsigned __int128 target = (unsigned __int128)system << UCLOCK_TSC_SHIFT;
+    uint64_t rate = system > tsc->measure ?
+                    uclock_tsc_rate(system - tsc->measure,
+                                    now_tsc - tsc->measure_tsc) :
+                    anchor->mult;
+
+    next->tsc = now_tsc;
+    if (target > current + ((unsigned __int128)UCLOCK_TSC_MAX_SLEW <<
+                            UCLOCK_TSC_SHIFT)) {
+        /* step forward */
+        next->base = target;
+        next->mult = rate;
+    } else if (current > target + ((unsigned __int128)UCLOCK_TSC_MAX_SLEW <<
+                                   UCLOCK_TSC_SHIFT)) {
+        /* hold the clock until the system time catches up, by moving the
+         * anchor into the future: readers clamp to its base until then */
+        next->tsc = now_tsc + (uint64_t)((current - target) / anchor->mult);
+        next->base = current;
+        next->mult = anchor->mult;
+    } else {
+        /* slew so that the error is absorbed in one period */
+        next->base = current;
+        if (target >= current)
+            next->mult = rate + (uint64_t)((target - current) / tsc->period);
+        else
+            next->mult = rate - (uint64_t)((current - target) / tsc->period);
+    }
+
+    tsc->measure_tsc = now_tsc;
+    tsc->measure = system;
+    uatomic_store(&tsc->generation, generation + 1);
+}
+
+/** @This returns the current system time.
+ *
+ * @param uclock utility structure passed to the module
+ * @return current system time in 27 MHz ticks
+ */
+static uint64_t uclock_tsc_now(struct uclock *uclock)
+{
+    struct uclock_tsc *tsc = uclock_tsc_from_uclock(uclock);
+    for ( ; ; ) {
+        uint32_t generation = uatomic_load(&tsc->generation);
+        struct uclock_tsc_anchor anchor = tsc->anchors[generation & 1];
+        uint64_t now_tsc = __rdtsc();
+        if (unlikely(uatomic_load(&tsc->generation) != generation))
+            continue;
+
+        uint64_t delta = now_tsc - anchor.tsc;
+        if (unlikely(delta > tsc->period && (int64_t)delta > 0)) {
+            uint32_t unlocked = 0;
+            if (uatomic_compare_exchange(&tsc->lock, &unlocked, 1)) {
+                uclock_tsc_reanchor(tsc);
+                uatomic_store(&tsc->lock, 0);
+                continue;
+            }
+        } else if (unlikely((int64_t)delta < 0)) {
+            /* counter read on a core behind the anchor, or clock held */
+            delta = 0;
+        }
+
+        return (anchor.base + (unsigned __int128)delta * anchor.mult) >>
+               UCLOCK_TSC_SHIFT;
+    }
+}
+
+/** @This converts a system time to Epoch-based real time (from
+ * 1970-01-01 00:00:00 +0000). The scale is in units of @ref #UCLOCK_FREQ,
+ * divide by it to get standard time_t.
+ *
+ * @param uclock pointer to uclock
+ * @param systime system time in 27 MHz ticks
+ * @return number of ticks since the Epoch, or UINT64_MAX if unsupported
+ */
+static uint64_t uclock_tsc_to_real(struct uclock *uclock, uint64_t systime)
+{
+    struct uclock_tsc *tsc = uclock_tsc_from_uclock(uclock);
+
+    if (tsc->flags & UCLOCK_FLAG_REALTIME)
+        return systime;
+
+    uint64_t now = uclock_tsc_now(uclock);
+    uint64_t ref = uclock_tsc_system(UCLOCK_FLAG_REALTIME);
+    return ref + systime - now;
+}
+
+/** @This converts Epoch-based real time (from * 1970-01-01 00:00:00 +0000)
+ * to real time. The scale has to be passed in units of @ref #UCLOCK_FREQ.
+ *
+ * @param uclock pointer to uclock
+ * @param real number of ticks since the Epoch
+ * @return system time in 27 MHz ticks, or UINT64_MAX if unsupported
+ */
+static uint64_t uclock_tsc_from_real(struct uclock *uclock, uint64_t real)
+{
+    struct uclock_tsc *tsc = uclock_tsc_from_uclock(uclock);
+
+    if (tsc->flags & UCLOCK_FLAG_REALTIME)
+        return real;
+
+    uint64_t now = uclock_tsc_now(uclock);
+    uint64_t ref = uclock_tsc_system(UCLOCK_FLAG_REALTIME);
+    return now + real - ref;
+}
+
+/** @This frees a uclock.
+ *
+ * @param urefcount pointer to urefcount
+ */
+static void uclock_tsc_free(struct urefcount *urefcount)
+{
+    struct uclock_tsc *tsc = uclock_tsc_from_urefcount(urefcount);
+    uatomic_clean(&tsc->generation);
+    uatomic_clean(&tsc->lock);
+    urefcount_clean(urefcount);
+    free(tsc);
+}
+
+/** @internal @This checks that the CPU has an invariant time-stamp counter.
+ *
+ * @return true if the counter can be used
+ */
+static bool uclock_tsc_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+        eax < 0x80000007)
+        return false;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+    return !!(edx & (1 << 8));
+}
+
+/** @This allocates a new uclock structure.
+ *
+ * @param flags flags for the creation of a uclock structure
+ * @return pointer to uclock, or NULL in case of error
+ */
+struct uclock *uclock_tsc_alloc(enum uclock_std_flags flags)
+{
+    if (!uclock_tsc_invariant())
+        return uclock_std_alloc(flags);
+
+    uint64_t start_tsc, end_tsc;
+    uint64_t start = uclock_tsc_measure(flags, &start_tsc);
+    if (unlikely(start == UINT64_MAX))
+        return NULL;
+    struct timespec ts = {
+        .tv_sec = 0,
+        .tv_nsec = UCLOCK_TSC_CALIBRATION * UINT64_C(1000000000) / UCLOCK_FREQ
+    };
+    nanosleep(&ts, NULL);
+    uint64_t end = uclock_tsc_measure(flags, &end_tsc);
+    if (unlikely(end == UINT64_MAX || end <= start || end_tsc <= start_tsc))
+        return uclock_std_alloc(flags);
+
+    struct uclock_tsc *tsc = malloc(sizeof(struct uclock_tsc));
+    if (unlikely(tsc == NULL))
+        return NULL;
+    tsc->flags = flags;
+    tsc->anchors[0].tsc = end_tsc;
+    tsc->anchors[0].base = (unsigned __int128)end << UCLOCK_TSC_SHIFT;
+    tsc->anchors[0].mult = uclock_tsc_rate(end - start, end_tsc - start_tsc);
+    tsc->anchors[1] = tsc->anchors[0];
+    tsc->period = (unsigned __int128)UCLOCK_TSC_PERIOD * (end_tsc - start_tsc)
+                  / (end - start);
+    tsc->measure_tsc = end_tsc;
+    tsc->measure = end;
+    uatomic_init(&tsc->generation, 0);
+    uatomic_init(&tsc->lock, 0);
+
+    urefcount_init(uclock_tsc_to_urefcount(tsc), uclock_tsc_free);
+    tsc->uclock.refcount = uclock_tsc_to_urefcount(tsc);
+    tsc->uclock.uclock_now = uclock_tsc_now;
+    tsc->uclock.uclock_to_real = uclock_tsc_to_real;
+    tsc->uclock.uclock_from_real = uclock_tsc_from_real;
+    return uclock_tsc_to_uclock(tsc);
+}
+
+#else
+
+/** @This allocates a new uclock structure.
+ *
+ * @param flags flags for the creation of a uclock structure
+ * @return pointer to uclock, or NULL in case of error
+ */
+struct uclock *uclock_tsc_alloc(enum uclock_std_flags flags)
+{
+    return uclock_std_alloc(flags);
+}
+
+#endif
@@ -144,6 +144,20 @@ static void upipe_dump_pipe(upipe_dump_pipe_label pipe_label,
         return;
 
     char *label = pipe_label(upipe);
+    if (upipe->stats != NULL) {
+        struct upipe_stats *stats = upipe->stats;
+        char *stats_label;
+        if (asprintf(&stats_label, "%s\\n%"PRIu64" urefs, %"PRIu64" octets"
+                     "\\n%"PRIu64" cycles/uref, max %"PRIu64
+                     "\\nqueue %"PRIu64", max %"PRIu64, label ?: "",
+                     stats->urefs, stats->octets,
+                     stats->urefs ? stats->cycles / stats->urefs : 0,
+                     stats->max_cycles, stats->queue_depth,
+                     stats->max_queue_depth) != -1) {
+            free(label);
+            label = stats_label;
+        }
+    }
 
     /* Prepare context. */
     struct upipe_dump_ctx *ctx = malloc(sizeof(struct upipe_dump_ctx));
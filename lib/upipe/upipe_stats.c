@@ -0,0 +1,157 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short Upipe per-pipe instrumentation counters
+ */
+
+#include "upipe/ubase.h"
+#include "upipe/upipe.h"
+#include "upipe/uref.h"
+#include "upipe/uref_block.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** true if all new pipes are instrumented; only accessed atomically since
+ * pipes may be allocated from several threads */
+static bool upipe_stats_global = false;
+
+/** ticks spent in the instrumented pipes called by the input function
+ * currently running on this thread */
+static __thread uint64_t upipe_stats_nested = 0;
+
+/** @internal @This returns the current value of the tick counter.
+ *
+ * @return CPU cycles, or nanoseconds without a cycle counter
+ */
+static inline uint64_t upipe_stats_now(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+#endif
+}
+
+/** @This enables or disables the instrumentation of all the pipes allocated
+ * afterwards, whatever their manager.
+ *
+ * @param enable true to instrument the pipes
+ */
+void upipe_stats_set_global(bool enable)
+{
+#ifdef UPIPE_HAVE_ATOMIC_OPS
+    __atomic_store_n(&upipe_stats_global, enable, __ATOMIC_RELAXED);
+#else
+    *(volatile bool *)&upipe_stats_global = enable;
+#endif
+}
+
+/** @internal @This returns true if all new pipes are instrumented.
+ *
+ * @return true if all new pipes are instrumented
+ */
+static inline bool upipe_stats_get_global(void)
+{
+#ifdef UPIPE_HAVE_ATOMIC_OPS
+    return __atomic_load_n(&upipe_stats_global, __ATOMIC_RELAXED);
+#else
+    return *(volatile bool *)&upipe_stats_global;
+#endif
+}
+
+/** @internal @This allocates the instrumentation counters of a new pipe,
+ * if instrumentation is enabled for its manager or globally.
+ *
+ * @param mgr management structure for this pipe type
+ * @return pointer to the counters, or NULL if the pipe is not instrumented
+ */
+struct upipe_stats *upipe_stats_alloc(struct upipe_mgr *mgr)
+{
+    if (likely(!upipe_stats_get_global() && (mgr == NULL || !mgr->stats)))
+        return NULL;
+    return calloc(1, sizeof(struct upipe_stats));
+}
+
+/** @internal @This sends a uref to an instrumented pipe, updating its
+ * counters. The ticks spent in instrumented pipes called from the input
+ * function are subtracted, so that each instrumented pipe only accounts for
+ * its own processing. Non-instrumented pipes are accounted to the
+ * instrumented pipe calling them.
+ *
+ * @param upipe description structure of the pipe
+ * @param uref uref structure to send
+ * @param upump_p reference to the pump that generated the buffer
+ */
+void upipe_stats_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    struct upipe_stats *stats = upipe->stats;
+    size_t size;
+    stats->urefs++;
+    if (uref->ubuf != NULL && ubase_check(uref_block_size(uref, &size)))
+        stats->octets += size;
+
+    uint64_t nested = upipe_stats_nested;
+    upipe_stats_nested = 0;
+    uint64_t start = upipe_stats_now();
+    upipe->mgr->upipe_input(upipe, uref, upump_p);
+    uint64_t total = upipe_stats_now() - start;
+    uint64_t cycles = total > upipe_stats_nested ?
+                      total - upipe_stats_nested : 0;
+    upipe_stats_nested = nested + total;
+
+    stats->cycles += cycles;
+    if (cycles > stats->max_cycles)
+        stats->max_cycles = cycles;
+}
+
+/** @This returns a snapshot of the instrumentation counters of a pipe. It
+ * must be called from the thread running the pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @param stats filled in with the counters
+ * @return an error code, UBASE_ERR_INVALID if the pipe is not instrumented
+ */
+int upipe_stats_get(struct upipe *upipe, struct upipe_stats *stats)
+{
+    if (upipe->stats == NULL)
+        return UBASE_ERR_INVALID;
+    *stats = *upipe->stats;
+    return UBASE_ERR_NONE;
+}
+
+/** @This resets the instrumentation counters of a pipe.
+ *
+ * @param upipe description structure of the pipe
+ * @return an error code, UBASE_ERR_INVALID if the pipe is not instrumented
+ */
+int upipe_stats_reset(struct upipe *upipe)
+{
+    if (upipe->stats == NULL)
+        return UBASE_ERR_INVALID;
+    memset(upipe->stats, 0, sizeof(struct upipe_stats));
+    return UBASE_ERR_NONE;
+}
@@ -33,9 +33,11 @@
 #include "upipe/umutex.h"
 #include "upipe/upump.h"
 #include "upipe/upump_common.h"
+#include "upipe/uprobe.h"
 #include "upump-ev/upump_ev.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <ev.h>
 
@@ -50,6 +52,17 @@ struct upump_ev_mgr {
     /** true if the loop has to be destroyed at the end */
     bool destroy;
 
+    /** true if statistics are recorded */
+    bool stats_enabled;
+    /** statistics of the loop */
+    struct upump_ev_stats stats;
+    /** pump whose callback is running, or NULL if it was freed meanwhile */
+    struct upump_ev *dispatching;
+    /** probe receiving the periodic statistics */
+    struct uprobe *stats_uprobe;
+    /** timer throwing the periodic statistics */
+    struct ev_timer stats_timer;
+
     /** common structure */
     struct upump_common_mgr common_mgr;
 
@@ -78,15 +91,87 @@ struct upump_ev {
     union {
         struct {
             uint64_t after;
+            /** date at which the timer is expected to expire */
+            ev_tstamp expected;
         } timer;
     };
 
+    /** statistics of the pump */
+    struct upump_ev_stats stats;
+
     /** common structure */
     struct upump_common common;
 };
 
 UBASE_FROM_TO(upump_ev, upump, upump, common.upump)
 
+/** @internal @This adds a duration to a statistics histogram.
+ *
+ * @param histogram histogram of UPUMP_EV_STATS_BUCKETS buckets
+ * @param max_p pointer to the maximum duration
+ * @param duration duration in seconds
+ */
+static void upump_ev_stats_add(uint64_t *histogram, uint64_t *max_p,
+                               ev_tstamp duration)
+{
+    uint64_t us = duration > 0. ? duration * 1000000. : 0;
+    unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= UPUMP_EV_STATS_BUCKETS)
+        bucket = UPUMP_EV_STATS_BUCKETS - 1;
+    histogram[bucket]++;
+    if (us > *max_p)
+        *max_p = us;
+}
+
+/** @internal @This dispatches an event to a pump and records statistics.
+ *
+ * @param upump_ev pump to dispatch
+ * @param expected date at which a timer was expected to expire
+ */
+static void upump_ev_dispatch_stats(struct upump_ev *upump_ev,
+                                    ev_tstamp expected)
+{
+    struct upump *upump = upump_ev_to_upump(upump_ev);
+    struct upump_ev_mgr *ev_mgr = upump_ev_mgr_from_upump_mgr(upump->mgr);
+    struct upump_ev *dispatching = ev_mgr->dispatching;
+    ev_tstamp start = ev_time();
+
+    if (upump_ev->event == UPUMP_TYPE_TIMER) {
+        ev_tstamp late = start - expected;
+        upump_ev_stats_add(ev_mgr->stats.late, &ev_mgr->stats.late_max, late);
+        upump_ev_stats_add(upump_ev->stats.late, &upump_ev->stats.late_max,
+                           late);
+    }
+
+    ev_mgr->dispatching = upump_ev;
+    upump_common_dispatch(upump);
+    ev_tstamp run = ev_time() - start;
+
+    ev_mgr->stats.dispatched++;
+    upump_ev_stats_add(ev_mgr->stats.run, &ev_mgr->stats.run_max, run);
+    /* the pump may have been freed by its callback */
+    if (ev_mgr->dispatching != NULL) {
+        upump_ev->stats.dispatched++;
+        upump_ev_stats_add(upump_ev->stats.run, &upump_ev->stats.run_max,
+                           run);
+    }
+    ev_mgr->dispatching = dispatching;
+}
+
+/** @internal @This dispatches an event to a pump.
+ *
+ * @param upump_ev pump to dispatch
+ */
+static inline void upump_ev_dispatch(struct upump_ev *upump_ev)
+{
+    struct upump *upump = upump_ev_to_upump(upump_ev);
+    struct upump_ev_mgr *ev_mgr = upump_ev_mgr_from_upump_mgr(upump->mgr);
+    if (unlikely(ev_mgr->stats_enabled))
+        upump_ev_dispatch_stats(upump_ev, 0.);
+    else
+        upump_common_dispatch(upump);
+}
+
 /** @This dispatches an event to a pump for type ev_io.
  *
  * @param ev_loop current event loop (unused parameter)
@@ -97,8 +182,7 @@ static void upump_ev_dispatch_io(struct ev_loop *ev_loop,
                                  struct ev_io *ev_io, int revents)
 {
     struct upump_ev *upump_ev = container_of(ev_io, struct upump_ev, ev_io);
-    struct upump *upump = upump_ev_to_upump(upump_ev);
-    upump_common_dispatch(upump);
+    upump_ev_dispatch(upump_ev);
 }
 
 /** @This dispatches an event to a pump for type ev_timer.
@@ -113,7 +197,19 @@ static void upump_ev_dispatch_timer(struct ev_loop *ev_loop,
     struct upump_ev *upump_ev = container_of(ev_timer, struct upump_ev,
                                              ev_timer);
     struct upump *upump = upump_ev_to_upump(upump_ev);
-    upump_common_dispatch(upump);
+    struct upump_ev_mgr *ev_mgr = upump_ev_mgr_from_upump_mgr(upump->mgr);
+    ev_tstamp expected = upump_ev->timer.expected;
+    if (ev_timer->repeat) {
+        /* same rescheduling as libev, before the callback may restart us */
+        upump_ev->timer.expected += ev_timer->repeat;
+        if (upump_ev->timer.expected < ev_now(ev_loop))
+            upump_ev->timer.expected = ev_now(ev_loop);
+    }
+
+    if (unlikely(ev_mgr->stats_enabled))
+        upump_ev_dispatch_stats(upump_ev, expected);
+    else
+        upump_common_dispatch(upump);
 }
 
 /** @This dispatches an event to a pump for type ev_idle.
@@ -126,8 +222,7 @@ static void upump_ev_dispatch_idle(struct ev_loop *ev_loop,
                                    struct ev_idle *ev_idle, int revents)
 {
     struct upump_ev *upump_ev = container_of(ev_idle, struct upump_ev, ev_idle);
-    struct upump *upump = upump_ev_to_upump(upump_ev);
-    upump_common_dispatch(upump);
+    upump_ev_dispatch(upump_ev);
 }
 
 /** @This dispatches an event to a pump for type ev_signal.
@@ -141,8 +236,7 @@ static void upump_ev_dispatch_signal(struct ev_loop *ev_loop,
 {
     struct upump_ev *upump_ev = container_of(ev_signal, struct upump_ev,
                                              ev_signal);
-    struct upump *upump = upump_ev_to_upump(upump_ev);
-    upump_common_dispatch(upump);
+    upump_ev_dispatch(upump_ev);
 }
 
 /** @This allocates a new upump_ev.
@@ -197,6 +291,7 @@ static struct upump *upump_ev_alloc(struct upump_mgr *mgr,
             return NULL;
     }
     upump_ev->event = event;
+    memset(&upump_ev->stats, 0, sizeof(upump_ev->stats));
 
     upump_common_init(upump);
 
@@ -218,6 +313,8 @@ static void upump_ev_real_start(struct upump *upump, bool status)
             ev_idle_start(ev_mgr->ev_loop, &upump_ev->ev_idle);
             break;
         case UPUMP_TYPE_TIMER:
+            upump_ev->timer.expected = ev_now(ev_mgr->ev_loop) +
+                                       upump_ev->ev_timer.at;
             ev_timer_start(ev_mgr->ev_loop, &upump_ev->ev_timer);
             break;
         case UPUMP_TYPE_FD_READ:
@@ -279,6 +376,8 @@ static void upump_ev_real_restart(struct upump *upump, bool status)
         case UPUMP_TYPE_TIMER: {
             bool active = ev_is_active(&upump_ev->ev_timer);
             if (active && upump_ev->ev_timer.repeat) {
+                upump_ev->timer.expected = ev_now(ev_mgr->ev_loop) +
+                                           upump_ev->ev_timer.repeat;
                 ev_timer_again(ev_mgr->ev_loop, &upump_ev->ev_timer);
                 return;
             }
@@ -287,6 +386,8 @@ static void upump_ev_real_restart(struct upump *upump, bool status)
                 ev_timer_stop(ev_mgr->ev_loop, &upump_ev->ev_timer);
             upump_ev->ev_timer.at =
                 (ev_tstamp)upump_ev->timer.after / UCLOCK_FREQ;
+            upump_ev->timer.expected = ev_now(ev_mgr->ev_loop) +
+                                       upump_ev->ev_timer.at;
             ev_timer_start(ev_mgr->ev_loop, &upump_ev->ev_timer);
             break;
         }
@@ -306,6 +407,8 @@ static void upump_ev_free(struct upump *upump)
     upump_stop(upump);
     upump_common_clean(upump);
     struct upump_ev *upump_ev = upump_ev_from_upump(upump);
+    if (ev_mgr->dispatching == upump_ev)
+        ev_mgr->dispatching = NULL;
     upool_free(&ev_mgr->common_mgr.upump_pool, upump_ev);
 }
 
@@ -379,6 +482,13 @@ static int upump_ev_control(struct upump *upump, int command, va_list args)
             upump_common_blocker_free(blocker);
             return UBASE_ERR_NONE;
         }
+        case UPUMP_EV_GET_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPUMP_EV_SIGNATURE)
+            struct upump_ev_stats *stats =
+                va_arg(args, struct upump_ev_stats *);
+            *stats = upump_ev_from_upump(upump)->stats;
+            return UBASE_ERR_NONE;
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -437,6 +547,60 @@ static int upump_ev_mgr_run(struct upump_mgr *mgr, struct umutex *mutex)
     return status ? UBASE_ERR_BUSY : UBASE_ERR_NONE;
 }
 
+/** @internal @This throws the statistics of the loop and resets them.
+ *
+ * @param ev_loop current event loop (unused parameter)
+ * @param ev_timer stats timer
+ * @param revents events triggered (unused parameter)
+ */
+static void upump_ev_mgr_stats_timer(struct ev_loop *ev_loop,
+                                     struct ev_timer *ev_timer, int revents)
+{
+    struct upump_ev_mgr *ev_mgr = container_of(ev_timer, struct upump_ev_mgr,
+                                               stats_timer);
+    struct upump_ev_stats stats = ev_mgr->stats;
+    memset(&ev_mgr->stats, 0, sizeof(ev_mgr->stats));
+    uprobe_throw(ev_mgr->stats_uprobe, NULL, UPROBE_UPUMP_EV_STATS,
+                 UPUMP_EV_SIGNATURE, upump_ev_mgr_to_upump_mgr(ev_mgr),
+                 &stats);
+}
+
+/** @internal @This sets the probe receiving the periodic statistics.
+ *
+ * @param mgr pointer to a upump_mgr structure
+ * @param uprobe probe to throw to (belongs to the callee), or NULL
+ * @param period period of the events, in units of a 27 MHz clock
+ * @return an error code
+ */
+static int _upump_ev_mgr_set_stats_probe(struct upump_mgr *mgr,
+                                         struct uprobe *uprobe,
+                                         uint64_t period)
+{
+    struct upump_ev_mgr *ev_mgr = upump_ev_mgr_from_upump_mgr(mgr);
+    if (ev_mgr->stats_uprobe != NULL) {
+        ev_ref(ev_mgr->ev_loop);
+        ev_timer_stop(ev_mgr->ev_loop, &ev_mgr->stats_timer);
+        uprobe_release(ev_mgr->stats_uprobe);
+        ev_mgr->stats_uprobe = NULL;
+    }
+    if (uprobe == NULL)
+        return UBASE_ERR_NONE;
+    if (unlikely(!period)) {
+        uprobe_release(uprobe);
+        return UBASE_ERR_INVALID;
+    }
+
+    ev_mgr->stats_uprobe = uprobe;
+    ev_mgr->stats_enabled = true;
+    ev_timer_init(&ev_mgr->stats_timer, upump_ev_mgr_stats_timer,
+                  (ev_tstamp)period / UCLOCK_FREQ,
+                  (ev_tstamp)period / UCLOCK_FREQ);
+    ev_timer_start(ev_mgr->ev_loop, &ev_mgr->stats_timer);
+    /* do not keep the loop alive */
+    ev_unref(ev_mgr->ev_loop);
+    return UBASE_ERR_NONE;
+}
+
 /** @This processes control commands on a upump_ev_mgr.
  *
  * @param mgr pointer to a upump_mgr structure
@@ -455,6 +619,31 @@ static int upump_ev_mgr_control(struct upump_mgr *mgr,
         case UPUMP_MGR_VACUUM:
             upump_common_mgr_vacuum(mgr);
             return UBASE_ERR_NONE;
+        case UPUMP_EV_MGR_SET_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPUMP_EV_SIGNATURE)
+            int enable = va_arg(args, int);
+            upump_ev_mgr_from_upump_mgr(mgr)->stats_enabled = !!enable;
+            return UBASE_ERR_NONE;
+        }
+        case UPUMP_EV_MGR_GET_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPUMP_EV_SIGNATURE)
+            struct upump_ev_stats *stats =
+                va_arg(args, struct upump_ev_stats *);
+            *stats = upump_ev_mgr_from_upump_mgr(mgr)->stats;
+            return UBASE_ERR_NONE;
+        }
+        case UPUMP_EV_MGR_RESET_STATS: {
+            UBASE_SIGNATURE_CHECK(args, UPUMP_EV_SIGNATURE)
+            struct upump_ev_mgr *ev_mgr = upump_ev_mgr_from_upump_mgr(mgr);
+            memset(&ev_mgr->stats, 0, sizeof(ev_mgr->stats));
+            return UBASE_ERR_NONE;
+        }
+        case UPUMP_EV_MGR_SET_STATS_PROBE: {
+            UBASE_SIGNATURE_CHECK(args, UPUMP_EV_SIGNATURE)
+            struct uprobe *uprobe = va_arg(args, struct uprobe *);
+            uint64_t period = va_arg(args, uint64_t);
+            return _upump_ev_mgr_set_stats_probe(mgr, uprobe, period);
+        }
         default:
             return UBASE_ERR_UNHANDLED;
     }
@@ -467,6 +656,7 @@ static int upump_ev_mgr_control(struct upump_mgr *mgr,
 static void upump_ev_mgr_free(struct urefcount *urefcount)
 {
     struct upump_ev_mgr *ev_mgr = upump_ev_mgr_from_urefcount(urefcount);
+    _upump_ev_mgr_set_stats_probe(upump_ev_mgr_to_upump_mgr(ev_mgr), NULL, 0);
     upump_common_mgr_clean(upump_ev_mgr_to_upump_mgr(ev_mgr));
     if (ev_mgr->destroy)
         ev_loop_destroy(ev_mgr->ev_loop);
@@ -507,6 +697,10 @@ struct upump_mgr *upump_ev_mgr_alloc(struct ev_loop *ev_loop,
 
     ev_mgr->ev_loop = ev_loop;
     ev_mgr->destroy = false;
+    ev_mgr->stats_enabled = false;
+    memset(&ev_mgr->stats, 0, sizeof(ev_mgr->stats));
+    ev_mgr->dispatching = NULL;
+    ev_mgr->stats_uprobe = NULL;
     return mgr;
 }
 
@@ -0,0 +1,133 @@
+/*
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+
+#include "checkasm.h"
+#include "lib/upipe-filters/audio_meter.h"
+
+#define NUM_SAMPLES 1024
+
+static int sum2_near(double a, double b)
+{
+    return fabs(a - b) <= 1e-9 * fmax(fabs(a), 1.);
+}
+
+#define CHECK_METER(type, name, random, min)                                \
+static void check_meter_##name(void (*func)(const type *, uintptr_t,        \
+                                            double *, double *))            \
+{                                                                           \
+    if (check_func(func, "audio_meter_" #name)) {                           \
+        type buf[NUM_SAMPLES];                                              \
+        declare_func(void, const type *p, uintptr_t n,                      \
+                     double *peak_p, double *sum2_p);                       \
+                                                                            \
+        for (int i = 0; i < NUM_SAMPLES; i++)                               \
+            buf[i] = random;                                                \
+        /* full scale negative value in the middle of a vector */           \
+        buf[37] = min;                                                      \
+        for (int i = 0; i < 64; i++) {                                      \
+            uintptr_t offset = rnd() % 16;                                  \
+            uintptr_t n = i < 40 ? i : rnd() % (NUM_SAMPLES - offset);      \
+            double peak0, peak1, sum20, sum21;                              \
+            call_ref(buf + offset, n, &peak0, &sum20);                      \
+            call_new(buf + offset, n, &peak1, &sum21);                      \
+            if (peak0 != peak1 || !sum2_near(sum20, sum21)) {               \
+                fail();                                                     \
+                break;                                                      \
+            }                                                               \
+        }                                                                   \
+        double peak, sum2;                                                  \
+        bench_new(buf, NUM_SAMPLES, &peak, &sum2);                          \
+    }                                                                       \
+    report("audio_meter_" #name);                                           \
+}
+CHECK_METER(uint8_t, u8, (uint8_t)rnd(), 0)
+CHECK_METER(int16_t, s16, (int16_t)rnd(), INT16_MIN)
+CHECK_METER(int32_t, s32, (int32_t)rnd(), INT32_MIN)
+CHECK_METER(float, flt, (int32_t)rnd() * (1.f / INT32_MAX), -1.f)
+#undef CHECK_METER
+
+typedef float (*tp_func)(const float [UPIPE_AUDIO_METER_TP_PHASES]
+                                     [UPIPE_AUDIO_METER_TP_TAPS],
+                         const float *, uintptr_t);
+
+static void check_true_peak(tp_func func)
+{
+    if (check_func(func, "audio_meter_tp")) {
+        struct upipe_audio_meter_tp tp;
+        float buf[UPIPE_AUDIO_METER_TP_TAPS - 1 + NUM_SAMPLES];
+        float *x = buf + UPIPE_AUDIO_METER_TP_TAPS - 1;
+        declare_func(float, const float coef[UPIPE_AUDIO_METER_TP_PHASES]
+                                            [UPIPE_AUDIO_METER_TP_TAPS],
+                     const float *x, uintptr_t n);
+
+        upipe_audio_meter_tp_init(&tp);
+        for (int i = 0; i < UPIPE_AUDIO_METER_TP_TAPS - 1 + NUM_SAMPLES; i++)
+            buf[i] = (int32_t)rnd() * (1.f / INT32_MAX);
+        for (int i = 0; i < 64; i++) {
+            uintptr_t n = i < 40 ? i : rnd() % NUM_SAMPLES;
+            float peak0 = call_ref(tp.coef, x, n);
+            float peak1 = call_new(tp.coef, x, n);
+            if (!float_near_abs_eps(peak0, peak1, 1e-5)) {
+                fail();
+                break;
+            }
+        }
+        bench_new(tp.coef, x, NUM_SAMPLES);
+    }
+    report("audio_meter_tp");
+}
+
+void checkasm_check_audio_meter(void)
+{
+    struct {
+        void (*u8)(const uint8_t *, uintptr_t, double *, double *);
+        void (*s16)(const int16_t *, uintptr_t, double *, double *);
+        void (*s32)(const int32_t *, uintptr_t, double *, double *);
+        void (*flt)(const float *, uintptr_t, double *, double *);
+        tp_func tp;
+    } s = {
+        .u8 = upipe_audio_meter_u8_c,
+        .s16 = upipe_audio_meter_s16_c,
+        .s32 = upipe_audio_meter_s32_c,
+        .flt = upipe_audio_meter_flt_c,
+        .tp = upipe_audio_meter_tp_c,
+    };
+
+#if defined(__i686__) || defined(__x86_64__)
+    int cpu_flags = av_get_cpu_flags();
+
+    if (cpu_flags & AV_CPU_FLAG_SSE2) {
+        s.s16 = upipe_audio_meter_s16_sse2;
+        s.flt = upipe_audio_meter_flt_sse2;
+    }
+    if (cpu_flags & AV_CPU_FLAG_AVX2) {
+        s.s16 = upipe_audio_meter_s16_avx2;
+        s.s32 = upipe_audio_meter_s32_avx2;
+        s.flt = upipe_audio_meter_flt_avx2;
+    }
+    if ((cpu_flags & AV_CPU_FLAG_AVX2) && (cpu_flags & AV_CPU_FLAG_FMA3)) {
+        s.tp = upipe_audio_meter_tp_avx2;
+    }
+#endif
+
+    check_meter_u8(s.u8);
+    check_meter_s16(s.s16);
+    check_meter_s32(s.s32);
+    check_meter_flt(s.flt);
+    check_true_peak(s.tp);
+}
@@ -75,8 +75,10 @@ static const struct {
     const char *name;
     void (*func)(void);
 } tests[] = {
+    { "audio_meter", checkasm_check_audio_meter },
     { "planar10_input", checkasm_check_planar10_input },
     { "planar8_input", checkasm_check_planar8_input },
+    { "psi_crc", checkasm_check_psi_crc },
     { "sdi_input", checkasm_check_sdi_input },
     { "uyvy_input", checkasm_check_uyvy_input },
     { "v210_input", checkasm_check_v210_input },
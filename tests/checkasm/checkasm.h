@@ -78,8 +78,10 @@
 #define HAVE_RDTSC 0
 #include "timer.h"
 
+void checkasm_check_audio_meter(void);
 void checkasm_check_planar10_input(void);
 void checkasm_check_planar8_input(void);
+void checkasm_check_psi_crc(void);
 void checkasm_check_sdi_input(void);
 void checkasm_check_uyvy_input(void);
 void checkasm_check_v210_input(void);
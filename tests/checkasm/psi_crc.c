@@ -0,0 +1,68 @@
+/*
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "checkasm.h"
+#include "lib/upipe-ts/psi_crc.h"
+
+/* maximum size of a private section */
+#define MAX_SECTION 4096
+
+static void randomize_buffer(uint8_t *buf)
+{
+    for (int i = 0; i < MAX_SECTION; i++)
+        buf[i] = rnd();
+}
+
+void checkasm_check_psi_crc(void)
+{
+    struct {
+        uint32_t (*crc)(uint32_t crc, const uint8_t *p, uintptr_t len);
+    } s = {
+#ifdef HAVE_BITSTREAM_COMMON_H
+        .crc = upipe_psi_crc_c,
+#endif
+    };
+
+#ifdef HAVE_BITSTREAM_COMMON_H
+#if defined(__i686__) || defined(__x86_64__)
+    int cpu_flags = av_get_cpu_flags();
+
+    if ((cpu_flags & AV_CPU_FLAG_SSSE3) && __builtin_cpu_supports("pclmul")) {
+        s.crc = upipe_psi_crc_pclmul;
+    }
+#endif
+#endif
+
+    if (check_func(s.crc, "psi_crc")) {
+        uint8_t buf[MAX_SECTION];
+        declare_func(uint32_t, uint32_t crc, const uint8_t *p, uintptr_t len);
+
+        randomize_buffer(buf);
+        /* every length around the block sizes, then random ones */
+        for (int i = 0; i < 300; i++) {
+            uintptr_t offset = rnd() % 16;
+            uintptr_t len = i < 200 ? i : rnd() % (MAX_SECTION - offset);
+            uint32_t crc = rnd();
+            if (call_ref(crc, buf + offset, len) !=
+                call_new(crc, buf + offset, len)) {
+                fail();
+                break;
+            }
+        }
+        bench_new(UINT32_MAX, buf, 1021);
+    }
+    report("psi_crc");
+}
@@ -0,0 +1,181 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for AVFrame ubuf manager
+ *
+ * This checks that software AVFrames travel by reference through ubuf_av
+ * (allocation, duplication, mapping and extraction) and that the plane copy
+ * counter only moves when a copy cannot be avoided.
+ */
+
+#undef NDEBUG
+
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_pic.h"
+#include "upipe/ubuf_sound.h"
+#include "upipe-av/ubuf_av.h"
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/channel_layout.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#define WIDTH       64
+#define HEIGHT      32
+#define SAMPLES     1024
+
+static uint64_t get_copies(struct ubuf_mgr *mgr)
+{
+    uint64_t copies;
+    ubase_assert(ubuf_av_mgr_get_copies(mgr, &copies));
+    return copies;
+}
+
+static void test_pic(struct ubuf_mgr *mgr)
+{
+    AVFrame *frame = av_frame_alloc();
+    assert(frame != NULL);
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = WIDTH;
+    frame->height = HEIGHT;
+    assert(av_frame_get_buffer(frame, 0) >= 0);
+    for (int i = 0; i < 3; i++)
+        memset(frame->data[i], i + 1,
+               frame->linesize[i] * (i ? HEIGHT / 2 : HEIGHT));
+
+    struct ubuf *ubuf = ubuf_pic_av_alloc(mgr, frame);
+    assert(ubuf != NULL);
+
+    size_t hsize, vsize;
+    ubase_assert(ubuf_pic_size(ubuf, &hsize, &vsize, NULL));
+    assert(hsize == WIDTH);
+    assert(vsize == HEIGHT);
+
+    /* mapping gives the frame planes */
+    const uint8_t *r;
+    ubase_assert(ubuf_pic_plane_read(ubuf, "y8", 0, 0, -1, -1, &r));
+    assert(r == frame->data[0]);
+    ubase_assert(ubuf_pic_plane_unmap(ubuf, "y8", 0, 0, -1, -1));
+    ubase_assert(ubuf_pic_plane_read(ubuf, "v8", 2, 2, -1, -1, &r));
+    assert(r == frame->data[2] + frame->linesize[2] + 1);
+    assert(r[0] == 3);
+    ubase_assert(ubuf_pic_plane_unmap(ubuf, "v8", 2, 2, -1, -1));
+
+    /* duplication and extraction share the same buffers */
+    struct ubuf *dup = ubuf_dup(ubuf);
+    assert(dup != NULL);
+    AVFrame *out = av_frame_alloc();
+    assert(out != NULL);
+    ubase_assert(ubuf_av_get_avframe(dup, out));
+    for (int i = 0; i < 3; i++) {
+        assert(out->data[i] == frame->data[i]);
+        assert(out->buf[i]->buffer == frame->buf[i]->buffer);
+    }
+    av_frame_free(&out);
+    ubuf_free(dup);
+
+    /* the buffer is shared with the original frame */
+    uint8_t *w;
+    assert(!ubase_check(ubuf_pic_plane_write(ubuf, "y8", 0, 0, -1, -1, &w)));
+    assert(get_copies(mgr) == 0);
+    ubuf_free(ubuf);
+
+    /* a flipped frame must be reordered once per plane */
+    for (int i = 0; i < 3; i++) {
+        int lines = i ? HEIGHT / 2 : HEIGHT;
+        frame->data[i] += frame->linesize[i] * (lines - 1);
+        frame->linesize[i] = -frame->linesize[i];
+    }
+    ubuf = ubuf_pic_av_alloc(mgr, frame);
+    assert(ubuf != NULL);
+    for (int j = 0; j < 2; j++) {
+        ubase_assert(ubuf_pic_plane_read(ubuf, "y8", 0, 0, -1, -1, &r));
+        assert(r != frame->data[0]);
+        assert(r[0] == 1);
+        ubase_assert(ubuf_pic_plane_unmap(ubuf, "y8", 0, 0, -1, -1));
+    }
+    assert(get_copies(mgr) == 1);
+    ubuf_free(ubuf);
+
+    av_frame_free(&frame);
+}
+
+static void test_sound(struct ubuf_mgr *mgr)
+{
+    AVFrame *frame = av_frame_alloc();
+    assert(frame != NULL);
+    frame->format = AV_SAMPLE_FMT_S16P;
+    frame->nb_samples = SAMPLES;
+    av_channel_layout_default(&frame->ch_layout, 2);
+    assert(av_frame_get_buffer(frame, 0) >= 0);
+
+    struct ubuf *ubuf = ubuf_sound_av_alloc(mgr, frame);
+    assert(ubuf != NULL);
+
+    size_t size;
+    ubase_assert(ubuf_sound_size(ubuf, &size, NULL));
+    assert(size == SAMPLES);
+
+    const char *channel;
+    int i = 0;
+    ubuf_sound_foreach_plane(ubuf, channel) {
+        const uint8_t *r;
+        ubase_assert(ubuf_sound_plane_read_uint8_t(ubuf, channel, 0, -1, &r));
+        assert(r == frame->data[i]);
+        ubase_assert(ubuf_sound_plane_unmap(ubuf, channel, 0, -1));
+        i++;
+    }
+    assert(i == 2);
+
+    struct ubuf *dup = ubuf_dup(ubuf);
+    assert(dup != NULL);
+    AVFrame *out = av_frame_alloc();
+    assert(out != NULL);
+    ubase_assert(ubuf_av_get_avframe(dup, out));
+    assert(out->buf[0]->buffer == frame->buf[0]->buffer);
+    av_frame_free(&out);
+    ubuf_free(dup);
+    ubuf_free(ubuf);
+
+    av_frame_free(&frame);
+}
+
+int main(int argc, char **argv)
+{
+    struct ubuf_mgr *mgr = ubuf_av_mgr_alloc();
+    assert(mgr != NULL);
+    assert(get_copies(mgr) == 0);
+
+    test_pic(mgr);
+    test_sound(mgr);
+
+    printf("plane copies: %"PRIu64"\n", get_copies(mgr));
+    assert(get_copies(mgr) == 1);
+
+    ubuf_mgr_release(mgr);
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests and benchmark for the index of segments of block ubufs
+ *
+ * This reassembles a large PES out of TS payloads, as the TS decapsulation
+ * does for intra pictures, checks random accesses and modifications against
+ * a flat copy, and prints the cost of a random access with and without the
+ * index.
+ */
+
+#undef NDEBUG
+
+#include "upipe/umem.h"
+#include "upipe/umem_alloc.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+#include "upipe/ubuf_block_mem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <assert.h>
+
+#define UBUF_POOL_DEPTH     1
+#define UBUF_PREPEND        32
+/** size of a TS payload */
+#define PAYLOAD_SIZE        184
+/** number of payloads of the PES (about 2 MB) */
+#define PAYLOADS            11400
+/** number of random accesses for the benchmark */
+#define ACCESSES            100000
+/** size of the random accesses */
+#define ACCESS_SIZE         8
+
+static struct ubuf_mgr *mgr;
+static uint8_t *ref;
+static size_t ref_size;
+
+/** returns the current time in ns */
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** allocates a segment filled with the reference content at offset */
+static struct ubuf *alloc_segment(size_t offset, int size)
+{
+    struct ubuf *ubuf = ubuf_block_alloc(mgr, size);
+    assert(ubuf != NULL);
+    uint8_t *w;
+    int wanted = -1;
+    ubase_assert(ubuf_block_write(ubuf, 0, &wanted, &w));
+    assert(wanted == size);
+    memcpy(w, ref + offset, size);
+    ubase_assert(ubuf_block_unmap(ubuf, 0));
+    return ubuf;
+}
+
+/** checks the whole content and a few random parts of a ubuf */
+static void check(struct ubuf *ubuf)
+{
+    size_t size;
+    ubase_assert(ubuf_block_size(ubuf, &size));
+    assert(size == ref_size);
+
+    uint8_t *buffer = malloc(size);
+    assert(buffer != NULL);
+    ubase_assert(ubuf_block_extract(ubuf, 0, size, buffer));
+    assert(!memcmp(buffer, ref, size));
+    free(buffer);
+
+    for (int i = 0; i < 1000; i++) {
+        int offset = rand() % (size - ACCESS_SIZE);
+        uint8_t part[ACCESS_SIZE];
+        ubase_assert(ubuf_block_extract(ubuf, offset, ACCESS_SIZE, part));
+        assert(!memcmp(part, ref + offset, ACCESS_SIZE));
+    }
+    uint8_t last;
+    ubase_assert(ubuf_block_extract(ubuf, -1, 1, &last));
+    assert(last == ref[size - 1]);
+}
+
+/** returns the segment containing an offset by walking the chain */
+static struct ubuf *walk(struct ubuf *ubuf, int *offset_p)
+{
+    struct ubuf_block *block = ubuf_block_from_ubuf(ubuf);
+    while (*offset_p >= block->size) {
+        *offset_p -= block->size;
+        ubuf = block->next_ubuf;
+        block = ubuf_block_from_ubuf(ubuf);
+    }
+    return ubuf;
+}
+
+int main(int argc, char **argv)
+{
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                   umem_mgr, UBUF_PREPEND, 0, -1, 0);
+    assert(mgr != NULL);
+
+    ref_size = PAYLOADS * PAYLOAD_SIZE;
+    ref = malloc(ref_size + 2 * PAYLOAD_SIZE);
+    assert(ref != NULL);
+    srand(42);
+    for (size_t i = 0; i < ref_size + 2 * PAYLOAD_SIZE; i++)
+        ref[i] = rand();
+
+    /* reassemble the PES */
+    uint64_t start = now();
+    struct ubuf *pes = alloc_segment(0, PAYLOAD_SIZE);
+    for (int i = 1; i < PAYLOADS; i++)
+        ubase_assert(ubuf_block_append(pes,
+                    alloc_segment(i * PAYLOAD_SIZE, PAYLOAD_SIZE)));
+    printf("reassembly: %"PRIu64" ns per payload\n",
+           (now() - start) / PAYLOADS);
+
+    /* the first random access builds the index */
+    struct ubuf_block *block = ubuf_block_from_ubuf(pes);
+    assert(block->index == NULL);
+    check(pes);
+    assert(block->index != NULL);
+    assert(block->index->count == PAYLOADS);
+
+    /* benchmark */
+    int *offsets = malloc(ACCESSES * sizeof(int));
+    assert(offsets != NULL);
+    for (int i = 0; i < ACCESSES; i++)
+        offsets[i] = rand() % ref_size;
+
+    uintptr_t sum = 0;
+    start = now();
+    for (int i = 0; i < ACCESSES; i++) {
+        int offset = offsets[i];
+        sum += (uintptr_t)ubuf_block_get(pes, &offset, NULL) + offset;
+    }
+    uint64_t indexed = (now() - start) / ACCESSES;
+    start = now();
+    for (int i = 0; i < ACCESSES; i++) {
+        int offset = offsets[i];
+        sum -= (uintptr_t)walk(pes, &offset) + offset;
+    }
+    uint64_t linear = (now() - start) / ACCESSES;
+    assert(!sum);
+    printf("random access: %"PRIu64" ns indexed, %"PRIu64" ns walking\n",
+           indexed, linear);
+    free(offsets);
+
+    /* appending keeps the index */
+    ubase_assert(ubuf_block_append(pes,
+                alloc_segment(ref_size, PAYLOAD_SIZE)));
+    ref_size += PAYLOAD_SIZE;
+    assert(block->index != NULL);
+    assert(block->index->count == PAYLOADS + 1);
+    check(pes);
+
+    /* deleting from the beginning and prepending again keeps it too */
+    ubase_assert(ubuf_block_delete(pes, 0, 10));
+    assert(block->index != NULL);
+    ubase_assert(ubuf_block_prepend(pes, 10));
+    assert(block->index != NULL);
+    check(pes);
+
+    /* and so does resizing */
+    ubase_assert(ubuf_block_resize(pes, 1000, ref_size - 2000));
+    memmove(ref, ref + 1000, ref_size - 2000);
+    ref_size -= 2000;
+    assert(block->index != NULL);
+    check(pes);
+
+    ubase_assert(ubuf_block_resize(pes, PAYLOAD_SIZE * 3 + 1, -1));
+    memmove(ref, ref + PAYLOAD_SIZE * 3 + 1, ref_size - PAYLOAD_SIZE * 3 - 1);
+    ref_size -= PAYLOAD_SIZE * 3 + 1;
+    assert(block->index != NULL);
+    check(pes);
+
+    /* prepending to the emptied head segment drops the index */
+    ubase_assert(ubuf_block_prepend(pes, 1));
+    assert(block->index == NULL);
+    memmove(ref + 1, ref, ref_size);
+    ref_size++;
+    uint8_t *w;
+    int wanted = 1;
+    ubase_assert(ubuf_block_write(pes, 0, &wanted, &w));
+    assert(wanted == 1);
+    ref[0] = w[0] = 0x47;
+    ubase_assert(ubuf_block_unmap(pes, 0));
+    check(pes);
+
+    /* deleting in the middle drops the index, which is rebuilt later */
+    ubase_assert(ubuf_block_delete(pes, 5000, 300));
+    memmove(ref + 5000, ref + 5300, ref_size - 5300);
+    ref_size -= 300;
+    check(pes);
+
+    /* insertion */
+    uint8_t segment[PAYLOAD_SIZE];
+    memcpy(segment, ref, PAYLOAD_SIZE);
+    ubase_assert(ubuf_block_insert(pes, 10000,
+                alloc_segment(0, PAYLOAD_SIZE)));
+    memmove(ref + 10000 + PAYLOAD_SIZE, ref + 10000, ref_size - 10000);
+    memcpy(ref + 10000, segment, PAYLOAD_SIZE);
+    ref_size += PAYLOAD_SIZE;
+    check(pes);
+
+    /* split */
+    size_t split_offset = ref_size / 2 + 17;
+    struct ubuf *tail = ubuf_block_split(pes, split_offset);
+    assert(tail != NULL);
+    ref_size = split_offset;
+    check(pes);
+    ubuf_free(tail);
+
+    /* truncation to zero */
+    ubase_assert(ubuf_block_truncate(pes, 0));
+    assert(block->index == NULL);
+    ubuf_free(pes);
+
+    free(ref);
+    ubuf_mgr_release(mgr);
+    umem_mgr_release(umem_mgr);
+    return 0;
+}
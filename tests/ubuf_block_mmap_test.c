@@ -0,0 +1,151 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for ubuf manager for block formats with mapped files
+ */
+
+#undef NDEBUG
+
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block.h"
+#include "upipe/ubuf_block_mmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define UBUF_POOL_DEPTH     1
+#define FILE_SIZE           (188 * 100)
+#define UBUF_SIZE           188
+#define WINDOW_OFFSET       (188 * 10 + 1)
+#define WINDOW_SIZE         (188 * 20)
+
+int main(int argc, char **argv)
+{
+    char path[] = "/tmp/ubuf_block_mmap_test.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    unlink(path);
+
+    struct ubuf_mgr *mgr = ubuf_block_mmap_mgr_alloc(UBUF_POOL_DEPTH);
+    assert(mgr != NULL);
+
+    /* empty files can't be mapped */
+    assert(ubuf_block_mmap_alloc(mgr, fd) == NULL);
+
+    uint8_t content[FILE_SIZE];
+    for (int i = 0; i < FILE_SIZE; i++)
+        content[i] = i % 256;
+    assert(write(fd, content, FILE_SIZE) == FILE_SIZE);
+
+    /* windows start anywhere in the file and stop at its end */
+    struct ubuf *window = ubuf_block_mmap_alloc_range(mgr, fd, WINDOW_OFFSET,
+                                                      WINDOW_SIZE);
+    assert(window != NULL);
+    size_t size;
+    ubase_assert(ubuf_block_size(window, &size));
+    assert(size == WINDOW_SIZE);
+    uint8_t buffer[2 * UBUF_SIZE];
+    ubase_assert(ubuf_block_extract(window, 0, UBUF_SIZE, buffer));
+    assert(!memcmp(buffer, content + WINDOW_OFFSET, UBUF_SIZE));
+    ubase_assert(ubuf_block_mmap_prefetch(window, 0, WINDOW_SIZE));
+    ubuf_free(window);
+
+    window = ubuf_block_mmap_alloc_range(mgr, fd, FILE_SIZE - UBUF_SIZE,
+                                         UINT64_MAX);
+    assert(window != NULL);
+    ubase_assert(ubuf_block_size(window, &size));
+    assert(size == UBUF_SIZE);
+    ubuf_free(window);
+    assert(ubuf_block_mmap_alloc_range(mgr, fd, FILE_SIZE, UBUF_SIZE) == NULL);
+
+    /* the size follows a growing file */
+    assert(write(fd, content, UBUF_SIZE) == UBUF_SIZE);
+    window = ubuf_block_mmap_alloc_range(mgr, fd, FILE_SIZE - UBUF_SIZE,
+                                         UINT64_MAX);
+    assert(window != NULL);
+    ubase_assert(ubuf_block_size(window, &size));
+    assert(size == 2 * UBUF_SIZE);
+    ubase_assert(ubuf_block_extract(window, 0, 2 * UBUF_SIZE, buffer));
+    assert(!memcmp(buffer, content + FILE_SIZE - UBUF_SIZE, UBUF_SIZE));
+    assert(!memcmp(buffer + UBUF_SIZE, content, UBUF_SIZE));
+    ubuf_free(window);
+    assert(ftruncate(fd, FILE_SIZE) == 0);
+
+    struct ubuf *file = ubuf_block_mmap_alloc(mgr, fd);
+    assert(file != NULL);
+    close(fd);
+
+    ubase_assert(ubuf_block_size(file, &size));
+    assert(size == FILE_SIZE);
+    ubase_assert(ubuf_block_mmap_prefetch(file, 0, FILE_SIZE));
+
+    /* spliced blocks reference the mapping */
+    struct ubuf *ubuf1 = ubuf_block_splice(file, UBUF_SIZE, UBUF_SIZE);
+    assert(ubuf1 != NULL);
+    struct ubuf *ubuf2 = ubuf_block_splice(file, 2 * UBUF_SIZE, UBUF_SIZE);
+    assert(ubuf2 != NULL);
+    ubuf_free(file);
+
+    const uint8_t *r;
+    int rsize = -1;
+    ubase_assert(ubuf_block_read(ubuf1, 0, &rsize, &r));
+    assert(rsize == UBUF_SIZE);
+    assert(!memcmp(r, content + UBUF_SIZE, UBUF_SIZE));
+    ubase_assert(ubuf_block_unmap(ubuf1, 0));
+    ubase_assert(ubuf_block_mmap_prefetch(ubuf1, 0, UBUF_SIZE));
+
+    /* shared mapping is not writable */
+    uint8_t *w;
+    int wsize = -1;
+    assert(!ubase_check(ubuf_block_write(ubuf1, 0, &wsize, &w)));
+
+    /* chaining is supported */
+    ubase_assert(ubuf_block_append(ubuf1, ubuf2));
+    ubase_assert(ubuf_block_size(ubuf1, &size));
+    assert(size == 2 * UBUF_SIZE);
+    ubase_assert(ubuf_block_extract(ubuf1, 0, -1, buffer));
+    assert(!memcmp(buffer, content + UBUF_SIZE, 2 * UBUF_SIZE));
+
+    struct ubuf *ubuf3 = ubuf_dup(ubuf1);
+    assert(ubuf3 != NULL);
+    ubuf_free(ubuf1);
+
+    /* the last reference to the mapping is writable, privately */
+    ubuf1 = ubuf_block_splice(ubuf3, 0, UBUF_SIZE);
+    assert(ubuf1 != NULL);
+    ubuf_free(ubuf3);
+    wsize = -1;
+    ubase_assert(ubuf_block_write(ubuf1, 0, &wsize, &w));
+    assert(wsize == UBUF_SIZE);
+    w[0] = 0xff;
+    ubase_assert(ubuf_block_unmap(ubuf1, 0));
+    ubuf_free(ubuf1);
+
+    /* blocks can't be allocated from a size */
+    assert(ubuf_block_alloc(mgr, UBUF_SIZE) == NULL);
+
+    ubuf_mgr_release(mgr);
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for the time-stamp counter uclock
+ *
+ * This compares the clock with the standard uclock over a few re-anchoring
+ * periods, and prints the cost of a call to both clocks.
+ */
+
+#undef NDEBUG
+
+#include "upipe/uclock.h"
+#include "upipe/uclock_std.h"
+#include "upipe/uclock_tsc.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <assert.h>
+
+#define TIME_SAMPLE 1429627742
+/** number of comparisons with the standard clock */
+#define SAMPLES 30
+/** interval between comparisons, in ns */
+#define INTERVAL 50000000
+/** maximum drift from the standard clock (20 us) */
+#define MAX_DRIFT (UCLOCK_FREQ / 50000)
+/** number of calls for the benchmark */
+#define CALLS 1000000
+
+static uint64_t ns_per_call(struct uclock *uclock)
+{
+    struct timespec start, end;
+    uint64_t last = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CALLS; i++) {
+        uint64_t now = uclock_now(uclock);
+        assert(now >= last);
+        last = now;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * UINT64_C(1000000000) +
+            end.tv_nsec - start.tv_nsec) / CALLS;
+}
+
+int main(int argc, char **argv)
+{
+    struct uclock *uclock_std = uclock_std_alloc(0);
+    struct uclock *uclock = uclock_tsc_alloc(0);
+    struct uclock *uclock_cal = uclock_tsc_alloc(UCLOCK_FLAG_REALTIME);
+    assert(uclock_std != NULL);
+    assert(uclock != NULL);
+    assert(uclock_cal != NULL);
+
+    int64_t max_drift = 0;
+    uint64_t last = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t before = uclock_now(uclock_std);
+        uint64_t now = uclock_now(uclock);
+        uint64_t after = uclock_now(uclock_std);
+        assert(now >= last);
+        last = now;
+
+        int64_t drift = 0;
+        if (now < before)
+            drift = now - before;
+        else if (now > after)
+            drift = now - after;
+        if (drift > max_drift || -drift > max_drift)
+            max_drift = drift > 0 ? drift : -drift;
+
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = INTERVAL };
+        nanosleep(&ts, NULL);
+    }
+    printf("max drift: %"PRId64" ns\n",
+           max_drift * INT64_C(1000000000) / (int64_t)UCLOCK_FREQ);
+    assert(max_drift <= MAX_DRIFT);
+
+    assert(uclock_to_real(uclock_cal, (uint64_t)TIME_SAMPLE * UCLOCK_FREQ) ==
+           TIME_SAMPLE * UCLOCK_FREQ);
+    assert(uclock_from_real(uclock_cal, (uint64_t)TIME_SAMPLE * UCLOCK_FREQ) ==
+           TIME_SAMPLE * UCLOCK_FREQ);
+
+    printf("uclock_std: %"PRIu64" ns per call\n", ns_per_call(uclock_std));
+    printf("uclock_tsc: %"PRIu64" ns per call\n", ns_per_call(uclock));
+
+    uclock_release(uclock_std);
+    uclock_release(uclock);
+    uclock_release(uclock_cal);
+    return 0;
+}
@@ -33,6 +33,7 @@
 #include "upipe/uprobe.h"
 #include "upipe/uprobe_stdio.h"
 #include "upipe/uprobe_prefix.h"
+#include "upipe/uprobe_ubuf_mem.h"
 #include "upipe/umem.h"
 #include "upipe/umem_alloc.h"
 #include "upipe/udict.h"
@@ -49,6 +50,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #define UDICT_POOL_DEPTH 0
@@ -57,6 +59,7 @@
 #define UPROBE_LOG_LEVEL UPROBE_LOG_DEBUG
 
 static unsigned int nb_packets = 0;
+static bool contiguous = false;
 
 /** definition of our uprobe */
 static int catch(struct uprobe *uprobe, struct upipe *upipe,
@@ -69,6 +72,7 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
         case UPROBE_READY:
         case UPROBE_DEAD:
         case UPROBE_NEW_FLOW_DEF:
+        case UPROBE_PROVIDE_REQUEST:
             break;
     }
     return UBASE_ERR_NONE;
@@ -93,6 +97,16 @@ static void test_input(struct upipe *upipe, struct uref *uref,
     ubase_assert(uref_block_size(uref, &size));
     assert(!nb_packets ? size == 376 : size == 188);
 
+    if (contiguous) {
+        /* single segment holding the packets in order */
+        assert(uref_block_iovec_count(uref, 0, -1) == 1);
+        for (size_t offset = 0; offset < size; offset += 188) {
+            uint8_t byte;
+            ubase_assert(uref_block_extract(uref, offset, 1, &byte));
+            assert(byte == nb_packets * 2 + offset / 188);
+        }
+    }
+
     nb_packets++;
     uref_free(uref);
 }
@@ -103,6 +117,12 @@ static int test_control(struct upipe *upipe, int command, va_list args)
     switch (command) {
         case UPIPE_SET_FLOW_DEF:
             return UBASE_ERR_NONE;
+        case UPIPE_REGISTER_REQUEST: {
+            struct urequest *urequest = va_arg(args, struct urequest *);
+            return upipe_throw_provide_request(upipe, urequest);
+        }
+        case UPIPE_UNREGISTER_REQUEST:
+            return UBASE_ERR_NONE;
         default:
             assert(0);
             return UBASE_ERR_UNHANDLED;
@@ -189,11 +209,71 @@ int main(int argc, char *argv[])
     upipe_release(upipe_agg);
 
     assert(nb_packets == 2);
+    test_free(upipe_sink);
 
-    /* release everything */
-    upipe_mgr_release(upipe_agg_mgr); // nop
+    /* contiguous buffers without ubuf manager */
+    upipe_agg = upipe_void_alloc(upipe_agg_mgr,
+            uprobe_pfx_alloc(uprobe_use(uprobe_stdio), UPROBE_LOG_LEVEL,
+                             "aggregate no ubuf_mgr"));
+    assert(upipe_agg != NULL);
+    ubase_assert(upipe_agg_set_contiguous(upipe_agg, true));
+    uref = uref_block_flow_alloc_def(uref_mgr, "foo.");
+    assert(uref != NULL);
+    ubase_assert(upipe_set_flow_def(upipe_agg, uref));
+    uref_free(uref);
+    /* segments are not merged, so the flow is not flagged */
+    ubase_assert(upipe_get_flow_def(upipe_agg, &uref));
+    ubase_nassert(uref_block_flow_get_contiguous(uref));
+    upipe_release(upipe_agg);
 
+    /* contiguous buffers */
+    struct uprobe *uprobe_ubuf_mem = uprobe_ubuf_mem_alloc(
+            uprobe_use(uprobe_stdio), umem_mgr,
+            UBUF_POOL_DEPTH, UBUF_POOL_DEPTH);
+    assert(uprobe_ubuf_mem != NULL);
+    contiguous = true;
+    nb_packets = 0;
+
+    upipe_agg = upipe_void_alloc(upipe_agg_mgr,
+            uprobe_pfx_alloc(uprobe_use(uprobe_ubuf_mem), UPROBE_LOG_LEVEL,
+                             "aggregate contiguous"));
+    assert(upipe_agg != NULL);
+    ubase_assert(upipe_agg_set_contiguous(upipe_agg, true));
+    ubase_assert(upipe_set_output_size(upipe_agg, 376));
+    uref = uref_block_flow_alloc_def(uref_mgr, "foo.");
+    assert(uref != NULL);
+    ubase_assert(upipe_set_flow_def(upipe_agg, uref));
+    uref_free(uref);
+    ubase_assert(upipe_get_flow_def(upipe_agg, &uref));
+    ubase_assert(uref_block_flow_get_contiguous(uref));
+
+    upipe_sink = upipe_void_alloc(&aggregate_test_mgr,
+            uprobe_pfx_alloc(uprobe_use(uprobe_ubuf_mem), UPROBE_LOG_LEVEL,
+                             "test contiguous"));
+    assert(upipe_sink != NULL);
+    ubase_assert(upipe_set_output(upipe_agg, upipe_sink));
+    upipe_release(upipe_sink);
+
+    for (uint8_t i = 0; i < 3; i++) {
+        uref = uref_block_alloc(uref_mgr, ubuf_mgr, 188);
+        assert(uref != NULL);
+        uint8_t *w;
+        int end = -1;
+        ubase_assert(uref_block_write(uref, 0, &end, &w));
+        memset(w, i, end);
+        ubase_assert(uref_block_unmap(uref, 0));
+        upipe_input(upipe_agg, uref, NULL);
+        assert(nb_packets == (i >= 1 ? 1 : 0));
+    }
+
+    /* flush */
+    upipe_release(upipe_agg);
+    assert(nb_packets == 2);
     test_free(upipe_sink);
+    uprobe_release(uprobe_ubuf_mem);
+
+    /* release everything */
+    upipe_mgr_release(upipe_agg_mgr); // nop
 
     uref_mgr_release(uref_mgr);
     ubuf_mgr_release(ubuf_mgr);
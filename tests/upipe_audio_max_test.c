@@ -45,6 +45,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <math.h>
 #include <assert.h>
 
 #define UDICT_POOL_DEPTH    5
@@ -53,7 +54,20 @@
 #define SAMPLES             1024
 #define UPROBE_LOG_LEVEL    UPROBE_LOG_VERBOSE
 #define ALIGN               0
+#define SINE_PERIOD         64
+#define SINE_AMPLITUDE      127
 
+/** input signals */
+enum test_signal {
+    /** s16 ramps from 0 to 2 * SAMPLES - 1 */
+    SIGNAL_S16_RAMP,
+    /** u8 silence */
+    SIGNAL_U8_SILENCE,
+    /** u8 sine of amplitude SINE_AMPLITUDE */
+    SIGNAL_U8_SINE,
+};
+
+static enum test_signal input_signal = SIGNAL_S16_RAMP;
 static bool got_urequest = false;
 static bool got_input = false;
 
@@ -90,12 +104,49 @@ static void test_input(struct upipe *upipe, struct uref *uref,
     assert(uref != NULL);
     upipe_dbg(upipe, "===> received input uref");
     uref_dump(uref, upipe->uprobe);
-    double amplitude;
+    double amplitude, rms, true_peak;
+    switch (input_signal) {
+        case SIGNAL_U8_SILENCE:
+            /* the legacy amplitude is not centered */
+            ubase_assert(uref_amax_get_amplitude(uref, &amplitude, 0));
+            assert(amplitude == 128. / UINT8_MAX);
+            ubase_assert(uref_amax_get_rms(uref, &rms, 0));
+            assert(rms == 0.);
+            ubase_assert(uref_amax_get_true_peak(uref, &true_peak, 0));
+            assert(true_peak == 0.);
+            uref_free(uref);
+            got_input = true;
+            return;
+
+        case SIGNAL_U8_SINE:
+            ubase_assert(uref_amax_get_amplitude(uref, &amplitude, 0));
+            assert(amplitude == (128. + SINE_AMPLITUDE) / UINT8_MAX);
+            ubase_assert(uref_amax_get_rms(uref, &rms, 0));
+            assert(fabs(rms - SINE_AMPLITUDE / 128. / sqrt(2.)) < 0.005);
+            ubase_assert(uref_amax_get_true_peak(uref, &true_peak, 0));
+            assert(fabs(true_peak - SINE_AMPLITUDE / 128.) < 0.05);
+            uref_free(uref);
+            got_input = true;
+            return;
+
+        default:
+            break;
+    }
+
     ubase_assert(uref_amax_get_amplitude(uref, &amplitude, 0));
     assert(amplitude == (SAMPLES - 1) * 1. / INT16_MAX);
     ubase_assert(uref_amax_get_amplitude(uref, &amplitude, 1));
     assert(amplitude == (SAMPLES * 2 - 1) * 1. / INT16_MAX);
 
+    /* ramp from 0 to SAMPLES - 1 */
+    ubase_assert(uref_amax_get_rms(uref, &rms, 0));
+    assert(fabs(rms * INT16_MAX -
+                sqrt((SAMPLES - 1) * (2 * SAMPLES - 1) / 6.)) < 0.01);
+
+    ubase_assert(uref_amax_get_amplitude(uref, &amplitude, 0));
+    ubase_assert(uref_amax_get_true_peak(uref, &true_peak, 0));
+    assert(true_peak > 0.9 * amplitude && true_peak < 1.1 * amplitude);
+
     uref_free(uref);
     got_input = true;
 }
@@ -166,6 +217,25 @@ static void fill_in(struct ubuf *ubuf)
     }
 }
 
+static void fill_in_u8(struct ubuf *ubuf, bool sine)
+{
+    size_t size;
+    ubase_assert(ubuf_sound_size(ubuf, &size, NULL));
+
+    const char *channel;
+    ubuf_sound_foreach_plane(ubuf, channel) {
+        uint8_t *buffer;
+        ubase_assert(ubuf_sound_plane_write_uint8_t(ubuf, channel, 0, -1,
+                                                    &buffer));
+
+        for (int x = 0; x < size; x++)
+            buffer[x] = !sine ? 128 :
+                128 + lrint(SINE_AMPLITUDE *
+                            sin(2. * M_PI * x / SINE_PERIOD));
+        ubase_assert(ubuf_sound_plane_unmap(ubuf, channel, 0, -1));
+    }
+}
+
 int main(int argc, char **argv)
 {
     printf("Compiled %s %s - %s\n", __DATE__, __TIME__, __FILE__);
@@ -228,11 +298,41 @@ int main(int argc, char **argv)
     ubase_assert(upipe_set_flow_def(amax, flow_def));
     uref_free(flow_def);
 
+    bool true_peak;
+    ubase_assert(upipe_amax_get_true_peak(amax, &true_peak));
+    assert(!true_peak);
+    ubase_assert(upipe_amax_set_true_peak(amax, true));
+
     struct uref *uref = uref_sound_alloc(uref_mgr, sound_mgr, SAMPLES);
     fill_in(uref->ubuf);
     upipe_input(amax, uref, NULL);
     assert(got_input);
 
+    /* u8 is centered on 128 */
+    struct ubuf_mgr *u8_mgr = ubuf_sound_mem_mgr_alloc(UBUF_POOL_DEPTH,
+                                             UBUF_POOL_DEPTH, umem_mgr, 1, ALIGN);
+    assert(u8_mgr);
+    ubase_assert(ubuf_sound_mem_mgr_add_plane(u8_mgr, "c"));
+
+    flow_def = uref_sound_flow_alloc_def(uref_mgr, "u8.", 1, 1);
+    ubase_assert(uref_sound_flow_add_plane(flow_def, "c"));
+    ubase_assert(upipe_set_flow_def(amax, flow_def));
+    uref_free(flow_def);
+
+    input_signal = SIGNAL_U8_SILENCE;
+    got_input = false;
+    uref = uref_sound_alloc(uref_mgr, u8_mgr, SAMPLES);
+    fill_in_u8(uref->ubuf, false);
+    upipe_input(amax, uref, NULL);
+    assert(got_input);
+
+    input_signal = SIGNAL_U8_SINE;
+    got_input = false;
+    uref = uref_sound_alloc(uref_mgr, u8_mgr, SAMPLES);
+    fill_in_u8(uref->ubuf, true);
+    upipe_input(amax, uref, NULL);
+    assert(got_input);
+
     /* release pipe */
     upipe_release(amax);
     test_free(test);
@@ -240,6 +340,7 @@ int main(int argc, char **argv)
     /* release managers */
     upipe_mgr_release(upipe_amax_mgr); // no-op
     ubuf_mgr_release(sound_mgr);
+    ubuf_mgr_release(u8_mgr);
     uref_mgr_release(uref_mgr);
     umem_mgr_release(umem_mgr);
     udict_mgr_release(udict_mgr);
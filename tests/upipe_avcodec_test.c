@@ -49,6 +49,8 @@
 #include "upipe/uref_flow.h"
 #include "upipe/uref_pic_flow.h"
 #include "upipe/uref_sound_flow.h"
+#include "upipe/uref_clock.h"
+#include "upipe/uclock.h"
 #include "upipe/upump.h"
 #include "upump-ev/upump_ev.h"
 #include "upipe-av/upipe_av.h"
@@ -67,6 +69,8 @@ UREF_ATTR_INT(xflow, num, "x.f.num", flow num)
 #include <assert.h>
 #include <pthread.h>
 
+#include <libavcodec/avcodec.h>
+
 #define UPUMP_POOL 0
 #define UPUMP_BLOCKER_POOL 0
 #define UDICT_POOL_DEPTH    0
@@ -93,6 +97,12 @@ struct ubuf_mgr *sound_mgr;
 struct ubuf_mgr *pic_mgr;
 struct uprobe *logger;
 struct uprobe uprobe_avcenc_s;
+/* number of frame threads of the decoders (0 to keep the defaults) */
+unsigned int dec_threads = 0;
+/* latency advertised by the last threaded decoder */
+uint64_t dec_latency = 0;
+/* last threaded decoder */
+struct upipe *dec_threaded = NULL;
 
 struct thread {
     pthread_t id;
@@ -118,6 +128,21 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe, int event, va_list
     return UBASE_ERR_NONE;
 }
 
+/** definition of our decoder uprobe */
+static int catch_avcdec(struct uprobe *uprobe, struct upipe *upipe,
+                        int event, va_list args)
+{
+    if (event == UPROBE_NEW_FLOW_DEF) {
+        va_list args_copy;
+        va_copy(args_copy, args);
+        struct uref *flow_def = va_arg(args_copy, struct uref *);
+        va_end(args_copy);
+        if (flow_def != NULL)
+            uref_clock_get_latency(flow_def, &dec_latency);
+    }
+    return uprobe_throw_next(uprobe, upipe, event, args);
+}
+
 /** definition of our uprobe */
 static int catch_avcenc(struct uprobe *uprobe, struct upipe *upipe,
                         int event, va_list args)
@@ -141,11 +166,19 @@ static int catch_avcenc(struct uprobe *uprobe, struct upipe *upipe,
     upump_mgr = upipe_get_opaque(upipe, struct upump_mgr *);
 
     /* decoder */
+    struct uprobe *uprobe_avcdec = uprobe_pfx_alloc_va(uprobe_use(logger),
+        loglevel, "avcdec %"PRId64, num);
+    if (dec_threads)
+        uprobe_avcdec = uprobe_alloc(catch_avcdec, uprobe_avcdec);
     struct upipe *avcdec = upipe_void_alloc_output(upipe, upipe_avcdec_mgr,
-        uprobe_upump_mgr_alloc(
-            uprobe_pfx_alloc_va(uprobe_use(logger), loglevel,
-                                "avcdec %"PRId64, num), upump_mgr));
+        uprobe_upump_mgr_alloc(uprobe_avcdec, upump_mgr));
     assert(avcdec);
+    if (dec_threads) {
+        ubase_assert(upipe_avcdec_set_threads(avcdec, dec_threads,
+                                              UPIPE_AVCDEC_THREAD_FRAME));
+        ubase_nassert(upipe_avcdec_set_threads(avcdec, dec_threads, 0x4));
+        dec_threaded = upipe_use(avcdec);
+    }
     upipe_release(avcdec);
 
     /* /dev/null */
@@ -367,6 +400,38 @@ int main(int argc, char **argv)
     upipe_release(avcenc);
     printf("Everything good so far, cleaning\n");
 
+    /* mono-threaded test with a frame-threaded decoder */
+    dec_threads = 4;
+    flow = uref_pic_flow_alloc_def(uref_mgr, 1);
+    assert(flow != NULL);
+    ubase_assert(uref_pic_flow_add_plane(flow, 1, 1, 1, "y8"));
+    ubase_assert(uref_pic_flow_add_plane(flow, 2, 2, 1, "u8"));
+    ubase_assert(uref_pic_flow_add_plane(flow, 2, 2, 1, "v8"));
+    ubase_assert(uref_pic_flow_set_hsize(flow, WIDTH));
+    ubase_assert(uref_pic_flow_set_vsize(flow, HEIGHT));
+    ubase_assert(uref_pic_flow_set_fps(flow, fps));
+    avcenc = build_pipeline("mpeg4.pic.", NULL, -1, flow);
+    uref_free(flow);
+
+    for (i=0; i < FRAMES_LIMIT; i++) {
+        pic = uref_pic_alloc(uref_mgr, pic_mgr, WIDTH, HEIGHT);
+        assert(pic != NULL);
+        fill_pic(pic->ubuf);
+        upipe_input(avcenc, pic, NULL);
+    }
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(59, 63, 100)
+    /* the extra frame threads add one frame of latency each */
+    assert(dec_latency >= (dec_threads - 1) * UCLOCK_FREQ * fps.den / fps.num);
+#endif
+    /* the codec is open, threading may no longer change */
+    assert(dec_threaded != NULL);
+    assert(upipe_avcdec_set_threads(dec_threaded, 1, 0) == UBASE_ERR_BUSY);
+    upipe_release(dec_threaded);
+    upipe_release(avcenc);
+    dec_threads = 0;
+    printf("Everything good so far, cleaning\n");
+
     /* mono-threaded audio test without upump_mgr */
     flow = uref_sound_flow_alloc_def(uref_mgr, "s16le.", 2, 4);
     assert(flow != NULL);
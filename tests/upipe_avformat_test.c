@@ -48,11 +48,14 @@
 #include "upipe-av/upipe_av.h"
 #include "upipe-av/upipe_avformat_source.h"
 #include "upipe-av/upipe_avformat_sink.h"
+#include "upipe-modules/upipe_file_source.h"
+#include "upipe-modules/upipe_file_sink.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <getopt.h>
 #include <assert.h>
 
 #define UDICT_POOL_DEPTH 10
@@ -68,7 +71,9 @@ static struct upipe *upipe_avfsrc;
 static struct upipe *upipe_avfsink;
 
 static void usage(const char *argv0) {
-    fprintf(stdout, "Usage: %s <source file> <sink file>\n", argv0);
+    fprintf(stdout, "Usage: %s [-i] [-o] <source file> <sink file>\n", argv0);
+    fprintf(stdout, "   -i: read the source file with a file source\n");
+    fprintf(stdout, "   -o: write the sink file with a file sink\n");
     exit(EXIT_FAILURE);
 }
 
@@ -82,6 +87,7 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
             break;
         case UPROBE_READY:
         case UPROBE_DEAD:
+        case UPROBE_SINK_END:
         case UPROBE_CLOCK_REF:
         case UPROBE_CLOCK_TS:
         case UPROBE_NEW_FLOW_DEF:
@@ -130,7 +136,21 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
 int main(int argc, char *argv[])
 {
     const char *src_url, *sink_url;
-
+    bool input = false, output = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "io")) != -1) {
+        switch (opt) {
+            case 'i':
+                input = true;
+                break;
+            case 'o':
+                output = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
     if (optind >= argc -1)
         usage(argv[0]);
     src_url = argv[optind++];
@@ -167,13 +187,39 @@ int main(int argc, char *argv[])
             uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "avfsink"));
     assert(upipe_avfsink != NULL);
     ubase_assert(upipe_set_uri(upipe_avfsink, sink_url));
+    if (output) {
+        /* the URI is only used to guess the format */
+        struct upipe_mgr *upipe_fsink_mgr = upipe_fsink_mgr_alloc();
+        assert(upipe_fsink_mgr != NULL);
+        struct upipe *upipe_fsink = upipe_void_alloc_output(upipe_avfsink,
+                upipe_fsink_mgr,
+                uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                 "fsink"));
+        assert(upipe_fsink != NULL);
+        upipe_mgr_release(upipe_fsink_mgr);
+        ubase_assert(upipe_fsink_set_path(upipe_fsink, sink_url,
+                                          UPIPE_FSINK_OVERWRITE));
+        upipe_release(upipe_fsink);
+    }
 
     struct upipe_mgr *upipe_avfsrc_mgr = upipe_avfsrc_mgr_alloc();
     assert(upipe_avfsrc_mgr != NULL);
     upipe_avfsrc = upipe_void_alloc(upipe_avfsrc_mgr,
             uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "avfsrc"));
     assert(upipe_avfsrc != NULL);
-    ubase_assert(upipe_set_uri(upipe_avfsrc, src_url));
+    if (input) {
+        struct upipe_mgr *upipe_fsrc_mgr = upipe_fsrc_mgr_alloc();
+        assert(upipe_fsrc_mgr != NULL);
+        struct upipe *upipe_fsrc = upipe_void_alloc(upipe_fsrc_mgr,
+                uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                 "fsrc"));
+        assert(upipe_fsrc != NULL);
+        upipe_mgr_release(upipe_fsrc_mgr);
+        ubase_assert(upipe_set_output(upipe_fsrc, upipe_avfsrc));
+        ubase_assert(upipe_set_output_size(upipe_fsrc, READ_SIZE));
+        ubase_assert(upipe_set_uri(upipe_fsrc, src_url));
+    } else
+        ubase_assert(upipe_set_uri(upipe_avfsrc, src_url));
 
     upump_mgr_run(upump_mgr, NULL);
 
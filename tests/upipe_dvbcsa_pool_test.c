@@ -0,0 +1,398 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests and benchmark for the dvbcsa worker pool
+ *
+ * Several services are scrambled and descrambled, first on the pipe thread
+ * and then through a shared worker pool. Each service interleaves clear
+ * packets with its scrambled packets, and the descrambled streams switch
+ * key parity in the middle of the batches. The output of each pipe must
+ * match the input packet for packet. The time taken by both passes is
+ * printed; the number of packets per service may be given on the command
+ * line. The figures only mean something when linked with the real libdvbcsa
+ * (built with its fastest bitslice width) on a machine with several cores.
+ */
+
+#undef NDEBUG
+
+#include "upipe/config.h"
+#include "upipe/ubase.h"
+#include "upipe/uprobe.h"
+#include "upipe/uprobe_stdio.h"
+#include "upipe/uprobe_prefix.h"
+#include "upipe/uprobe_upump_mgr.h"
+#include "upipe/uprobe_uclock.h"
+#include "upipe/umem.h"
+#include "upipe/umem_alloc.h"
+#include "upipe/udict.h"
+#include "upipe/udict_inline.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block_mem.h"
+#include "upipe/uref.h"
+#include "upipe/uref_std.h"
+#include "upipe/uref_flow.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_block_flow.h"
+#include "upipe/uclock.h"
+#include "upipe/uclock_std.h"
+#include "upipe/upump.h"
+#include "upipe/upipe.h"
+#include "upump-ev/upump_ev.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_encrypt.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_decrypt.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_common.h"
+#include "upipe-dvbcsa/upipe_dvbcsa_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include <bitstream/mpeg/ts.h>
+
+#ifdef UPIPE_HAVE_GCRYPT_H
+#include <gcrypt.h>
+#endif
+
+#define UDICT_POOL_DEPTH    0
+#define UREF_POOL_DEPTH     0
+#define UBUF_POOL_DEPTH     0
+#define UPUMP_POOL          0
+#define UPUMP_BLOCKER_POOL  0
+#define UPROBE_LOG_LEVEL    UPROBE_LOG_WARNING
+/** number of services */
+#define SERVICES            40
+/** default number of packets per service */
+#define PACKETS             1000
+/** one packet out of CLEAR_EVERY is not scrambled */
+#define CLEAR_EVERY         7
+/** length of the runs of packets with the same key parity */
+#define PARITY_RUN          45
+#define PID_BASE            0x100
+#define CLEAR_PID           0x1fff
+
+static struct uref_mgr *uref_mgr;
+static struct ubuf_mgr *ubuf_mgr;
+static struct upump_mgr *upump_mgr;
+static unsigned int nb_packets = PACKETS;
+/** even and odd keys of the services, used to check the scrambled output */
+static dvbcsa_key_t *keys[SERVICES][2];
+/** even and odd control words of the services */
+static char cws[SERVICES][2][13];
+/** true if the output must be descrambled before checking it */
+static bool scrambled_output;
+
+/** definition of our uprobe */
+static int catch(struct uprobe *uprobe, struct upipe *upipe,
+                 int event, va_list args)
+{
+    switch (event) {
+        case UPROBE_READY:
+        case UPROBE_DEAD:
+        case UPROBE_LOG:
+            break;
+        default:
+            return uprobe_throw_next(uprobe, upipe, event, args);
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** returns whether a packet is scrambled */
+static bool packet_scrambled(unsigned int packet)
+{
+    return packet % CLEAR_EVERY != CLEAR_EVERY - 1;
+}
+
+/** returns the key parity of a packet */
+static bool packet_odd(unsigned int packet)
+{
+    return (packet / PARITY_RUN) % 2;
+}
+
+/** writes a clear packet */
+static void write_packet(uint8_t *p, unsigned int service,
+                         unsigned int packet)
+{
+    uint16_t pid = packet_scrambled(packet) ? PID_BASE + service : CLEAR_PID;
+    p[0] = 0x47;
+    p[1] = pid >> 8;
+    p[2] = pid & 0xff;
+    p[3] = 0x10 | (packet & 0xf);
+    for (unsigned int i = TS_HEADER_SIZE; i < TS_SIZE; i++)
+        p[i] = service * 7 + packet * 3 + i;
+}
+
+/** allocates a packet, scrambled with the key of the right parity if
+ * scrambled is true */
+static struct uref *alloc_packet(unsigned int service, unsigned int packet,
+                                 bool scrambled)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr, TS_SIZE);
+    assert(uref != NULL);
+    uint8_t *w;
+    int size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &w));
+    assert(size == TS_SIZE);
+    write_packet(w, service, packet);
+    if (scrambled && packet_scrambled(packet)) {
+        bool odd = packet_odd(packet);
+        dvbcsa_encrypt(keys[service][odd], w + TS_HEADER_SIZE,
+                       TS_SIZE - TS_HEADER_SIZE);
+        ts_set_scrambling(w, odd ? TS_SCRAMBLING_ODD : TS_SCRAMBLING_EVEN);
+    }
+    ubase_assert(uref_block_unmap(uref, 0));
+    return uref;
+}
+
+/** private structure of the sink pipes */
+struct sink {
+    /** service index */
+    unsigned int service;
+    /** number of received packets */
+    unsigned int received;
+    /** public pipe structure */
+    struct upipe upipe;
+};
+
+UBASE_FROM_TO(sink, upipe, upipe, upipe);
+
+/** helper phony pipe */
+static struct upipe *sink_alloc(struct upipe_mgr *mgr, struct uprobe *uprobe,
+                                uint32_t signature, va_list args)
+{
+    struct sink *sink = malloc(sizeof(struct sink));
+    assert(sink != NULL);
+    upipe_init(&sink->upipe, mgr, uprobe);
+    sink->service = 0;
+    sink->received = 0;
+    return &sink->upipe;
+}
+
+/** helper phony pipe */
+static void sink_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    struct sink *sink = sink_from_upipe(upipe);
+    unsigned int packet = sink->received++;
+    assert(packet < nb_packets);
+
+    uint8_t buffer[TS_SIZE];
+    ubase_assert(uref_block_extract(uref, 0, TS_SIZE, buffer));
+    uref_free(uref);
+
+    if (scrambled_output && packet_scrambled(packet)) {
+        assert(ts_get_scrambling(buffer) == TS_SCRAMBLING_EVEN);
+        dvbcsa_decrypt(keys[sink->service][0], buffer + TS_HEADER_SIZE,
+                       TS_SIZE - TS_HEADER_SIZE);
+        ts_set_scrambling(buffer, 0);
+    }
+
+    uint8_t expected[TS_SIZE];
+    write_packet(expected, sink->service, packet);
+    assert(!memcmp(buffer, expected, TS_SIZE));
+}
+
+/** helper phony pipe */
+static int sink_control(struct upipe *upipe, int command, va_list args)
+{
+    switch (command) {
+        case UPIPE_REGISTER_REQUEST: {
+            struct urequest *urequest = va_arg(args, struct urequest *);
+            return upipe_throw_provide_request(upipe, urequest);
+        }
+        case UPIPE_UNREGISTER_REQUEST:
+            return UBASE_ERR_NONE;
+        case UPIPE_SET_FLOW_DEF:
+            return UBASE_ERR_NONE;
+    }
+    return UBASE_ERR_UNHANDLED;
+}
+
+/** helper phony pipe */
+static void sink_free(struct upipe *upipe)
+{
+    struct sink *sink = sink_from_upipe(upipe);
+    assert(sink->received == nb_packets);
+    upipe_clean(upipe);
+    free(sink);
+}
+
+/** helper phony pipe */
+static struct upipe_mgr sink_mgr = {
+    .refcount = NULL,
+    .signature = 0,
+    .upipe_alloc = sink_alloc,
+    .upipe_input = sink_input,
+    .upipe_control = sink_control,
+    .upipe_mgr_control = NULL
+};
+
+/** returns the current time in seconds */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+/** scrambles or descrambles all the services with the given pool, and
+ * returns the elapsed time */
+static double test(struct uprobe *logger, struct upipe_dvbcsa_pool *pool,
+                   bool encrypt)
+{
+    struct upipe_mgr *upipe_dvbcsa_mgr = encrypt ?
+        upipe_dvbcsa_enc_mgr_alloc() : upipe_dvbcsa_dec_mgr_alloc();
+    assert(upipe_dvbcsa_mgr != NULL);
+    struct uref *flow_def = uref_block_flow_alloc_def(uref_mgr, "mpegts.");
+    assert(flow_def != NULL);
+
+    struct upipe *upipes[SERVICES];
+    struct upipe *sinks[SERVICES];
+    for (unsigned int i = 0; i < SERVICES; i++) {
+        upipes[i] = upipe_flow_alloc(upipe_dvbcsa_mgr,
+                uprobe_pfx_alloc_va(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                    "dvbcsa %u", i),
+                flow_def);
+        assert(upipes[i] != NULL);
+        ubase_assert(upipe_set_flow_def(upipes[i], flow_def));
+        ubase_assert(upipe_dvbcsa_add_pid(upipes[i], PID_BASE + i));
+        ubase_assert(upipe_dvbcsa_set_key(upipes[i], cws[i][0],
+                                          encrypt ? NULL : cws[i][1]));
+        ubase_assert(upipe_dvbcsa_set_pool(upipes[i], pool));
+
+        sinks[i] = upipe_void_alloc(&sink_mgr,
+                uprobe_pfx_alloc_va(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                    "sink %u", i));
+        assert(sinks[i] != NULL);
+        sink_from_upipe(sinks[i])->service = i;
+        ubase_assert(upipe_set_output(upipes[i], sinks[i]));
+    }
+    uref_free(flow_def);
+    upipe_mgr_release(upipe_dvbcsa_mgr);
+
+    /* prepare the input so that only the pipes are timed */
+    struct uref **urefs = malloc(SERVICES * nb_packets * sizeof(struct uref *));
+    assert(urefs != NULL);
+    for (unsigned int j = 0; j < nb_packets; j++)
+        for (unsigned int i = 0; i < SERVICES; i++)
+            urefs[j * SERVICES + i] = alloc_packet(i, j, !encrypt);
+    scrambled_output = encrypt;
+
+    double start = now();
+    for (unsigned int j = 0; j < nb_packets; j++)
+        for (unsigned int i = 0; i < SERVICES; i++)
+            upipe_input(upipes[i], urefs[j * SERVICES + i], NULL);
+    upump_mgr_run(upump_mgr, NULL);
+    double elapsed = now() - start;
+
+    /* the sinks check that every packet was received */
+    for (unsigned int i = 0; i < SERVICES; i++) {
+        upipe_release(upipes[i]);
+        sink_free(sinks[i]);
+    }
+    free(urefs);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    printf("Compiled %s %s - %s\n", __DATE__, __TIME__, __FILE__);
+    if (argc > 1)
+        nb_packets = atoi(argv[1]);
+    assert(nb_packets > 0);
+
+#ifdef UPIPE_HAVE_GCRYPT_H
+    gcry_check_version(NULL);
+    gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+#endif
+
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr =
+        udict_inline_mgr_alloc(UDICT_POOL_DEPTH, umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr, 0);
+    assert(uref_mgr != NULL);
+    ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                        umem_mgr, 0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+    upump_mgr = upump_ev_mgr_alloc_default(UPUMP_POOL, UPUMP_BLOCKER_POOL);
+    assert(upump_mgr != NULL);
+
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, NULL);
+    struct uprobe *logger = uprobe_stdio_alloc(&uprobe, stdout,
+                                               UPROBE_LOG_LEVEL);
+    assert(logger != NULL);
+    logger = uprobe_upump_mgr_alloc(logger, upump_mgr);
+    assert(logger != NULL);
+    struct uclock *uclock = uclock_std_alloc(0);
+    assert(uclock != NULL);
+    logger = uprobe_uclock_alloc(logger, uclock);
+    assert(logger != NULL);
+
+    for (unsigned int i = 0; i < SERVICES; i++) {
+        for (unsigned int odd = 0; odd < 2; odd++) {
+            snprintf(cws[i][odd], sizeof(cws[i][odd]),
+                     "%02x%02x%02x%02x%02x%02x",
+                     i + 1, odd ? 0x5a : 0xa5, 0x11, 0x22, 0x33, 0x44);
+            struct ustring_dvbcsa_cw cw =
+                ustring_to_dvbcsa_cw(ustring_from_str(cws[i][odd]));
+            assert(cw.str.len == 12);
+            keys[i][odd] = dvbcsa_key_alloc();
+            assert(keys[i][odd] != NULL);
+            dvbcsa_key_set(cw.value, keys[i][odd]);
+        }
+    }
+
+    long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int nb_threads = nb_cpus > 2 ? nb_cpus : 2;
+    struct upipe_dvbcsa_pool *pool = upipe_dvbcsa_pool_alloc(nb_threads);
+    assert(pool != NULL);
+
+    unsigned int total = SERVICES * nb_packets;
+    for (int encrypt = 1; encrypt >= 0; encrypt--) {
+        double single = test(logger, NULL, encrypt);
+        double pooled = test(logger, pool, encrypt);
+        printf("%s %u packets: single thread %.0f packets/s, "
+               "pool of %u threads %.0f packets/s\n",
+               encrypt ? "scrambling" : "descrambling", total,
+               total / single, nb_threads, total / pooled);
+    }
+    upipe_dvbcsa_pool_release(pool);
+
+    for (unsigned int i = 0; i < SERVICES; i++)
+        for (unsigned int odd = 0; odd < 2; odd++)
+            dvbcsa_key_free(keys[i][odd]);
+
+    uprobe_release(logger);
+    uprobe_clean(&uprobe);
+    uclock_release(uclock);
+    upump_mgr_release(upump_mgr);
+    ubuf_mgr_release(ubuf_mgr);
+    uref_mgr_release(uref_mgr);
+    udict_mgr_release(udict_mgr);
+    umem_mgr_release(umem_mgr);
+    return 0;
+}
@@ -42,9 +42,9 @@
 #include "upipe/uref_clock.h"
 #include "upipe/ubuf_sound_mem.h"
 #include "upipe-ebur128/upipe_ebur128.h"
-#include "upipe-modules/upipe_null.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
@@ -63,6 +63,15 @@
 #define UPROBE_LOG_LEVEL    UPROBE_LOG_VERBOSE
 #define ALIGN               0
 
+/** number of buffers received by the sink */
+static unsigned int nb_urefs = 0;
+/** number of buffers carrying the loudness range and global loudness */
+static unsigned int nb_periodic = 0;
+/** number of samples since the last buffer carrying them */
+static uint64_t since_periodic = 0;
+/** expected period in samples, or 0 for every buffer */
+static uint64_t period_samples = 0;
+
 /** definition of our uprobe */
 static int catch(struct uprobe *uprobe, struct upipe *upipe,
                  int event, va_list args)
@@ -79,6 +88,88 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** helper phony pipe */
+static struct upipe *test_alloc(struct upipe_mgr *mgr, struct uprobe *uprobe,
+                                uint32_t signature, va_list args)
+{
+    struct upipe *upipe = malloc(sizeof(struct upipe));
+    assert(upipe != NULL);
+    upipe_init(upipe, mgr, uprobe);
+    upipe_throw_ready(upipe);
+    return upipe;
+}
+
+/** helper phony pipe checking the loudness attributes */
+static void test_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    double momentary, shortterm, lra = 0., global = 0.;
+    ubase_assert(uref_ebur128_get_momentary(uref, &momentary));
+    ubase_assert(uref_ebur128_get_shortterm(uref, &shortterm));
+    /* a full scale sine reaches a stable loudness once the 3 s short-term
+     * window is filled */
+    if (nb_urefs * DURATION >= 3 * UCLOCK_FREQ) {
+        assert(shortterm > -6. && shortterm < 3.);
+        assert(fabs(momentary - shortterm) < .5);
+    }
+
+    bool periodic = ubase_check(uref_ebur128_get_lra(uref, &lra));
+    assert(periodic == ubase_check(uref_ebur128_get_global(uref, &global)));
+    if (!nb_urefs || !period_samples)
+        /* the first buffer always carries them */
+        assert(periodic);
+    else if (periodic)
+        /* not before the period, and not later than the next buffer */
+        assert(since_periodic >= period_samples &&
+               since_periodic < period_samples + SAMPLES);
+    else
+        assert(since_periodic < period_samples);
+
+    if (periodic) {
+        nb_periodic++;
+        since_periodic = 0;
+        /* constant loudness, once the first 400 ms gating block is done */
+        assert(lra >= 0. && lra < 1.);
+        if (nb_urefs * DURATION >= UCLOCK_FREQ / 2)
+            assert(global > -6. && global < 3.);
+    }
+
+    size_t samples;
+    ubase_assert(uref_sound_size(uref, &samples, NULL));
+    since_periodic += samples;
+    nb_urefs++;
+    uref_free(uref);
+}
+
+/** helper phony pipe */
+static int test_control(struct upipe *upipe, int command, va_list args)
+{
+    switch (command) {
+        case UPIPE_SET_FLOW_DEF:
+            return UBASE_ERR_NONE;
+        default:
+            assert(0);
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** helper phony pipe */
+static void test_free(struct upipe *upipe)
+{
+    upipe_throw_dead(upipe);
+    upipe_clean(upipe);
+    free(upipe);
+}
+
+/** helper phony pipe */
+static struct upipe_mgr test_mgr = {
+    .refcount = NULL,
+    .signature = 0,
+    .upipe_alloc = test_alloc,
+    .upipe_input = test_input,
+    .upipe_control = test_control
+};
+
 int main(int argc, char **argv)
 {
     printf("Compiled %s %s - %s\n", __DATE__, __TIME__, __FILE__);
@@ -123,12 +214,19 @@ int main(int argc, char **argv)
     ubase_assert(uref_sound_flow_set_rate(flow, RATE));
     ubase_assert(upipe_set_flow_def(r128, flow));
 
-    struct upipe *null = upipe_void_alloc_output(r128,
-        upipe_null_mgr_alloc(),
-        uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "null"));
-    assert(null);
-    upipe_release(null);
-    upipe_null_dump_dict(null, true);
+    uint64_t period;
+    ubase_assert(upipe_ebur128_get_period(r128, &period));
+    assert(period == 0);
+    ubase_assert(upipe_ebur128_set_period(r128, UCLOCK_FREQ));
+    ubase_assert(upipe_ebur128_get_period(r128, &period));
+    assert(period == UCLOCK_FREQ);
+
+    period_samples = RATE;
+
+    struct upipe *sink = upipe_void_alloc(&test_mgr,
+        uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "sink"));
+    assert(sink);
+    ubase_assert(upipe_set_output(r128, sink));
 
     uref_free(flow);
 
@@ -137,6 +235,12 @@ int main(int argc, char **argv)
     /* now send reference urefs */
     double phase = 0;
     for (i=0; i < ITERATIONS; i++) {
+        if (i == ITERATIONS - 10) {
+            /* every buffer from now on */
+            ubase_assert(upipe_ebur128_set_period(r128, 0));
+            period_samples = 0;
+        }
+
         struct uref *uref = uref_sound_alloc(uref_mgr, sound_mgr, SAMPLES);
         assert(uref);
         const char *channel;
@@ -164,8 +268,14 @@ int main(int argc, char **argv)
         upipe_input(r128, uref, NULL);
     }
 
+    assert(nb_urefs == ITERATIONS);
+    /* buffers 0, 47, 94, 141 and 188 (47 buffers are the first to cover one
+     * second), then the last 10 buffers */
+    assert(nb_periodic == 5 + 10);
+
     /* release pipe */
     upipe_release(r128);
+    test_free(sink);
 
     /* release managers */
     upipe_mgr_release(upipe_ebur128_mgr); // no-op
@@ -44,6 +44,9 @@
 #include "upipe/udict_inline.h"
 #include "upipe/uref.h"
 #include "upipe/uref_std.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_block_flow.h"
+#include "upipe/ubuf_block_mem.h"
 #include "upipe/upump.h"
 #include "upump-ev/upump_ev.h"
 #include "upipe/upipe.h"
@@ -53,8 +56,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #define UDICT_POOL_DEPTH 0
 #define UREF_POOL_DEPTH 0
@@ -63,14 +70,33 @@
 #define UPUMP_BLOCKER_POOL 0
 #define READ_SIZE 4096
 #define UPROBE_LOG_LEVEL UPROBE_LOG_DEBUG
+#define LOW_RATE_SIZE 188
+
+/** path of the low rate write-behind test */
+static char *wb_path = NULL;
+/** file sink of the low rate write-behind test */
+static struct upipe *wb_fsink = NULL;
 
 static void usage(const char *argv0) {
-    fprintf(stdout, "Usage: %s [-d <delay>] [-a|-o] <source file> <sink file>\n", argv0);
+    fprintf(stdout, "Usage: %s [-d <delay>] [-a|-o] [-w <size> [-D]] <source file> <sink file>\n", argv0);
     fprintf(stdout, "-a : append\n");
     fprintf(stdout, "-o : overwrite\n");
+    fprintf(stdout, "-w : write-behind buffer size\n");
+    fprintf(stdout, "-D : O_DIRECT with write-behind\n");
     exit(EXIT_FAILURE);
 }
 
+/** checks that the write-behind buffer was written without a sync period */
+static void wb_timer(struct upump *upump)
+{
+    struct stat st;
+    assert(stat(wb_path, &st) == 0);
+    assert(st.st_size == LOW_RATE_SIZE);
+    upipe_release(wb_fsink);
+    upump_stop(upump);
+    upump_free(upump);
+}
+
 /** definition of our uprobe */
 static int catch(struct uprobe *uprobe, struct upipe *upipe,
                  int event, va_list args)
@@ -93,8 +119,10 @@ int main(int argc, char *argv[])
     const char *src_file, *sink_file;
     int64_t delay = 0;
     enum upipe_fsink_mode mode = UPIPE_FSINK_CREATE;
+    unsigned int wb_size = 0;
+    bool direct = false;
     int opt;
-    while ((opt = getopt(argc, argv, "d:ao")) != -1) {
+    while ((opt = getopt(argc, argv, "d:aow:D")) != -1) {
         switch (opt) {
             case 'd':
                 delay = atoi(optarg);
@@ -105,6 +133,12 @@ int main(int argc, char *argv[])
             case 'o':
                 mode = UPIPE_FSINK_OVERWRITE;
                 break;
+            case 'w':
+                wb_size = atoi(optarg);
+                break;
+            case 'D':
+                direct = true;
+                break;
             default:
                 usage(argv[0]);
         }
@@ -181,11 +215,56 @@ int main(int argc, char *argv[])
     assert(upipe_fsink != NULL);
     if (delay)
         ubase_assert(upipe_attach_uclock(upipe_fsink));
+    if (wb_size)
+        ubase_assert(upipe_fsink_set_write_behind(upipe_fsink, wb_size,
+                                                  direct));
     ubase_assert(upipe_fsink_set_path(upipe_fsink, sink_file, mode));
     upipe_release(upipe_fsink);
 
     upump_mgr_run(upump_mgr, NULL);
 
+    if (wb_size) {
+        /* a buffer much smaller than the write-behind buffer is written
+         * after the write-behind period */
+        wb_path = malloc(strlen(sink_file) + sizeof(".wb"));
+        assert(wb_path != NULL);
+        sprintf(wb_path, "%s.wb", sink_file);
+        wb_fsink = upipe_void_alloc(upipe_fsink_mgr,
+                uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                 "write-behind sink"));
+        assert(wb_fsink != NULL);
+        struct uref *flow_def = uref_block_flow_alloc_def(uref_mgr, NULL);
+        assert(flow_def != NULL);
+        ubase_assert(upipe_set_flow_def(wb_fsink, flow_def));
+        uref_free(flow_def);
+        ubase_assert(upipe_fsink_set_write_behind(wb_fsink, wb_size, direct));
+        ubase_assert(upipe_fsink_set_path(wb_fsink, wb_path,
+                                          UPIPE_FSINK_OVERWRITE));
+
+        struct ubuf_mgr *ubuf_mgr =
+            ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                     umem_mgr, 0, 0, -1, 0);
+        assert(ubuf_mgr != NULL);
+        struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                                             LOW_RATE_SIZE);
+        assert(uref != NULL);
+        upipe_input(wb_fsink, uref, NULL);
+        ubuf_mgr_release(ubuf_mgr);
+
+        struct stat st;
+        assert(stat(wb_path, &st) == 0);
+        assert(st.st_size == 0);
+
+        struct upump *upump = upump_alloc_timer(upump_mgr, wb_timer, NULL,
+                NULL, UPIPE_FSINK_WRITE_BEHIND_PERIOD * 3 / 2, 0);
+        assert(upump != NULL);
+        upump_start(upump);
+        upump_mgr_run(upump_mgr, NULL);
+
+        unlink(wb_path);
+        free(wb_path);
+    }
+
     upipe_release(upipe_fsrc);
     upipe_mgr_release(upipe_fsrc_mgr); // nop
     upipe_mgr_release(upipe_fsink_mgr); // nop
@@ -10,3 +10,9 @@ trap cleanup EXIT
 
 "$srcdir"/valgrind_wrapper.sh "$srcdir" ./upipe_file_test "$srcdir"/upipe_ts_test.ts "$TMP"/test
 cmp --quiet "$TMP"/test "$srcdir"/upipe_ts_test.ts
+
+"$srcdir"/valgrind_wrapper.sh "$srcdir" ./upipe_file_test -w 65536 "$srcdir"/upipe_ts_test.ts "$TMP"/test_wb
+cmp --quiet "$TMP"/test_wb "$srcdir"/upipe_ts_test.ts
+
+"$srcdir"/valgrind_wrapper.sh "$srcdir" ./upipe_file_test -w 65536 -D "$srcdir"/upipe_ts_test.ts "$TMP"/test_direct
+cmp --quiet "$TMP"/test_direct "$srcdir"/upipe_ts_test.ts
@@ -0,0 +1,460 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for the hls playlist pipe and its segment prefetch
+ *
+ * The segments are served by a stand-in for the http source, which sends
+ * them in small chunks from an idler so that several downloads overlap.
+ */
+
+#undef NDEBUG
+
+#include "upipe/ubase.h"
+#include "upipe/uprobe.h"
+#include "upipe/uprobe_stdio.h"
+#include "upipe/uprobe_prefix.h"
+#include "upipe/uprobe_upump_mgr.h"
+#include "upipe/uprobe_source_mgr.h"
+#include "upipe/umem.h"
+#include "upipe/umem_alloc.h"
+#include "upipe/udict.h"
+#include "upipe/udict_inline.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block_mem.h"
+#include "upipe/uref.h"
+#include "upipe/uref_std.h"
+#include "upipe/uref_flow.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_block_flow.h"
+#include "upipe/uref_uri.h"
+#include "upipe/uref_m3u.h"
+#include "upipe/uref_m3u_playlist.h"
+#include "upipe/uref_m3u_playlist_flow.h"
+#include "upipe/uclock.h"
+#include "upipe/upump.h"
+#include "upipe/upipe.h"
+#include "upipe/upipe_helper_upipe.h"
+#include "upipe/upipe_helper_urefcount.h"
+#include "upipe/upipe_helper_void.h"
+#include "upipe/upipe_helper_output.h"
+#include "upump-ev/upump_ev.h"
+#include "upipe-hls/upipe_hls_playlist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define UDICT_POOL_DEPTH    0
+#define UREF_POOL_DEPTH     0
+#define UBUF_POOL_DEPTH     0
+#define UPUMP_POOL          0
+#define UPUMP_BLOCKER_POOL  0
+#define UPROBE_LOG_LEVEL    UPROBE_LOG_DEBUG
+#define STANDIN_SIGNATURE   UBASE_FOURCC('t','s','r','c')
+/** number of items in the playlist */
+#define SEGMENTS            8
+/** size of a segment */
+#define SEGMENT_SIZE        4096
+/** size of the chunks sent by the stand-in source */
+#define CHUNK_SIZE          512
+
+static struct uref_mgr *uref_mgr;
+static struct ubuf_mgr *ubuf_mgr;
+static struct upump_mgr *upump_mgr;
+
+/** number of downloads */
+static unsigned int fetches;
+/** number of running downloads */
+static unsigned int active;
+/** maximum number of running downloads */
+static unsigned int max_active;
+
+/** jump to jump_to instead of playing the item following jump_from */
+static uint64_t jump_from = UINT64_MAX;
+static uint64_t jump_to;
+
+/** segments received by the sink */
+static unsigned int played[SEGMENTS];
+static unsigned int nb_played;
+static size_t received;
+
+/** stand-in for the http source */
+struct standin_src {
+    struct urefcount urefcount;
+    struct upipe *output;
+    struct uref *flow_def;
+    enum upipe_helper_output_state output_state;
+    struct uchain request_list;
+    struct upump *upump;
+    uint8_t segment;
+    size_t offset;
+    struct upipe upipe;
+};
+
+UPIPE_HELPER_UPIPE(standin_src, upipe, STANDIN_SIGNATURE);
+UPIPE_HELPER_UREFCOUNT(standin_src, urefcount, standin_src_free);
+UPIPE_HELPER_VOID(standin_src);
+UPIPE_HELPER_OUTPUT(standin_src, output, flow_def, output_state, request_list);
+
+static struct upipe *standin_src_alloc(struct upipe_mgr *mgr,
+                                       struct uprobe *uprobe,
+                                       uint32_t signature, va_list args)
+{
+    struct upipe *upipe = standin_src_alloc_void(mgr, uprobe, signature, args);
+    assert(upipe != NULL);
+    standin_src_init_urefcount(upipe);
+    standin_src_init_output(upipe);
+    struct standin_src *standin_src = standin_src_from_upipe(upipe);
+    standin_src->upump = NULL;
+    standin_src->offset = 0;
+    upipe_throw_ready(upipe);
+    return upipe;
+}
+
+static void standin_src_stop(struct upipe *upipe)
+{
+    struct standin_src *standin_src = standin_src_from_upipe(upipe);
+    if (standin_src->upump != NULL) {
+        upump_stop(standin_src->upump);
+        upump_free(standin_src->upump);
+        standin_src->upump = NULL;
+        active--;
+    }
+}
+
+static void standin_src_worker(struct upump *upump)
+{
+    struct upipe *upipe = upump_get_opaque(upump, struct upipe *);
+    struct standin_src *standin_src = standin_src_from_upipe(upipe);
+
+    int size = CHUNK_SIZE;
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr, size);
+    assert(uref != NULL);
+    uint8_t *w;
+    ubase_assert(uref_block_write(uref, 0, &size, &w));
+    memset(w, standin_src->segment, size);
+    ubase_assert(uref_block_unmap(uref, 0));
+    standin_src->offset += size;
+    standin_src_output(upipe, uref, &standin_src->upump);
+
+    if (standin_src->offset >= SEGMENT_SIZE) {
+        standin_src_stop(upipe);
+        upipe_throw_source_end(upipe);
+    }
+}
+
+static int standin_src_set_uri(struct upipe *upipe, const char *uri)
+{
+    struct standin_src *standin_src = standin_src_from_upipe(upipe);
+    unsigned int segment;
+    const char *name = strrchr(uri, '/');
+    assert(name != NULL);
+    assert(sscanf(name, "/seg%u.ts", &segment) == 1);
+    assert(segment < SEGMENTS);
+    standin_src->segment = segment;
+
+    struct uref *flow_def = uref_block_flow_alloc_def(uref_mgr, NULL);
+    assert(flow_def != NULL);
+    standin_src_store_flow_def(upipe, flow_def);
+
+    standin_src->upump = upump_alloc_idler(upump_mgr, standin_src_worker,
+                                           upipe, upipe->refcount);
+    assert(standin_src->upump != NULL);
+    upump_start(standin_src->upump);
+    fetches++;
+    if (++active > max_active)
+        max_active = active;
+    return UBASE_ERR_NONE;
+}
+
+static int standin_src_control(struct upipe *upipe, int command, va_list args)
+{
+    UBASE_HANDLED_RETURN(standin_src_control_output(upipe, command, args));
+    switch (command) {
+        case UPIPE_SET_URI: {
+            const char *uri = va_arg(args, const char *);
+            return standin_src_set_uri(upipe, uri);
+        }
+        case UPIPE_SRC_SET_RANGE: {
+            uint64_t offset = va_arg(args, uint64_t);
+            uint64_t length = va_arg(args, uint64_t);
+            assert(offset == 0);
+            assert(length == UINT64_MAX);
+            return UBASE_ERR_NONE;
+        }
+        default:
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+static void standin_src_free(struct upipe *upipe)
+{
+    standin_src_stop(upipe);
+    upipe_throw_dead(upipe);
+    standin_src_clean_output(upipe);
+    standin_src_clean_urefcount(upipe);
+    standin_src_free_void(upipe);
+}
+
+static struct upipe_mgr standin_src_mgr = {
+    .refcount = NULL,
+    .signature = STANDIN_SIGNATURE,
+
+    .upipe_alloc = standin_src_alloc,
+    .upipe_input = NULL,
+    .upipe_control = standin_src_control
+};
+
+/** helper phony pipe */
+static struct upipe *test_alloc(struct upipe_mgr *mgr, struct uprobe *uprobe,
+                                uint32_t signature, va_list args)
+{
+    struct upipe *upipe = malloc(sizeof(struct upipe));
+    assert(upipe != NULL);
+    upipe_init(upipe, mgr, uprobe);
+    return upipe;
+}
+
+/** helper phony pipe */
+static void test_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    size_t size;
+    ubase_assert(uref_block_size(uref, &size));
+    uint8_t buffer[size];
+    ubase_assert(uref_block_extract(uref, 0, size, buffer));
+    for (size_t i = 1; i < size; i++)
+        assert(buffer[i] == buffer[0]);
+    uref_free(uref);
+
+    if (!nb_played || buffer[0] != played[nb_played - 1]) {
+        /* the previous segment must be complete */
+        assert(!nb_played || received == SEGMENT_SIZE);
+        assert(nb_played < SEGMENTS);
+        played[nb_played++] = buffer[0];
+        received = 0;
+    }
+    received += size;
+    assert(received <= SEGMENT_SIZE);
+}
+
+/** helper phony pipe */
+static int test_control(struct upipe *upipe, int command, va_list args)
+{
+    switch (command) {
+        case UPIPE_SET_FLOW_DEF: {
+            struct uref *flow_def = va_arg(args, struct uref *);
+            return uref_flow_match_def(flow_def, "block.");
+        }
+        case UPIPE_REGISTER_REQUEST: {
+            struct urequest *urequest = va_arg(args, struct urequest *);
+            return upipe_throw_provide_request(upipe, urequest);
+        }
+        case UPIPE_UNREGISTER_REQUEST:
+            return UBASE_ERR_NONE;
+        default:
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** helper phony pipe */
+static void test_free(struct upipe *upipe)
+{
+    upipe_clean(upipe);
+    free(upipe);
+}
+
+/** helper phony pipe */
+static struct upipe_mgr test_mgr = {
+    .refcount = NULL,
+    .signature = 0,
+
+    .upipe_alloc = test_alloc,
+    .upipe_input = test_input,
+    .upipe_control = test_control
+};
+
+/** definition of our uprobe */
+static int catch(struct uprobe *uprobe, struct upipe *upipe,
+                 int event, va_list args)
+{
+    if (event < UPROBE_LOCAL ||
+        ubase_get_signature(args) != UPIPE_HLS_PLAYLIST_SIGNATURE)
+        return uprobe_throw_next(uprobe, upipe, event, args);
+
+    switch (event) {
+        case UPROBE_HLS_PLAYLIST_RELOADED:
+            ubase_assert(upipe_hls_playlist_play(upipe));
+            break;
+
+        case UPROBE_HLS_PLAYLIST_ITEM_END: {
+            uint64_t index;
+            ubase_assert(upipe_hls_playlist_get_index(upipe, &index));
+            if (index == jump_from)
+                ubase_assert(upipe_hls_playlist_set_index(upipe, jump_to));
+            else
+                ubase_assert(upipe_hls_playlist_next(upipe));
+            ubase_assert(upipe_hls_playlist_get_index(upipe, &index));
+            if (index < SEGMENTS)
+                ubase_assert(upipe_hls_playlist_play(upipe));
+            break;
+        }
+
+        case UPROBE_HLS_PLAYLIST_NEED_RELOAD:
+            break;
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** plays the playlist with the given prefetch limits */
+static void test(struct uprobe *logger, unsigned int prefetch,
+                 uint64_t prefetch_size)
+{
+    fetches = active = max_active = 0;
+    nb_played = 0;
+    received = 0;
+
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, uprobe_use(logger));
+
+    struct upipe_mgr *upipe_hls_playlist_mgr = upipe_hls_playlist_mgr_alloc();
+    assert(upipe_hls_playlist_mgr != NULL);
+    struct upipe *upipe_hls_playlist = upipe_void_alloc(
+        upipe_hls_playlist_mgr,
+        uprobe_pfx_alloc(uprobe_use(&uprobe), UPROBE_LOG_LEVEL, "playlist"));
+    upipe_mgr_release(upipe_hls_playlist_mgr);
+    assert(upipe_hls_playlist != NULL);
+    ubase_assert(upipe_hls_playlist_set_prefetch(upipe_hls_playlist,
+                                                 prefetch, prefetch_size));
+    unsigned int count;
+    uint64_t size;
+    ubase_assert(upipe_hls_playlist_get_prefetch(upipe_hls_playlist,
+                                                 &count, &size));
+    assert(count == prefetch);
+    assert(size == prefetch_size);
+
+    struct upipe *sink = upipe_void_alloc(&test_mgr, uprobe_use(logger));
+    assert(sink != NULL);
+    ubase_assert(upipe_set_output(upipe_hls_playlist, sink));
+
+    struct uref *flow_def = uref_alloc_control(uref_mgr);
+    assert(flow_def != NULL);
+    ubase_assert(uref_flow_set_def(flow_def, "block.m3u.playlist."));
+    ubase_assert(uref_uri_set_from_str(flow_def,
+                                       "http://standin/live/index.m3u8"));
+    ubase_assert(uref_m3u_playlist_flow_set_type(flow_def, "VOD"));
+    ubase_assert(uref_m3u_playlist_flow_set_endlist(flow_def));
+    ubase_assert(uref_m3u_playlist_flow_set_target_duration(flow_def,
+                                                            UCLOCK_FREQ));
+    ubase_assert(uref_m3u_playlist_flow_set_media_sequence(flow_def, 0));
+    ubase_assert(upipe_set_flow_def(upipe_hls_playlist, flow_def));
+    uref_free(flow_def);
+
+    for (unsigned int i = 0; i < SEGMENTS; i++) {
+        struct uref *item = uref_alloc_control(uref_mgr);
+        assert(item != NULL);
+        char uri[16];
+        snprintf(uri, sizeof (uri), "seg%u.ts", i);
+        ubase_assert(uref_m3u_set_uri(item, uri));
+        ubase_assert(uref_m3u_playlist_set_seq_duration(item, UCLOCK_FREQ));
+        if (i == SEGMENTS - 1)
+            uref_block_set_end(item);
+        upipe_input(upipe_hls_playlist, item, NULL);
+    }
+
+    upump_mgr_run(upump_mgr, NULL);
+
+    upipe_release(upipe_hls_playlist);
+    test_free(sink);
+    uprobe_clean(&uprobe);
+    assert(!active);
+}
+
+int main(int argc, char **argv)
+{
+    printf("Compiled %s %s - %s\n", __DATE__, __TIME__, __FILE__);
+
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr =
+        udict_inline_mgr_alloc(UDICT_POOL_DEPTH, umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr, 0);
+    assert(uref_mgr != NULL);
+    ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                        umem_mgr, 0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+    upump_mgr = upump_ev_mgr_alloc_default(UPUMP_POOL, UPUMP_BLOCKER_POOL);
+    assert(upump_mgr != NULL);
+
+    struct uprobe *logger = uprobe_stdio_alloc(NULL, stdout, UPROBE_LOG_LEVEL);
+    assert(logger != NULL);
+    logger = uprobe_upump_mgr_alloc(logger, upump_mgr);
+    assert(logger != NULL);
+    logger = uprobe_source_mgr_alloc(logger, &standin_src_mgr);
+    assert(logger != NULL);
+
+    /* one segment after another */
+    test(logger, 0, UINT64_MAX);
+    assert(nb_played == SEGMENTS);
+    for (unsigned int i = 0; i < SEGMENTS; i++)
+        assert(played[i] == i);
+    assert(fetches == SEGMENTS);
+    assert(max_active == 1);
+
+    /* prefetch 3 segments, each segment is still downloaded once */
+    test(logger, 3, UINT64_MAX);
+    assert(nb_played == SEGMENTS);
+    for (unsigned int i = 0; i < SEGMENTS; i++)
+        assert(played[i] == i);
+    assert(fetches == SEGMENTS);
+    assert(max_active == 4);
+
+    /* jump over prefetched segments */
+    jump_from = 1;
+    jump_to = 6;
+    test(logger, 3, UINT64_MAX);
+    assert(nb_played == 4);
+    assert(played[0] == 0);
+    assert(played[1] == 1);
+    assert(played[2] == 6);
+    assert(played[3] == 7);
+    jump_from = UINT64_MAX;
+
+    /* the size of the segments is unknown until the first one is complete,
+     * then the byte limit allows 2 segments ahead of the played one */
+    test(logger, 6, 2 * SEGMENT_SIZE);
+    assert(nb_played == SEGMENTS);
+    for (unsigned int i = 0; i < SEGMENTS; i++)
+        assert(played[i] == i);
+    assert(fetches == SEGMENTS);
+    assert(max_active == 3);
+
+    uprobe_release(logger);
+    upump_mgr_release(upump_mgr);
+    ubuf_mgr_release(ubuf_mgr);
+    uref_mgr_release(uref_mgr);
+    udict_mgr_release(udict_mgr);
+    umem_mgr_release(umem_mgr);
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for the HLS sink pipe
+ *
+ * The input is a synthetic transport stream of 25 frames per second, each
+ * frame being a PAT and a PMT packet, 6 video packets and an audio packet.
+ * Video random access points happen every second, audio packets all carry
+ * the random access indicator, and a discontinuity happens in the middle.
+ * The stream starts with a frame without any random access point.
+ */
+
+#undef NDEBUG
+
+#include "upipe/ubase.h"
+#include "upipe/uprobe.h"
+#include "upipe/uprobe_stdio.h"
+#include "upipe/uprobe_prefix.h"
+#include "upipe/uprobe_upump_mgr.h"
+#include "upipe/umem.h"
+#include "upipe/umem_alloc.h"
+#include "upipe/udict.h"
+#include "upipe/udict_inline.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block_mem.h"
+#include "upipe/uref.h"
+#include "upipe/uref_std.h"
+#include "upipe/uref_flow.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_block_flow.h"
+#include "upipe/uref_clock.h"
+#include "upipe/uref_m3u.h"
+#include "upipe/uref_m3u_playlist.h"
+#include "upipe/uclock.h"
+#include "upipe/upump.h"
+#include "upipe/upipe.h"
+#include "upump-ev/upump_ev.h"
+#include "upipe-hls/upipe_hls_sink.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include <bitstream/mpeg/ts.h>
+
+#define UDICT_POOL_DEPTH    0
+#define UREF_POOL_DEPTH     0
+#define UBUF_POOL_DEPTH     0
+#define UPUMP_POOL          0
+#define UPUMP_BLOCKER_POOL  0
+#define UPROBE_LOG_LEVEL    UPROBE_LOG_DEBUG
+/** number of frames per second */
+#define FPS                 25
+/** number of frames */
+#define FRAMES              263
+/** frame carrying the discontinuity */
+#define DISCONTINUITY       120
+/** number of packets per frame */
+#define PACKETS             9
+#define FRAME_SIZE          (PACKETS * TS_SIZE)
+/** size of the PAT and PMT packets repeated in each segment */
+#define PSI_SIZE            (2 * TS_SIZE)
+#define PMT_PID             0x42
+#define VIDEO_PID           0x100
+#define AUDIO_PID           0x101
+
+static struct uref_mgr *uref_mgr;
+static struct ubuf_mgr *ubuf_mgr;
+static struct upump_mgr *upump_mgr;
+static uint64_t segments[16];
+static unsigned int nb_segments = 0;
+
+/** checks that a segment starts with the PAT, the PMT and a random access
+ * point, and returns its size */
+static size_t check_start(struct uref *uref)
+{
+    size_t size;
+    ubase_assert(uref_block_size(uref, &size));
+    assert(size > PSI_SIZE);
+    uint8_t buffer[TS_SIZE];
+    ubase_assert(uref_block_extract(uref, 0, TS_SIZE, buffer));
+    assert(ts_get_pid(buffer) == 0);
+    ubase_assert(uref_block_extract(uref, TS_SIZE, TS_SIZE, buffer));
+    assert(ts_get_pid(buffer) == PMT_PID);
+    ubase_assert(uref_block_extract(uref, PSI_SIZE, TS_SIZE, buffer));
+    assert(ts_get_pid(buffer) == VIDEO_PID);
+    assert(tsaf_has_randomaccess(buffer));
+    return size;
+}
+
+/** definition of our uprobe */
+static int catch(struct uprobe *uprobe, struct upipe *upipe,
+                 int event, va_list args)
+{
+    switch (event) {
+        case UPROBE_READY:
+        case UPROBE_DEAD:
+        case UPROBE_LOG:
+            break;
+        case UPROBE_HLS_SINK_SEGMENT: {
+            UBASE_SIGNATURE_CHECK(args, UPIPE_HLS_SINK_SIGNATURE)
+            uint64_t sequence = va_arg(args, uint64_t);
+            assert(nb_segments < UBASE_ARRAY_SIZE(segments));
+            segments[nb_segments++] = sequence;
+
+            struct uref *uref;
+            ubase_assert(upipe_hls_sink_get_segment(upipe, sequence, &uref));
+            size_t size = check_start(uref);
+            /* the first frame, without random access point, is dropped */
+            if (!sequence)
+                assert(size == 50 * FRAME_SIZE + PSI_SIZE);
+            uref_free(uref);
+            break;
+        }
+        default:
+            return uprobe_throw_next(uprobe, upipe, event, args);
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** writes a packet */
+static void write_packet(uint8_t *p, uint16_t pid, bool unitstart, bool random,
+                         unsigned int frame)
+{
+    memset(p, 0xff, TS_SIZE);
+    p[0] = 0x47;
+    p[1] = (unitstart ? 0x40 : 0) | (pid >> 8);
+    p[2] = pid & 0xff;
+    p[3] = 0x10;
+    if (random) {
+        p[3] |= 0x20;
+        p[4] = 1;
+        p[5] = 0x40;
+    }
+    p[TS_SIZE - 2] = frame >> 8;
+    p[TS_SIZE - 1] = frame & 0xff;
+}
+
+/** writes a PAT packet announcing a single program */
+static void write_pat(uint8_t *p)
+{
+    static const uint8_t section[] = {
+        0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff,
+        0x00, 0x00, 0x00, 0x00
+    };
+    write_packet(p, 0, true, false, 0);
+    p[4] = 0;
+    memcpy(p + 5, section, sizeof(section));
+}
+
+/** writes a PMT packet with the video and audio PIDs */
+static void write_pmt(uint8_t *p)
+{
+    static const uint8_t section[] = {
+        0x02, 0xb0, 0x17, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00,
+        0x1b, 0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00,
+        0x0f, 0xe0 | (AUDIO_PID >> 8), AUDIO_PID & 0xff, 0xf0, 0x00,
+        0x00, 0x00, 0x00, 0x00
+    };
+    write_packet(p, PMT_PID, true, false, 0);
+    p[4] = 0;
+    memcpy(p + 5, section, sizeof(section));
+}
+
+/** allocates a frame, with random access points unless told otherwise */
+static struct uref *alloc_frame(unsigned int frame, bool random)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr, FRAME_SIZE);
+    assert(uref != NULL);
+    uint8_t *w;
+    int size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &w));
+    assert(size == FRAME_SIZE);
+    write_pat(w);
+    write_pmt(w + TS_SIZE);
+    for (unsigned int i = 2; i < PACKETS - 1; i++)
+        write_packet(w + i * TS_SIZE, VIDEO_PID, i == 3,
+                     random && i == 3 && !(frame % FPS), frame);
+    write_packet(w + (PACKETS - 1) * TS_SIZE, AUDIO_PID, true, random, frame);
+    ubase_assert(uref_block_unmap(uref, 0));
+
+    uint64_t cr = frame * UCLOCK_FREQ / FPS;
+    if (frame >= DISCONTINUITY)
+        cr += 1000 * UCLOCK_FREQ;
+    uref_clock_set_cr_sys(uref, cr);
+    if (frame == DISCONTINUITY)
+        uref_flow_set_discontinuity(uref);
+    return uref;
+}
+
+/** checks a segment of the ring */
+static void check_segment(struct upipe *upipe, const char *prefix,
+                          uint64_t sequence,
+                          unsigned int first, unsigned int frames,
+                          bool discontinuity)
+{
+    struct uref *uref;
+    ubase_assert(upipe_hls_sink_get_segment(upipe, sequence, &uref));
+
+    size_t size = check_start(uref);
+    assert(size == frames * FRAME_SIZE + PSI_SIZE);
+    uint8_t buffer[TS_SIZE];
+    ubase_assert(uref_block_extract(uref, PSI_SIZE, TS_SIZE, buffer));
+    assert(buffer[TS_SIZE - 2] == first >> 8);
+    assert(buffer[TS_SIZE - 1] == (first & 0xff));
+    ubase_assert(uref_block_extract(uref, size - TS_SIZE, TS_SIZE, buffer));
+    assert(buffer[TS_SIZE - 2] == (first + frames) >> 8);
+    assert(buffer[TS_SIZE - 1] == ((first + frames) & 0xff));
+
+    const char *uri;
+    char expected[32];
+    sprintf(expected, "%s-%"PRIu64".ts", prefix, sequence);
+    ubase_assert(uref_m3u_get_uri(uref, &uri));
+    assert(!strcmp(uri, expected));
+    bool flag = false;
+    uref_m3u_playlist_get_discontinuity(uref, &flag);
+    assert(flag == discontinuity);
+    uref_free(uref);
+}
+
+/** returns the content of a file, or NULL */
+static char *read_file(const char *dir, const char *name, size_t *size_p)
+{
+    char path[strlen(dir) + strlen(name) + 2];
+    sprintf(path, "%s/%s", dir, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    struct stat st;
+    assert(fstat(fileno(file), &st) == 0);
+    char *buffer = malloc(st.st_size + 1);
+    assert(buffer != NULL);
+    assert(fread(buffer, 1, st.st_size, file) == (size_t)st.st_size);
+    buffer[st.st_size] = '\0';
+    fclose(file);
+    if (size_p != NULL)
+        *size_p = st.st_size;
+    return buffer;
+}
+
+/** playlist after the 5 first segments, with the segment prefix */
+#define PLAYLIST_FMT                                                        \
+    "#EXTM3U\n"                                                              \
+    "#EXT-X-VERSION:3\n"                                                     \
+    "#EXT-X-TARGETDURATION:2\n"                                              \
+    "#EXT-X-MEDIA-SEQUENCE:2\n"                                              \
+    "#EXTINF:0.760,\n"                                                       \
+    "%1$s-2.ts\n"                                                            \
+    "#EXT-X-DISCONTINUITY\n"                                                 \
+    "#EXTINF:2.000,\n"                                                       \
+    "%1$s-3.ts\n"                                                            \
+    "#EXTINF:2.000,\n"                                                       \
+    "%1$s-4.ts\n"
+
+/** playlist at the end of the stream */
+static const char *final_playlist =
+    "#EXTM3U\n"
+    "#EXT-X-VERSION:3\n"
+    "#EXT-X-TARGETDURATION:2\n"
+    "#EXT-X-MEDIA-SEQUENCE:3\n"
+    "#EXT-X-DISCONTINUITY\n"
+    "#EXTINF:2.000,\n"
+    "live-3.ts\n"
+    "#EXTINF:2.000,\n"
+    "live-4.ts\n"
+    "#EXTINF:1.480,\n"
+    "live-5.ts\n"
+    "#EXT-X-ENDLIST\n";
+
+/** packages the stream in memory, and on disk if dir is not NULL */
+static void test(struct uprobe *logger, const char *dir)
+{
+    nb_segments = 0;
+
+    struct upipe_mgr *upipe_hls_sink_mgr = upipe_hls_sink_mgr_alloc();
+    assert(upipe_hls_sink_mgr != NULL);
+    struct upipe *upipe = upipe_void_alloc(upipe_hls_sink_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "hls sink"));
+    assert(upipe != NULL);
+    upipe_mgr_release(upipe_hls_sink_mgr);
+
+    /* segments are named after the playlist */
+    const char *prefix = dir != NULL ? "live" : "segment";
+    char uri[256];
+    if (dir != NULL) {
+        snprintf(uri, sizeof(uri), "%s/live.m3u8", dir);
+        ubase_assert(upipe_set_uri(upipe, uri));
+    }
+    ubase_assert(upipe_hls_sink_set_target_duration(upipe, 2 * UCLOCK_FREQ));
+    ubase_assert(upipe_hls_sink_set_window(upipe, 3, 4));
+    unsigned int window, depth;
+    ubase_assert(upipe_hls_sink_get_window(upipe, &window, &depth));
+    assert(window == 3 && depth == 4);
+
+    struct uref *flow_def = uref_block_flow_alloc_def(uref_mgr, "mpegts.");
+    assert(flow_def != NULL);
+    ubase_assert(upipe_set_flow_def(upipe, flow_def));
+    uref_free(flow_def);
+
+    const char *text;
+    ubase_assert(upipe_hls_sink_get_playlist(upipe, &text));
+    assert(text == NULL);
+
+    upipe_input(upipe, alloc_frame(0, false), NULL);
+    for (unsigned int i = 0; i < FRAMES; i++)
+        upipe_input(upipe, alloc_frame(i, true), NULL);
+
+    /* cuts at frames 50, 100, the discontinuity at 125, 175 and 225 */
+    assert(nb_segments == 5);
+    for (unsigned int i = 0; i < nb_segments; i++)
+        assert(segments[i] == i);
+    struct uref *uref;
+    ubase_nassert(upipe_hls_sink_get_segment(upipe, 0, &uref));
+    ubase_nassert(upipe_hls_sink_get_segment(upipe, 5, &uref));
+    check_segment(upipe, prefix, 1, 50, 50, false);
+    check_segment(upipe, prefix, 2, 100, 25, false);
+    check_segment(upipe, prefix, 3, 125, 50, true);
+    check_segment(upipe, prefix, 4, 175, 50, false);
+
+    char playlist[512];
+    snprintf(playlist, sizeof(playlist), PLAYLIST_FMT, prefix);
+    ubase_assert(upipe_hls_sink_get_playlist(upipe, &text));
+    assert(text != NULL);
+    printf("%s", text);
+    assert(!strcmp(text, playlist));
+
+    if (dir != NULL) {
+        /* nothing is written until the event loop runs */
+        assert(read_file(dir, "live.m3u8", NULL) == NULL);
+        upump_mgr_run(upump_mgr, NULL);
+
+        char *content = read_file(dir, "live.m3u8", NULL);
+        assert(content != NULL);
+        assert(!strcmp(content, playlist));
+        free(content);
+        assert(read_file(dir, "live-0.ts", NULL) == NULL);
+        size_t size;
+        content = read_file(dir, "live-2.ts", &size);
+        assert(content != NULL);
+        assert(size == 25 * FRAME_SIZE + PSI_SIZE);
+        free(content);
+    }
+
+    /* the last segment is completed and the playlist ended */
+    upipe_release(upipe);
+    assert(nb_segments == 6);
+    assert(segments[5] == 5);
+
+    if (dir != NULL) {
+        char *content = read_file(dir, "live.m3u8", NULL);
+        assert(content != NULL);
+        printf("%s", content);
+        assert(!strcmp(content, final_playlist));
+        free(content);
+        assert(read_file(dir, "live-1.ts", NULL) == NULL);
+        for (unsigned int i = 2; i <= 5; i++) {
+            char name[32];
+            sprintf(name, "live-%u.ts", i);
+            size_t size;
+            content = read_file(dir, name, &size);
+            assert(content != NULL);
+            assert(size % TS_SIZE == 0);
+            free(content);
+
+            char path[strlen(dir) + sizeof(name) + 1];
+            sprintf(path, "%s/%s", dir, name);
+            assert(unlink(path) == 0);
+        }
+        assert(unlink(uri) == 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    printf("Compiled %s %s - %s\n", __DATE__, __TIME__, __FILE__);
+
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr =
+        udict_inline_mgr_alloc(UDICT_POOL_DEPTH, umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr, 0);
+    assert(uref_mgr != NULL);
+    ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                        umem_mgr, 0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+    upump_mgr = upump_ev_mgr_alloc_default(UPUMP_POOL, UPUMP_BLOCKER_POOL);
+    assert(upump_mgr != NULL);
+
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, NULL);
+    struct uprobe *logger = uprobe_stdio_alloc(&uprobe, stdout,
+                                               UPROBE_LOG_LEVEL);
+    assert(logger != NULL);
+    logger = uprobe_upump_mgr_alloc(logger, upump_mgr);
+    assert(logger != NULL);
+
+    /* in-process origin only */
+    test(logger, NULL);
+
+    /* and on disk */
+    char dir[] = "/tmp/upipe_hls_sink_test.XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    test(logger, dir);
+    assert(rmdir(dir) == 0);
+
+    uprobe_release(logger);
+    uprobe_clean(&uprobe);
+    upump_mgr_release(upump_mgr);
+    ubuf_mgr_release(ubuf_mgr);
+    uref_mgr_release(uref_mgr);
+    udict_mgr_release(udict_mgr);
+    umem_mgr_release(umem_mgr);
+    return 0;
+}
@@ -59,6 +59,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <sys/param.h>
 #include <fcntl.h>
@@ -82,6 +83,13 @@ static struct upump *idler;
 static uint64_t rotate = 0;
 static uint64_t rotate_offset = 0;
 static uint64_t gen_systime = 0;
+/** next timestamp expected from the multicat source */
+static uint64_t next_systime = 0;
+/** number of packets received from the multicat source */
+static unsigned int nb_received = 0;
+/** file truncated when the packet of timestamp truncate_systime is received */
+static const char *truncate_path = NULL;
+static uint64_t truncate_systime = 0;
 
 static void sig_handler(int sig)
 {
@@ -152,20 +160,29 @@ static void test_input(struct upipe *upipe, struct uref *uref,
     upipe_dbg(upipe, "===> received input uref");
     uref_dump(uref, upipe->uprobe);
 
-    static uint64_t systime = 0;
+    /* missing segments are skipped */
     uint64_t cr_sys;
     ubase_assert(uref_clock_get_cr_sys(uref, &cr_sys));
-    assert(cr_sys == systime);
+    assert(cr_sys >= next_systime);
+    assert(!((cr_sys - rotate_offset) % (rotate/UREF_PER_SLICE)));
+
+    /* the sink truncates the files of its ring in overwrite mode, while
+     * blocks of them may still be held */
+    if (truncate_path != NULL && cr_sys == truncate_systime) {
+        upipe_dbg_va(upipe, "truncating %s", truncate_path);
+        assert(truncate(truncate_path, 0) == 0);
+        truncate_path = NULL;
+    }
 
     int size = -1;
     const uint8_t *buf;
     ubase_assert(uref_block_read(uref, 0, &size, &buf));
     assert(size == sizeof(uint64_t));
-    cr_sys = upipe_genaux_ntoh64(buf);
-    assert(cr_sys == systime);
+    assert(upipe_genaux_ntoh64(buf) == cr_sys);
     ubase_assert(uref_block_unmap(uref, 0));
     uref_free(uref);
-    systime += rotate/UREF_PER_SLICE;
+    next_systime = cr_sys + rotate/UREF_PER_SLICE;
+    nb_received++;
 }
 
 /** helper phony pipe */
@@ -203,6 +220,31 @@ static struct upipe_mgr test_mgr = {
     .upipe_control = test_control
 };
 
+/** allocates a multicat source reading the files of the sink */
+static struct upipe *msrc_alloc(struct uprobe *logger, const char *dirpath,
+                                const char *suffix, bool mmap)
+{
+    struct upipe_mgr *upipe_msrc_mgr = upipe_msrc_mgr_alloc();
+    struct upipe *msrc = upipe_void_alloc(upipe_msrc_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "multicat source"));
+    assert(msrc != NULL);
+    upipe_mgr_release(upipe_msrc_mgr);
+    struct uref *flow = uref_alloc_control(uref_mgr);
+    assert(flow != NULL);
+    ubase_assert(uref_msrc_flow_set_path(flow, dirpath));
+    ubase_assert(uref_msrc_flow_set_data(flow, suffix));
+    ubase_assert(uref_msrc_flow_set_aux(flow, suffix));
+    ubase_assert(uref_msrc_flow_set_rotate(flow, rotate));
+    ubase_assert(uref_msrc_flow_set_offset(flow, rotate_offset));
+    if (mmap)
+        ubase_assert(uref_msrc_flow_set_mmap(flow));
+    ubase_assert(upipe_set_flow_def(msrc, flow));
+    uref_free(flow);
+    ubase_assert(upipe_set_output_size(msrc, sizeof(uint64_t)));
+    return msrc;
+}
+
 int main(int argc, char *argv[])
 {
     const char *dirpath, *suffix;
@@ -321,31 +363,46 @@ int main(int argc, char *argv[])
         close(fd);
     }
 
-    // check resulting files with msrc
-    struct upipe_mgr *upipe_msrc_mgr = upipe_msrc_mgr_alloc();
-    struct upipe *msrc = upipe_void_alloc(upipe_msrc_mgr,
-            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
-                             "multicat source"));
-    assert(msrc != NULL);
-    upipe_mgr_release(upipe_msrc_mgr);
-    flow = uref_alloc_control(uref_mgr);
-    assert(flow != NULL);
-    ubase_assert(uref_msrc_flow_set_path(flow, dirpath));
-    ubase_assert(uref_msrc_flow_set_data(flow, suffix));
-    ubase_assert(uref_msrc_flow_set_aux(flow, suffix));
-    ubase_assert(uref_msrc_flow_set_rotate(flow, rotate));
-    ubase_assert(uref_msrc_flow_set_offset(flow, rotate_offset));
-    ubase_assert(upipe_set_flow_def(msrc, flow));
-    uref_free(flow);
-    ubase_assert(upipe_set_output_size(msrc, sizeof(uint64_t)));
-
+    // check resulting files with msrc, truncating a segment while one of
+    // its blocks is held
     struct upipe *test = upipe_void_alloc(&test_mgr, uprobe_use(logger));
     assert(test != NULL);
+    struct upipe *msrc = msrc_alloc(logger, dirpath, suffix, false);
     ubase_assert(upipe_set_output(msrc, test));
 
+    char truncated[MAXPATHLEN];
+    snprintf(truncated, MAXPATHLEN, "%s%u%s", dirpath, SLICES_NUM - 2, suffix);
+    truncate_path = truncated;
+    truncate_systime = rotate_offset + (SLICES_NUM - 2) * rotate +
+                       3 * (rotate/UREF_PER_SLICE);
+
     // fire !
-    ubase_assert(upipe_src_set_position(msrc, 0));
+    next_systime = rotate_offset;
+    ubase_assert(upipe_src_set_position(msrc, rotate_offset));
+    upump_mgr_run(upump_mgr, NULL);
+    assert(truncate_path == NULL);
+    /* the segment was already read */
+    assert(nb_received == SLICES_NUM * UREF_PER_SLICE);
+    upipe_release(msrc);
+
+    // map the files, the truncated segment is skipped
+    msrc = msrc_alloc(logger, dirpath, suffix, true);
+    ubase_assert(upipe_set_output(msrc, test));
+    next_systime = rotate_offset;
+    nb_received = 0;
+    ubase_assert(upipe_src_set_position(msrc, rotate_offset));
+    upump_mgr_run(upump_mgr, NULL);
+    assert(nb_received == (SLICES_NUM - 1) * UREF_PER_SLICE);
+
+    // a cached segment which shrank is dropped instead of being read
+    snprintf(truncated, MAXPATHLEN, "%s%u%s", dirpath, SLICES_NUM - 1, suffix);
+    assert(truncate(truncated, 0) == 0);
+    next_systime = rotate_offset;
+    nb_received = 0;
+    ubase_assert(upipe_src_set_position(msrc,
+                rotate_offset + (SLICES_NUM - 1) * rotate));
     upump_mgr_run(upump_mgr, NULL);
+    assert(!nb_received);
 
     // release everything
     upipe_release(msrc);
@@ -41,6 +41,9 @@
 #include "upipe/uref.h"
 #include "upipe/uref_std.h"
 #include "upipe/uref_block_flow.h"
+#include "upipe/uref_block.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block_mem.h"
 #include "upipe/upump.h"
 #include "upump-ev/upump_ev.h"
 #include "upipe-modules/upipe_queue_source.h"
@@ -55,6 +58,18 @@
 #define UPUMP_POOL 0
 #define UPUMP_BLOCKER_POOL 0
 #define QUEUE_LENGTH 6
+#define UBUF_POOL_DEPTH 0
+/** length of the queue exceeding the limit of the previous implementation */
+#define DEEP_QUEUE_LENGTH 1000
+/** number of urefs without buffer in the deep queue */
+#define DEEP_UREFS 500
+/** number of urefs with a block buffer in the deep queue */
+#define DEEP_BLOCKS 4
+/** size of the block buffers */
+#define BLOCK_SIZE 100
+/** maximum number of octets in the deep queue */
+#define MAX_OCTETS 250
+#define BUDGET 16
 #define UPROBE_LOG_LEVEL UPROBE_LOG_VERBOSE
 
 UREF_ATTR_SMALL_UNSIGNED(test, test, "x.test", test)
@@ -65,6 +80,8 @@ static uint8_t counter = 0;
 static struct uref_mgr *uref_mgr;
 static struct urequest request;
 static bool request_was_unregistered = false;
+static struct upipe *upipe_deep;
+static unsigned int deep_counter = 0;
 
 /** definition of our uprobe */
 static int catch(struct uprobe *uprobe, struct upipe *upipe,
@@ -77,6 +94,7 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
         case UPROBE_READY:
         case UPROBE_DEAD:
         case UPROBE_NEW_FLOW_DEF:
+        case UPROBE_STALLED:
             break;
         case UPROBE_SOURCE_END:
             upipe_release(upipe);
@@ -165,6 +183,47 @@ static struct upipe_mgr queue_test_mgr = {
     .upipe_control = test_control
 };
 
+/** helper phony pipe counting urefs from the deep queue */
+static void count_input(struct upipe *upipe, struct uref *uref,
+                        struct upump **upump_p)
+{
+    assert(uref != NULL);
+    deep_counter++;
+    if (deep_counter == DEEP_UREFS + DEEP_BLOCKS) {
+        /* sampled before the source started draining the queue */
+        unsigned int high_length, high_octets;
+        ubase_assert(upipe_qsrc_get_high_water(upipe_deep, &high_length,
+                                               &high_octets));
+        assert(high_length == 1 + DEEP_UREFS + MAX_OCTETS / BLOCK_SIZE);
+        assert(high_octets == MAX_OCTETS / BLOCK_SIZE * BLOCK_SIZE);
+        ubase_assert(upipe_qsrc_reset_high_water(upipe_deep));
+        ubase_assert(upipe_qsrc_get_high_water(upipe_deep, &high_length,
+                                               &high_octets));
+        assert(high_length == 0);
+        assert(high_octets == 0);
+    }
+    uref_free(uref);
+}
+
+/** helper phony pipe */
+static int count_control(struct upipe *upipe, int command, va_list args)
+{
+    switch (command) {
+        case UPIPE_SET_FLOW_DEF:
+            return UBASE_ERR_NONE;
+        default:
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** helper phony pipe */
+static struct upipe_mgr count_test_mgr = {
+    .refcount = NULL,
+    .upipe_alloc = test_alloc,
+    .upipe_input = count_input,
+    .upipe_control = count_control
+};
+
 int main(int argc, char *argv[])
 {
     upump_mgr = upump_ev_mgr_alloc_default(UPUMP_POOL, UPUMP_BLOCKER_POOL);
@@ -235,6 +294,59 @@ int main(int argc, char *argv[])
     assert(counter == 2);
     assert(request_was_unregistered);
 
+    /* deep queue with a limit on the number of octets */
+    struct ubuf_mgr *ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH,
+                                                         UBUF_POOL_DEPTH,
+                                                         umem_mgr, 0, 0, -1,
+                                                         0);
+    assert(ubuf_mgr != NULL);
+    struct upipe *upipe_count = upipe_void_alloc(&count_test_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "count"));
+    assert(upipe_count != NULL);
+
+    upipe_deep = upipe_qsrc_alloc(upipe_qsrc_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "deep queue source"), DEEP_QUEUE_LENGTH);
+    assert(upipe_deep != NULL);
+    ubase_assert(upipe_qsrc_get_max_length(upipe_deep, &length));
+    assert(length == DEEP_QUEUE_LENGTH);
+    ubase_assert(upipe_qsrc_set_max_octets(upipe_deep, MAX_OCTETS));
+    ubase_nassert(upipe_qsrc_set_budget(upipe_deep, 0));
+    ubase_assert(upipe_qsrc_set_budget(upipe_deep, BUDGET));
+    ubase_assert(upipe_set_output(upipe_deep, upipe_count));
+
+    upipe_qsink = upipe_qsink_alloc(upipe_qsink_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "deep queue sink"),
+            upipe_deep);
+    assert(upipe_qsink != NULL);
+    uref = uref_block_flow_alloc_def(uref_mgr, NULL);
+    assert(uref != NULL);
+    ubase_assert(upipe_set_flow_def(upipe_qsink, uref));
+    uref_free(uref);
+
+    for (int i = 0; i < DEEP_UREFS; i++) {
+        uref = uref_alloc(uref_mgr);
+        assert(uref != NULL);
+        upipe_input(upipe_qsink, uref, NULL);
+    }
+    /* the sink blocks when the number of octets exceeds the limit */
+    for (int i = 0; i < DEEP_BLOCKS; i++) {
+        uref = uref_block_alloc(uref_mgr, ubuf_mgr, BLOCK_SIZE);
+        assert(uref != NULL);
+        upipe_input(upipe_qsink, uref, NULL);
+    }
+    ubase_assert(upipe_qsrc_get_length(upipe_deep, &length));
+    assert(length == 1 + DEEP_UREFS + MAX_OCTETS / BLOCK_SIZE);
+    upipe_release(upipe_qsink);
+
+    upump_mgr_run(upump_mgr, NULL);
+    assert(deep_counter == DEEP_UREFS + DEEP_BLOCKS);
+
+    test_free(upipe_count);
+    ubuf_mgr_release(ubuf_mgr);
+
     /* check that they are correctly released even if no flow def is input */
     upipe_qsrc = upipe_qsrc_alloc(upipe_qsrc_mgr,
             uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
@@ -0,0 +1,441 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for rtp feedback pipe
+ *
+ * This sends an RTP stream with isolated losses, a burst, a dense loss
+ * pattern and a reordering through a rtpfb pipe, answers its
+ * retransmission requests (generic NACKs, then RIST range NACKs) and
+ * checks that the stream is output without any hole.
+ */
+
+#undef NDEBUG
+
+#include "upipe/uprobe.h"
+#include "upipe/uprobe_stdio.h"
+#include "upipe/uprobe_prefix.h"
+#include "upipe/uprobe_uref_mgr.h"
+#include "upipe/uprobe_upump_mgr.h"
+#include "upipe/uprobe_uclock.h"
+#include "upipe/uprobe_ubuf_mem.h"
+#include "upipe/uclock.h"
+#include "upipe/uclock_std.h"
+#include "upipe/umem.h"
+#include "upipe/umem_alloc.h"
+#include "upipe/udict.h"
+#include "upipe/udict_inline.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block_mem.h"
+#include "upipe/uref.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_block_flow.h"
+#include "upipe/uref_clock.h"
+#include "upipe/uref_std.h"
+#include "upipe/upump.h"
+#include "upump-ev/upump_ev.h"
+#include "upipe/upipe.h"
+#include "upipe-filters/upipe_rtp_feedback.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <assert.h>
+
+#include <bitstream/ietf/rtp.h>
+#include <bitstream/ietf/rtcp.h>
+#include <bitstream/ietf/rtcp_fb.h>
+
+#define UDICT_POOL_DEPTH 0
+#define UREF_POOL_DEPTH 0
+#define UBUF_POOL_DEPTH 0
+#define UPUMP_POOL 0
+#define UPUMP_BLOCKER_POOL 0
+#define UPROBE_LOG_LEVEL UPROBE_LOG_NOTICE
+#define PAYLOAD_SIZE 1316
+/** number of packets of the stream */
+#define PACKETS 3000
+/** packets sent every millisecond */
+#define PACKETS_PER_TICK 10
+/** first sequence number, to wrap around */
+#define FIRST_SEQNUM 64000
+/** buffering of the rtpfb pipe, in ms */
+#define LATENCY "100"
+
+static struct uref_mgr *uref_mgr;
+static struct ubuf_mgr *ubuf_mgr;
+static struct uclock *uclock;
+static struct upipe *rtpfb;
+static struct upipe *rtpfb_output;
+static struct upump *send_pump;
+static unsigned sent;
+static unsigned dropped;
+static unsigned received;
+static unsigned nack_packets;
+/** range NACKs for a single packet, and largest number of additional packets
+ * in a range NACK */
+static unsigned single_ranges, max_range;
+static bool done;
+/** retransmissions waiting for the next tick */
+static uint16_t pending[PACKETS];
+static unsigned nb_pending;
+/** packets already retransmitted */
+static bool retransmitted[PACKETS];
+
+/** definition of our uprobe */
+static int catch(struct uprobe *uprobe, struct upipe *upipe,
+                 int event, va_list args)
+{
+    switch (event) {
+        default:
+            assert(0);
+            break;
+        case UPROBE_READY:
+        case UPROBE_DEAD:
+        case UPROBE_NEW_FLOW_DEF:
+        case UPROBE_SOURCE_END:
+            break;
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** returns true if the network loses the first transmission of a packet */
+static bool lost(unsigned i)
+{
+    return i % 97 == 13 ||                          /* isolated losses */
+           (i >= 500 && i < 540) ||                 /* burst */
+           (i >= 1200 && i < 1400 && i % 3 == 0);   /* dense losses */
+}
+
+/** allocates the RTP packet of a given index */
+static struct uref *packet(unsigned i)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                                         RTP_HEADER_SIZE + PAYLOAD_SIZE);
+    assert(uref != NULL);
+    uint8_t *buf;
+    int size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &buf));
+    memset(buf, 0, size);
+    rtp_set_hdr(buf);
+    rtp_set_type(buf, 33);
+    rtp_set_seqnum(buf, (uint16_t)(FIRST_SEQNUM + i));
+    static const uint8_t ssrc[4] = { 0xde, 0xad, 0xbe, 0xef };
+    rtp_set_ssrc(buf, ssrc);
+    memcpy(buf + RTP_HEADER_SIZE, &i, sizeof(i));
+    ubase_assert(uref_block_unmap(uref, 0));
+    uref_clock_set_cr_sys(uref, uclock_now(uclock));
+    return uref;
+}
+
+/** sends a tick worth of packets and the pending retransmissions */
+static void send_tick(struct upump *upump)
+{
+    if (done) {
+        unsigned expected_seqnum, last_output_seqnum;
+        size_t buffered, nacks, repaired, loss, dups;
+        ubase_assert(upipe_rtpfb_get_stats(rtpfb, &expected_seqnum,
+                    &last_output_seqnum, &buffered, &nacks, &repaired,
+                    &loss, &dups));
+        assert(loss == 0);
+        assert(dups == 0);
+        assert(nacks == dropped);
+        /* the reordered packet is repaired too */
+        assert(repaired == dropped + 1);
+
+        upump_stop(send_pump);
+        upump_free(send_pump);
+        upipe_release(rtpfb_output);
+        upipe_release(rtpfb);
+        return;
+    }
+
+    for (unsigned i = 0; i < nb_pending; i++) {
+        unsigned index = (uint16_t)(pending[i] - FIRST_SEQNUM);
+        upipe_input(rtpfb, packet(index), NULL);
+    }
+    nb_pending = 0;
+
+    for (unsigned i = 0; i < PACKETS_PER_TICK && sent < PACKETS; i++) {
+        unsigned index = sent++;
+        /* swap two packets */
+        if (index == 800 || index == 801)
+            index ^= 1;
+        if (lost(index))
+            dropped++;
+        else
+            upipe_input(rtpfb, packet(index), NULL);
+    }
+}
+
+/** helper phony pipe */
+static struct upipe *test_alloc(struct upipe_mgr *mgr, struct uprobe *uprobe,
+                                uint32_t signature, va_list args)
+{
+    struct upipe *upipe = malloc(sizeof(struct upipe));
+    assert(upipe != NULL);
+    upipe_init(upipe, mgr, uprobe);
+    upipe_throw_ready(upipe);
+    return upipe;
+}
+
+/** helper phony pipe receiving the repaired stream */
+static void test_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    uint8_t buffer[RTP_HEADER_SIZE];
+    const uint8_t *rtp = uref_block_peek(uref, 0, RTP_HEADER_SIZE, buffer);
+    assert(rtp != NULL);
+    uint16_t seqnum = rtp_get_seqnum(rtp);
+    uref_block_peek_unmap(uref, 0, buffer, rtp);
+    uref_free(uref);
+
+    assert(seqnum == (uint16_t)(FIRST_SEQNUM + received));
+    if (++received == PACKETS)
+        done = true;
+}
+
+/** helper phony pipe */
+static int test_control(struct upipe *upipe, int command, va_list args)
+{
+    switch (command) {
+        case UPIPE_SET_FLOW_DEF:
+            return UBASE_ERR_NONE;
+        case UPIPE_REGISTER_REQUEST: {
+            struct urequest *urequest = va_arg(args, struct urequest *);
+            return upipe_throw_provide_request(upipe, urequest);
+        }
+        case UPIPE_UNREGISTER_REQUEST:
+            return UBASE_ERR_NONE;
+        default:
+            assert(0);
+            return UBASE_ERR_UNHANDLED;
+    }
+}
+
+/** helper phony pipe */
+static void test_free(struct upipe *upipe)
+{
+    upipe_throw_dead(upipe);
+    upipe_clean(upipe);
+    free(upipe);
+}
+
+/** helper phony pipe */
+static struct upipe_mgr test_mgr = {
+    .refcount = NULL,
+    .signature = 0,
+    .upipe_alloc = test_alloc,
+    .upipe_input = test_input,
+    .upipe_control = test_control
+};
+
+/** schedules the retransmission of a requested packet */
+static void retransmit(uint16_t seqnum)
+{
+    unsigned index = (uint16_t)(seqnum - FIRST_SEQNUM);
+    assert(index < sent);
+    assert(lost(index));
+    assert(!retransmitted[index]);
+    retransmitted[index] = true;
+    pending[nb_pending++] = seqnum;
+}
+
+/** helper phony pipe receiving the retransmission requests */
+static void nack_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    const uint8_t *buf;
+    int size = -1;
+    ubase_assert(uref_block_read(uref, 0, &size, &buf));
+    assert(size >= 12 && size % 4 == 0);
+    assert(rtcp_get_length(buf) == size / 4 - 1);
+    nack_packets++;
+
+    if (rtcp_get_pt(buf) == RTCP_PT_APP) {
+        /* range NACK */
+        assert(!memcmp(buf + 8, "RIST", 4));
+        for (const uint8_t *fci = buf + 12; fci < buf + size; fci += 4) {
+            uint16_t seqnum = rtcp_fb_nack_get_packet_id(fci);
+            /* number of additional lost packets after seqnum */
+            uint16_t count = rtcp_fb_nack_get_bitmask_lost(fci);
+            unsigned index = (uint16_t)(seqnum - FIRST_SEQNUM);
+            /* a lost packet followed by a received one is alone */
+            if (!lost(index + 1))
+                assert(count == 0);
+            if (!count)
+                single_ranges++;
+            if (count > max_range)
+                max_range = count;
+            retransmit(seqnum);
+            while (count--)
+                retransmit(++seqnum);
+        }
+    } else {
+        /* generic NACK */
+        assert(rtcp_get_pt(buf) == RTCP_PT_RTPFB);
+        assert(rtcp_fb_get_fmt(buf) == RTCP_PT_RTPFB_GENERIC_NACK);
+        for (const uint8_t *fci = buf + RTCP_FB_HEADER_SIZE; fci < buf + size;
+             fci += RTCP_FB_FCI_GENERIC_NACK_SIZE) {
+            uint16_t seqnum = rtcp_fb_nack_get_packet_id(fci);
+            uint16_t bitmask = rtcp_fb_nack_get_bitmask_lost(fci);
+            retransmit(seqnum);
+            for (unsigned i = 0; i < 16; i++)
+                if (bitmask & (1 << i))
+                    retransmit(seqnum + 1 + i);
+        }
+    }
+
+    uref_block_unmap(uref, 0);
+    uref_free(uref);
+}
+
+/** helper phony pipe */
+static struct upipe_mgr nack_mgr = {
+    .refcount = NULL,
+    .signature = 0,
+    .upipe_alloc = test_alloc,
+    .upipe_input = nack_input,
+    .upipe_control = test_control
+};
+
+/** returns the CPU time in ns */
+static uint64_t cpu_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** runs the stream with a given NACK form */
+static void run(struct upump_mgr *upump_mgr, struct uprobe *logger,
+                const char *nack)
+{
+    sent = dropped = received = nack_packets = nb_pending = 0;
+    single_ranges = max_range = 0;
+    done = false;
+    memset(retransmitted, 0, sizeof(retransmitted));
+
+    struct upipe_mgr *rtpfb_mgr = upipe_rtpfb_mgr_alloc();
+    assert(rtpfb_mgr != NULL);
+    rtpfb = upipe_void_alloc(rtpfb_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "rtpfb"));
+    assert(rtpfb != NULL);
+    upipe_mgr_release(rtpfb_mgr);
+    ubase_assert(upipe_set_option(rtpfb, "latency", LATENCY));
+    ubase_assert(upipe_set_option(rtpfb, "nack", nack));
+    ubase_nassert(upipe_set_option(rtpfb, "nack", "foo"));
+
+    rtpfb_output = upipe_void_alloc_sub(rtpfb,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "rtpfb output"));
+    assert(rtpfb_output != NULL);
+    struct upipe *nack_sink = upipe_void_alloc(&nack_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "nack"));
+    assert(nack_sink != NULL);
+    ubase_assert(upipe_set_output(rtpfb_output, nack_sink));
+
+    struct uref *flow_def = uref_block_flow_alloc_def(uref_mgr, NULL);
+    assert(flow_def != NULL);
+    ubase_assert(upipe_set_flow_def(rtpfb, flow_def));
+    uref_free(flow_def);
+
+    struct upipe *sink = upipe_void_alloc(&test_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "sink"));
+    assert(sink != NULL);
+    ubase_assert(upipe_set_output(rtpfb, sink));
+
+    send_pump = upump_alloc_timer(upump_mgr, send_tick, NULL, NULL,
+                                  UCLOCK_FREQ / 1000, UCLOCK_FREQ / 1000);
+    assert(send_pump != NULL);
+    upump_start(send_pump);
+
+    uint64_t start = cpu_time();
+    upump_mgr_run(upump_mgr, NULL);
+    uint64_t cpu = cpu_time() - start;
+
+    assert(received == PACKETS);
+    unsigned repairs = 0;
+    for (unsigned i = 0; i < PACKETS; i++)
+        if (retransmitted[i])
+            repairs++;
+    assert(repairs == dropped);
+    if (!strcmp(nack, "range")) {
+        /* isolated losses are requested with no additional packet, and the
+         * burst with at least one range */
+        assert(single_ranges > 0);
+        assert(max_range > 0 && max_range < 40);
+    }
+    printf("%s NACKs: %u packets lost, %u NACK packets, %"PRIu64" us CPU\n",
+           nack, dropped, nack_packets, cpu / 1000);
+
+    test_free(sink);
+    test_free(nack_sink);
+}
+
+int main(int argc, char *argv[])
+{
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr = udict_inline_mgr_alloc(UDICT_POOL_DEPTH,
+                                                         umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr, 0);
+    assert(uref_mgr != NULL);
+    ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                        umem_mgr, 0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+    struct upump_mgr *upump_mgr = upump_ev_mgr_alloc_default(UPUMP_POOL,
+            UPUMP_BLOCKER_POOL);
+    assert(upump_mgr != NULL);
+    uclock = uclock_std_alloc(0);
+    assert(uclock != NULL);
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, NULL);
+    struct uprobe *logger = uprobe_stdio_alloc(&uprobe, stdout,
+                                               UPROBE_LOG_LEVEL);
+    assert(logger != NULL);
+    logger = uprobe_uref_mgr_alloc(logger, uref_mgr);
+    assert(logger != NULL);
+    logger = uprobe_upump_mgr_alloc(logger, upump_mgr);
+    assert(logger != NULL);
+    logger = uprobe_uclock_alloc(logger, uclock);
+    assert(logger != NULL);
+    logger = uprobe_ubuf_mem_alloc(logger, umem_mgr, UBUF_POOL_DEPTH,
+                                   UBUF_POOL_DEPTH);
+    assert(logger != NULL);
+
+    run(upump_mgr, logger, "bitmask");
+    run(upump_mgr, logger, "range");
+
+    uprobe_release(logger);
+    uprobe_clean(&uprobe);
+    uclock_release(uclock);
+    upump_mgr_release(upump_mgr);
+    ubuf_mgr_release(ubuf_mgr);
+    uref_mgr_release(uref_mgr);
+    udict_mgr_release(udict_mgr);
+    umem_mgr_release(umem_mgr);
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short unit tests for per-pipe instrumentation counters
+ */
+
+#undef NDEBUG
+
+#include "upipe/uprobe.h"
+#include "upipe/uprobe_stdio.h"
+#include "upipe/uprobe_prefix.h"
+#include "upipe/umem.h"
+#include "upipe/umem_alloc.h"
+#include "upipe/udict.h"
+#include "upipe/udict_inline.h"
+#include "upipe/ubuf.h"
+#include "upipe/ubuf_block_mem.h"
+#include "upipe/uref.h"
+#include "upipe/uref_block.h"
+#include "upipe/uref_std.h"
+#include "upipe/upipe.h"
+#include "upipe/upipe_dump.h"
+#include "upipe-modules/upipe_null.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#define UDICT_POOL_DEPTH    5
+#define UREF_POOL_DEPTH     5
+#define UBUF_POOL_DEPTH     5
+#define ITERATIONS          50
+#define BLOCK_SIZE          188
+#define UPROBE_LOG_LEVEL    UPROBE_LOG_DEBUG
+#define SPIN_LOOPS          1000000
+
+/** definition of our uprobe */
+static int catch(struct uprobe *uprobe, struct upipe *upipe,
+                 int event, va_list args)
+{
+    switch (event) {
+        case UPROBE_READY:
+        case UPROBE_DEAD:
+            break;
+        default:
+            assert(0);
+            break;
+    }
+    return UBASE_ERR_NONE;
+}
+
+/** pipe the forward pipe outputs to */
+static struct upipe *fwd_output = NULL;
+
+/** helper phony pipe */
+static struct upipe *test_alloc(struct upipe_mgr *mgr, struct uprobe *uprobe,
+                                uint32_t signature, va_list args)
+{
+    struct upipe *upipe = malloc(sizeof(struct upipe));
+    assert(upipe != NULL);
+    upipe_init(upipe, mgr, uprobe);
+    return upipe;
+}
+
+/** helper phony pipe forwarding urefs to fwd_output */
+static void fwd_input(struct upipe *upipe, struct uref *uref,
+                      struct upump **upump_p)
+{
+    upipe_input(fwd_output, uref, upump_p);
+}
+
+/** helper phony pipe burning cycles */
+static void spin_input(struct upipe *upipe, struct uref *uref,
+                       struct upump **upump_p)
+{
+    volatile unsigned int i;
+    for (i = 0; i < SPIN_LOOPS; i++);
+    uref_free(uref);
+}
+
+/** helper phony pipe */
+static void test_free(struct upipe *upipe)
+{
+    upipe_clean(upipe);
+    free(upipe);
+}
+
+/** helper phony pipe */
+static struct upipe_mgr fwd_mgr = {
+    .upipe_alloc = test_alloc,
+    .upipe_input = fwd_input,
+    .upipe_control = NULL
+};
+
+/** helper phony pipe */
+static struct upipe_mgr spin_mgr = {
+    .upipe_alloc = test_alloc,
+    .upipe_input = spin_input,
+    .upipe_control = NULL
+};
+
+int main(int argc, char **argv)
+{
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr = udict_inline_mgr_alloc(UDICT_POOL_DEPTH,
+                                                         umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    struct uref_mgr *uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH,
+                                                   udict_mgr, 0);
+    assert(uref_mgr != NULL);
+    struct ubuf_mgr *ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH,
+                                                         UBUF_POOL_DEPTH,
+                                                         umem_mgr,
+                                                         0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, NULL);
+    struct uprobe *logger = uprobe_stdio_alloc(&uprobe, stdout,
+                                               UPROBE_LOG_LEVEL);
+    assert(logger != NULL);
+
+    struct upipe_mgr *upipe_null_mgr = upipe_null_mgr_alloc();
+    assert(upipe_null_mgr != NULL);
+
+    /* not instrumented */
+    struct upipe *null1 = upipe_void_alloc(upipe_null_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "null1"));
+    assert(null1 != NULL);
+    assert(null1->stats == NULL);
+    struct upipe_stats stats;
+    assert(!ubase_check(upipe_stats_get(null1, &stats)));
+
+    /* instrumented through the manager */
+    upipe_mgr_set_stats(upipe_null_mgr, true);
+    struct upipe *null2 = upipe_void_alloc(upipe_null_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "null2"));
+    assert(null2 != NULL);
+    upipe_mgr_set_stats(upipe_null_mgr, false);
+
+    /* instrumented globally */
+    upipe_stats_set_global(true);
+    struct upipe *null3 = upipe_void_alloc(upipe_null_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL, "null3"));
+    assert(null3 != NULL);
+    upipe_stats_set_global(false);
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        upipe_input(null1, uref_block_alloc(uref_mgr, ubuf_mgr, BLOCK_SIZE),
+                    NULL);
+        upipe_input(null2, uref_block_alloc(uref_mgr, ubuf_mgr, BLOCK_SIZE),
+                    NULL);
+        upipe_input(null3, uref_alloc(uref_mgr), NULL);
+    }
+
+    ubase_assert(upipe_stats_get(null2, &stats));
+    assert(stats.urefs == ITERATIONS);
+    assert(stats.octets == ITERATIONS * BLOCK_SIZE);
+    assert(stats.max_cycles <= stats.cycles);
+    assert(stats.max_queue_depth == 0);
+
+    ubase_assert(upipe_stats_get(null3, &stats));
+    assert(stats.urefs == ITERATIONS);
+    assert(stats.octets == 0);
+
+    upipe_stats_queue(null3, 3);
+    upipe_stats_queue(null3, 1);
+    ubase_assert(upipe_stats_get(null3, &stats));
+    assert(stats.queue_depth == 1);
+    assert(stats.max_queue_depth == 3);
+
+    upipe_dump(NULL, NULL, stdout, NULL, null1, null2, null3, NULL);
+
+    ubase_assert(upipe_stats_reset(null2));
+    ubase_assert(upipe_stats_get(null2, &stats));
+    assert(stats.urefs == 0 && stats.octets == 0 && stats.cycles == 0);
+
+    upipe_release(null1);
+    upipe_release(null2);
+    upipe_release(null3);
+
+    /* nested pipes only account for their own time */
+    upipe_stats_set_global(true);
+    struct upipe *fwd = upipe_void_alloc(&fwd_mgr, uprobe_use(logger));
+    assert(fwd != NULL);
+    struct upipe *spin = upipe_void_alloc(&spin_mgr, uprobe_use(logger));
+    assert(spin != NULL);
+    upipe_stats_set_global(false);
+    fwd_output = spin;
+
+    for (int i = 0; i < 5; i++)
+        upipe_input(fwd, uref_alloc(uref_mgr), NULL);
+
+    struct upipe_stats fwd_stats;
+    ubase_assert(upipe_stats_get(fwd, &fwd_stats));
+    ubase_assert(upipe_stats_get(spin, &stats));
+    assert(fwd_stats.urefs == 5);
+    assert(stats.urefs == 5);
+    assert(stats.cycles >= SPIN_LOOPS);
+    assert(fwd_stats.cycles < stats.cycles / 10);
+    assert(fwd_stats.max_cycles < stats.max_cycles);
+
+    test_free(fwd);
+    test_free(spin);
+
+    upipe_mgr_release(upipe_null_mgr); // no-op
+    ubuf_mgr_release(ubuf_mgr);
+    uref_mgr_release(uref_mgr);
+    udict_mgr_release(udict_mgr);
+    umem_mgr_release(umem_mgr);
+    uprobe_release(logger);
+    uprobe_clean(&uprobe);
+
+    return 0;
+}
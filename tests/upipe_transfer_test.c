@@ -56,6 +56,7 @@ static bool transferred = false;
 static bool got_uri = false;
 static uatomic_uint32_t source_end;
 static pthread_t xfer_thread_id;
+static bool called = false;
 
 /** helper phony pipe */
 struct test_pipe {
@@ -117,6 +118,20 @@ static struct upipe_mgr test_mgr = {
     .upipe_control = test_control
 };
 
+/** function called in the remote thread */
+static int remote_call(struct upipe *upipe, void *opaque)
+{
+    assert(pthread_equal(pthread_self(), xfer_thread_id));
+    /* messages of the batch were processed first */
+    assert(transferred);
+    assert(got_uri);
+    bool *called_p = opaque;
+    if (*called_p)
+        return UBASE_ERR_INVALID;
+    *called_p = true;
+    return UBASE_ERR_NONE;
+}
+
 static void *thread(void *_upipe_xfer_mgr)
 {
     struct upipe_mgr *upipe_xfer_mgr = (struct upipe_mgr *)_upipe_xfer_mgr;
@@ -187,8 +202,17 @@ int main(int argc, char **argv)
             upipe_test);
     /* from now on upipe_test shouldn't be accessed from this thread */
     assert(upipe_handle != NULL);
+    ubase_assert(upipe_xfer_mgr_batch_begin(upipe_xfer_mgr));
     ubase_assert(upipe_attach_upump_mgr(upipe_handle));
+    ubase_assert(upipe_xfer_mgr_batch_begin(upipe_xfer_mgr));
     ubase_assert(upipe_set_uri(upipe_handle, "toto"));
+    ubase_assert(upipe_xfer_mgr_batch_end(upipe_xfer_mgr));
+    ubase_assert(upipe_xfer_mgr_batch_end(upipe_xfer_mgr));
+    ubase_nassert(upipe_xfer_mgr_batch_end(upipe_xfer_mgr));
+    ubase_assert(upipe_xfer_call(upipe_handle, remote_call, &called));
+    assert(called);
+    assert(upipe_xfer_call(upipe_handle, remote_call, &called) ==
+           UBASE_ERR_INVALID);
     upipe_release(upipe_handle);
 
     upipe_mgr_release(upipe_xfer_mgr);
@@ -46,11 +46,15 @@
 #include "upipe/uref_block.h"
 #include "upipe/uref_std.h"
 #include "upipe/upipe.h"
+#include "upipe/upipe_helper_upipe.h"
+#include "upipe/upipe_helper_urefcount.h"
+#include "upipe-modules/upipe_worker_linear.h"
 #include "upipe-ts/upipe_ts_demux.h"
 #include "upipe-ts/upipe_ts_split.h"
 #include "upipe-framers/upipe_auto_framer.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #include <bitstream/mpeg/ts.h>
@@ -62,13 +66,20 @@
 #define UREF_POOL_DEPTH 0
 #define UBUF_POOL_DEPTH 0
 #define UPROBE_LOG_LEVEL UPROBE_LOG_DEBUG
+#define QUEUE_LENGTH 8
 
+static struct uref_mgr *uref_mgr;
+static struct ubuf_mgr *ubuf_mgr;
 static struct upipe *upipe_ts_demux;
 static struct upipe *upipe_ts_demux_output_pmt = NULL;
 static struct upipe *upipe_ts_demux_output_video = NULL;
 static struct uprobe *logger;
 static uint64_t wanted_flow_id;
 static int expect_new_flow_def = 0;
+/** number of wlin pipes allocated */
+static unsigned int nb_wlin = 0;
+/** number of urefs sent to the worker */
+static unsigned int nb_wlin_urefs = 0;
 
 /** definition of our uprobe */
 static int catch(struct uprobe *uprobe, struct upipe *upipe,
@@ -135,38 +146,87 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
-int main(int argc, char *argv[])
+/** phony wlin pipe, running the remote pipe on the same thread */
+struct wlin_test {
+    /** refcount management structure */
+    struct urefcount urefcount;
+    /** remote pipe */
+    struct upipe *remote;
+    /** public upipe structure */
+    struct upipe upipe;
+};
+
+UPIPE_HELPER_UPIPE(wlin_test, upipe, UPIPE_WLIN_SIGNATURE)
+UPIPE_HELPER_UREFCOUNT(wlin_test, urefcount, wlin_test_free)
+
+/** allocates a phony wlin pipe */
+static struct upipe *wlin_test_alloc(struct upipe_mgr *mgr,
+                                     struct uprobe *uprobe,
+                                     uint32_t signature, va_list args)
 {
-    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
-    assert(umem_mgr != NULL);
-    struct udict_mgr *udict_mgr = udict_inline_mgr_alloc(UDICT_POOL_DEPTH,
-                                                         umem_mgr, -1, -1);
-    assert(udict_mgr != NULL);
-    struct uref_mgr *uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr,
-                                                   0);
-    assert(uref_mgr != NULL);
-    struct ubuf_mgr *ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH,
-                                                         UBUF_POOL_DEPTH,
-                                                         umem_mgr, 0, 0, -1, 0);
-    assert(ubuf_mgr != NULL);
-    struct uprobe uprobe;
-    uprobe_init(&uprobe, catch, NULL);
-    logger = uprobe_stdio_alloc(&uprobe, stdout, UPROBE_LOG_LEVEL);
-    assert(logger != NULL);
-    logger = uprobe_uref_mgr_alloc(logger, uref_mgr);
-    assert(logger != NULL);
-    logger = uprobe_ubuf_mem_alloc(logger, umem_mgr,
-                                   UBUF_POOL_DEPTH, UBUF_POOL_DEPTH);
-    assert(logger != NULL);
+    assert(signature == UPIPE_WLIN_SIGNATURE);
+    struct upipe *remote = va_arg(args, struct upipe *);
+    struct uprobe *uprobe_remote = va_arg(args, struct uprobe *);
+    unsigned int input_queue_length = va_arg(args, unsigned int);
+    unsigned int output_queue_length = va_arg(args, unsigned int);
+    assert(remote != NULL);
+    assert(uprobe_remote != NULL);
+    assert(input_queue_length == QUEUE_LENGTH);
+    assert(output_queue_length == QUEUE_LENGTH);
+    uprobe_release(uprobe_remote);
 
-    struct upipe_mgr *upipe_autof_mgr = upipe_autof_mgr_alloc();
-    assert(upipe_autof_mgr != NULL);
+    struct wlin_test *wlin_test = malloc(sizeof(struct wlin_test));
+    assert(wlin_test != NULL);
+    struct upipe *upipe = wlin_test_to_upipe(wlin_test);
+    upipe_init(upipe, mgr, uprobe);
+    wlin_test_init_urefcount(upipe);
+    wlin_test->remote = remote;
+    nb_wlin++;
+    upipe_throw_ready(upipe);
+    return upipe;
+}
 
-    struct upipe_mgr *upipe_ts_demux_mgr = upipe_ts_demux_mgr_alloc();
-    assert(upipe_ts_demux_mgr != NULL);
-    ubase_assert(upipe_ts_demux_mgr_set_autof_mgr(upipe_ts_demux_mgr,
-                                                  upipe_autof_mgr));
+/** sends a packet to the remote pipe */
+static void wlin_test_input(struct upipe *upipe, struct uref *uref,
+                            struct upump **upump_p)
+{
+    struct wlin_test *wlin_test = wlin_test_from_upipe(upipe);
+    nb_wlin_urefs++;
+    upipe_input(wlin_test->remote, uref, upump_p);
+}
+
+/** forwards control commands to the remote pipe */
+static int wlin_test_control(struct upipe *upipe, int command, va_list args)
+{
+    struct wlin_test *wlin_test = wlin_test_from_upipe(upipe);
+    return upipe_control_va(wlin_test->remote, command, args);
+}
+
+/** frees a phony wlin pipe */
+static void wlin_test_free(struct upipe *upipe)
+{
+    struct wlin_test *wlin_test = wlin_test_from_upipe(upipe);
+    upipe_throw_dead(upipe);
+    upipe_release(wlin_test->remote);
+    wlin_test_clean_urefcount(upipe);
+    upipe_clean(upipe);
+    free(wlin_test);
+}
 
+/** phony wlin manager */
+static struct upipe_mgr wlin_test_mgr = {
+    .refcount = NULL,
+    .signature = UPIPE_WLIN_SIGNATURE,
+    .upipe_alloc = wlin_test_alloc,
+    .upipe_input = wlin_test_input,
+    .upipe_control = wlin_test_control
+};
+
+/** demuxes a PAT, a PMT, a new version of both and a video PES, with the
+ * framers allocated behind wlin_mgr if not NULL */
+static void test(struct upipe_mgr *upipe_ts_demux_mgr,
+                 struct upipe_mgr *wlin_mgr)
+{
     struct uref *uref;
     uref = uref_block_flow_alloc_def(uref_mgr, "mpegts.");
     assert(uref != NULL);
@@ -177,6 +237,15 @@ int main(int argc, char *argv[])
     ubase_assert(upipe_set_flow_def(upipe_ts_demux, uref));
     uref_free(uref);
 
+    if (wlin_mgr != NULL) {
+        ubase_nassert(upipe_ts_demux_set_framer_worker(upipe_ts_demux,
+                    wlin_mgr, NULL, QUEUE_LENGTH));
+        ubase_nassert(upipe_ts_demux_set_framer_worker(upipe_ts_demux,
+                    wlin_mgr, logger, 0));
+        ubase_assert(upipe_ts_demux_set_framer_worker(upipe_ts_demux,
+                    wlin_mgr, logger, QUEUE_LENGTH));
+    }
+
     uint8_t *buffer, *payload, *pat_program, *pmt_es;
     int size;
 
@@ -387,6 +456,49 @@ int main(int argc, char *argv[])
     upipe_release(upipe_ts_demux_output_video);
     upipe_release(upipe_ts_demux_output_pmt);
     upipe_release(upipe_ts_demux);
+    upipe_ts_demux_output_video = NULL;
+    upipe_ts_demux_output_pmt = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr = udict_inline_mgr_alloc(UDICT_POOL_DEPTH,
+                                                         umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr, 0);
+    assert(uref_mgr != NULL);
+    ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH, UBUF_POOL_DEPTH,
+                                        umem_mgr, 0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, NULL);
+    logger = uprobe_stdio_alloc(&uprobe, stdout, UPROBE_LOG_LEVEL);
+    assert(logger != NULL);
+    logger = uprobe_uref_mgr_alloc(logger, uref_mgr);
+    assert(logger != NULL);
+    logger = uprobe_ubuf_mem_alloc(logger, umem_mgr,
+                                   UBUF_POOL_DEPTH, UBUF_POOL_DEPTH);
+    assert(logger != NULL);
+
+    struct upipe_mgr *upipe_autof_mgr = upipe_autof_mgr_alloc();
+    assert(upipe_autof_mgr != NULL);
+
+    struct upipe_mgr *upipe_ts_demux_mgr = upipe_ts_demux_mgr_alloc();
+    assert(upipe_ts_demux_mgr != NULL);
+    ubase_assert(upipe_ts_demux_mgr_set_autof_mgr(upipe_ts_demux_mgr,
+                                                  upipe_autof_mgr));
+
+    /* everything on the demux thread */
+    test(upipe_ts_demux_mgr, NULL);
+    assert(!nb_wlin);
+
+    /* framers behind a worker */
+    test(upipe_ts_demux_mgr, &wlin_test_mgr);
+    /* framers are allocated on the first PES, which only program 13 gets */
+    assert(nb_wlin == 1);
+    assert(nb_wlin_urefs == 1);
 
     upipe_mgr_release(upipe_ts_demux_mgr);
     upipe_mgr_release(upipe_autof_mgr);
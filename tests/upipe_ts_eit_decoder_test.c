@@ -149,52 +149,16 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
-int main(int argc, char *argv[])
+/** build the first section of the EIT */
+static struct uref *build_eit_first(struct uref_mgr *uref_mgr,
+                                    struct ubuf_mgr *ubuf_mgr,
+                                    uint8_t version)
 {
-    setenv("TZ", "UTC", 1);
-    tzset();
-
-    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
-    assert(umem_mgr != NULL);
-    struct udict_mgr *udict_mgr = udict_inline_mgr_alloc(UDICT_POOL_DEPTH,
-                                                         umem_mgr, -1, -1);
-    assert(udict_mgr != NULL);
-    struct uref_mgr *uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr,
-                                                   0);
-    assert(uref_mgr != NULL);
-    struct ubuf_mgr *ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH,
-                                                         UBUF_POOL_DEPTH,
-                                                         umem_mgr, 0, 0, -1, 0);
-    assert(ubuf_mgr != NULL);
-    struct uprobe uprobe;
-    uprobe_init(&uprobe, catch, NULL);
-    struct uprobe *uprobe_stdio = uprobe_stdio_alloc(&uprobe, stdout,
-                                                     UPROBE_LOG_LEVEL);
-    assert(uprobe_stdio != NULL);
-    uprobe_stdio = uprobe_ubuf_mem_alloc(uprobe_stdio, umem_mgr,
-                                         UBUF_POOL_DEPTH, UBUF_POOL_DEPTH);
-    assert(uprobe_stdio != NULL);
-
-    struct uref *uref;
-    uref = uref_block_flow_alloc_def(uref_mgr, "mpegtspsi.mpegtseit.");
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+            EIT_HEADER_SIZE + EIT_EVENT_SIZE + PSI_CRC_SIZE);
     assert(uref != NULL);
-
-    struct upipe_mgr *upipe_ts_eitd_mgr = upipe_ts_eitd_mgr_alloc();
-    assert(upipe_ts_eitd_mgr != NULL);
-    struct upipe *upipe_ts_eitd = upipe_void_alloc(upipe_ts_eitd_mgr,
-            uprobe_pfx_alloc(uprobe_use(uprobe_stdio), UPROBE_LOG_LEVEL,
-                             "ts eitd"));
-    assert(upipe_ts_eitd != NULL);
-    ubase_assert(upipe_set_flow_def(upipe_ts_eitd, uref));
-    uref_free(uref);
-
     uint8_t *buffer, *eit_event;
-    int size;
-
-    uref = uref_block_alloc(uref_mgr, ubuf_mgr,
-                            EIT_HEADER_SIZE + EIT_EVENT_SIZE + PSI_CRC_SIZE);
-    assert(uref != NULL);
-    size = -1;
+    int size = -1;
     ubase_assert(uref_block_write(uref, 0, &size, &buffer));
     assert(size == EIT_HEADER_SIZE + EIT_EVENT_SIZE + PSI_CRC_SIZE);
     eit_init(buffer, true);
@@ -204,7 +168,7 @@ int main(int argc, char *argv[])
     eit_set_onid(buffer, onid);
     eit_set_segment_last_sec_number(buffer, 0);
     eit_set_last_table_id(buffer, EIT_TABLE_ID_PF_ACTUAL);
-    psi_set_version(buffer, 0);
+    psi_set_version(buffer, version);
     psi_set_current(buffer);
     psi_set_section(buffer, 0);
     psi_set_lastsection(buffer, 3);
@@ -217,15 +181,22 @@ int main(int argc, char *argv[])
     eitn_set_desclength(eit_event, 0);
     psi_set_crc(buffer);
     uref_block_unmap(uref, 0);
-    upipe_input(upipe_ts_eitd, uref, NULL);
+    return uref;
+}
 
-    uref = uref_block_alloc(uref_mgr, ubuf_mgr,
-                            EIT_HEADER_SIZE + EIT_EVENT_SIZE +
-                            DESC4D_HEADER_SIZE +
-                            strlen("meuh") + 1 + strlen("coin") + 1 +
-                            PSI_CRC_SIZE);
+/** build the last section of the EIT */
+static struct uref *build_eit_last(struct uref_mgr *uref_mgr,
+                                   struct ubuf_mgr *ubuf_mgr,
+                                   uint8_t version)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+            EIT_HEADER_SIZE + EIT_EVENT_SIZE +
+            DESC4D_HEADER_SIZE +
+            strlen("meuh") + 1 + strlen("coin") + 1 +
+            PSI_CRC_SIZE);
     assert(uref != NULL);
-    size = -1;
+    uint8_t *buffer, *eit_event;
+    int size = -1;
     ubase_assert(uref_block_write(uref, 0, &size, &buffer));
     assert(size == EIT_HEADER_SIZE + EIT_EVENT_SIZE + DESC4D_HEADER_SIZE +
            strlen("meuh") + 1 + strlen("coin") + 1 + PSI_CRC_SIZE);
@@ -237,7 +208,7 @@ int main(int argc, char *argv[])
     eit_set_onid(buffer, onid);
     eit_set_segment_last_sec_number(buffer, 3);
     eit_set_last_table_id(buffer, EIT_TABLE_ID_PF_ACTUAL);
-    psi_set_version(buffer, 0);
+    psi_set_version(buffer, version);
     psi_set_current(buffer);
     psi_set_section(buffer, 3);
     psi_set_lastsection(buffer, 3);
@@ -258,10 +229,85 @@ int main(int argc, char *argv[])
     desc4d_set_length(desc);
     psi_set_crc(buffer);
     uref_block_unmap(uref, 0);
+    return uref;
+}
+
+int main(int argc, char *argv[])
+{
+    setenv("TZ", "UTC", 1);
+    tzset();
+
+    struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
+    assert(umem_mgr != NULL);
+    struct udict_mgr *udict_mgr = udict_inline_mgr_alloc(UDICT_POOL_DEPTH,
+                                                         umem_mgr, -1, -1);
+    assert(udict_mgr != NULL);
+    struct uref_mgr *uref_mgr = uref_std_mgr_alloc(UREF_POOL_DEPTH, udict_mgr,
+                                                   0);
+    assert(uref_mgr != NULL);
+    struct ubuf_mgr *ubuf_mgr = ubuf_block_mem_mgr_alloc(UBUF_POOL_DEPTH,
+                                                         UBUF_POOL_DEPTH,
+                                                         umem_mgr, 0, 0, -1, 0);
+    assert(ubuf_mgr != NULL);
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch, NULL);
+    struct uprobe *uprobe_stdio = uprobe_stdio_alloc(&uprobe, stdout,
+                                                     UPROBE_LOG_LEVEL);
+    assert(uprobe_stdio != NULL);
+    uprobe_stdio = uprobe_ubuf_mem_alloc(uprobe_stdio, umem_mgr,
+                                         UBUF_POOL_DEPTH, UBUF_POOL_DEPTH);
+    assert(uprobe_stdio != NULL);
+
+    struct uref *uref;
+    uref = uref_block_flow_alloc_def(uref_mgr, "mpegtspsi.mpegtseit.");
+    assert(uref != NULL);
+
+    struct upipe_mgr *upipe_ts_eitd_mgr = upipe_ts_eitd_mgr_alloc();
+    assert(upipe_ts_eitd_mgr != NULL);
+    struct upipe *upipe_ts_eitd = upipe_void_alloc(upipe_ts_eitd_mgr,
+            uprobe_pfx_alloc(uprobe_use(uprobe_stdio), UPROBE_LOG_LEVEL,
+                             "ts eitd"));
+    assert(upipe_ts_eitd != NULL);
+    ubase_assert(upipe_set_flow_def(upipe_ts_eitd, uref));
+    uref_free(uref);
+
+    uref = build_eit_first(uref_mgr, ubuf_mgr, 0);
+    upipe_input(upipe_ts_eitd, uref, NULL);
+
+    uref = build_eit_last(uref_mgr, ubuf_mgr, 0);
     complete = true;
     upipe_input(upipe_ts_eitd, uref, NULL);
     assert(!complete);
 
+    uint64_t hits, misses;
+    ubase_assert(upipe_ts_eitd_get_cache_stats(upipe_ts_eitd,
+                                               &hits, &misses));
+    assert(hits == 0);
+    assert(misses == 2);
+
+    /* repetitions of the current EIT are caught by the section cache */
+    for (int i = 0; i < 3; i++) {
+        upipe_input(upipe_ts_eitd, build_eit_first(uref_mgr, ubuf_mgr, 0),
+                    NULL);
+        upipe_input(upipe_ts_eitd, build_eit_last(uref_mgr, ubuf_mgr, 0),
+                    NULL);
+    }
+    ubase_assert(upipe_ts_eitd_get_cache_stats(upipe_ts_eitd,
+                                               &hits, &misses));
+    assert(hits == 6);
+    assert(misses == 2);
+
+    /* changed sections miss the cache and replace the table */
+    complete = true;
+    upipe_input(upipe_ts_eitd, build_eit_first(uref_mgr, ubuf_mgr, 1), NULL);
+    upipe_input(upipe_ts_eitd, build_eit_last(uref_mgr, ubuf_mgr, 1), NULL);
+    complete = false;
+    upipe_input(upipe_ts_eitd, build_eit_first(uref_mgr, ubuf_mgr, 1), NULL);
+    ubase_assert(upipe_ts_eitd_get_cache_stats(upipe_ts_eitd,
+                                               &hits, &misses));
+    assert(hits == 7);
+    assert(misses == 4);
+
     upipe_release(upipe_ts_eitd);
 
     upipe_mgr_release(upipe_ts_eitd_mgr); // nop
@@ -55,10 +55,12 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include <bitstream/mpeg/ts.h>
 #include <bitstream/mpeg/pes.h>
+#include <bitstream/mpeg/psi.h>
 
 #define UDICT_POOL_DEPTH 0
 #define UREF_POOL_DEPTH 0
@@ -230,6 +232,45 @@ static void check_ubuf(struct ubuf *ubuf, uint8_t stream_id, bool unitstart,
     }
 }
 
+static void check_carousel_ubuf(struct ubuf *ubuf, bool unitstart,
+                                const uint8_t *payload)
+{
+    assert(ubuf != NULL);
+    size_t size;
+    ubase_assert(ubuf_block_size(ubuf, &size));
+    assert(size == TS_SIZE);
+
+    uint8_t ts[TS_SIZE];
+    ubase_assert(ubuf_block_extract(ubuf, 0, TS_SIZE, ts));
+    assert(ts_validate(ts));
+    assert(ts_get_pid(ts) == 68);
+    assert(ts_has_payload(ts));
+    assert(!ts_has_adaptation(ts));
+    assert(ts_get_unitstart(ts) == unitstart);
+    last_cc++;
+    last_cc &= 0xf;
+    assert(ts_get_cc(ts) == last_cc);
+    assert(!memcmp(ts + TS_HEADER_SIZE, payload, TS_SIZE - TS_HEADER_SIZE));
+}
+
+static struct uref *alloc_section(struct uref_mgr *uref_mgr,
+                                  struct ubuf_mgr *ubuf_mgr,
+                                  const uint8_t *section, size_t section_size,
+                                  uint64_t cr_sys)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr, section_size);
+    assert(uref != NULL);
+    uint8_t *buffer;
+    int size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+    assert(size == section_size);
+    memcpy(buffer, section, section_size);
+    uref_block_unmap(uref, 0);
+    uref_clock_set_cr_sys(uref, cr_sys);
+    uref_block_set_start(uref);
+    return uref;
+}
+
 int main(int argc, char *argv[])
 {
     struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
@@ -622,6 +663,114 @@ int main(int argc, char *argv[])
 
     upipe_release(upipe_ts_encaps);
 
+    /* PSI carousel */
+    flow_def = uref_block_flow_alloc_def(uref_mgr, "mpegtspsi.");
+    assert(flow_def != NULL);
+    ubase_assert(uref_block_flow_set_octetrate(flow_def, 1024));
+    ubase_assert(uref_ts_flow_set_tb_rate(flow_def, 2050));
+    ubase_assert(uref_ts_flow_set_pid(flow_def, 68));
+
+    upipe_ts_encaps = upipe_void_alloc(upipe_ts_encaps_mgr,
+            uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                             "ts encaps"));
+    assert(upipe_ts_encaps != NULL);
+    ubase_assert(upipe_set_flow_def(upipe_ts_encaps, flow_def));
+    uref_free(flow_def);
+    ubase_assert(upipe_ts_encaps_set_carousel(upipe_ts_encaps, 2));
+
+    /* a 300-octet section spans two TS packets */
+    uint8_t section[300];
+    section[0] = 0x42;
+    section[1] = 0xb0;
+    psi_set_length(section, sizeof(section) - PSI_HEADER_SIZE);
+    for (i = PSI_HEADER_SIZE; i < sizeof(section) - PSI_CRC_SIZE; i++)
+        section[i] = i % 251;
+    section[sizeof(section) - 4] = 0xde;
+    section[sizeof(section) - 3] = 0xad;
+    section[sizeof(section) - 2] = 0xbe;
+    section[sizeof(section) - 1] = 0xef;
+    uint8_t expected[2 * (TS_SIZE - TS_HEADER_SIZE)];
+    memset(expected, 0xff, sizeof(expected));
+    expected[0] = 0; /* pointer_field */
+    memcpy(expected + 1, section, sizeof(section));
+
+    const uint8_t *payloads[2];
+    uint64_t cr_sys = UINT32_MAX;
+    for (int rep = 0; rep < 3; rep++) {
+        /* the section is repeated every second */
+        uref = alloc_section(uref_mgr, ubuf_mgr, section, sizeof(section),
+                             cr_sys);
+        upipe_input(upipe_ts_encaps, uref, NULL);
+        if (!rep) {
+            last_cc = 7;
+            ubase_assert(upipe_ts_mux_set_cc(upipe_ts_encaps, last_cc));
+        }
+        assert(next_ready);
+        assert(next_cr_sys <= cr_sys);
+        assert(next_cr_sys + UCLOCK_FREQ > cr_sys);
+
+        for (i = 0; i < 2; i++) {
+            ubase_assert(upipe_ts_encaps_splice(upipe_ts_encaps,
+                        next_cr_sys, next_cr_sys, &ubuf, &dts_sys));
+            check_carousel_ubuf(ubuf, !i,
+                                expected + i * (TS_SIZE - TS_HEADER_SIZE));
+
+            /* repetitions reference the payloads built the first time */
+            const uint8_t *payload;
+            size = -1;
+            ubase_assert(ubuf_block_read(ubuf, TS_HEADER_SIZE, &size,
+                                         &payload));
+            assert(size == TS_SIZE - TS_HEADER_SIZE);
+            if (!rep)
+                payloads[i] = payload;
+            else
+                assert(payload == payloads[i]);
+            ubuf_block_unmap(ubuf, TS_HEADER_SIZE);
+            ubuf_free(ubuf);
+        }
+        assert(!next_ready);
+        cr_sys += UCLOCK_FREQ;
+    }
+
+    /* a changed section gets new payloads, the CC goes on */
+    section[sizeof(section) - 1] = 0xee;
+    expected[sizeof(section)] = 0xee;
+    uref = alloc_section(uref_mgr, ubuf_mgr, section, sizeof(section), cr_sys);
+    upipe_input(upipe_ts_encaps, uref, NULL);
+    for (i = 0; i < 2; i++) {
+        ubase_assert(upipe_ts_encaps_splice(upipe_ts_encaps,
+                    next_cr_sys, next_cr_sys, &ubuf, &dts_sys));
+        check_carousel_ubuf(ubuf, !i,
+                            expected + i * (TS_SIZE - TS_HEADER_SIZE));
+        const uint8_t *payload;
+        size = -1;
+        ubase_assert(ubuf_block_read(ubuf, TS_HEADER_SIZE, &size, &payload));
+        assert(payload != payloads[i]);
+        ubuf_block_unmap(ubuf, TS_HEADER_SIZE);
+        ubuf_free(ubuf);
+    }
+    cr_sys += UCLOCK_FREQ;
+
+    /* the first section is still in the carousel */
+    section[sizeof(section) - 1] = 0xef;
+    expected[sizeof(section)] = 0xef;
+    uref = alloc_section(uref_mgr, ubuf_mgr, section, sizeof(section), cr_sys);
+    upipe_input(upipe_ts_encaps, uref, NULL);
+    for (i = 0; i < 2; i++) {
+        ubase_assert(upipe_ts_encaps_splice(upipe_ts_encaps,
+                    next_cr_sys, next_cr_sys, &ubuf, &dts_sys));
+        check_carousel_ubuf(ubuf, !i,
+                            expected + i * (TS_SIZE - TS_HEADER_SIZE));
+        const uint8_t *payload;
+        size = -1;
+        ubase_assert(ubuf_block_read(ubuf, TS_HEADER_SIZE, &size, &payload));
+        assert(payload == payloads[i]);
+        ubuf_block_unmap(ubuf, TS_HEADER_SIZE);
+        ubuf_free(ubuf);
+    }
+
+    upipe_release(upipe_ts_encaps);
+
     upipe_mgr_release(upipe_ts_encaps_mgr); // nop
 
     uref_mgr_release(uref_mgr);
@@ -123,6 +123,54 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** build a NIT section with the current parameters */
+static struct uref *build_nit(struct uref_mgr *uref_mgr,
+                              struct ubuf_mgr *ubuf_mgr, uint8_t version)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+            NIT_HEADER_SIZE + DESC40_HEADER_SIZE + strlen("meuh") +
+            NIT_HEADER2_SIZE + NIT_TS_SIZE +
+            DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE + PSI_CRC_SIZE);
+    assert(uref != NULL);
+    uint8_t *buffer, *nit_ts, *desc, *nith, *service;
+    int size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+    assert(size == NIT_HEADER_SIZE + DESC40_HEADER_SIZE + strlen("meuh") +
+                   NIT_HEADER2_SIZE + NIT_TS_SIZE +
+                   DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE + PSI_CRC_SIZE);
+    nit_init(buffer, true);
+    nit_set_length(buffer, DESC40_HEADER_SIZE + strlen("meuh") +
+                           NIT_HEADER2_SIZE + NIT_TS_SIZE +
+                           DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE);
+    nit_set_nid(buffer, nid);
+    psi_set_version(buffer, version);
+    psi_set_current(buffer);
+    psi_set_section(buffer, 0);
+    psi_set_lastsection(buffer, 0);
+    nit_set_desclength(buffer, DESC40_HEADER_SIZE + strlen("meuh"));
+    desc = descs_get_desc(nit_get_descs(buffer), 0);
+    desc40_init(desc);
+    desc40_set_networkname(desc, (uint8_t *)"meuh", strlen("meuh"));
+    nith = nit_get_header2(buffer);
+    nith_init(nith);
+    nith_set_tslength(nith, NIT_TS_SIZE +
+                            DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE);
+    nit_ts = nit_get_ts(buffer, 0);
+    nitn_init(nit_ts);
+    nitn_set_tsid(nit_ts, tsid);
+    nitn_set_onid(nit_ts, onid);
+    nitn_set_desclength(nit_ts, DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE);
+    desc = descs_get_desc(nitn_get_descs(nit_ts), 0);
+    desc41_init(desc);
+    desc_set_length(desc, DESC41_SERVICE_SIZE);
+    service = desc41_get_service(desc, 0);
+    desc41n_set_sid(service, sid);
+    desc41n_set_type(service, type);
+    psi_set_crc(buffer);
+    uref_block_unmap(uref, 0);
+    return uref;
+}
+
 int main(int argc, char *argv[])
 {
     setenv("TZ", "UTC", 1);
@@ -162,53 +210,34 @@ int main(int argc, char *argv[])
     ubase_assert(upipe_set_flow_def(upipe_ts_nitd, uref));
     uref_free(uref);
 
-    uint8_t *buffer, *nit_ts, *desc, *nith, *service;
-    int size;
-
-    uref = uref_block_alloc(uref_mgr, ubuf_mgr,
-                            NIT_HEADER_SIZE + DESC40_HEADER_SIZE +
-                            strlen("meuh") + NIT_HEADER2_SIZE + NIT_TS_SIZE +
-                            DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE +
-                            PSI_CRC_SIZE);
-    assert(uref != NULL);
-    size = -1;
-    ubase_assert(uref_block_write(uref, 0, &size, &buffer));
-    assert(size == NIT_HEADER_SIZE + DESC40_HEADER_SIZE + strlen("meuh") +
-                   NIT_HEADER2_SIZE + NIT_TS_SIZE +
-                   DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE + PSI_CRC_SIZE);
-    nit_init(buffer, true);
-    nit_set_length(buffer, DESC40_HEADER_SIZE + strlen("meuh") +
-                           NIT_HEADER2_SIZE + NIT_TS_SIZE +
-                           DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE);
-    nit_set_nid(buffer, nid);
-    psi_set_version(buffer, 0);
-    psi_set_current(buffer);
-    psi_set_section(buffer, 0);
-    psi_set_lastsection(buffer, 0);
-    nit_set_desclength(buffer, DESC40_HEADER_SIZE + strlen("meuh"));
-    desc = descs_get_desc(nit_get_descs(buffer), 0);
-    desc40_init(desc);
-    desc40_set_networkname(desc, (uint8_t *)"meuh", strlen("meuh"));
-    nith = nit_get_header2(buffer);
-    nith_init(nith);
-    nith_set_tslength(nith, NIT_TS_SIZE +
-                            DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE);
-    nit_ts = nit_get_ts(buffer, 0);
-    nitn_init(nit_ts);
-    nitn_set_tsid(nit_ts, tsid);
-    nitn_set_onid(nit_ts, onid);
-    nitn_set_desclength(nit_ts, DESC41_HEADER_SIZE + DESC41_SERVICE_SIZE);
-    desc = descs_get_desc(nitn_get_descs(nit_ts), 0);
-    desc41_init(desc);
-    desc_set_length(desc, DESC41_SERVICE_SIZE);
-    service = desc41_get_service(desc, 0);
-    desc41n_set_sid(service, sid);
-    desc41n_set_type(service, type);
-    psi_set_crc(buffer);
-    uref_block_unmap(uref, 0);
+    uref = build_nit(uref_mgr, ubuf_mgr, 0);
     upipe_input(upipe_ts_nitd, uref, NULL);
     assert(!complete);
 
+    uint64_t hits, misses;
+    ubase_assert(upipe_ts_nitd_get_cache_stats(upipe_ts_nitd,
+                                               &hits, &misses));
+    assert(hits == 0);
+    assert(misses == 1);
+
+    /* repetitions of the current NIT are caught by the section cache */
+    for (int i = 0; i < 3; i++)
+        upipe_input(upipe_ts_nitd, build_nit(uref_mgr, ubuf_mgr, 0), NULL);
+    ubase_assert(upipe_ts_nitd_get_cache_stats(upipe_ts_nitd,
+                                               &hits, &misses));
+    assert(hits == 3);
+    assert(misses == 1);
+
+    /* a changed section misses the cache and is parsed */
+    type = 2;
+    complete = true;
+    upipe_input(upipe_ts_nitd, build_nit(uref_mgr, ubuf_mgr, 1), NULL);
+    assert(!complete);
+    ubase_assert(upipe_ts_nitd_get_cache_stats(upipe_ts_nitd,
+                                               &hits, &misses));
+    assert(hits == 3);
+    assert(misses == 2);
+
     upipe_release(upipe_ts_nitd);
 
     upipe_mgr_release(upipe_ts_nitd_mgr); // nop
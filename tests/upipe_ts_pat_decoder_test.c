@@ -363,6 +363,76 @@ int main(int argc, char *argv[])
     assert(!program_sum);
     assert(!pid_sum);
 
+    uint64_t hits, misses, prev_hits, prev_misses;
+    ubase_assert(upipe_ts_patd_get_cache_stats(upipe_ts_patd,
+                                               &prev_hits, &prev_misses));
+
+    /* repetitions of the current PAT are caught by the section cache */
+    for (int i = 0; i < 3; i++) {
+        uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                                PAT_HEADER_SIZE + PAT_PROGRAM_SIZE * 2 +
+                                PSI_CRC_SIZE);
+        assert(uref != NULL);
+        size = -1;
+        ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+        pat_init(buffer);
+        pat_set_length(buffer, PAT_PROGRAM_SIZE * 2);
+        pat_set_tsid(buffer, tsid);
+        psi_set_version(buffer, 5);
+        psi_set_current(buffer);
+        psi_set_section(buffer, 0);
+        psi_set_lastsection(buffer, 0);
+        pat_program = pat_get_program(buffer, 0);
+        patn_init(pat_program);
+        patn_set_program(pat_program, 13);
+        patn_set_pid(pat_program, 43);
+        pat_program = pat_get_program(buffer, 1);
+        patn_init(pat_program);
+        patn_set_program(pat_program, 14);
+        patn_set_pid(pat_program, 44);
+        psi_set_crc(buffer);
+        uref_block_unmap(uref, 0);
+        systime = UINT32_MAX;
+        uref_clock_set_cr_sys(uref, systime);
+        upipe_input(upipe_ts_patd, uref, NULL);
+        assert(!systime);
+        assert(!program_sum);
+        assert(!pid_sum);
+    }
+    ubase_assert(upipe_ts_patd_get_cache_stats(upipe_ts_patd,
+                                               &hits, &misses));
+    assert(hits == prev_hits + 3);
+    assert(misses == prev_misses);
+
+    /* a changed section misses the cache and is parsed */
+    uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                            PAT_HEADER_SIZE + PAT_PROGRAM_SIZE + PSI_CRC_SIZE);
+    assert(uref != NULL);
+    size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+    pat_init(buffer);
+    pat_set_length(buffer, PAT_PROGRAM_SIZE);
+    pat_set_tsid(buffer, tsid);
+    psi_set_version(buffer, 6);
+    psi_set_current(buffer);
+    psi_set_section(buffer, 0);
+    psi_set_lastsection(buffer, 0);
+    pat_program = pat_get_program(buffer, 0);
+    patn_init(pat_program);
+    patn_set_program(pat_program, 15);
+    patn_set_pid(pat_program, 45);
+    psi_set_crc(buffer);
+    uref_block_unmap(uref, 0);
+    program_sum = 15;
+    pid_sum = 45;
+    upipe_input(upipe_ts_patd, uref, NULL);
+    assert(!program_sum);
+    assert(!pid_sum);
+    ubase_assert(upipe_ts_patd_get_cache_stats(upipe_ts_patd,
+                                               &prev_hits, &prev_misses));
+    assert(prev_hits == hits);
+    assert(prev_misses == misses + 1);
+
     upipe_release(upipe_ts_patd);
     assert(!program_sum);
     assert(!pid_sum);
@@ -65,6 +65,10 @@ static int end = UBASE_ERR_NONE;
 static size_t payload_size = 12;
 static bool expect_lost = false;
 static bool expect_acquired = true;
+/** true if the output must be contiguous and filled with the pattern */
+static bool expect_linear = false;
+/** value of the pattern written in payloads */
+static uint8_t pattern = 0;
 
 /** definition of our uprobe */
 static int catch(struct uprobe *uprobe, struct upipe *upipe,
@@ -120,10 +124,47 @@ static void test_input(struct upipe *upipe, struct uref *uref,
     ubase_assert(uref_block_size(uref, &size));
     assert(size == payload_size);
     assert(end == uref_block_get_end(uref));
+    if (expect_linear) {
+        const uint8_t *r;
+        int read_size = -1;
+        ubase_assert(uref_block_read(uref, 0, &read_size, &r));
+        assert(read_size == size);
+        for (int i = 0; i < read_size; i++)
+            assert(r[i] == (uint8_t)(i & 0xff));
+        uref_block_unmap(uref, 0);
+    }
     uref_free(uref);
     nb_packets--;
 }
 
+/** allocates a TS payload, optionally starting with a PES header without
+ * timestamp, and fills the rest with the pattern */
+static struct uref *alloc_payload(struct uref_mgr *uref_mgr,
+                                  struct ubuf_mgr *ubuf_mgr,
+                                  int size, bool start, uint16_t pes_length)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr, size);
+    assert(uref != NULL);
+    uint8_t *buffer;
+    int wsize = -1;
+    ubase_assert(uref_block_write(uref, 0, &wsize, &buffer));
+    assert(wsize == size);
+    int offset = 0;
+    if (start) {
+        pes_init(buffer);
+        pes_set_streamid(buffer, PES_STREAM_ID_VIDEO_MPEG);
+        pes_set_length(buffer, pes_length);
+        pes_set_headerlength(buffer, 0);
+        offset = PES_HEADER_SIZE_NOPTS;
+        uref_block_set_start(uref);
+        pattern = 0;
+    }
+    for ( ; offset < size; offset++)
+        buffer[offset] = pattern++;
+    uref_block_unmap(uref, 0);
+    return uref;
+}
+
 /** helper phony pipe */
 static int test_control(struct upipe *upipe, int command, va_list args)
 {
@@ -338,6 +379,53 @@ int main(int argc, char *argv[])
     assert(!nb_packets);
     assert(!expect_lost);
 
+    /* coalesce a bounded PES spanning several TS packets */
+    bool coalesce;
+    ubase_assert(upipe_ts_pesd_get_coalesce(upipe_ts_pesd, &coalesce));
+    assert(!coalesce);
+    ubase_assert(upipe_ts_pesd_set_coalesce(upipe_ts_pesd, true));
+    ubase_assert(upipe_ts_pesd_get_coalesce(upipe_ts_pesd, &coalesce));
+    assert(coalesce);
+    expect_linear = true;
+    payload_size = 1000;
+    end = UBASE_ERR_NONE;
+    upipe_input(upipe_ts_pesd,
+                alloc_payload(uref_mgr, ubuf_mgr, 184, true,
+                              PES_HEADER_SIZE_NOPTS - PES_HEADER_SIZE + 1000),
+                NULL);
+    int left = 1000 - (184 - PES_HEADER_SIZE_NOPTS);
+    while (left > 0) {
+        assert(!nb_packets);
+        if (left <= 184)
+            nb_packets++;
+        int chunk = left < 184 ? left : 184;
+        upipe_input(upipe_ts_pesd,
+                    alloc_payload(uref_mgr, ubuf_mgr, chunk, false, 0), NULL);
+        left -= chunk;
+    }
+    assert(!nb_packets);
+
+    /* unbounded PES are output when the next one starts, and grow past the
+     * predicted size */
+    upipe_input(upipe_ts_pesd,
+                alloc_payload(uref_mgr, ubuf_mgr, 184, true, 0), NULL);
+    for (int i = 0; i < 100; i++)
+        upipe_input(upipe_ts_pesd,
+                    alloc_payload(uref_mgr, ubuf_mgr, 184, false, 0), NULL);
+    payload_size = 184 - PES_HEADER_SIZE_NOPTS + 100 * 184;
+    end = UBASE_ERR_INVALID;
+    nb_packets++;
+    upipe_input(upipe_ts_pesd,
+                alloc_payload(uref_mgr, ubuf_mgr, 184, true, 0), NULL);
+    assert(!nb_packets);
+
+    /* disabling coalescing outputs the pending PES */
+    payload_size = 184 - PES_HEADER_SIZE_NOPTS;
+    nb_packets++;
+    ubase_assert(upipe_ts_pesd_set_coalesce(upipe_ts_pesd, false));
+    assert(!nb_packets);
+    expect_linear = false;
+
     upipe_release(upipe_ts_pesd);
     upipe_mgr_release(upipe_ts_pesd_mgr); // nop
 
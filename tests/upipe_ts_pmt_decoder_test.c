@@ -422,6 +422,84 @@ int main(int argc, char *argv[])
     assert(!desc_size_sum);
     assert(!systime);
 
+    uint64_t hits, misses, prev_hits, prev_misses;
+    ubase_assert(upipe_ts_pmtd_get_cache_stats(upipe_ts_pmtd,
+                                               &prev_hits, &prev_misses));
+
+    /* repetitions of the current PMT are caught by the section cache */
+    for (int i = 0; i < 3; i++) {
+        pcrpid = 143;
+        uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                                PMT_HEADER_SIZE + 2 * PMT_ES_SIZE +
+                                PSI_CRC_SIZE);
+        assert(uref != NULL);
+        size = -1;
+        ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+        pmt_init(buffer);
+        pmt_set_length(buffer, 2 * PMT_ES_SIZE);
+        pmt_set_program(buffer, program);
+        psi_set_version(buffer, 3);
+        psi_set_current(buffer);
+        pmt_set_pcrpid(buffer, pcrpid);
+        pmt_set_desclength(buffer, 0);
+        pmt_es = pmt_get_es(buffer, 0);
+        pmtn_init(pmt_es);
+        pmtn_set_pid(pmt_es, 12);
+        pmtn_set_streamtype(pmt_es, PMT_STREAMTYPE_VIDEO_MPEG2);
+        pmtn_set_desclength(pmt_es, 0);
+        pmt_es = pmt_get_es(buffer, 1);
+        pmtn_init(pmt_es);
+        pmtn_set_pid(pmt_es, 14);
+        pmtn_set_streamtype(pmt_es, PMT_STREAMTYPE_AUDIO_ADTS);
+        pmtn_set_desclength(pmt_es, 0);
+        psi_set_crc(buffer);
+        uref_block_unmap(uref, 0);
+        systime = 7 * UINT32_MAX;
+        uref_clock_set_cr_sys(uref, systime);
+        upipe_input(upipe_ts_pmtd, uref, NULL);
+        assert(pcrpid == 143);
+        assert(!pid_sum);
+        assert(!systime);
+    }
+    ubase_assert(upipe_ts_pmtd_get_cache_stats(upipe_ts_pmtd,
+                                               &hits, &misses));
+    assert(hits == prev_hits + 3);
+    assert(misses == prev_misses);
+
+    /* a changed section misses the cache and is parsed */
+    pcrpid = 143;
+    uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                            PMT_HEADER_SIZE + PMT_ES_SIZE + PSI_CRC_SIZE);
+    assert(uref != NULL);
+    size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+    pmt_init(buffer);
+    pmt_set_length(buffer, PMT_ES_SIZE);
+    pmt_set_program(buffer, program);
+    psi_set_version(buffer, 4);
+    psi_set_current(buffer);
+    pmt_set_pcrpid(buffer, pcrpid);
+    pmt_set_desclength(buffer, 0);
+    pmt_es = pmt_get_es(buffer, 0);
+    pmtn_init(pmt_es);
+    pmtn_set_pid(pmt_es, 15);
+    pmtn_set_streamtype(pmt_es, PMT_STREAMTYPE_AUDIO_MPEG2);
+    pmtn_set_desclength(pmt_es, 0);
+    psi_set_crc(buffer);
+    uref_block_unmap(uref, 0);
+    pid_sum = 15;
+    desc_size_sum = 0;
+    systime = 8 * UINT32_MAX;
+    uref_clock_set_cr_sys(uref, systime);
+    upipe_input(upipe_ts_pmtd, uref, NULL);
+    assert(!pid_sum);
+    assert(!desc_size_sum);
+    assert(!systime);
+    ubase_assert(upipe_ts_pmtd_get_cache_stats(upipe_ts_pmtd,
+                                               &prev_hits, &prev_misses));
+    assert(prev_hits == hits);
+    assert(prev_misses == misses + 1);
+
     upipe_release(upipe_ts_pmtd);
     assert(!pid_sum);
     assert(!desc_size_sum);
@@ -130,6 +130,38 @@ static int catch(struct uprobe *uprobe, struct upipe *upipe,
     return UBASE_ERR_NONE;
 }
 
+/** build an SDT section with a single service and no descriptor */
+static struct uref *build_sdt(struct uref_mgr *uref_mgr,
+                              struct ubuf_mgr *ubuf_mgr, uint8_t version,
+                              uint8_t section, uint8_t last_section,
+                              uint16_t sid)
+{
+    struct uref *uref = uref_block_alloc(uref_mgr, ubuf_mgr,
+                                         SDT_HEADER_SIZE + SDT_SERVICE_SIZE +
+                                         PSI_CRC_SIZE);
+    assert(uref != NULL);
+    uint8_t *buffer;
+    int size = -1;
+    ubase_assert(uref_block_write(uref, 0, &size, &buffer));
+    assert(size == SDT_HEADER_SIZE + SDT_SERVICE_SIZE + PSI_CRC_SIZE);
+    sdt_init(buffer, true);
+    sdt_set_length(buffer, SDT_SERVICE_SIZE);
+    sdt_set_tsid(buffer, tsid);
+    sdt_set_onid(buffer, onid);
+    psi_set_version(buffer, version);
+    psi_set_current(buffer);
+    psi_set_section(buffer, section);
+    psi_set_lastsection(buffer, last_section);
+    uint8_t *sdt_service = sdt_get_service(buffer, 0);
+    sdtn_init(sdt_service);
+    sdtn_set_sid(sdt_service, sid);
+    sdtn_set_running(sdt_service, 4);
+    sdtn_set_desclength(sdt_service, 0);
+    psi_set_crc(buffer);
+    uref_block_unmap(uref, 0);
+    return uref;
+}
+
 int main(int argc, char *argv[])
 {
     struct umem_mgr *umem_mgr = umem_alloc_mgr_alloc();
@@ -320,6 +352,61 @@ int main(int argc, char *argv[])
     assert(provider_sum == string_to_sum("meuh") + string_to_sum("coin"));
     assert(service_sum == string_to_sum("coin") + string_to_sum("meuh"));
 
+    uint64_t hits, misses, prev_hits, prev_misses;
+    ubase_assert(upipe_ts_sdtd_get_cache_stats(upipe_ts_sdtd,
+                                               &prev_hits, &prev_misses));
+
+    /* two-section table */
+    sid_sum = 0;
+    upipe_input(upipe_ts_sdtd, build_sdt(uref_mgr, ubuf_mgr, 3, 0, 1, 15),
+                NULL);
+    assert(sid_sum == 0);
+    upipe_input(upipe_ts_sdtd, build_sdt(uref_mgr, ubuf_mgr, 3, 1, 1, 16),
+                NULL);
+    assert(sid_sum == 15 + 16);
+    ubase_assert(upipe_ts_sdtd_get_cache_stats(upipe_ts_sdtd,
+                                               &hits, &misses));
+    assert(hits == prev_hits);
+    assert(misses == prev_misses + 2);
+
+    /* repetitions of the current SDT are caught by the section cache */
+    sid_sum = 0;
+    for (int i = 0; i < 3; i++) {
+        upipe_input(upipe_ts_sdtd,
+                    build_sdt(uref_mgr, ubuf_mgr, 3, 0, 1, 15), NULL);
+        upipe_input(upipe_ts_sdtd,
+                    build_sdt(uref_mgr, ubuf_mgr, 3, 1, 1, 16), NULL);
+    }
+    assert(sid_sum == 0);
+    ubase_assert(upipe_ts_sdtd_get_cache_stats(upipe_ts_sdtd,
+                                               &prev_hits, &prev_misses));
+    assert(prev_hits == hits + 6);
+    assert(prev_misses == misses);
+
+    /* while a new version is gathered, known sections are not dropped */
+    upipe_input(upipe_ts_sdtd, build_sdt(uref_mgr, ubuf_mgr, 4, 0, 1, 17),
+                NULL);
+    upipe_input(upipe_ts_sdtd, build_sdt(uref_mgr, ubuf_mgr, 3, 1, 1, 16),
+                NULL);
+    assert(sid_sum == 0);
+    upipe_input(upipe_ts_sdtd, build_sdt(uref_mgr, ubuf_mgr, 4, 1, 1, 18),
+                NULL);
+    assert(sid_sum == 17 + 18);
+    ubase_assert(upipe_ts_sdtd_get_cache_stats(upipe_ts_sdtd,
+                                               &hits, &misses));
+    assert(hits == prev_hits + 1);
+    assert(misses == prev_misses + 2);
+
+    /* the new version is now cached */
+    sid_sum = 0;
+    upipe_input(upipe_ts_sdtd, build_sdt(uref_mgr, ubuf_mgr, 4, 0, 1, 17),
+                NULL);
+    assert(sid_sum == 0);
+    ubase_assert(upipe_ts_sdtd_get_cache_stats(upipe_ts_sdtd,
+                                               &prev_hits, &prev_misses));
+    assert(prev_hits == hits + 1);
+    assert(prev_misses == misses);
+
     upipe_release(upipe_ts_sdtd);
 
     upipe_mgr_release(upipe_ts_sdtd_mgr); // nop
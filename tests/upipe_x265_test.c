@@ -46,8 +46,11 @@
 #include "upipe/uref_clock.h"
 #include "upipe/uref_pic.h"
 #include "upipe/uref_pic_flow.h"
+#include "upipe/upump.h"
+#include "upipe/uprobe_upump_mgr.h"
 #include "upipe/upipe.h"
 #include "upipe/upipe_helper_upipe.h"
+#include "upump-ev/upump_ev.h"
 
 #include "upipe-x265/upipe_x265.h"
 
@@ -55,6 +58,8 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#define UPUMP_POOL          0
+#define UPUMP_BLOCKER_POOL  0
 #define UDICT_POOL_DEPTH    0
 #define UREF_POOL_DEPTH     0
 #define UBUF_POOL_DEPTH     0
@@ -244,7 +249,6 @@ int main(int argc, char **argv)
                                      "x265"));
     assert(x265);
     ubase_assert(upipe_set_flow_def(x265, flow_def));
-    uref_free(flow_def);
 
     /* x265_test */
     struct upipe *x265_test = upipe_void_alloc(&x265_test_mgr,
@@ -277,7 +281,48 @@ int main(int argc, char **argv)
 
     /* release pipes */
     upipe_release(x265);
+    assert(x265_test_from_upipe(x265_test)->counter == LIMIT);
+    test_free(x265_test);
+
+    /* asynchronous encoding test */
+    struct upump_mgr *upump_mgr = upump_ev_mgr_alloc_default(UPUMP_POOL,
+            UPUMP_BLOCKER_POOL);
+    assert(upump_mgr != NULL);
+    logger = uprobe_upump_mgr_alloc(logger, upump_mgr);
+    assert(logger != NULL);
+
+    x265 = upipe_void_alloc(upipe_x265_mgr,
+                    uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                     "x265 async"));
+    assert(x265);
+    ubase_assert(upipe_set_flow_def(x265, flow_def));
+    uref_free(flow_def);
+    x265_test = upipe_void_alloc(&x265_test_mgr,
+                    uprobe_pfx_alloc(uprobe_use(logger), UPROBE_LOG_LEVEL,
+                                     "x265_test async"));
+    ubase_assert(upipe_set_output(x265, x265_test));
+    ubase_assert(upipe_x265_set_async(x265, 4));
+    /* disable assembly (not valgrind safe) */
+    ubase_assert(upipe_set_option(x265, "asm", "0"));
+
+    /* frames beyond the queue depth are held until the encoder thread
+     * catches up, and the pipe only dies once they are all output */
+    for (counter = 0; counter < LIMIT; counter ++) {
+        printf("Sending pic %d\n", counter);
+        pic = uref_pic_alloc(uref_mgr, pic_mgr, WIDTH, HEIGHT);
+        assert(pic);
+        fill_pic(pic, counter);
+        pts = counter + 42;
+        uref_clock_set_pts_orig(pic, pts);
+        uref_clock_set_pts_prog(pic, pts * UCLOCK_FREQ + UINT32_MAX);
+        upipe_input(x265, pic, NULL);
+    }
+
+    upipe_release(x265);
+    upump_mgr_run(upump_mgr, NULL);
+    assert(x265_test_from_upipe(x265_test)->counter == LIMIT);
     test_free(x265_test);
+    upump_mgr_release(upump_mgr);
 
     /* clean everything */
     upipe_mgr_release(upipe_x265_mgr);
@@ -30,14 +30,96 @@
 #undef NDEBUG
 
 #include "upump-ev/upump_ev.h"
+#include "upipe/uclock.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
 
 #include "upump_common_test.h"
 
 #define UPUMP_POOL 1
 #define UPUMP_BLOCKER_POOL 1
+#define TICKS 10
+#define PERIOD (UCLOCK_FREQ / 100)
+
+static struct upump *stats_timer = NULL;
+static unsigned int ticks = 0;
+static unsigned int stats_events = 0;
+
+static void stats_timer_cb(struct upump *upump)
+{
+    if (++ticks >= TICKS)
+        upump_stop(upump);
+}
+
+static int catch_stats(struct uprobe *uprobe, struct upipe *upipe,
+                       int event, va_list args)
+{
+    assert(event == UPROBE_UPUMP_EV_STATS);
+    assert(upipe == NULL);
+    unsigned int signature = va_arg(args, unsigned int);
+    assert(signature == UPUMP_EV_SIGNATURE);
+    struct upump_mgr *mgr = va_arg(args, struct upump_mgr *);
+    assert(mgr != NULL);
+    const struct upump_ev_stats *stats =
+        va_arg(args, const struct upump_ev_stats *);
+    assert(stats != NULL);
+    stats_events++;
+    return UBASE_ERR_NONE;
+}
+
+static void test_stats(struct upump_mgr *mgr)
+{
+    struct uprobe uprobe;
+    uprobe_init(&uprobe, catch_stats, NULL);
+
+    ubase_assert(upump_ev_mgr_set_stats(mgr, true));
+    stats_timer = upump_alloc_timer(mgr, stats_timer_cb, NULL, NULL,
+                                    PERIOD, PERIOD);
+    assert(stats_timer != NULL);
+    upump_start(stats_timer);
+    ubase_assert(upump_mgr_run(mgr, NULL));
+    assert(ticks == TICKS);
+
+    struct upump_ev_stats stats;
+    ubase_assert(upump_ev_get_stats(stats_timer, &stats));
+    assert(stats.dispatched == TICKS);
+    uint64_t run = 0, late = 0;
+    for (int i = 0; i < UPUMP_EV_STATS_BUCKETS; i++) {
+        run += stats.run[i];
+        late += stats.late[i];
+    }
+    assert(run == TICKS);
+    assert(late == TICKS);
+
+    ubase_assert(upump_ev_mgr_get_stats(mgr, &stats));
+    assert(stats.dispatched == TICKS);
+    printf("loop: %"PRIu64" callbacks, max run %"PRIu64" us, "
+           "max late %"PRIu64" us\n",
+           stats.dispatched, stats.run_max, stats.late_max);
+    ubase_assert(upump_ev_mgr_reset_stats(mgr));
+    ubase_assert(upump_ev_mgr_get_stats(mgr, &stats));
+    assert(stats.dispatched == 0);
+
+    /* periodic events while the timer is running */
+    ticks = 0;
+    ubase_assert(upump_ev_mgr_set_stats_probe(mgr, uprobe_use(&uprobe),
+                                              PERIOD * 3));
+    upump_start(stats_timer);
+    ubase_assert(upump_mgr_run(mgr, NULL));
+    assert(ticks == TICKS);
+    assert(stats_events >= 2);
+    ubase_assert(upump_ev_mgr_set_stats_probe(mgr, NULL, 0));
+
+    upump_free(stats_timer);
+    upump_mgr_release(mgr);
+    uprobe_clean(&uprobe);
+}
 
 int main(int argc, char **argv)
 {
     run(upump_ev_mgr_alloc_default(UPUMP_POOL, UPUMP_BLOCKER_POOL));
+    test_stats(upump_ev_mgr_alloc_loop(UPUMP_POOL, UPUMP_BLOCKER_POOL));
     return 0;
 }
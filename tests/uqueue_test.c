@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2026 OpenHeadend S.A.R.L.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** @file
+ * @short multi-producer stress test for uqueue
+ *
+ * The consumer only pops after the pop event has fired, like a upump
+ * watcher would, so a lost wake-up shows up as a poll timeout. The race
+ * between two producers is also replayed step by step, since it is
+ * hard to hit on a single core.
+ */
+
+#undef NDEBUG
+
+#include "upipe/ubase.h"
+#include "upipe/uqueue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <assert.h>
+
+#define UQUEUE_LENGTH 16
+#define NB_PRODUCERS 4
+#define NB_ELEMS 50000
+/** time after which a missing wake-up is considered lost, in ms */
+#define WAKEUP_TIMEOUT 5000
+
+static struct uqueue uqueue;
+static uint8_t uqueue_extra[uqueue_sizeof(UQUEUE_LENGTH)];
+static uint32_t elems[NB_PRODUCERS][NB_ELEMS];
+
+/** returns the file descriptor to poll for the given ueventfd */
+static int ueventfd_poll_fd(struct ueventfd *fd)
+{
+    return fd->mode == UEVENTFD_MODE_EVENTFD ? fd->event_fd :
+                                               fd->pipe_fds[0];
+}
+
+/** waits until the given ueventfd is readable */
+static void wait_event(struct ueventfd *fd)
+{
+    struct pollfd pfd;
+    pfd.fd = ueventfd_poll_fd(fd);
+    pfd.events = POLLIN;
+    int ret = poll(&pfd, 1, WAKEUP_TIMEOUT);
+    assert(ret == 1);
+}
+
+/** returns true if the given ueventfd is readable */
+static bool check_event(struct ueventfd *fd)
+{
+    struct pollfd pfd;
+    pfd.fd = ueventfd_poll_fd(fd);
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/** interleaves two pushes by hand so that the second one completes while
+ * the first one has claimed its cell but not stored it yet */
+static void test_interleaved(void)
+{
+    uint32_t first = 1, second = 2;
+
+    /* first push: reserve and claim the cell, as uqueue_store does */
+    assert(uqueue_reserve(&uqueue));
+    uint32_t pos = uatomic_fetch_add(&uqueue.push_pos, 1);
+    struct uqueue_cell *cell = &uqueue.cells[pos & uqueue.mask];
+
+    /* second push completes and signals the consumer */
+    assert(uqueue_push(&uqueue, &second));
+    assert(check_event(&uqueue.event_pop));
+
+    /* the head of the queue is not ready yet */
+    assert(uqueue_pop(&uqueue, uint32_t *) == NULL);
+    /* the consumer must be woken up again */
+    assert(check_event(&uqueue.event_pop));
+
+    /* first push completes, without signalling since counter != 0 */
+    cell->element = &first;
+    uatomic_store(&cell->seq, pos + 1);
+    assert(uatomic_fetch_add(&uqueue.counter, 1) != 0);
+
+    assert(uqueue_pop(&uqueue, uint32_t *) == &first);
+    assert(uqueue_pop(&uqueue, uint32_t *) == &second);
+    assert(uqueue_pop(&uqueue, uint32_t *) == NULL);
+    assert(!check_event(&uqueue.event_pop));
+}
+
+static void *producer(void *_id)
+{
+    unsigned int id = (uintptr_t)_id;
+    for (unsigned int i = 0; i < NB_ELEMS; i++) {
+        elems[id][i] = (id << 24) | i;
+        while (!uqueue_push(&uqueue, &elems[id][i]))
+            wait_event(&uqueue.event_push);
+        if (!(i % 7))
+            sched_yield();
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    assert(uqueue_init(&uqueue, UQUEUE_LENGTH, uqueue_extra));
+    test_interleaved();
+
+    pthread_t threads[NB_PRODUCERS];
+    for (unsigned int i = 0; i < NB_PRODUCERS; i++)
+        assert(pthread_create(&threads[i], NULL, producer,
+                              (void *)(uintptr_t)i) == 0);
+
+    uint32_t next[NB_PRODUCERS] = { 0 };
+    unsigned int received = 0;
+    unsigned int spurious = 0;
+    while (received < NB_PRODUCERS * NB_ELEMS) {
+        wait_event(&uqueue.event_pop);
+
+        uint32_t *elem;
+        unsigned int popped = 0;
+        while ((elem = uqueue_pop(&uqueue, uint32_t *)) != NULL) {
+            unsigned int id = *elem >> 24;
+            assert(id < NB_PRODUCERS);
+            /* each producer's elements come out in order */
+            assert((*elem & 0xffffff) == next[id]);
+            next[id]++;
+            received++;
+            popped++;
+        }
+        if (!popped)
+            spurious++;
+    }
+
+    for (unsigned int i = 0; i < NB_PRODUCERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+        assert(next[i] == NB_ELEMS);
+    }
+    assert(uqueue_length(&uqueue) == 0);
+    assert(uqueue_pop(&uqueue, uint32_t *) == NULL);
+    printf("received %u elements, %u empty wake-ups\n", received, spurious);
+
+    uqueue_clean(&uqueue);
+    return 0;
+}